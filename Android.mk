@@ -44,6 +44,28 @@ ifeq ($(KERNELFLINGER_SL_BIND_ROOT_TRUST), true)
     KERNELFLINGER_CFLAGS += -DUSE_SILENTLAKE
 endif
 
+ifeq ($(KERNELFLINGER_USB_SUPERSPEED),true)
+    KERNELFLINGER_CFLAGS += -DUSB_SUPERSPEED
+endif
+
+# Boot medium of the product, one of emmc, ufs, sdcard, sata or nvme:
+# only that storage backend is compiled in, the others are not probed.
+KERNELFLINGER_STORAGE_TYPES := emmc:EMMC ufs:UFS sdcard:SDCARD sata:SATA nvme:NVME
+ifneq ($(strip $(KERNELFLINGER_STORAGE)),)
+    storage_type := $(patsubst $(strip $(KERNELFLINGER_STORAGE)):%,%,\
+        $(filter $(strip $(KERNELFLINGER_STORAGE)):%,$(KERNELFLINGER_STORAGE_TYPES)))
+    ifeq ($(storage_type),)
+        $(error Unsupported KERNELFLINGER_STORAGE $(KERNELFLINGER_STORAGE))
+    endif
+    KERNELFLINGER_CFLAGS += -DSTORAGE_ONLY=STORAGE_$(storage_type)
+endif
+
+# Highest log level compiled in per subsystem, for instance
+# KERNELFLINGER_LOG_LEVEL_STORAGE := 2 to keep the verbose messages.
+$(foreach s,STORAGE TRANSPORT FASTBOOT UI SECURITY,\
+    $(if $(KERNELFLINGER_LOG_LEVEL_$(s)),\
+        $(eval KERNELFLINGER_CFLAGS += -DLOG_LEVEL_$(s)=$(KERNELFLINGER_LOG_LEVEL_$(s)))))
+
 KERNELFLINGER_STATIC_LIBRARIES := \
 	libuefi_ssl_static \
 	libuefi_crypto_static \
@@ -98,6 +120,7 @@ ifneq ($(TARGET_USE_USERFASTBOOT),true)
 	libfastboot-$(TARGET_BUILD_VARIANT) \
 	libefiusb-$(TARGET_BUILD_VARIANT) \
 	libefitcp-$(TARGET_BUILD_VARIANT) \
+	libefiudp-$(TARGET_BUILD_VARIANT) \
 	libtransport-$(TARGET_BUILD_VARIANT)
 ifneq ($(TARGET_BUILD_VARIANT),user)
     LOCAL_STATIC_LIBRARIES += libadb-$(TARGET_BUILD_VARIANT)
@@ -106,6 +129,9 @@ endif
 
 ifneq ($(TARGET_BUILD_VARIANT),user)
     LOCAL_SRC_FILES += unittest.c
+ifneq ($(TARGET_USE_USERFASTBOOT),true)
+    LOCAL_C_INCLUDES := $(addprefix $(LOCAL_PATH)/,libfastboot)
+endif
 endif
 
 LOCAL_MODULE := kernelflinger-$(TARGET_BUILD_VARIANT)
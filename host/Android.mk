@@ -0,0 +1,34 @@
+# Host build of the pure logic modules: the sparse parser, the CRC32
+# helpers, the text parser, the blobstore and the ext4 formatter, over
+# a C library shim.
+# They can then be measured, profiled or fuzzed on a workstation.
+
+LOCAL_PATH := $(call my-dir)/..
+
+include $(CLEAR_VARS)
+
+GNU_EFI_INC ?= external/gnu-efi/gnu-efi-3.0/inc
+
+LOCAL_MODULE := kernelflinger-host-bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS := -fshort-wchar -fno-builtin -Wall -Wextra -Werror \
+	-Wno-unused-parameter -Wno-pointer-sign
+LOCAL_C_INCLUDES := \
+	$(GNU_EFI_INC) \
+	$(GNU_EFI_INC)/x86_64 \
+	$(GNU_EFI_INC)/protocol \
+	$(LOCAL_PATH)/include/libkernelflinger \
+	$(LOCAL_PATH)/include/libfastboot \
+	$(LOCAL_PATH)/libfastboot \
+	$(LOCAL_PATH)/host
+LOCAL_SRC_FILES := \
+	libkernelflinger/crc32.c \
+	libkernelflinger/text_parser.c \
+	libkernelflinger/blobstore.c \
+	libfastboot/sparse.c \
+	libfastboot/mkfs.c \
+	host/efi_shim.c \
+	host/flash_shim.c \
+	host/bench.c
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* Host driver of the pure logic modules, to run them under a profiler
+   or a fuzzer and measure them without flashing a device.  */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "crc32.h"
+#include "text_parser.h"
+#include "blobstore.h"
+#include "sparse.h"
+#include "sparse_format.h"
+#include "mkfs.h"
+#include "host.h"
+
+static void report(CHAR16 *name, unsigned long long start, UINT64 bytes)
+{
+	unsigned long long ns = host_time_ns() - start;
+
+	Print(L"%s: %ld bytes in %ld us, %ld MB/s\n", name, bytes, ns / 1000,
+	      ns ? bytes * 1000 / ns : 0);
+}
+
+static int bench_crc32(void *data, UINTN size)
+{
+	unsigned long long start = host_time_ns();
+	UINT32 crc;
+
+	crc = crc32_update(0, data, size);
+	report(L"crc32", start, size);
+	Print(L"crc32 = %08x\n", crc);
+	return 0;
+}
+
+static EFI_STATUS count_line(char *line, VOID *ctx)
+{
+	(void)line;
+	(*(UINTN *)ctx)++;
+	return EFI_SUCCESS;
+}
+
+static int bench_text(void *data, UINTN size)
+{
+	unsigned long long start = host_time_ns();
+	UINTN lines = 0;
+	EFI_STATUS ret;
+
+	ret = parse_text_buffer(data, size, count_line, &lines);
+	report(L"parse_text_buffer", start, size);
+	Print(L"%ld lines\n", lines);
+	return EFI_ERROR(ret) ? 1 : 0;
+}
+
+static int bench_sparse(void *data, UINTN size, char *output)
+{
+	sparse_header_t *sph = data;
+	unsigned long long start;
+	EFI_STATUS ret;
+
+	if (!is_sparse_image(data, size)) {
+		Print(L"Not a sparse image\n");
+		return 1;
+	}
+
+	if (host_disk_open(output, (UINT64)sph->total_blks * sph->blk_sz))
+		return 1;
+
+	start = host_time_ns();
+	ret = flash_sparse(data, size);
+	report(L"flash_sparse", start, size);
+	host_disk_close();
+
+	return EFI_ERROR(ret) ? 1 : 0;
+}
+
+static int bench_blobstore(void *data, UINTN size, char *key)
+{
+	unsigned long long start = host_time_ns();
+	struct blobstore *bs;
+	unsigned int blob_size;
+	void *blob;
+	int ret;
+
+	bs = blobstore_get(data, size);
+	if (!bs) {
+		Print(L"Not a blobstore\n");
+		return 1;
+	}
+
+	ret = blobstore_get_item(bs, key, BLOB_TYPE_DTB, &blob, &blob_size);
+	report(L"blobstore_get_item", start, size);
+	if (ret)
+		Print(L"%a not found\n", key);
+	else
+		Print(L"%a: %d bytes\n", key, blob_size);
+	return ret ? 1 : 0;
+}
+
+static int bench_mkfs(char *size_str, char *output)
+{
+	UINT64 size = strtoul(size_str, NULL, 0);
+	unsigned long long start;
+	EFI_STATUS ret;
+
+	if (host_disk_open(output, size))
+		return 1;
+
+	start = host_time_ns();
+	ret = ext4_mkfs(size, 0);
+	report(L"ext4_mkfs", start, size);
+	host_disk_close();
+
+	return EFI_ERROR(ret) ? 1 : 0;
+}
+
+static int usage(void)
+{
+	Print(L"Usage: kernelflinger-host-bench crc32 FILE\n"
+	      "       kernelflinger-host-bench text FILE\n"
+	      "       kernelflinger-host-bench sparse IMAGE OUTPUT\n"
+	      "       kernelflinger-host-bench blobstore FILE KEY\n"
+	      "       kernelflinger-host-bench mkfs SIZE OUTPUT\n");
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long size;
+	void *data;
+	int ret;
+
+	if (argc < 3)
+		return usage();
+
+	/* The only command without input file */
+	if (!strcmp((CHAR8 *)argv[1], (CHAR8 *)"mkfs"))
+		return argc == 4 ? bench_mkfs(argv[2], argv[3]) : usage();
+
+	data = host_read_file(argv[2], &size);
+	if (!data)
+		return 1;
+
+	if (!strcmp((CHAR8 *)argv[1], (CHAR8 *)"crc32"))
+		ret = bench_crc32(data, size);
+	else if (!strcmp((CHAR8 *)argv[1], (CHAR8 *)"text"))
+		ret = bench_text(data, size);
+	else if (!strcmp((CHAR8 *)argv[1], (CHAR8 *)"sparse") && argc == 4)
+		ret = bench_sparse(data, size, argv[3]);
+	else if (!strcmp((CHAR8 *)argv[1], (CHAR8 *)"blobstore") && argc == 4)
+		ret = bench_blobstore(data, size, argv[3]);
+	else
+		ret = usage();
+
+	host_free(data);
+	return ret;
+}
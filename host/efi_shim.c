@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* C library implementation of the few gnu-efi and Kernelflinger
+   services the pure logic modules rely on.  This file must not include
+   the gnu-efi or Kernelflinger headers, whose string functions
+   prototypes conflict with the C library ones: the EFI types are
+   spelled out with their C equivalent.  */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "host.h"
+
+typedef uint16_t CHAR16;
+typedef uint64_t EFI_STATUS;
+
+#define EFI_SUCCESS		0
+#define EFI_OUT_OF_RESOURCES	(0x8000000000000000ULL | 9)
+#define LOG_SUBSYSTEM_NB	5
+
+/*
+ * Memory
+ */
+void *AllocatePool(uint64_t size)
+{
+	return malloc(size ? size : 1);
+}
+
+void *AllocateZeroPool(uint64_t size)
+{
+	return calloc(1, size ? size : 1);
+}
+
+void FreePool(void *ptr)
+{
+	free(ptr);
+}
+
+void ZeroMem(void *buf, uint64_t size)
+{
+	memset(buf, 0, size);
+}
+
+void SetMem(void *buf, uint64_t size, uint8_t value)
+{
+	memset(buf, value, size);
+}
+
+void CopyMem(void *dest, const void *src, uint64_t len)
+{
+	memmove(dest, src, len);
+}
+
+int64_t CompareMem(const void *a, const void *b, uint64_t len)
+{
+	return memcmp(a, b, len);
+}
+
+/* The buffer is zeroed, as the firmware allocated one */
+EFI_STATUS alloc_aligned(void **free_addr, void **aligned_addr,
+			 uint64_t size, uint64_t align)
+{
+	uintptr_t addr;
+
+	if (!align)
+		align = 1;
+
+	*free_addr = calloc(1, size + align);
+	if (!*free_addr)
+		return EFI_OUT_OF_RESOURCES;
+
+	addr = (uintptr_t)*free_addr;
+	*aligned_addr = (void *)((addr + align - 1) & ~(uintptr_t)(align - 1));
+	return EFI_SUCCESS;
+}
+
+void *arena_alloc(uint64_t size, uint64_t align)
+{
+	void *ptr;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	if (posix_memalign(&ptr, align, size ? size : 1))
+		return NULL;
+	return ptr;
+}
+
+void arena_free(void *ptr)
+{
+	free(ptr);
+}
+
+/* The heap usage accounting is not measured on the host.  */
+void memstat_alloc(unsigned tag, uint64_t size, uint8_t ok)
+{
+}
+
+void memstat_free(unsigned tag, uint64_t size)
+{
+}
+
+/*
+ * Logs: the gnu-efi format strings are UCS-2 with their own
+ * conversions, the common ones are rendered here.
+ */
+uint8_t log_levels[LOG_SUBSYSTEM_NB] = { 1, 1, 1, 1, 1 };
+
+static void put_str16(FILE *out, const CHAR16 *s)
+{
+	for (; s && *s; s++)
+		fputc(*s < 0x80 ? *s : '?', out);
+}
+
+static void vprint16(FILE *out, const CHAR16 *fmt, va_list ap)
+{
+	int is_long;
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%') {
+			fputc(*fmt < 0x80 ? *fmt : '?', out);
+			continue;
+		}
+
+		fmt++;
+		while (*fmt == '-' || *fmt == '.' || (*fmt >= '0' && *fmt <= '9'))
+			fmt++;
+		for (is_long = 0; *fmt == 'l' || *fmt == 'h'; fmt++)
+			if (*fmt == 'l')
+				is_long = 1;
+
+		switch (*fmt) {
+		case 'd':
+			if (is_long)
+				fprintf(out, "%lld", va_arg(ap, long long));
+			else
+				fprintf(out, "%d", va_arg(ap, int));
+			break;
+		case 'u':
+			if (is_long)
+				fprintf(out, "%llu", va_arg(ap, unsigned long long));
+			else
+				fprintf(out, "%u", va_arg(ap, unsigned int));
+			break;
+		case 'x':
+		case 'X':
+			if (is_long)
+				fprintf(out, "%llx", va_arg(ap, unsigned long long));
+			else
+				fprintf(out, "%x", va_arg(ap, unsigned int));
+			break;
+		case 'c':
+			fputc(va_arg(ap, int), out);
+			break;
+		case 'a':
+			fputs(va_arg(ap, const char *), out);
+			break;
+		case 's':
+			put_str16(out, va_arg(ap, const CHAR16 *));
+			break;
+		case 'r':
+			fprintf(out, "status %#llx",
+				(unsigned long long)va_arg(ap, EFI_STATUS));
+			break;
+		case 'p':
+		case 'g':
+			fprintf(out, "%p", va_arg(ap, void *));
+			break;
+		case '%':
+			fputc('%', out);
+			break;
+		case 0:
+			return;
+		default:
+			fputc('?', out);
+		}
+	}
+}
+
+void log(const CHAR16 *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprint16(stderr, fmt, ap);
+	va_end(ap);
+}
+
+uint64_t Print(const CHAR16 *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprint16(stdout, fmt, ap);
+	va_end(ap);
+	return 0;
+}
+
+void ui_error(CHAR16 *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprint16(stderr, fmt, ap);
+	va_end(ap);
+}
+
+uint8_t ui_is_ready(void)
+{
+	return 0;
+}
+
+void log_error_persist(void)
+{
+}
+
+/*
+ * Random numbers, not meant to be secure on the host
+ */
+EFI_STATUS generate_random_numbers(char *data, uint64_t size)
+{
+	uint64_t i;
+
+	for (i = 0; i < size; i++)
+		data[i] = rand();
+	return EFI_SUCCESS;
+}
+
+/*
+ * Files and time
+ */
+static struct {
+	int fd;
+	unsigned long long size;
+} disk = { -1, 0 };
+
+int host_disk_open(const char *path, unsigned long long size)
+{
+	host_disk_close();
+
+	disk.fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (disk.fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (ftruncate(disk.fd, size)) {
+		perror(path);
+		host_disk_close();
+		return -1;
+	}
+	disk.size = size;
+	host_flash_reset();
+
+	return 0;
+}
+
+void host_disk_close(void)
+{
+	if (disk.fd >= 0)
+		close(disk.fd);
+	disk.fd = -1;
+	disk.size = 0;
+}
+
+unsigned long long host_disk_size(void)
+{
+	return disk.size;
+}
+
+int host_disk_read(unsigned long long offset, void *data, unsigned long size)
+{
+	if (disk.fd < 0 || offset + size > disk.size)
+		return -1;
+	return pread(disk.fd, data, size, offset) == (ssize_t)size ? 0 : -1;
+}
+
+int host_disk_write(unsigned long long offset, const void *data,
+		    unsigned long size)
+{
+	if (disk.fd < 0 || offset + size > disk.size)
+		return -1;
+	return pwrite(disk.fd, data, size, offset) == (ssize_t)size ? 0 : -1;
+}
+
+void *host_read_file(const char *path, unsigned long *size)
+{
+	FILE *f;
+	void *data;
+	long len;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+
+	if (fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET)) {
+		perror(path);
+		fclose(f);
+		return NULL;
+	}
+
+	data = malloc(len ? len : 1);
+	if (data && fread(data, 1, len, f) != (size_t)len) {
+		perror(path);
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+
+	*size = len;
+	return data;
+}
+
+void host_free(void *ptr)
+{
+	free(ptr);
+}
+
+unsigned long long host_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
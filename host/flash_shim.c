@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* Host implementation of the flash.h write interface the sparse
+   parser uses, writing to the file opened by host_disk_open().  */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "flash.h"
+#include "host.h"
+
+#define FILL_BUFFER_SIZE (1024 * 1024)
+
+static UINT64 cur_offset;
+
+void host_flash_reset(void)
+{
+	cur_offset = 0;
+}
+
+static BOOLEAN is_inside_disk(UINT64 offset, UINT64 size)
+{
+	return offset + size >= offset && offset + size <= host_disk_size();
+}
+
+EFI_STATUS flash_skip(UINT64 size)
+{
+	if (!is_inside_disk(cur_offset, size))
+		return EFI_INVALID_PARAMETER;
+	cur_offset += size;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_keep(UINT64 size)
+{
+	return flash_skip(size);
+}
+
+UINT64 flash_tell(void)
+{
+	return cur_offset;
+}
+
+UINT64 flash_space(void)
+{
+	return host_disk_size() - cur_offset;
+}
+
+EFI_STATUS flash_read(UINT64 offset, VOID *data, UINTN size)
+{
+	return host_disk_read(offset, data, size) ? EFI_DEVICE_ERROR : EFI_SUCCESS;
+}
+
+EFI_STATUS flash_write(VOID *data, UINTN size)
+{
+	if (!is_inside_disk(cur_offset, size)) {
+		error(L"Attempt to write outside of the disk");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	if (host_disk_write(cur_offset, data, size))
+		return EFI_DEVICE_ERROR;
+
+	cur_offset += size;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_fill(UINT32 pattern, UINT64 size)
+{
+	static UINT32 buf[FILL_BUFFER_SIZE / sizeof(UINT32)];
+	EFI_STATUS ret;
+	UINTN i, len;
+
+	for (i = 0; i < ARRAY_SIZE(buf); i++)
+		buf[i] = pattern;
+
+	for (; size; size -= len) {
+		len = min(size, (UINT64)sizeof(buf));
+		ret = flash_write(buf, len);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+UINTN flash_io_align(void)
+{
+	return 0;
+}
+
+UINTN flash_write_granule(void)
+{
+	return 1024 * 1024;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+/* Host side helpers of the host build.  This header only uses C types
+   so that it can be included by both the EFI side sources, built
+   against the gnu-efi headers, and the C library side shim.  */
+
+/* The disk the flash functions write to is a regular file */
+int host_disk_open(const char *path, unsigned long long size);
+void host_disk_close(void);
+unsigned long long host_disk_size(void);
+int host_disk_read(unsigned long long offset, void *data, unsigned long size);
+int host_disk_write(unsigned long long offset, const void *data,
+		    unsigned long size);
+
+/* Read the whole file at PATH in a buffer to be released with free() */
+void *host_read_file(const char *path, unsigned long *size);
+void host_free(void *ptr);
+
+unsigned long long host_time_ns(void);
+
+/* Reset the flash_write() position to the start of the disk */
+void host_flash_reset(void);
+
+#endif	/* _HOST_H_ */
@@ -57,7 +57,7 @@ typedef struct adb_msg {
 } adb_msg_t;
 
 #define ADB_MIN_PAYLOAD 4096
-#define ADB_MAX_PAYLOAD 262144
+#define ADB_MAX_PAYLOAD (1024 * 1024)
 
 /* Negociated (CONNECT hand-shake) maximum buffer size */
 extern UINT32 adb_max_payload;
@@ -36,12 +36,23 @@
 #include <efitcp.h>
 #include <transport.h>
 
+/* ADDRESS_CB is called when the listener is up, from tcp_start() or
+   later from tcp_run() if DHCP is still ongoing.  */
 EFI_STATUS tcp_start(UINT32 port, start_callback_t start_cb,
 		     data_callback_t rx_cb, data_callback_t tx_cb,
-		     EFI_IPv4_ADDRESS *station_address);
+		     address_callback_t address_cb);
 EFI_STATUS tcp_stop(void);
 EFI_STATUS tcp_run(void);
+/* Event signaled when tcp_run() has completions to report, NULL if
+   the TCP layer can only be polled.  */
+EFI_EVENT tcp_event(void);
 EFI_STATUS tcp_read(void *buf, UINT32 size);
+/* Read up to SIZE bytes, the rx callback is called as soon as some
+   data is received.  */
+EFI_STATUS tcp_read_some(void *buf, UINT32 size);
+EFI_STATUS tcp_readv_some(transport_fragment_t *frags, UINTN count);
+const transport_counters_t *tcp_counters(void);
 EFI_STATUS tcp_write(void *buf, UINT32 size);
+EFI_STATUS tcp_writev(transport_fragment_t *frags, UINTN count);
 
 #endif	/* _TCP_H_ */
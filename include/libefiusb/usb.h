@@ -48,5 +48,8 @@ EFI_STATUS usb_stop(void);
 EFI_STATUS usb_run(void);
 EFI_STATUS usb_read(void *buf, UINT32 size);
 EFI_STATUS usb_write(void *buf, UINT32 size);
+const transport_counters_t *usb_counters(void);
+/* The controller only takes reads of multiple of MaxPacketSize.  */
+UINT32 usb_read_granularity(void);
 
 #endif	/* _USB_H_ */
@@ -39,11 +39,21 @@
 #include <lib.h>
 #include <vars.h>
 
+/* Download size used when the memory map cannot be read.  Otherwise
+   the largest free memory range less DOWNLOAD_MEMORY_RESERVE is
+   advertised, up to DOWNLOAD_SIZE_LIMIT.  */
 #define MAX_DOWNLOAD_SIZE (256 * 1024 * 1024)
+#define DOWNLOAD_MEMORY_RESERVE (128 * 1024 * 1024)
+#define DOWNLOAD_SIZE_LIMIT 0xFFF00000UL
+/* Streamed downloads go through a fixed ring of buffers, they are
+   only limited by the 32 bits size field of the DATA response.  */
+#define MAX_STREAM_SIZE 0xFFFFFFFFUL
 #define MAGIC_LENGTH 64
 
 /* GUID for variables used to communicate with Fastboot */
 extern const EFI_GUID fastboot_guid;
+/* GPT type of the partitions reported as ext4 */
+extern EFI_GUID guid_linux_data;
 
 typedef void (*fastboot_handle) (INTN argc, CHAR8 **argv);
 
@@ -56,6 +66,8 @@ struct fastboot_cmd {
 typedef struct cmdlist *cmdlist_t;
 
 void fastboot_set_dlbuffer(void *buffer, unsigned size);
+/* Last downloaded data, NULL if there is none.  */
+void *fastboot_get_dlbuffer(unsigned *size);
 
 struct fastboot_cmd *fastboot_get_root_cmd(const char *name);
 EFI_STATUS fastboot_register(struct fastboot_cmd *cmd);
@@ -65,10 +77,20 @@ void fastboot_run_cmd(cmdlist_t list, const char *name, INTN argc, CHAR8 **argv)
 void fastboot_run_root_cmd(const char *name, INTN argc, CHAR8 **argv);
 
 EFI_STATUS fastboot_publish(const char *name, const char *value);
+EFI_STATUS fastboot_publish_dynamic(const char *name, char *(get_value)(void));
+/* Publish the variables starting with PREFIX, GET_VALUE is given the
+   rest of the variable name.  */
+EFI_STATUS fastboot_publish_prefix(const char *prefix,
+				  char *(*get_value)(const char *suffix));
 void fastboot_okay(const char *fmt, ...);
 void fastboot_fail(const char *fmt, ...);
 void fastboot_info(const char *fmt, ...);
 EFI_STATUS fastboot_info_long_string(char *str, void *context);
+void fastboot_info_text(const char *text, UINTN len);
+/* Hand over the pool allocated DATA of SIZE bytes to be sent to the
+   host by the next upload command.  It replaces and frees any data
+   previously staged.  */
+void fastboot_stage(void *data, UINTN size);
 
 EFI_STATUS fastboot_set_command_buffer(char *buffer, UINTN size);
 EFI_STATUS fastboot_start(void **bootimage, void **efiimage,
@@ -76,7 +98,6 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage,
 EFI_STATUS fastboot_stop(void *bootimage, void *efiimage, UINTN imagesize,
 			 enum boot_target target);
 void fastboot_free(void);
-EFI_STATUS refresh_partition_var(void);
 
 void fastboot_reboot(enum boot_target target, CHAR16 *msg);
 
@@ -122,6 +122,19 @@ struct OEM1_TABLE {
 	UINT8 rsvd2[11];		/* Reserved */
 } __attribute__ ((packed));
 
+/* Boot Graphics Resource Table */
+#define BGRT_STATUS_DISPLAYED	(1 << 0)
+
+struct BGRT_TABLE {
+	struct ACPI_DESC_HEADER header;	/* System Description Table Header */
+	UINT16 version;			/* Version, 1 */
+	UINT8 status;			/* Bit 0 set if the image is displayed */
+	UINT8 image_type;		/* 0 for a bitmap */
+	UINT64 image_address;		/* Physical address of the image */
+	UINT32 image_offset_x;		/* X offset of the image on screen */
+	UINT32 image_offset_y;		/* Y offset of the image on screen */
+} __attribute__ ((packed));
+
 /* Some ACPI table signatures, SSDT for instance, might appear several
  * times.  An extra table number can be appended to the supplied
  * SIGNATURE to specify which one is required.  For instance, with
@@ -123,6 +123,33 @@ EFI_STATUS android_image_load_partition(
                 IN const CHAR16 *label,
                 OUT VOID **bootimage_p);
 
+/* Free a boot image returned by android_image_load_partition() */
+void android_image_free(IN VOID *bootimage);
+
+/* In-place reception of a boot image into the SIZE bytes BOOTIMAGE
+ * buffer: the kernel and the ramdisk are received directly at the
+ * location they are booted from, like android_image_load_partition()
+ * does.  Once RECEIVED bytes are in the buffer, returns:
+ * EFI_SUCCESS - the following data must be received at the location
+ * returned by android_image_locate()
+ * EFI_NOT_READY - call again once *NEED bytes have been received, and
+ * not more
+ * Any other error - the image cannot be received in place */
+EFI_STATUS android_image_place(VOID *bootimage, UINTN size, UINTN received,
+                               UINTN *need);
+
+/* Location of the data at OFFSET in a boot image being received in
+ * place.  *LEN is clamped to the remaining size of this location.  */
+VOID *android_image_locate(VOID *bootimage, UINTN offset, UINTN *len);
+
+/* Stop receiving BOOTIMAGE in place.  The kernel and ramdisk are first
+ * copied back into the buffer if FLATTEN is TRUE.  */
+void android_image_unplace(VOID *bootimage, BOOLEAN flatten);
+
+/* Copy the SIZE bytes boot image FROM to TO.  A boot image received
+ * in place keeps its kernel and ramdisk where they are.  */
+void android_image_move(VOID *from, VOID *to, UINTN size);
+
 EFI_STATUS android_image_load_file(
                 IN EFI_HANDLE device,
                 IN CHAR16 *loader,
@@ -133,6 +160,8 @@ EFI_STATUS read_bcb(
                 IN const CHAR16 *label,
                 OUT struct bootloader_message *bcb);
 
+/* After a read_bcb(), only writes the sectors which changed or
+ * nothing at all if the BCB is unchanged */
 EFI_STATUS write_bcb(
                 IN const CHAR16 *label,
                 IN struct bootloader_message *bcb);
@@ -148,6 +177,21 @@ struct boot_img_hdr *get_bootimage_header(VOID *bootimage_blob);
  * block */
 UINTN bootimage_size(struct boot_img_hdr *aosp_header);
 
+/* Contiguous piece of a loaded boot image */
+struct bootimage_piece {
+        VOID *data;
+        UINTN size;
+};
+
+#define BOOTIMAGE_MAX_PIECES 5
+
+/* Split the SIZE first bytes of a boot image in the pieces they are
+ * loaded in, in image order: the kernel and the ramdisk may have been
+ * read directly at the location they are booted from.  Return the
+ * number of pieces.  */
+UINTN bootimage_pieces(VOID *bootimage, UINTN size,
+                       struct bootimage_piece *pieces);
+
 /* Return the blob_size aligned on hdr->page_size.  */
 UINT32 pagealign(struct boot_img_hdr *hdr, UINT32 blob_size);
 
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _ASYNC_IO_H_
+#define _ASYNC_IO_H_
+
+#include <efi.h>
+
+/* Asynchronous block writer.  When the device of BIO exposes the
+   Block IO2 protocol, up to ASYNC_IO_DEPTH writes are kept in
+   flight.  Otherwise, and while no writer is opened,
+   async_write_blocks() is a synchronous BIO->WriteBlocks() call.
+   Only one writer is active at a time but the active writer can be
+   detached to let its writes complete in the background while
+   another device is written.
+
+   A write error is reported by one of the following
+   async_write_blocks() calls or by async_write_close().  */
+#define ASYNC_IO_DEPTH 8
+/* Active plus detached writers */
+#define ASYNC_IO_WRITERS 4
+
+EFI_STATUS async_write_open(EFI_BLOCK_IO *bio);
+/* Same as async_write_open() with up to DEPTH writes in flight,
+   DEPTH being at most ASYNC_IO_DEPTH */
+EFI_STATUS async_write_open_depth(EFI_BLOCK_IO *bio, UINTN depth);
+BOOLEAN async_write_active(EFI_BLOCK_IO *bio);
+/* TRUE if a writer is opened, whatever its device */
+BOOLEAN async_write_opened(void);
+
+/* Number of writes that waited for a free request, since boot */
+UINT64 async_write_stalls(void);
+
+/* If COPY is FALSE, DATA must stay untouched until the next
+   async_write_sync() or async_write_close() call.  Otherwise it is
+   copied first.  */
+EFI_STATUS async_write_blocks(EFI_BLOCK_IO *bio, EFI_LBA lba, UINTN size,
+			      VOID *data, BOOLEAN copy);
+
+/* Wait for all the writes in flight */
+EFI_STATUS async_write_sync(void);
+EFI_STATUS async_write_close(void);
+
+/* Close the active writer without waiting for its writes in flight.
+   They are waited for by async_write_join() or when a writer is
+   opened on the same device.  Without a free slot or Block IO2 it is
+   async_write_close().  */
+EFI_STATUS async_write_detach(void);
+/* Wait for the writes of the detached writers and return the first
+   error */
+EFI_STATUS async_write_join(void);
+
+/* Asynchronous block reader for read-ahead.  When the device of BIO
+   exposes the Block IO2 protocol, async_read_blocks() returns once
+   the read is submitted, otherwise it is a synchronous
+   BIO->ReadBlocks() call.  async_read_wait() returns the status of
+   the read.  A reader has a single read in flight.  */
+typedef struct async_reader async_reader_t;
+
+EFI_STATUS async_read_open(EFI_BLOCK_IO *bio, async_reader_t **reader);
+EFI_STATUS async_read_blocks(async_reader_t *reader, EFI_LBA lba,
+			     UINTN size, VOID *data);
+EFI_STATUS async_read_wait(async_reader_t *reader);
+void async_read_close(async_reader_t *reader);
+
+#endif	/* _ASYNC_IO_H_ */
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _BUMP_H_
+#define _BUMP_H_
+
+#include <efi.h>
+
+/* Bump allocator for the short-lived allocations of the boot and
+   fastboot paths: strings, variable buffers, text lines.  The area is
+   reserved once, in the image data, so that an allocation does not
+   cost a boot services call.  When it is full, the allocations fall
+   back on the pool.  bump_free() accepts both kinds of buffer.
+
+   The area is reclaimed when the last allocation is freed or when
+   bump_release() rewinds it to a mark taken earlier with bump_mark(),
+   which the boot and fastboot paths do at well-defined points.  It
+   must not be used from event notification functions nor for
+   long-lived buffers.  */
+VOID *bump_alloc(UINTN size);
+CHAR16 *bump_strdup(const CHAR16 *str);
+CHAR16 *bump_stra_to_str(const CHAR8 *stra);
+void bump_free(VOID *ptr);
+UINTN bump_mark(void);
+void bump_release(UINTN mark);
+
+#endif	/* _BUMP_H_ */
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <efi.h>
+
+/* IEEE 802.3 CRC32 as used by zlib, GPT and the Android sparse
+   format.  CRC is the value returned for the preceding data, 0 for
+   the first call.  */
+UINT32 crc32_update(UINT32 crc, const VOID *data, UINTN size);
+
+/* Return the CRC32 of A followed by B where CRC_A and CRC_B are the
+   CRC32 of A and B and LEN_B the length of B.  */
+UINT32 crc32_combine(UINT32 crc_a, UINT32 crc_b, UINT64 len_b);
+
+/* Update CRC with SIZE bytes of the 32 bits PATTERN repeated, SIZE
+   being a multiple of 4.  It costs O(log(SIZE)) combinations instead
+   of reading SIZE bytes.  */
+UINT32 crc32_fill(UINT32 crc, UINT32 pattern, UINT64 size);
+
+#endif	/* _CRC32_H_ */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _DELTA_FORMAT_H_
+#define _DELTA_FORMAT_H_
+
+#include <efi.h>
+
+/* A delta image rebuilds a partition from its current content.  It
+   is a sequence of operations, each one producing the next OP_SZ
+   blocks of the partition.  */
+typedef struct delta_header {
+	UINT32	magic;		/* DELTA_HEADER_MAGIC */
+	UINT16	major_version;	/* (0x1) - reject images with higher major versions */
+	UINT16	minor_version;	/* (0x0) - allow images with higher minor versions */
+	UINT32	blk_sz;		/* block size in bytes, a multiple of 512 */
+	UINT32	total_blks;	/* total blocks produced by the operations */
+	UINT32	total_ops;	/* total operations in the delta image */
+	UINT32	reserved;
+} delta_header_t;
+
+#define DELTA_HEADER_MAGIC	0x544c4544	/* "DELT" */
+
+#define DELTA_OP_RAW		0xDE01
+#define DELTA_OP_COPY		0xDE02
+#define DELTA_OP_FILL		0xDE03
+#define DELTA_OP_KEEP		0xDE04
+
+typedef struct delta_op {
+	UINT16	op_type;
+	UINT16	reserved1;
+	UINT32	op_sz;		/* in blocks of the partition */
+	UINT64	arg;		/* COPY: source block, FILL: 32 bits pattern */
+} delta_op_t;
+
+/* A RAW operation is followed by its OP_SZ * BLK_SZ bytes of data.
+ * COPY reads the partition as it is when the operation is applied:
+ *   its source must not start before the blocks it produces, which
+ *   also guarantees that it has not been overwritten yet.
+ * KEEP leaves the blocks untouched.
+ */
+
+#endif	/* _DELTA_FORMAT_H_ */
@@ -91,6 +91,13 @@ EFI_STATUS gpt_get_partition_by_label(const CHAR16 *label, struct gpt_partition_
 EFI_STATUS gpt_list_partition(struct gpt_partition_interface **gpartlist, UINTN *part_count, logical_unit_t log_unit);
 EFI_STATUS gpt_create(UINTN start_lba, UINTN part_count, struct gpt_bin_part *gbp, logical_unit_t log_unit);
 void gpt_free_cache(void);
+/* Start reading the GPT of the logical unit in the background.  The
+   first function needing the partitions waits for the read.  */
+EFI_STATUS gpt_prefetch(logical_unit_t log_unit);
+/* Make the partition drivers enumerate the partitions again.  The
+   cached partition tables are kept: a writer of the disk which may
+   change them, other than gpt_create() and gpt_swap_partition(), has
+   to call gpt_free_cache().  */
 EFI_STATUS gpt_refresh(void);
 EFI_STATUS gpt_get_root_disk(struct gpt_partition_interface *gpart, logical_unit_t log_unit);
 EFI_STATUS gpt_get_partition_guid(CHAR16 *label, EFI_GUID *guid, logical_unit_t log_unit);
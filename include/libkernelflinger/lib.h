@@ -84,6 +84,13 @@ EFI_STATUS set_efi_variable(const EFI_GUID *guid, CHAR16 *key,
 EFI_STATUS set_efi_variable_str(const EFI_GUID *guid, CHAR16 *key,
                 BOOLEAN nonvol, BOOLEAN runtime, CHAR16 *val);
 
+/* To be called after a variable has been written without the
+ * functions above, GUID or KEY being NULL for all variables.  */
+void efi_variable_cache_invalidate(const EFI_GUID *guid, CHAR16 *key);
+
+/* Changes each time a variable may have been written or deleted */
+UINTN efi_variable_generation(void);
+
 /*
  * File I/O
  */
@@ -106,6 +113,9 @@ EFI_STATUS stra_to_guid(char *str, EFI_GUID *g);
 
 int vsnprintf(CHAR8 *dst, UINTN size, const CHAR8 *format, va_list ap);
 
+/* Same as vsnprintf() with a CHAR16 format string */
+int vsnprintf_w(CHAR8 *dst, UINTN size, const CHAR16 *format, va_list ap);
+
 int snprintf(CHAR8 *str, UINTN size, const CHAR8 *format, ...);
 
 VOID StrNCpy(OUT CHAR16 *dest, IN const CHAR16 *src, UINT32 n);
@@ -164,6 +174,7 @@ int tolower(int c);
 
 VOID halt_system(VOID) __attribute__ ((noreturn));
 
+VOID sleep_us(UINT64 usecs);
 VOID pause(UINTN seconds);
 
 VOID reboot(CHAR16 *target) __attribute__ ((noreturn));
@@ -172,6 +183,9 @@ void *memset(void *s, int c, size_t n);
 
 int memcmp(const void *s1, const void *s2, size_t n);
 
+/* TRUE if the SIZE bytes at BUF are all zero */
+BOOLEAN is_zero(const void *buf, size_t size);
+
 EFI_STATUS alloc_aligned(VOID **free_addr, VOID **aligned_addr,
                          UINTN size, UINTN align);
 
@@ -185,4 +199,8 @@ UINT8 min_boot_state();
 
 VOID cpuid(UINT32 op, UINT32 reg[4]);
 
+/* Same as cpuid() for the leaves with sub-leaves, COUNT being the
+   sub-leaf.  */
+VOID cpuid_count(UINT32 op, UINT32 count, UINT32 reg[4]);
+
 #endif
@@ -38,6 +38,13 @@
 #include <vars.h>
 
 EFI_STATUS log_flush_to_var(BOOLEAN nonvol);
+/* Return a pool allocated copy of the log buffer.  */
+EFI_STATUS log_dump(void **buf, UINTN *size);
+void log_error_persist(void);
+EFI_STATUS log_persist(void);
+EFI_STATUS log_async_start(void);
+void log_async_stop(void);
+void log_flush_serial(void);
 
 void log(const CHAR16 *fmt, ...);
 
@@ -58,13 +65,68 @@ void log(const CHAR16 *fmt, ...);
 #define debug_pause(x) (void)(x)
 #endif
 
+/* Per-subsystem log levels.  The LOG_LEVEL_<SUBSYSTEM> defines, which
+   can be set in KERNELFLINGER_CFLAGS, are the highest level compiled
+   in: messages above it are removed by the compiler.  Below it, the
+   level is raised or lowered at runtime through the LOG_LEVELS_VAR
+   variable ("storage=2,ui=0" for instance) and a filtered out message
+   costs one test.  */
+#define LOG_LEVEL_NONE		0
+#define LOG_LEVEL_DEBUG		1
+#define LOG_LEVEL_VERBOSE	2
+
+#define LOG_LEVEL_DEFAULT	(DEBUG_MESSAGES ? LOG_LEVEL_DEBUG : LOG_LEVEL_NONE)
+
+#ifndef LOG_LEVEL_STORAGE
+#define LOG_LEVEL_STORAGE	LOG_LEVEL_DEFAULT
+#endif
+#ifndef LOG_LEVEL_TRANSPORT
+#define LOG_LEVEL_TRANSPORT	LOG_LEVEL_DEFAULT
+#endif
+#ifndef LOG_LEVEL_FASTBOOT
+#define LOG_LEVEL_FASTBOOT	LOG_LEVEL_DEFAULT
+#endif
+#ifndef LOG_LEVEL_UI
+#define LOG_LEVEL_UI		LOG_LEVEL_DEFAULT
+#endif
+#ifndef LOG_LEVEL_SECURITY
+#define LOG_LEVEL_SECURITY	LOG_LEVEL_DEFAULT
+#endif
+
+enum log_subsystem {
+	LOG_STORAGE,
+	LOG_TRANSPORT,
+	LOG_FASTBOOT,
+	LOG_UI,
+	LOG_SECURITY,
+	LOG_SUBSYSTEM_NB
+};
+
+#define LOG_LEVELS_VAR	L"LogLevels"
+
+extern UINT8 log_levels[LOG_SUBSYSTEM_NB];
+void log_levels_load(void);
+
+#define log_enabled(sub, level) \
+	(LOG_LEVEL_##sub >= (level) && log_levels[LOG_##sub] >= (level))
+
+#define log_level(sub, level, fmt, ...) do { \
+    if (log_enabled(sub, level)) \
+        log(fmt "\n", ##__VA_ARGS__); \
+} while(0)
+
+#define log_debug(sub, fmt, ...) \
+	log_level(sub, LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define log_verbose(sub, fmt, ...) \
+	log_level(sub, LOG_LEVEL_VERBOSE, fmt, ##__VA_ARGS__)
+
 #define error(x, ...) do { \
   log(x "\n", ##__VA_ARGS__); \
   if (ui_is_ready()) { \
     ui_error(x, ##__VA_ARGS__); \
   } else \
     Print(x "\n", ##__VA_ARGS__); \
-  log_flush_to_var(TRUE); \
+  log_error_persist(); \
 } while(0)
 
 #define efi_perror(ret, x, ...) do { \
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MEMSTAT_H_
+#define _MEMSTAT_H_
+
+#include <efi.h>
+
+/* Heap usage accounting.  The subsystems whose allocations can be
+   large or numerous account them under their tag: current and peak
+   bytes, largest single allocation and failures.  Only the callers of
+   the functions below are counted: the Fastboot buffers and OpenSSL
+   today, not the libkernelflinger allocations.  */
+enum memstat_tag {
+	MEMSTAT_DOWNLOAD,
+	MEMSTAT_SPARSE,
+	MEMSTAT_FLASH,
+	MEMSTAT_OPENSSL,
+	MEMSTAT_TAG_NB
+};
+
+typedef struct memstat {
+	UINT64 current;
+	UINT64 peak;
+	UINT64 largest;
+	UINT64 allocs;
+	UINT64 failures;
+} memstat_t;
+
+/* Account an allocation of SIZE bytes, OK is FALSE if it failed.  */
+void memstat_alloc(enum memstat_tag tag, UINTN size, BOOLEAN ok);
+void memstat_free(enum memstat_tag tag, UINTN size);
+
+/* AllocatePool() and FreePool() accounted under TAG.  The caller
+   gives back the SIZE of the allocation on release.  */
+VOID *memstat_pool(enum memstat_tag tag, UINTN size);
+VOID *memstat_zero_pool(enum memstat_tag tag, UINTN size);
+void memstat_free_pool(enum memstat_tag tag, VOID *buf, UINTN size);
+
+const memstat_t *memstat_get(enum memstat_tag tag);
+const char *memstat_name(enum memstat_tag tag);
+
+#endif	/* _MEMSTAT_H_ */
@@ -35,7 +35,16 @@
 
 #include <efi.h>
 
+/* Variables written, deleted and left untouched because their content
+   was already the requested one, by the last flash  */
+typedef struct oemvars_stats {
+	UINTN written;
+	UINTN deleted;
+	UINTN unchanged;
+} oemvars_stats_t;
+
 EFI_STATUS flash_oemvars(VOID *data, UINTN size);
+void oemvars_get_stats(oemvars_stats_t *stats);
 EFI_STATUS flash_oemvars_silent_write_error(VOID *data, UINTN size,
 					    const EFI_GUID *restricted_guid);
 
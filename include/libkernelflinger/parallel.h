@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <efi.h>
+
+/* Work item callback.  It runs on the BSP or on an application
+   processor so it must neither use the boot services nor allocate
+   memory.  */
+typedef VOID (*parallel_work_t)(VOID *arg, UINTN index);
+
+/* Called on the BSP between work items with the number of completed
+   items.  */
+typedef VOID (*parallel_progress_t)(VOID *arg, UINTN done, UINTN count);
+
+/* Locate the MP services and allocate what parallel_for() needs.  It
+   is called by parallel_for() but a caller which must not see any
+   allocation after a memory map snapshot calls it first.  */
+EFI_STATUS parallel_init(void);
+
+/* Number of processors parallel_for() spreads the work on, the BSP
+   included.  */
+UINTN parallel_workers(void);
+
+/* Run WORK(ARG, I) for I in [0, COUNT) on the BSP and the application
+   processors and return once all the items are done.  Each processor
+   has a queue of consecutive items and steals from the others once
+   its queue is empty.  The items run serially on the BSP if the MP
+   services are absent or busy.  PROGRESS can be NULL.  */
+EFI_STATUS parallel_for(UINTN count, parallel_work_t work,
+			parallel_progress_t progress, VOID *arg);
+
+/* Wait for the application processors of the last parallel_for()
+   run, if it completed above TPL_APPLICATION, and release the
+   resources of parallel_init().  It must be called at
+   TPL_APPLICATION before the handover to the OS.  */
+EFI_STATUS parallel_exit(void);
+
+#endif	/* _PARALLEL_H_ */
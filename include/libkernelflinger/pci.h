@@ -56,6 +56,23 @@ typedef struct _pci_device_ids
  */
 PCI_DEVICE_PATH *get_pci_device_path(EFI_DEVICE_PATH *p);
 
+/**
+ * get_pci_protocol:
+ * @p - Pointer to a EFI_DEVICE_PATH structure
+ * @guid - The protocol to look for
+ * @interface - The protocol interface
+ *
+ * Gets the @guid protocol of the device @p leads to, the protocols
+ * installed on a PCI controller are cached so that the boot device can
+ * be checked repeatedly at no cost
+ *
+ * Returns:
+ * EFI_SUCCESS if the protocol was found
+ * an EFI error if no device of the path supports it
+ */
+EFI_STATUS get_pci_protocol(IN EFI_DEVICE_PATH *p, IN EFI_GUID *guid,
+			    OUT VOID **interface);
+
 /**
  * get_pci_device:
  * @p - Pointer to a EFI_DEVICE_PATH structure
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RAMDISK_H_
+#define _RAMDISK_H_
+
+#include <efi.h>
+
+#define RAMDISK_DEFAULT_BLOCK_SIZE	512
+
+/* Install a memory backed Block IO and Disk IO device of SIZE bytes,
+   selected with identify_boot_device(STORAGE_RAMDISK).  IO_ALIGN is
+   reported in the media and enforced on the buffers, LATENCY_US is
+   added to each transfer.  Only one RAM disk can exist, it lasts
+   until the next reset.  */
+EFI_STATUS ramdisk_create(UINT64 size, UINT32 block_size, UINT32 io_align,
+			  UINT32 latency_us);
+BOOLEAN ramdisk_exists(void);
+/* Write a synthetic partition table to the RAM disk, the RAM disk
+   must be the current storage.  */
+EFI_STATUS ramdisk_create_gpt(void);
+
+#endif	/* _RAMDISK_H_ */
@@ -72,6 +72,27 @@ UINT8 verify_android_boot_image(
         OUT CHAR16 *target,
         OUT X509 **verifier_cert);
 
+/* Streaming boot image hash.  The boot image loader calls
+ * bootimage_hash_start() with the signature block, which selects the
+ * digest algorithm, then feeds the boot image data in image order as
+ * it is read and calls bootimage_hash_end() once the whole image has
+ * been hashed.  verify_android_boot_image() then only has to hash the
+ * signature AuthenticatedAttributes.  */
+EFI_STATUS bootimage_hash_start(VOID *bootimage, VOID *signature_data);
+void bootimage_hash_update(const VOID *data, UINTN size);
+void bootimage_hash_end(void);
+void bootimage_hash_abort(void);
+
+/* Same as bootimage_hash_start() when the signature block is not
+ * available yet, as for a boot image being downloaded.  SHA-256, the
+ * boot signer digest, is assumed: the streamed hash is ignored at
+ * verification time if the signature uses another one.  */
+EFI_STATUS bootimage_hash_start_sha256(VOID *bootimage);
+
+/* The boot image the hash is streamed for has been copied from FROM
+ * to TO.  */
+void bootimage_hash_move(VOID *from, VOID *to);
+
 /* Determines if UEFI Secure Boot is enabled or not. */
 BOOLEAN is_efi_secure_boot_enabled(VOID);
 
@@ -41,14 +41,26 @@ enum storage_type {
 	STORAGE_UFS,
 	STORAGE_SDCARD,
 	STORAGE_SATA,
+	STORAGE_NVME,
+	STORAGE_RAMDISK,	/* Only selected explicitly */
 	STORAGE_ALL,
 };
 
 /* It is faster to erase multiple block at once */
 #define N_BLOCK (4096)
 
+/* Blocks START to END included */
+struct lba_range {
+	UINT64 start;
+	UINT64 end;
+};
+
 struct storage {
 	EFI_STATUS (*erase_blocks)(EFI_HANDLE handle, EFI_BLOCK_IO *bio, UINT64 start, UINT64 end);
+	/* Optional, erases several ranges with as few commands as
+	   possible */
+	EFI_STATUS (*erase_ranges)(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				   struct lba_range *ranges, UINTN nb);
 	EFI_STATUS (*check_logical_unit)(EFI_DEVICE_PATH *p, logical_unit_t log_unit);
 	BOOLEAN (*probe)(EFI_DEVICE_PATH *p);
 	const CHAR16 *name;
@@ -61,6 +73,11 @@ PCI_DEVICE_PATH *get_boot_device(void);
 EFI_STATUS storage_set_boot_device(EFI_HANDLE device);
 EFI_STATUS storage_check_logical_unit(EFI_DEVICE_PATH *p, logical_unit_t log_unit);
 EFI_STATUS storage_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, UINT64 start, UINT64 end);
+EFI_STATUS storage_erase_ranges(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				struct lba_range *ranges, UINTN nb);
+/* Number of blocks of the fill_with() pattern which writes the [START,
+   END] range at media speed */
+UINTN fill_chunk_blocks(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end);
 EFI_STATUS fill_with(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end,
 		     VOID *pattern, UINTN pattern_blocks);
 EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end);
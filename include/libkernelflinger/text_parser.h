@@ -37,6 +37,31 @@
 #include <efiapi.h>
 
 void skip_whitespace(char **line);
+
+/* Zero-copy iteration over the lines of a text buffer.  The lines and
+   tokens are slices of the original buffer, which is not modified,
+   stripped from their surrounding white spaces.  Blank lines are
+   skipped.  */
+typedef struct text_slice {
+	char *ptr;
+	UINTN len;
+} text_slice_t;
+
+typedef struct text_iter {
+	char *cur;
+	char *end;
+	UINTN lineno;
+} text_iter_t;
+
+void text_iter_init(text_iter_t *it, VOID *data, UINTN size);
+BOOLEAN text_next_line(text_iter_t *it, text_slice_t *line);
+BOOLEAN text_next_token(text_slice_t *s, text_slice_t *token);
+void text_slice_trim(text_slice_t *s);
+char *text_slice_chr(text_slice_t *s, char c);
+BOOLEAN text_slice_eq(text_slice_t *s, const char *str);
+
+/* Calls PARSE_LINE with each non-blank line as a NUL terminated
+   string.  */
 EFI_STATUS parse_text_buffer(VOID *data, UINTN size,
 			     EFI_STATUS (*parse_line)(char *line, VOID *ctx),
 			     VOID *context);
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _TIMESTAMP_H_
+#define _TIMESTAMP_H_
+
+#include <efi.h>
+
+/* Boot phase time stamps, in microseconds since the platform reset.
+   The time stamps of the current boot are saved in a runtime EFI
+   variable when the kernel is started or on reboot so that they can
+   be read by the OS.  The variable is volatile, except during a boot
+   bench run where the time stamps are reported by the next boot.  */
+#define TIMESTAMP_NAME_LENGTH 24
+#define MAX_TIMESTAMPS 32
+
+struct timestamp {
+	CHAR8 name[TIMESTAMP_NAME_LENGTH];
+	UINT64 us;
+} __attribute__((packed));
+
+/* NAME must be a static string */
+void timestamp_record(const char *name);
+EFI_STATUS timestamp_save(void);
+
+/* Copy up to MAX time stamps of the current boot and return how many
+   were copied.  */
+UINTN timestamp_get(struct timestamp *stamps, UINTN max);
+/* Return the current boot time stamps as a "NAME:US,NAME:US..."
+   string to be freed with FreePool(), NULL if there is none.  */
+CHAR16 *timestamp_timeline(void);
+
+/* Time stamps saved by the previous boot, STAMPS must be freed with
+   FreePool().  */
+EFI_STATUS timestamp_get_last_boot(struct timestamp **stamps, UINTN *count);
+
+/* Boot time regression harness.  While boots remain, the time of
+   the kernel handover is saved in a rolling EFI variable of the last
+   BOOT_BENCH_SAMPLES boots and the device reboots automatically.  */
+#define BOOT_BENCH_SAMPLES 128
+
+struct boot_bench_stats {
+	UINT32 remaining;
+	UINT32 count;
+	UINT32 min_us;
+	UINT32 p50_us;
+	UINT32 p99_us;
+	UINT32 max_us;
+};
+
+/* Start a run of BOOTS boots, 0 stops the current run.  The previous
+   samples are discarded.  */
+EFI_STATUS timestamp_bench_start(UINT32 boots);
+/* Called when the kernel is about to be started, does not return if
+   more boots are expected.  */
+void timestamp_bench_record(void);
+EFI_STATUS timestamp_bench_get(struct boot_bench_stats *stats);
+
+#endif	/* _TIMESTAMP_H_ */
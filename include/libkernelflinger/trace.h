@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <efi.h>
+
+/* Binary trace ring.  Records are compact enough to be left in the
+   hot paths: recording is an atomic increment and a few stores.  */
+#define TRACE_MAGIC	0x5254464b	/* "KFTR" */
+#define TRACE_VERSION	1
+
+enum trace_event {
+#define TRACE_EVENT(id, name) TRACE_##id,
+#include "trace_events.h"
+#undef TRACE_EVENT
+	TRACE_EVENT_NB
+};
+
+typedef struct trace_record {
+	UINT64 ticks;
+	UINT32 event;
+	UINT32 a;
+	UINT64 b;
+} __attribute__((packed)) trace_record_t;
+
+/* A dump is this header followed by COUNT records, oldest first.  */
+typedef struct trace_header {
+	UINT32 magic;
+	UINT16 version;
+	UINT16 record_size;
+	UINT64 ticks_per_ms;
+	UINT64 count;
+	UINT64 lost;
+} __attribute__((packed)) trace_header_t;
+
+EFI_STATUS trace_init(void);
+void trace(enum trace_event event, UINT32 a, UINT64 b);
+EFI_STATUS trace_dump(void **buf, UINTN *size);
+const char *trace_event_name(UINT32 event);
+
+#endif	/* _TRACE_H_ */
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* List of the trace events, shared with the host decoder.  Each
+   event is recorded with two arguments, A and B, described here.  */
+
+/* A: command line length, B: first eight characters of the command */
+TRACE_EVENT(FASTBOOT_CMD,	"fastboot-cmd")
+/* A: transport index, B: length */
+TRACE_EVENT(TRANSPORT_RX,	"transport-rx")
+TRACE_EVENT(TRANSPORT_TX,	"transport-tx")
+/* A: size, B: disk offset in bytes */
+TRACE_EVENT(DISK_WRITE,		"disk-write")
+/* A: status, B: unused */
+TRACE_EVENT(FLASH_END,		"flash-end")
+/* A: memstat tag, B: size of the failed allocation */
+TRACE_EVENT(ALLOC_FAIL,		"alloc-fail")
+/* A: memstat tag, B: new peak in bytes */
+TRACE_EVENT(ALLOC_PEAK,		"alloc-peak")
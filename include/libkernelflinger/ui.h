@@ -49,17 +49,22 @@ extern EFI_GRAPHICS_OUTPUT_BLT_PIXEL	COLOR_HIGHLIGHT;
 extern EFI_GRAPHICS_OUTPUT_BLT_PIXEL	COLOR_ORANGE;
 
 /* Image */
+/* Run-length encoded images (see png2c) have a NULL BLT until their
+   DATA is decoded on first draw.  */
 typedef struct image {
 	const char *name;
 	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt;
 	UINTN width;
 	UINTN height;
+	const unsigned char *data;
+	UINTN data_len;
 } ui_image_t;
 
 EFI_STATUS ui_image_draw(ui_image_t *image, UINTN x, UINTN y);
 EFI_STATUS ui_image_draw_scale(ui_image_t *image, UINTN x,
 			       UINTN y, UINTN width, UINTN height);
 ui_image_t *ui_image_get(const char *name);
+void ui_image_free_cache(void);
 
 /* Font */
 typedef struct ui_font {
@@ -74,6 +79,27 @@ typedef struct ui_font {
 EFI_STATUS ui_font_init(void);
 ui_font_t *ui_font_get_default(void);
 ui_font_t *ui_font_get(char *name);
+
+/* Glyph atlas: the printable characters of a font rendered in a
+   color over a background color at a given cell size.  */
+#define UI_GLYPH_FIRST	0x21
+#define UI_GLYPH_LAST	0x7E
+
+typedef struct ui_glyphs {
+	ui_font_t *font;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL color;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL bg_color;
+	BOOLEAN bold;
+	UINTN cwidth;
+	UINTN cheight;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt;
+} ui_glyphs_t;
+
+ui_glyphs_t *ui_font_get_glyphs(ui_font_t *font,
+				EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color,
+				EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color,
+				BOOLEAN bold, UINTN cwidth, UINTN cheight);
+void ui_font_free_glyphs(void);
 extern ui_font_t ui_fonts[];
 extern UINTN ui_fonts_nb;
 
@@ -91,15 +117,31 @@ typedef struct ui_textarea {
 	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color;
 	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color;
 	ui_font_t *font;
+	UINTN cwidth;
+	UINTN cheight;
 	INTN current;
 	UINTN width;
 	UINTN height;
 	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt;
+	/* Incremental rendering: the lines to render in the blt, the
+	   current line when the blt was rendered and the blt lines to
+	   draw on the screen.  */
+	BOOLEAN *dirty;
+	BOOLEAN rendered;
+	INTN rendered_current;
+	UINTN changed_first;
+	UINTN changed_last;
+	BOOLEAN drawn;
+	UINTN drawn_x;
+	UINTN drawn_y;
 } ui_textarea_t;
 
 ui_textarea_t *ui_textarea_create(UINTN line_nb, UINTN row_nb, ui_font_t *font,
 				  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color,
 				  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color);
+ui_textarea_t *ui_textarea_create_text(const ui_textline_t *text, ui_font_t *font,
+				       UINTN width, UINTN height,
+				       EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color);
 EFI_STATUS ui_textarea_display_text(const ui_textline_t *text, ui_font_t *font,
 				    UINTN x, UINTN *y, UINTN width, UINTN height,
 				    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color);
@@ -112,6 +154,7 @@ void ui_textarea_newline(ui_textarea_t *textarea, char *str,
 EFI_STATUS ui_textarea_draw_scale(ui_textarea_t *textarea, UINTN x, UINTN *y,
 				  UINTN width, UINTN height);
 EFI_STATUS ui_textarea_draw(ui_textarea_t *textarea, UINTN x, UINTN y);
+void ui_textarea_invalidate(ui_textarea_t *textarea);
 
 /* EFI Scan codes */
 #ifdef USE_POWER_BUTTON
@@ -150,6 +193,9 @@ typedef struct ui_boot_menu {
 	UINTN x;
 	UINTN y;
 	UINTN max_width;
+	UINTN image_height;
+	ui_textarea_t *help;
+	UINTN help_width;
 } ui_boot_menu_t;
 ui_boot_menu_t *ui_boot_menu_create(ui_boot_action_t *actions);
 UINTN ui_boot_menu_draw(ui_boot_menu_t *menu, UINTN x, UINTN *y, UINTN max_width);
@@ -173,6 +219,11 @@ EFI_STATUS ui_display_texts(const ui_textline_t **texts, UINTN x, UINTN y,
 			    UINTN linesarea, UINTN colsarea);
 EFI_STATUS ui_draw_blt(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt, UINTN x, UINTN y,
 		       UINTN width, UINTN height);
+EFI_STATUS ui_draw_blt_lines(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt, UINTN x, UINTN y,
+			     UINTN width, UINTN first, UINTN nb);
+EFI_STATUS ui_back_buffer_enable(void);
+void ui_back_buffer_disable(void);
+EFI_STATUS ui_flush(void);
 void ui_print(CHAR16 *fmt, ...);
 void ui_error(CHAR16 *fmt, ...);
 void ui_print_clear(void);
@@ -180,8 +231,8 @@ void ui_get_scaled_dimension(UINTN orig_width, UINTN orig_heigth,
 			     UINTN max_width, UINTN max_height,
 			     UINTN *width, UINTN *height);
 UINT64 ui_get_blt_size(UINTN width, UINTN height);
-void ui_bilinear_scale(unsigned char *s, unsigned char *d,
-		       int sx, int sy, int dx, int dy,
-		       int depth);
+EFI_STATUS ui_bilinear_scale(unsigned char *s, unsigned char *d,
+			     int sx, int sy, int dx, int dy,
+			     int depth);
 
 #endif  /* _UI_H_ */
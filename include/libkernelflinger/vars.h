@@ -80,6 +80,16 @@ extern const UINTN FASTBOOT_SECURED_VARS_SIZE;
 /* EFI variable to store the kernelflinger logs.  */
 #define LOG_VAR			L"KernelflingerLogs"
 
+/* EFI variable to store the boot phases time stamps.  */
+#define TIMESTAMPS_VAR		L"KernelflingerTimestamps"
+
+/* EFI variable to store the boot time regression samples.  */
+#define BOOT_BENCH_VAR		L"KernelflingerBootBench"
+
+/* EFI variable to store the graphic mode selected when the firmware
+   one is not usable.  */
+#define UI_MODE_VAR		L"KernelflingerGraphicMode"
+
 #ifndef USER
 #define CMDLINE_PREPEND_VAR     L"PrependCmdline"
 #define CMDLINE_APPEND_VAR      L"AppendCmdline"
@@ -100,9 +110,45 @@ BOOLEAN get_current_off_mode_charge(void);
 EFI_STATUS set_off_mode_charge(BOOLEAN enabled);
 BOOLEAN get_current_crash_event_menu(void);
 EFI_STATUS set_crash_event_menu(BOOLEAN enabled);
+BOOLEAN get_discard_dont_care(void);
+EFI_STATUS set_discard_dont_care(BOOLEAN enabled);
+BOOLEAN get_verify_flash(void);
+EFI_STATUS set_verify_flash(BOOLEAN enabled);
+BOOLEAN get_delta_flash(void);
+EFI_STATUS set_delta_flash(BOOLEAN enabled);
+BOOLEAN get_pipeline_flash(void);
+EFI_STATUS set_pipeline_flash(BOOLEAN enabled);
+BOOLEAN get_deferred_erase(void);
+EFI_STATUS set_deferred_erase(BOOLEAN enabled);
 BOOLEAN get_oemvars_update(void);
 EFI_STATUS set_oemvars_update(BOOLEAN updated);
 
+/* SHA-256 digest of the last boot image oemvars applied, see
+   set_image_oemvars_nocheck().  A NULL DIGEST forgets it.  */
+#define OEMVARS_DIGEST_SIZE 32
+BOOLEAN oemvars_digest_match(const UINT8 *digest);
+EFI_STATUS set_oemvars_digest(const UINT8 *digest);
+
+/* Partitions known to be erased, by first and last block, so that a
+   new erase can be skipped.  Anything writing blocks must forget the
+   ranges it overlaps, forget_all_erased_parts() before starting an
+   image that may write anywhere.  */
+BOOLEAN is_erased_part(UINT64 start, UINT64 end);
+EFI_STATUS set_erased_part(UINT64 start, UINT64 end);
+void forget_erased_parts(UINT64 start, UINT64 end);
+void forget_all_erased_parts(void);
+
+typedef struct ip_config {
+	EFI_IPv4_ADDRESS address;
+	EFI_IPv4_ADDRESS subnet;
+} ip_config_t;
+
+BOOLEAN get_ip_config_cache(void);
+EFI_STATUS set_ip_config_cache(BOOLEAN enabled);
+EFI_STATUS get_cached_ip_config(ip_config_t *config);
+EFI_STATUS set_cached_ip_config(ip_config_t *config);
+EFI_STATUS get_static_ip_config(ip_config_t *config);
+
 enum device_state {
 	UNKNOWN_STATE = -1,
 	LOCKED = 0,
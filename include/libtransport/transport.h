@@ -40,6 +40,49 @@
 typedef void (*data_callback_t)(void *buf, unsigned len);
 typedef void (*start_callback_t)(void);
 
+/* Network transports report their station address with an address
+   callback, once the IP configuration is known.  DHCP is carried on
+   by their run() function and given up after DHCP_TIMEOUT_US, the
+   transport then stays idle.  */
+typedef void (*address_callback_t)(EFI_IPv4_ADDRESS *address);
+#define DHCP_TIMEOUT_US	(5 * 1000 * 1000)
+#define DHCP_POLL_US	(100 * 1000)
+
+/* One piece of a message read with transport_readv_some() or
+   written with transport_writev().  */
+typedef struct transport_fragment {
+	void *buf;
+	UINT32 size;
+} transport_fragment_t;
+
+/* Transfer statistics.  Completion latencies are counted per
+   transfer size class (below 512B, 4KiB, 64KiB, 1MiB and above) in
+   decade buckets (below 10us, 100us, 1ms, 10ms, 100ms and above).  */
+#define TRANSPORT_SIZE_CLASSES		5
+#define TRANSPORT_LATENCY_BUCKETS	6
+
+/* Events only the backend sees: failures reported on completion and
+   requests it queues again by itself to carry on with a transfer
+   (receive queue refill, re-arm after a zero length packet...).  */
+typedef struct transport_counters {
+	UINT64 errors;
+	UINT64 rearms;
+} transport_counters_t;
+
+typedef struct transport_stats {
+	UINT64 rx_bytes;
+	UINT64 rx_transfers;
+	UINT64 tx_bytes;
+	UINT64 tx_transfers;
+	UINT64 errors;
+	UINT64 retries;		/* Requests refused with EFI_NOT_READY */
+	UINT64 rearms;
+	UINT32 latency[TRANSPORT_SIZE_CLASSES][TRANSPORT_LATENCY_BUCKETS];
+} transport_stats_t;
+
+/* transport_get_stats() index of the transport in use.  */
+#define TRANSPORT_CURRENT ((UINTN)-1)
+
 typedef struct transport {
 	const char *name;
 	EFI_STATUS (*start)(start_callback_t start_cb,
@@ -49,6 +92,27 @@ typedef struct transport {
 	EFI_STATUS (*run)(void);
 	EFI_STATUS (*read)(void *buf, UINT32 size);
 	EFI_STATUS (*write)(void *buf, UINT32 size);
+	/* Optional, write several fragments as one message.  The tx
+	   callback is called once with the first fragment and the
+	   total length.  */
+	EFI_STATUS (*writev)(transport_fragment_t *frags, UINTN count);
+	/* Optional, stream transports only.  Read in several fragments,
+	   the rx callback is called as soon as some data is received
+	   with the first fragment and the received length.  */
+	EFI_STATUS (*readv_some)(transport_fragment_t *frags, UINTN count);
+	/* Optional, size the reads must be a multiple of not to lose
+	   the data of a host transfer beyond them, the last read of
+	   the transfer excepted.  */
+	UINT32 (*read_granularity)(void);
+	/* Optional, number of writes which can be in flight at once, 1
+	   if absent.  */
+	UINTN (*write_depth)(void);
+	/* Optional, backend counters.  */
+	const transport_counters_t *(*counters)(void);
+	/* Optional, event signaled when run() has completions to
+	   report.  A transport without one, or returning NULL, can
+	   only be polled.  */
+	EFI_EVENT (*event)(void);
 } transport_t;
 
 EFI_STATUS transport_register(transport_t *trans, UINTN nb);
@@ -59,7 +123,21 @@ EFI_STATUS transport_start(start_callback_t start_cb,
 			   data_callback_t tx_cb);
 EFI_STATUS transport_stop(void);
 EFI_STATUS transport_run(void);
+/* Store in EVENTS, up to MAX, the events signaled when
+   transport_run() has something to process.  Returns their number,
+   0 if one of the transports in use can only be polled.  */
+UINTN transport_events(EFI_EVENT *events, UINTN max);
 EFI_STATUS transport_read(void *buf, UINT32 len);
 EFI_STATUS transport_write(void *buf, UINT32 len);
+EFI_STATUS transport_writev(transport_fragment_t *frags, UINTN count);
+EFI_STATUS transport_readv_some(transport_fragment_t *frags, UINTN count);
+/* Read granularity of the transport in use, 1 if it accepts any read
+   length.  */
+UINT32 transport_read_granularity(void);
+/* Number of writes the transport in use accepts in flight, 1 if it
+   only takes one at a time.  */
+UINTN transport_write_depth(void);
+EFI_STATUS transport_get_stats(UINTN index, const char **name,
+			       transport_stats_t *stats);
 
 #endif	/* _TRANSPORT_H_ */
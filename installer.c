@@ -36,6 +36,7 @@
 #include <transport.h>
 
 #include "lib.h"
+#include "crc32.h"
 #include "uefi_utils.h"
 #include "protocol.h"
 #include "flash.h"
@@ -51,11 +52,18 @@ static fastboot_handle fastboot_flash_cmd;
 static EFI_FILE_IO_INTERFACE *file_io_interface;
 static data_callback_t fastboot_rx_cb, fastboot_tx_cb;
 static CHAR8 DEFAULT_OPTIONS[] = "--batch installer.cmd";
-static BOOLEAN need_tx_cb;
+static UINTN need_tx_cb;
 static char *fastboot_cmd_buf;
 static UINTN fastboot_cmd_buf_len;
 static char command_buffer[256]; /* Large enough to fit long filename
 				    on flash command.  */
+/* The batch commands are slices of the batch files content which is
+   kept until all the commands have run.  */
+static text_slice_t *commands;
+static UINTN command_nb;
+static UINTN current_command;
+static VOID **batch_files;
+static UINTN batch_file_nb;
 
 #define inst_perror(ret, x, ...) do { \
 	fastboot_fail(x ": %r", ##__VA_ARGS__, ret); \
@@ -63,8 +71,9 @@ static char command_buffer[256]; /* Large enough to fit long filename
 
 static void flush_tx_buffer(void)
 {
+	/* One callback per INFO message written */
 	while (need_tx_cb) {
-		need_tx_cb = FALSE;
+		need_tx_cb--;
 		fastboot_tx_cb(NULL, 0);
 	}
 }
@@ -97,196 +106,480 @@ static EFI_STATUS read_file(EFI_FILE *file, UINTN size, void *data)
 	return ret;
 }
 
+/* The file is read through the EFI_FILE_PROTOCOL revision 2 ReadEx()
+   function when the file system driver provides it so that the next
+   piece of the file is read while the current one is flashed.
+   Otherwise, file_read_start() reads synchronously.  The errors are
+   reported by file_read_wait().  */
+struct file_reader {
+	EFI_FILE *file;
+	BOOLEAN async;
+	BOOLEAN busy;
+	UINTN size;
+	UINTN read;
+	EFI_STATUS status;
+#ifdef EFI_FILE_PROTOCOL_REVISION2
+	EFI_FILE_IO_TOKEN token;
+#endif
+};
+
+static void file_reader_init(struct file_reader *r, EFI_FILE *file)
+{
+	ZeroMem(r, sizeof(*r));
+	r->file = file;
+#ifdef EFI_FILE_PROTOCOL_REVISION2
+	if (file->Revision < EFI_FILE_PROTOCOL_REVISION2)
+		return;
+
+	r->async = !EFI_ERROR(uefi_call_wrapper(BS->CreateEvent, 5, 0, 0,
+						NULL, NULL, &r->token.Event));
+#endif
+}
+
+static void file_read_start(struct file_reader *r, UINTN size, void *data)
+{
+	r->size = size;
+#ifdef EFI_FILE_PROTOCOL_REVISION2
+	if (r->async) {
+		r->token.Status = EFI_SUCCESS;
+		r->token.BufferSize = size;
+		r->token.Buffer = data;
+		r->status = uefi_call_wrapper(r->file->ReadEx, 2, r->file, &r->token);
+		if (!EFI_ERROR(r->status)) {
+			r->busy = TRUE;
+			return;
+		}
+		/* Fallback to synchronous reads */
+		r->async = FALSE;
+		uefi_call_wrapper(BS->CloseEvent, 1, r->token.Event);
+	}
+#endif
+	r->read = size;
+	r->status = uefi_call_wrapper(r->file->Read, 3, r->file, &r->read, data);
+}
+
+static void file_read_complete(struct file_reader *r)
+{
+#ifdef EFI_FILE_PROTOCOL_REVISION2
+	UINTN index;
+
+	if (!r->busy)
+		return;
+
+	uefi_call_wrapper(BS->WaitForEvent, 3, 1, &r->token.Event, &index);
+	r->busy = FALSE;
+	r->status = r->token.Status;
+	r->read = r->token.BufferSize;
+#else
+	(void)r;
+#endif
+}
+
+static EFI_STATUS file_read_wait(struct file_reader *r)
+{
+	file_read_complete(r);
+	if (EFI_ERROR(r->status)) {
+		inst_perror(r->status, "Failed to read file");
+		return r->status;
+	}
+	if (r->read != r->size) {
+		fastboot_fail("Failed to read %d bytes (only %d read)",
+			      r->size, r->read);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static void file_reader_close(struct file_reader *r)
+{
+	file_read_complete(r);
+#ifdef EFI_FILE_PROTOCOL_REVISION2
+	if (r->async)
+		uefi_call_wrapper(BS->CloseEvent, 1, r->token.Event);
+#endif
+}
+
 typedef struct flash_buffer {
 	struct sparse_header sph;
 	struct chunk_header skip_ckh;
-	union {
-		struct chunk_header ckh;
-		char data[1];
-	} d;
-	char ckh_data[1];
+	char data[];
 } __attribute__((__packed__)) flash_buffer_t;
 
-/* This function splits a chunk too large to fit into a
-   MAX_DOWNLOAD_SIZE buffer into smaller chunks and flash them. */
-static EFI_STATUS installer_flash_big_chunk(EFI_FILE *file, UINTN *remaining_data,
-					    flash_buffer_t *fb, UINTN argc, CHAR8 **argv)
-{
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
-	UINTN payload_size, read_size, already_read, ckh_blks, data_size;
-	const UINTN MAX_DATA_SIZE = MAX_DOWNLOAD_SIZE - offsetof(flash_buffer_t, ckh_data);
-	const UINTN MAX_BLKS = MAX_DATA_SIZE / fb->sph.blk_sz;
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	struct chunk_header *ckh;
-	void *read_ptr;
-
-	ckh = &fb->d.ckh;
-	payload_size = ckh->total_sz - sizeof(*ckh);
-	fb->sph.total_chunks = 2; /* skip and data chunks. */
-
-	for (ckh_blks = ckh->chunk_sz; ckh_blks; ckh_blks -= ckh->chunk_sz) {
-		ckh->chunk_sz = min(MAX_BLKS, ckh_blks);
-		data_size = ckh->chunk_sz * fb->sph.blk_sz;
-		ckh->total_sz = sizeof(*ckh) + data_size;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz + ckh->chunk_sz;
-
-		installer_flash_buffer(fb, ckh->total_sz + HEADER_SIZE, argc, argv);
-		if (!last_cmd_succeeded)
-			return EFI_INVALID_PARAMETER;
+/* The input sparse file is flashed by windows of FLASH_WINDOW_SIZE
+   bytes through two buffers: the next window is read while the
+   current one is flashed.  Each window starts with a new sparse
+   header and with a skip chunk covering the blocks already flashed.
+   A raw chunk which does not fit in the window is split on a block
+   boundary so that only its partial last block and its header are
+   carried to the next window.  The CRC32 of the image covers all the
+   windows, it is checked here and the CRC32 chunks are flashed as
+   empty DONT_CARE chunks.  */
+#define FLASH_WINDOW_SIZE (64 * 1024 * 1024)
+#define FLASH_WINDOWS 2
+
+struct carry {
+	BOOLEAN split;
+	struct chunk_header ckh;
+	void *data;
+	UINTN len;
+	UINT32 crc;		/* CRC32 of the image flashed so far */
+};
 
-		payload_size -= data_size;
-		if (!payload_size)
+/* Account the LEN bytes of data of the chunk CKH in the image CRC32.
+   Return FALSE on a CRC32 chunk mismatch.  */
+static BOOLEAN window_crc(struct chunk_header *ckh, struct sparse_header *sph,
+			  UINTN len, struct carry *carry)
+{
+	UINT64 size = (UINT64)ckh->chunk_sz * sph->blk_sz;
+	void *data = (void *)ckh + sizeof(*ckh);
+	UINT32 word;
+
+	switch (ckh->chunk_type) {
+	case CHUNK_TYPE_RAW:
+		carry->crc = crc32_update(carry->crc, data, len);
+		break;
+	case CHUNK_TYPE_FILL:
+		if (len < sizeof(word))
+			break;
+		memcpy(&word, data, sizeof(word));
+		carry->crc = crc32_fill(carry->crc, word, size);
+		break;
+	case CHUNK_TYPE_DONT_CARE:
+		carry->crc = crc32_fill(carry->crc, 0, size);
+		break;
+	case CHUNK_TYPE_CRC32:
+		if (len < sizeof(word))
 			break;
+		memcpy(&word, data, sizeof(word));
+		if (word != carry->crc) {
+			error(L"sparse image CRC32 mismatch, expected 0x%08x, got 0x%08x",
+			      word, carry->crc);
+			return FALSE;
+		}
+		ckh->chunk_type = CHUNK_TYPE_DONT_CARE;
+		break;
+	}
+
+	return TRUE;
+}
+
+/* Build the headers of the FB window holding LEN bytes of chunks.
+   Return the size to flash, 0 if the window does not hold a single
+   chunk and the data to carry to the next window in CARRY.  */
+static UINTN prepare_window(flash_buffer_t *fb, UINTN len,
+			    struct sparse_header *sph, UINT32 *blk_count,
+			    INTN *nb_chunks, struct carry *carry)
+{
+	struct chunk_header *ckh = (struct chunk_header *)fb->data;
+	void *end = fb->data + len;
+	UINTN blks;
 
-		/* Move the incomplete data from the end to the
-		   beginning of the buffer. */
-		read_ptr = fb->ckh_data;
-		read_size = min(payload_size, MAX_DATA_SIZE);
-		if (data_size < MAX_DATA_SIZE) {
-			already_read = MAX_DATA_SIZE - data_size;
-			memcpy(read_ptr, fb->d.data + ckh->total_sz, already_read);
-			read_size -= already_read;
-			read_ptr += already_read;
+	memcpy(&fb->sph, sph, sizeof(*sph));
+	fb->sph.total_chunks = 1;
+	fb->sph.total_blks = fb->skip_ckh.chunk_sz = *blk_count;
+	fb->skip_ckh.chunk_type = CHUNK_TYPE_DONT_CARE;
+	fb->skip_ckh.reserved1 = 0;
+	fb->skip_ckh.total_sz = sizeof(fb->skip_ckh);
+
+	carry->split = FALSE;
+	carry->len = 0;
+
+	while (*nb_chunks > 0 && (void *)ckh + sizeof(*ckh) <= end) {
+		if (ckh->total_sz < sizeof(*ckh))
+			return 0;
+
+		if ((void *)ckh + ckh->total_sz <= end) {
+			if (!window_crc(ckh, sph, ckh->total_sz - sizeof(*ckh), carry))
+				return 0;
+			fb->sph.total_blks += ckh->chunk_sz;
+			fb->sph.total_chunks++;
+			*blk_count += ckh->chunk_sz;
+			(*nb_chunks)--;
+			ckh = (void *)ckh + ckh->total_sz;
+			continue;
 		}
 
-		ret = read_file(file, read_size, read_ptr);
-		if (EFI_ERROR(ret))
-			return ret;
-		*remaining_data -= read_size;
+		if (ckh->chunk_type != CHUNK_TYPE_RAW)
+			break;
 
-		fb->skip_ckh.chunk_sz += ckh->chunk_sz;
+		blks = (end - (void *)ckh - sizeof(*ckh)) / sph->blk_sz;
+		if (!blks)
+			break;
+
+		/* Flash the complete blocks of this raw chunk and carry
+		   the rest of it with a new header.  */
+		carry->split = TRUE;
+		carry->ckh = *ckh;
+		carry->ckh.chunk_sz -= blks;
+		carry->ckh.total_sz -= blks * sph->blk_sz;
+		ckh->chunk_sz = blks;
+		ckh->total_sz = sizeof(*ckh) + blks * sph->blk_sz;
+		window_crc(ckh, sph, blks * sph->blk_sz, carry);
+		fb->sph.total_blks += blks;
+		fb->sph.total_chunks++;
+		*blk_count += blks;
+		ckh = (void *)ckh + ckh->total_sz;
+		break;
 	}
 
-	if (payload_size)
-		return EFI_INVALID_PARAMETER;
+	carry->data = ckh;
+	carry->len = *nb_chunks > 0 ? end - (void *)ckh : 0;
 
-	return EFI_SUCCESS;
+	if (fb->sph.total_chunks == 1)
+		return 0;
+	return (void *)ckh - (void *)fb;
 }
 
-/* This function splits a huge sparse file into smaller ones and flash
-   them. */
-static void installer_split_and_flash(CHAR16 *filename, UINTN size,
-				      UINTN argc, CHAR8 **argv)
+/* In batch mode, the file of the next flash command is opened and
+   its beginning, the first window of a sparse file to split or the
+   whole file otherwise, is read while the current command runs.  The
+   prefetch is only started if the file can be read asynchronously.
+   The read errors are reported by the command which uses it.  */
+static struct prefetch {
+	CHAR16 *filename;
+	EFI_FILE *file;
+	struct file_reader reader;
+	UINTN size;
+	struct sparse_header sph;
+	void *data;
+} prefetch;
+
+static BOOLEAN is_flash_command(const char *cmd)
 {
-	EFI_STATUS ret;
+	return !strncmp((CHAR8 *)cmd, (CHAR8 *)"flash", 5) &&
+		(cmd[5] == ' ' || cmd[5] == ':');
+}
+
+/* Return the file name of the next command if it is a flash one */
+static CHAR16 *next_flash_filename(void)
+{
+	char cmd[sizeof(command_buffer)], *saveptr, *file;
+	UINTN len;
+
+	if (current_command >= command_nb)
+		return NULL;
+
+	len = commands[current_command].len;
+	if (len >= sizeof(cmd))
+		return NULL;
+	memcpy(cmd, commands[current_command].ptr, len);
+	cmd[len] = '\0';
+	if (!is_flash_command(cmd))
+		return NULL;
+
+	if (!strtok_r(cmd, ": ", &saveptr) || !strtok_r(NULL, " ", &saveptr))
+		return NULL;
+	file = strtok_r(NULL, " ", &saveptr);
+	if (!file || strtok_r(NULL, " ", &saveptr))
+		return NULL;
+
+	return stra_to_str((CHAR8 *)file);
+}
+
+static void prefetch_release(void)
+{
+	if (prefetch.filename)
+		FreePool(prefetch.filename);
+	ZeroMem(&prefetch, sizeof(prefetch));
+}
+
+static void prefetch_cancel(void)
+{
+	if (!prefetch.filename)
+		return;
+
+	file_reader_close(&prefetch.reader);
+	if (prefetch.data)
+		FreePool(prefetch.data);
+	uefi_call_wrapper(prefetch.file->Close, 1, prefetch.file);
+	prefetch_release();
+}
+
+/* Return TRUE if the prefetched file is FILENAME, otherwise drop the
+   prefetch */
+static BOOLEAN prefetch_match(CHAR16 *filename)
+{
+	if (prefetch.filename && !StrCmp(prefetch.filename, filename))
+		return TRUE;
+
+	prefetch_cancel();
+	return FALSE;
+}
+
+static void prefetch_start(void)
+{
+	const UINTN MAX_DATA_SIZE = FLASH_WINDOW_SIZE - sizeof(flash_buffer_t);
 	flash_buffer_t *fb;
-	struct sparse_header sph;
-	struct chunk_header *ckh;
-	void *buf;
-	UINTN read_size, flash_size, already_read, remaining_data = size;
-	void *read_ptr;
-	INTN nb_chunks;
-	EFI_FILE *file;
-	UINT32 blk_count;
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	const UINTN MAX_DATA_SIZE = MAX_DOWNLOAD_SIZE - HEADER_SIZE;
+	CHAR16 *filename;
+	EFI_STATUS ret;
+	UINTN size, len;
 
-	ret = uefi_open_file(file_io_interface, filename, &file);
-	if (EFI_ERROR(ret)) {
-		inst_perror(ret, "Failed to open %s file", filename);
+	if (prefetch.filename)
 		return;
-	}
 
-	ret = read_file(file, sizeof(sph), &sph);
-	if (EFI_ERROR(ret))
+	filename = next_flash_filename();
+	if (!filename)
 		return;
-	remaining_data -= sizeof(sph);
 
-	if (!is_sparse_image((void *) &sph, sizeof(sph))) {
-		fastboot_fail("sparse file expected");
+	ret = uefi_get_file_size(file_io_interface, filename, &size);
+	if (EFI_ERROR(ret) || !size) {
+		FreePool(filename);
 		return;
 	}
 
-	buf = AllocatePool(MAX_DOWNLOAD_SIZE);
-	if (!buf) {
-		fastboot_fail("Failed to allocate %d bytes", MAX_DOWNLOAD_SIZE);
+	ret = uefi_open_file(file_io_interface, filename, &prefetch.file);
+	if (EFI_ERROR(ret)) {
+		FreePool(filename);
+		return;
+	}
+	prefetch.filename = filename;
+	prefetch.size = size;
+
+	file_reader_init(&prefetch.reader, prefetch.file);
+	if (!prefetch.reader.async)
+		goto cancel;
+
+	if (size <= MAX_DOWNLOAD_SIZE) {
+		prefetch.data = AllocatePool(size);
+		if (!prefetch.data)
+			goto cancel;
+		file_read_start(&prefetch.reader, size, prefetch.data);
 		return;
 	}
-	fb = buf;
-
-	/* New sparse header. */
-	memcpy(&fb->sph, &sph, sizeof(sph));
-
-	/* Sparse skip chunk. */
-	fb->skip_ckh.chunk_type = CHUNK_TYPE_DONT_CARE;
-	fb->skip_ckh.total_sz = sizeof(fb->skip_ckh);
-
-	nb_chunks = sph.total_chunks;
-	read_size = MAX_DATA_SIZE;
-	read_ptr = fb->d.data;
-	blk_count = 0;
 
-	while (nb_chunks > 0 && remaining_data > 0) {
-		fb->sph.total_chunks = 1;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz = blk_count;
+	len = sizeof(prefetch.sph);
+	ret = uefi_call_wrapper(prefetch.file->Read, 3, prefetch.file,
+				&len, &prefetch.sph);
+	if (EFI_ERROR(ret) || len != sizeof(prefetch.sph) ||
+	    !is_sparse_image((void *)&prefetch.sph, sizeof(prefetch.sph)))
+		goto cancel;
+
+	fb = prefetch.data = AllocatePool(FLASH_WINDOW_SIZE);
+	if (!fb)
+		goto cancel;
+	file_read_start(&prefetch.reader,
+			min(size - sizeof(prefetch.sph), MAX_DATA_SIZE), fb->data);
+	return;
+
+cancel:
+	prefetch_cancel();
+}
 
-		if (remaining_data < read_size)
-			read_size = remaining_data;
+/* This function splits a huge sparse file into smaller ones and flash
+   them. */
+static void installer_split_and_flash(CHAR16 *filename, UINTN size,
+				      UINTN argc, CHAR8 **argv)
+{
+	const UINTN MAX_DATA_SIZE = FLASH_WINDOW_SIZE - sizeof(flash_buffer_t);
+	EFI_STATUS ret;
+	struct file_reader reader;
+	flash_buffer_t *fbs[FLASH_WINDOWS] = { NULL }, *fb, *next;
+	struct sparse_header sph;
+	struct carry carry;
+	UINTN read_size, flash_size, len, remaining_data = size, i;
+	INTN nb_chunks;
+	EFI_FILE *file;
+	UINT32 blk_count = 0;
+
+	/* The token of a read in progress cannot move */
+	if (prefetch.filename) {
+		file_read_complete(&prefetch.reader);
+		reader = prefetch.reader;
+		file = prefetch.file;
+		sph = prefetch.sph;
+		fbs[0] = prefetch.data;
+		read_size = reader.size;
+		remaining_data -= sizeof(sph) + read_size;
+		prefetch_release();
+	} else {
+		ret = uefi_open_file(file_io_interface, filename, &file);
+		if (EFI_ERROR(ret)) {
+			inst_perror(ret, "Failed to open %s file", filename);
+			return;
+		}
 
-		/* Read a new piece of the input sparse file. */
-		ret = read_file(file, read_size, read_ptr);
+		ret = read_file(file, sizeof(sph), &sph);
 		if (EFI_ERROR(ret))
-			goto exit;
-		remaining_data -= read_size;
+			goto close;
+		remaining_data -= sizeof(sph);
 
-		/* Process the loaded chunks to build the new header
-		   and the skip chunk. */
-		flash_size = HEADER_SIZE;
-		ckh = &fb->d.ckh;
-		while ((void *)ckh + sizeof(*ckh) <= read_ptr + read_size &&
-		       (void *)ckh + ckh->total_sz <= read_ptr + read_size) {
-			if (nb_chunks == 0) {
-				fastboot_fail("Corrupted sparse file: too many chunks");
-				goto exit;
-			}
-			flash_size += ckh->total_sz;
-			fb->sph.total_blks += ckh->chunk_sz;
-			blk_count += ckh->chunk_sz;
-			fb->sph.total_chunks++;
-			nb_chunks--;
-			ckh = (void *)ckh + ckh->total_sz;
+		if (!is_sparse_image((void *) &sph, sizeof(sph))) {
+			fastboot_fail("sparse file expected");
+			goto close;
 		}
+		file_reader_init(&reader, file);
+	}
 
-		/* chunk is too big to fit in the download buffer. */
-		if (flash_size == HEADER_SIZE) {
-			if (ckh->chunk_type != CHUNK_TYPE_RAW ||
-			    remaining_data < ckh->total_sz - MAX_DATA_SIZE) {
-				fastboot_fail("Corrupted sparse file");
-				goto exit;
-			}
+	if (sph.blk_sz > MAX_DATA_SIZE / 2) {
+		fastboot_fail("Unsupported sparse block size %d", sph.blk_sz);
+		goto reader_close;
+	}
 
-			blk_count += ckh->chunk_sz;
-			nb_chunks--;
+	for (i = 0; i < FLASH_WINDOWS; i++) {
+		if (fbs[i])
+			continue;
+		fbs[i] = AllocatePool(FLASH_WINDOW_SIZE);
+		if (!fbs[i]) {
+			fastboot_fail("Failed to allocate %d bytes", FLASH_WINDOW_SIZE);
+			goto reader_close;
+		}
+	}
 
-			ret = installer_flash_big_chunk(file, &remaining_data,
-							fb, argc, argv);
-			if (EFI_ERROR(ret))
-				goto exit;
+	nb_chunks = sph.total_chunks;
+	carry.crc = 0;
+	fb = fbs[0];
+	len = 0;
+	if (!reader.size) {
+		read_size = min(remaining_data, MAX_DATA_SIZE);
+		file_read_start(&reader, read_size, fb->data);
+		remaining_data -= read_size;
+	}
 
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-			continue;
+	while (read_size) {
+		ret = file_read_wait(&reader);
+		if (EFI_ERROR(ret))
+			goto reader_close;
+		len += read_size;
+
+		flash_size = prepare_window(fb, len, &sph, &blk_count,
+					    &nb_chunks, &carry);
+		if (!flash_size || (nb_chunks > 0 && !remaining_data)) {
+			fastboot_fail("Corrupted sparse file");
+			goto reader_close;
+		}
+
+		/* Start the read of the next window */
+		next = fbs[fb == fbs[0]];
+		len = 0;
+		if (carry.split) {
+			memcpy(next->data, &carry.ckh, sizeof(carry.ckh));
+			len = sizeof(carry.ckh);
 		}
+		memcpy(next->data + len, carry.data, carry.len);
+		len += carry.len;
 
-		installer_flash_buffer(buf, flash_size, argc, argv);
+		read_size = nb_chunks > 0 ? min(remaining_data, MAX_DATA_SIZE - len) : 0;
+		if (read_size) {
+			file_read_start(&reader, read_size, next->data + len);
+			remaining_data -= read_size;
+		} else
+			prefetch_start();
+
+		installer_flash_buffer(fb, flash_size, argc, argv);
 		if (!last_cmd_succeeded)
-			goto exit;
+			goto reader_close;
 
-		/* Move the incomplete chunk from the end to the
-		   beginning of the buffer. */
-		if (buf + flash_size < read_ptr + read_size) {
-			already_read = read_ptr + read_size - (void *)ckh;
-			memcpy(fb->d.data, ckh, already_read);
-			read_size = MAX_DATA_SIZE - already_read;
-			read_ptr = fb->d.data + already_read;
-		} else {
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-		}
+		fb = next;
 	}
 
-exit:
-	FreePool(buf);
+reader_close:
+	file_reader_close(&reader);
+	for (i = 0; i < FLASH_WINDOWS; i++)
+		if (fbs[i])
+			FreePool(fbs[i]);
+close:
+	uefi_call_wrapper(file->Close, 1, file);
 }
 
 static void installer_flash_cmd(INTN argc, CHAR8 **argv)
@@ -310,10 +603,14 @@ static void installer_flash_cmd(INTN argc, CHAR8 **argv)
 		return;
 	}
 
-	ret = uefi_get_file_size(file_io_interface, filename, &size);
-	if (EFI_ERROR(ret)) {
-		inst_perror(ret, "Failed to get %s file size", filename);
-		goto exit;
+	if (prefetch_match(filename))
+		size = prefetch.size;
+	else {
+		ret = uefi_get_file_size(file_io_interface, filename, &size);
+		if (EFI_ERROR(ret)) {
+			inst_perror(ret, "Failed to get %s file size", filename);
+			goto exit;
+		}
 	}
 
 	if (size > MAX_DOWNLOAD_SIZE) {
@@ -321,12 +618,24 @@ static void installer_flash_cmd(INTN argc, CHAR8 **argv)
 		goto exit;
 	}
 
-	ret = uefi_read_file(file_io_interface, filename, &data, &size);
-	if (EFI_ERROR(ret)) {
-		inst_perror(ret, "Unable to read file %s", filename);
-		goto exit;
+	if (prefetch.filename) {
+		ret = file_read_wait(&prefetch.reader);
+		data = prefetch.data;
+		prefetch.data = NULL;
+		prefetch_cancel();
+		if (EFI_ERROR(ret)) {
+			FreePool(data);
+			goto exit;
+		}
+	} else {
+		ret = uefi_read_file(file_io_interface, filename, &data, &size);
+		if (EFI_ERROR(ret)) {
+			inst_perror(ret, "Unable to read file %s", filename);
+			goto exit;
+		}
 	}
 
+	prefetch_start();
 	installer_flash_buffer(data, size, argc, argv);
 	FreePool(data);
 
@@ -361,7 +670,8 @@ static CHAR16 *get_format_image_filename(CHAR8 *label)
 	return filename16;
 }
 
-/* Simulate the fastboot host format command:
+/* The ext4 partitions are formatted on the device.  Otherwise,
+   simulate the fastboot host format command:
    1. get a filesystem image from a file;
    2. erase the partition;
    3. flash the filesystem image; */
@@ -370,7 +680,23 @@ static void installer_format(INTN argc, CHAR8 **argv)
 	EFI_STATUS ret;
 	void *data = NULL;
 	UINTN size;
-	CHAR16 *filename;
+	CHAR16 *filename, *label;
+
+	label = stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Unable to allocate CHAR16 label buffer");
+		return;
+	}
+	ret = format_by_label(label);
+	FreePool(label);
+	if (!EFI_ERROR(ret)) {
+		fastboot_okay("");
+		return;
+	}
+	if (ret != EFI_UNSUPPORTED) {
+		inst_perror(ret, "Unable to format %a", argv[1]);
+		return;
+	}
 
 	filename = get_format_image_filename(argv[1]);
 	if (!filename)
@@ -399,59 +725,74 @@ free_filename:
 	FreePool(filename);
 }
 
-static char **commands;
-static UINTN command_nb;
-static UINTN current_command;
-
 static void free_commands(void)
 {
 	UINTN i;
 
-	if (!commands)
-		return;
-
-	for (i = 0; i < command_nb; i++)
-		if (commands[i])
-			FreePool(commands);
+	for (i = 0; i < batch_file_nb; i++)
+		FreePool(batch_files[i]);
+	if (batch_files)
+		FreePool(batch_files);
+	batch_files = NULL;
+	batch_file_nb = 0;
 
-	FreePool(commands);
+	if (commands)
+		FreePool(commands);
 	commands = NULL;
 	command_nb = 0;
 	current_command = 0;
 }
 
-static EFI_STATUS store_command(char *command, VOID *context _unused)
+/* The commands of a nested batch file are appended to the current
+   list, as they were when they were copied one by one.  If OWNED,
+   DATA is released with the commands.  */
+static EFI_STATUS store_commands(VOID *data, UINTN size, BOOLEAN owned)
 {
-	char **new_commands;
+	text_slice_t *new_commands, line;
+	text_iter_t it;
+	VOID **new_files;
+	UINTN nb = 0;
+
+	if (owned) {
+		new_files = AllocatePool((batch_file_nb + 1) * sizeof(*new_files));
+		if (!new_files)
+			return EFI_OUT_OF_RESOURCES;
+		memcpy(new_files, batch_files, batch_file_nb * sizeof(*batch_files));
+		if (batch_files)
+			FreePool(batch_files);
+		batch_files = new_files;
+	}
 
-	new_commands = AllocatePool((command_nb + 1) * sizeof(*new_commands));
-	if (!new_commands) {
-		free_commands();
+	text_iter_init(&it, data, size);
+	while (text_next_line(&it, &line))
+		nb++;
+
+	new_commands = AllocatePool((command_nb + nb) * sizeof(*new_commands));
+	if (!new_commands)
 		return EFI_OUT_OF_RESOURCES;
-	}
 
 	memcpy(new_commands, commands, command_nb * sizeof(*commands));
-	new_commands[command_nb] = strdup(command);
-	if (!new_commands[command_nb]) {
-		free_commands();
-		return EFI_OUT_OF_RESOURCES;
-	}
+	text_iter_init(&it, data, size);
+	while (text_next_line(&it, &line))
+		new_commands[command_nb++] = line;
+
 	if (commands)
 		FreePool(commands);
 	commands = new_commands;
-	command_nb++;
+	if (owned)
+		batch_files[batch_file_nb++] = data;
 
 	return EFI_SUCCESS;
 }
 
-static char *next_command()
+static text_slice_t *next_command()
 {
 	if (command_nb == current_command) {
 		free_commands();
 		return NULL;
 	}
 
-	return commands[current_command++];
+	return &commands[current_command++];
 }
 
 static void batch(INTN argc, CHAR8 **argv)
@@ -480,11 +821,11 @@ static void batch(INTN argc, CHAR8 **argv)
 	}
 	FreePool(filename);
 
-	ret = parse_text_buffer(data, size, store_command, NULL);
-	FreePool(data);
-	if (EFI_ERROR(ret))
+	ret = store_commands(data, size, TRUE);
+	if (EFI_ERROR(ret)) {
+		FreePool(data);
 		inst_perror(ret, "Failed to parse batch file");
-	else
+	} else
 		fastboot_okay("");
 }
 
@@ -565,6 +906,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *_table)
 	enum boot_target target;
 
 	InitializeLib(image, _table);
+	log_levels_load();
 	g_parent_image = image;
 
 	ret = handle_protocol(image, &LoadedImageProtocol, (void **)&loaded_img);
@@ -596,8 +938,9 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *_table)
 	options = strchr(options, ' ');
 	skip_whitespace((char **)&options);
 
-	store_command(*options != '\0' ? (char *)options : (char *)DEFAULT_OPTIONS,
-		      NULL);
+	if (*options == '\0')
+		options = (CHAR8 *)DEFAULT_OPTIONS;
+	store_commands(options, strlen(options), FALSE);
 
 	/* Run the fastboot library. */
 	ret = fastboot_start(&bootimage, &efiimage, &imagesize, &target);
@@ -646,8 +989,7 @@ EFI_STATUS installer_transport_run(void)
 {
 	static BOOLEAN initialized = FALSE;
 	EFI_STATUS ret;
-	char *cmd;
-	UINTN cmd_len;
+	text_slice_t *cmd;
 
 	if (!initialized) {
 		ret = installer_replace_functions();
@@ -671,21 +1013,27 @@ EFI_STATUS installer_transport_run(void)
 	if (!cmd)
 		goto stop;
 
-	cmd_len = strlena((CHAR8 *)cmd);
-	if (cmd_len > fastboot_cmd_buf_len) {
+	if (cmd->len >= fastboot_cmd_buf_len) {
 		inst_perror(EFI_BUFFER_TOO_SMALL,
 			    "command too long for fastboot command buffer");
 		goto stop;
 	}
 
-	memcpy(fastboot_cmd_buf, cmd, cmd_len);
+	memcpy(fastboot_cmd_buf, cmd->ptr, cmd->len);
+	fastboot_cmd_buf[cmd->len] = '\0';
 
-	Print(L"Starting command: '%a'\n", cmd);
-	fastboot_rx_cb(fastboot_cmd_buf, cmd_len);
+	/* A flash command starts the prefetch once it has read its
+	   own file */
+	if (!is_flash_command(fastboot_cmd_buf))
+		prefetch_start();
+
+	Print(L"Starting command: '%a'\n", fastboot_cmd_buf);
+	fastboot_rx_cb(fastboot_cmd_buf, cmd->len);
 
 	return EFI_SUCCESS;
 
 stop:
+	prefetch_cancel();
 	fastboot_stop(NULL, NULL, 0, EXIT_SHELL);
 	return EFI_SUCCESS;
 }
@@ -707,7 +1055,7 @@ EFI_STATUS installer_transport_write(void *buf, UINT32 size)
 
 	if (!memcmp((CHAR8 *)"INFO", buf, PREFIX_LEN)) {
 		Print(L"(bootloader) %a\n", buf + PREFIX_LEN);
-		need_tx_cb = TRUE;
+		need_tx_cb++;
 	} if (!memcmp((CHAR8 *)"OKAY", buf, PREFIX_LEN)) {
 		if (((char *)buf)[PREFIX_LEN] != '\0')
 			Print(L"%a\n", buf + PREFIX_LEN);
@@ -763,6 +1111,23 @@ enum boot_target fastboot_ui_event_handler()
 	return UNKNOWN_TARGET;
 }
 
+void fastboot_ui_progress_start(__attribute__((__unused__)) UINT64 total,
+				__attribute__((__unused__)) UINT64 done)
+{
+}
+
+void fastboot_ui_progress_update(__attribute__((__unused__)) UINT64 done)
+{
+}
+
+void fastboot_ui_progress_refresh(void)
+{
+}
+
+void fastboot_ui_progress_stop(void)
+{
+}
+
 /* Installer does not support UI.  It is intended to be used in
    factory or for engineering purpose only.  */
 BOOLEAN fastboot_ui_confirm_for_state(__attribute__((__unused__)) enum device_state target)
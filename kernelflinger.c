@@ -53,6 +53,7 @@
 #include "em.h"
 #include "storage.h"
 #include "version.h"
+#include "timestamp.h"
 #ifdef HAL_AUTODETECT
 #include "blobstore.h"
 #endif
@@ -134,14 +135,19 @@ static enum boot_target check_fastboot_sentinel(VOID)
 }
 
 
-static enum boot_target check_magic_key(VOID)
-{
-        unsigned long i;
-        EFI_STATUS ret = EFI_NOT_READY;
+/* The magic key window is opened at the start of efi_main() and runs
+ * while the storage, the capsules and the boot target checks are set
+ * up.  check_magic_key() only waits for what is left of it.  */
+static struct {
+        BOOLEAN armed;
+        BOOLEAN pressed;
+        EFI_EVENT timer;
         EFI_INPUT_KEY key;
-#ifdef USERFASTBOOT
-        enum boot_target bt;
-#endif
+} magic_key;
+
+static unsigned long get_magic_key_timeout(VOID)
+{
+        EFI_STATUS ret;
         unsigned long wait_ms = EFI_RESET_WAIT_MS;
 
         /* Some systems require a short stall before we can be sure there
@@ -160,21 +166,104 @@ static enum boot_target check_magic_key(VOID)
         }
 
         debug(L"Reset wait time: %d", wait_ms);
+        return wait_ms;
+}
+
+static VOID arm_magic_key(VOID)
+{
+        EFI_STATUS ret;
+        unsigned long wait_ms;
+
+        wait_ms = get_magic_key_timeout();
+
+        ret = uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2,
+                                ST->ConIn, &magic_key.key);
+        if (ret == EFI_SUCCESS) {
+                magic_key.pressed = TRUE;
+                magic_key.armed = TRUE;
+                return;
+        }
+
+        ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0, NULL, NULL,
+                                &magic_key.timer);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to create the magic key timer");
+                return;
+        }
+
+        /* 100ns units */
+        ret = uefi_call_wrapper(BS->SetTimer, 3, magic_key.timer,
+                                TimerRelative, wait_ms * 10000);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to start the magic key timer");
+                uefi_call_wrapper(BS->CloseEvent, 1, magic_key.timer);
+                magic_key.timer = NULL;
+                return;
+        }
+
+        magic_key.armed = TRUE;
+}
+
+/* Close the magic key window, whether check_magic_key() ran or not */
+static VOID disarm_magic_key(VOID)
+{
+        if (magic_key.timer) {
+                uefi_call_wrapper(BS->CloseEvent, 1, magic_key.timer);
+                magic_key.timer = NULL;
+        }
+        magic_key.armed = FALSE;
+}
+
+static EFI_STATUS read_magic_key(EFI_INPUT_KEY *key)
+{
+        EFI_STATUS ret;
+        unsigned long i, wait_ms;
+
+        if (magic_key.pressed) {
+                *key = magic_key.key;
+                return EFI_SUCCESS;
+        }
 
         /* Check for 'magic' key. Some BIOSes are flaky about this
          * so wait for the ConIn to be ready after reset */
+        if (magic_key.armed) {
+                for (;;) {
+                        ret = uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2,
+                                                ST->ConIn, key);
+                        if (ret == EFI_SUCCESS ||
+                            uefi_call_wrapper(BS->CheckEvent, 1, magic_key.timer) == EFI_SUCCESS)
+                                break;
+                        uefi_call_wrapper(BS->Stall, 1, DETECT_KEY_STALL_TIME_MS * 1000);
+                }
+                disarm_magic_key();
+                return ret;
+        }
+
+        wait_ms = get_magic_key_timeout();
         for (i = 0; i <= wait_ms; i += DETECT_KEY_STALL_TIME_MS) {
                 ret = uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2,
-                                        ST->ConIn, &key);
+                                        ST->ConIn, key);
                 if (ret == EFI_SUCCESS || i == wait_ms)
                         break;
                 uefi_call_wrapper(BS->Stall, 1, DETECT_KEY_STALL_TIME_MS * 1000);
         }
 
+        return ret;
+}
+
+static enum boot_target check_magic_key(VOID)
+{
+        EFI_STATUS ret;
+        EFI_INPUT_KEY key;
+#ifdef USERFASTBOOT
+        enum boot_target bt;
+#endif
+
+        ret = read_magic_key(&key);
         if (EFI_ERROR(ret))
                 return NORMAL_BOOT;
 
-        debug(L"ReadKeyStroke: (%d tries) %d %d", i, key.ScanCode, key.UnicodeChar);
+        debug(L"ReadKeyStroke: %d %d", key.ScanCode, key.UnicodeChar);
         if (ui_keycode_to_event(key.ScanCode) != MAGIC_KEY)
                 return NORMAL_BOOT;
 
@@ -284,12 +373,11 @@ static enum boot_target check_loader_entry_one_shot(VOID)
 
         debug(L"checking %s", LOADER_ENTRY_ONESHOT);
         target = get_efi_variable_str(&loader_guid, LOADER_ENTRY_ONESHOT);
-
-        del_efi_variable(&loader_guid, LOADER_ENTRY_ONESHOT);
-
         if (!target)
                 return NORMAL_BOOT;
 
+        del_efi_variable(&loader_guid, LOADER_ENTRY_ONESHOT);
+
         debug(L"target = %s", target);
         ret = name_to_boot_target(target);
         if (ret == UNKNOWN_TARGET) {
@@ -517,91 +605,137 @@ enum boot_target check_battery()
         return NORMAL_BOOT;
 }
 
+struct boot_choice {
+        VOID *address;
+        CHAR16 *path;
+        BOOLEAN oneshot;
+};
+
+static enum boot_target check_command_line_choice(struct boot_choice *choice)
+{
+        return check_command_line(&choice->address);
+}
+
+static enum boot_target check_bcb_choice(struct boot_choice *choice)
+{
+        return check_bcb(&choice->path, &choice->oneshot);
+}
+
+/* A DNX oneshot target is not honored, the next checks still run */
+static enum boot_target check_loader_entry(VOID)
+{
+        enum boot_target ret;
+
+        ret = check_loader_entry_one_shot();
+        return ret == DNX ? NORMAL_BOOT : ret;
+}
+
+static enum boot_target check_battery_level(VOID)
+{
+        enum boot_target ret;
+
+        ret = check_battery();
+        if (ret == POWER_OFF)
+                ux_display_low_battery(3);
+        return ret;
+}
+
+static BOOLEAN off_mode_charge_enabled(VOID)
+{
+        return get_current_off_mode_charge();
+}
+
+static BOOLEAN crash_event_menu_enabled(VOID)
+{
+        return get_current_crash_event_menu();
+}
+
+/* What a check touches when it is not ruled out */
+enum check_cost {
+        COST_CHEAP,             /* Command line, RSCI and cached variables */
+        COST_STORAGE,           /* Reads the ESP or the misc partition */
+        COST_INPUT              /* Waits for the keyboard */
+};
+
 /* Policy:
- * 1. Check if we had multiple watchdog reported in a short period of
- *    time.  If so, let the user choose the boot target.
- * 2. Check if the "-a xxxxxxxxx" command line was passed in, if so load an
+ * 1. Check if the "-a xxxxxxxxx" command line was passed in, if so load an
  *    android boot image from RAM at that location.
- * 3. Check if the fastboot sentinel file \force_fastboot is present, and if
+ * 2. Check if the fastboot sentinel file \force_fastboot is present, and if
  *    so, force fastboot mode. Use in bootable media.
- * 4. Check for "magic key" being held. Short press loads Recovery. Long press
+ * 3. Check for "magic key" being held. Short press loads Recovery. Long press
  *    loads Fastboot.
+ * 4. Check if we had multiple watchdog reported in a short period of
+ *    time.  If so, let the user choose the boot target.
  * 5. Check if wake source is battery inserted, if so power off
  * 6. Check bootloader control block for a boot target, which could be
  *    the name of a boot image that we know how to read from a partition,
  *    or a boot image file in the ESP. BCB can specify oneshot or persistent
  *    targets.
  * 7. Check LoaderEntryOneShot for a boot target
- * 8. Check if we should go into charge mode or normal boot
+ * 8. Check the battery level and if we should go into charge mode or
+ *    normal boot
  *
- * target_address - If MEMORY returned, physical address to load data
+ * The checks are run in this order, the first one returning something
+ * else than NORMAL_BOOT wins.  NEEDED, when set, is a cheap test which
+ * rules the check out before it touches anything.  */
+static const struct boot_check {
+        const CHAR16 *name;
+        enum check_cost cost;
+        BOOLEAN (*needed)(VOID);
+        enum boot_target (*check)(VOID);
+        enum boot_target (*check_choice)(struct boot_choice *choice);
+} BOOT_CHECKS[] = {
+        { L"osloader command line", COST_CHEAP, NULL, NULL, check_command_line_choice },
+        { L"fastboot sentinel", COST_STORAGE, NULL, check_fastboot_sentinel, NULL },
+        { L"magic key", COST_INPUT, NULL, check_magic_key, NULL },
+        { L"watchdog", COST_CHEAP, crash_event_menu_enabled, check_watchdog, NULL },
+        { L"battery insertion", COST_CHEAP, off_mode_charge_enabled, check_battery_inserted, NULL },
+        { L"BCB", COST_STORAGE, NULL, NULL, check_bcb_choice },
+        { L"reboot target", COST_CHEAP, NULL, check_loader_entry, NULL },
+        { L"battery level", COST_CHEAP, off_mode_charge_enabled, check_battery_level, NULL },
+        { L"charger insertion", COST_CHEAP, off_mode_charge_enabled, check_charge_mode, NULL }
+};
+
+/* target_address - If MEMORY returned, physical address to load data
  * target_path - If ESP_EFI_BINARY or ESP_BOOTIMAGE returned, path to the
  *               image on the EFI System Partition
  * oneshot - Whether this is a one-shot boot, indicating that the image at
  *           target_path should be deleted before chainloading
- *
  */
 static enum boot_target choose_boot_target(VOID **target_address,
                 CHAR16 **target_path, BOOLEAN *oneshot)
 {
-        enum boot_target ret;
-
-        *target_path = NULL;
-        *target_address = NULL;
-        *oneshot = TRUE;
+        static const CHAR16 *COST_NAMES[] = { L"cheap", L"storage", L"input" };
+        struct boot_choice choice = { NULL, NULL, TRUE };
+        const struct boot_check *check;
+        enum boot_target ret = NORMAL_BOOT;
+        UINTN i;
 
 #if DEBUG_MESSAGES
         print_rsci_values();
 #endif
         debug(L"Bootlogic: Choosing boot target");
 
-        debug(L"Bootlogic: Check osloader command line...");
-        ret = check_command_line(target_address);
-        if (ret != NORMAL_BOOT)
-                goto out;
+        for (i = 0; i < ARRAY_SIZE(BOOT_CHECKS); i++) {
+                check = &BOOT_CHECKS[i];
+                if (check->needed && !check->needed()) {
+                        debug(L"Bootlogic: Skip %s", check->name);
+                        continue;
+                }
 
-        debug(L"Bootlogic: Check fastboot sentinel...");
-        ret = check_fastboot_sentinel();
-        if (ret != NORMAL_BOOT) {
-                goto out;
+                debug(L"Bootlogic: Check %s (%s)...", check->name,
+                      COST_NAMES[check->cost]);
+                ret = check->check ? check->check() :
+                        check->check_choice(&choice);
+                if (ret != NORMAL_BOOT)
+                        break;
         }
+        disarm_magic_key();
 
-        debug(L"Bootlogic: Check magic key...");
-        ret = check_magic_key();
-        if (ret != NORMAL_BOOT)
-                goto out;
-
-        debug(L"Bootlogic: Check watchdog...");
-        ret = check_watchdog();
-        if (ret != NORMAL_BOOT)
-                goto out;
-
-        debug(L"Bootlogic: Check battery insertion...");
-        ret = check_battery_inserted();
-        if (ret != NORMAL_BOOT)
-                goto out;
-
-        debug(L"Bootlogic: Check BCB...");
-        ret = check_bcb(target_path, oneshot);
-        if (ret != NORMAL_BOOT)
-                goto out;
-
-        debug(L"Bootlogic: Check reboot target...");
-        ret = check_loader_entry_one_shot();
-        if (ret != DNX && ret != NORMAL_BOOT)
-                goto out;
-
-        debug(L"Bootlogic: Check battery level...");
-        ret = check_battery();
-        if (ret == POWER_OFF)
-                ux_display_low_battery(3);
-        if (ret != NORMAL_BOOT)
-                goto out;
+        *target_address = choice.address;
+        *target_path = choice.path;
+        *oneshot = choice.oneshot;
 
-        debug(L"Bootlogic: Check charger insertion...");
-        ret = check_charge_mode();
-
-out:
         debug(L"Bootlogic: selected '%s'",  boot_target_description(ret));
         return ret;
 }
@@ -744,6 +878,7 @@ static EFI_STATUS enter_efi_binary(CHAR16 *path, BOOLEAN delete)
                         if (EFI_ERROR(ret))
                                 efi_perror(ret, L"Couldn't delete %s", path);
                 }
+                forget_all_erased_parts();
                 ret = uefi_call_wrapper(BS->StartImage, 3, image, NULL, NULL);
                 uefi_call_wrapper(BS->UnloadImage, 1, image);
         }
@@ -755,6 +890,36 @@ static EFI_STATUS enter_efi_binary(CHAR16 *path, BOOLEAN delete)
 #define OEMVARS_MAGIC           "#OEMVARS\n"
 #define OEMVARS_MAGIC_SZ        9
 
+/* Apply OEMVARS unless the very same blob, with the same GUID
+   restriction, was the last one applied.  */
+static EFI_STATUS apply_image_oemvars(VOID *oemvars, UINTN osz,
+                                      const EFI_GUID *restricted_guid)
+{
+        SHA256_CTX ctx;
+        UINT8 digest[SHA256_DIGEST_LENGTH];
+        EFI_STATUS ret;
+
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, oemvars, osz);
+        if (restricted_guid)
+                SHA256_Update(&ctx, restricted_guid, sizeof(*restricted_guid));
+        SHA256_Final(digest, &ctx);
+
+        if (oemvars_digest_match(digest)) {
+                debug(L"OEM vars unchanged since last applied");
+                return EFI_SUCCESS;
+        }
+
+        ret = flash_oemvars_silent_write_error(oemvars, osz, restricted_guid);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        ret = set_oemvars_digest(digest);
+        if (EFI_ERROR(ret))
+                efi_perror(ret, L"Failed to save the OEM vars digest");
+        return EFI_SUCCESS;
+}
+
 static EFI_STATUS set_image_oemvars_nocheck(VOID *bootimage,
                                             const EFI_GUID *restricted_guid)
 {
@@ -766,9 +931,9 @@ static EFI_STATUS set_image_oemvars_nocheck(VOID *bootimage,
         if (ret == EFI_SUCCESS && osz > OEMVARS_MAGIC_SZ &&
             !memcmp(oemvars, OEMVARS_MAGIC, OEMVARS_MAGIC_SZ)) {
                 debug(L"secondstage contains raw oemvars");
-                return flash_oemvars_silent_write_error((CHAR8*)oemvars + OEMVARS_MAGIC_SZ,
-                                                        osz - OEMVARS_MAGIC_SZ,
-                                                        restricted_guid);
+                return apply_image_oemvars((CHAR8*)oemvars + OEMVARS_MAGIC_SZ,
+                                           osz - OEMVARS_MAGIC_SZ,
+                                           restricted_guid);
         }
 
 #ifdef HAL_AUTODETECT
@@ -781,7 +946,7 @@ static EFI_STATUS set_image_oemvars_nocheck(VOID *bootimage,
                 return ret;
         }
 
-        return flash_oemvars_silent_write_error(oemvars, osz, restricted_guid);
+        return apply_image_oemvars(oemvars, osz, restricted_guid);
 #else
         return EFI_NOT_FOUND;
 #endif
@@ -817,6 +982,9 @@ static EFI_STATUS load_image(VOID *bootimage, UINT8 boot_state,
                 efi_perror(ret, L"Failed to set os secure boot");
 #endif
 
+        /* The OS writes its partitions */
+        forget_all_erased_parts();
+
         debug(L"chainloading boot image, boot state is %s",
                         boot_state_to_string(boot_state));
         ret = android_image_start_buffer(g_parent_image, bootimage,
@@ -833,6 +1001,8 @@ static VOID die(VOID)
 {
         /* Allow plenty of time for the error to be visible before the
          * screen goes blank */
+        log_persist();
+        log_flush_serial();
         pause(30);
         halt_system();
 }
@@ -972,7 +1142,7 @@ static VOID enter_fastboot_mode(UINT8 boot_state, VOID *bootimage)
 #endif
                                 load_image(bootimage, BOOT_STATE_ORANGE, FALSE);
                         }
-                        FreePool(bootimage);
+                        android_image_free(bootimage);
                         bootimage = NULL;
                         continue;
                 }
@@ -986,6 +1156,7 @@ static VOID enter_fastboot_mode(UINT8 boot_state, VOID *bootimage)
                                 efi_perror(ret, L"Unable to load the received EFI image");
                                 continue;
                         }
+                        forget_all_erased_parts();
                         ret = uefi_call_wrapper(BS->StartImage, 3, image, NULL, NULL);
                         if (EFI_ERROR(ret))
                                 efi_perror(ret, L"Unable to start the received EFI image");
@@ -1010,6 +1181,114 @@ static VOID enter_fastboot_mode(UINT8 boot_state, VOID *bootimage)
 }
 #endif
 
+/* Capsules persisting across reset are read in chunks of at most
+ * CAPSULE_CHUNK_MAX bytes, smaller ones are tried down to a page when
+ * the memory is too fragmented.  They make the scatter list
+ * UpdateCapsule() takes.  The other capsules must be in a single
+ * contiguous buffer, the scatter list then has a single entry.  */
+#define CAPSULE_CHUNK_MAX       (1024 * 1024)
+
+static void free_capsule(EFI_CAPSULE_BLOCK_DESCRIPTOR *list)
+{
+        EFI_CAPSULE_BLOCK_DESCRIPTOR *desc;
+
+        for (desc = list; desc->Length; desc++)
+                FreePool((VOID *)(UINTN)desc->Union.DataBlock);
+        FreePool(list);
+}
+
+static EFI_STATUS read_capsule(IN EFI_HANDLE device, IN CHAR16 *name,
+                               OUT EFI_CAPSULE_BLOCK_DESCRIPTOR **list_p,
+                               OUT UINTN *len_p)
+{
+        EFI_CAPSULE_BLOCK_DESCRIPTOR *list, *desc;
+        EFI_CAPSULE_HEADER header;
+        EFI_FILE *root_dir, *file;
+        EFI_FILE_INFO *info;
+        UINTN len, offset, chunk, min_chunk, size;
+        VOID *data;
+        EFI_STATUS ret;
+
+        root_dir = LibOpenRoot(device);
+        if (!root_dir)
+                return EFI_LOAD_ERROR;
+
+        ret = uefi_call_wrapper(root_dir->Open, 5, root_dir, &file,
+                                name, EFI_FILE_MODE_READ, 0);
+        uefi_call_wrapper(root_dir->Close, 1, root_dir);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        info = LibFileInfo(file);
+        if (!info) {
+                ret = EFI_UNSUPPORTED;
+                goto close;
+        }
+        len = info->FileSize;
+        FreePool(info);
+
+        if (len < sizeof(header)) {
+                ret = EFI_LOAD_ERROR;
+                goto close;
+        }
+
+        size = sizeof(header);
+        ret = uefi_call_wrapper(file->Read, 3, file, &size, &header);
+        if (EFI_ERROR(ret) || size != sizeof(header)) {
+                ret = EFI_ERROR(ret) ? ret : EFI_LOAD_ERROR;
+                goto close;
+        }
+        ret = uefi_call_wrapper(file->SetPosition, 2, file, 0);
+        if (EFI_ERROR(ret))
+                goto close;
+
+        if (header.Flags & CAPSULE_FLAGS_PERSIST_ACROSS_RESET) {
+                chunk = CAPSULE_CHUNK_MAX;
+                min_chunk = EFI_PAGE_SIZE;
+        } else
+                chunk = min_chunk = len;
+
+        /* Worst case of page sized chunks plus the terminator */
+        list = AllocateZeroPool((len / EFI_PAGE_SIZE + 2) * sizeof(*list));
+        if (!list) {
+                ret = EFI_OUT_OF_RESOURCES;
+                goto close;
+        }
+
+        for (offset = 0, desc = list; offset < len; offset += size, desc++) {
+                size = min(chunk, len - offset);
+                while (!(data = AllocatePool(size)) && chunk > min_chunk) {
+                        chunk /= 2;
+                        size = min(chunk, len - offset);
+                }
+                if (!data) {
+                        ret = EFI_OUT_OF_RESOURCES;
+                        goto free;
+                }
+                desc->Union.DataBlock = (EFI_PHYSICAL_ADDRESS)(UINTN)data;
+                desc->Length = size;
+
+                ret = uefi_call_wrapper(file->Read, 3, file, &size, data);
+                if (EFI_ERROR(ret) || size != desc->Length) {
+                        ret = EFI_ERROR(ret) ? ret : EFI_LOAD_ERROR;
+                        goto free;
+                }
+        }
+
+        if (chunk < min(len, (UINTN)CAPSULE_CHUNK_MAX))
+                debug(L"Capsule read in %d bytes chunks", chunk);
+        *list_p = list;
+        *len_p = len;
+        ret = EFI_SUCCESS;
+        goto close;
+
+free:
+        free_capsule(list);
+close:
+        uefi_call_wrapper(file->Close, 1, file);
+        return ret;
+}
+
 static EFI_STATUS push_capsule(
                 IN EFI_FILE *root_dir,
                 IN CHAR16 *name,
@@ -1018,39 +1297,28 @@ static EFI_STATUS push_capsule(
         UINTN len = 0;
         UINT64 max = 0;
         EFI_CAPSULE_HEADER *capHeader = NULL;
-        EFI_CAPSULE_HEADER **capHeaderArray;
+        EFI_CAPSULE_HEADER *capHeaderArray[2];
         EFI_CAPSULE_BLOCK_DESCRIPTOR *scatterList;
-        CHAR8 *content = NULL;
         EFI_STATUS ret;
 
         debug(L"Trying to load capsule: %s", name);
-        ret = file_read(root_dir, name, &content, &len);
-        if (EFI_SUCCESS == ret) {
-                if (len <= 0) {
-                        debug(L"Couldn't load capsule data from disk");
-                        FreePool(content);
-                        return EFI_LOAD_ERROR;
-                }
-                /* Some capsules might invoke reset during UpdateCapsule
-                so delete the file now */
-                ret = file_delete(g_disk_device, name);
-                if (ret != EFI_SUCCESS) {
-                        efi_perror(ret, L"Couldn't delete %s", name);
-                        FreePool(content);
-                        return ret;
-                }
-        }
-        else {
-                debug(L"Error in reading file");
+        ret = read_capsule(root_dir, name, &scatterList, &len);
+        if (EFI_ERROR(ret)) {
+                debug(L"Couldn't load capsule data from disk: %r", ret);
                 return ret;
         }
 
-        capHeader = (EFI_CAPSULE_HEADER *) content;
-        capHeaderArray = AllocatePool(2*sizeof(EFI_CAPSULE_HEADER*));
-        if (!capHeaderArray) {
-                FreePool(content);
-                return EFI_OUT_OF_RESOURCES;
+        /* Some capsules might invoke reset during UpdateCapsule
+        so delete the file now */
+        ret = file_delete(g_disk_device, name);
+        if (ret != EFI_SUCCESS) {
+                efi_perror(ret, L"Couldn't delete %s", name);
+                free_capsule(scatterList);
+                return ret;
         }
+
+        /* The header is at the beginning of the first chunk */
+        capHeader = (EFI_CAPSULE_HEADER *)(UINTN)scatterList->Union.DataBlock;
         capHeaderArray[0] = capHeader;
         capHeaderArray[1] = NULL;
         debug(L"Querying capsule capabilities");
@@ -1058,28 +1326,15 @@ static EFI_STATUS push_capsule(
                         capHeaderArray, 1,  &max, resetType);
         if (EFI_SUCCESS == ret) {
                 if (len > max) {
-                        FreePool(content);
-                        FreePool(capHeaderArray);
+                        free_capsule(scatterList);
                         return EFI_BAD_BUFFER_SIZE;
                 }
-                scatterList = AllocatePool(2*sizeof(EFI_CAPSULE_BLOCK_DESCRIPTOR));
-                if (!scatterList) {
-                        FreePool(content);
-                        FreePool(capHeaderArray);
-                        return EFI_OUT_OF_RESOURCES;
-                }
-                memset((CHAR8*)scatterList, 0x0,
-                        2*sizeof(EFI_CAPSULE_BLOCK_DESCRIPTOR));
-                scatterList->Length = len;
-                scatterList->Union.DataBlock = (EFI_PHYSICAL_ADDRESS) (UINTN) capHeader;
 
                 debug(L"Calling RT->UpdateCapsule");
                 ret = uefi_call_wrapper(RT->UpdateCapsule, 3, capHeaderArray, 1,
                         (EFI_PHYSICAL_ADDRESS) (UINTN) scatterList);
                 if (ret != EFI_SUCCESS) {
-                        FreePool(content);
-                        FreePool(capHeaderArray);
-                        FreePool(scatterList);
+                        free_capsule(scatterList);
                         return ret;
                 }
         }
@@ -1141,7 +1396,7 @@ static void flash_bootloader_policy(void)
         if (!blpolicy_is_flashed())
                 debug(L"Bootloader Policy EFI variables are not flashed");
 out:
-        FreePool(bootimage);
+        android_image_free(bootimage);
 }
 #endif
 
@@ -1162,9 +1417,14 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
         CHAR16 *name = NULL;
         EFI_RESET_TYPE resetType;
 
+        timestamp_record("efi_main");
+
         /* gnu-efi initialization */
         InitializeLib(image, sys_table);
+        log_levels_load();
+        arm_magic_key();
         ux_init();
+        timestamp_record("ux_init");
 
         debug(L"%s", loader_version);
         set_efi_variable_str(&loader_guid, LOADER_VERSION_VAR,
@@ -1177,6 +1437,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
                         image, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"OpenProtocol: LoadedImageProtocol");
+                disarm_magic_key();
                 return ret;
         }
         g_disk_device = g_loaded_image->DeviceHandle;
@@ -1186,6 +1447,12 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
                 ret = storage_set_boot_device(g_disk_device);
                 if (EFI_ERROR(ret))
                         error(L"Failed to set boot device");
+                timestamp_record("storage_set_boot_device");
+
+                /* The partition table is read while the boot target
+                 * is chosen */
+                if (!EFI_ERROR(ret))
+                        gpt_prefetch(LOGICAL_UNIT_USER);
         }
 
         if (file_exists(g_disk_device, FWUPDATE_FILE)) {
@@ -1201,6 +1468,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
         /* No UX prompts before this point, do not want to interfere
          * with magic key detection */
         boot_target = choose_boot_target(&target_address, &target_path, &oneshot);
+        timestamp_record("choose_boot_target");
         if (boot_target == EXIT_SHELL)
                 return EFI_SUCCESS;
         if (boot_target == CRASHMODE)
@@ -1286,6 +1554,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 
         debug(L"Loading boot image");
         ret = load_boot_image(boot_target, target_path, &bootimage, oneshot);
+        timestamp_record("load_boot_image");
         FreePool(target_path);
         if (EFI_ERROR(ret)) {
                 debug(L"issue loading boot image: %r", ret);
@@ -1294,6 +1563,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
                 debug(L"Validating boot image");
                 boot_state = validate_bootimage(boot_target, bootimage,
                                                 &verifier_cert);
+                timestamp_record("validate_bootimage");
         }
 
         if (boot_state == BOOT_STATE_YELLOW) {
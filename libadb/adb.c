@@ -35,6 +35,7 @@
 #include <usb.h>
 #include <tcp.h>
 #include <transport.h>
+#include <trace.h>
 
 #include "adb.h"
 #include "adb_socket.h"
@@ -49,8 +50,11 @@
 /* TCP configuration */
 #define TCP_PORT	5555
 
-/* Protocol definitions */
-#define ADB_VERSION	0x01000000
+/* Protocol definitions.  From version 0x01000001, the payload
+   checksum is neither computed nor checked.  */
+#define ADB_VERSION_MIN			0x01000000
+#define ADB_VERSION_SKIP_CHECKSUM	0x01000001
+#define ADB_VERSION			ADB_VERSION_SKIP_CHECKSUM
 #define SYSTEM_TYPE	"bootloader"
 
 /* Internal data */
@@ -63,71 +67,279 @@ typedef enum adb_state {
 static service_t *SERVICES[] = { &reboot_service, &sync_service };
 static adb_state_t adb_state;
 static adb_pkt_t adb_pkt_in;
-/* This buffer size is set to the minimum to avoid the waste of memory
- * resource.  If new adb commands support is added that requires a
- * bigger input buffer, feel free to increase this size.  */
+/* The input buffer is set to the minimum until the CNXN hand-shake,
+ * it is then replaced by a buffer of the negotiated payload size.  */
 unsigned char in_buf[ADB_MIN_PAYLOAD];
+static UINT32 in_buf_size;
 
 UINT32 adb_max_payload;
+static UINT32 adb_version;
+
+/* Bytes of the incoming message received so far.  On a stream
+   transport one receive is posted for a header and a full payload: it
+   completes with whatever the host has sent, usually a whole message
+   and sometimes the beginning of the next ones.  These extra bytes
+   are kept in the input buffer, at PENDING_OFFSET, until the current
+   message is processed.  */
+static UINT32 rx_header_len;
+static UINT32 rx_data_len;
+static UINT32 pending_offset;
+static UINT32 pending_len;
+
+/* Sum of the payload bytes.  Eight bytes are added at once in four
+   16-bit lanes, folded every 128 words before they can overflow.  */
+#define BYTE_LANES	0x00FF00FF00FF00FFULL
+#define FOLD_WORDS	128
 
 static UINT32 adb_pkt_sum(adb_pkt_t *pkt)
 {
-	UINTN count, sum;
+	UINTN count = pkt->msg.data_length, n;
 	unsigned char *cur = pkt->data;
+	const UINT64 *word;
+	UINT64 lanes;
+	UINT32 sum = 0;
 
-	for (sum = 0, count = pkt->msg.data_length; count; count--)
+	for (; count && ((UINTN)cur & (sizeof(*word) - 1)); count--)
+		sum += *cur++;
+
+	for (word = (const UINT64 *)cur; count >= sizeof(*word); ) {
+		n = min(count / sizeof(*word), (UINTN)FOLD_WORDS);
+		count -= n * sizeof(*word);
+		for (lanes = 0; n; n--, word++)
+			lanes += (*word & BYTE_LANES) + ((*word >> 8) & BYTE_LANES);
+		sum += (lanes & 0xFFFF) + ((lanes >> 16) & 0xFFFF) +
+			((lanes >> 32) & 0xFFFF) + (lanes >> 48);
+	}
+
+	for (cur = (unsigned char *)word; count; count--)
 		sum += *cur++;
 
 	return sum;
 }
 
-static adb_pkt_t *delayed_pkt_data;
-EFI_STATUS adb_send_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0, UINT32 arg1)
+/* The host checks the CNXN packet before it knows the version.  */
+static BOOLEAN skip_checksum(adb_pkt_t *pkt)
+{
+	return adb_version >= ADB_VERSION_SKIP_CHECKSUM &&
+		pkt->msg.command != A_CNXN;
+}
+
+/* Transmit queue.  The packets are sent in order and their header is
+   kept here until the transport layer completes it.  A socket has at
+   most one WRTE packet waiting for the host OKAY message, so
+   concurrent streams get their packets sent in turn.  */
+#define TX_QUEUE_SIZE	(2 * MAX_ADB_SOCKET + 2)
+
+typedef enum tx_state {
+	TX_FREE,
+	TX_QUEUED,
+	TX_HEADER,	/* Header sent, payload sent on completion */
+	TX_PAYLOAD,
+	TX_VECTOR	/* Header and payload sent together */
+} tx_state_t;
+
+static struct tx_entry {
+	tx_state_t state;
+	adb_msg_t msg;
+	unsigned char *data;
+} tx_queue[TX_QUEUE_SIZE];
+static UINTN tx_tail, tx_next;
+/* Some transport layer (USB in particular) might not support several
+   writes in raw.  */
+static BOOLEAN tx_busy;
+
+static void tx_reset(void)
+{
+	memset(tx_queue, 0, sizeof(tx_queue));
+	tx_tail = tx_next = 0;
+	tx_busy = FALSE;
+}
+
+static void tx_release(struct tx_entry *entry)
+{
+	if (entry->state == TX_HEADER || entry->state == TX_PAYLOAD)
+		tx_busy = FALSE;
+	entry->state = TX_FREE;
+}
+
+static EFI_STATUS tx_kick(void)
 {
 	EFI_STATUS ret;
+	struct tx_entry *entry;
+	UINTN count;
+
+	while (!tx_busy && tx_queue[tx_next].state == TX_QUEUED) {
+		entry = &tx_queue[tx_next];
+		tx_next = (tx_next + 1) % TX_QUEUE_SIZE;
+
+		/* Send the header and the payload together when the
+		   transport layer supports it.  */
+		transport_fragment_t frags[] = {
+			{ .buf = &entry->msg, .size = sizeof(entry->msg) },
+			{ .buf = entry->data, .size = entry->msg.data_length }
+		};
+		count = entry->msg.data_length ? 2 : 1;
+
+		entry->state = TX_VECTOR;
+		ret = transport_writev(frags, count);
+		if (ret == EFI_NOT_READY) {
+			/* Retried on the next transmit completion */
+			entry->state = TX_QUEUED;
+			tx_next = entry - tx_queue;
+			return EFI_SUCCESS;
+		}
+		if (ret == EFI_UNSUPPORTED) {
+			/* The TX event sends the payload.  The state is
+			   set before the write because some transport
+			   implementation trig the TX event before
+			   transport_write() returns.  */
+			tx_busy = TRUE;
+			entry->state = TX_HEADER;
+			ret = transport_write(&entry->msg, sizeof(entry->msg));
+		}
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to send adb msg");
+			tx_release(entry);
+			return ret;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS adb_send_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0, UINT32 arg1)
+{
+	struct tx_entry *entry = &tx_queue[tx_tail];
 
 	pkt->msg.command = command;
 	pkt->msg.arg0 = arg0;
 	pkt->msg.arg1 = arg1;
 
 	pkt->msg.magic = pkt->msg.command ^ 0xFFFFFFFF;
-	pkt->msg.data_check = adb_pkt_sum(pkt);
-
-	/* Some transport layer (USB in particular) might not support
-	   several writes in raw.  Wait for the TX event to send the
-	   payload.  Prepare the delayed packet before we send the
-	   first one because some transport implementation trig the TX
-	   even (TCP in particular) before the first transport_write()
-	   returns.  */
-	if (pkt->msg.data_length)
-		delayed_pkt_data = pkt;
-
-	ret = transport_write(&pkt->msg, sizeof(pkt->msg));
-	if (EFI_ERROR(ret))
-		efi_perror(ret, L"Failed to send adb msg");
+	pkt->msg.data_check = skip_checksum(pkt) ? 0 : adb_pkt_sum(pkt);
+
+	if (entry->state != TX_FREE) {
+		error(L"adb transmit queue is full");
+		return EFI_OUT_OF_RESOURCES;
+	}
 
-	return ret;
+	entry->msg = pkt->msg;
+	entry->data = pkt->data;
+	entry->state = TX_QUEUED;
+	tx_tail = (tx_tail + 1) % TX_QUEUE_SIZE;
+
+	return tx_kick();
 }
 
-static void adb_read_msg(void)
+/* Read the rest of the header, and as much of the payload and of the
+   following messages as the transport can give at once.  Transports
+   delivering each host transfer on its own only read the header.  */
+static void adb_read_msg_header(void)
 {
+	transport_fragment_t frags[] = {
+		{ (UINT8 *)&adb_pkt_in.msg + rx_header_len,
+		  sizeof(adb_pkt_in.msg) - rx_header_len },
+		{ adb_pkt_in.data, in_buf_size }
+	};
 	EFI_STATUS ret;
 
 	adb_state = ADB_READ_MSG;
-	ret = transport_read(&adb_pkt_in.msg, sizeof(adb_pkt_in.msg));
+	ret = transport_readv_some(frags, ARRAY_SIZE(frags));
+	if (ret == EFI_UNSUPPORTED)
+		ret = transport_read(frags[0].buf, frags[0].size);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"transport_read failed for next adb message");
 }
 
-static void adb_read_msg_payload()
+static void adb_read_msg_payload(void)
 {
 	EFI_STATUS ret;
 
 	adb_state = ADB_READ_MSG_PAYLOAD;
-	ret = transport_read(adb_pkt_in.data, adb_pkt_in.msg.data_length);
+	ret = transport_read(adb_pkt_in.data + rx_data_len,
+			     adb_pkt_in.msg.data_length - rx_data_len);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"transport_read failed for adb message payload");
+}
 
+static void cmd_okay(adb_pkt_t *pkt);
+
+/* Move the pending bytes to the header and the front of the input
+   buffer, they are the beginning of the next message.  */
+static void adb_next_msg(void)
+{
+	unsigned char *pending = adb_pkt_in.data + pending_offset;
+
+	rx_header_len = min(pending_len, (UINT32)sizeof(adb_pkt_in.msg));
+	memcpy(&adb_pkt_in.msg, pending, rx_header_len);
+	rx_data_len = pending_len - rx_header_len;
+	if (rx_data_len)
+		CopyMem(adb_pkt_in.data, pending + rx_header_len, rx_data_len);
+	pending_offset = pending_len = 0;
+}
+
+/* Go on with the bytes received so far: read what is missing of the
+   current message or get it ready for process_msg().  The OKAY
+   messages are processed on the spot and the next buffered message,
+   if any, is parsed in turn.  */
+static void adb_parse_msg(void)
+{
+	adb_msg_t *msg = &adb_pkt_in.msg;
+
+	for (;;) {
+		if (rx_header_len < sizeof(*msg)) {
+			adb_read_msg_header();
+			return;
+		}
+
+		if (msg->magic != (msg->command ^ 0xFFFFFFFF)) {
+			error(L"Bad magic");
+			return;
+		}
+
+		if (msg->data_length > in_buf_size) {
+			error(L"internal read buffer is too small");
+			return;
+		}
+
+		if (rx_data_len < msg->data_length) {
+			adb_read_msg_payload();
+			return;
+		}
+
+		if (msg->data_length && !skip_checksum(&adb_pkt_in) &&
+		    msg->data_check != adb_pkt_sum(&adb_pkt_in)) {
+			error(L"Corrupted data detected");
+			return;
+		}
+
+		pending_offset = msg->data_length;
+		pending_len = rx_data_len - msg->data_length;
+
+		/* Fastpath for OKAY message for performance purposes.  */
+		if (msg->command != A_OKAY || msg->data_length) {
+			adb_state = ADB_PROCESS_MSG;
+			return;
+		}
+
+		cmd_okay(&adb_pkt_in);
+		adb_next_msg();
+	}
+}
+
+static void adb_read_msg(void)
+{
+	adb_next_msg();
+	adb_parse_msg();
+}
+
+/* The packets queued for a previous connection will never complete.  */
+static void adb_start(void)
+{
+	tx_reset();
+	rx_header_len = rx_data_len = 0;
+	pending_offset = pending_len = 0;
+	adb_parse_msg();
 }
 
 /* ADB commands */
@@ -140,23 +352,50 @@ static void cmd_unsupported(adb_pkt_t *pkt)
 	error(L"'%a' adb message is not supported", cmd);
 }
 
+static void free_in_buf(void)
+{
+	if (adb_pkt_in.data != in_buf)
+		FreePool(adb_pkt_in.data);
+	adb_pkt_in.data = in_buf;
+	in_buf_size = sizeof(in_buf);
+}
+
+/* The CNXN payload is not used, the input buffer can be replaced.
+   The bytes received after it are moved to the new one.  */
 static void cmd_connect(adb_pkt_t *pkt)
 {
 	EFI_STATUS ret;
 	static adb_pkt_t out_pkt;
+	unsigned char *buf;
 
-	if (pkt->msg.arg0 != ADB_VERSION) {
+	if (pkt->msg.arg0 < ADB_VERSION_MIN) {
 		error(L"Unsupported adb version 0x%08x", pkt->msg.arg0);
 		return;
 	}
 
+	adb_version = min((UINT32)ADB_VERSION, pkt->msg.arg0);
+	debug(L"Negociated adb version is 0x%08x", adb_version);
+
 	adb_max_payload = min((UINT32)ADB_MAX_PAYLOAD, pkt->msg.arg1);
+	if (adb_max_payload > in_buf_size) {
+		buf = AllocatePool(adb_max_payload);
+		if (buf) {
+			memcpy(buf, pkt->data + pending_offset, pending_len);
+			pending_offset = 0;
+			free_in_buf();
+			pkt->data = buf;
+			in_buf_size = adb_max_payload;
+		} else {
+			error(L"Failed to allocate the adb input buffer");
+			adb_max_payload = in_buf_size;
+		}
+	}
 	debug(L"Negociated payload size is %d bytes", adb_max_payload);
 
 	out_pkt.data = (unsigned char *)SYSTEM_TYPE "::";
 	out_pkt.msg.data_length = strlen(out_pkt.data);
 
-	ret = adb_send_pkt(&out_pkt, pkt->msg.command, pkt->msg.arg0,
+	ret = adb_send_pkt(&out_pkt, pkt->msg.command, adb_version,
 			   adb_max_payload);
 	if (EFI_ERROR(ret))
 		error(L"Failed to send connection packet");
@@ -248,78 +487,73 @@ static void process_msg(void)
 
 static void adb_process_rx(void *buf, unsigned len)
 {
-	adb_msg_t *msg;
+	UINT32 header_len;
 
 	switch (adb_state) {
 	case ADB_READ_MSG:
-		if (buf != &adb_pkt_in || len != sizeof(adb_pkt_in.msg)) {
+		if (buf != (UINT8 *)&adb_pkt_in.msg + rx_header_len ||
+		    len > sizeof(adb_pkt_in.msg) - rx_header_len + in_buf_size) {
 			error(L"Invalid adb packet buffer reference");
 			return;
 		}
 
-		msg = (adb_msg_t *)buf;
-		if (msg->magic != (msg->command ^ 0xFFFFFFFF)) {
-			error(L"Bad magic");
-			return;
-		}
-
-		if (msg->data_length > sizeof(in_buf)) {
-			error(L"internal read buffer is too small");
-			return;
-		}
-
-		if (msg->data_length) {
-			adb_read_msg_payload();
-			return;
-		}
-
-		/* Fastpath for OKAY message for performance purposes.  */
-		if (msg->command == A_OKAY) {
-			cmd_okay(&adb_pkt_in);
-			adb_read_msg();
-			return;
-		}
-
-		adb_state = ADB_PROCESS_MSG;
+		header_len = min((UINT32)len,
+				 (UINT32)sizeof(adb_pkt_in.msg) - rx_header_len);
+		rx_header_len += header_len;
+		rx_data_len = len - header_len;
 		break;
 
 	case ADB_READ_MSG_PAYLOAD:
-		if (buf != adb_pkt_in.data) {
+		if (buf != adb_pkt_in.data + rx_data_len) {
 			error(L"Invalid adb payload buffer reference");
 			return;
 		}
 
-		if (len != adb_pkt_in.msg.data_length) {
+		if (len != adb_pkt_in.msg.data_length - rx_data_len) {
 			error(L"Received 0x%x bytes payload instead of 0x%x bytes",
-			      len, adb_pkt_in.msg.data_length);
+			      len, adb_pkt_in.msg.data_length - rx_data_len);
 			return;
 		}
 
-		if (adb_pkt_in.msg.data_check != adb_pkt_sum(&adb_pkt_in)) {
-			error(L"Corrupted data detected");
-			return;
-		}
-
-		adb_state = ADB_PROCESS_MSG;
+		rx_data_len += len;
 		break;
 
 	default:
 		error(L"Inconsistent 0x%x adb state", adb_state);
+		return;
 	}
+
+	adb_parse_msg();
 }
 
-static void adb_process_tx(__attribute__((__unused__)) void *buf,
-			   __attribute__((__unused__)) unsigned len)
+static void adb_process_tx(void *buf, __attribute__((__unused__)) unsigned len)
 {
 	EFI_STATUS ret;
+	struct tx_entry *entry;
+	UINTN i;
 
-	if (!delayed_pkt_data)
-		return;
+	for (i = 0; i < TX_QUEUE_SIZE; i++) {
+		entry = &tx_queue[i];
+		if (entry->state == TX_HEADER && buf == &entry->msg &&
+		    entry->msg.data_length) {
+			entry->state = TX_PAYLOAD;
+			ret = transport_write(entry->data, entry->msg.data_length);
+			if (!EFI_ERROR(ret))
+				return;
+			efi_perror(ret, L"Failed to send adb payload");
+			tx_release(entry);
+			break;
+		}
 
-	ret = transport_write(delayed_pkt_data->data, delayed_pkt_data->msg.data_length);
-	delayed_pkt_data = NULL;
-	if (EFI_ERROR(ret))
-		efi_perror(ret, L"Failed to send adb payload");
+		if ((entry->state == TX_HEADER && buf == &entry->msg) ||
+		    (entry->state == TX_VECTOR && buf == &entry->msg) ||
+		    (entry->state == TX_PAYLOAD && buf == entry->data)) {
+			tx_release(entry);
+			break;
+		}
+	}
+
+	tx_kick();
 }
 
 static enum boot_target exit_bt;
@@ -357,17 +591,8 @@ static EFI_STATUS adb_tcp_start(start_callback_t start_cb,
 				data_callback_t rx_cb,
 				data_callback_t tx_cb)
 {
-	EFI_STATUS ret;
-	EFI_IPv4_ADDRESS station_address;
-
-	ret = tcp_start(TCP_PORT, start_cb, rx_cb, tx_cb,
-			&station_address);
-	if (EFI_ERROR(ret))
-		return ret;
-
-	print_tcpip_information(&station_address);
-
-	return EFI_SUCCESS;
+	return tcp_start(TCP_PORT, start_cb, rx_cb, tx_cb,
+			 print_tcpip_information);
 }
 
 static transport_t ADB_TRANSPORT[] = {
@@ -377,7 +602,8 @@ static transport_t ADB_TRANSPORT[] = {
 		.stop = usb_stop,
 		.run = usb_run,
 		.read = usb_read,
-		.write = usb_write
+		.write = usb_write,
+		.counters = usb_counters
 	},
 	{
 		.name = "TCP for adb",
@@ -385,7 +611,10 @@ static transport_t ADB_TRANSPORT[] = {
 		.stop = tcp_stop,
 		.run = tcp_run,
 		.read = tcp_read,
-		.write = tcp_write
+		.write = tcp_write,
+		.writev = tcp_writev,
+		.readv_some = tcp_readv_some,
+		.counters = tcp_counters
 	}
 };
 
@@ -394,15 +623,22 @@ EFI_STATUS adb_init()
 	EFI_STATUS ret;
 
 	adb_pkt_in.data = in_buf;
+	in_buf_size = sizeof(in_buf);
+	adb_version = ADB_VERSION_MIN;
+	tx_reset();
 	exit_bt = UNKNOWN_TARGET;
 
+	ret = trace_init();
+	if (EFI_ERROR(ret))
+		debug(L"Tracing not available: %r", ret);
+
 	ret = transport_register(ADB_TRANSPORT, ARRAY_SIZE(ADB_TRANSPORT));
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"adb failed to register support transport");
 		return ret;
 	}
 
-	return transport_start(adb_read_msg, adb_process_rx, adb_process_tx);
+	return transport_start(adb_start, adb_process_rx, adb_process_tx);
 }
 
 EFI_STATUS adb_run()
@@ -424,5 +660,6 @@ EFI_STATUS adb_exit()
 {
 	asock_close_all();
 	transport_stop();
+	free_in_buf();
 	return EFI_SUCCESS;
 }
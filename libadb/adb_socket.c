@@ -41,7 +41,7 @@ struct asock {
 	UINT32 remote;
 	adb_pkt_t msg;
 	adb_pkt_t wrt;
-	unsigned char data[ADB_MAX_PAYLOAD];
+	unsigned char data[ADB_MIN_PAYLOAD];
 	service_t *service;
 	void *context;
 };
@@ -145,11 +145,21 @@ EFI_STATUS asock_read(asock_t s, unsigned char *data, UINT32 length)
 /* Device to host */
 EFI_STATUS asock_write(asock_t s, unsigned char *data, UINT32 length)
 {
-	if (!s || length > adb_max_payload)
+	if (!s || length > sizeof(s->data) || length > adb_max_payload)
 		return EFI_INVALID_PARAMETER;
 
 	memcpy(s->data, data, length);
-	s->wrt.data = s->data;
+	return asock_write_nocopy(s, s->data, length);
+}
+
+/* DATA must remain valid until the host acknowledges the packet
+   with an OKAY message.  */
+EFI_STATUS asock_write_nocopy(asock_t s, unsigned char *data, UINT32 length)
+{
+	if (!s || length > adb_max_payload)
+		return EFI_INVALID_PARAMETER;
+
+	s->wrt.data = data;
 	s->wrt.msg.data_length = length;
 	return adb_send_pkt(&s->wrt, A_WRTE, s->local, s->remote);
 }
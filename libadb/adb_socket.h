@@ -52,6 +52,7 @@ EFI_STATUS asock_read(asock_t s, unsigned char *data, UINT32 length);
 
 /* Device to host */
 EFI_STATUS asock_write(asock_t s, unsigned char *data, UINT32 length);
+EFI_STATUS asock_write_nocopy(asock_t s, unsigned char *data, UINT32 length);
 EFI_STATUS asock_send_okay(asock_t s);
 EFI_STATUS asock_send_close(asock_t s);
 
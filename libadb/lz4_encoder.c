@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+
+#include "lz4_encoder.h"
+
+#define LZ4_MAGIC		0x184D2204
+/* Version 1, independent blocks, no checksum, 64KiB blocks and the
+   corresponding descriptor checksum.  */
+#define LZ4_FLG			0x60
+#define LZ4_BD			0x40
+#define LZ4_HC			0x82
+#define LZ4_UNCOMPRESSED	0x80000000
+
+#define MIN_MATCH		4
+#define LAST_LITERALS		5
+#define MF_LIMIT		12
+#define MAX_OFFSET		65535
+#define HASH_LOG		12
+
+/* Positions in the block being encoded.  Entries left by a
+   previous block are harmless: candidates are always checked.  */
+static UINT32 hash_table[1 << HASH_LOG];
+
+static UINT32 read32(const UINT8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static void write32(UINT8 *p, UINT32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static UINT32 hash(UINT32 v)
+{
+	return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static UINT8 *write_length(UINT8 *op, UINTN len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+static UINT8 *write_literals(UINT8 *op, UINT8 *token, const UINT8 *lit, UINTN len)
+{
+	*token = min(len, (UINTN)15) << 4;
+	if (len >= 15)
+		op = write_length(op, len - 15);
+	memcpy(op, lit, len);
+
+	return op + len;
+}
+
+static UINTN compress(const UINT8 *src, UINTN len, UINT8 *dst)
+{
+	const UINT8 *ip = src, *anchor = src, *end = src + len;
+	const UINT8 *ref, *m, *r;
+	UINT8 *op = dst, *token;
+	UINT32 seq, h;
+	UINTN mlen;
+
+	while (len > MF_LIMIT && ip < end - MF_LIMIT) {
+		seq = read32(ip);
+		h = hash(seq);
+		ref = src + hash_table[h];
+		hash_table[h] = ip - src;
+		if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		for (m = ip + MIN_MATCH, r = ref + MIN_MATCH;
+		     m < end - LAST_LITERALS && *m == *r; m++, r++)
+			;
+		mlen = m - ip - MIN_MATCH;
+
+		token = op++;
+		op = write_literals(op, token, anchor, ip - anchor);
+		*op++ = ip - ref;
+		*op++ = (ip - ref) >> 8;
+		*token |= min(mlen, (UINTN)15);
+		if (mlen >= 15)
+			op = write_length(op, mlen - 15);
+
+		ip = anchor = m;
+	}
+
+	token = op++;
+	op = write_literals(op, token, anchor, end - anchor);
+
+	return op - dst;
+}
+
+UINTN lz4_frame_header(UINT8 *dst)
+{
+	write32(dst, LZ4_MAGIC);
+	dst[4] = LZ4_FLG;
+	dst[5] = LZ4_BD;
+	dst[6] = LZ4_HC;
+
+	return LZ4_FRAME_HEADER_SIZE;
+}
+
+/* DST must hold LZ4_BLOCK_BOUND(LEN) bytes.  Blocks which do not
+   compress are stored as is.  */
+UINTN lz4_encode_block(const UINT8 *src, UINTN len, UINT8 *dst)
+{
+	UINTN size;
+
+	size = compress(src, len, dst + 4);
+	if (size >= len) {
+		memcpy(dst + 4, src, len);
+		write32(dst, len | LZ4_UNCOMPRESSED);
+		return 4 + len;
+	}
+
+	write32(dst, size);
+	return 4 + size;
+}
+
+UINTN lz4_end_mark(UINT8 *dst)
+{
+	write32(dst, 0);
+
+	return LZ4_END_MARK_SIZE;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _LZ4_ENCODER_H_
+#define _LZ4_ENCODER_H_
+
+#include <efi.h>
+
+/* LZ4 frame encoder.  The frame uses independent blocks of up to
+   LZ4_BLOCK_MAX bytes without any checksum.  */
+#define LZ4_BLOCK_MAX		(64 * 1024)
+#define LZ4_FRAME_HEADER_SIZE	7
+#define LZ4_END_MARK_SIZE	4
+
+/* Worst case size of an encoded block, block size field included */
+#define LZ4_BLOCK_BOUND(len)	(4 + (len) + (len) / 255 + 16)
+
+UINTN lz4_frame_header(UINT8 *dst);
+UINTN lz4_encode_block(const UINT8 *src, UINTN len, UINT8 *dst);
+UINTN lz4_end_mark(UINT8 *dst);
+
+#endif	/* _LZ4_ENCODER_H_ */
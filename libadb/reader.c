@@ -31,15 +31,54 @@
  */
 
 #include <lib.h>
+#include <openssl/sha.h>
+#include <uefi_utils.h>
+#include <async_io.h>
+#include <transport.h>
+#include <trace.h>
 
 #include "reader.h"
 #include "acpi.h"
 #include "sparse_format.h"
+#include "lz4_encoder.h"
 
 /* RAM reader avoid dynamic memory allocation to avoid RAM corruption
    during the dump.  */
 #define MAX_MEMORY_REGION_NB 256
 
+/* Conventional memory regions are sent as one chunk per segment: a
+   FILL chunk if the segment only holds zeros, a RAW chunk otherwise.
+   The number of chunks is then known when the sparse header is sent
+   while the content is only scanned as it is read.  */
+#define RAM_SEGMENT_SIZE (64 * 1024)
+
+/* Physical ranges a RAM dump can be restricted to.  */
+#define RAM_MAX_RANGES 16
+
+struct ram_range {
+	EFI_PHYSICAL_ADDRESS start;
+	EFI_PHYSICAL_ADDRESS end;
+};
+
+/* Memory types which can be dumped.  The other types may not be
+   backed by RAM and accessing them could hang the platform.  */
+static const struct ram_type {
+	const char *name;
+	EFI_MEMORY_TYPE type;
+} RAM_TYPES[] = {
+	{ "loader-code",	EfiLoaderCode },
+	{ "loader-data",	EfiLoaderData },
+	{ "bs-code",		EfiBootServicesCode },
+	{ "bs-data",		EfiBootServicesData },
+	{ "rt-code",		EfiRuntimeServicesCode },
+	{ "rt-data",		EfiRuntimeServicesData },
+	{ "conventional",	EfiConventionalMemory },
+	{ "acpi-reclaim",	EfiACPIReclaimMemory },
+	{ "acpi-nvs",		EfiACPIMemoryNVS }
+};
+
+#define RAM_DEFAULT_TYPES (1 << EfiConventionalMemory)
+
 static struct ram_priv {
 	BOOLEAN is_in_used;
 
@@ -50,10 +89,22 @@ static struct ram_priv {
 	EFI_PHYSICAL_ADDRESS start;
 	EFI_PHYSICAL_ADDRESS end;
 
+	/* Filters: memory types mask and sorted disjoint ranges */
+	UINT32 types;
+	UINTN range_nb;
+	struct ram_range ranges[RAM_MAX_RANGES];
+
 	/* Current memory region */
 	EFI_PHYSICAL_ADDRESS cur;
 	EFI_PHYSICAL_ADDRESS cur_end;
 
+	/* Current segment of a conventional memory region */
+	EFI_PHYSICAL_ADDRESS seg_end;
+	struct {
+		struct chunk_header header;
+		UINT32 fill;
+	} __attribute__((packed)) seg_chunk;
+
 	/* Sparse format */
 	UINTN chunk_nb;
 	UINTN cur_chunk;
@@ -61,70 +112,105 @@ static struct ram_priv {
 	struct chunk_header chunks[MAX_MEMORY_REGION_NB];
 } ram_priv;
 
-static VOID sort_memory_map(CHAR8 *entries, UINTN nr_entries, UINTN entry_sz)
-{
-	BOOLEAN swapped;
-	EFI_MEMORY_DESCRIPTOR *cur, *next;
-	UINTN i;
-
-	/* Bubble sort algorithm */
-	do {
-		swapped = FALSE;
-		for (i = 0; i < nr_entries - 1; i++) {
-			cur = (EFI_MEMORY_DESCRIPTOR *)(entries + entry_sz * i);
-			next = (EFI_MEMORY_DESCRIPTOR *)(entries + entry_sz * (i + 1));
-			if (cur->PhysicalStart > next->PhysicalStart) {
-				CHAR8 save[entry_sz];
-				memcpy(save, cur, entry_sz);
-				memcpy(cur, next, entry_sz);
-				memcpy(next, save, entry_sz);
-				swapped = TRUE;
-			}
-		}
-		nr_entries--;
-	} while (swapped);
-}
-
 static EFI_STATUS ram_add_chunk(reader_ctx_t *ctx, struct ram_priv *priv, UINT16 type, UINT64 size)
 {
 	struct chunk_header *cur = NULL;
+	UINT64 prev_size = 0, segments;
+
+	if (size == 0)
+		return EFI_SUCCESS;
 
 	if (size % EFI_PAGE_SIZE) {
 		error(L"chunk size must be multiple of %d bytes", EFI_PAGE_SIZE);
 		return EFI_INVALID_PARAMETER;
 	}
 
-	if (priv->chunk_nb == MAX_MEMORY_REGION_NB) {
-		error(L"Failed to allocate a new chunk");
-		return EFI_OUT_OF_RESOURCES;
+	/* Adjacent regions of the same type are merged */
+	if (priv->chunk_nb && priv->chunks[priv->chunk_nb - 1].chunk_type == type) {
+		cur = &priv->chunks[priv->chunk_nb - 1];
+		prev_size = (UINT64)cur->chunk_sz * EFI_PAGE_SIZE;
+	} else {
+		if (priv->chunk_nb == MAX_MEMORY_REGION_NB) {
+			error(L"Failed to allocate a new chunk");
+			return EFI_OUT_OF_RESOURCES;
+		}
+
+		cur = &priv->chunks[priv->chunk_nb++];
+		cur->chunk_type = type;
+		cur->chunk_sz = 0;
+		cur->total_sz = sizeof(*cur);
+		if (type != CHUNK_TYPE_RAW) {
+			ctx->len += sizeof(*cur);
+			priv->sheader.total_chunks++;
+		}
 	}
 
-	cur = &priv->chunks[priv->chunk_nb++];
+	cur->chunk_sz += size / EFI_PAGE_SIZE;
+	priv->sheader.total_blks += size / EFI_PAGE_SIZE;
 
-	cur->chunk_type = type;
-	cur->chunk_sz = size / EFI_PAGE_SIZE;
-	cur->total_sz = sizeof(*cur);
-	ctx->len += sizeof(*cur);
+	/* Each segment of a RAW chunk is sent as a chunk.  Upper bound,
+	   zero segments are shorter.  */
 	if (type == CHUNK_TYPE_RAW) {
+		segments = DIV_ROUND_UP(prev_size + size, RAM_SEGMENT_SIZE) -
+			DIV_ROUND_UP(prev_size, RAM_SEGMENT_SIZE);
 		cur->total_sz += size;
-		ctx->len += size;
+		ctx->len += size + segments * sizeof(*cur);
+		priv->sheader.total_chunks += segments;
 	}
 
-	priv->sheader.total_chunks++;
-	priv->sheader.total_blks += cur->chunk_sz;
-
 	return EFI_SUCCESS;
 }
 
+/* Add the chunks of the [START, END[ region of a memory map entry.
+   Only the parts of a dumped region which are in the requested ranges
+   are sent.  */
+static EFI_STATUS ram_add_region(reader_ctx_t *ctx, struct ram_priv *priv,
+				 EFI_PHYSICAL_ADDRESS start,
+				 EFI_PHYSICAL_ADDRESS end, BOOLEAN dump)
+{
+	EFI_STATUS ret;
+	struct ram_range *range;
+	EFI_PHYSICAL_ADDRESS cut;
+	UINTN i;
+
+	if (!dump || priv->range_nb == 0)
+		return ram_add_chunk(ctx, priv, dump ? CHUNK_TYPE_RAW :
+				     CHUNK_TYPE_DONT_CARE, end - start);
+
+	for (i = 0; i < priv->range_nb && start < end; i++) {
+		range = &priv->ranges[i];
+		if (range->end <= start)
+			continue;
+		if (range->start >= end)
+			break;
+
+		if (range->start > start) {
+			ret = ram_add_chunk(ctx, priv, CHUNK_TYPE_DONT_CARE,
+					    range->start - start);
+			if (EFI_ERROR(ret))
+				return ret;
+			start = range->start;
+		}
+
+		cut = min(end, range->end);
+		ret = ram_add_chunk(ctx, priv, CHUNK_TYPE_RAW, cut - start);
+		if (EFI_ERROR(ret))
+			return ret;
+		start = cut;
+	}
+
+	return ram_add_chunk(ctx, priv, CHUNK_TYPE_DONT_CARE, end - start);
+}
+
 static EFI_STATUS ram_build_chunks(reader_ctx_t *ctx, struct ram_priv *priv,
 				   UINTN nr_entries, UINTN entry_sz)
 {
 	EFI_STATUS ret = EFI_SUCCESS;
-	UINT16 type;
+	BOOLEAN dump;
 	UINTN i;
 	EFI_MEMORY_DESCRIPTOR *entry;
 	UINT64 entry_len, length;
-	EFI_PHYSICAL_ADDRESS entry_end, prev_end;
+	EFI_PHYSICAL_ADDRESS entry_end, prev_end, start;
 	CHAR8 *entries = priv->memmap;
 
 	prev_end = ctx->cur = ctx->len = 0;
@@ -167,8 +253,10 @@ static EFI_STATUS ram_build_chunks(reader_ctx_t *ctx, struct ram_priv *priv,
 		if (priv->end && priv->end < entry_end)
 			length -= entry_end - priv->end;
 
-		type = entry->Type == EfiConventionalMemory ? CHUNK_TYPE_RAW : CHUNK_TYPE_DONT_CARE;
-		ret = ram_add_chunk(ctx, priv, type, length);
+		dump = entry->Type < EfiMaxMemoryType &&
+			(priv->types & (1 << entry->Type));
+		start = max(priv->start, entry->PhysicalStart);
+		ret = ram_add_region(ctx, priv, start, start + length, dump);
 		if (EFI_ERROR(ret))
 			goto err;
 
@@ -199,18 +287,139 @@ err:
 	return EFI_ERROR(ret) ? ret : EFI_INVALID_PARAMETER;
 }
 
+/* Parse a comma separated list of memory type names and return the
+   corresponding mask.  */
+static EFI_STATUS ram_parse_types(char *list, UINT32 *mask)
+{
+	char *name, *saveptr;
+	UINTN i;
+
+	*mask = 0;
+	for (name = strtok_r(list, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		for (i = 0; i < ARRAY_SIZE(RAM_TYPES); i++)
+			if (!strcmp((CHAR8 *)name, (CHAR8 *)RAM_TYPES[i].name))
+				break;
+
+		if (i == ARRAY_SIZE(RAM_TYPES)) {
+			error(L"Unsupported memory type %a", name);
+			return EFI_INVALID_PARAMETER;
+		}
+		*mask |= 1 << RAM_TYPES[i].type;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Parse a comma separated list of START+LENGTH ranges and insert them
+   sorted in the ranges table.  */
+static EFI_STATUS ram_parse_ranges(struct ram_priv *priv, char *list)
+{
+	struct ram_range range, *ranges = priv->ranges;
+	char *token, *endptr, *saveptr;
+	UINTN i, j;
+
+	for (token = strtok_r(list, ",", &saveptr); token;
+	     token = strtok_r(NULL, ",", &saveptr)) {
+		range.start = strtoul(token, &endptr, 16);
+		if (*endptr != '+')
+			return EFI_INVALID_PARAMETER;
+		range.end = range.start + strtoul(endptr + 1, &endptr, 16);
+		if (*endptr != '\0' || range.end <= range.start)
+			return EFI_INVALID_PARAMETER;
+
+		if (range.start % EFI_PAGE_SIZE || range.end % EFI_PAGE_SIZE) {
+			error(L"Ranges must be multiple of %d bytes", EFI_PAGE_SIZE);
+			return EFI_INVALID_PARAMETER;
+		}
+
+		if (priv->range_nb == ARRAY_SIZE(priv->ranges)) {
+			error(L"Too many ranges, %d maximum", RAM_MAX_RANGES);
+			return EFI_INVALID_PARAMETER;
+		}
+
+		for (i = priv->range_nb; i > 0 && ranges[i - 1].start > range.start; i--)
+			;
+
+		if ((i > 0 && ranges[i - 1].end > range.start) ||
+		    (i < priv->range_nb && range.end > ranges[i].start)) {
+			error(L"Overlapping ranges");
+			return EFI_INVALID_PARAMETER;
+		}
+
+		for (j = priv->range_nb; j > i; j--)
+			ranges[j] = ranges[j - 1];
+		ranges[i] = range;
+		priv->range_nb++;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Parse the ram reader arguments: the optional START and LENGTH
+   boundaries followed by the optional types=, notypes= and ranges=
+   filters.  */
+static EFI_STATUS ram_parse_args(struct ram_priv *priv, UINTN argc, char **argv)
+{
+	EFI_STATUS ret;
+	char *endptr, *value;
+	UINTN i, bounds = 0;
+	UINT32 mask;
+	UINT64 length;
+
+	priv->types = RAM_DEFAULT_TYPES;
+
+	for (i = 0; i < argc; i++) {
+		value = (char *)strchr((CHAR8 *)argv[i], '=');
+		if (!value) {
+			if (i != bounds || bounds == 2)
+				return EFI_INVALID_PARAMETER;
+
+			length = strtoul(argv[i], &endptr, 16);
+			if (*endptr != '\0')
+				return EFI_INVALID_PARAMETER;
+			if (bounds++ == 0)
+				priv->start = length;
+			else
+				priv->end = priv->start + length;
+			continue;
+		}
+
+		*value++ = '\0';
+		if (!strcmp((CHAR8 *)argv[i], (CHAR8 *)"types")) {
+			ret = ram_parse_types(value, &priv->types);
+		} else if (!strcmp((CHAR8 *)argv[i], (CHAR8 *)"notypes")) {
+			ret = ram_parse_types(value, &mask);
+			priv->types &= ~mask;
+		} else if (!strcmp((CHAR8 *)argv[i], (CHAR8 *)"ranges"))
+			ret = ram_parse_ranges(priv, value);
+		else
+			ret = EFI_INVALID_PARAMETER;
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	if (priv->start % EFI_PAGE_SIZE || priv->end % EFI_PAGE_SIZE) {
+		error(L"Boundaries must be multiple of %d bytes", EFI_PAGE_SIZE);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	/* Without explicit boundaries, the dump covers the ranges */
+	if (priv->range_nb && bounds == 0) {
+		priv->start = priv->ranges[0].start;
+		priv->end = priv->ranges[priv->range_nb - 1].end;
+	}
+
+	return EFI_SUCCESS;
+}
+
 static EFI_STATUS ram_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 {
 	EFI_STATUS ret = EFI_SUCCESS;
 	struct ram_priv *priv;
-	char *endptr;
 	CHAR8 *entries = NULL;
 	UINT32 descr_ver;
 	UINTN descr_sz, key, memmap_sz, nr_descr;
-	UINT64 length;
-
-	if (argc > 2)
-		return EFI_INVALID_PARAMETER;
 
 	if (ram_priv.is_in_used)
 		return EFI_UNSUPPORTED;
@@ -219,25 +428,9 @@ static EFI_STATUS ram_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 	memset(priv, 0, sizeof(*priv));
 	priv->is_in_used = TRUE;
 
-	/* Parse argv  */
-	if (argc > 0) {
-		priv->start = strtoul(argv[0], &endptr, 16);
-		if (*endptr != '\0')
-			goto err;
-	}
-
-	if (argc == 2) {
-		length = strtoul(argv[1], &endptr, 16);
-		if (*endptr != '\0')
-			goto err;
-		priv->end = priv->start + length;
-	} else
-		priv->end = 0;
-
-	if (priv->start % EFI_PAGE_SIZE || priv->end % EFI_PAGE_SIZE) {
-		error(L"Boundaries must be multiple of %d bytes", EFI_PAGE_SIZE);
+	ret = ram_parse_args(priv, argc, argv);
+	if (EFI_ERROR(ret))
 		goto err;
-	}
 
 	/* Initialize sparse header */
 	priv->sheader.magic = SPARSE_HEADER_MAGIC;
@@ -272,6 +465,33 @@ err:
 	return EFI_ERROR(ret) ? ret : EFI_INVALID_PARAMETER;
 }
 
+static EFI_STATUS ram_start_segment(struct ram_priv *priv, unsigned char **buf, UINTN *len)
+{
+	struct chunk_header *header = &priv->seg_chunk.header;
+	UINT64 size = min(priv->cur_end - priv->cur, (UINT64)RAM_SEGMENT_SIZE);
+
+	if (*len < sizeof(priv->seg_chunk))
+		return EFI_INVALID_PARAMETER;
+
+	header->chunk_sz = size / EFI_PAGE_SIZE;
+	if (is_zero((void *)priv->cur, size)) {
+		header->chunk_type = CHUNK_TYPE_FILL;
+		header->total_sz = sizeof(priv->seg_chunk);
+		priv->seg_chunk.fill = 0;
+		priv->cur += size;
+		priv->seg_end = priv->cur;
+		*len = sizeof(priv->seg_chunk);
+	} else {
+		header->chunk_type = CHUNK_TYPE_RAW;
+		header->total_sz = sizeof(*header) + size;
+		priv->seg_end = priv->cur + size;
+		*len = sizeof(*header);
+	}
+	*buf = (unsigned char *)header;
+
+	return EFI_SUCCESS;
+}
+
 static EFI_STATUS ram_read(reader_ctx_t *ctx, unsigned char **buf, UINTN *len)
 {
 	struct ram_priv *priv = ctx->private;
@@ -284,28 +504,42 @@ static EFI_STATUS ram_read(reader_ctx_t *ctx, unsigned char **buf, UINTN *len)
 
 		*buf = (unsigned char *)&priv->sheader;
 		*len = sizeof(priv->sheader);
-		priv->cur = priv->cur_end = priv->start;
+		priv->cur = priv->cur_end = priv->seg_end = priv->start;
 		return EFI_SUCCESS;
 	}
 
-	/* Start new chunk */
-	if (priv->cur == priv->cur_end) {
-		if (priv->cur_chunk == priv->chunk_nb || *len < sizeof(*priv->chunks))
-			return EFI_INVALID_PARAMETER;
+	/* Continue to send the current segment */
+	if (priv->cur != priv->seg_end) {
+		*len = min(*len, priv->seg_end - priv->cur);
+		*buf = (unsigned char *)priv->cur;
+		priv->cur += *len;
+		return EFI_SUCCESS;
+	}
+
+	/* Next segment of the current memory region */
+	if (priv->cur != priv->cur_end)
+		return ram_start_segment(priv, buf, len);
 
-		chunk = &priv->chunks[priv->cur_chunk++];
-		*buf = (unsigned char *)chunk;
-		*len = sizeof(*chunk);
-		priv->cur_end = priv->cur + chunk->chunk_sz * EFI_PAGE_SIZE;
-		if (chunk->chunk_type != CHUNK_TYPE_RAW)
-			priv->cur = priv->cur_end;
+	/* All the chunks have been sent, zero segments made the dump
+	   shorter than announced.  */
+	if (priv->cur_chunk == priv->chunk_nb) {
+		*len = 0;
+		ctx->len = ctx->cur;
 		return EFI_SUCCESS;
 	}
 
-	/* Continue to send the current memory region */
-	*len = min(*len, priv->cur_end - priv->cur);
-	*buf = (unsigned char *)priv->cur;
-	priv->cur += *len;
+	/* Start new chunk */
+	if (*len < sizeof(*priv->chunks))
+		return EFI_INVALID_PARAMETER;
+
+	chunk = &priv->chunks[priv->cur_chunk++];
+	priv->cur_end = priv->cur + chunk->chunk_sz * EFI_PAGE_SIZE;
+	if (chunk->chunk_type == CHUNK_TYPE_RAW)
+		return ram_start_segment(priv, buf, len);
+
+	*buf = (unsigned char *)chunk;
+	*len = sizeof(*chunk);
+	priv->cur = priv->seg_end = priv->cur_end;
 
 	return EFI_SUCCESS;
 }
@@ -315,30 +549,78 @@ static void ram_close(reader_ctx_t *ctx)
 	((struct ram_priv *)ctx->private)->is_in_used = FALSE;
 }
 
-/* Partition reader */
-#define PART_READER_BUF_SIZE (10 * 1024 * 1024)
+/* Partition reader.  While one buffer is being sent, the next part of
+   the partition is read in the other one.  */
+#define PART_READER_BUF_SIZE (4 * 1024 * 1024)
+#define PART_READER_BUF_NB 2
 
 struct part_priv {
 	struct gpt_partition_interface gparti;
 	BOOLEAN need_more_data;
-	unsigned char buf[PART_READER_BUF_SIZE];
+	VOID *free_addr[PART_READER_BUF_NB];
+	unsigned char *bufs[PART_READER_BUF_NB];
+	UINTN buf_idx;
+	unsigned char *buf;
 	UINTN buf_cur;
 	UINTN buf_len;
 	UINT64 offset;
+	/* Read-ahead */
+	async_reader_t *aio;
+	EFI_LBA next_lba;
+	EFI_LBA end_lba;
+	UINTN skip;
+	UINTN pending_len;
 };
 
+static void free_part_priv(struct part_priv *priv)
+{
+	UINTN i;
+
+	async_read_close(priv->aio);
+	for (i = 0; i < PART_READER_BUF_NB; i++)
+		if (priv->free_addr[i])
+			FreePool(priv->free_addr[i]);
+	FreePool(priv);
+}
+
+/* Read the next part of the partition in the I buffer */
+static EFI_STATUS part_read_ahead(struct part_priv *priv, UINTN i)
+{
+	EFI_STATUS ret;
+	UINT32 block_size = priv->gparti.bio->Media->BlockSize;
+	UINT64 blocks;
+
+	priv->pending_len = 0;
+	if (priv->next_lba == priv->end_lba)
+		return EFI_SUCCESS;
+
+	blocks = min(priv->end_lba - priv->next_lba,
+		     (UINT64)PART_READER_BUF_SIZE / block_size);
+	ret = async_read_blocks(priv->aio, priv->next_lba, blocks * block_size,
+				priv->bufs[i]);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	priv->next_lba += blocks;
+	priv->pending_len = blocks * block_size;
+
+	return EFI_SUCCESS;
+}
+
 static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical_unit_t log_unit)
 {
 	EFI_STATUS ret = EFI_SUCCESS;
 	struct gpt_partition_interface *gparti;
 	struct part_priv *priv;
 	CHAR16 *partname;
-	UINT64 length;
+	UINT64 length, start, end;
+	UINT32 block_size;
+	UINTN i;
 
 	if (argc < 1 || argc > 3)
 		return EFI_INVALID_PARAMETER;
 
-	priv = ctx->private = AllocatePool(sizeof(*priv));
+	priv = ctx->private = AllocateZeroPool(sizeof(*priv));
 	if (!priv)
 		return EFI_OUT_OF_RESOURCES;
 
@@ -357,9 +639,10 @@ static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical
 		goto err;
 	}
 
-	priv->offset = gparti->part.starting_lba * gparti->bio->Media->BlockSize;
+	block_size = gparti->bio->Media->BlockSize;
+	priv->offset = gparti->part.starting_lba * block_size;
 	length = (gparti->part.ending_lba + 1 - gparti->part.starting_lba) *
-		gparti->bio->Media->BlockSize;
+		block_size;
 
 	ctx->cur = 0;
 	ctx->len = length;
@@ -371,19 +654,43 @@ static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical
 	}
 
 	if (argc == 3) {
-		ctx->len = strtoul(argv[2], NULL, 16);
-		if (ctx->len == 0 || ctx->len > length || ctx->cur >= length - ctx->len)
+		length = strtoul(argv[2], NULL, 16);
+		if (length == 0 || length > ctx->len - ctx->cur)
 			goto err;
+		ctx->len = ctx->cur + length;
+	}
+
+	for (i = 0; i < PART_READER_BUF_NB; i++) {
+		ret = alloc_aligned(&priv->free_addr[i], (VOID **)&priv->bufs[i],
+				    PART_READER_BUF_SIZE, gparti->bio->Media->IoAlign);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to allocate the partition buffers");
+			goto err;
+		}
 	}
 
+	ret = async_read_open(gparti->bio, &priv->aio);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	start = priv->offset + ctx->cur;
+	end = priv->offset + ctx->len;
+	priv->next_lba = start / block_size;
+	priv->end_lba = DIV_ROUND_UP(end, block_size);
+	priv->skip = start % block_size;
+	priv->buf_idx = 0;
 	priv->buf_cur = 0;
 	priv->buf_len = 0;
 	priv->need_more_data = TRUE;
 
+	ret = part_read_ahead(priv, priv->buf_idx);
+	if (EFI_ERROR(ret))
+		goto err;
+
 	return EFI_SUCCESS;
 
 err:
-	FreePool(priv);
+	free_part_priv(priv);
 	return EFI_ERROR(ret) ? ret : EFI_INVALID_PARAMETER;
 }
 
@@ -403,17 +710,22 @@ static EFI_STATUS part_read(reader_ctx_t *ctx, unsigned char **buf, UINTN *len)
 	struct part_priv *priv = ctx->private;
 
 	if (priv->need_more_data) {
-		priv->buf_len = min(sizeof(priv->buf), ctx->len - ctx->cur);
-		ret = uefi_call_wrapper(priv->gparti.dio->ReadDisk, 5, priv->gparti.dio,
-					priv->gparti.bio->Media->MediaId,
-					priv->offset + ctx->cur, priv->buf_len, priv->buf);
+		ret = async_read_wait(priv->aio);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Failed to read partition");
 			return ret;
 		}
 
+		priv->buf = priv->bufs[priv->buf_idx];
+		priv->buf_len = priv->pending_len;
+		priv->buf_cur = priv->skip;
+		priv->skip = 0;
 		priv->need_more_data = FALSE;
-		priv->buf_cur = 0;
+
+		priv->buf_idx = (priv->buf_idx + 1) % PART_READER_BUF_NB;
+		ret = part_read_ahead(priv, priv->buf_idx);
+		if (EFI_ERROR(ret))
+			return ret;
 	}
 
 	*len = min(*len, priv->buf_len - priv->buf_cur);
@@ -425,6 +737,11 @@ static EFI_STATUS part_read(reader_ctx_t *ctx, unsigned char **buf, UINTN *len)
 	return EFI_SUCCESS;
 }
 
+static void part_close(reader_ctx_t *ctx)
+{
+	free_part_priv(ctx->private);
+}
+
 /* ACPI table reader */
 static EFI_STATUS acpi_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 {
@@ -448,14 +765,74 @@ static EFI_STATUS acpi_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 }
 
 /* EFI variable reader */
-static EFI_STATUS efivar_find(CHAR16 *varname, EFI_GUID *guid_p)
+
+/* GetNextVariableName() is very slow on some firmwares.  A name to
+   GUID index of the variable store is built on the first lookup and
+   kept until a variable is written.  */
+struct efivar_entry {
+	CHAR16 *name;
+	EFI_GUID guid;
+};
+
+static struct {
+	BOOLEAN valid;
+	UINTN generation;
+	UINTN nb;
+	UINTN max;
+	struct efivar_entry *entries;
+} efivar_index;
+
+static void efivar_index_free(void)
+{
+	UINTN i;
+
+	for (i = 0; i < efivar_index.nb; i++)
+		FreePool(efivar_index.entries[i].name);
+	if (efivar_index.entries)
+		FreePool(efivar_index.entries);
+	ZeroMem(&efivar_index, sizeof(efivar_index));
+}
+
+static EFI_STATUS efivar_index_add(CHAR16 *name, EFI_GUID *guid)
+{
+	struct efivar_entry *entries;
+	UINTN max;
+
+	if (efivar_index.nb == efivar_index.max) {
+		max = efivar_index.max ? efivar_index.max * 2 : 128;
+		entries = AllocatePool(max * sizeof(*entries));
+		if (!entries)
+			return EFI_OUT_OF_RESOURCES;
+		if (efivar_index.entries) {
+			memcpy(entries, efivar_index.entries,
+			       efivar_index.nb * sizeof(*entries));
+			FreePool(efivar_index.entries);
+		}
+		efivar_index.entries = entries;
+		efivar_index.max = max;
+	}
+
+	efivar_index.entries[efivar_index.nb].name = StrDuplicate(name);
+	if (!efivar_index.entries[efivar_index.nb].name)
+		return EFI_OUT_OF_RESOURCES;
+	efivar_index.entries[efivar_index.nb].guid = *guid;
+	efivar_index.nb++;
+
+	return EFI_SUCCESS;
+}
+
+typedef EFI_STATUS (*efivar_cb_t)(CHAR16 *name, EFI_GUID *guid, void *data);
+
+/* Walk the variable store once, building the index and calling CB, if
+   not NULL, for each variable.  */
+static EFI_STATUS efivar_index_build(efivar_cb_t cb, void *data)
 {
 	EFI_STATUS ret;
 	UINTN bufsize, namesize;
 	CHAR16 *name;
 	EFI_GUID guid;
-	BOOLEAN found = FALSE;
-	EFI_GUID found_guid;
+
+	efivar_index_free();
 
 	bufsize = 64;		/* Initial size large enough to handle
 				   usual variable names length and
@@ -479,6 +856,7 @@ static EFI_STATUS efivar_find(CHAR16 *varname, EFI_GUID *guid_p)
 			name = ReallocatePool(name, bufsize, namesize);
 			if (!name) {
 				error(L"Failed to re-allocate variable name buffer");
+				efivar_index_free();
 				return EFI_OUT_OF_RESOURCES;
 			}
 			bufsize = namesize;
@@ -489,26 +867,159 @@ static EFI_STATUS efivar_find(CHAR16 *varname, EFI_GUID *guid_p)
 			break;
 		}
 
-		if (!StrCmp(name, varname)) {
-			if (found) {
-				error(L"Found 2 variables named %s", varname);
-				ret = EFI_UNSUPPORTED;
+		ret = efivar_index_add(name, &guid);
+		if (EFI_ERROR(ret)) {
+			error(L"Failed to add %s to the variable index", name);
+			break;
+		}
+
+		if (cb) {
+			ret = cb(name, &guid, data);
+			if (EFI_ERROR(ret))
 				break;
-			}
-			found = TRUE;
-			found_guid = guid;
 		}
 	}
 
 	FreePool(name);
 
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
+		efivar_index_free();
 		return ret;
+	}
+
+	efivar_index.valid = TRUE;
+	efivar_index.generation = efi_variable_generation();
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS efivar_find(CHAR16 *varname, EFI_GUID *guid_p)
+{
+	EFI_STATUS ret;
+	struct efivar_entry *found = NULL;
+	UINTN i;
+
+	if (!efivar_index.valid ||
+	    efivar_index.generation != efi_variable_generation()) {
+		ret = efivar_index_build(NULL, NULL);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	for (i = 0; i < efivar_index.nb; i++) {
+		if (StrCmp(efivar_index.entries[i].name, varname))
+			continue;
+		if (found) {
+			error(L"Found 2 variables named %s", varname);
+			return EFI_UNSUPPORTED;
+		}
+		found = &efivar_index.entries[i];
+	}
 
 	if (!found)
 		return EFI_NOT_FOUND;
 
-	*guid_p = found_guid;
+	*guid_p = found->guid;
+	return EFI_SUCCESS;
+}
+
+/* efivar:* dumps all the variables as a sequence of records, each
+   made of a struct efivar_record followed by the NUL terminated
+   variable name and the variable data.  */
+struct efivar_record {
+	EFI_GUID guid;
+	UINT32 attributes;
+	UINT32 name_size;
+	UINT32 data_size;
+} __attribute__((__packed__));
+
+struct efivar_dump {
+	unsigned char *buf;
+	UINTN len;
+	UINTN max;
+};
+
+static EFI_STATUS efivar_dump_reserve(struct efivar_dump *dump, UINTN size)
+{
+	unsigned char *buf;
+	UINTN new_max;
+
+	if (dump->max - dump->len >= size)
+		return EFI_SUCCESS;
+
+	new_max = max(dump->max * 2, dump->len + size);
+	buf = AllocatePool(new_max);
+	if (!buf) {
+		error(L"Failed to allocate the EFI variables dump buffer");
+		return EFI_OUT_OF_RESOURCES;
+	}
+	if (dump->buf) {
+		memcpy(buf, dump->buf, dump->len);
+		FreePool(dump->buf);
+	}
+	dump->buf = buf;
+	dump->max = new_max;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS efivar_dump_one(CHAR16 *name, EFI_GUID *guid, void *data)
+{
+	struct efivar_dump *dump = data;
+	struct efivar_record record;
+	EFI_STATUS ret;
+	UINTN header, size;
+	UINT32 attributes;
+
+	record.guid = *guid;
+	record.name_size = StrSize(name);
+	header = sizeof(record) + record.name_size;
+
+	size = 0;
+	ret = efivar_dump_reserve(dump, header);
+	for (;;) {
+		if (EFI_ERROR(ret))
+			return ret;
+		size = dump->max - dump->len - header;
+		ret = uefi_call_wrapper(RT->GetVariable, 5, name, guid,
+					&attributes, &size,
+					dump->buf + dump->len + header);
+		if (ret != EFI_BUFFER_TOO_SMALL)
+			break;
+		ret = efivar_dump_reserve(dump, header + size);
+	}
+	if (EFI_ERROR(ret)) {
+		debug(L"Skipping %s %g, %r", name, guid, ret);
+		return EFI_SUCCESS;
+	}
+
+	record.attributes = attributes;
+	record.data_size = size;
+	memcpy(dump->buf + dump->len, &record, sizeof(record));
+	memcpy(dump->buf + dump->len + sizeof(record), name, record.name_size);
+	dump->len += header + size;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS efivar_dump_open(reader_ctx_t *ctx)
+{
+	EFI_STATUS ret;
+	struct efivar_dump dump = { NULL, 0, 0 };
+
+	ret = efivar_dump_reserve(&dump, 64 * 1024);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = efivar_index_build(efivar_dump_one, &dump);
+	if (EFI_ERROR(ret)) {
+		FreePool(dump.buf);
+		return ret;
+	}
+
+	ctx->private = dump.buf;
+	ctx->cur = 0;
+	ctx->len = dump.len;
+
 	return EFI_SUCCESS;
 }
 
@@ -523,6 +1034,9 @@ static EFI_STATUS efivar_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 	if (argc != 1 && argc != 2)
 		return EFI_INVALID_PARAMETER;
 
+	if (argc == 1 && !strcmp((CHAR8 *)argv[0], (CHAR8 *)"*"))
+		return efivar_dump_open(ctx);
+
 	if (argc == 2) {
 		ret = stra_to_guid(argv[1], &guid);
 		if (EFI_ERROR(ret))
@@ -663,6 +1177,363 @@ static EFI_STATUS gpt_factory_parts_open(reader_ctx_t *ctx, UINTN argc,
 	return _gpt_parts_open(ctx, LOGICAL_UNIT_FACTORY);
 }
 
+/* TRANSPORT-STATS */
+#define TRANSPORT_STATS_SIZE 2048
+
+static const char *SIZE_CLASS_NAMES[TRANSPORT_SIZE_CLASSES] = {
+	"<512B ", "<4K   ", "<64K  ", "<1M   ", ">=1M  "
+};
+
+static EFI_STATUS transport_stats_open(reader_ctx_t *ctx, UINTN argc,
+				       __attribute__((__unused__)) char **argv)
+{
+	transport_stats_t stats;
+	const char *name;
+	CHAR8 *report;
+	UINTN index, class, len = 0;
+	UINT32 *h;
+	int n;
+
+	if (argc != 0)
+		return EFI_INVALID_PARAMETER;
+
+	report = AllocatePool(TRANSPORT_STATS_SIZE);
+	if (!report)
+		return EFI_OUT_OF_RESOURCES;
+
+	for (index = 0; !EFI_ERROR(transport_get_stats(index, &name, &stats)); index++) {
+		n = snprintf(report + len, TRANSPORT_STATS_SIZE - len,
+			     (CHAR8 *)"%a\n"
+			     "  rx %ld bytes in %ld transfers\n"
+			     "  tx %ld bytes in %ld transfers\n"
+			     "  errors %ld, retries %ld, re-arms %ld\n"
+			     "  latency  <10us <100us   <1ms  <10ms <100ms  >=100ms\n",
+			     name, stats.rx_bytes, stats.rx_transfers,
+			     stats.tx_bytes, stats.tx_transfers,
+			     stats.errors, stats.retries, stats.rearms);
+		if (n < 0)
+			break;
+		len = min(len + n, (UINTN)TRANSPORT_STATS_SIZE - 1);
+
+		for (class = 0; class < TRANSPORT_SIZE_CLASSES; class++) {
+			h = stats.latency[class];
+			n = snprintf(report + len, TRANSPORT_STATS_SIZE - len,
+				     (CHAR8 *)"  %a %6d %6d %6d %6d %6d %8d\n",
+				     SIZE_CLASS_NAMES[class],
+				     h[0], h[1], h[2], h[3], h[4], h[5]);
+			if (n < 0)
+				break;
+			len = min(len + n, (UINTN)TRANSPORT_STATS_SIZE - 1);
+		}
+	}
+
+	ctx->private = report;
+	ctx->len = len;
+	ctx->cur = 0;
+
+	return EFI_SUCCESS;
+}
+
+/* Binary dump of the trace ring, see tools/tracedump to decode it */
+static EFI_STATUS trace_open(reader_ctx_t *ctx, UINTN argc,
+			     __attribute__((__unused__)) char **argv)
+{
+	EFI_STATUS ret;
+	void *dump;
+	UINTN size;
+
+	if (argc != 0)
+		return EFI_INVALID_PARAMETER;
+
+	ret = trace_dump(&dump, &size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ctx->private = dump;
+	ctx->len = size;
+	ctx->cur = 0;
+
+	return EFI_SUCCESS;
+}
+
+/* LZ4 compressed stream of another reader.  Like the RAM reader, it
+   does not allocate memory so that it can wrap a RAM dump.  */
+#define LZ4_MIN_READ 64
+
+static EFI_STATUS reader_open_argv(reader_ctx_t *ctx, UINTN argc, char **argv);
+
+static struct lz4_priv {
+	BOOLEAN is_in_used;
+	reader_ctx_t inner;
+	BOOLEAN inner_done;
+	UINT8 in[LZ4_BLOCK_MAX];
+	UINT8 out[LZ4_BLOCK_BOUND(LZ4_BLOCK_MAX)];
+	UINTN out_cur;
+	UINTN out_len;
+} lz4_priv;
+
+static EFI_STATUS lz4_open(reader_ctx_t *ctx, UINTN argc, char **argv)
+{
+	EFI_STATUS ret;
+	struct lz4_priv *priv = &lz4_priv;
+	UINT64 blocks;
+
+	if (argc == 0)
+		return EFI_INVALID_PARAMETER;
+
+	if (priv->is_in_used)
+		return EFI_UNSUPPORTED;
+
+	priv->is_in_used = TRUE;
+	ret = reader_open_argv(&priv->inner, argc, argv);
+	if (EFI_ERROR(ret)) {
+		priv->is_in_used = FALSE;
+		return ret;
+	}
+
+	priv->inner_done = FALSE;
+	priv->out_cur = 0;
+	priv->out_len = lz4_frame_header(priv->out);
+	ctx->private = priv;
+
+	/* Upper bound, adjusted once the inner reader is exhausted */
+	blocks = DIV_ROUND_UP(priv->inner.len, LZ4_BLOCK_MAX - LZ4_MIN_READ);
+	ctx->len = priv->out_len + LZ4_END_MARK_SIZE +
+		blocks * LZ4_BLOCK_BOUND(LZ4_BLOCK_MAX);
+	ctx->cur = 0;
+
+	return EFI_SUCCESS;
+}
+
+/* Gather the inner reader data in a block and encode it.  */
+static EFI_STATUS lz4_fill(struct lz4_priv *priv)
+{
+	EFI_STATUS ret;
+	unsigned char *data;
+	UINTN len, in_len = 0;
+
+	while (!priv->inner_done && LZ4_BLOCK_MAX - in_len >= LZ4_MIN_READ) {
+		len = LZ4_BLOCK_MAX - in_len;
+		data = priv->in + in_len;
+		ret = reader_read(&priv->inner, &data, &len);
+		if (EFI_ERROR(ret))
+			return ret;
+
+		if (len == 0) {
+			priv->inner_done = TRUE;
+			break;
+		}
+
+		if (data != priv->in + in_len)
+			memcpy(priv->in + in_len, data, len);
+		in_len += len;
+	}
+
+	priv->out_cur = 0;
+	if (in_len)
+		priv->out_len = lz4_encode_block(priv->in, in_len, priv->out);
+	else
+		priv->out_len = lz4_end_mark(priv->out);
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS lz4_read(reader_ctx_t *ctx, unsigned char **buf, UINTN *len)
+{
+	EFI_STATUS ret;
+	struct lz4_priv *priv = ctx->private;
+
+	if (priv->out_cur == priv->out_len) {
+		/* The end mark has been sent */
+		if (priv->inner_done) {
+			*len = 0;
+			ctx->len = ctx->cur;
+			return EFI_SUCCESS;
+		}
+
+		ret = lz4_fill(priv);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	*len = min(*len, priv->out_len - priv->out_cur);
+	*buf = priv->out + priv->out_cur;
+	priv->out_cur += *len;
+
+	return EFI_SUCCESS;
+}
+
+static void lz4_close(reader_ctx_t *ctx)
+{
+	struct lz4_priv *priv = ctx->private;
+
+	reader_close(&priv->inner);
+	priv->is_in_used = FALSE;
+}
+
+/* SHA-256 digest of another reader.  With a block size argument,
+   the digest of each block is also reported so that the host only
+   has to fetch the blocks that differ.  */
+#define HASH_READ_SIZE (64 * 1024)
+#define HASH_HEX_LEN (SHA256_DIGEST_LENGTH * 2)
+#define HASH_LINE_LEN (16 + 1 + HASH_HEX_LEN + 1)
+#define HASH_TOTAL_LEN (6 + HASH_HEX_LEN + 1)
+
+static struct hash_priv {
+	BOOLEAN is_in_used;
+	reader_ctx_t inner;
+	BOOLEAN inner_done;
+	BOOLEAN total_done;
+	SHA256_CTX total;
+	SHA256_CTX block;
+	UINT64 block_size;
+	UINT64 offset;
+	UINT8 in[HASH_READ_SIZE];
+	CHAR8 out[HASH_LINE_LEN + 1];
+	UINTN out_cur;
+	UINTN out_len;
+} hash_priv;
+
+static EFI_STATUS hash_open(reader_ctx_t *ctx, UINTN argc, char **argv)
+{
+	EFI_STATUS ret;
+	struct hash_priv *priv = &hash_priv;
+	UINT64 block_size = 0;
+	char *endptr;
+
+	if (argc == 0)
+		return EFI_INVALID_PARAMETER;
+
+	/* Optional block size in MiB */
+	if (argv[0][0] >= '0' && argv[0][0] <= '9') {
+		block_size = strtoul(argv[0], &endptr, 10);
+		if (*endptr != '\0' || block_size == 0 || argc == 1)
+			return EFI_INVALID_PARAMETER;
+		block_size *= 1024 * 1024;
+		argc--;
+		argv++;
+	}
+
+	if (priv->is_in_used)
+		return EFI_UNSUPPORTED;
+
+	priv->is_in_used = TRUE;
+	ret = reader_open_argv(&priv->inner, argc, argv);
+	if (EFI_ERROR(ret)) {
+		priv->is_in_used = FALSE;
+		return ret;
+	}
+
+	SHA256_Init(&priv->total);
+	SHA256_Init(&priv->block);
+	priv->block_size = block_size;
+	priv->offset = 0;
+	priv->inner_done = FALSE;
+	priv->total_done = FALSE;
+	priv->out_cur = priv->out_len = 0;
+	ctx->private = priv;
+
+	/* Upper bound, adjusted once the inner reader is exhausted */
+	if (block_size)
+		ctx->len = HASH_TOTAL_LEN + HASH_LINE_LEN *
+			DIV_ROUND_UP(priv->inner.len, block_size);
+	else
+		ctx->len = HASH_HEX_LEN + 1;
+	ctx->cur = 0;
+
+	return EFI_SUCCESS;
+}
+
+/* Digest the inner reader data up to the end of the current block
+   and format the next line of the report.  */
+static EFI_STATUS hash_fill(struct hash_priv *priv)
+{
+	EFI_STATUS ret;
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	CHAR8 hex[HASH_HEX_LEN + 1];
+	unsigned char *data;
+	UINT64 block_len = 0;
+	UINTN len;
+	int n;
+
+	while (!priv->inner_done &&
+	       (!priv->block_size || block_len < priv->block_size)) {
+		len = sizeof(priv->in);
+		if (priv->block_size)
+			len = min((UINT64)len, priv->block_size - block_len);
+		data = priv->in;
+		ret = reader_read(&priv->inner, &data, &len);
+		if (EFI_ERROR(ret))
+			return ret;
+
+		if (len == 0) {
+			priv->inner_done = TRUE;
+			break;
+		}
+
+		SHA256_Update(&priv->total, data, len);
+		if (priv->block_size)
+			SHA256_Update(&priv->block, data, len);
+		block_len += len;
+	}
+
+	if (block_len && priv->block_size) {
+		SHA256_Final(digest, &priv->block);
+		SHA256_Init(&priv->block);
+		bytes_to_hex_stra(digest, sizeof(digest), hex, sizeof(hex));
+		n = snprintf(priv->out, sizeof(priv->out),
+			     (CHAR8 *)"%016lx %a\n", priv->offset, hex);
+		priv->offset += block_len;
+	} else {
+		SHA256_Final(digest, &priv->total);
+		bytes_to_hex_stra(digest, sizeof(digest), hex, sizeof(hex));
+		n = snprintf(priv->out, sizeof(priv->out),
+			     (CHAR8 *)(priv->block_size ? "total %a\n" : "%a\n"),
+			     hex);
+		priv->total_done = TRUE;
+	}
+	if (n < 0)
+		return EFI_OUT_OF_RESOURCES;
+
+	priv->out_cur = 0;
+	priv->out_len = min((UINTN)n, sizeof(priv->out) - 1);
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS hash_read(reader_ctx_t *ctx, unsigned char **buf, UINTN *len)
+{
+	EFI_STATUS ret;
+	struct hash_priv *priv = ctx->private;
+
+	if (priv->out_cur == priv->out_len) {
+		/* The overall digest has been sent */
+		if (priv->total_done) {
+			*len = 0;
+			ctx->len = ctx->cur;
+			return EFI_SUCCESS;
+		}
+
+		ret = hash_fill(priv);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	*len = min(*len, priv->out_len - priv->out_cur);
+	*buf = (unsigned char *)priv->out + priv->out_cur;
+	priv->out_cur += *len;
+
+	return EFI_SUCCESS;
+}
+
+static void hash_close(reader_ctx_t *ctx)
+{
+	struct hash_priv *priv = ctx->private;
+
+	reader_close(&priv->inner);
+	priv->is_in_used = FALSE;
+}
+
 /* Interface */
 static EFI_STATUS read_from_private(reader_ctx_t *ctx, unsigned char **buf,
 				    __attribute__((__unused__)) UINTN *len)
@@ -684,25 +1555,45 @@ struct reader {
 } READERS[] = {
 	{ "ram",		ram_open,			ram_read,		ram_close },
 	{ "acpi",		acpi_open,			read_from_private,	NULL },
-	{ "part",		part_open,			part_read,		free_private },
-	{ "factory-part",	factory_part_open,		part_read,		free_private },
+	{ "part",		part_open,			part_read,		part_close },
+	{ "factory-part",	factory_part_open,		part_read,		part_close },
 	{ "efivar",		efivar_open,			read_from_private,	free_private },
 	{ "mbr",		mbr_open,			read_from_private,	free_private },
 	{ "gpt-header",		gpt_header_open,		read_from_private,	free_private },
 	{ "gpt-parts",		gpt_parts_open,			read_from_private,	free_private },
 	{ "gpt-factory-header",	gpt_factory_header_open,	read_from_private,	free_private },
-	{ "gpt-factory-parts",	gpt_factory_parts_open,		read_from_private,	free_private }
+	{ "gpt-factory-parts",	gpt_factory_parts_open,		read_from_private,	free_private },
+	{ "transport-stats",	transport_stats_open,		read_from_private,	free_private },
+	{ "trace",		trace_open,			read_from_private,	free_private },
+	{ "lz4",		lz4_open,			lz4_read,		lz4_close },
+	{ "hash",		hash_open,			hash_read,		hash_close }
 };
 
 #define MAX_ARGS		8
 #define READER_DELIMITER	":"
 
+static EFI_STATUS reader_open_argv(reader_ctx_t *ctx, UINTN argc, char **argv)
+{
+	struct reader *reader = NULL;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(READERS); i++)
+		if (!strcmp((CHAR8 *)argv[0], (CHAR8 *)READERS[i].name)) {
+			reader = &READERS[i];
+			break;
+		}
+
+	if (!reader)
+		return EFI_UNSUPPORTED;
+
+	ctx->reader = reader;
+	return reader->open(ctx, argc - 1, argv + 1);
+}
+
 EFI_STATUS reader_open(reader_ctx_t *ctx, char *args)
 {
 	UINTN argc;
-	UINTN i;
 	char *argv[MAX_ARGS], *token, *saveptr;
-	struct reader *reader = NULL;
 
 	if (!args || !ctx)
 		return EFI_INVALID_PARAMETER;
@@ -721,17 +1612,7 @@ EFI_STATUS reader_open(reader_ctx_t *ctx, char *args)
 	if (token && strtok_r(NULL, READER_DELIMITER, &saveptr))
 		return EFI_INVALID_PARAMETER;
 
-	for (i = 0; i < ARRAY_SIZE(READERS); i++)
-		if (!strcmp((CHAR8 *)argv[0], (CHAR8 *)READERS[i].name)) {
-			reader = &READERS[i];
-			break;
-		}
-
-	if (!reader)
-		return EFI_UNSUPPORTED;
-
-	ctx->reader = reader;
-	return reader->open(ctx, argc - 1, argv + 1);
+	return reader_open_argv(ctx, argc, argv);
 }
 
 EFI_STATUS reader_read(reader_ctx_t *ctx, unsigned char **buf, UINTN *len)
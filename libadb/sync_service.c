@@ -71,14 +71,25 @@ typedef union {
 
 #define SYNC_DATA_MAX (64 * 1024)
 
+/* The DATA messages are a byte stream packed in WRTE packets of the
+   negotiated payload size.  While a packet waits for the host OKAY
+   message, the next one is already filled from the reader.  */
+#define SYNC_PACKETS 2
+
 typedef struct {
 	state_t state;
 	reader_ctx_t reader_ctx;
 	BOOLEAN need_more_data;
+	BOOLEAN eof;
 	unsigned char *buf;
 	UINTN buf_cur;
 	UINTN buf_len;
 	UINT64 sent;
+	unsigned char *pkt[SYNC_PACKETS];
+	UINT32 pkt_len[SYNC_PACKETS];
+	BOOLEAN pkt_last[SYNC_PACKETS];
+	UINT32 pkt_size;
+	UINTN cur_pkt;
 } sync_ctx_t;
 static sync_ctx_t CONTEXTS[MAX_ADB_SOCKET];
 
@@ -121,65 +132,127 @@ static EFI_STATUS sync_service_close(asock_t s)
 	if (ctx->state == SENDING_DATA)
 		reader_close(&ctx->reader_ctx);
 
+	if (ctx->pkt[0]) {
+		FreePool(ctx->pkt[0]);
+		ctx->pkt[0] = NULL;
+	}
 	ctx->state = FREE;
 
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS send_done(asock_t s, sync_ctx_t *ctx)
+static EFI_STATUS alloc_packets(sync_ctx_t *ctx)
 {
-	sync_msg_t msg;
+	UINTN i;
 
-	reader_close(&ctx->reader_ctx);
+	if (ctx->pkt[0] && ctx->pkt_size == adb_max_payload)
+		return EFI_SUCCESS;
 
-	ctx->state = ESTABLISHED;
+	if (ctx->pkt[0])
+		FreePool(ctx->pkt[0]);
+
+	ctx->pkt[0] = AllocatePool(SYNC_PACKETS * adb_max_payload);
+	if (!ctx->pkt[0]) {
+		error(L"Failed to allocate the sync packet buffers");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	for (i = 1; i < SYNC_PACKETS; i++)
+		ctx->pkt[i] = ctx->pkt[0] + i * adb_max_payload;
+	ctx->pkt_size = adb_max_payload;
 
-	msg.req.id = ID_DONE;
-	msg.req.namelen = 0;
-	return asock_write(s, (unsigned char *)&msg, sizeof(msg.req));
+	return EFI_SUCCESS;
 }
 
 #define DATA_PROGRESS_THRESHOLD (5 * 1024 * 1024)
 
-static EFI_STATUS send_more_data(asock_t s, sync_ctx_t *ctx)
+/* Fill the I packet with the next part of the DATA messages stream
+   and, at the end of the reader data, with the DONE message.  */
+static EFI_STATUS fill_packet(sync_ctx_t *ctx, UINTN i)
 {
 	EFI_STATUS ret;
-	UINT32 sent;
+	unsigned char *pkt = ctx->pkt[i];
+	UINT32 len = 0, size;
 	sync_msg_t msg;
 
-	/* Need to load more data. */
-	if (ctx->need_more_data) {
-		ctx->buf_len = SYNC_DATA_MAX;
+	while (ctx->pkt_size - len >= sizeof(msg.data)) {
+		if (ctx->eof) {
+			msg.req.id = ID_DONE;
+			msg.req.namelen = 0;
+			memcpy(pkt + len, &msg, sizeof(msg.req));
+			len += sizeof(msg.req);
+			ctx->pkt_last[i] = TRUE;
+			break;
+		}
+
+		if (ctx->need_more_data) {
+			ctx->buf_len = SYNC_DATA_MAX;
+			ret = reader_read(&ctx->reader_ctx, &ctx->buf, &ctx->buf_len);
+			if (EFI_ERROR(ret))
+				return ret;
+
+			if (ctx->buf_len == 0) { /* No more data to send. */
+				ctx->eof = TRUE;
+				continue;
+			}
+
+			msg.data.id = ID_DATA;
+			msg.data.size = ctx->buf_len;
+			memcpy(pkt + len, &msg, sizeof(msg.data));
+			len += sizeof(msg.data);
+			ctx->buf_cur = 0;
+			ctx->need_more_data = FALSE;
+		}
+
+		size = min((UINTN)ctx->pkt_size - len, ctx->buf_len - ctx->buf_cur);
+		memcpy(pkt + len, ctx->buf + ctx->buf_cur, size);
+		len += size;
+		ctx->buf_cur += size;
+		if (ctx->buf_cur == ctx->buf_len)
+			ctx->need_more_data = TRUE;
+
+		ctx->sent += size;
+		if (ctx->sent >= DATA_PROGRESS_THRESHOLD &&
+		    ctx->sent % DATA_PROGRESS_THRESHOLD < size)
+			debug(L"%d MB have been sent", ctx->sent / 1024 / 1024);
+	}
 
-		ret = reader_read(&ctx->reader_ctx, &ctx->buf, &ctx->buf_len);
-		if (EFI_ERROR(ret))
-			return ret;
-		if (ctx->buf_len == 0) /* No more data to send. */
-			return send_done(s, ctx);
+	ctx->pkt_len[i] = len;
+	return EFI_SUCCESS;
+}
 
-		msg.data.id = ID_DATA;
-		msg.data.size = ctx->buf_len;
-		ctx->buf_cur = 0;
-		ctx->need_more_data = FALSE;
+/* Send the prefetched packet and fill the next one while it is in
+   flight.  */
+static EFI_STATUS prefetch(sync_ctx_t *ctx)
+{
+	EFI_STATUS ret;
 
-		return asock_write(s, (unsigned char *)&msg, sizeof(msg.data));
+	ret = fill_packet(ctx, ctx->cur_pkt);
+	if (EFI_ERROR(ret)) {
+		reader_close(&ctx->reader_ctx);
+		ctx->state = ESTABLISHED;
 	}
 
-	sent = min((UINTN)adb_max_payload, ctx->buf_len - ctx->buf_cur);
-	ret = asock_write(s, ctx->buf + ctx->buf_cur, sent);
+	return ret;
+}
+
+static EFI_STATUS send_more_data(asock_t s, sync_ctx_t *ctx)
+{
+	EFI_STATUS ret;
+	UINTN i = ctx->cur_pkt;
+
+	ret = asock_write_nocopy(s, ctx->pkt[i], ctx->pkt_len[i]);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	ctx->buf_cur = ctx->buf_cur + sent;
-	if (ctx->buf_cur == ctx->buf_len)
-		ctx->need_more_data = TRUE;
-
-	ctx->sent += sent;
-	if (ctx->sent >= DATA_PROGRESS_THRESHOLD &&
-	    ctx->sent % DATA_PROGRESS_THRESHOLD < sent)
-		debug(L"%d MB have been sent", ctx->sent / 1024 / 1024);
+	if (ctx->pkt_last[i]) {
+		reader_close(&ctx->reader_ctx);
+		ctx->state = ESTABLISHED;
+		return EFI_SUCCESS;
+	}
 
-	return ret;
+	ctx->cur_pkt = (i + 1) % SYNC_PACKETS;
+	return prefetch(ctx);
 }
 
 static EFI_STATUS sync_service_okay(asock_t s)
@@ -244,11 +317,16 @@ fail:
 static EFI_STATUS sync_service_recv(asock_t s, sync_ctx_t *ctx, unsigned char *data, UINT32 length)
 {
 	EFI_STATUS ret;
+	UINTN i;
 
 	ret = asock_send_okay(s);
 	if (EFI_ERROR(ret))
 		return ret;
 
+	ret = alloc_packets(ctx);
+	if (EFI_ERROR(ret))
+		return ret;
+
 	ret = sync_service_reader_open(ctx, data, length);
 	if (EFI_ERROR(ret))
 		return ret;
@@ -256,6 +334,14 @@ static EFI_STATUS sync_service_recv(asock_t s, sync_ctx_t *ctx, unsigned char *d
 	ctx->sent = 0;
 	ctx->state = SENDING_DATA;
 	ctx->need_more_data = TRUE;
+	ctx->eof = FALSE;
+	ctx->cur_pkt = 0;
+	for (i = 0; i < SYNC_PACKETS; i++)
+		ctx->pkt_last[i] = FALSE;
+
+	ret = prefetch(ctx);
+	if (EFI_ERROR(ret))
+		return ret;
 
 	return send_more_data(s, ctx);
 }
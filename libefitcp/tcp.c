@@ -35,6 +35,7 @@
 #include <vars.h>
 #include <efitcp.h>
 #include <smbios.h>
+#include <timer.h>
 
 #include "tcp.h"
 
@@ -49,59 +50,173 @@ static EFI_TCP4 *tcp_listener;
 static EFI_TCP4_LISTEN_TOKEN accept_token;
 static EFI_TCP4_CLOSE_TOKEN close_token;
 
-/* RX data structures  */
-#define MAX_TOKEN 16
-#define RX_FRAG_SIZE 2048  /* Fragment size greater or equal to TCP
-			      MSS  */
+/* RX data structures.  Receive fragments are posted directly in
+   the caller buffer, the number of tokens in flight depends on the
+   size of the read request.  A vectored read uses a single token
+   with up to MAX_RX_FRAGMENT fragments.  */
+#define MAX_RX_TOKEN 64
+#define MAX_RX_FRAGMENT 4
+#define RX_FRAG_SIZE (64 * 1024)
 typedef struct token {
 	EFI_TCP4_IO_TOKEN token;
 	UINT32 requested;
+	UINT32 offset;
 } token_t;
-static token_t rx_token[MAX_TOKEN];
-static EFI_TCP4_RECEIVE_DATA rx_data[MAX_TOKEN];
-static CHAR8 rx_frag_buf[MAX_TOKEN][RX_FRAG_SIZE];
-
-/* TX data structures  */
+typedef struct rx_data {
+	EFI_TCP4_RECEIVE_DATA data;
+	EFI_TCP4_FRAGMENT_DATA more[MAX_RX_FRAGMENT - 1];
+} rx_data_t;
+static token_t rx_token[MAX_RX_TOKEN];
+static rx_data_t rx_data[MAX_RX_TOKEN];
+
+/* TX data structures.  Up to MAX_TX_TOKEN messages can be queued in
+   the TCP driver, each made of up to MAX_TX_FRAGMENT fragments.  */
+#define MAX_TX_TOKEN 32
+#define MAX_TX_FRAGMENT 4
+typedef struct tx_data {
+	EFI_TCP4_TRANSMIT_DATA data;
+	EFI_TCP4_FRAGMENT_DATA more[MAX_TX_FRAGMENT - 1];
+} tx_data_t;
 static UINTN next_tx_token;
-static token_t tx_token[MAX_TOKEN];
-static EFI_TCP4_TRANSMIT_DATA tx_data[MAX_TOKEN];
+static token_t tx_token[MAX_TX_TOKEN];
+static tx_data_t tx_data[MAX_TX_TOKEN];
 
 /* Events  */
 static BOOLEAN events_created;
 
+/* Signaled whenever a completion handler ran, so that the caller can
+   sleep with WaitForEvent() until there is something to process.  */
+static EFI_EVENT activity_event;
+
 /* Caller data  */
 static start_callback_t start_callback;
 static data_callback_t rx_callback;
 static data_callback_t tx_callback;
+static address_callback_t address_callback;
+
+static transport_counters_t counters;
 
 static struct rx {
 	char *buf;
 	UINT32 size;
-	UINT32 requested;
+	UINT32 requested;	/* Bytes requested by the tokens in flight */
 	UINT32 received;
+	UINT32 posted;		/* End of the last posted fragment */
+	UINTN depth;
+	UINTN head;		/* Oldest token in flight */
+	UINTN tail;		/* Next token to post */
+	UINTN inflight;
 	BOOLEAN receiving;
 } rx;
 
-static EFI_STATUS request_data(token_t *token, UINT32 max_size)
+static struct rxv {
+	transport_fragment_t frags[MAX_RX_FRAGMENT];
+	UINTN count;
+	UINT32 size;
+	UINT32 received;
+	BOOLEAN active;
+} rxv;
+
+static UINT32 rx_next_fragment_size(void)
+{
+	/* A short completion shifts the following data down, the
+	   tail of the buffer can only be posted again once all the
+	   tokens in flight have completed.  */
+	if (rx.inflight == 0)
+		rx.posted = rx.received;
+
+	return min(min(rx.size - rx.received - rx.requested,
+		       rx.size - rx.posted), (UINT32)RX_FRAG_SIZE);
+}
+
+static EFI_STATUS request_data(token_t *token, UINT32 size)
 {
 	EFI_STATUS ret;
-	UINTN size = min(max_size, (UINT32)RX_FRAG_SIZE);
 	EFI_TCP4_RECEIVE_DATA *data = token->token.Packet.RxData;
 
 	data->DataLength = size;
+	data->FragmentCount = 1;
 	data->FragmentTable[0].FragmentLength = size;
+	data->FragmentTable[0].FragmentBuffer = rx.buf + rx.posted;
 
 	token->requested = size;
+	token->offset = rx.posted;
 	rx.requested += size;
+	rx.posted += size;
+	rx.tail = (rx.tail + 1) % rx.depth;
+	rx.inflight++;
 
 	ret = uefi_call_wrapper(tcp_connection->Receive, 2,
 				tcp_connection, &token->token);
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
+		counters.errors++;
+		efi_perror(ret, L"TCP Receive failed");
+	}
+
+	return ret;
+}
+
+static EFI_STATUS post_rx_tokens(void)
+{
+	EFI_STATUS ret;
+	UINT32 size;
+
+	while (rx.inflight < rx.depth) {
+		size = rx_next_fragment_size();
+		if (!size)
+			break;
+
+		ret = request_data(&rx_token[rx.tail], size);
+		if (EFI_ERROR(ret)) {
+			rx.receiving = FALSE;
+			return ret;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Post a vectored read, it completes at the first received data.  */
+static EFI_STATUS request_vector_data(void)
+{
+	EFI_STATUS ret;
+	token_t *token = &rx_token[0];
+	EFI_TCP4_RECEIVE_DATA *data = token->token.Packet.RxData;
+	UINTN i;
+
+	for (i = 0; i < rxv.count; i++) {
+		data->FragmentTable[i].FragmentBuffer = rxv.frags[i].buf;
+		data->FragmentTable[i].FragmentLength = rxv.frags[i].size;
+	}
+
+	data->FragmentCount = rxv.count;
+	data->DataLength = rxv.size;
+	token->requested = data->DataLength;
+
+	ret = uefi_call_wrapper(tcp_connection->Receive, 2,
+				tcp_connection, &token->token);
+	if (EFI_ERROR(ret)) {
+		rxv.active = rx.receiving = FALSE;
+		counters.errors++;
 		efi_perror(ret, L"TCP Receive failed");
+	}
 
 	return ret;
 }
 
+static void vector_data_received(EFI_TCP4_RECEIVE_DATA *data)
+{
+	rxv.received = data->DataLength;
+	rxv.active = rx.receiving = FALSE;
+	rx_callback(rxv.frags[0].buf, rxv.received);
+}
+
+static void signal_activity(void)
+{
+	if (activity_event)
+		uefi_call_wrapper(BS->SignalEvent, 1, activity_event);
+}
+
 /* Event handlers */
 static void EFIAPI data_sent(__attribute__((__unused__)) EFI_EVENT evt,
 			     void *ctx)
@@ -109,9 +224,17 @@ static void EFIAPI data_sent(__attribute__((__unused__)) EFI_EVENT evt,
 	token_t *token = (token_t *)ctx;
 	EFI_TCP4_TRANSMIT_DATA *data = token->token.Packet.TxData;
 
-	if (token->requested != data->DataLength) {
-		error(L"TCP sent failed. %d bytes sent instead of %d",
-		      data->DataLength, token->requested);
+	signal_activity();
+	if (EFI_ERROR(token->token.CompletionToken.Status) ||
+	    token->requested != data->DataLength) {
+		counters.errors++;
+		efi_perror(token->token.CompletionToken.Status,
+			   L"TCP sent failed. %d bytes sent instead of %d",
+			   data->DataLength, token->requested);
+		/* The callback still releases the buffer, a zero
+		   length tells that the send failed.  */
+		token->requested = 0;
+		tx_callback(data->FragmentTable[0].FragmentBuffer, 0);
 		return;
 	}
 
@@ -125,9 +248,11 @@ static void EFIAPI data_received(__attribute__((__unused__)) EFI_EVENT evt, void
 	EFI_STATUS ret;
 	token_t *token = (token_t *)ctx;
 	EFI_TCP4_RECEIVE_DATA *data = token->token.Packet.RxData;
+	UINT32 length;
 
+	signal_activity();
 	if (token->token.CompletionToken.Status == EFI_CONNECTION_FIN) {
-		rx.receiving = FALSE;
+		rxv.active = rx.receiving = FALSE;
 
 		if (!events_created)
 			return;
@@ -141,26 +266,44 @@ static void EFIAPI data_received(__attribute__((__unused__)) EFI_EVENT evt, void
 	}
 
 	if (EFI_ERROR(token->token.CompletionToken.Status)) {
-		rx.receiving = FALSE;
+		rxv.active = rx.receiving = FALSE;
+		counters.errors++;
 		efi_perror(token->token.CompletionToken.Status,
 			   L"TCP data received failed");
 		return;
 	}
 
-	memcpy(rx.buf + rx.received,
-	       data->FragmentTable[0].FragmentBuffer,
-	       data->FragmentTable[0].FragmentLength);
+	if (rxv.active) {
+		vector_data_received(data);
+		return;
+	}
 
-	rx.received += data->FragmentTable[0].FragmentLength;
-	rx.requested -= token->requested;
+	/* The TCP driver completes the receive tokens in order.  */
+	if (token != &rx_token[rx.head]) {
+		rx.receiving = FALSE;
+		counters.errors++;
+		error(L"TCP receive token completed out of order");
+		return;
+	}
+	rx.head = (rx.head + 1) % rx.depth;
+	rx.inflight--;
+
+	length = data->FragmentTable[0].FragmentLength;
+	if (token->offset != rx.received)
+		CopyMem(rx.buf + rx.received, rx.buf + token->offset, length);
 
-	if (rx.requested < rx.size - rx.received)
-		request_data(token, rx.size - rx.received - rx.requested);
+	rx.received += length;
+	rx.requested -= token->requested;
 
 	if (rx.received == rx.size) {
 		rx.receiving = FALSE;
 		rx_callback(rx.buf, rx.received);
+		return;
 	}
+
+	if (rx.posted < rx.size)
+		counters.rearms++;
+	post_rx_tokens();
 }
 
 static void EFIAPI connection_accepted(__attribute__((__unused__)) EFI_EVENT evt,
@@ -169,9 +312,12 @@ static void EFIAPI connection_accepted(__attribute__((__unused__)) EFI_EVENT evt
 	EFI_TCP4_LISTEN_TOKEN *token = (EFI_TCP4_LISTEN_TOKEN *)ctx;
 	EFI_STATUS ret;
 
+	signal_activity();
 	if (EFI_ERROR(token->CompletionToken.Status)) {
-		efi_perror(token->CompletionToken.Status,
-			   L"connection_accepted with bad status");
+		/* The listener moved to another address.  */
+		if (token->CompletionToken.Status != EFI_ABORTED)
+			efi_perror(token->CompletionToken.Status,
+				   L"connection_accepted with bad status");
 		return;
 	}
 
@@ -195,6 +341,7 @@ static void EFIAPI connection_closed(__attribute__((__unused__)) EFI_EVENT evt,
 {
 	EFI_STATUS ret;
 
+	signal_activity();
 	ret = uefi_call_wrapper(tcp_connection->Configure, 2,
 				tcp_connection, NULL);
 	if (EFI_ERROR(ret)) {
@@ -216,16 +363,17 @@ static void init_rx_tx_structures()
 {
 	UINTN i;
 
-	for (i = 0; i < MAX_TOKEN; i++) {
-		rx_data[i].UrgentFlag = FALSE;
-		rx_data[i].FragmentCount = 1;
-		rx_data[i].FragmentTable[0].FragmentBuffer = rx_frag_buf[i];
-		rx_token[i].token.Packet.RxData = &rx_data[i];
+	for (i = 0; i < MAX_RX_TOKEN; i++) {
+		rx_data[i].data.UrgentFlag = FALSE;
+		rx_data[i].data.FragmentCount = 1;
+		rx_token[i].token.Packet.RxData = &rx_data[i].data;
+	}
 
-		tx_data[i].Push = TRUE;
-		tx_data[i].Urgent = FALSE;
-		tx_data[i].FragmentCount = 1;
-		tx_token[i].token.Packet.TxData = &tx_data[i];
+	for (i = 0; i < MAX_TX_TOKEN; i++) {
+		tx_data[i].data.Push = TRUE;
+		tx_data[i].data.Urgent = FALSE;
+		tx_data[i].data.FragmentCount = 1;
+		tx_token[i].token.Packet.TxData = &tx_data[i].data;
 	}
 }
 
@@ -256,7 +404,7 @@ static EFI_STATUS create_events()
 		goto accept;
 	}
 
-	for (i = 0; i < MAX_TOKEN; i++) {
+	for (i = 0; i < MAX_TX_TOKEN; i++) {
 		ret = uefi_call_wrapper(BS->CreateEvent, 5,
 					EVT_NOTIFY_SIGNAL,
 					TPL_CALLBACK,
@@ -269,7 +417,7 @@ static EFI_STATUS create_events()
 		}
 	}
 
-	for (j = 0; j < MAX_TOKEN; j++) {
+	for (j = 0; j < MAX_RX_TOKEN; j++) {
 		ret = uefi_call_wrapper(BS->CreateEvent, 5,
 					EVT_NOTIFY_SIGNAL,
 					TPL_CALLBACK,
@@ -282,6 +430,14 @@ static EFI_STATUS create_events()
 		}
 	}
 
+	/* Only an optimization: without it, the caller keeps polling.  */
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+				&activity_event);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create TCP activity event");
+		activity_event = NULL;
+	}
+
 	events_created = TRUE;
 	return EFI_SUCCESS;
 
@@ -316,28 +472,32 @@ void close_events()
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed close TCP Accept event");
 
-	for (i = 0; i < MAX_TOKEN; i++) {
+	for (i = 0; i < MAX_TX_TOKEN; i++) {
 		ret = uefi_call_wrapper(BS->CloseEvent, 1,
 					tx_token[i].token.CompletionToken.Event);
 		if (EFI_ERROR(ret))
 			efi_perror(ret, L"Failed to close TCP Transmit %d event", i);
 	}
 
-	for (i = 0; i < MAX_TOKEN; i++) {
+	for (i = 0; i < MAX_RX_TOKEN; i++) {
 		ret = uefi_call_wrapper(BS->CloseEvent, 1,
 					rx_token[i].token.CompletionToken.Event);
 		if (EFI_ERROR(ret))
 			efi_perror(ret, L"Failed to close TCP Receive %d event", i);
 	}
 
+	if (activity_event) {
+		uefi_call_wrapper(BS->CloseEvent, 1, activity_event);
+		activity_event = NULL;
+	}
+
 	events_created = FALSE;
 }
 
-static EFI_STATUS ip_configuration(UINT32 port, EFI_IPv4_ADDRESS *address)
+static void tcp_config_init(EFI_TCP4_CONFIG_DATA *tcp_config, UINT32 port,
+			    ip_config_t *ip)
 {
-	EFI_STATUS ret;
-	EFI_IP4_MODE_DATA ip_data;
-	EFI_TCP4_CONFIG_DATA tcp_config = {
+	EFI_TCP4_CONFIG_DATA config = {
 		.TypeOfService = 0x00,
 		.TimeToLive = 255,
 		.AccessPoint = {
@@ -352,60 +512,282 @@ static EFI_STATUS ip_configuration(UINT32 port, EFI_IPv4_ADDRESS *address)
 		.ControlOption = NULL
 	};
 
+	if (ip) {
+		config.AccessPoint.UseDefaultAddress = FALSE;
+		config.AccessPoint.StationAddress = ip->address;
+		config.AccessPoint.SubnetMask = ip->subnet;
+	}
+
+	memcpy(tcp_config, &config, sizeof(config));
+}
+
+static EFI_STATUS get_ip_config(EFI_TCP4 *tcp, ip_config_t *ip)
+{
+	EFI_STATUS ret;
+	EFI_IP4_MODE_DATA ip_data;
+
+	ret = uefi_call_wrapper(tcp->GetModeData, 5,
+				tcp, NULL, NULL, &ip_data, NULL, NULL);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get IP mode data");
+		return ret;
+	}
+
+	if (!ip_data.IsConfigured)
+		return EFI_NOT_READY;
+
+	ip->address = ip_data.ConfigData.StationAddress;
+	ip->subnet = ip_data.ConfigData.SubnetMask;
+
+	return EFI_SUCCESS;
+}
+
+/* When the network configuration comes from the cache, the DHCP
+   configuration is done in the background with a probe TCP
+   instance.  If the lease changed, the cache is updated and the
+   listener moves to the new address unless a connection is
+   established.  */
+#define REVALIDATE_PERIOD_US (100 * 1000)
+
+static struct revalidation {
+	BOOLEAN active;
+	EFI_HANDLE handle;
+	EFI_TCP4 *tcp;
+	ip_config_t cached;
+	UINT32 port;
+	UINT64 next_us;
+} reval;
+
+static void revalidation_stop(void)
+{
+	if (reval.tcp) {
+		uefi_call_wrapper(reval.tcp->Configure, 2, reval.tcp, NULL);
+		reval.tcp = NULL;
+	}
+
+	if (reval.handle) {
+		uefi_call_wrapper(tcp_srv_binding->DestroyChild, 2,
+				  tcp_srv_binding, reval.handle);
+		reval.handle = NULL;
+	}
+
+	reval.active = FALSE;
+}
+
+static void revalidation_start(UINT32 port, ip_config_t *cached)
+{
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(tcp_srv_binding->CreateChild, 2,
+				tcp_srv_binding, &reval.handle);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create TCP probe child");
+		return;
+	}
+
+	ret = uefi_call_wrapper(BS->OpenProtocol, 6,
+				reval.handle,
+				&TCP_GUID,
+				(VOID **)&reval.tcp,
+				g_parent_image,
+				NULL,
+				EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open TCP probe protocol");
+		reval.tcp = NULL;
+		revalidation_stop();
+		return;
+	}
+
+	reval.cached = *cached;
+	reval.port = port;
+	reval.next_us = 0;
+	reval.active = TRUE;
+}
+
+static void revalidation_poll(void)
+{
+	EFI_STATUS ret;
+	EFI_TCP4_CONFIG_DATA tcp_config;
+	ip_config_t ip;
+	UINT64 now;
+
+	now = timer_us();
+	if (now < reval.next_us)
+		return;
+	reval.next_us = now + REVALIDATE_PERIOD_US;
+
+	/* Port 0, let the driver pick one.  */
+	tcp_config_init(&tcp_config, 0, NULL);
+	ret = uefi_call_wrapper(reval.tcp->Configure, 2, reval.tcp, &tcp_config);
+	if (ret == EFI_NO_MAPPING)
+		return;
+	if (!EFI_ERROR(ret))
+		ret = get_ip_config(reval.tcp, &ip);
+	if (ret == EFI_NOT_READY)
+		return;
+	revalidation_stop();
+	if (EFI_ERROR(ret))
+		return;
+
+	if (!memcmp(&ip, &reval.cached, sizeof(ip)))
+		return;
+
+	debug(L"Cached IP configuration is stale, using %d.%d.%d.%d",
+	      ip.address.Addr[0], ip.address.Addr[1],
+	      ip.address.Addr[2], ip.address.Addr[3]);
+	set_cached_ip_config(&ip);
+
+	if (tcp_connection)
+		return;
+
+	uefi_call_wrapper(tcp_listener->Configure, 2, tcp_listener, NULL);
+	tcp_config_init(&tcp_config, reval.port, &ip);
 	ret = uefi_call_wrapper(tcp_listener->Configure, 2,
 				tcp_listener, &tcp_config);
-	if (EFI_ERROR(ret) && ret != EFI_NO_MAPPING) {
-		efi_perror(ret, L"Failed to configure IP stack");
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to reconfigure the TCP listener");
+		return;
+	}
+
+	ret = uefi_call_wrapper(tcp_listener->Accept, 2,
+				tcp_listener, &accept_token);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"TCP Accept failed");
+}
+
+/* While DHCP is ongoing, the listener configuration is carried on
+   by tcp_run() so that the other transports are served meanwhile.
+   Without an answer after DHCP_TIMEOUT_US, TCP stays idle.  */
+static struct dhcp {
+	BOOLEAN pending;
+	UINT32 port;
+	UINT64 deadline_us;
+	UINT64 next_us;
+} dhcp;
+
+static EFI_STATUS listen(EFI_IPv4_ADDRESS *address)
+{
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(tcp_listener->Accept, 2,
+				tcp_listener, &accept_token);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"TCP Accept failed");
 		return ret;
 	}
 
-	/* DHCP still ongoing. */
-	if (ret == EFI_NO_MAPPING) {
-		do {
-			ret = uefi_call_wrapper(tcp_listener->GetModeData, 5,
-						tcp_listener, NULL, NULL, &ip_data, NULL, NULL);
-			if (EFI_ERROR(ret)) {
-				efi_perror(ret, L"Failed to get IP mode data");
-				return ret;
-			}
-		} while (!ip_data.IsConfigured);
+	address_callback(address);
+	return EFI_SUCCESS;
+}
+
+static void dhcp_poll(void)
+{
+	EFI_STATUS ret;
+	EFI_TCP4_CONFIG_DATA tcp_config;
+	ip_config_t ip;
+	UINT64 now;
+
+	now = timer_us();
+	if (now < dhcp.next_us)
+		return;
+	dhcp.next_us = now + DHCP_POLL_US;
+
+	ret = get_ip_config(tcp_listener, &ip);
+	if (ret == EFI_NOT_READY) {
+		if (now >= dhcp.deadline_us) {
+			debug(L"No DHCP answer, TCP is not available");
+			dhcp.pending = FALSE;
+		}
+		return;
+	}
+	dhcp.pending = FALSE;
+	if (EFI_ERROR(ret))
+		return;
+
+	tcp_config_init(&tcp_config, dhcp.port, NULL);
+	ret = uefi_call_wrapper(tcp_listener->Configure, 2,
+				tcp_listener, &tcp_config);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to configure IP stack");
+		return;
+	}
+
+	ret = get_ip_config(tcp_listener, &ip);
+	if (EFI_ERROR(ret))
+		return;
+
+	if (get_ip_config_cache())
+		set_cached_ip_config(&ip);
+
+	listen(&ip.address);
+}
+
+static EFI_STATUS ip_configuration(UINT32 port)
+{
+	EFI_STATUS ret;
+	EFI_TCP4_CONFIG_DATA tcp_config;
+	ip_config_t ip;
+	BOOLEAN cache = get_ip_config_cache();
+
+	/* A pinned address, or the last one we got, is used right
+	   away.  */
+	if (!EFI_ERROR(get_static_ip_config(&ip)) ||
+	    (cache && !EFI_ERROR(get_cached_ip_config(&ip)))) {
+		tcp_config_init(&tcp_config, port, &ip);
 		ret = uefi_call_wrapper(tcp_listener->Configure, 2,
 					tcp_listener, &tcp_config);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed to configure IP stack");
-			return ret;
+		if (!EFI_ERROR(ret)) {
+			if (cache)
+				revalidation_start(port, &ip);
+			return listen(&ip.address);
 		}
+		efi_perror(ret, L"Failed to use the stored IP configuration");
 	}
 
-	if (!ip_data.IsConfigured) {
-		ret = uefi_call_wrapper(tcp_listener->GetModeData, 5,
-					tcp_listener, NULL, NULL, &ip_data, NULL, NULL);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed to get IP mode data");
-			return ret;
-		}
+	tcp_config_init(&tcp_config, port, NULL);
+	ret = uefi_call_wrapper(tcp_listener->Configure, 2,
+				tcp_listener, &tcp_config);
+	/* DHCP still ongoing. */
+	if (ret == EFI_NO_MAPPING) {
+		dhcp.port = port;
+		dhcp.deadline_us = timer_us() + DHCP_TIMEOUT_US;
+		dhcp.next_us = 0;
+		dhcp.pending = TRUE;
+		return EFI_SUCCESS;
+	}
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to configure IP stack");
+		return ret;
 	}
 
-	memcpy(address, &ip_data.ConfigData.StationAddress, sizeof(address));
+	ret = get_ip_config(tcp_listener, &ip);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	return EFI_SUCCESS;
+	if (cache)
+		set_cached_ip_config(&ip);
+
+	return listen(&ip.address);
 }
 
 EFI_STATUS tcp_start(UINT32 port, start_callback_t start_cb,
 		     data_callback_t rx_cb, data_callback_t tx_cb,
-		     EFI_IPv4_ADDRESS *station_address)
+		     address_callback_t address_cb)
 {
 	EFI_GUID tcp_srv_binding_guid = EFI_TCP4_SERVICE_BINDING_PROTOCOL;
 	EFI_HANDLE *handles;
 	UINTN nb_handle = 0;
 	EFI_STATUS ret;
 
-	if (!start_cb || !rx_cb || !tx_cb || !station_address)
+	if (!start_cb || !rx_cb || !tx_cb || !address_cb)
 		return EFI_INVALID_PARAMETER;
 
 	start_callback = start_cb;
 	rx_callback = rx_cb;
 	tx_callback = tx_cb;
+	address_callback = address_cb;
+	ZeroMem(&counters, sizeof(counters));
 
 	ret = uefi_call_wrapper(BS->LocateHandleBuffer, 5, ByProtocol,
 				&tcp_srv_binding_guid, NULL, &nb_handle, &handles);
@@ -453,19 +835,12 @@ EFI_STATUS tcp_start(UINT32 port, start_callback_t start_cb,
 	if (EFI_ERROR(ret))
 		goto err;
 
-	ret = ip_configuration(port, station_address);
+	ret = ip_configuration(port);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"IP configuration failed");
 		goto err;
 	}
 
-	ret = uefi_call_wrapper(tcp_listener->Accept, 2,
-				tcp_listener, &accept_token);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"TCP Accept failed");
-		goto err;
-	}
-
 	return EFI_SUCCESS;
 
 err:
@@ -473,55 +848,112 @@ err:
 	return ret;
 }
 
-EFI_STATUS tcp_write(void *buf, UINT32 size)
+EFI_STATUS tcp_writev(transport_fragment_t *frags, UINTN count)
 {
 	EFI_STATUS ret;
-	token_t *token;
+	token_t *token = NULL;
 	EFI_TCP4_TRANSMIT_DATA *data;
+	UINT32 size = 0;
+	UINTN i;
+
+	if (!frags || !count || count > MAX_TX_FRAGMENT)
+		return EFI_INVALID_PARAMETER;
 
-	if (tx_token[next_tx_token].requested != 0)
+	/* Tokens do not necessarily complete in the order they were
+	   queued, take the first free one.  */
+	for (i = 0; i < MAX_TX_TOKEN; i++) {
+		if (tx_token[next_tx_token].requested == 0) {
+			token = &tx_token[next_tx_token];
+			break;
+		}
+		next_tx_token = (next_tx_token + 1) % MAX_TX_TOKEN;
+	}
+	if (!token)
 		return EFI_NOT_READY;
 
-	token = &tx_token[next_tx_token];
-	next_tx_token = (next_tx_token + 1) % MAX_TOKEN;
+	next_tx_token = (next_tx_token + 1) % MAX_TX_TOKEN;
 	data = token->token.Packet.TxData;
 
+	for (i = 0; i < count; i++) {
+		data->FragmentTable[i].FragmentLength = frags[i].size;
+		data->FragmentTable[i].FragmentBuffer = frags[i].buf;
+		size += frags[i].size;
+	}
+
 	token->requested = size;
 	data->DataLength = size;
-	data->FragmentTable[0].FragmentLength = size;
-	data->FragmentTable[0].FragmentBuffer = buf;
+	data->FragmentCount = count;
 
 	ret = uefi_call_wrapper(tcp_connection->Transmit, 2,
 				tcp_connection, &token->token);
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
+		token->requested = 0;
+		counters.errors++;
 		efi_perror(ret, L"TCP Transmit failed");
+	}
 
 	return ret;
 }
 
+EFI_STATUS tcp_write(void *buf, UINT32 size)
+{
+	transport_fragment_t frag = { .buf = buf, .size = size };
+
+	return tcp_writev(&frag, 1);
+}
+
 EFI_STATUS tcp_read(void *buf, UINT32 size)
 {
-	EFI_STATUS ret;
-	UINTN i;
+	if (!buf || !size)
+		return EFI_INVALID_PARAMETER;
 
 	if (rx.receiving)
 		return EFI_NOT_READY;
 
 	rx.buf = buf;
 	rx.size = size;
-	rx.received = rx.requested = 0;
+	rx.received = rx.requested = rx.posted = 0;
+	rx.depth = min(DIV_ROUND_UP(size, RX_FRAG_SIZE), (UINT32)MAX_RX_TOKEN);
+	rx.head = rx.tail = rx.inflight = 0;
 	rx.receiving = TRUE;
 
-	for (i = 0; i < MAX_TOKEN && size; i++) {
-		ret = request_data(&rx_token[i], size);
-		if (EFI_ERROR(ret)) {
-			rx.receiving = FALSE;
-			return ret;
-		}
-		size -= rx_token[i].requested;
+	return post_rx_tokens();
+}
+
+static EFI_STATUS readv(transport_fragment_t *frags, UINTN count)
+{
+	UINTN i;
+
+	if (!frags || !count || count > MAX_RX_FRAGMENT)
+		return EFI_INVALID_PARAMETER;
+
+	if (rx.receiving)
+		return EFI_NOT_READY;
+
+	rxv.size = 0;
+	for (i = 0; i < count; i++) {
+		if (!frags[i].buf || !frags[i].size)
+			return EFI_INVALID_PARAMETER;
+		rxv.frags[i] = frags[i];
+		rxv.size += frags[i].size;
 	}
+	rxv.count = count;
+	rxv.received = 0;
+	rxv.active = rx.receiving = TRUE;
 
-	return EFI_SUCCESS;
+	return request_vector_data();
+}
+
+EFI_STATUS tcp_read_some(void *buf, UINT32 size)
+{
+	transport_fragment_t frag = { buf, size };
+
+	return readv(&frag, 1);
+}
+
+EFI_STATUS tcp_readv_some(transport_fragment_t *frags, UINTN count)
+{
+	return readv(frags, count);
 }
 
 EFI_STATUS tcp_stop(void)
@@ -529,6 +961,10 @@ EFI_STATUS tcp_stop(void)
 	EFI_STATUS ret;
 	UINTN index;
 
+	if (reval.active)
+		revalidation_stop();
+	dhcp.pending = FALSE;
+
 	if (events_created)
 		close_events();
 
@@ -594,8 +1030,24 @@ EFI_STATUS tcp_stop(void)
 	return EFI_SUCCESS;
 }
 
+const transport_counters_t *tcp_counters(void)
+{
+	return &counters;
+}
+
+EFI_EVENT tcp_event(void)
+{
+	return activity_event;
+}
+
 EFI_STATUS tcp_run(void)
 {
+	if (dhcp.pending)
+		dhcp_poll();
+
+	if (reval.active)
+		revalidation_poll();
+
 	if (!tcp_connection)
 		return EFI_SUCCESS;
 
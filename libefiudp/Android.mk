@@ -0,0 +1,17 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libefiudp-$(TARGET_BUILD_VARIANT)
+LOCAL_CFLAGS := $(KERNELFLINGER_CFLAGS)
+LOCAL_STATIC_LIBRARIES := \
+	$(KERNELFLINGER_STATIC_LIBRARIES) \
+	libkernelflinger-$(TARGET_BUILD_VARIANT) \
+	libtransport-$(TARGET_BUILD_VARIANT)
+
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)/../include/libefiudp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include/libefiudp
+LOCAL_SRC_FILES := \
+	udp.c
+
+include $(BUILD_EFI_STATIC_LIBRARY)
@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+#include <efiudp.h>
+#include <timer.h>
+
+#include "udp.h"
+
+/* UDP/IP structures  */
+static EFI_HANDLE udp_handle;
+static EFI_GUID UDP_GUID = EFI_UDP4_PROTOCOL;
+static EFI_SERVICE_BINDING *udp_srv_binding;
+static EFI_UDP4 *udp;
+
+/* Several receive tokens are kept posted in the UDP driver so that
+   no datagram is dropped while the previous one is processed.  */
+#define MAX_RX_TOKEN 8
+#define MAX_TX_TOKEN 16
+
+typedef struct token {
+	EFI_UDP4_COMPLETION_TOKEN token;
+	BOOLEAN busy;
+} token_t;
+static token_t rx_token[MAX_RX_TOKEN];
+static token_t tx_token[MAX_TX_TOKEN];
+static EFI_UDP4_TRANSMIT_DATA tx_data[MAX_TX_TOKEN];
+static UINTN next_tx_token;
+
+/* Datagrams are sent back to the peer of the last received one.  */
+static EFI_UDP4_SESSION_DATA peer;
+static BOOLEAN has_peer;
+
+static BOOLEAN events_created;
+
+/* Caller data  */
+static data_callback_t rx_callback;
+static data_callback_t tx_callback;
+static address_callback_t address_callback;
+
+/* While DHCP is ongoing, the configuration is carried on by
+   udp_run() so that the other transports are served meanwhile.
+   Without an answer after DHCP_TIMEOUT_US, UDP stays idle.  */
+static struct dhcp {
+	BOOLEAN pending;
+	UINT32 port;
+	UINT64 deadline_us;
+	UINT64 next_us;
+} dhcp;
+
+static EFI_STATUS request_data(token_t *token)
+{
+	EFI_STATUS ret;
+
+	token->token.Packet.RxData = NULL;
+	token->busy = TRUE;
+	ret = uefi_call_wrapper(udp->Receive, 2, udp, &token->token);
+	if (EFI_ERROR(ret)) {
+		token->busy = FALSE;
+		efi_perror(ret, L"UDP Receive failed");
+	}
+
+	return ret;
+}
+
+/* Event handlers */
+static void EFIAPI data_sent(__attribute__((__unused__)) EFI_EVENT evt,
+			     void *ctx)
+{
+	token_t *token = (token_t *)ctx;
+	EFI_UDP4_TRANSMIT_DATA *data = token->token.Packet.TxData;
+
+	token->busy = FALSE;
+	if (EFI_ERROR(token->token.Status)) {
+		efi_perror(token->token.Status, L"UDP transmit failed");
+		return;
+	}
+
+	tx_callback(data->FragmentTable[0].FragmentBuffer,
+		    data->FragmentTable[0].FragmentLength);
+}
+
+static void EFIAPI data_received(__attribute__((__unused__)) EFI_EVENT evt,
+				 void *ctx)
+{
+	token_t *token = (token_t *)ctx;
+	EFI_UDP4_RECEIVE_DATA *data = token->token.Packet.RxData;
+
+	token->busy = FALSE;
+	if (EFI_ERROR(token->token.Status)) {
+		/* The token is aborted when the transport stops, any
+		   other error must not leave it idle.  */
+		if (token->token.Status != EFI_ABORTED) {
+			efi_perror(token->token.Status, L"UDP receive failed");
+			request_data(token);
+		}
+		return;
+	}
+
+	/* The protocol on top works on single datagrams, fragmented
+	   ones are not expected.  */
+	if (data->FragmentCount == 1) {
+		peer.DestinationAddress = data->UdpSession.SourceAddress;
+		peer.DestinationPort = data->UdpSession.SourcePort;
+		has_peer = TRUE;
+		rx_callback(data->FragmentTable[0].FragmentBuffer,
+			    data->DataLength);
+	} else
+		error(L"Dropping a %d fragments UDP datagram",
+		      data->FragmentCount);
+
+	uefi_call_wrapper(BS->SignalEvent, 1, data->RecycleSignal);
+	request_data(token);
+}
+
+static void close_events(UINTN nb_rx, UINTN nb_tx)
+{
+	UINTN i;
+
+	for (i = 0; i < nb_rx; i++)
+		uefi_call_wrapper(BS->CloseEvent, 1, rx_token[i].token.Event);
+	for (i = 0; i < nb_tx; i++)
+		uefi_call_wrapper(BS->CloseEvent, 1, tx_token[i].token.Event);
+
+	events_created = FALSE;
+}
+
+static EFI_STATUS create_events(void)
+{
+	EFI_STATUS ret;
+	UINTN i, j;
+
+	for (i = 0; i < MAX_RX_TOKEN; i++) {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5,
+					EVT_NOTIFY_SIGNAL,
+					TPL_CALLBACK,
+					data_received,
+					&rx_token[i],
+					&rx_token[i].token.Event);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create UDP Receive event");
+			close_events(i, 0);
+			return ret;
+		}
+	}
+
+	for (j = 0; j < MAX_TX_TOKEN; j++) {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5,
+					EVT_NOTIFY_SIGNAL,
+					TPL_CALLBACK,
+					data_sent,
+					&tx_token[j],
+					&tx_token[j].token.Event);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create UDP Transmit event");
+			close_events(i, j);
+			return ret;
+		}
+		tx_token[j].token.Packet.TxData = &tx_data[j];
+		tx_data[j].UdpSessionData = &peer;
+		tx_data[j].GatewayAddress = NULL;
+		tx_data[j].FragmentCount = 1;
+	}
+
+	events_created = TRUE;
+	return EFI_SUCCESS;
+}
+
+static void udp_config_init(EFI_UDP4_CONFIG_DATA *udp_config, UINT32 port)
+{
+	EFI_UDP4_CONFIG_DATA config = {
+		.AcceptBroadcast = FALSE,
+		.AcceptPromiscuous = FALSE,
+		.AcceptAnyPort = FALSE,
+		.AllowDuplicatePort = FALSE,
+		.TypeOfService = 0x00,
+		.TimeToLive = 255,
+		.DoNotFragment = FALSE,
+		.ReceiveTimeout = 0,
+		.TransmitTimeout = 0,
+		.UseDefaultAddress = TRUE,
+		.StationAddress = { {0, 0, 0, 0} }, /* ignored - use default */
+		.SubnetMask = { {0, 0, 0, 0} },	    /* ignored - use default */
+		.StationPort = port,
+		.RemoteAddress = { {0, 0, 0, 0} }, /* accept any */
+		.RemotePort = 0 /* accept any */
+	};
+
+	*udp_config = config;
+}
+
+/* Post the receive tokens of the configured instance.  */
+static EFI_STATUS receive_start(void)
+{
+	EFI_STATUS ret;
+	EFI_IP4_MODE_DATA ip_data;
+	UINTN i;
+
+	ret = uefi_call_wrapper(udp->GetModeData, 5, udp, NULL, &ip_data,
+				NULL, NULL);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get IP mode data");
+		return ret;
+	}
+
+	for (i = 0; i < MAX_RX_TOKEN; i++) {
+		ret = request_data(&rx_token[i]);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	address_callback(&ip_data.ConfigData.StationAddress);
+	return EFI_SUCCESS;
+}
+
+static void dhcp_poll(void)
+{
+	EFI_STATUS ret;
+	EFI_UDP4_CONFIG_DATA udp_config;
+	UINT64 now;
+
+	now = timer_us();
+	if (now < dhcp.next_us)
+		return;
+	dhcp.next_us = now + DHCP_POLL_US;
+
+	udp_config_init(&udp_config, dhcp.port);
+	ret = uefi_call_wrapper(udp->Configure, 2, udp, &udp_config);
+	if (ret == EFI_NO_MAPPING) {
+		if (now >= dhcp.deadline_us) {
+			debug(L"No DHCP answer, UDP is not available");
+			dhcp.pending = FALSE;
+		}
+		return;
+	}
+	dhcp.pending = FALSE;
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to configure UDP");
+		return;
+	}
+
+	receive_start();
+}
+
+static EFI_STATUS ip_configuration(UINT32 port)
+{
+	EFI_STATUS ret;
+	EFI_UDP4_CONFIG_DATA udp_config;
+
+	udp_config_init(&udp_config, port);
+	ret = uefi_call_wrapper(udp->Configure, 2, udp, &udp_config);
+	/* DHCP still ongoing. */
+	if (ret == EFI_NO_MAPPING) {
+		dhcp.port = port;
+		dhcp.deadline_us = timer_us() + DHCP_TIMEOUT_US;
+		dhcp.next_us = 0;
+		dhcp.pending = TRUE;
+		return EFI_SUCCESS;
+	}
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to configure UDP");
+		return ret;
+	}
+
+	return receive_start();
+}
+
+EFI_STATUS udp_start(UINT32 port, data_callback_t rx_cb,
+		     data_callback_t tx_cb, address_callback_t address_cb)
+{
+	EFI_GUID udp_srv_binding_guid = EFI_UDP4_SERVICE_BINDING_PROTOCOL;
+	EFI_HANDLE *handles;
+	UINTN nb_handle = 0;
+	EFI_STATUS ret;
+
+	if (!rx_cb || !tx_cb || !address_cb)
+		return EFI_INVALID_PARAMETER;
+
+	rx_callback = rx_cb;
+	tx_callback = tx_cb;
+	address_callback = address_cb;
+	has_peer = FALSE;
+
+	ret = uefi_call_wrapper(BS->LocateHandleBuffer, 5, ByProtocol,
+				&udp_srv_binding_guid, NULL, &nb_handle, &handles);
+	if (EFI_ERROR(ret)) {
+		debug(L"Failed to locate UDP service binding protocol");
+		return EFI_UNSUPPORTED;
+	}
+
+	/* Use the first network device. */
+	ret = uefi_call_wrapper(BS->OpenProtocol, 6,
+				handles[0],
+				&udp_srv_binding_guid,
+				(VOID **)&udp_srv_binding,
+				g_parent_image,
+				NULL,
+				EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	FreePool(handles);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open UDP service binding protocol");
+		return ret;
+	}
+
+	ret = uefi_call_wrapper(udp_srv_binding->CreateChild, 2,
+				udp_srv_binding, &udp_handle);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create UDP child");
+		return ret;
+	}
+
+	ret = uefi_call_wrapper(BS->OpenProtocol, 6,
+				udp_handle,
+				&UDP_GUID,
+				(VOID **)&udp,
+				g_parent_image,
+				NULL,
+				EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open UDP protocol");
+		goto err;
+	}
+
+	ret = create_events();
+	if (EFI_ERROR(ret))
+		goto err;
+
+	ret = ip_configuration(port);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	return EFI_SUCCESS;
+
+err:
+	udp_stop();
+	return ret;
+}
+
+EFI_STATUS udp_write(void *buf, UINT32 size)
+{
+	EFI_STATUS ret;
+	token_t *token = &tx_token[next_tx_token];
+	EFI_UDP4_TRANSMIT_DATA *data = token->token.Packet.TxData;
+
+	if (!has_peer)
+		return EFI_NOT_STARTED;
+
+	if (token->busy)
+		return EFI_NOT_READY;
+
+	next_tx_token = (next_tx_token + 1) % MAX_TX_TOKEN;
+	data->DataLength = size;
+	data->FragmentTable[0].FragmentLength = size;
+	data->FragmentTable[0].FragmentBuffer = buf;
+
+	token->busy = TRUE;
+	ret = uefi_call_wrapper(udp->Transmit, 2, udp, &token->token);
+	if (EFI_ERROR(ret)) {
+		token->busy = FALSE;
+		efi_perror(ret, L"UDP Transmit failed");
+	}
+
+	return ret;
+}
+
+EFI_STATUS udp_stop(void)
+{
+	EFI_STATUS ret;
+
+	dhcp.pending = FALSE;
+	if (udp) {
+		/* Cancels all the pending tokens.  */
+		ret = uefi_call_wrapper(udp->Configure, 2, udp, NULL);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"UDP Configure failed");
+		udp = NULL;
+	}
+
+	if (events_created)
+		close_events(MAX_RX_TOKEN, MAX_TX_TOKEN);
+
+	if (udp_srv_binding) {
+		ret = uefi_call_wrapper(udp_srv_binding->DestroyChild, 2,
+					udp_srv_binding, udp_handle);
+		if (EFI_ERROR(ret) && ret != EFI_UNSUPPORTED) {
+			efi_perror(ret, L"UDP service DestroyChild failed");
+			return ret;
+		}
+		udp_srv_binding = NULL;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS udp_run(void)
+{
+	if (!udp)
+		return EFI_SUCCESS;
+
+	if (dhcp.pending) {
+		dhcp_poll();
+		return EFI_SUCCESS;
+	}
+
+	return uefi_call_wrapper(udp->Poll, 1, udp);
+}
@@ -89,8 +89,16 @@
 //
 // USB Descriptor types
 //
+#define USB_DESC_TYPE_BOS                    0x0F
+#define USB_DESC_TYPE_DEVICE_CAPABILITY      0x10
 #define USB_DESC_TYPE_SS_ENDPOINT_COMPANION  0x30
 
+//
+// BOS device capability types
+//
+#define USB_DEV_CAP_TYPE_USB20_EXTENSION     0x02
+#define USB_DEV_CAP_TYPE_SUPERSPEED_USB      0x03
+
 
 //
 // USB device states from USB spec sec 9.1
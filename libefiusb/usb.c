@@ -51,7 +51,16 @@
 #define IF_PROTOCOL          	0x00	/* Default protocol */
 #define IN_ENDPOINT_NUM         1
 #define OUT_ENDPOINT_NUM        2
+#ifdef USB_SUPERSPEED
+#define BULK_EP_PKT_SIZE     	USB_BULK_EP_PKT_SIZE_SS
+#define BULK_EP_MAX_BURST	15	/* 16 packets per burst */
+#define BCD_USB			USB_BCD_VERSION_SS
+#define EP0_MAX_PKT_SIZE	USB_EP0_MAX_PKT_SIZE_SS
+#else
 #define BULK_EP_PKT_SIZE     	USB_BULK_EP_PKT_SIZE_HS	/* default to using high speed */
+#define BCD_USB			USB_BCD_VERSION_HS
+#define EP0_MAX_PKT_SIZE	USB_EP0_MAX_PKT_SIZE_HS
+#endif
 #define VENDOR_ID               0x8087	/* Intel Inc. */
 #define PRODUCT_ID		0x09EF
 #define BCD_DEVICE		0x0100
@@ -95,12 +104,20 @@ static USB_STRING_DESCRIPTOR string_table[] = {
 	{ 2 + sizeof(STR_INTERFACE)	, USB_DESC_TYPE_STRING, STR_INTERFACE },
 };
 
-/* Complete Configuration structure */
+/* Complete Configuration structure.  In SuperSpeed each endpoint
+   descriptor is immediately followed by its companion
+   descriptor.  */
 struct config_descriptor {
 	EFI_USB_CONFIG_DESCRIPTOR    config;
 	EFI_USB_INTERFACE_DESCRIPTOR interface;
 	EFI_USB_ENDPOINT_DESCRIPTOR  ep_in;
+#ifdef USB_SUPERSPEED
+	EFI_USB_ENDPOINT_COMPANION_DESCRIPTOR ep_in_comp;
+#endif
 	EFI_USB_ENDPOINT_DESCRIPTOR  ep_out;
+#ifdef USB_SUPERSPEED
+	EFI_USB_ENDPOINT_COMPANION_DESCRIPTOR ep_out_comp;
+#endif
 } __attribute__((packed));
 
 static struct config_descriptor config_descriptor = {
@@ -133,6 +150,15 @@ static struct config_descriptor config_descriptor = {
 		BULK_EP_PKT_SIZE,
 		0x00 /* Not specified for bulk endpoint */
 	},
+#ifdef USB_SUPERSPEED
+	.ep_in_comp = {
+		sizeof(EFI_USB_ENDPOINT_COMPANION_DESCRIPTOR),
+		USB_DESC_TYPE_SS_ENDPOINT_COMPANION,
+		BULK_EP_MAX_BURST,
+		0x00, /* No stream */
+		0x00  /* Not specified for bulk endpoint */
+	},
+#endif
 	.ep_out = {
 		sizeof(EFI_USB_ENDPOINT_DESCRIPTOR),
 		USB_DESC_TYPE_ENDPOINT,
@@ -140,17 +166,86 @@ static struct config_descriptor config_descriptor = {
 		USB_ENDPOINT_BULK,
 		BULK_EP_PKT_SIZE,
 		0x00 /* Not specified for bulk endpoint */
+	},
+#ifdef USB_SUPERSPEED
+	.ep_out_comp = {
+		sizeof(EFI_USB_ENDPOINT_COMPANION_DESCRIPTOR),
+		USB_DESC_TYPE_SS_ENDPOINT_COMPANION,
+		BULK_EP_MAX_BURST,
+		0x00, /* No stream */
+		0x00  /* Not specified for bulk endpoint */
+	}
+#endif
+};
+
+#ifdef USB_SUPERSPEED
+#define EP_IN_COMP_DESC		(&config_descriptor.ep_in_comp)
+#define EP_OUT_COMP_DESC	(&config_descriptor.ep_out_comp)
+
+/* Binary Object Store, required by the host for a 3.x device */
+#define U1_DEV_EXIT_LAT		0x01	/* Less than 1 us */
+#define U2_DEV_EXIT_LAT		0x01F4	/* Less than 500 us */
+
+static struct bos_descriptor {
+	struct {
+		UINT8 Length;
+		UINT8 DescriptorType;
+		UINT16 TotalLength;
+		UINT8 NumDeviceCaps;
+	} __attribute__((packed)) bos;
+	struct {
+		UINT8 Length;
+		UINT8 DescriptorType;
+		UINT8 DevCapabilityType;
+		UINT32 Attributes;
+	} __attribute__((packed)) usb20_ext;
+	struct {
+		UINT8 Length;
+		UINT8 DescriptorType;
+		UINT8 DevCapabilityType;
+		UINT8 Attributes;
+		UINT16 SpeedsSupported;
+		UINT8 FunctionalitySupport;
+		UINT8 U1DevExitLat;
+		UINT16 U2DevExitLat;
+	} __attribute__((packed)) ss_cap;
+} __attribute__((packed)) bos_descriptor = {
+	.bos = {
+		sizeof(bos_descriptor.bos),
+		USB_DESC_TYPE_BOS,
+		sizeof(struct bos_descriptor),
+		2
+	},
+	.usb20_ext = {
+		sizeof(bos_descriptor.usb20_ext),
+		USB_DESC_TYPE_DEVICE_CAPABILITY,
+		USB_DEV_CAP_TYPE_USB20_EXTENSION,
+		0x02 /* Link Power Management */
+	},
+	.ss_cap = {
+		sizeof(bos_descriptor.ss_cap),
+		USB_DESC_TYPE_DEVICE_CAPABILITY,
+		USB_DEV_CAP_TYPE_SUPERSPEED_USB,
+		0x00,
+		0x0E, /* Full, High and SuperSpeed */
+		0x02, /* Fully functional from High Speed */
+		U1_DEV_EXIT_LAT,
+		U2_DEV_EXIT_LAT
 	}
 };
+#else
+#define EP_IN_COMP_DESC		NULL
+#define EP_OUT_COMP_DESC	NULL
+#endif
 
 static USB_DEVICE_DESCRIPTOR device_descriptor = {
 	sizeof(USB_DEVICE_DESCRIPTOR),
 	USB_DESC_TYPE_DEVICE,
-	USB_BCD_VERSION_HS, /* Default to High Speed */
+	BCD_USB,
 	0x00, /* specified in interface descriptor */
 	0x00, /* specified in interface descriptor */
 	0x00, /* specified in interface descriptor */
-	USB_EP0_MAX_PKT_SIZE_HS, /* Default to high speed */
+	EP0_MAX_PKT_SIZE,
 	VENDOR_ID,
 	PRODUCT_ID,
 	BCD_DEVICE,
@@ -160,47 +255,211 @@ static USB_DEVICE_DESCRIPTOR device_descriptor = {
 	CONFIG_COUNT
 };
 
+static transport_counters_t counters;
+
 EFI_STATUS usb_write(void *buf, UINT32 size)
 {
 	EFI_STATUS ret;
 	USB_DEVICE_IO_REQ ioReq;
 
 	ioReq.EndpointInfo.EndpointDesc = &config_descriptor.ep_in;
-	ioReq.EndpointInfo.EndpointCompDesc = NULL;
+	ioReq.EndpointInfo.EndpointCompDesc = EP_IN_COMP_DESC;
 	ioReq.IoInfo.Buffer = buf;
 	ioReq.IoInfo.Length = size;
 
 	/* queue the Tx request */
 	ret = uefi_call_wrapper(usb_device->EpTxData, 2, usb_device, &ioReq);
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
+		counters.errors++;
 		efi_perror(ret, L"failed to queue Tx request");
+	}
 
 	return ret;
 }
 
-EFI_STATUS usb_read(void *buf, UINT32 size)
+/* Reads are split in several requests queued back-to-back in
+   consecutive regions of the caller buffer so that the device
+   controller never waits for the upper layer between two
+   transfers.  The controller only accepts multiple of MaxPacketSize
+   requests: the tail of a read which is not is received in a
+   bounce buffer instead of overrunning the caller buffer.  */
+#define RX_QUEUE_DEPTH		4
+#define RX_CHUNK_SIZE		(1024 * 1024)
+
+static UINT8 rx_tail_buf[USB_BULK_EP_PKT_SIZE_MAX] __attribute__((aligned(64)));
+
+static struct rx {
+	char *buf;
+	UINT32 size;
+	UINT32 posted;
+	UINT32 received;
+	UINT32 offset[RX_QUEUE_DEPTH];
+	UINT32 length[RX_QUEUE_DEPTH];
+	UINTN head;
+	UINTN tail;
+	UINTN inflight;
+	BOOLEAN short_packet;
+	BOOLEAN receiving;
+} rx;
+
+static void *rx_request_buffer(UINTN index)
 {
-	EFI_STATUS ret;
-	USB_DEVICE_IO_REQ ioReq;
+	if (rx.length[index] < config_descriptor.ep_out.MaxPacketSize)
+		return rx_tail_buf;
 
-	/* WA: usb device stack doesn't accept rx buffer not multiple of MaxPacketSize */
-	unsigned max_pkt_size = config_descriptor.ep_out.MaxPacketSize;
+	return rx.buf + rx.offset[index];
+}
 
-	size = ALIGN(size, max_pkt_size);
+static EFI_STATUS queue_rx_request(void *buf, UINT32 size)
+{
+	EFI_STATUS ret;
+	USB_DEVICE_IO_REQ ioReq;
 
 	ioReq.EndpointInfo.EndpointDesc = &config_descriptor.ep_out;
-	ioReq.EndpointInfo.EndpointCompDesc = NULL;
+	ioReq.EndpointInfo.EndpointCompDesc = EP_OUT_COMP_DESC;
 	ioReq.IoInfo.Buffer = buf;
 	ioReq.IoInfo.Length = size;
 
 	/* queue the  receive request */
 	ret = uefi_call_wrapper(usb_device->EpRxData, 2, usb_device, &ioReq);
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
+		counters.errors++;
 		efi_perror(ret, L"failed to queue Rx request");
+	}
 
 	return ret;
 }
 
+static EFI_STATUS post_rx_requests(void)
+{
+	EFI_STATUS ret;
+	UINT32 size, max_pkt_size = config_descriptor.ep_out.MaxPacketSize;
+
+	while (rx.inflight < RX_QUEUE_DEPTH && rx.posted < rx.size) {
+		size = min((UINT32)RX_CHUNK_SIZE, rx.size - rx.posted);
+		if (size >= max_pkt_size)
+			size -= size % max_pkt_size;
+
+		rx.offset[rx.tail] = rx.posted;
+		rx.length[rx.tail] = size;
+
+		ret = queue_rx_request(rx_request_buffer(rx.tail),
+				       size < max_pkt_size ? max_pkt_size : size);
+		if (EFI_ERROR(ret)) {
+			rx.receiving = FALSE;
+			return ret;
+		}
+
+		rx.tail = (rx.tail + 1) % RX_QUEUE_DEPTH;
+		rx.inflight++;
+		rx.posted += size;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static void rx_request_completed(EFI_USB_DEVICE_XFER_INFO *XferInfo)
+{
+	UINT32 length;
+
+	if (XferInfo->Buffer != rx_request_buffer(rx.head)) {
+		counters.errors++;
+		error(L"USB Rx requests completed out of order");
+		rx.receiving = FALSE;
+		return;
+	}
+
+	length = min(XferInfo->Length, rx.length[rx.head]);
+	if (XferInfo->Length < rx.length[rx.head])
+		rx.short_packet = TRUE;
+
+	/* Copy the tail out of the bounce buffer and, if a previous
+	   short transfer left a hole, keep the data contiguous.  */
+	if (XferInfo->Buffer != rx.buf + rx.received)
+		CopyMem(rx.buf + rx.received, XferInfo->Buffer, length);
+
+	rx.received += length;
+	rx.head = (rx.head + 1) % RX_QUEUE_DEPTH;
+	rx.inflight--;
+
+	/* A short packet ends the host transfer, do not queue more
+	   requests.  */
+	if (!rx.short_packet && rx.posted < rx.size) {
+		counters.rearms++;
+		post_rx_requests();
+	}
+
+	/* Nothing received yet, a lone zero length packet does not
+	   complete the read.  */
+	if (rx.short_packet && !rx.inflight && !rx.received) {
+		rx.short_packet = FALSE;
+		rx.posted = 0;
+		counters.rearms++;
+		post_rx_requests();
+		return;
+	}
+
+	if (rx.received == rx.size || (rx.short_packet && !rx.inflight)) {
+		rx.receiving = FALSE;
+		if (rx_callback)
+			rx_callback(rx.buf, rx.received);
+	}
+}
+
+static EFI_STATUS start_read(void *buf, UINT32 size)
+{
+	rx.buf = buf;
+	rx.size = size;
+	rx.posted = rx.received = 0;
+	rx.head = rx.tail = rx.inflight = 0;
+	rx.short_packet = FALSE;
+	rx.receiving = TRUE;
+
+	return post_rx_requests();
+}
+
+EFI_STATUS usb_read(void *buf, UINT32 size)
+{
+	if (!buf || !size)
+		return EFI_INVALID_PARAMETER;
+
+	if (rx.receiving)
+		return EFI_NOT_READY;
+
+	return start_read(buf, size);
+}
+
+const transport_counters_t *usb_counters(void)
+{
+	return &counters;
+}
+
+UINT32 usb_read_granularity(void)
+{
+	return config_descriptor.ep_out.MaxPacketSize;
+}
+
+#ifdef USB_SUPERSPEED
+static EFIAPI EFI_STATUS setup_handler(EFI_USB_DEVICE_REQUEST *CtrlRequest,
+				       USB_DEVICE_IO_INFO *IoInfo)
+{
+	/* The device mode stack handles the standard descriptors but
+	   the BOS one.  The link speed itself is negotiated by the
+	   controller.  */
+	if ((CtrlRequest->RequestType & USB_REQ_TYPE_MASK) == USB_REQ_TYPE_STANDARD &&
+	    CtrlRequest->Request == USB_REQ_GET_DESCRIPTOR &&
+	    (CtrlRequest->Value >> 8) == USB_DESC_TYPE_BOS) {
+		IoInfo->Buffer = &bos_descriptor;
+		IoInfo->Length = min((UINT32)CtrlRequest->Length,
+				     (UINT32)sizeof(bos_descriptor));
+		return EFI_SUCCESS;
+	}
+
+	/* Does not handle any Class/Vendor specific setup requests */
+
+	return EFI_SUCCESS;
+}
+#else
 static EFIAPI EFI_STATUS setup_handler(__attribute__((__unused__)) EFI_USB_DEVICE_REQUEST *CtrlRequest,
 				       __attribute__((__unused__)) USB_DEVICE_IO_INFO *IoInfo)
 {
@@ -209,6 +468,7 @@ static EFIAPI EFI_STATUS setup_handler(__attribute__((__unused__)) EFI_USB_DEVIC
 
 	return EFI_SUCCESS;
 }
+#endif
 
 static EFIAPI EFI_STATUS config_handler(UINT8 cfgVal)
 {
@@ -228,8 +488,22 @@ static EFIAPI EFI_STATUS config_handler(UINT8 cfgVal)
 
 EFIAPI EFI_STATUS data_handler(EFI_USB_DEVICE_XFER_INFO *XferInfo)
 {
-	if (!XferInfo->Buffer || XferInfo->Length == 0) {
-		error(L"Received an unexpected NULL or zero length buffer");
+	if (!XferInfo->Buffer) {
+		counters.errors++;
+		error(L"Received an unexpected NULL buffer");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	/* A zero length packet terminates a transfer which is a
+	   multiple of MaxPacketSize.  */
+	if (XferInfo->EndpointDir == USB_ENDPOINT_DIR_OUT && rx.receiving) {
+		rx_request_completed(XferInfo);
+		return EFI_SUCCESS;
+	}
+
+	if (XferInfo->Length == 0) {
+		counters.errors++;
+		error(L"Received an unexpected zero length buffer");
 		return EFI_INVALID_PARAMETER;
 	}
 
@@ -237,9 +511,10 @@ EFIAPI EFI_STATUS data_handler(EFI_USB_DEVICE_XFER_INFO *XferInfo)
 	if (XferInfo->EndpointDir == USB_ENDPOINT_DIR_OUT) {
 		if (rx_callback)
 			rx_callback(XferInfo->Buffer, XferInfo->Length);
-	} else
+	} else {
 		if (tx_callback)
 			tx_callback(XferInfo->Buffer, XferInfo->Length);
+	}
 	return EFI_SUCCESS;
 }
 
@@ -346,10 +621,10 @@ static void init_driver_objs(UINT8 subclass,
 
 	/* Endpoint Data In/Out objects */
 	gEndpointObjs[0].EndpointDesc      = &config_descriptor.ep_in;
-	gEndpointObjs[0].EndpointCompDesc  = NULL;
+	gEndpointObjs[0].EndpointCompDesc  = EP_IN_COMP_DESC;
 
 	gEndpointObjs[1].EndpointDesc      = &config_descriptor.ep_out;
-	gEndpointObjs[1].EndpointCompDesc  = NULL;
+	gEndpointObjs[1].EndpointCompDesc  = EP_OUT_COMP_DESC;
 }
 
 EFI_STATUS usb_start(UINT8 subclass, UINT8 protocol,
@@ -365,6 +640,7 @@ EFI_STATUS usb_start(UINT8 subclass, UINT8 protocol,
 	start_callback = start_cb;
 	rx_callback = rx_cb;
 	tx_callback = tx_cb;
+	ZeroMem(&counters, sizeof(counters));
 
 	ret = LibLocateProtocol(&gEfiUsbDeviceModeProtocolGuid, (void **)&usb_device);
 	if (EFI_ERROR(ret) || !usb_device) {
@@ -418,6 +694,7 @@ EFI_STATUS usb_stop(void)
 	start_callback = NULL;
 	rx_callback = NULL;
 	tx_callback = NULL;
+	rx.receiving = FALSE;
 
 	return ret;
 }
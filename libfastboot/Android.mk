@@ -9,6 +9,7 @@ SHARED_STATIC_LIBRARIES := \
 	$(KERNELFLINGER_STATIC_LIBRARIES) \
 	libefiusb-$(TARGET_BUILD_VARIANT) \
 	libefitcp-$(TARGET_BUILD_VARIANT) \
+	libefiudp-$(TARGET_BUILD_VARIANT) \
 	libtransport-$(TARGET_BUILD_VARIANT) \
 	libkernelflinger-$(TARGET_BUILD_VARIANT)
 SHARED_SRC_FILES := \
@@ -17,6 +18,11 @@ SHARED_SRC_FILES := \
 	fastboot_flashing.c \
 	flash.c \
 	sparse.c \
+	mkfs.c \
+	delta.c \
+	lz4.c \
+	arena.c \
+	perf.c \
 	info.c \
 	intel_variables.c \
 	bootmgr.c \
@@ -36,7 +42,8 @@ LOCAL_EXPORT_C_INCLUDE_DIRS := $(SHARED_EXPORT_C_INCLUDE_DIRS)
 LOCAL_C_INCLUDES := $(SHARED_C_INCLUDES)
 LOCAL_SRC_FILES := $(SHARED_SRC_FILES) \
 	fastboot_ui.c \
-	fastboot_transport.c
+	fastboot_transport.c \
+	fastboot_loopback.c
 
 include $(BUILD_EFI_STATIC_LIBRARY)
 
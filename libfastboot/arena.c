@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <fastboot.h>
+
+#include "arena.h"
+
+#define ARENA_SCRATCH_SIZE (16 * 1024 * 1024)
+#define ARENA_MIN_DOWNLOAD_SIZE (16 * 1024 * 1024)
+#define ARENA_MAX_ALLOCS 16
+
+static struct {
+	EFI_PHYSICAL_ADDRESS base;
+	UINTN pages;
+	UINTN download_size;
+	UINTN count;
+	struct {
+		UINTN start;	/* offset in the scratch area */
+		UINTN end;
+		BOOLEAN used;
+	} allocs[ARENA_MAX_ALLOCS];
+} arena;
+
+#define scratch_base ((CHAR8 *)(UINTN)arena.base + arena.download_size)
+
+UINT64 largest_free_range(void)
+{
+	EFI_MEMORY_DESCRIPTOR *map, *desc;
+	UINTN nr_entries, key, entry_sz, i;
+	UINT32 entry_ver;
+	UINT64 largest = 0;
+
+	map = LibMemoryMap(&nr_entries, &key, &entry_sz, &entry_ver);
+	if (!map)
+		return 0;
+
+	for (i = 0; i < nr_entries; i++) {
+		desc = (EFI_MEMORY_DESCRIPTOR *)((CHAR8 *)map + i * entry_sz);
+		if (desc->Type == EfiConventionalMemory &&
+		    desc->NumberOfPages > largest)
+			largest = desc->NumberOfPages;
+	}
+
+	FreePool(map);
+	return largest * EFI_PAGE_SIZE;
+}
+
+EFI_STATUS arena_init(void)
+{
+	EFI_STATUS ret;
+	UINT64 size;
+
+	if (arena.base)
+		return EFI_SUCCESS;
+
+	/* The arena takes at most half of the largest free range so
+	   that the other allocations do not starve.  */
+	size = min(largest_free_range() / 2,
+		   (UINT64)MAX_DOWNLOAD_SIZE + ARENA_SCRATCH_SIZE);
+	if (size < ARENA_MIN_DOWNLOAD_SIZE + ARENA_SCRATCH_SIZE)
+		return EFI_OUT_OF_RESOURCES;
+
+	arena.pages = EFI_SIZE_TO_PAGES(size);
+	ret = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages,
+				EfiLoaderData, arena.pages, &arena.base);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to allocate the download arena");
+		arena.base = 0;
+		return ret;
+	}
+
+	arena.download_size = arena.pages * EFI_PAGE_SIZE - ARENA_SCRATCH_SIZE;
+	arena.count = 0;
+	debug(L"Download arena: %ld MiB", size / (1024 * 1024));
+
+	return EFI_SUCCESS;
+}
+
+void arena_release(void)
+{
+	if (!arena.base)
+		return;
+
+	if (arena.count)
+		error(L"%d scratch buffers still in use", arena.count);
+
+	uefi_call_wrapper(BS->FreePages, 2, arena.base, arena.pages);
+	arena.base = 0;
+	arena.download_size = 0;
+	arena.count = 0;
+}
+
+BOOLEAN arena_contains(VOID *ptr)
+{
+	return arena.base && (UINTN)ptr >= (UINTN)arena.base &&
+		(UINTN)ptr < (UINTN)arena.base + arena.pages * EFI_PAGE_SIZE;
+}
+
+UINTN arena_download_size(void)
+{
+	return arena.download_size;
+}
+
+VOID *arena_download_buffer(UINTN size)
+{
+	if (!arena.base || size > arena.download_size)
+		return NULL;
+
+	return (VOID *)(UINTN)arena.base;
+}
+
+VOID *arena_alloc(UINTN size, UINTN align)
+{
+	UINTN start;
+
+	if (!arena.base || !size || arena.count == ARENA_MAX_ALLOCS)
+		return NULL;
+
+	start = arena.count ? arena.allocs[arena.count - 1].end : 0;
+	if (align > 1)
+		start = (start + align - 1) & ~(align - 1);
+	if (start > ARENA_SCRATCH_SIZE || size > ARENA_SCRATCH_SIZE - start)
+		return NULL;
+
+	arena.allocs[arena.count].start = start;
+	arena.allocs[arena.count].end = start + size;
+	arena.allocs[arena.count].used = TRUE;
+	arena.count++;
+
+	return scratch_base + start;
+}
+
+VOID *arena_pool_alloc(UINTN size)
+{
+	VOID *ptr;
+
+	ptr = arena_alloc(size, sizeof(UINT64));
+	return ptr ? ptr : AllocatePool(size);
+}
+
+void arena_free(VOID *ptr)
+{
+	UINTN i;
+
+	if (!ptr)
+		return;
+
+	if (!arena_contains(ptr)) {
+		FreePool(ptr);
+		return;
+	}
+
+	for (i = 0; i < arena.count; i++)
+		if (scratch_base + arena.allocs[i].start == ptr)
+			break;
+	if (i == arena.count) {
+		error(L"Invalid scratch buffer %p", ptr);
+		return;
+	}
+
+	/* A buffer released out of order is reclaimed once the buffers
+	   allocated after it are released.  */
+	arena.allocs[i].used = FALSE;
+	while (arena.count && !arena.allocs[arena.count - 1].used)
+		arena.count--;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <efi.h>
+
+/* The download arena is reserved once per fastboot session.  Its head
+   receives the downloaded images and its tail is a scratch area for
+   the temporary buffers used while an image is processed.  */
+EFI_STATUS arena_init(void);
+void arena_release(void);
+BOOLEAN arena_contains(VOID *ptr);
+UINTN arena_download_size(void);
+VOID *arena_download_buffer(UINTN size);
+
+/* Size of the largest free conventional memory range */
+UINT64 largest_free_range(void);
+
+/* Scratch allocations are released in reverse order.  arena_alloc()
+   returns NULL if the scratch area is full, arena_pool_alloc() falls
+   back on the pool.  arena_free() accepts both.  */
+VOID *arena_alloc(UINTN size, UINTN align);
+VOID *arena_pool_alloc(UINTN size);
+void arena_free(VOID *ptr);
+
+#endif	/* _ARENA_H_ */
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "uefi_utils.h"
+#include "flash.h"
+#include "arena.h"
+#include "delta_format.h"
+#include "delta.h"
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+BOOLEAN is_delta_image(void *data, UINT64 size)
+{
+	delta_header_t *dh = data;
+
+	if (size < sizeof(*dh))
+		return FALSE;
+
+	return dh->magic == DELTA_HEADER_MAGIC && dh->major_version == 1;
+}
+
+static EFI_STATUS delta_copy(UINT64 src, UINT64 size, CHAR8 *buf)
+{
+	EFI_STATUS ret;
+	UINTN len;
+
+	if (src < flash_tell()) {
+		error(L"Delta copy source 0x%lx is already overwritten", src);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	for (; size; size -= len, src += len) {
+		len = min(size, (UINT64)COPY_BUFFER_SIZE);
+		ret = flash_read(src, buf, len);
+		if (EFI_ERROR(ret))
+			return ret;
+
+		ret = flash_write(buf, len);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_delta(void *data, UINT64 size)
+{
+	delta_header_t *dh = data;
+	delta_op_t *op;
+	CHAR8 *p = data, *end = p + size;
+	VOID *buf, *free_addr = NULL;
+	EFI_STATUS ret = EFI_SUCCESS;
+	UINT64 len, blocks = 0;
+	UINT32 i;
+
+	if (!dh->blk_sz || dh->blk_sz % 512) {
+		error(L"Invalid delta block size %d", dh->blk_sz);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	/* Aligned for flash_write() to use the BlockIo fast path */
+	buf = arena_alloc(COPY_BUFFER_SIZE, flash_io_align());
+	if (!buf) {
+		ret = alloc_aligned(&free_addr, &buf, COPY_BUFFER_SIZE,
+				    flash_io_align());
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to allocate the delta copy buffer");
+			return ret;
+		}
+	}
+
+	p += sizeof(*dh);
+	for (i = 0; i < dh->total_ops; i++) {
+		if ((UINTN)(end - p) < sizeof(*op)) {
+			error(L"Truncated delta image");
+			ret = EFI_INVALID_PARAMETER;
+			break;
+		}
+		op = (delta_op_t *)p;
+		p += sizeof(*op);
+
+		len = (UINT64)op->op_sz * dh->blk_sz;
+		blocks += op->op_sz;
+		if (blocks > dh->total_blks) {
+			error(L"Delta operations exceed the image size");
+			ret = EFI_INVALID_PARAMETER;
+			break;
+		}
+
+		switch (op->op_type) {
+		case DELTA_OP_RAW:
+			if ((UINT64)(end - p) < len) {
+				error(L"Truncated delta RAW operation");
+				ret = EFI_INVALID_PARAMETER;
+				break;
+			}
+			ret = flash_write(p, len);
+			p += len;
+			break;
+		case DELTA_OP_COPY:
+			ret = delta_copy(op->arg * dh->blk_sz, len, buf);
+			break;
+		case DELTA_OP_FILL:
+			ret = flash_fill((UINT32)op->arg, len);
+			break;
+		case DELTA_OP_KEEP:
+			ret = flash_keep(len);
+			break;
+		default:
+			error(L"Unknown delta operation 0x%x", op->op_type);
+			ret = EFI_INVALID_PARAMETER;
+		}
+		if (EFI_ERROR(ret))
+			break;
+	}
+
+	if (!EFI_ERROR(ret) && blocks != dh->total_blks) {
+		error(L"Delta operations do not match the image size");
+		ret = EFI_INVALID_PARAMETER;
+	}
+
+	if (free_addr)
+		FreePool(free_addr);
+	else
+		arena_free(buf);
+
+	return ret;
+}
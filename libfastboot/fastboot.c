@@ -51,6 +51,17 @@
 #include "info.h"
 #include "authenticated_action.h"
 #include "fastboot_transport.h"
+#include "arena.h"
+#include "crc32.h"
+#include "perf.h"
+#include "timestamp.h"
+#include "trace.h"
+#include "memstat.h"
+#include "bump.h"
+#include "android.h"
+#include "security.h"
+#include "sparse_format.h"
+#include "sparse.h"
 
 /* size of "INFO" "OKAY" or "FAIL" */
 #define CODE_LENGTH 4
@@ -58,7 +69,6 @@
 #define MAX_VARIABLE_LENGTH 64
 
 struct fastboot_var {
-	struct fastboot_var *next;
 	char name[MAX_VARIABLE_LENGTH];
 	char value[MAX_VARIABLE_LENGTH];
 	char *(*get_value)(void);
@@ -69,9 +79,14 @@ struct fastboot_tx_buffer {
 	char msg[MAGIC_LENGTH];
 };
 
+/* Commands are indexed by an open addressing hash table of SIZE
+   slots, a power of two, grown to keep it at most half full.  A
+   command registered under an existing name replaces it.  */
+#define CMD_HASH_MIN_SIZE 32
 struct cmdlist {
-	struct cmdlist *next;
-	struct fastboot_cmd *cmd;
+	struct fastboot_cmd **slots;
+	UINTN size;
+	UINTN count;
 };
 
 enum fastboot_states {
@@ -81,6 +96,8 @@ enum fastboot_states {
 	STATE_START_DOWNLOAD,
 	STATE_DOWNLOAD,
 	STATE_TX,
+	STATE_UPLOAD,
+	STATE_UPLOAD_DATA,
 	STATE_STOPPING,
 	STATE_STOPPED,
 	STATE_ERROR,
@@ -91,14 +108,125 @@ EFI_GUID guid_linux_data = {0x0fc63daf, 0x8483, 0x4772, {0x8e, 0x79, 0x3d, 0x69,
 static cmdlist_t cmdlist;
 static char *command_buffer;
 static UINTN command_buffer_size;
-static struct fastboot_var *varlist;
-static struct fastboot_tx_buffer *txbuf_head;
+
+/* Variables are stored in publish order in a fixed arena, indexed by
+   an open addressing hash table of VAR_HASH_SIZE slots holding the
+   variable index plus one.  */
+#define MAX_VARIABLES 512
+#define VAR_HASH_SIZE (2 * MAX_VARIABLES)
+static struct {
+	struct fastboot_var *vars;
+	UINT16 *slots;
+	UINTN count;
+} vartable;
+
+/* Variables families resolved by a handler of the name suffix */
+#define MAX_PREFIX_VARIABLES 8
+static struct prefix_var {
+	const char *prefix;
+	char *(*get_value)(const char *suffix);
+} prefix_vars[MAX_PREFIX_VARIABLES];
+static UINTN prefix_var_count;
+static struct fastboot_tx_buffer *txbuf_head, *txbuf_tail;
 static enum fastboot_states fastboot_state;
 static enum fastboot_states next_state;
 
+/* Queued responses are written back-to-back, up to TX_QUEUE_DEPTH
+   of them in flight if the transport accepts as many.  The state
+   machine only moves on when the last one is sent.  */
+#define TX_QUEUE_DEPTH 8
+static CHAR8 tx_slots[TX_QUEUE_DEPTH][MAGIC_LENGTH];
+static UINTN tx_next_slot;
+static UINTN tx_inflight;
+
 /* Download buffer and size, for download and flash commands */
 static void *dlbuffer;
 static unsigned dlsize, bufsize;
+static UINTN max_download_size = MAX_DOWNLOAD_SIZE;
+static unsigned received_len;
+static unsigned last_received_len;
+
+/* A download interrupted by a transport restart can be completed with
+   "download-resume:<session>", the data received so far is kept.  */
+static struct {
+	UINT32 session;
+	BOOLEAN interrupted;
+} resume;
+
+/* A downloaded boot image is hashed as it is received so that
+   "fastboot boot" does not have to hash it again.  The hash is only
+   kept if "boot" is the command following the download.  */
+static struct {
+	BOOLEAN checked;	/* boot image header checked */
+	unsigned imgsize;	/* 0 if the download is not hashed */
+	unsigned hashed;
+} dlhash;
+
+/* A boot image downloaded on an unlocked device, which may then be
+   booted, is received in place: see android_image_place().  The
+   transfers are bounded to DLPLACE_NEED bytes until it is placed.  */
+static unsigned dlplace_need;
+
+/* The chunk headers of a downloaded sparse image are checked as they
+   are received.  A malformed image is refused at once: the rest of
+   the data is only drained and the download fails.  */
+static EFI_STATUS dlcheck_status;
+
+/* Partition armed by "flash:<label>:stream" for the next download.  */
+#define STREAM_SUFFIX ":stream"
+static CHAR16 *stream_label;
+static BOOLEAN stream_active;
+static EFI_STATUS stream_status;
+
+/* Streamed downloads are received in a ring of page-aligned slots
+   instead of the download buffer.  A slot is handed to the flash
+   writer as soon as it is full, while the next one is being
+   received.  */
+#define STREAM_RING_SLOTS 4
+#define STREAM_SLOT_SIZE (4 * 1024 * 1024)
+#define STREAM_RING_PAGES EFI_SIZE_TO_PAGES(STREAM_RING_SLOTS * STREAM_SLOT_SIZE)
+static struct {
+	EFI_PHYSICAL_ADDRESS base;
+	UINTN slot;		/* slot being received */
+	UINTN fill;		/* bytes already received in this slot */
+	UINTN request;		/* bytes expected in this slot */
+} ring;
+
+/* Background writer.  With "oem pipeline-flash", once checked, an
+   image of a regular partition is acknowledged and queued.  With
+   "oem deferred-erase", an erase is.  The queued operations are run
+   in order by the main loop, a slice at a time, while the next
+   commands are received.  A queued image keeps the download buffer:
+   the next download gets a new one.  Only "download",
+   "download-resume", "getvar" and the commands which queue an
+   operation run meanwhile, the other commands wait for the queue to
+   be empty.  A failure cancels the queued operations and is the
+   response of the next command, which is not run.
+   "getvar:flash-status" waits for the queue.  */
+#define PIPELINE_DEPTH 4
+#define PIPELINE_SLICE_SIZE (4 * 1024 * 1024)
+#define FLASH_STATUS_VAR "flash-status"
+enum pipeline_op {
+	PIPELINE_FLASH,
+	PIPELINE_ERASE
+};
+struct pipeline_job {
+	enum pipeline_op op;
+	CHAR16 *label;
+	CHAR8 *data;		/* image to flash */
+	UINTN size;
+	UINTN bufsize;		/* of DATA if allocated from the pool */
+	UINTN written;
+	BOOLEAN started;
+};
+static struct {
+	struct pipeline_job jobs[PIPELINE_DEPTH];
+	UINTN head;
+	UINTN count;
+	EFI_STATUS status;	/* of the failed operation */
+	enum pipeline_op failed_op;
+	CHAR16 *failed;		/* label of the failed operation */
+} pipeline;
 
 static const char *flash_locked_whitelist[] = {
 #ifdef BOOTLOADER_POLICY
@@ -107,12 +235,30 @@ static const char *flash_locked_whitelist[] = {
 	NULL
 };
 
+/* Image handed to the loader once the session is stopped.  */
+static void *fastboot_bootimage;
+static void *fastboot_efiimage;
+static UINTN fastboot_imagesize;
+static enum boot_target fastboot_target;
+
+static void dlhash_reset(void);
+static BOOLEAN dlhash_header_valid(struct boot_img_hdr *hdr, UINT64 size);
+static void fastboot_stop_session(void);
+
 void fastboot_set_dlbuffer(void *buffer, unsigned size)
 {
+	dlhash_reset();
+	android_image_unplace(dlbuffer, FALSE);
 	dlbuffer = buffer;
 	dlsize = size;
 }
 
+void *fastboot_get_dlbuffer(unsigned *size)
+{
+	*size = dlsize;
+	return dlsize ? dlbuffer : NULL;
+}
+
 EFI_STATUS fastboot_set_command_buffer(char *buffer, UINTN size)
 {
 	if (!buffer)
@@ -124,23 +270,78 @@ EFI_STATUS fastboot_set_command_buffer(char *buffer, UINTN size)
 	return EFI_SUCCESS;
 }
 
+static UINT32 name_hash(const char *name)
+{
+	UINT32 hash = 2166136261U;
+
+	for (; *name; name++)
+		hash = (hash ^ (UINT8)*name) * 16777619U;
+
+	return hash;
+}
+
+/* Return the slot of NAME, or the free slot where it belongs.  */
+static struct fastboot_cmd **cmd_slot(cmdlist_t list, const char *name)
+{
+	UINTN i, mask = list->size - 1;
+	struct fastboot_cmd **slot;
+
+	for (i = name_hash(name) & mask; ; i = (i + 1) & mask) {
+		slot = &list->slots[i];
+		if (!*slot || !strcmp((CHAR8 *)name, (CHAR8 *)(*slot)->name))
+			return slot;
+	}
+}
+
+static EFI_STATUS cmdlist_grow(cmdlist_t list)
+{
+	struct fastboot_cmd **old = list->slots;
+	UINTN i, old_size = list->size;
+
+	list->size = old_size ? old_size * 2 : CMD_HASH_MIN_SIZE;
+	list->slots = AllocateZeroPool(list->size * sizeof(*list->slots));
+	if (!list->slots) {
+		list->slots = old;
+		list->size = old_size;
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	for (i = 0; i < old_size; i++)
+		if (old[i])
+			*cmd_slot(list, old[i]->name) = old[i];
+
+	if (old)
+		FreePool(old);
+	return EFI_SUCCESS;
+}
+
 EFI_STATUS fastboot_register_into(cmdlist_t *list, struct fastboot_cmd *cmd)
 {
-	cmdlist_t node;
+	struct fastboot_cmd **slot;
 
 	if (!list || !cmd)
 		return EFI_INVALID_PARAMETER;
 
-	node = AllocatePool(sizeof(*node));
-	if (!node) {
-		error(L"Failed to allocate fastboot command %a", cmd->name);
-		return EFI_OUT_OF_RESOURCES;
+	if (!*list) {
+		*list = AllocateZeroPool(sizeof(**list));
+		if (!*list)
+			goto err;
 	}
-	node->cmd = cmd;
-	node->next = *list;
-	*list = node;
+
+	if ((*list)->count * 2 >= (*list)->size &&
+	    EFI_ERROR(cmdlist_grow(*list)))
+		goto err;
+
+	slot = cmd_slot(*list, cmd->name);
+	if (!*slot)
+		(*list)->count++;
+	*slot = cmd;
 
 	return EFI_SUCCESS;
+
+err:
+	error(L"Failed to allocate fastboot command %a", cmd->name);
+	return EFI_OUT_OF_RESOURCES;
 }
 
 EFI_STATUS fastboot_register(struct fastboot_cmd *cmd)
@@ -150,32 +351,70 @@ EFI_STATUS fastboot_register(struct fastboot_cmd *cmd)
 
 void fastboot_cmdlist_unregister(cmdlist_t *list)
 {
-	cmdlist_t next, node;
-
-	if (!list)
+	if (!list || !*list)
 		return;
 
-	for (node = *list; node; node = next) {
-		next = node->next;
-		FreePool(node);
-	}
+	if ((*list)->slots)
+		FreePool((*list)->slots);
+	FreePool(*list);
 	*list = NULL;
 }
 
+static UINTN var_hash(const char *name)
+{
+	return name_hash(name) & (VAR_HASH_SIZE - 1);
+}
+
+/* Return the slot of NAME, or the free slot where it belongs.  */
+static UINT16 *var_slot(const char *name)
+{
+	UINTN i;
+	UINT16 *slot;
+
+	for (i = var_hash(name); ; i = (i + 1) & (VAR_HASH_SIZE - 1)) {
+		slot = &vartable.slots[i];
+		if (!*slot || !strcmp((CHAR8 *)name,
+				      (CHAR8 *)vartable.vars[*slot - 1].name))
+			return slot;
+	}
+}
+
+static EFI_STATUS vartable_alloc(void)
+{
+	if (vartable.vars)
+		return EFI_SUCCESS;
+
+	vartable.vars = AllocatePool(MAX_VARIABLES * sizeof(*vartable.vars));
+	vartable.slots = AllocateZeroPool(VAR_HASH_SIZE * sizeof(*vartable.slots));
+	if (!vartable.vars || !vartable.slots) {
+		if (vartable.vars)
+			FreePool(vartable.vars);
+		if (vartable.slots)
+			FreePool(vartable.slots);
+		vartable.vars = NULL;
+		vartable.slots = NULL;
+		return EFI_OUT_OF_RESOURCES;
+	}
+	vartable.count = 0;
+
+	return EFI_SUCCESS;
+}
+
 struct fastboot_var *fastboot_getvar(const char *name)
 {
-	struct fastboot_var *var;
+	UINT16 *slot;
 
-	for (var = varlist; var; var = var->next)
-		if (!strcmp((CHAR8 *)name, (const CHAR8 *)var->name))
-			return var;
+	if (!vartable.vars)
+		return NULL;
 
-	return NULL;
+	slot = var_slot(name);
+	return *slot ? &vartable.vars[*slot - 1] : NULL;
 }
 
 static struct fastboot_var *fastboot_getvar_or_create(const char *name)
 {
 	struct fastboot_var *var;
+	UINT16 *slot;
 	UINTN size;
 
 	size = strlena((CHAR8 *) name) + 1;
@@ -184,55 +423,39 @@ static struct fastboot_var *fastboot_getvar_or_create(const char *name)
 		return NULL;
 	}
 
-	var = fastboot_getvar(name);
-	if (!var) {
-		var = AllocateZeroPool(sizeof(*var));
-		if (!var) {
-			error(L"Failed to allocate variable '%a'", name);
-			return NULL;
-		}
-		var->next = varlist;
-		varlist = var;
-		CopyMem(var->name, name, size);
+	if (EFI_ERROR(vartable_alloc())) {
+		error(L"Failed to allocate the variable table");
+		return NULL;
 	}
 
-	return var;
-}
+	slot = var_slot(name);
+	if (*slot)
+		return &vartable.vars[*slot - 1];
 
-/*
- * remove all fastboot variable which starts with partition-
- */
-#define MATCH_PART "partition-"
-static void clean_partition_var(void)
-{
-	struct fastboot_var *var;
-	struct fastboot_var *old_varlist;
-	struct fastboot_var *next;
+	if (vartable.count == MAX_VARIABLES) {
+		error(L"Too many variables, cannot add '%a'", name);
+		return NULL;
+	}
 
-	old_varlist = varlist;
-	varlist = NULL;
+	var = &vartable.vars[vartable.count++];
+	ZeroMem(var, sizeof(*var));
+	CopyMem(var->name, name, size);
+	*slot = vartable.count;
 
-	for (var = old_varlist; var; var = next) {
-		next = var->next;
-		if (!memcmp(MATCH_PART, var->name, strlena((CHAR8 *) MATCH_PART))) {
-			FreePool(var);
-		} else {
-			var->next = varlist;
-			varlist = var;
-		}
-	}
+	return var;
 }
 
 static void fastboot_unpublish_all()
 {
-	struct fastboot_var *next, *var;
-
-	for (var = varlist; var; var = next) {
-		next = var->next;
-		FreePool(var);
+	if (vartable.vars) {
+		FreePool(vartable.vars);
+		FreePool(vartable.slots);
 	}
 
-	varlist = NULL;
+	vartable.vars = NULL;
+	vartable.slots = NULL;
+	vartable.count = 0;
+	prefix_var_count = 0;
 }
 
 EFI_STATUS fastboot_publish_dynamic(const char *name, char *(get_value)(void))
@@ -251,6 +474,37 @@ EFI_STATUS fastboot_publish_dynamic(const char *name, char *(get_value)(void))
 	return EFI_SUCCESS;
 }
 
+EFI_STATUS fastboot_publish_prefix(const char *prefix,
+				  char *(*get_value)(const char *suffix))
+{
+	if (!prefix || !get_value)
+		return EFI_INVALID_PARAMETER;
+
+	if (prefix_var_count == MAX_PREFIX_VARIABLES) {
+		error(L"Too many prefix variables, cannot add '%a'", prefix);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	prefix_vars[prefix_var_count].prefix = prefix;
+	prefix_vars[prefix_var_count].get_value = get_value;
+	prefix_var_count++;
+
+	return EFI_SUCCESS;
+}
+
+static char *prefix_var_value(const char *name)
+{
+	UINTN i, len;
+
+	for (i = 0; i < prefix_var_count; i++) {
+		len = strlen((CHAR8 *)prefix_vars[i].prefix);
+		if (!strncmp((CHAR8 *)name, (CHAR8 *)prefix_vars[i].prefix, len))
+			return prefix_vars[i].get_value(name + len);
+	}
+
+	return NULL;
+}
+
 EFI_STATUS fastboot_publish(const char *name, const char *value)
 {
 	struct fastboot_var *var;
@@ -297,38 +551,77 @@ static char *get_psize_str(UINT64 size)
 	return part_size;
 }
 
-static EFI_STATUS publish_part(CHAR16 *part_name, UINT64 size, EFI_GUID *guid)
+/* The partition variables are not published, they are resolved on
+   demand from the GPT cache so that they follow any GPT change.  */
+static char *part_size_value(struct gpt_partition_interface *gparti)
 {
-	struct descriptor {
-		char *name;
-		char *value;
-	} descriptors[] = {
-		{ "partition-size",	get_psize_str(size) },
-		{ "partition-type",	get_ptype_str(guid) },
-		{ "has-slot",		"no" }
-	};
-	char var[MAX_VARIABLE_LENGTH];
-	int len;
-	UINTN i;
-	struct descriptor *desc;
+	return get_psize_str(gparti->bio->Media->BlockSize *
+			     (gparti->part.ending_lba + 1 - gparti->part.starting_lba));
+}
+
+static char *part_type_value(struct gpt_partition_interface *gparti)
+{
+	return get_ptype_str(&gparti->part.type);
+}
+
+static char *part_slot_value(__attribute__((__unused__)) struct gpt_partition_interface *gparti)
+{
+	return "no";
+}
 
-	for (i = 0; i < ARRAY_SIZE(descriptors); i++) {
-		desc = &descriptors[i];
-		if (!desc->value)
-			return EFI_INVALID_PARAMETER;
+static const struct part_var {
+	const char *prefix;
+	char *(*get_value)(struct gpt_partition_interface *gparti);
+} PART_VARS[] = {
+	{ "partition-size:",	part_size_value },
+	{ "partition-type:",	part_type_value },
+	{ "has-slot:",		part_slot_value }
+};
 
-		len = snprintf((CHAR8 *)var, sizeof(var), (CHAR8 *)"%a:%s",
-			       desc->name, part_name);
-		if (len < 0 || len >= (int)sizeof(var))
-			return EFI_INVALID_PARAMETER;
+static char *part_var_value(const char *name)
+{
+	struct gpt_partition_interface gparti;
+	EFI_STATUS ret;
+	CHAR16 *label;
+	UINTN i, len;
 
-		fastboot_publish(var, desc->value);
+	for (i = 0; i < ARRAY_SIZE(PART_VARS); i++) {
+		len = strlen((CHAR8 *)PART_VARS[i].prefix);
+		if (!strncmp((CHAR8 *)name, (CHAR8 *)PART_VARS[i].prefix, len))
+			break;
 	}
+	if (i == ARRAY_SIZE(PART_VARS))
+		return NULL;
 
-	return EFI_SUCCESS;
+	label = bump_stra_to_str((CHAR8 *)name + len);
+	if (!label)
+		return NULL;
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	/* stay compatible with userdata/data naming */
+	if (ret == EFI_NOT_FOUND && !StrCmp(label, L"data"))
+		ret = gpt_get_partition_by_label(L"userdata", &gparti,
+						 LOGICAL_UNIT_USER);
+	bump_free(label);
+	if (EFI_ERROR(ret))
+		return NULL;
+
+	return PART_VARS[i].get_value(&gparti);
+}
+
+static void info_part_vars(CHAR16 *name, struct gpt_partition_interface *gparti)
+{
+	char *value;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(PART_VARS); i++) {
+		value = PART_VARS[i].get_value(gparti);
+		if (value)
+			fastboot_info("%a%s: %a", PART_VARS[i].prefix, name, value);
+	}
 }
 
-static EFI_STATUS publish_partsize(void)
+static void info_all_part_vars(void)
 {
 	EFI_STATUS ret;
 	struct gpt_partition_interface *gparti;
@@ -337,33 +630,19 @@ static EFI_STATUS publish_partsize(void)
 
 	ret = gpt_list_partition(&gparti, &part_count, LOGICAL_UNIT_USER);
 	if (EFI_ERROR(ret) || part_count == 0)
-		return EFI_SUCCESS;
+		return;
 
 	for (i = 0; i < part_count; i++) {
-		UINT64 size;
-
-		size = gparti[i].bio->Media->BlockSize
-			* (gparti[i].part.ending_lba + 1 - gparti[i].part.starting_lba);
-
-		ret = publish_part(gparti[i].part.name, size, &gparti[i].part.type);
-		if (EFI_ERROR(ret))
-			return ret;
+		info_part_vars(gparti[i].part.name, &gparti[i]);
 
 		/* stay compatible with userdata/data naming */
-		if (!StrCmp(gparti[i].part.name, L"data")) {
-			ret = publish_part(L"userdata", size, &gparti[i].part.type);
-			if (EFI_ERROR(ret))
-				return ret;
-		} else if (!StrCmp(gparti[i].part.name, L"userdata")) {
-			ret = publish_part(L"data", size, &gparti[i].part.type);
-			if (EFI_ERROR(ret))
-				return ret;
-		}
+		if (!StrCmp(gparti[i].part.name, L"data"))
+			info_part_vars(L"userdata", &gparti[i]);
+		else if (!StrCmp(gparti[i].part.name, L"userdata"))
+			info_part_vars(L"data", &gparti[i]);
 	}
 
 	FreePool(gparti);
-
-	return EFI_SUCCESS;
 }
 
 static char *get_battery_voltage_var()
@@ -414,54 +693,78 @@ void fastboot_ack(const char *code, const char *fmt, va_list ap)
 	if (EFI_ERROR(ret))
 		return;
 
-	debug(L"SENT %a", msg);
+	log_debug(FASTBOOT, L"SENT %a", msg);
 	fastboot_state = next_state;
 	ret = transport_write(msg, MAGIC_LENGTH);
 	if (EFI_ERROR(ret))
 		fastboot_state = STATE_ERROR;
 }
 
+static struct fastboot_tx_buffer *txbuf_new(const char *code)
+{
+	struct fastboot_tx_buffer *txbuf;
+
+	txbuf = AllocateZeroPool(sizeof(*txbuf));
+	if (!txbuf) {
+		error(L"Failed to allocate memory");
+		return NULL;
+	}
+
+	CopyMem(txbuf->msg, code, CODE_LENGTH);
+	return txbuf;
+}
+
+static void txbuf_queue(struct fastboot_tx_buffer *txbuf)
+{
+	if (!txbuf_head)
+		txbuf_head = txbuf;
+	else
+		txbuf_tail->next = txbuf;
+	txbuf_tail = txbuf;
+	fastboot_state = STATE_TX;
+}
+
 void fastboot_ack_buffered(const char *code, const char *fmt, va_list ap)
 {
 	struct fastboot_tx_buffer *new_txbuf;
-	struct fastboot_tx_buffer *txbuf;
 	EFI_STATUS ret;
 
-	new_txbuf = AllocateZeroPool(sizeof(*new_txbuf));
-	if (!new_txbuf) {
-		error(L"Failed to allocate memory");
+	new_txbuf = txbuf_new(code);
+	if (!new_txbuf)
 		return;
-	}
 
 	ret = fastboot_build_ack_msg(new_txbuf->msg, code, fmt, ap);
 	if (EFI_ERROR(ret)) {
 		FreePool(new_txbuf);
 		return;
 	}
-	if (!txbuf_head)
-		txbuf_head = new_txbuf;
-	else {
-		txbuf = txbuf_head;
-		while (txbuf->next)
-			txbuf = txbuf->next;
-		txbuf->next = new_txbuf;
-	}
-	fastboot_state = STATE_TX;
+	txbuf_queue(new_txbuf);
 }
 
-EFI_STATUS fastboot_info_long_string(char *str, VOID *context _unused)
+/* Queue TEXT as INFO messages, split at the payload size.  TEXT is
+   copied as is, it is not a format string.  */
+void fastboot_info_text(const char *text, UINTN len)
 {
-	char linebuf[INFO_PAYLOAD];
-	const UINTN max_len = sizeof(linebuf) - 1;
+	struct fastboot_tx_buffer *txbuf;
+	const UINTN max_len = INFO_PAYLOAD - 1;
+	UINTN chunk;
 
-	linebuf[max_len] = '\0';
+	do {
+		chunk = min(len, max_len);
+		txbuf = txbuf_new("INFO");
+		if (!txbuf)
+			return;
 
-	while (strlen((CHAR8 *)str) > max_len) {
-		memcpy(linebuf, str, max_len);
-		fastboot_info(linebuf);
-		str += max_len;
-	}
-	fastboot_info(str);
+		CopyMem(&txbuf->msg[CODE_LENGTH], text, chunk);
+		txbuf_queue(txbuf);
+		text += chunk;
+		len -= chunk;
+	} while (len);
+}
+
+EFI_STATUS fastboot_info_long_string(char *str, VOID *context _unused)
+{
+	fastboot_info_text(str, strlen((CHAR8 *)str));
 
 	return EFI_SUCCESS;
 }
@@ -479,6 +782,7 @@ void fastboot_fail(const char *fmt, ...)
 {
 	va_list ap;
 
+	perf_cmd_end();
 	va_start(ap, fmt);
 	if (fastboot_state == STATE_TX)
 		fastboot_ack_buffered("FAIL", fmt, ap);
@@ -491,6 +795,7 @@ void fastboot_okay(const char *fmt, ...)
 {
 	va_list ap;
 
+	perf_cmd_end();
 	va_start(ap, fmt);
 	if (fastboot_state == STATE_TX)
 		fastboot_ack_buffered("OKAY", fmt, ap);
@@ -503,18 +808,30 @@ static void flush_tx_buffer(void)
 {
 	EFI_STATUS ret;
 	struct fastboot_tx_buffer *msg;
-	static CHAR8 buf[sizeof(msg->msg)];
+	CHAR8 *buf;
+	UINTN depth = min(transport_write_depth(), (UINTN)TX_QUEUE_DEPTH);
+
+	while (txbuf_head && tx_inflight < depth) {
+		msg = txbuf_head;
+		txbuf_head = txbuf_head->next;
+		if (!txbuf_head) {
+			txbuf_tail = NULL;
+			fastboot_state = next_state;
+		}
 
-	msg = txbuf_head;
-	txbuf_head = txbuf_head->next;
-	if (!txbuf_head)
-		fastboot_state = next_state;
+		buf = tx_slots[tx_next_slot];
+		tx_next_slot = (tx_next_slot + 1) % TX_QUEUE_DEPTH;
+		memcpy(buf, msg->msg, MAGIC_LENGTH);
+		FreePool(msg);
 
-	memcpy(buf, msg->msg, sizeof(buf));
-	FreePool(msg);
-	ret = transport_write(buf, sizeof(buf));
-	if (EFI_ERROR(ret))
-		fastboot_state = STATE_ERROR;
+		tx_inflight++;
+		ret = transport_write(buf, MAGIC_LENGTH);
+		if (EFI_ERROR(ret)) {
+			tx_inflight--;
+			fastboot_state = STATE_ERROR;
+			return;
+		}
+	}
 }
 
 static BOOLEAN is_in_white_list(const CHAR8 *key, const char **white_list)
@@ -526,93 +843,533 @@ static BOOLEAN is_in_white_list(const CHAR8 *key, const char **white_list)
 	return FALSE;
 }
 
-EFI_STATUS refresh_partition_var(void)
+static void fastboot_flash_fail(EFI_STATUS ret)
 {
-	clean_partition_var();
-	return publish_partsize();
+	UINT64 offset;
+
+	if (flash_verify_failed(&offset))
+		fastboot_fail("Verification failure at offset 0x%lx", offset);
+	else
+		fastboot_fail("Flash failure: %r", ret);
 }
 
-static void cmd_flash(INTN argc, CHAR8 **argv)
+static void stream_disarm(void)
+{
+	if (stream_label) {
+		FreePool(stream_label);
+		stream_label = NULL;
+	}
+	stream_active = FALSE;
+}
+
+static EFI_STATUS ring_alloc(void)
 {
 	EFI_STATUS ret;
-	CHAR16 *label;
 
-	if (argc != 2) {
-		fastboot_fail("Invalid parameter");
-		return;
-	}
+	if (ring.base)
+		return EFI_SUCCESS;
 
-	if (get_current_state() == LOCKED &&
-	    !is_in_white_list(argv[1], flash_locked_whitelist)) {
-		error(L"Flash %a is prohibited in %a state.", argv[1],
-		      get_current_state_string());
-		fastboot_fail("Prohibited command in %a state.", get_current_state_string());
-		return;
+	ret = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages,
+				EfiLoaderData, STREAM_RING_PAGES, &ring.base);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to allocate the stream ring");
+		ring.base = 0;
 	}
+	return ret;
+}
 
-	label = stra_to_str((CHAR8*)argv[1]);
-	if (!label) {
-		error(L"Failed to get label %a", argv[1]);
-		fastboot_fail("Allocation error");
+static void ring_free(void)
+{
+	if (!ring.base)
 		return;
-	}
-	ui_print(L"Flashing %s ...", label);
 
-	ret = flash(dlbuffer, dlsize, label);
-	FreePool(label);
-	if (EFI_ERROR(ret)) {
-		fastboot_fail("Flash failure: %r", ret);
-		return;
+	uefi_call_wrapper(BS->FreePages, 2, ring.base, STREAM_RING_PAGES);
+	ring.base = 0;
+}
+
+static CHAR8 *ring_slot(UINTN slot)
+{
+	return (CHAR8 *)(UINTN)ring.base + slot * STREAM_SLOT_SIZE;
+}
+
+static void pipeline_release(struct pipeline_job *job)
+{
+	if (job->data && !arena_contains(job->data))
+		memstat_free_pool(MEMSTAT_DOWNLOAD, job->data, job->bufsize);
+	if (job->label)
+		FreePool(job->label);
+	ZeroMem(job, sizeof(*job));
+}
+
+static void pipeline_pop(void)
+{
+	pipeline_release(&pipeline.jobs[pipeline.head]);
+	pipeline.head = (pipeline.head + 1) % PIPELINE_DEPTH;
+	pipeline.count--;
+}
+
+static void pipeline_fail(struct pipeline_job *job, EFI_STATUS ret)
+{
+	efi_perror(ret, L"Background %a of %s failed",
+		   job->op == PIPELINE_FLASH ? "flash" : "erase", job->label);
+	pipeline.status = ret;
+	pipeline.failed_op = job->op;
+	pipeline.failed = job->label;
+	job->label = NULL;
+
+	while (pipeline.count) {
+		job = &pipeline.jobs[pipeline.head];
+		if (job->label)
+			error(L"Background %a of %s cancelled",
+			      job->op == PIPELINE_FLASH ? "flash" : "erase",
+			      job->label);
+		pipeline_pop();
 	}
+}
 
-	gpt_sync();
+static EFI_STATUS pipeline_flash_step(struct pipeline_job *job, BOOLEAN *done)
+{
+	EFI_STATUS ret, ret_end;
+	UINTN len;
 
-	/* update partition variable in case it has changed */
-	if (ret & REFRESH_PARTITION_VAR) {
-		ret = refresh_partition_var();
+	if (!job->started) {
+		perf_flash_start(job->label);
+		ret = flash_stream_start(job->label);
 		if (EFI_ERROR(ret)) {
-			fastboot_fail("Failed to publish partition variables, %r", ret);
-			return;
+			perf_flash_end();
+			return ret;
 		}
+		job->started = TRUE;
 	}
 
-	ui_print(L"Flash done.");
-	fastboot_okay("");
+	len = min((UINTN)PIPELINE_SLICE_SIZE, job->size - job->written);
+	ret = flash_stream_write(job->data + job->written, len);
+	job->written += len;
+	if (!EFI_ERROR(ret) && job->written < job->size)
+		return EFI_SUCCESS;
+
+	*done = TRUE;
+	ret_end = flash_stream_end();
+	perf_flash_end();
+	if (EFI_ERROR(ret))
+		return ret;
+	if (EFI_ERROR(ret_end))
+		return ret_end;
+
+	gpt_sync();
+	ui_print(L"Flash of %s done.", job->label);
+	return EFI_SUCCESS;
 }
 
-static void cmd_erase(INTN argc, CHAR8 **argv)
+static EFI_STATUS pipeline_erase_step(struct pipeline_job *job, BOOLEAN *done)
 {
 	EFI_STATUS ret;
-	CHAR16 *label;
-
-	if (argc != 2) {
-		fastboot_fail("Invalid parameter");
-		return;
-	}
 
-	label = stra_to_str((CHAR8*)argv[1]);
-	if (!label) {
-		error(L"Failed to get label %a", argv[1]);
-		fastboot_fail("Allocation error");
-		return;
-	}
-	ui_print(L"Erasing %s ...", label);
-	ret = erase_by_label(label);
-	FreePool(label);
-	if (EFI_ERROR(ret)) {
-		fastboot_fail("Erase failure: %r", ret);
-		return;
+	if (!job->started) {
+		ret = erase_start(job->label);
+		if (EFI_ERROR(ret))
+			return ret;
+		job->started = TRUE;
 	}
 
-	ui_print(L"Erase done.");
-	fastboot_okay("");
+	ret = erase_step(done);
+	if (!EFI_ERROR(ret) && *done)
+		ui_print(L"Erase of %s done.", job->label);
+	return ret;
 }
 
-static void cmd_boot(__attribute__((__unused__)) INTN argc,
+/* Run the next step of the oldest operation, called from the main
+   loop.  */
+static void pipeline_run(void)
+{
+	struct pipeline_job *job;
+	BOOLEAN done = FALSE;
+	EFI_STATUS ret;
+
+	if (!pipeline.count)
+		return;
+
+	job = &pipeline.jobs[pipeline.head];
+	if (job->op == PIPELINE_FLASH)
+		ret = pipeline_flash_step(job, &done);
+	else
+		ret = pipeline_erase_step(job, &done);
+
+	if (EFI_ERROR(ret))
+		pipeline_fail(job, ret);
+	else if (done)
+		pipeline_pop();
+}
+
+static void pipeline_sync(void)
+{
+	while (pipeline.count)
+		pipeline_run();
+}
+
+static BOOLEAN pipeline_failed(void)
+{
+	return pipeline.failed != NULL;
+}
+
+static void pipeline_report(void)
+{
+	UINT64 offset;
+
+	if (pipeline.failed_op == PIPELINE_ERASE)
+		fastboot_fail("Erase of %s failed: %r", pipeline.failed,
+			      pipeline.status);
+	else if (flash_verify_failed(&offset))
+		fastboot_fail("Verification failure of %s at offset 0x%lx",
+			      pipeline.failed, offset);
+	else
+		fastboot_fail("Flash of %s failed: %r", pipeline.failed,
+			      pipeline.status);
+	FreePool(pipeline.failed);
+	pipeline.failed = NULL;
+	pipeline.status = EFI_SUCCESS;
+}
+
+/* Wait for the queued operations before a command accesses the disk
+   on its own.  FALSE if one failed, the failure is then reported.  */
+static BOOLEAN pipeline_wait(void)
+{
+	pipeline_sync();
+	if (!pipeline_failed())
+		return TRUE;
+
+	pipeline_report();
+	return FALSE;
+}
+
+static BOOLEAN pipeline_overlaps(INTN argc, CHAR8 **argv)
+{
+	if (!strcmp(argv[0], (CHAR8 *)"download") ||
+	    !strcmp(argv[0], (CHAR8 *)"download-resume"))
+		return TRUE;
+
+	/* They wait for the queue if they do not queue an operation.  */
+	if (!strcmp(argv[0], (CHAR8 *)"flash"))
+		return get_pipeline_flash();
+	if (!strcmp(argv[0], (CHAR8 *)"erase"))
+		return get_deferred_erase();
+
+	return !strcmp(argv[0], (CHAR8 *)"getvar") &&
+		(argc != 2 || strcmp(argv[1], (CHAR8 *)FLASH_STATUS_VAR));
+}
+
+static BOOLEAN pipeline_holds_arena(void)
+{
+	UINTN i;
+
+	for (i = 0; i < PIPELINE_DEPTH; i++)
+		if (arena_contains(pipeline.jobs[i].data))
+			return TRUE;
+
+	return FALSE;
+}
+
+/* NULL if an operation run to make room failed.  */
+static struct pipeline_job *pipeline_push(enum pipeline_op op, CHAR16 *label)
+{
+	struct pipeline_job *job;
+
+	while (pipeline.count == PIPELINE_DEPTH)
+		pipeline_run();
+	if (pipeline_failed())
+		return NULL;
+
+	job = &pipeline.jobs[(pipeline.head + pipeline.count) % PIPELINE_DEPTH];
+	pipeline.count++;
+	job->op = op;
+	job->label = label;
+
+	return job;
+}
+
+/* Queue the flash of the downloaded image, which the queue takes like
+   LABEL.  EFI_UNSUPPORTED if the image must be flashed synchronously,
+   EFI_ABORTED if a queued operation failed.  */
+static EFI_STATUS pipeline_flash(CHAR16 *label)
+{
+	struct pipeline_job *job;
+	EFI_STATUS ret;
+
+	if (!get_pipeline_flash() || !dlsize)
+		return EFI_UNSUPPORTED;
+
+	ret = flash_stream_check(label, dlbuffer, dlsize);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	job = pipeline_push(PIPELINE_FLASH, label);
+	if (!job)
+		return EFI_ABORTED;
+	job->data = dlbuffer;
+	job->size = dlsize;
+	job->bufsize = bufsize;
+	dlbuffer = NULL;
+	dlsize = bufsize = 0;
+
+	return EFI_SUCCESS;
+}
+
+/* Same as pipeline_flash() for the erase of LABEL, which is
+   copied.  */
+static EFI_STATUS pipeline_erase(CHAR16 *label)
+{
+	struct gpt_partition_interface part;
+	CHAR16 *copy;
+	EFI_STATUS ret;
+
+	if (!get_deferred_erase())
+		return EFI_UNSUPPORTED;
+
+	ret = gpt_get_partition_by_label(label, &part, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	copy = StrDuplicate(label);
+	if (!copy)
+		return EFI_OUT_OF_RESOURCES;
+
+	if (!pipeline_push(PIPELINE_ERASE, copy)) {
+		FreePool(copy);
+		return EFI_ABORTED;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static void pipeline_free(void)
+{
+	pipeline_sync();
+	if (pipeline_failed()) {
+		FreePool(pipeline.failed);
+		pipeline.failed = NULL;
+	}
+}
+
+static BOOLEAN strip_stream_suffix(CHAR8 *arg)
+{
+	UINTN len = strlen(arg), suffix_len = strlen((CHAR8 *)STREAM_SUFFIX);
+
+	if (len <= suffix_len ||
+	    strcmp(arg + len - suffix_len, (CHAR8 *)STREAM_SUFFIX))
+		return FALSE;
+
+	arg[len - suffix_len] = '\0';
+	return TRUE;
+}
+
+static void cmd_flash(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	CHAR16 *label;
+	BOOLEAN stream;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	stream = strip_stream_suffix(argv[1]);
+
+	if (get_current_state() == LOCKED &&
+	    !is_in_white_list(argv[1], flash_locked_whitelist)) {
+		error(L"Flash %a is prohibited in %a state.", argv[1],
+		      get_current_state_string());
+		fastboot_fail("Prohibited command in %a state.", get_current_state_string());
+		return;
+	}
+
+	label = stra_to_str((CHAR8*)argv[1]);
+	if (!label) {
+		error(L"Failed to get label %a", argv[1]);
+		fastboot_fail("Allocation error");
+		return;
+	}
+	ui_print(L"Flashing %s ...", label);
+
+	if (stream) {
+		if (!pipeline_wait()) {
+			FreePool(label);
+			return;
+		}
+		stream_disarm();
+		stream_label = label;
+		fastboot_okay("");
+		return;
+	}
+
+	ret = pipeline_flash(label);
+	if (!EFI_ERROR(ret)) {
+		ui_print(L"Flash of %s queued.", label);
+		fastboot_okay("");
+		return;
+	}
+	if (ret == EFI_ABORTED || (ret == EFI_UNSUPPORTED && !pipeline_wait())) {
+		FreePool(label);
+		if (ret == EFI_ABORTED)
+			pipeline_report();
+		return;
+	}
+	if (ret != EFI_UNSUPPORTED) {
+		FreePool(label);
+		fastboot_flash_fail(ret);
+		return;
+	}
+
+	perf_flash_start(label);
+	ret = flash(dlbuffer, dlsize, label);
+	perf_flash_end();
+	FreePool(label);
+	if (EFI_ERROR(ret)) {
+		fastboot_flash_fail(ret);
+		return;
+	}
+
+	gpt_sync();
+
+	ui_print(L"Flash done.");
+	fastboot_okay("");
+}
+
+static void cmd_erase(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	CHAR16 *label;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	label = bump_stra_to_str((CHAR8*)argv[1]);
+	if (!label) {
+		error(L"Failed to get label %a", argv[1]);
+		fastboot_fail("Allocation error");
+		return;
+	}
+	ui_print(L"Erasing %s ...", label);
+
+	ret = pipeline_erase(label);
+	if (!EFI_ERROR(ret)) {
+		ui_print(L"Erase of %s queued.", label);
+		bump_free(label);
+		fastboot_okay("");
+		return;
+	}
+	if (ret == EFI_ABORTED || (ret == EFI_UNSUPPORTED && !pipeline_wait())) {
+		bump_free(label);
+		if (ret == EFI_ABORTED)
+			pipeline_report();
+		return;
+	}
+
+	if (ret == EFI_UNSUPPORTED)
+		ret = erase_by_label(label);
+	bump_free(label);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Erase failure: %r", ret);
+		return;
+	}
+
+	ui_print(L"Erase done.");
+	fastboot_okay("");
+}
+
+/* A sparse boot image is expanded straight into the buffer handed
+   to the loader, instead of the copy fastboot_stop() would make, and
+   hashed in the same pass.  */
+struct sparse_boot {
+	VOID *image;
+	UINT64 size;		/* sparse_expanded_size() */
+	UINT64 imgsize;		/* 0 if the image is not hashed */
+	UINT64 hashed;
+	BOOLEAN checked;
+};
+
+static void sparse_boot_hash(void *data, UINTN size, void *ctx)
+{
+	struct sparse_boot *sb = ctx;
+	UINT64 len;
+
+	if (!sb->checked) {
+		sb->checked = TRUE;
+		if (data != sb->image || size < sizeof(struct boot_img_hdr) ||
+		    !dlhash_header_valid(data, sb->size) ||
+		    EFI_ERROR(bootimage_hash_start_sha256(data)))
+			return;
+		sb->imgsize = bootimage_size(data);
+	}
+
+	if (!sb->imgsize || sb->hashed >= sb->imgsize)
+		return;
+
+	/* Areas are contiguous: a DONT_CARE gap before the end of the
+	   boot image is reported as zeroes too.  */
+	len = (UINT8 *)data + size - ((UINT8 *)sb->image + sb->hashed);
+	len = min(len, sb->imgsize - sb->hashed);
+	bootimage_hash_update((UINT8 *)sb->image + sb->hashed, len);
+	sb->hashed += len;
+	if (sb->hashed == sb->imgsize)
+		bootimage_hash_end();
+}
+
+static void cmd_boot_sparse(void)
+{
+	struct sparse_boot sb = { .imgsize = 0 };
+	UINT64 size;
+	EFI_STATUS ret;
+
+	ret = sparse_expanded_size(dlbuffer, dlsize, &size);
+	if (EFI_ERROR(ret) || !size || size > (UINTN)-1) {
+		fastboot_fail("Invalid sparse boot image: %r",
+			      EFI_ERROR(ret) ? ret : EFI_BAD_BUFFER_SIZE);
+		return;
+	}
+
+	sb.size = size;
+	sb.image = AllocatePool(size);
+	if (!sb.image) {
+		fastboot_fail("Failed to allocate image buffer");
+		return;
+	}
+
+	dlhash_reset();
+	ret = sparse_expand(dlbuffer, dlsize, sb.image, size,
+			    sparse_boot_hash, &sb);
+	if (sb.imgsize && sb.hashed != sb.imgsize)
+		bootimage_hash_abort();
+	if (EFI_ERROR(ret)) {
+		FreePool(sb.image);
+		fastboot_fail("Invalid sparse boot image: %r", ret);
+		return;
+	}
+
+	fastboot_imagesize = size;
+	fastboot_target = UNKNOWN_TARGET;
+	fastboot_bootimage = sb.image;
+	fastboot_efiimage = NULL;
+	fastboot_stop_session();
+
+	ui_print(L"Booting received sparse image ...");
+	fastboot_okay("");
+}
+
+static void cmd_boot(__attribute__((__unused__)) INTN argc,
 		     __attribute__((__unused__)) CHAR8 **argv)
 {
 	EFI_STATUS ret;
 
+	if (is_sparse_image(dlbuffer, dlsize)) {
+		cmd_boot_sparse();
+		return;
+	}
+
 	ret = fastboot_stop(dlbuffer, NULL, dlsize, UNKNOWN_TARGET);
 	if (EFI_ERROR(ret)) {
 		fastboot_fail("Failed to stop transport");
@@ -641,171 +1398,645 @@ static char *fastboot_var_value(struct fastboot_var *var)
 	return value;
 }
 
-static void cmd_getvar(INTN argc, CHAR8 **argv)
+static void cmd_getvar(INTN argc, CHAR8 **argv)
+{
+	struct fastboot_var *var;
+	char *value;
+	UINTN i;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (!strcmp(argv[1], (CHAR8 *)"all")) {
+		for (i = 0; i < vartable.count; i++) {
+			var = &vartable.vars[i];
+			fastboot_info("%a: %a", var->name, fastboot_var_value(var));
+		}
+		info_all_part_vars();
+		fastboot_okay("");
+		return;
+	}
+
+	/* Pipelined flash failures are reported before.  */
+	if (!strcmp(argv[1], (CHAR8 *)FLASH_STATUS_VAR)) {
+		fastboot_okay("ok");
+		return;
+	}
+
+	var = fastboot_getvar((char *)argv[1]);
+	if (var)
+		value = fastboot_var_value(var);
+	else {
+		value = prefix_var_value((char *)argv[1]);
+		if (!value)
+			value = part_var_value((char *)argv[1]);
+	}
+	fastboot_okay("%a", value ? value : "");
+}
+
+void fastboot_reboot(enum boot_target target, CHAR16 *msg)
+{
+	EFI_STATUS ret = fastboot_stop(NULL, NULL, 0, target);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to stop transport");
+		return;
+	}
+	ui_print(msg);
+	fastboot_okay("");
+}
+
+static void cmd_continue(__attribute__((__unused__)) INTN argc,
+			 __attribute__((__unused__)) CHAR8 **argv)
+{
+	fastboot_reboot(NORMAL_BOOT, L"Continuing ...");
+}
+
+static void cmd_reboot(__attribute__((__unused__)) INTN argc,
+		       __attribute__((__unused__)) CHAR8 **argv)
+{
+	fastboot_reboot(NORMAL_BOOT, L"Rebooting ...");
+}
+
+static void cmd_reboot_bootloader(__attribute__((__unused__)) INTN argc,
+				  __attribute__((__unused__)) CHAR8 **argv)
+{
+	fastboot_reboot(FASTBOOT, L"Rebooting to bootloader ...");
+}
+
+static struct fastboot_cmd *get_cmd(cmdlist_t list, const char *name)
+{
+	if (!name || !list || !list->size)
+		return NULL;
+
+	return *cmd_slot(list, name);
+}
+
+struct fastboot_cmd *fastboot_get_root_cmd(const char *name)
+{
+	return get_cmd(cmdlist, name);
+}
+
+void fastboot_run_cmd(cmdlist_t list, const char *name, INTN argc, CHAR8 **argv)
+{
+	struct fastboot_cmd *cmd;
+
+	cmd = get_cmd(list, name);
+	if (!cmd) {
+		error(L"unknown command '%a'", name);
+		fastboot_fail("unknown command");
+		return;
+	}
+
+	if (cmd->min_state > get_current_state()) {
+		fastboot_fail("command not allowed in %a state",
+			      get_current_state_string());
+		return;
+	}
+	cmd->handle(argc, argv);
+}
+
+void fastboot_run_root_cmd(const char *name, INTN argc, CHAR8 **argv)
+{
+	fastboot_run_cmd(cmdlist, name, argc, argv);
+}
+
+static void fastboot_read_command(void)
+{
+	transport_read(command_buffer, command_buffer_size);
+}
+
+static void dlbuffer_free(void)
+{
+	android_image_unplace(dlbuffer, FALSE);
+	if (dlbuffer && !arena_contains(dlbuffer))
+		memstat_free_pool(MEMSTAT_DOWNLOAD, dlbuffer, bufsize);
+	dlbuffer = NULL;
+	bufsize = 0;
+}
+
+/* Downloads are received in the arena when it is large enough, a pool
+   buffer is only used for the larger images.  */
+static EFI_STATUS dlbuffer_alloc(UINTN size)
+{
+	VOID *buffer;
+
+	/* The arena may still hold an image being flashed.  */
+	buffer = pipeline_holds_arena() ? NULL : arena_download_buffer(size);
+	if (buffer) {
+		if (buffer != dlbuffer)
+			dlbuffer_free();
+		dlbuffer = buffer;
+		bufsize = size;
+		return EFI_SUCCESS;
+	}
+
+	if (dlbuffer && !arena_contains(dlbuffer) && size <= bufsize)
+		return EFI_SUCCESS;
+
+	dlbuffer_free();
+	dlbuffer = memstat_pool(MEMSTAT_DOWNLOAD, size);
+	if (!dlbuffer && pipeline.count) {
+		/* The queued flashes hold their image and the arena, a
+		   failure is reported by the next command.  */
+		pipeline_sync();
+		return dlbuffer_alloc(size);
+	}
+	if (!dlbuffer)
+		return EFI_OUT_OF_RESOURCES;
+	bufsize = size;
+
+	return EFI_SUCCESS;
+}
+
+static void send_data_response(unsigned size)
+{
+	static CHAR8 response[MAGIC_LENGTH];
+	EFI_STATUS ret;
+	int len;
+
+	len = snprintf(response, sizeof(response), (CHAR8 *)"DATA%08x", size);
+	if (len < 0) {
+		error(L"Failed to format DATA response");
+		fastboot_fail("Failed to format DATA response");
+		return;
+	}
+
+	fastboot_state = STATE_START_DOWNLOAD;
+	perf_download_start(size);
+	ret = transport_write(response, strlen((CHAR8 *)response));
+	if (EFI_ERROR(ret)) {
+		fastboot_state = STATE_ERROR;
+		return;
+	}
+}
+
+static void dlhash_reset(void)
+{
+	if (dlhash.imgsize)
+		bootimage_hash_abort();
+	dlhash.imgsize = dlhash.hashed = 0;
+	dlhash.checked = FALSE;
+}
+
+static BOOLEAN dlhash_header_valid(struct boot_img_hdr *hdr, UINT64 size)
+{
+	return !memcmp(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) &&
+		hdr->page_size >= 2048 &&
+		!(hdr->page_size & (hdr->page_size - 1)) &&
+		bootimage_size(hdr) <= size;
+}
+
+static void dlhash_update(void)
+{
+	struct boot_img_hdr *hdr = dlbuffer;
+	unsigned end;
+	UINTN len;
+	VOID *data;
+
+	if (!dlhash.imgsize) {
+		if (dlhash.checked || received_len < sizeof(*hdr))
+			return;
+		dlhash.checked = TRUE;
+		if (!dlhash_header_valid(hdr, dlsize) ||
+		    EFI_ERROR(bootimage_hash_start_sha256(dlbuffer)))
+			return;
+		dlhash.imgsize = bootimage_size(hdr);
+	}
+
+	end = min(received_len, dlhash.imgsize);
+	if (end <= dlhash.hashed)
+		return;
+
+	while (dlhash.hashed < end) {
+		len = end - dlhash.hashed;
+		data = android_image_locate(dlbuffer, dlhash.hashed, &len);
+		bootimage_hash_update(data, len);
+		dlhash.hashed += len;
+	}
+	if (dlhash.hashed == dlhash.imgsize)
+		bootimage_hash_end();
+}
+
+/* The placement bounds the reads at the header, setup and kernel
+   boundaries, which are not aligned: it needs a transport accepting
+   any read length.  */
+static void dlplace_start(void)
+{
+	android_image_unplace(dlbuffer, FALSE);
+	dlplace_need = 0;
+	if (!stream_active && get_current_state() != LOCKED &&
+	    transport_read_granularity() == 1 &&
+	    dlsize >= sizeof(struct boot_img_hdr))
+		dlplace_need = sizeof(struct boot_img_hdr);
+}
+
+static void dlplace_update(void)
+{
+	EFI_STATUS ret;
+	UINTN need;
+
+	if (!dlplace_need || received_len < dlplace_need)
+		return;
+
+	ret = android_image_place(dlbuffer, dlsize, received_len, &need);
+	dlplace_need = 0;
+	if (ret == EFI_NOT_READY && need > received_len && need <= dlsize)
+		dlplace_need = need;
+	else if (ret == EFI_SUCCESS)
+		log_debug(FASTBOOT, L"Receiving the boot image in place");
+}
+
+static void dlcheck_update(void)
+{
+	if (EFI_ERROR(dlcheck_status))
+		return;
+
+	/* A sparse image is never placed, its headers are read from
+	   the contiguous download buffer.  */
+	dlcheck_status = sparse_check_update(dlbuffer, received_len);
+	if (EFI_ERROR(dlcheck_status)) {
+		efi_perror(dlcheck_status, L"Refusing the sparse image at %d bytes",
+			   received_len);
+		dlhash_reset();
+		dlplace_need = 0;
+	}
+}
+
+/* Queue the next transfer of a non-streamed download.  */
+static EFI_STATUS dl_read(void)
+{
+	UINTN len = dlsize - received_len;
+	VOID *dest;
+
+	if (dlplace_need)
+		len = min(len, (UINTN)(dlplace_need - received_len));
+	dest = android_image_locate(dlbuffer, received_len, &len);
+	return transport_read(dest, len);
+}
+
+static UINT32 dl_crc32(unsigned size)
+{
+	UINT32 crc = 0;
+	UINTN offset, len;
+	VOID *data;
+
+	for (offset = 0; offset < size; offset += len) {
+		len = size - offset;
+		data = android_image_locate(dlbuffer, offset, &len);
+		crc = crc32_update(crc, data, len);
+	}
+
+	return crc;
+}
+
+static void cmd_download(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	UINTN newdlsize;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	newdlsize = strtoul((const char *)argv[1], NULL, 16);
+
+	ui_print(L"Receiving %d bytes ...", newdlsize);
+	if (newdlsize == 0) {
+		fastboot_fail("no data to download");
+		return;
+	} else if (newdlsize > (stream_label ? MAX_STREAM_SIZE : max_download_size)) {
+		fastboot_fail("data too large");
+		return;
+	}
+
+	if (stream_label) {
+		ret = ring_alloc();
+		if (EFI_ERROR(ret)) {
+			stream_disarm();
+			fastboot_fail("Memory allocation failure");
+			return;
+		}
+	} else {
+		ret = dlbuffer_alloc(newdlsize);
+		if (EFI_ERROR(ret)) {
+			error(L"Failed to allocate download buffer (0x%x bytes)",
+			      newdlsize);
+			fastboot_fail("Memory allocation failure");
+			dlsize = 0;
+			return;
+		}
+	}
+	dlsize = newdlsize;
+
+	if (stream_label) {
+		/* An operation queued since "flash" is done first.  */
+		pipeline_sync();
+		perf_flash_start(stream_label);
+		ret = flash_stream_start(stream_label);
+		if (EFI_ERROR(ret)) {
+			stream_disarm();
+			fastboot_fail("Flash failure: %r", ret);
+			return;
+		}
+		stream_status = EFI_SUCCESS;
+		stream_active = TRUE;
+	}
+
+	received_len = last_received_len = 0;
+	dlhash_reset();
+	dlplace_start();
+	dlcheck_status = EFI_SUCCESS;
+	sparse_check_start(dlsize);
+	resume.session++;
+	resume.interrupted = FALSE;
+	fastboot_ui_progress_start(dlsize, 0);
+	send_data_response(dlsize);
+}
+
+static void cmd_download_resume(INTN argc, CHAR8 **argv)
 {
-	struct fastboot_var *var;
 	if (argc != 2) {
 		fastboot_fail("Invalid parameter");
 		return;
 	}
 
-	if (!strcmp(argv[1], (CHAR8 *)"all")) {
-		for (var = varlist; var; var = var->next)
-			fastboot_info("%a: %a", var->name, fastboot_var_value(var));
-		fastboot_okay("");
+	if (!resume.interrupted || !dlbuffer ||
+	    strtoul((const char *)argv[1], NULL, 10) != resume.session) {
+		fastboot_fail("No such download to resume");
 		return;
 	}
 
-	var = fastboot_getvar((char *)argv[1]);
-	fastboot_okay("%a", var ? fastboot_var_value(var) : "");
+	ui_print(L"Resuming download at %d bytes ...", received_len);
+	resume.interrupted = FALSE;
+	fastboot_ui_progress_start(dlsize, received_len);
+	send_data_response(dlsize - received_len);
 }
 
-void fastboot_reboot(enum boot_target target, CHAR16 *msg)
+/* "<session>:<received>:<size>:<crc32 of the received data>" of the
+   download that can be resumed.  */
+static char *get_download_resume_var(void)
 {
-	EFI_STATUS ret = fastboot_stop(NULL, NULL, 0, target);
-	if (EFI_ERROR(ret)) {
-		fastboot_fail("Failed to stop transport");
-		return;
-	}
-	ui_print(msg);
-	fastboot_okay("");
-}
+	static char value[MAGIC_LENGTH];
+	int len;
 
-static void cmd_continue(__attribute__((__unused__)) INTN argc,
-			 __attribute__((__unused__)) CHAR8 **argv)
-{
-	fastboot_reboot(NORMAL_BOOT, L"Continuing ...");
-}
+	if (!resume.interrupted)
+		return "";
 
-static void cmd_reboot(__attribute__((__unused__)) INTN argc,
-		       __attribute__((__unused__)) CHAR8 **argv)
-{
-	fastboot_reboot(NORMAL_BOOT, L"Rebooting ...");
+	len = snprintf((CHAR8 *)value, sizeof(value),
+		       (CHAR8 *)"%d:0x%x:0x%x:0x%08x", resume.session,
+		       received_len, dlsize,
+		       dl_crc32(received_len));
+	if (len < 0 || len >= (int)sizeof(value))
+		return "";
+
+	return value;
 }
 
-static void cmd_reboot_bootloader(__attribute__((__unused__)) INTN argc,
-				  __attribute__((__unused__)) CHAR8 **argv)
+static EFI_STATUS ring_read(void)
 {
-	fastboot_reboot(FASTBOOT, L"Rebooting to bootloader ...");
+	ring.fill = 0;
+	ring.request = min((UINTN)STREAM_SLOT_SIZE, (UINTN)(dlsize - received_len));
+	return transport_read(ring_slot(ring.slot), ring.request);
 }
 
-static struct fastboot_cmd *get_cmd(cmdlist_t list, const char *name)
+static void worker_download(void)
 {
-	cmdlist_t node;
+	EFI_STATUS ret;
 
-	if (!name || !list)
-		return NULL;
+	if (stream_active) {
+		ring.slot = 0;
+		ret = ring_read();
+	} else
+		ret = dl_read();
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to receive %d bytes", dlsize);
+		fastboot_ui_progress_stop();
+		fastboot_fail("Transport receive failed");
+		return;
+	}
+	fastboot_state = STATE_DOWNLOAD;
+}
 
-	for (node = list; node; node = node->next)
-		if (!strcmp((CHAR8 *)name, (CHAR8 *)node->cmd->name))
-			return node->cmd;
+/* Data staged by a command for the host to fetch with the upload
+   command, sent in a single data phase.  */
+static struct {
+	void *data;
+	UINTN size;
+} staged;
 
-	return NULL;
+void fastboot_stage(void *data, UINTN size)
+{
+	if (staged.data)
+		FreePool(staged.data);
+	if (data && !size) {
+		FreePool(data);
+		data = NULL;
+	}
+	staged.data = data;
+	staged.size = data ? size : 0;
 }
 
-struct fastboot_cmd *fastboot_get_root_cmd(const char *name)
+static void staged_free(void)
 {
-	return get_cmd(cmdlist, name);
+	fastboot_stage(NULL, 0);
 }
 
-void fastboot_run_cmd(cmdlist_t list, const char *name, INTN argc, CHAR8 **argv)
+static void start_upload(void)
 {
-	struct fastboot_cmd *cmd;
+	static CHAR8 response[MAGIC_LENGTH];
+	EFI_STATUS ret;
 
-	cmd = get_cmd(list, name);
-	if (!cmd) {
-		error(L"unknown command '%a'", name);
-		fastboot_fail("unknown command");
+	if (!staged.data) {
+		fastboot_fail("No data staged");
 		return;
 	}
 
-	if (cmd->min_state > get_current_state()) {
-		fastboot_fail("command not allowed in %a state",
-			      get_current_state_string());
+	if (staged.size > 0xFFFFFFFF) {
+		staged_free();
+		fastboot_fail("Staged data too large");
 		return;
 	}
-	cmd->handle(argc, argv);
+
+	snprintf(response, sizeof(response), (CHAR8 *)"DATA%08x",
+		 (UINT32)staged.size);
+
+	fastboot_state = STATE_UPLOAD;
+	ret = transport_write(response, strlen((CHAR8 *)response));
+	if (EFI_ERROR(ret))
+		fastboot_state = STATE_ERROR;
 }
 
-void fastboot_run_root_cmd(const char *name, INTN argc, CHAR8 **argv)
+static void cmd_upload(INTN argc, __attribute__((__unused__)) CHAR8 **argv)
 {
-	fastboot_run_cmd(cmdlist, name, argc, argv);
+	if (argc != 1) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	start_upload();
 }
 
-static void fastboot_read_command(void)
+/* "fetch:<label>[:<offset>:<size>]" sends the partition, or a range
+   of it, as a sparse image built in memory.  Blocks holding a
+   repeated pattern become FILL chunks and the part before OFFSET a
+   DONT_CARE chunk so that the image can be flashed back as is.  */
+#define FETCH_READ_SIZE (1024 * 1024)
+#define FETCH_BLOCK_SIZE 4096
+
+static EFI_STATUS fetch_partition(struct gpt_partition_interface *gparti,
+				  UINT64 offset, UINT64 length,
+				  void **image, UINTN *image_size)
 {
-	transport_read(command_buffer, command_buffer_size);
+	EFI_STATUS ret;
+	struct sparse_encoder enc;
+	UINT32 blk_sz = FETCH_BLOCK_SIZE;
+	UINT64 part_offset, done, max;
+	UINTN size, len;
+	void *buf, *out;
+
+	if ((offset | length) % blk_sz)
+		blk_sz = gparti->bio->Media->BlockSize;
+	if ((offset | length) % blk_sz)
+		return EFI_INVALID_PARAMETER;
+
+	max = sizeof(struct sparse_header) + length +
+		(length / blk_sz + 2) * (sizeof(struct chunk_header) + sizeof(UINT32));
+	size = min(max, (UINT64)MAX_DOWNLOAD_SIZE);
+
+	out = AllocatePool(size);
+	if (!out)
+		return EFI_OUT_OF_RESOURCES;
+
+	buf = AllocatePool(FETCH_READ_SIZE);
+	if (!buf) {
+		FreePool(out);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	ret = sparse_encode_start(&enc, out, size, blk_sz);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	ret = sparse_encode_skip(&enc, offset / blk_sz);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	part_offset = gparti->part.starting_lba * gparti->bio->Media->BlockSize;
+	for (done = 0; done < length; done += len) {
+		len = min(length - done, (UINT64)FETCH_READ_SIZE);
+		ret = uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio,
+					gparti->bio->Media->MediaId,
+					part_offset + offset + done, len, buf);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to read the partition");
+			goto out;
+		}
+
+		ret = sparse_encode_data(&enc, buf, len);
+		if (EFI_ERROR(ret))
+			goto out;
+	}
+
+	*image = out;
+	*image_size = sparse_encode_end(&enc);
+
+out:
+	FreePool(buf);
+	if (EFI_ERROR(ret))
+		FreePool(out);
+	return ret;
 }
 
-static void cmd_download(INTN argc, CHAR8 **argv)
+static void cmd_fetch(INTN argc, CHAR8 **argv)
 {
-	static CHAR8 response[MAGIC_LENGTH];
 	EFI_STATUS ret;
-	int len;
-	UINTN newdlsize;
+	struct gpt_partition_interface gparti;
+	char *name, *arg, *endptr, *saveptr;
+	UINT64 offset = 0, length, part_len;
+	CHAR16 *label;
+	void *image;
+	UINTN size;
 
 	if (argc != 2) {
 		fastboot_fail("Invalid parameter");
 		return;
 	}
 
-	newdlsize = strtoul((const char *)argv[1], NULL, 16);
-
-	ui_print(L"Receiving %d bytes ...", newdlsize);
-	if (newdlsize == 0) {
-		fastboot_fail("no data to download");
+	name = strtok_r((char *)argv[1], ":", &saveptr);
+	label = name ? bump_stra_to_str((CHAR8 *)name) : NULL;
+	if (!label) {
+		fastboot_fail("Invalid partition");
 		return;
-	} else if (newdlsize > MAX_DOWNLOAD_SIZE) {
-		fastboot_fail("data too large");
+	}
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	bump_free(label);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Cannot access partition '%a'", name);
 		return;
 	}
 
-	if (newdlsize > bufsize) {
-		if (dlbuffer)
-			FreePool(dlbuffer);
-		dlbuffer = AllocatePool(newdlsize);
-		if (!dlbuffer) {
-			error(L"Failed to allocate download buffer (0x%x bytes)",
-			      newdlsize);
-			fastboot_fail("Memory allocation failure");
-			dlsize = bufsize = 0;
+	part_len = (gparti.part.ending_lba + 1 - gparti.part.starting_lba) *
+		gparti.bio->Media->BlockSize;
+	length = part_len;
+
+	arg = strtok_r(NULL, ":", &saveptr);
+	if (arg) {
+		offset = strtoul(arg, &endptr, 16);
+		arg = strtok_r(NULL, ":", &saveptr);
+		if (*endptr != '\0' || !arg) {
+			fastboot_fail("Invalid range");
+			return;
+		}
+		length = strtoul(arg, &endptr, 16);
+		if (*endptr != '\0' || !length || offset >= part_len ||
+		    length > part_len - offset) {
+			fastboot_fail("Invalid range");
 			return;
 		}
-		bufsize = newdlsize;
 	}
-	dlsize = newdlsize;
 
-	len = snprintf(response, sizeof(response), (CHAR8 *)"DATA%08x", dlsize);
-	if (len < 0) {
-		error(L"Failed to format DATA response");
-		fastboot_fail("Failed to format DATA response");
+	ui_print(L"Fetching %a ...", name);
+	ret = fetch_partition(&gparti, offset, length, &image, &size);
+	if (ret == EFI_BUFFER_TOO_SMALL) {
+		fastboot_fail("Too much data, fetch a smaller range");
 		return;
 	}
-
-	fastboot_state = STATE_START_DOWNLOAD;
-	ret = transport_write(response, strlen((CHAR8 *)response));
 	if (EFI_ERROR(ret)) {
-		fastboot_state = STATE_ERROR;
+		fastboot_fail("Fetch failure: %r", ret);
 		return;
 	}
+
+	fastboot_stage(image, size);
+	start_upload();
 }
 
-static void worker_download(void)
+static void upload_data(void)
 {
 	EFI_STATUS ret;
 
-	ret = transport_read(dlbuffer, dlsize);
+	fastboot_state = STATE_UPLOAD_DATA;
+	ret = transport_write(staged.data, staged.size);
 	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to receive %d bytes", dlsize);
-		fastboot_fail("Transport receive failed");
-		return;
+		efi_perror(ret, L"Failed to send the staged data");
+		fastboot_state = STATE_ERROR;
 	}
-	fastboot_state = STATE_DOWNLOAD;
 }
 
 static void fastboot_process_tx(__attribute__((__unused__)) void *buf,
 				__attribute__((__unused__)) unsigned len)
 {
+	/* Only the completion of the last queued response moves the
+	   state machine.  */
+	if (tx_inflight) {
+		tx_inflight--;
+		if (tx_inflight && fastboot_state != STATE_TX)
+			return;
+	}
+
 	switch (fastboot_state) {
 	case STATE_STOPPING:
 		fastboot_state = STATE_STOPPED;
@@ -819,6 +2050,13 @@ static void fastboot_process_tx(__attribute__((__unused__)) void *buf,
 	case STATE_START_DOWNLOAD:
 		worker_download();
 		break;
+	case STATE_UPLOAD:
+		upload_data();
+		break;
+	case STATE_UPLOAD_DATA:
+		staged_free();
+		fastboot_okay("");
+		break;
 	default:
 		error(L"Unexpected tx event while in state %d", fastboot_state);
 		break;
@@ -846,8 +2084,6 @@ static EFI_STATUS get_command_buffer_argv(INTN *argc, CHAR8 *argv[], UINTN max_a
 	return EFI_SUCCESS;
 }
 
-static unsigned received_len;
-static unsigned last_received_len;
 #define DATA_PROGRESS_THRESHOLD (5 * 1024 * 1024)
 static void fastboot_run_command()
 {
@@ -855,43 +2091,150 @@ static void fastboot_run_command()
 	EFI_STATUS ret;
 	CHAR8 *argv[MAX_ARGS];
 	INTN argc;
+	UINT64 name = 0;
+	UINTN len, mark;
 
 	if (fastboot_state != STATE_COMMAND)
 		return;
 
+	/* The short-lived allocations of a command are released once it
+	   is done.  */
+	mark = bump_mark();
+
+	len = strlen((CHAR8 *)command_buffer);
+	memcpy(&name, command_buffer, min(len, sizeof(name)));
+	trace(TRACE_FASTBOOT_CMD, len, name);
+	perf_cmd_start((CHAR8 *)command_buffer);
+
 	ret = get_command_buffer_argv(&argc, argv, MAX_ARGS);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to split fastboot command line");
 		return;
 	}
 
-	fastboot_run_root_cmd((char *)argv[0], argc, argv);
-	received_len = 0;
-	last_received_len = 0;
+	/* Any other command may modify the download buffer.  */
+	if (strcmp(argv[0], (CHAR8 *)"boot") &&
+	    strcmp(argv[0], (CHAR8 *)"download-resume")) {
+		dlhash_reset();
+		android_image_unplace(dlbuffer,
+				      strcmp(argv[0], (CHAR8 *)"download") != 0);
+	}
+
+	if (!pipeline_overlaps(argc, argv))
+		pipeline_sync();
+	if (pipeline_failed())
+		pipeline_report();
+	else
+		fastboot_run_root_cmd((char *)argv[0], argc, argv);
+	bump_release(mark);
 
 	if (fastboot_state == STATE_TX)
 		flush_tx_buffer();
+
+	/* The errors of the command are saved once it is done.  */
+	log_persist();
 }
 
-static void fastboot_process_rx(void *buf, unsigned len)
+static void stream_write(void *buf, unsigned len)
+{
+	if (EFI_ERROR(stream_status))
+		return;
+
+	stream_status = flash_stream_write(buf, len);
+	if (EFI_ERROR(stream_status))
+		efi_perror(stream_status, L"Failed to write streamed data at 0x%x",
+			   received_len - len);
+}
+
+static void stream_complete(void)
+{
+	EFI_STATUS ret;
+
+	ret = flash_stream_end();
+	perf_flash_end();
+	if (!EFI_ERROR(stream_status))
+		stream_status = ret;
+	stream_disarm();
+	/* The download buffer does not hold the streamed image.  */
+	dlsize = 0;
+
+	if (EFI_ERROR(stream_status)) {
+		fastboot_flash_fail(stream_status);
+		return;
+	}
+
+	gpt_sync();
+	ui_print(L"Flash done.");
+	fastboot_okay("");
+}
+
+static void stream_process_rx(unsigned len)
 {
-	CHAR8 *s;
+	EFI_STATUS ret;
+	UINTN slot;
+
+	ring.fill += len;
+	if (received_len == dlsize) {
+		perf_download_end();
+		fastboot_state = STATE_COMMAND;
+		stream_write(ring_slot(ring.slot), ring.fill);
+		stream_complete();
+		return;
+	}
+
+	/* Partial transfer, keep filling the same slot.  */
+	if (ring.fill < ring.request) {
+		ret = transport_read(ring_slot(ring.slot) + ring.fill,
+				     ring.request - ring.fill);
+		goto out;
+	}
+
+	/* The next transfer is queued, write this slot to the disk
+	   meanwhile.  */
+	slot = ring.slot;
+	ring.slot = (ring.slot + 1) % STREAM_RING_SLOTS;
+	ret = ring_read();
+	stream_write(ring_slot(slot), ring.request);
+
+out:
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to receive %d bytes", dlsize);
+		fastboot_state = STATE_ERROR;
+	}
+}
 
+static void fastboot_process_rx(void *buf, unsigned len)
+{
 	switch (fastboot_state) {
 	case STATE_DOWNLOAD:
 		received_len += len;
 		if (received_len / DATA_PROGRESS_THRESHOLD >
 		    last_received_len / DATA_PROGRESS_THRESHOLD) {
 			if (dlsize > MiB)
-				debug(L"\rRX %d MiB / %d MiB", received_len/MiB, dlsize / MiB);
+				log_verbose(FASTBOOT, L"\rRX %d MiB / %d MiB", received_len/MiB, dlsize / MiB);
 			else
-				debug(L"\rRX %d KiB / %d KiB", received_len/1024, dlsize / 1024);
+				log_verbose(FASTBOOT, L"\rRX %d KiB / %d KiB", received_len/1024, dlsize / 1024);
 		}
 		last_received_len = received_len;
+		fastboot_ui_progress_update(received_len);
+		if (received_len >= dlsize)
+			fastboot_ui_progress_stop();
+		if (stream_active) {
+			stream_process_rx(len);
+			break;
+		}
+		dlcheck_update();
+		dlplace_update();
+		dlhash_update();
 		if (received_len < dlsize) {
-			s = buf;
-			transport_read(&s[len], dlsize - received_len);
+			dl_read();
+		} else if (EFI_ERROR(dlcheck_status)) {
+			/* Nothing to flash from this download.  */
+			dlsize = 0;
+			fastboot_state = STATE_COMMAND;
+			fastboot_fail("Invalid sparse image: %r", dlcheck_status);
 		} else {
+			perf_download_end();
 			fastboot_state = STATE_COMMAND;
 			fastboot_okay("");
 		}
@@ -903,7 +2246,7 @@ static void fastboot_process_rx(void *buf, unsigned len)
 		}
 
 		((CHAR8 *)buf)[len] = '\0';
-		debug(L"GOT %a", (CHAR8 *)buf);
+		log_debug(FASTBOOT, L"GOT %a", (CHAR8 *)buf);
 
 		fastboot_state = STATE_COMMAND;
 		break;
@@ -914,12 +2257,23 @@ static void fastboot_process_rx(void *buf, unsigned len)
 
 static void fastboot_start_callback(void)
 {
+	/* The transport restarted in the middle of a download */
+	if ((fastboot_state == STATE_START_DOWNLOAD ||
+	     fastboot_state == STATE_DOWNLOAD) && !stream_label) {
+		debug(L"Download interrupted at %d bytes", received_len);
+		resume.interrupted = TRUE;
+		fastboot_ui_progress_stop();
+	}
+
 	fastboot_state = next_state;
 	fastboot_read_command();
 }
 
 static struct fastboot_cmd COMMANDS[] = {
 	{ "download",		LOCKED,		cmd_download },
+	{ "download-resume",	LOCKED,		cmd_download_resume },
+	{ "upload",		LOCKED,		cmd_upload },
+	{ "fetch",		UNLOCKED,	cmd_fetch },
 	{ "flash",		LOCKED,		cmd_flash },
 	{ "erase",		UNLOCKED,	cmd_erase },
 	{ "getvar",		LOCKED,		cmd_getvar },
@@ -929,6 +2283,34 @@ static struct fastboot_cmd COMMANDS[] = {
 	{ "reboot-bootloader",	LOCKED,		cmd_reboot_bootloader }
 };
 
+/* Computed once the arena is reserved: larger downloads use the
+   pool, which must keep DOWNLOAD_MEMORY_RESERVE for the other
+   allocations.  */
+static UINTN get_max_download_size(void)
+{
+	UINT64 size = largest_free_range();
+
+	if (!size)
+		return MAX_DOWNLOAD_SIZE;
+
+	size = size > DOWNLOAD_MEMORY_RESERVE ? size - DOWNLOAD_MEMORY_RESERVE : 0;
+	size = max(size, (UINT64)arena_download_size());
+	size = min(size, (UINT64)DOWNLOAD_SIZE_LIMIT);
+
+	return size & ~((UINT64)EFI_PAGE_SIZE - 1);
+}
+
+static char *get_max_download_size_var(void)
+{
+	static char value[30];
+
+	if (snprintf((CHAR8 *)value, sizeof(value), (CHAR8 *)"0x%lX",
+		     max_download_size) < 0)
+		return NULL;
+
+	return value;
+}
+
 static EFI_STATUS fastboot_init()
 {
 	EFI_STATUS ret;
@@ -936,6 +2318,9 @@ static EFI_STATUS fastboot_init()
 	char download_max_str[30];
 	static char default_command_buffer[MAGIC_LENGTH];
 
+	tx_inflight = 0;
+	tx_next_slot = 0;
+
 	ret = fastboot_set_command_buffer(default_command_buffer,
 					  sizeof(default_command_buffer));
 	if (EFI_ERROR(ret)) {
@@ -949,6 +2334,12 @@ static EFI_STATUS fastboot_init()
 		/* Might as well continue even though this failed ... */
 	}
 
+	ret = arena_init();
+	if (EFI_ERROR(ret))
+		debug(L"No download arena, downloads use the pool");
+	max_download_size = get_max_download_size();
+	debug(L"Maximum download size: %ld MiB", max_download_size / (1024 * 1024));
+
 	ret = fastboot_publish("product", info_product());
 	if (EFI_ERROR(ret))
 		goto error;
@@ -963,25 +2354,33 @@ static EFI_STATUS fastboot_init()
 	if (EFI_ERROR(ret))
 		goto error;
 
+	ret = perf_publish();
+	if (EFI_ERROR(ret))
+		goto error;
+
+	ret = fastboot_publish_dynamic("download-resume", get_download_resume_var);
+	if (EFI_ERROR(ret))
+		goto error;
+
 	ret = fastboot_publish_dynamic("battery-voltage", get_battery_voltage_var);
 	if (EFI_ERROR(ret))
 		goto error;
 
+	ret = fastboot_publish_dynamic("max-download-size", get_max_download_size_var);
+	if (EFI_ERROR(ret))
+		goto error;
+
 	if (snprintf((CHAR8 *)download_max_str, sizeof(download_max_str),
-		     (CHAR8 *)"0x%lX", MAX_DOWNLOAD_SIZE) < 0) {
+		     (CHAR8 *)"0x%lX", MAX_STREAM_SIZE) < 0) {
 		error(L"Failed to set download_max_str string");
 		ret = EFI_INVALID_PARAMETER;
 		goto error;
 	} else {
-		ret = fastboot_publish("max-download-size", download_max_str);
+		ret = fastboot_publish("max-stream-size", download_max_str);
 		if (EFI_ERROR(ret))
 			goto error;
 	}
 
-	ret = publish_partsize();
-	if (EFI_ERROR(ret))
-		goto error;
-
 	/* Register commands */
 	for (i = 0; i < ARRAY_SIZE(COMMANDS); i++) {
 		ret = fastboot_register(&COMMANDS[i]);
@@ -1011,10 +2410,64 @@ error:
 	return ret;
 }
 
-static void *fastboot_bootimage;
-static void *fastboot_efiimage;
-static UINTN fastboot_imagesize;
-static enum boot_target fastboot_target;
+/* While no command is being processed, the main loop sleeps until
+   the transport, the keyboard or the idle timer wakes it up.  The
+   idle timer bounds the sleep for the transports and UI updates
+   which can only be polled.  */
+#define IDLE_PERIOD_MS 100
+#define MAX_WAIT_EVENTS 6
+
+static EFI_EVENT idle_timer;
+
+static void idle_start(void)
+{
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0, NULL, NULL,
+				&idle_timer);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create the idle timer, polling");
+		idle_timer = NULL;
+		return;
+	}
+
+	ret = uefi_call_wrapper(BS->SetTimer, 3, idle_timer, TimerPeriodic,
+				IDLE_PERIOD_MS * 10000);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to set the idle timer, polling");
+		uefi_call_wrapper(BS->CloseEvent, 1, idle_timer);
+		idle_timer = NULL;
+	}
+}
+
+static void idle_stop(void)
+{
+	if (!idle_timer)
+		return;
+
+	uefi_call_wrapper(BS->CloseEvent, 1, idle_timer);
+	idle_timer = NULL;
+}
+
+static void idle_wait(void)
+{
+	EFI_EVENT events[MAX_WAIT_EVENTS];
+	UINTN count, index;
+
+	if (!idle_timer || pipeline.count ||
+	    (fastboot_state != STATE_OFFLINE && fastboot_state != STATE_COMPLETE))
+		return;
+
+	count = transport_events(events, MAX_WAIT_EVENTS - 2);
+	if (!count)
+		return;
+
+	events[count++] = idle_timer;
+	if (ST->ConIn)
+		events[count++] = ST->ConIn->WaitForKey;
+
+	uefi_call_wrapper(BS->WaitForEvent, 3, count, events, &index);
+}
 
 EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 			  enum boot_target *target)
@@ -1029,8 +2482,18 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 	fastboot_target = UNKNOWN_TARGET;
 	*target = UNKNOWN_TARGET;
 
+	timestamp_record("fastboot_start");
 	fastboot_init();
 
+	ret = trace_init();
+	if (EFI_ERROR(ret))
+		debug(L"Tracing not available: %r", ret);
+
+	/* Flashing logs a lot, do not wait for the serial port.  */
+	ret = log_async_start();
+	if (EFI_ERROR(ret))
+		debug(L"Asynchronous logging not available: %r", ret);
+
 	/* In case user still holding it from answering a UX prompt
 	 * or magic key */
 	ui_wait_for_key_release();
@@ -1048,6 +2511,8 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 		efi_perror(ret, L"Failed to initialize transport layer");
 		goto exit;
 	}
+	timestamp_record("transport_start");
+	idle_start();
 
 	for (;;) {
 		*target = fastboot_ui_event_handler();
@@ -1068,8 +2533,12 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 
 		if (fastboot_state == STATE_STOPPED)
 			break;
+
+		pipeline_run();
+		idle_wait();
 	}
 
+	idle_stop();
 	ret = transport_stop();
 	if (EFI_ERROR(ret))
 		goto exit;
@@ -1082,7 +2551,10 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 	*imagesize = fastboot_imagesize;
 
 exit:
+	idle_stop();
 	fastboot_free();
+	log_persist();
+	log_async_stop();
 	return ret;
 }
 
@@ -1100,27 +2572,38 @@ EFI_STATUS fastboot_stop(void *bootimage, void *efiimage, UINTN imagesize,
 			error(L"Failed to allocate image buffer");
 			return EFI_OUT_OF_RESOURCES;
 		}
-		memcpy(imgbuffer, bootimage ? bootimage : efiimage, imagesize);
+		if (bootimage) {
+			android_image_move(bootimage, imgbuffer, imagesize);
+			bootimage_hash_move(bootimage, imgbuffer);
+		} else
+			memcpy(imgbuffer, efiimage, imagesize);
 	}
 
 	fastboot_bootimage = bootimage ? imgbuffer : NULL;
 	fastboot_efiimage = efiimage ? imgbuffer : NULL;
+	fastboot_stop_session();
+
+	return EFI_SUCCESS;
+}
 
+static void fastboot_stop_session(void)
+{
 	if (fastboot_state == STATE_COMPLETE)
 		fastboot_state = STATE_STOPPED;
 	else
 		next_state = STATE_STOPPING;
-
-	return EFI_SUCCESS;
 }
 
 void fastboot_free()
 {
-	if (dlbuffer) {
-		FreePool(dlbuffer);
-		dlbuffer = NULL;
-		bufsize = dlsize = 0;
-	}
+	pipeline_free();
+	dlbuffer_free();
+	dlsize = 0;
+	staged_free();
+	stream_disarm();
+	ring_free();
+	flash_free();
+	arena_release();
 
 	fastboot_unpublish_all();
 	fastboot_cmdlist_unregister(&cmdlist);
@@ -76,6 +76,8 @@ EFI_STATUS change_device_state(enum device_state new_state, BOOLEAN interactive)
 		}
 #endif
 		ui_print(L"Erasing userdata...");
+		/* The user data may have been written by other means */
+		flash_forget_erased(L"data");
 		ret = erase_by_label(L"data");
 		if (EFI_ERROR(ret) && ret != EFI_NOT_FOUND) {
 			if (interactive)
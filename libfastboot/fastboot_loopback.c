@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+#include <timer.h>
+#include <fastboot.h>
+#include <transport.h>
+
+#include "fastboot_loopback.h"
+
+#define TX_QUEUE_DEPTH	8
+#define PREFIX_LEN	4
+
+static struct {
+	CHAR8 *session;
+	UINTN size;
+	UINTN cur;		/* Current record */
+	UINTN consumed;		/* Bytes of the current record delivered */
+} replay;
+
+static struct {
+	data_callback_t rx_cb;
+	data_callback_t tx_cb;
+	BOOLEAN started;
+	BOOLEAN stopping;
+	void *rx_buf;
+	UINT32 rx_size;
+	struct {
+		void *buf;
+		UINT32 size;
+	} tx[TX_QUEUE_DEPTH];
+	UINTN tx_head;
+	UINTN tx_count;
+	UINT64 start;
+} loopback;
+
+static loopback_result_t result;
+
+static struct loopback_record *current_record(void)
+{
+	struct loopback_record *record;
+
+	if (replay.size - replay.cur < sizeof(*record))
+		return NULL;
+
+	record = (struct loopback_record *)(replay.session + replay.cur);
+	if (record->size > replay.size - replay.cur - sizeof(*record)) {
+		error(L"Truncated loopback record at offset %d", replay.cur);
+		return NULL;
+	}
+
+	return record;
+}
+
+static void next_record(void)
+{
+	replay.cur += sizeof(struct loopback_record) + current_record()->size;
+	replay.consumed = 0;
+}
+
+/* Compare a response with the expected one, INFO messages being only
+   compared when expected.  */
+static void check_response(CHAR8 *buf, UINT32 size)
+{
+	struct loopback_record *record = current_record();
+	CHAR8 *expected;
+
+	if (!record || record->type != LOOPBACK_DEVICE)
+		return;
+
+	if (size >= PREFIX_LEN && !memcmp(buf, "INFO", PREFIX_LEN) &&
+	    (record->size < PREFIX_LEN || memcmp(&record[1], "INFO", PREFIX_LEN)))
+		return;
+
+	expected = (CHAR8 *)&record[1];
+	if (size < record->size || memcmp(buf, expected, record->size)) {
+		error(L"Loopback: unexpected response '%a'", buf);
+		result.mismatches++;
+	}
+	next_record();
+}
+
+EFI_STATUS fastboot_loopback_set_session(VOID *session, UINTN size)
+{
+	if (!session || !size)
+		return EFI_INVALID_PARAMETER;
+
+	replay.session = session;
+	replay.size = size;
+	replay.cur = 0;
+	replay.consumed = 0;
+	ZeroMem(&result, sizeof(result));
+
+	return EFI_SUCCESS;
+}
+
+void fastboot_loopback_clear_session(void)
+{
+	ZeroMem(&replay, sizeof(replay));
+}
+
+BOOLEAN fastboot_loopback_enabled(void)
+{
+	return replay.session != NULL;
+}
+
+void fastboot_loopback_get_result(loopback_result_t *res)
+{
+	memcpy(res, &result, sizeof(*res));
+}
+
+static EFI_STATUS loopback_start(start_callback_t start_cb,
+				 data_callback_t rx_cb,
+				 data_callback_t tx_cb)
+{
+	if (!replay.session)
+		return EFI_UNSUPPORTED;
+
+	ZeroMem(&loopback, sizeof(loopback));
+	loopback.rx_cb = rx_cb;
+	loopback.tx_cb = tx_cb;
+	loopback.started = TRUE;
+	loopback.start = timer_ticks();
+
+	start_cb();
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS loopback_stop(void)
+{
+	if (!loopback.started)
+		return EFI_NOT_STARTED;
+
+	result.us = timer_ticks_to_us(timer_ticks() - loopback.start);
+	loopback.started = FALSE;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS loopback_read(void *buf, UINT32 size)
+{
+	if (loopback.rx_buf)
+		return EFI_NOT_READY;
+
+	loopback.rx_buf = buf;
+	loopback.rx_size = size;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS loopback_write(void *buf, UINT32 size)
+{
+	UINTN tail;
+
+	if (loopback.tx_count == TX_QUEUE_DEPTH)
+		return EFI_NOT_READY;
+
+	tail = (loopback.tx_head + loopback.tx_count) % TX_QUEUE_DEPTH;
+	loopback.tx[tail].buf = buf;
+	loopback.tx[tail].size = size;
+	loopback.tx_count++;
+	return EFI_SUCCESS;
+}
+
+/* Complete the queued writes, then the pending read with the next
+   piece of the session.  */
+static EFI_STATUS loopback_run(void)
+{
+	struct loopback_record *record;
+	void *buf;
+	UINT32 size;
+
+	if (!loopback.started)
+		return EFI_NOT_STARTED;
+
+	while (loopback.tx_count) {
+		buf = loopback.tx[loopback.tx_head].buf;
+		size = loopback.tx[loopback.tx_head].size;
+		loopback.tx_head = (loopback.tx_head + 1) % TX_QUEUE_DEPTH;
+		loopback.tx_count--;
+
+		check_response(buf, size);
+		result.tx_bytes += size;
+		loopback.tx_cb(buf, size);
+	}
+
+	if (!loopback.rx_buf || loopback.stopping)
+		return EFI_SUCCESS;
+
+	record = current_record();
+	if (record && record->type == LOOPBACK_DEVICE)
+		return EFI_SUCCESS;	/* Response still to come */
+
+	if (!record) {
+		result.complete = replay.cur == replay.size;
+		loopback.stopping = TRUE;
+		fastboot_stop(NULL, NULL, 0, EXIT_SHELL);
+		return EFI_SUCCESS;
+	}
+
+	size = min(loopback.rx_size, record->size - replay.consumed);
+	buf = loopback.rx_buf;
+	memcpy(buf, (CHAR8 *)&record[1] + replay.consumed, size);
+	replay.consumed += size;
+	if (replay.consumed == record->size)
+		next_record();
+
+	loopback.rx_buf = NULL;
+	result.rx_bytes += size;
+	loopback.rx_cb(buf, size);
+
+	return EFI_SUCCESS;
+}
+
+static transport_t LOOPBACK_TRANSPORT[] = {
+	{
+		.name = "Loopback for fastboot",
+		.start = loopback_start,
+		.stop = loopback_stop,
+		.run = loopback_run,
+		.read = loopback_read,
+		.write = loopback_write
+	}
+};
+
+transport_t *fastboot_loopback_transport(void)
+{
+	return LOOPBACK_TRANSPORT;
+}
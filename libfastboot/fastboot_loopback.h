@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _FASTBOOT_LOOPBACK_H_
+#define _FASTBOOT_LOOPBACK_H_
+
+#include <transport.h>
+
+/* A recorded session is a sequence of records, each one made of a
+   struct loopback_record followed by SIZE bytes.  LOOPBACK_HOST
+   records are the messages and the download data received by the
+   device, LOOPBACK_DEVICE ones the expected beginning of the next
+   response other than INFO.  */
+enum loopback_type {
+	LOOPBACK_HOST,
+	LOOPBACK_DEVICE
+};
+
+struct loopback_record {
+	UINT32 type;
+	UINT32 size;
+} __attribute__((packed));
+
+typedef struct loopback_result {
+	UINT64 rx_bytes;
+	UINT64 tx_bytes;
+	UINT64 us;
+	UINTN mismatches;
+	BOOLEAN complete;
+} loopback_result_t;
+
+/* Once a session is set, fastboot only registers the loopback
+   transport, which replays SESSION as fast as the protocol and the
+   flash path go.  The session ends with an EXIT_SHELL target.  */
+EFI_STATUS fastboot_loopback_set_session(VOID *session, UINTN size);
+void fastboot_loopback_clear_session(void);
+BOOLEAN fastboot_loopback_enabled(void);
+transport_t *fastboot_loopback_transport(void);
+void fastboot_loopback_get_result(loopback_result_t *result);
+
+#endif	/* _FASTBOOT_LOOPBACK_H_ */
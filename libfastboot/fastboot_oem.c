@@ -36,6 +36,7 @@
 #include <lib.h>
 #include <vars.h>
 #include <storage.h>
+#include <ramdisk.h>
 
 #include "uefi_utils.h"
 #include "flash.h"
@@ -48,9 +49,22 @@
 #include "fastboot_oem.h"
 #include "intel_variables.h"
 #include "text_parser.h"
+#include "timestamp.h"
+#include "perf.h"
+#include "async_io.h"
+#include "timer.h"
+#include "trace.h"
+#include "memstat.h"
+#include "bump.h"
 
 #define OFF_MODE_CHARGE		"off-mode-charge"
 #define CRASH_EVENT_MENU	"crash-event-menu"
+#define DISCARD_DONT_CARE	"discard-dont-care"
+#define VERIFY_FLASH		"verify-flash"
+#define DELTA_FLASH		"delta-flash"
+#define PIPELINE_FLASH		"pipeline-flash"
+#define DEFERRED_ERASE		"deferred-erase"
+#define IP_CONFIG_CACHE		"ip-config-cache"
 
 static cmdlist_t cmdlist;
 
@@ -62,6 +76,30 @@ static EFI_STATUS fastboot_oem_publish(void)
 	if (EFI_ERROR(ret))
 		return ret;
 
+	ret = fastboot_publish(DISCARD_DONT_CARE, get_discard_dont_care() ? "1" : "0");
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = fastboot_publish(VERIFY_FLASH, get_verify_flash() ? "1" : "0");
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = fastboot_publish(DELTA_FLASH, get_delta_flash() ? "1" : "0");
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = fastboot_publish(PIPELINE_FLASH, get_pipeline_flash() ? "1" : "0");
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = fastboot_publish(DEFERRED_ERASE, get_deferred_erase() ? "1" : "0");
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = fastboot_publish(IP_CONFIG_CACHE, get_ip_config_cache() ? "1" : "0");
+	if (EFI_ERROR(ret))
+		return ret;
+
 	return publish_intel_variables();
 }
 
@@ -121,6 +159,174 @@ static void cmd_oem_crash_event_menu(INTN argc, CHAR8 **argv)
 		fastboot_okay("");
 }
 
+static void cmd_oem_discard_dont_care(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (strcmp(argv[1], (CHAR8* )"1") && strcmp(argv[1], (CHAR8 *)"0")) {
+		fastboot_fail("Invalid value");
+		error(L"Please specify 1 or 0 to enable/disable DONT_CARE discard");
+		return;
+	}
+
+	ret = set_discard_dont_care(!strcmp(argv[1], (CHAR8* )"1"));
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to set %a", DISCARD_DONT_CARE);
+		return;
+	}
+
+	ret = fastboot_oem_publish();
+	if (EFI_ERROR(ret))
+		fastboot_fail("Failed to publish OEM variables");
+	else
+		fastboot_okay("");
+}
+
+static void cmd_oem_verify_flash(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (strcmp(argv[1], (CHAR8* )"1") && strcmp(argv[1], (CHAR8 *)"0")) {
+		fastboot_fail("Invalid value");
+		error(L"Please specify 1 or 0 to enable/disable flash verification");
+		return;
+	}
+
+	ret = set_verify_flash(!strcmp(argv[1], (CHAR8* )"1"));
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to set %a", VERIFY_FLASH);
+		return;
+	}
+
+	ret = fastboot_oem_publish();
+	if (EFI_ERROR(ret))
+		fastboot_fail("Failed to publish OEM variables");
+	else
+		fastboot_okay("");
+}
+
+static void cmd_oem_delta_flash(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (strcmp(argv[1], (CHAR8* )"1") && strcmp(argv[1], (CHAR8 *)"0")) {
+		fastboot_fail("Invalid value");
+		error(L"Please specify 1 or 0 to enable/disable delta flash");
+		return;
+	}
+
+	ret = set_delta_flash(!strcmp(argv[1], (CHAR8* )"1"));
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to set %a", DELTA_FLASH);
+		return;
+	}
+
+	ret = fastboot_oem_publish();
+	if (EFI_ERROR(ret))
+		fastboot_fail("Failed to publish OEM variables");
+	else
+		fastboot_okay("");
+}
+
+static void cmd_oem_pipeline_flash(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (strcmp(argv[1], (CHAR8* )"1") && strcmp(argv[1], (CHAR8 *)"0")) {
+		fastboot_fail("Invalid value");
+		error(L"Please specify 1 or 0 to enable/disable pipelined flash");
+		return;
+	}
+
+	ret = set_pipeline_flash(!strcmp(argv[1], (CHAR8* )"1"));
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to set %a", PIPELINE_FLASH);
+		return;
+	}
+
+	ret = fastboot_oem_publish();
+	if (EFI_ERROR(ret))
+		fastboot_fail("Failed to publish OEM variables");
+	else
+		fastboot_okay("");
+}
+
+static void cmd_oem_deferred_erase(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (strcmp(argv[1], (CHAR8* )"1") && strcmp(argv[1], (CHAR8 *)"0")) {
+		fastboot_fail("Invalid value");
+		error(L"Please specify 1 or 0 to enable/disable deferred erase");
+		return;
+	}
+
+	ret = set_deferred_erase(!strcmp(argv[1], (CHAR8* )"1"));
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to set %a", DEFERRED_ERASE);
+		return;
+	}
+
+	ret = fastboot_oem_publish();
+	if (EFI_ERROR(ret))
+		fastboot_fail("Failed to publish OEM variables");
+	else
+		fastboot_okay("");
+}
+
+static void cmd_oem_ip_config_cache(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (strcmp(argv[1], (CHAR8* )"1") && strcmp(argv[1], (CHAR8 *)"0")) {
+		fastboot_fail("Invalid value");
+		error(L"Please specify 1 or 0 to enable/disable the IP configuration cache");
+		return;
+	}
+
+	ret = set_ip_config_cache(!strcmp(argv[1], (CHAR8* )"1"));
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to set %a", IP_CONFIG_CACHE);
+		return;
+	}
+
+	ret = fastboot_oem_publish();
+	if (EFI_ERROR(ret))
+		fastboot_fail("Failed to publish OEM variables");
+	else
+		fastboot_okay("");
+}
+
 static void cmd_oem_setvar(INTN argc, CHAR8 **argv)
 {
 	EFI_STATUS ret;
@@ -132,7 +338,7 @@ static void cmd_oem_setvar(INTN argc, CHAR8 **argv)
 		return;
 	}
 
-	varname = stra_to_str(argv[1]);
+	varname = bump_stra_to_str(argv[1]);
 	if (argc == 3)
 		value = argv[2];
 
@@ -142,13 +348,19 @@ static void cmd_oem_setvar(INTN argc, CHAR8 **argv)
 		ret = set_efi_variable(&loader_guid, varname,
 				       strlen(value) + 1, value,
 				       TRUE, TRUE);
+	/* The variable may be one the boot image oemvars set, they must
+	   be applied again.  */
+	set_oemvars_digest(NULL);
 	if (EFI_ERROR(ret))
 		fastboot_fail("Unable to %a '%s' variable",
 			      value ? "set" : "clear", varname);
-	else
+	else {
+		if (!StrCmp(varname, LOG_LEVELS_VAR))
+			log_levels_load();
 		fastboot_okay("");
+	}
 
-	FreePool(varname);
+	bump_free(varname);
 }
 
 static void cmd_oem_reboot(INTN argc, CHAR8 **argv)
@@ -161,14 +373,14 @@ static void cmd_oem_reboot(INTN argc, CHAR8 **argv)
 		return;
 	}
 
-	target = stra_to_str(argv[1]);
+	target = bump_stra_to_str(argv[1]);
 	if (!target) {
 		fastboot_fail("Unable to convert string");
 		return;
 	}
 
 	bt = name_to_boot_target(target);
-	FreePool(target);
+	bump_free(target);
 	if (bt == UNKNOWN_TARGET) {
 		fastboot_fail("Unknown %a boot target", argv[1]);
 		return;
@@ -177,10 +389,16 @@ static void cmd_oem_reboot(INTN argc, CHAR8 **argv)
 	fastboot_reboot(bt, L"Rebooting to requested target ...");
 }
 
-static void cmd_oem_garbage_disk(__attribute__((__unused__)) INTN argc,
-				 __attribute__((__unused__)) CHAR8 **argv)
+static void cmd_oem_garbage_disk(INTN argc, CHAR8 **argv)
 {
-	EFI_STATUS ret = garbage_disk();
+	EFI_STATUS ret;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], (CHAR8 *)"full"))) {
+		fastboot_fail("Usage: garbage-disk [full]");
+		return;
+	}
+
+	ret = garbage_disk(argc == 2);
 
 	if (ret == EFI_SUCCESS)
 		fastboot_okay("");
@@ -188,6 +406,38 @@ static void cmd_oem_garbage_disk(__attribute__((__unused__)) INTN argc,
 		fastboot_fail("Garbage disk failed, %r", ret);
 }
 
+static void cmd_oem_format(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	CHAR16 *label;
+
+	if (argc != 2) {
+		fastboot_fail("Usage: format <partition>");
+		return;
+	}
+
+	label = bump_stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Allocation error");
+		return;
+	}
+
+	ui_print(L"Formatting %s ...", label);
+	ret = format_by_label(label);
+	bump_free(label);
+	if (ret == EFI_UNSUPPORTED) {
+		fastboot_fail("%a is not an ext4 partition", argv[1]);
+		return;
+	}
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Format failure: %r", ret);
+		return;
+	}
+
+	ui_print(L"Format done.");
+	fastboot_okay("");
+}
+
 static struct oem_hash {
 	const CHAR16 *name;
 	EFI_STATUS (*hash)(const CHAR16 *name);
@@ -205,10 +455,10 @@ static void cmd_oem_gethashes(INTN argc, CHAR8 **argv)
 	EFI_STATUS ret;
 	UINTN i;
 
-	if (argc == 2) {
-		ret = set_hash_algorithm(argv[1]);
+	if (argc >= 2) {
+		ret = set_hash_algorithms(argc - 1, &argv[1]);
 		if (EFI_ERROR(ret)) {
-			fastboot_fail("Fail to set the algorithm, %r", ret);
+			fastboot_fail("Fail to set the algorithms, %r", ret);
 			return;
 		}
 	}
@@ -226,14 +476,122 @@ static void cmd_oem_gethashes(INTN argc, CHAR8 **argv)
 	fastboot_okay("");
 }
 
+static void cmd_oem_verify_verity(INTN argc, CHAR8 **argv)
+{
+	CHAR16 *label;
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Usage: verify-verity <partition>");
+		return;
+	}
+
+	label = bump_stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Allocation error");
+		return;
+	}
+
+	ret = verify_verity(label);
+	bump_free(label);
+	if (EFI_ERROR(ret))
+		fastboot_fail("Verity verification failed, %r", ret);
+	else
+		fastboot_okay("");
+}
+
+static void cmd_oem_verify_blocks(INTN argc, CHAR8 **argv)
+{
+	CHAR16 *label;
+	VOID *manifest;
+	unsigned size;
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Usage: verify-blocks <partition>");
+		return;
+	}
+
+	manifest = fastboot_get_dlbuffer(&size);
+	if (!manifest) {
+		fastboot_fail("No block digest manifest downloaded");
+		return;
+	}
+
+	label = bump_stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Allocation error");
+		return;
+	}
+
+	ret = verify_block_digests(label, manifest, size);
+	bump_free(label);
+	if (EFI_ERROR(ret))
+		fastboot_fail("Block verification failed, %r", ret);
+	else
+		fastboot_okay("");
+}
+
 #ifndef USER
+/* SIZE[K|M|G] */
+static EFI_STATUS parse_size(CHAR8 *str, UINT64 *size)
+{
+	char *end;
+
+	*size = strtoul((char *)str, &end, 10);
+	switch (*end) {
+	case 'G':
+		*size *= 1024;
+		/* fall through */
+	case 'M':
+		*size *= 1024;
+		/* fall through */
+	case 'K':
+		*size *= 1024;
+		end++;
+	}
+
+	return *end || end == (char *)str ? EFI_INVALID_PARAMETER : EFI_SUCCESS;
+}
+
+/* ramdisk SIZE[K|M|G] [BLOCKSIZE] [IOALIGN] [LATENCY_US] */
+static EFI_STATUS setup_ramdisk(INTN argc, CHAR8 **argv)
+{
+	UINT64 size, block_size = RAMDISK_DEFAULT_BLOCK_SIZE;
+	UINT64 io_align = 0, latency_us = 0;
+
+	if (ramdisk_exists())
+		return argc == 2 ? EFI_SUCCESS : EFI_ALREADY_STARTED;
+
+	if (argc < 3 || argc > 6
+	    || EFI_ERROR(parse_size(argv[2], &size))
+	    || (argc > 3 && EFI_ERROR(parse_size(argv[3], &block_size)))
+	    || (argc > 4 && EFI_ERROR(parse_size(argv[4], &io_align)))
+	    || (argc > 5 && EFI_ERROR(parse_size(argv[5], &latency_us)))
+	    || block_size > (UINT32)-1 || io_align > (UINT32)-1
+	    || latency_us > (UINT32)-1)
+		return EFI_INVALID_PARAMETER;
+
+	return ramdisk_create(size, block_size, io_align, latency_us);
+}
+
 static void cmd_oem_set_storage(INTN argc, CHAR8 **argv)
 {
 	enum storage_type type;
 	EFI_STATUS ret;
 
+	if (argc >= 2 && !strcmp(argv[1], (CHAR8 *)"ramdisk")) {
+		ret = setup_ramdisk(argc, argv);
+		if (EFI_ERROR(ret)) {
+			fastboot_fail("Usage: set-storage ramdisk <size> [blocksize] [ioalign] [latency-us], %r", ret);
+			return;
+		}
+		type = STORAGE_RAMDISK;
+		goto set;
+	}
+
 	if (argc != 2) {
-		fastboot_fail("Supported storage: ufs, emmc");
+		fastboot_fail("Supported storage: ufs, emmc, nvme, ramdisk");
 		return;
 	}
 
@@ -245,6 +603,10 @@ static void cmd_oem_set_storage(INTN argc, CHAR8 **argv)
 		type = STORAGE_UFS;
 		goto set;
 	}
+	if (!strcmp(argv[1], (CHAR8*)"nvme")) {
+		type = STORAGE_NVME;
+		goto set;
+	}
 	fastboot_fail("Unsupported storage");
 	return;
 set:
@@ -255,14 +617,50 @@ set:
 	}
 
 	ret = gpt_refresh();
+	/* The cached disks belong to the previous storage */
+	gpt_free_cache();
 	if (EFI_ERROR(ret)) {
 		fastboot_fail("Failed to refresh partition table: %r", ret);
 		return;
 	}
 
-	ret = refresh_partition_var();
+	if (type == STORAGE_RAMDISK) {
+		ret = ramdisk_create_gpt();
+		if (EFI_ERROR(ret)) {
+			fastboot_fail("Failed to create the RAM disk partitions: %r", ret);
+			return;
+		}
+	}
+
+	fastboot_okay("");
+}
+
+static void cmd_oem_storage_bench(INTN argc, CHAR8 **argv)
+{
+	UINT64 size, block_size = 1024 * 1024, depth = ASYNC_IO_DEPTH;
+	CHAR16 *label;
+	EFI_STATUS ret;
+
+	if (argc < 3 || argc > 5
+	    || EFI_ERROR(parse_size(argv[2], &size))
+	    || (argc > 3 && EFI_ERROR(parse_size(argv[3], &block_size)))
+	    || (argc > 4 && EFI_ERROR(parse_size(argv[4], &depth)))) {
+		fastboot_fail("Usage: storage-bench <partition> <size> [blocksize] [qd]");
+		return;
+	}
+
+	label = stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Allocation error");
+		return;
+	}
+
+	hash_cache_invalidate(label);
+	flash_forget_erased(label);
+	ret = perf_storage_bench(label, size, block_size, depth);
+	FreePool(label);
 	if (EFI_ERROR(ret))
-		fastboot_fail("Failed to refresh partition vars: %r", ret);
+		fastboot_fail("Storage benchmark failed, %r", ret);
 	else
 		fastboot_okay("");
 }
@@ -307,15 +705,16 @@ static void cmd_oem_rm(INTN argc, CHAR8 **argv)
 		if (*tmp == '/')
 			*tmp = '\\';
 
-	filename16 = stra_to_str(filename);
+	filename16 = bump_stra_to_str(filename);
 	if (!filename16) {
 		efi_perror(ret, L"failed to allocate CHAR16 filename");
 		fastboot_fail("failed to allocate CHAR16 filename");
 		return;
 	}
 
+	esp_hash_invalidate(filename16);
 	ret = uefi_delete_file(io, filename16);
-	FreePool(filename16);
+	bump_free(filename16);
 	if (EFI_ERROR(ret)) {
 		fastboot_fail("Failed to delete file '%a', %r", filename, ret);
 		return;
@@ -379,6 +778,239 @@ static void cmd_oem_get_logs(INTN argc, __attribute__((__unused__)) CHAR8 **argv
 	fastboot_okay("");
 }
 
+/* The log bundle staged for the upload command is a sequence of
+   sections, each made of a log_section header followed by SIZE bytes
+   of data.  Missing sources are simply left out.  */
+#define LOG_SECTION_NAME_LEN 16
+
+struct log_section {
+	char name[LOG_SECTION_NAME_LEN];
+	UINT32 size;
+} __attribute__((packed));
+
+enum {
+	LOG_SOURCE_CURRENT,
+	LOG_SOURCE_LAST_BOOT,
+	LOG_SOURCE_TRACE,
+	LOG_SOURCE_NB
+};
+
+static const char *LOG_SOURCE_NAMES[LOG_SOURCE_NB] = {
+	[LOG_SOURCE_CURRENT] = "log",
+	[LOG_SOURCE_LAST_BOOT] = "last-boot-log",
+	[LOG_SOURCE_TRACE] = "trace"
+};
+
+static void cmd_oem_stage_logs(INTN argc, __attribute__((__unused__)) CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	struct log_section *section;
+	void *data[LOG_SOURCE_NB] = { NULL };
+	UINTN size[LOG_SOURCE_NB] = { 0 };
+	UINTN i, total = 0;
+	UINT32 flags;
+	char *bundle, *cur;
+
+	if (argc != 1) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	ret = log_dump(&data[LOG_SOURCE_CURRENT], &size[LOG_SOURCE_CURRENT]);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to get the log buffer");
+
+	ret = get_efi_variable(&loader_guid, LOG_VAR, &size[LOG_SOURCE_LAST_BOOT],
+			       &data[LOG_SOURCE_LAST_BOOT], &flags);
+	if (EFI_ERROR(ret) && ret != EFI_NOT_FOUND)
+		efi_perror(ret, L"Failed to get the last boot log");
+
+	ret = trace_dump(&data[LOG_SOURCE_TRACE], &size[LOG_SOURCE_TRACE]);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to get the trace");
+
+	for (i = 0; i < LOG_SOURCE_NB; i++)
+		if (data[i])
+			total += sizeof(*section) + size[i];
+
+	if (!total) {
+		fastboot_fail("No log available");
+		return;
+	}
+
+	cur = bundle = AllocatePool(total);
+	if (!bundle) {
+		fastboot_fail("Failed to allocate the log bundle");
+		goto out;
+	}
+
+	for (i = 0; i < LOG_SOURCE_NB; i++) {
+		if (!data[i])
+			continue;
+		section = (struct log_section *)cur;
+		memset(section->name, 0, sizeof(section->name));
+		strncpy((CHAR8 *)section->name, (CHAR8 *)LOG_SOURCE_NAMES[i],
+			sizeof(section->name) - 1);
+		section->size = size[i];
+		cur += sizeof(*section);
+		memcpy(cur, data[i], size[i]);
+		cur += size[i];
+		fastboot_info("%a: %ld bytes", LOG_SOURCE_NAMES[i], size[i]);
+	}
+
+	fastboot_stage(bundle, total);
+	fastboot_info("%ld bytes staged, use 'fastboot get_staged'", total);
+	fastboot_okay("");
+
+out:
+	for (i = 0; i < LOG_SOURCE_NB; i++)
+		if (data[i])
+			FreePool(data[i]);
+}
+
+/* Only the last records of the trace ring are decoded here.  The
+   complete binary ring is part of the "oem get-logs" bundle.  */
+#define TRACE_DEFAULT_RECORDS 64
+
+static void cmd_oem_get_trace(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	trace_header_t *header;
+	trace_record_t *records;
+	unsigned long nb = TRACE_DEFAULT_RECORDS;
+	char *endptr;
+	UINTN size, i;
+
+	if (argc > 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (argc == 2) {
+		nb = strtoul((char *)argv[1], &endptr, 10);
+		if (*endptr != '\0' || !nb) {
+			fastboot_fail("Invalid value");
+			return;
+		}
+	}
+
+	ret = trace_dump((void **)&header, &size);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to get the trace, %r", ret);
+		return;
+	}
+
+	records = (trace_record_t *)(header + 1);
+	i = header->count > nb ? header->count - nb : 0;
+	fastboot_info("%ld records, %ld lost", header->count, header->lost);
+	for (; i < header->count; i++)
+		fastboot_info("%ld us %a %x %lx",
+			      timer_ticks_to_us(records[i].ticks),
+			      trace_event_name(records[i].event),
+			      records[i].a, records[i].b);
+
+	FreePool(header);
+	fastboot_okay("");
+}
+
+static void info_timestamps(const char *title, struct timestamp *stamps,
+			    UINTN count)
+{
+	UINT64 prev = 0;
+	UINTN i;
+
+	fastboot_info("%a:", title);
+	for (i = 0; i < count; i++) {
+		fastboot_info("  %a: %ld ms (+%ld)", stamps[i].name,
+			      stamps[i].us / 1000,
+			      (stamps[i].us - prev) / 1000);
+		prev = stamps[i].us;
+	}
+}
+
+static void cmd_oem_memstat(INTN argc, __attribute__((__unused__)) CHAR8 **argv)
+{
+	const memstat_t *s;
+	UINTN i;
+
+	if (argc != 1) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	for (i = 0; i < MEMSTAT_TAG_NB; i++) {
+		s = memstat_get(i);
+		fastboot_info("%a: %ld bytes, peak %ld, largest %ld",
+			      memstat_name(i), s->current, s->peak, s->largest);
+		fastboot_info("%a: %ld allocations, %ld failures",
+			      memstat_name(i), s->allocs, s->failures);
+	}
+	fastboot_okay("");
+}
+
+static void cmd_oem_perf(INTN argc, CHAR8 **argv)
+{
+	struct timestamp stamps[MAX_TIMESTAMPS], *last;
+	struct boot_bench_stats bench;
+	EFI_STATUS ret;
+	UINTN count;
+
+	if (argc == 2 && !strcmp(argv[1], (CHAR8 *)"commands")) {
+		perf_cmd_report();
+		fastboot_okay("");
+		return;
+	}
+
+	if (argc != 1) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	ret = timestamp_get_last_boot(&last, &count);
+	if (EFI_ERROR(ret))
+		fastboot_info("last boot: not available, %r", ret);
+	else {
+		info_timestamps("last boot", last, count);
+		FreePool(last);
+	}
+
+	count = timestamp_get(stamps, ARRAY_SIZE(stamps));
+	info_timestamps("this boot", stamps, count);
+
+	ret = timestamp_bench_get(&bench);
+	if (!EFI_ERROR(ret) && bench.count)
+		fastboot_info("boot bench: %d boots, %d remaining, min %d p50 %d p99 %d max %d us",
+			      bench.count, bench.remaining, bench.min_us,
+			      bench.p50_us, bench.p99_us, bench.max_us);
+	fastboot_okay("");
+}
+
+#ifndef USER
+static void cmd_oem_boot_bench(INTN argc, CHAR8 **argv)
+{
+	unsigned long boots;
+	EFI_STATUS ret;
+	char *end;
+
+	if (argc != 2) {
+		fastboot_fail("Usage: boot-bench <boots>");
+		return;
+	}
+
+	boots = strtoul((char *)argv[1], &end, 10);
+	if (*end || end == (char *)argv[1] || boots > (UINT32)-1) {
+		fastboot_fail("Invalid value");
+		return;
+	}
+
+	ret = timestamp_bench_start(boots);
+	if (EFI_ERROR(ret))
+		fastboot_fail("Failed to start the boot bench, %r", ret);
+	else
+		fastboot_okay("");
+}
+#endif
+
 static void cmd_oem(INTN argc, CHAR8 **argv)
 {
 	if (argc < 2) {
@@ -419,17 +1051,32 @@ static struct fastboot_cmd COMMANDS[] = {
 	 * requirements.  They are provided for engineering and
 	 * provisioning purpose only.  */
 	{ CRASH_EVENT_MENU,		LOCKED,		cmd_oem_crash_event_menu  },
+	{ DISCARD_DONT_CARE,		UNLOCKED,	cmd_oem_discard_dont_care  },
+	{ VERIFY_FLASH,			LOCKED,		cmd_oem_verify_flash  },
+	{ DELTA_FLASH,			LOCKED,		cmd_oem_delta_flash  },
+	{ PIPELINE_FLASH,		LOCKED,		cmd_oem_pipeline_flash  },
+	{ DEFERRED_ERASE,		LOCKED,		cmd_oem_deferred_erase  },
+	{ IP_CONFIG_CACHE,		LOCKED,		cmd_oem_ip_config_cache  },
 	{ "setvar",			UNLOCKED,	cmd_oem_setvar  },
 	{ "garbage-disk",		UNLOCKED,	cmd_oem_garbage_disk  },
+	{ "format",			UNLOCKED,	cmd_oem_format  },
 	{ "reboot",			LOCKED,		cmd_oem_reboot  },
 #ifndef USER
 	{ "set-storage",		LOCKED,		cmd_oem_set_storage  },
 	{ "reprovision",		LOCKED,		cmd_oem_reprovision  },
+	{ "storage-bench",		UNLOCKED,	cmd_oem_storage_bench },
 	{ "rm",				LOCKED,		cmd_oem_rm },
 	{ "set-watchdog-counter-max",	LOCKED,		cmd_oem_set_watchdog_counter_max },
+	{ "boot-bench",			LOCKED,		cmd_oem_boot_bench },
 #endif
 	{ "get-hashes",			LOCKED,		cmd_oem_gethashes  },
+	{ "verify-verity",		LOCKED,		cmd_oem_verify_verity },
+	{ "verify-blocks",		LOCKED,		cmd_oem_verify_blocks },
 	{ "get-provisioning-logs",	LOCKED,		cmd_oem_get_logs },
+	{ "get-logs",			LOCKED,		cmd_oem_stage_logs },
+	{ "get-trace",			LOCKED,		cmd_oem_get_trace },
+	{ "perf",			LOCKED,		cmd_oem_perf },
+	{ "memstat",			LOCKED,		cmd_oem_memstat },
 #ifdef BOOTLOADER_POLICY
 	{ "get-action-nonce",		LOCKED,		cmd_oem_get_action_nonce }
 #endif
@@ -452,6 +1099,11 @@ EFI_STATUS fastboot_oem_init(void)
 			return ret;
 	}
 
+	/* Their hash is computed while they are flashed */
+	for (i = 0; i < ARRAY_SIZE(OEM_HASH); i++)
+		if (OEM_HASH[i].hash == get_fs_hash)
+			hash_cache_register(OEM_HASH[i].name);
+
 	fastboot_register(&oem);
 
 	return EFI_SUCCESS;
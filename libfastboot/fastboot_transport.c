@@ -35,8 +35,11 @@
 #include <fastboot.h>
 #include <usb.h>
 #include <tcp.h>
+#include <udp.h>
 #include <transport.h>
 
+#include "fastboot_loopback.h"
+
 /* USB */
 #define FASTBOOT_IF_SUBCLASS		0x42
 #define FASTBOOT_IF_PROTOCOL		0x03
@@ -78,9 +81,20 @@ static struct rx {
 	char *buf;
 	UINT32 size;
 	UINT32 used;
+	BOOLEAN ready;		/* complete, to report from tcp_run() */
 } rx;
 static UINT64 remaining_data;
 
+/* A message header is read along with the start of the payload, a
+   small command then takes a single segment.  The bytes read past the
+   current message are kept for the next read.  */
+#define TCP_HEAD_SIZE 512
+static struct {
+	UINT8 buf[sizeof(UINT64) + TCP_HEAD_SIZE];
+	UINT32 start;
+	UINT32 end;
+} head;
+
 static start_callback_t start_callback;
 static data_callback_t rx_callback;
 static data_callback_t tx_callback;
@@ -105,8 +119,54 @@ static void fastboot_tcp_start_cb(void)
 	}
 }
 
+/* Consume the buffered header and payload bytes.  COMPLETE is set if
+   the read is done, otherwise the next transfer is queued.  */
+static EFI_STATUS tcp_head_process(BOOLEAN *complete)
+{
+	EFI_STATUS ret;
+	UINT64 length;
+	UINT32 len;
+
+	*complete = FALSE;
+	while (!remaining_data) {
+		len = head.end - head.start;
+		if (len < sizeof(length)) {
+			CopyMem(head.buf, head.buf + head.start, len);
+			head.start = 0;
+			head.end = len;
+			tcp_state = WAITING_DATA_SIZE;
+			ret = tcp_read_some(head.buf + len, sizeof(head.buf) - len);
+			if (EFI_ERROR(ret))
+				efi_perror(ret, L"fastboot_tcp_read failed");
+			return ret;
+		}
+
+		memcpy(&length, head.buf + head.start, sizeof(length));
+		head.start += sizeof(length);
+		remaining_data = be64toh(length);
+	}
+
+	len = min(min(head.end - head.start, rx.size - rx.used), remaining_data);
+	memcpy(rx.buf + rx.used, head.buf + head.start, len);
+	head.start += len;
+	rx.used += len;
+	remaining_data -= len;
+	if (rx.used == rx.size || remaining_data == 0) {
+		*complete = TRUE;
+		return EFI_SUCCESS;
+	}
+
+	/* The rest of the payload goes straight to the caller buffer.  */
+	tcp_state = WAITING_DATA;
+	ret = tcp_read(rx.buf + rx.used, min(rx.size - rx.used, remaining_data));
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Transport_tcp_rx tcp_read failed");
+	return ret;
+}
+
 static void transport_tcp_rx_cb(void *buf, UINT32 size)
 {
+	BOOLEAN complete;
 	EFI_STATUS ret;
 
 	switch (tcp_state) {
@@ -119,23 +179,24 @@ static void transport_tcp_rx_cb(void *buf, UINT32 size)
 		}
 
 		remaining_data = 0;
+		head.start = head.end = 0;
+		rx.ready = FALSE;
 		tcp_state = READY;
 		start_callback();
 		return;
 
 	case WAITING_DATA_SIZE:
-		if (size != sizeof(remaining_data) || buf != &remaining_data) {
+		if (buf != head.buf + head.end ||
+		    size > sizeof(head.buf) - head.end) {
 			error(L"Waiting data size %d", size);
 			return;
 		}
 
-		remaining_data = be64toh(remaining_data);
-
-		tcp_state = WAITING_DATA;
-		ret = tcp_read(rx.buf, min(rx.size, remaining_data));
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"transport_tcp_rx tcp_read failed");
-			return;
+		head.end += size;
+		ret = tcp_head_process(&complete);
+		if (!EFI_ERROR(ret) && complete) {
+			tcp_state = READY;
+			rx_callback(rx.buf, rx.used);
 		}
 		return;
 
@@ -186,48 +247,49 @@ static EFI_STATUS fastboot_tcp_start(start_callback_t start_cb,
 				     data_callback_t rx_cb,
 				     data_callback_t tx_cb)
 {
-	EFI_STATUS ret;
-	EFI_IPv4_ADDRESS station_address;
-
 	start_callback = start_cb;
 	rx_callback = rx_cb;
 	tx_callback = tx_cb;
 
-	ret = tcp_start(TCP_PORT, fastboot_tcp_start_cb,
-			transport_tcp_rx_cb, transport_tcp_tx_cb,
-			&station_address);
-	if (EFI_ERROR(ret))
-		return ret;
-
-	print_tcpip_information(&station_address);
-
-	return EFI_SUCCESS;
+	return tcp_start(TCP_PORT, fastboot_tcp_start_cb,
+			 transport_tcp_rx_cb, transport_tcp_tx_cb,
+			 print_tcpip_information);
 }
 
+/* Several responses may be in flight, each needs its own header */
+#define TCP_WRITE_HEADERS 16
+
 EFI_STATUS fastboot_tcp_write(void *buf, UINT32 size)
 {
-	static char write_buf[MAGIC_LENGTH + sizeof(UINT64)];
+	static UINT64 headers[TCP_WRITE_HEADERS];
+	static UINTN cur;
+	transport_fragment_t frags[2];
 
 	if (tcp_state != READY) {
 		error(L"Inconsistent TCP state %d at write", tcp_state);
 		return EFI_NOT_STARTED;
 	}
 
-	if (size + sizeof(UINT64) > sizeof(write_buf)) {
-		error(L"Invalid size %d", size);
-		return EFI_INVALID_PARAMETER;
-	}
+	headers[cur] = htobe64(size);
+	frags[0].buf = &headers[cur];
+	frags[0].size = sizeof(headers[cur]);
+	frags[1].buf = buf;
+	frags[1].size = size;
+	cur = (cur + 1) % TCP_WRITE_HEADERS;
 
-	*((UINT64 *)write_buf) = htobe64(size);
-	memcpy(write_buf + sizeof(UINT64), buf, size);
-	return tcp_write(write_buf, size + sizeof(UINT64));
+	return tcp_writev(frags, ARRAY_SIZE(frags));
+}
+
+static UINTN fastboot_tcp_write_depth(void)
+{
+	return TCP_WRITE_HEADERS;
 }
 
 EFI_STATUS fastboot_tcp_read(void *buf, UINT32 size)
 {
 	EFI_STATUS ret;
 
-	if (tcp_state != READY) {
+	if (tcp_state != READY || rx.ready) {
 		error(L"Inconsistent TCP state %d at read", tcp_state);
 		return EFI_INVALID_PARAMETER;
 	}
@@ -235,15 +297,365 @@ EFI_STATUS fastboot_tcp_read(void *buf, UINT32 size)
 	rx.buf = buf;
 	rx.size = size;
 	rx.used = 0;
-	tcp_state = WAITING_DATA_SIZE;
 
-	ret = tcp_read(&remaining_data, sizeof(remaining_data));
+	/* A read satisfied by the buffered bytes is reported by
+	   fastboot_tcp_run(), not from within this call.  */
+	ret = tcp_head_process(&rx.ready);
+	if (EFI_ERROR(ret))
+		tcp_state = READY;
+
+	return ret;
+}
+
+static EFI_STATUS fastboot_tcp_run(void)
+{
+	EFI_STATUS ret;
+
+	ret = tcp_run();
+	if (rx.ready && tcp_state == READY) {
+		rx.ready = FALSE;
+		rx_callback(rx.buf, rx.used);
+	}
+
+	return ret;
+}
+
+static EFI_EVENT fastboot_tcp_event(void)
+{
+	EFI_EVENT event = tcp_event();
+
+	/* A read satisfied by the buffered bytes has no completion of
+	   its own.  */
+	if (event && rx.ready)
+		uefi_call_wrapper(BS->SignalEvent, 1, event);
+
+	return event;
+}
+
+/* UDP.  The host drives the protocol: every host packet is
+   acknowledged by a device packet with the same sequence number and
+   the device data is carried by these acknowledgments.  */
+static const UINT32 UDP_PORT = 5554;
+
+#define UDP_ID_ERROR			0x00
+#define UDP_ID_QUERY			0x01
+#define UDP_ID_INIT			0x02
+#define UDP_ID_FASTBOOT			0x03
+#define UDP_FLAG_CONTINUATION		0x01
+#define UDP_PROTOCOL_VERSION		1
+#define UDP_MIN_PACKET_SIZE		512
+#define UDP_MAX_PACKET_SIZE		1472	/* No IP fragmentation */
+#define UDP_TX_QUEUE_DEPTH		16
+
+typedef struct udp_header {
+	UINT8 id;
+	UINT8 flags;
+	UINT16 seq;
+} __attribute__((packed)) udp_header_t;
+
+#define UDP_MAX_DATA_SIZE (UDP_MAX_PACKET_SIZE - sizeof(udp_header_t))
+
+static start_callback_t udp_start_callback;
+static data_callback_t udp_rx_callback;
+static data_callback_t udp_tx_callback;
+
+/* Two response buffers: the last response is kept for
+   retransmission while the next one is built.  */
+typedef struct udp_response {
+	char data[UDP_MAX_PACKET_SIZE];
+	UINT32 size;
+	void *completes;	/* Message fully sent by this response */
+	UINT32 completes_size;
+} udp_response_t;
+
+static struct udp_session {
+	BOOLEAN initialized;
+	UINT16 seq;		/* Next expected sequence number */
+	UINT16 max_packet;
+	udp_response_t resp[2];
+	udp_response_t *last;
+} udp_session;
+
+static struct udp_rx {
+	char *buf;
+	UINT32 size;
+	UINT32 used;
+	BOOLEAN reading;
+	/* Host data received while no read was pending */
+	char pending[UDP_MAX_DATA_SIZE];
+	UINT32 pending_len;
+	BOOLEAN pending_end;
+} udp_rx;
+
+static struct udp_tx {
+	struct {
+		void *buf;
+		UINT32 size;
+	} msg[UDP_TX_QUEUE_DEPTH];
+	UINTN head;
+	UINTN count;
+	UINT32 sent;		/* Bytes of the head message already sent */
+} udp_tx;
+
+static void udp_rx_push(char *data, UINT32 len, BOOLEAN end)
+{
+	UINT32 n = min(len, udp_rx.size - udp_rx.used);
+
+	memcpy(udp_rx.buf + udp_rx.used, data, n);
+	udp_rx.used += n;
+
+	if (n < len) {
+		memcpy(udp_rx.pending, data + n, len - n);
+		udp_rx.pending_len = len - n;
+		udp_rx.pending_end = end;
+	}
+
+	if (udp_rx.used == udp_rx.size || (end && n == len)) {
+		udp_rx.reading = FALSE;
+		udp_rx_callback(udp_rx.buf, udp_rx.used);
+	}
+}
+
+static EFI_STATUS udp_send(udp_response_t *resp)
+{
+	EFI_STATUS ret;
+
+	ret = udp_write(resp->data, resp->size);
 	if (EFI_ERROR(ret))
-		efi_perror(ret, L"fastboot_tcp_read failed");
+		efi_perror(ret, L"Failed to send UDP response");
 
 	return ret;
 }
 
+static udp_response_t *udp_new_response(UINT8 id, UINT8 flags, UINT16 seq)
+{
+	udp_response_t *resp;
+	udp_header_t *hdr;
+
+	resp = udp_session.last == &udp_session.resp[0] ?
+		&udp_session.resp[1] : &udp_session.resp[0];
+	hdr = (udp_header_t *)resp->data;
+	hdr->id = id;
+	hdr->flags = flags;
+	hdr->seq = htobe16(seq);
+	resp->size = sizeof(*hdr);
+	resp->completes = NULL;
+
+	return resp;
+}
+
+static void udp_add_tx_data(udp_response_t *resp)
+{
+	UINTN head = udp_tx.head;
+	UINT32 n, room = udp_session.max_packet - sizeof(udp_header_t);
+	char *buf;
+
+	if (!udp_tx.count)
+		return;
+
+	buf = udp_tx.msg[head].buf;
+	n = min(room, udp_tx.msg[head].size - udp_tx.sent);
+	memcpy(resp->data + resp->size, buf + udp_tx.sent, n);
+	resp->size += n;
+	udp_tx.sent += n;
+
+	if (udp_tx.sent < udp_tx.msg[head].size) {
+		((udp_header_t *)resp->data)->flags |= UDP_FLAG_CONTINUATION;
+		return;
+	}
+
+	resp->completes = buf;
+	resp->completes_size = udp_tx.msg[head].size;
+	udp_tx.head = (head + 1) % UDP_TX_QUEUE_DEPTH;
+	udp_tx.count--;
+	udp_tx.sent = 0;
+}
+
+static void udp_process_init(udp_header_t *hdr, char *data, UINT32 len)
+{
+	udp_response_t *resp;
+	UINT16 *body, host_max;
+
+	if (len < 2 * sizeof(UINT16)) {
+		error(L"Invalid UDP initialization packet");
+		return;
+	}
+
+	host_max = be16toh(((UINT16 *)data)[1]);
+	if (host_max < UDP_MIN_PACKET_SIZE) {
+		error(L"UDP host max packet size %d is too small", host_max);
+		return;
+	}
+
+	udp_session.seq = be16toh(hdr->seq);
+	udp_session.max_packet = min(host_max, (UINT16)UDP_MAX_PACKET_SIZE);
+	udp_rx.reading = FALSE;
+	udp_rx.pending_len = 0;
+	udp_tx.head = udp_tx.count = udp_tx.sent = 0;
+
+	resp = udp_new_response(UDP_ID_INIT, 0, udp_session.seq);
+	body = (UINT16 *)(resp->data + resp->size);
+	body[0] = htobe16(UDP_PROTOCOL_VERSION);
+	body[1] = htobe16(udp_session.max_packet);
+	resp->size += 2 * sizeof(UINT16);
+
+	udp_session.last = resp;
+	udp_session.seq++;
+	udp_send(resp);
+
+	if (!udp_session.initialized) {
+		udp_session.initialized = TRUE;
+		udp_start_callback();
+	}
+}
+
+static void udp_process_fastboot(udp_header_t *hdr, char *data, UINT32 len)
+{
+	UINT16 seq = be16toh(hdr->seq);
+	BOOLEAN end = !(hdr->flags & UDP_FLAG_CONTINUATION);
+	udp_response_t *resp;
+
+	/* Our previous response got lost.  */
+	if (seq == (UINT16)(udp_session.seq - 1) && udp_session.last) {
+		udp_send(udp_session.last);
+		return;
+	}
+
+	if (seq != udp_session.seq)
+		return;
+
+	if (len) {
+		if (udp_rx.reading && !udp_rx.pending_len)
+			udp_rx_push(data, len, end);
+		else if (!udp_rx.pending_len) {
+			memcpy(udp_rx.pending, data, len);
+			udp_rx.pending_len = len;
+			udp_rx.pending_end = end;
+		} else
+			return;	/* No room, the host will retransmit */
+	}
+
+	resp = udp_new_response(UDP_ID_FASTBOOT, 0, seq);
+	if (end)
+		udp_add_tx_data(resp);
+
+	udp_session.last = resp;
+	udp_session.seq++;
+	udp_send(resp);
+}
+
+static void transport_udp_rx_cb(void *buf, UINT32 size)
+{
+	udp_header_t *hdr = buf;
+	udp_response_t *resp;
+	char *data = (char *)buf + sizeof(*hdr);
+	UINT32 len;
+
+	if (size < sizeof(*hdr))
+		return;
+	len = min(size - (UINT32)sizeof(*hdr), (UINT32)UDP_MAX_DATA_SIZE);
+
+	switch (hdr->id) {
+	case UDP_ID_QUERY:
+		resp = udp_new_response(UDP_ID_QUERY, 0, be16toh(hdr->seq));
+		*(UINT16 *)(resp->data + resp->size) = htobe16(udp_session.seq);
+		resp->size += sizeof(UINT16);
+		udp_send(resp);
+		return;
+
+	case UDP_ID_INIT:
+		udp_process_init(hdr, data, len);
+		return;
+
+	case UDP_ID_FASTBOOT:
+		if (udp_session.initialized)
+			udp_process_fastboot(hdr, data, len);
+		return;
+
+	default:
+		log_verbose(TRANSPORT, L"Ignoring UDP packet id %d", hdr->id);
+	}
+}
+
+static void transport_udp_tx_cb(void *buf, __attribute__((__unused__)) UINT32 size)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(udp_session.resp); i++) {
+		udp_response_t *resp = &udp_session.resp[i];
+
+		if (buf != resp->data || !resp->completes)
+			continue;
+
+		udp_tx_callback(resp->completes, resp->completes_size);
+		resp->completes = NULL;
+	}
+}
+
+static void print_udp_information(EFI_IPv4_ADDRESS *address)
+{
+	ui_print(L"Fastboot is listening on UDP %d.%d.%d.%d:%d",
+		 address->Addr[0], address->Addr[1],
+		 address->Addr[2], address->Addr[3], UDP_PORT);
+}
+
+static EFI_STATUS fastboot_udp_start(start_callback_t start_cb,
+				     data_callback_t rx_cb,
+				     data_callback_t tx_cb)
+{
+	udp_start_callback = start_cb;
+	udp_rx_callback = rx_cb;
+	udp_tx_callback = tx_cb;
+	memset(&udp_session, 0, sizeof(udp_session));
+
+	return udp_start(UDP_PORT, transport_udp_rx_cb, transport_udp_tx_cb,
+			 print_udp_information);
+}
+
+static EFI_STATUS fastboot_udp_run(void)
+{
+	/* Hand the data received while no read was pending.  */
+	if (udp_rx.reading && udp_rx.pending_len) {
+		UINT32 len = udp_rx.pending_len;
+
+		udp_rx.pending_len = 0;
+		udp_rx_push(udp_rx.pending, len, udp_rx.pending_end);
+	}
+
+	return udp_run();
+}
+
+static EFI_STATUS fastboot_udp_read(void *buf, UINT32 size)
+{
+	if (!udp_session.initialized || udp_rx.reading)
+		return EFI_NOT_READY;
+
+	udp_rx.buf = buf;
+	udp_rx.size = size;
+	udp_rx.used = 0;
+	udp_rx.reading = TRUE;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS fastboot_udp_write(void *buf, UINT32 size)
+{
+	UINTN tail;
+
+	if (!udp_session.initialized)
+		return EFI_NOT_STARTED;
+
+	if (udp_tx.count == UDP_TX_QUEUE_DEPTH)
+		return EFI_NOT_READY;
+
+	tail = (udp_tx.head + udp_tx.count) % UDP_TX_QUEUE_DEPTH;
+	udp_tx.msg[tail].buf = buf;
+	udp_tx.msg[tail].size = size;
+	udp_tx.count++;
+
+	return EFI_SUCCESS;
+}
+
 /* Transport */
 static transport_t FASTBOOT_TRANSPORT[] = {
 	{
@@ -252,20 +664,36 @@ static transport_t FASTBOOT_TRANSPORT[] = {
 		.stop = usb_stop,
 		.run = usb_run,
 		.read = fastboot_usb_read,
-		.write = usb_write
+		.write = usb_write,
+		.read_granularity = usb_read_granularity,
+		.counters = usb_counters
 	},
 	{
 		.name = "TCP for fastboot",
 		.start = fastboot_tcp_start,
 		.stop = tcp_stop,
-		.run = tcp_run,
+		.run = fastboot_tcp_run,
 		.read = fastboot_tcp_read,
-		.write = fastboot_tcp_write
+		.write = fastboot_tcp_write,
+		.write_depth = fastboot_tcp_write_depth,
+		.counters = tcp_counters,
+		.event = fastboot_tcp_event
+	},
+	{
+		.name = "UDP for fastboot",
+		.start = fastboot_udp_start,
+		.stop = udp_stop,
+		.run = fastboot_udp_run,
+		.read = fastboot_udp_read,
+		.write = fastboot_udp_write
 	}
 };
 
 EFI_STATUS fastboot_transport_register(void)
 {
+	if (fastboot_loopback_enabled())
+		return transport_register(fastboot_loopback_transport(), 1);
+
 	return transport_register(FASTBOOT_TRANSPORT,
 				  ARRAY_SIZE(FASTBOOT_TRANSPORT));
 }
@@ -37,7 +37,10 @@
 #include <ui.h>
 #include <security.h>
 
+#include <timer.h>
+
 #include "uefi_utils.h"
+#include "gpt_bin.h"
 #include "fastboot_oem.h"
 #include "fastboot_ui.h"
 #include "smbios.h"
@@ -104,6 +107,23 @@ static UINTN area_x;
 static UINTN area_y;
 static ui_boot_menu_t *boot_menu;
 
+/* Download progress bar.  The receive path only records the amount
+   of data received, the bar and its text are drawn from the main
+   loop when the periodic timer has expired.  */
+#define PROGRESS_PERIOD_MS	250
+#define PROGRESS_HEIGHT		12
+
+static struct progress {
+	EFI_EVENT timer;
+	BOOLEAN active;
+	UINT64 total;
+	UINT64 done;
+	UINT64 start;
+	UINT64 start_us;
+	UINTN y;
+	UINTN filled;
+} progress;
+
 static EFI_STATUS fastboot_ui_clear_dynamic_part(void)
 {
 	return ui_clear_area(area_x, area_y,
@@ -159,26 +179,75 @@ struct info_text_fun {
 
 static const char *FASTBOOT_TITLE = "FASTBOOT MODE";
 
-static UINTN fastboot_ui_info_draw(UINTN x, UINTN y, UINTN width, UINTN height)
+/* The info panel is rendered once in a textarea.  Only the lock
+   state line is rendered again when the device state changes.  */
+#define INFO_LOCK_STATE_LINE	(ARRAY_SIZE(FASTBOOT_INFOS) + 1)
+
+static struct info_panel {
+	ui_textarea_t *textarea;
+	UINTN width;
+	UINTN height;
+	enum device_state state;
+} info_panel;
+
+static char *fastboot_ui_info_line(const struct info_text_fun *info, UINTN i)
+{
+	char *value, *str;
+	int len;
+
+	value = info->get_value();
+	if (!value) {
+		error(L"Failed to get fastboot info line %d value", i);
+		return NULL;
+	}
+
+	len = strlen((CHAR8 *)info->header) + strlen((CHAR8 *)value) + 4;
+	str = AllocatePool(len);
+	if (!str) {
+		error(L"Failed to allocate fastboot line %d buffer len=%d", i, len);
+		return NULL;
+	}
+
+	len = snprintf((CHAR8 *)str, len, (CHAR8 *)"%a - %a",
+		       info->header, value);
+	if (len < 0) {
+		error(L"Failed to format fastboot info line %d", i);
+		FreePool(str);
+		return NULL;
+	}
+
+	return str;
+}
+
+static void fastboot_ui_info_free(void)
+{
+	if (!info_panel.textarea)
+		return;
+
+	ui_textarea_free(info_panel.textarea);
+	info_panel.textarea = NULL;
+}
+
+static EFI_STATUS fastboot_ui_info_create(UINTN width, UINTN height)
 {
 	UINTN i, line_nb = ARRAY_SIZE(FASTBOOT_INFOS) + 2;
 	ui_textline_t *lines;
 
 	lines = AllocateZeroPool(sizeof(*lines) * (line_nb + 1));
 	if (!lines)
-		goto exit;
+		return EFI_OUT_OF_RESOURCES;
 
-	lines[0].str = (char *)FASTBOOT_TITLE;
+	lines[0].str = strdup(FASTBOOT_TITLE);
 	lines[0].color = &COLOR_RED;
 	lines[0].bold = TRUE;
 
-	lines[1].str = "";
+	lines[1].str = strdup("");
+	if (!lines[0].str || !lines[1].str)
+		goto exit;
 
 	for (i = 2; i < line_nb; i++) {
 		const struct info_text_fun *info = &FASTBOOT_INFOS[i - 2];
 		ui_textline_t *line = &lines[i];
-		char *value;
-		int len;
 
 		line->color = info->get_color();
 		if (!line->color) {
@@ -186,37 +255,78 @@ static UINTN fastboot_ui_info_draw(UINTN x, UINTN y, UINTN width, UINTN height)
 			goto exit;
 		}
 
-		value = info->get_value();
-		if (!value) {
-			error(L"Failed to get fastboot info line %d value", i);
+		line->str = fastboot_ui_info_line(info, i);
+		if (!line->str)
 			goto exit;
-		}
+	}
 
-		len = strlen((CHAR8 *)info->header) + strlen((CHAR8 *)value) + 4;
-		line->str = AllocatePool(len);
-		if (!line->str) {
-			error(L"Failed to allocate fastboot line %d buffer len=%d", i, len);
-			goto exit;
-		}
+	info_panel.textarea = ui_textarea_create_text(lines, ui_font_get_default(),
+						      width, height, NULL);
+	info_panel.width = width;
+	info_panel.height = height;
+	info_panel.state = get_current_state();
 
-		len = snprintf((CHAR8 *)line->str, len, (CHAR8 *)"%a - %a",
-			       info->header, value);
-		if (len < 0) {
-			error(L"Failed to format fastboot info line %d", i);
-			goto exit;
-		}
+exit:
+	if (!info_panel.textarea)
+		for (i = 0; i < line_nb; i++)
+			if (lines[i].str)
+				FreePool(lines[i].str);
+	FreePool(lines);
+	return info_panel.textarea ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+/* Render again the lock state line if the device state has changed.
+   The whole panel is rebuilt if the new line does not fit.  */
+static EFI_STATUS fastboot_ui_info_update(void)
+{
+	const struct info_text_fun *info = &FASTBOOT_INFOS[INFO_LOCK_STATE_LINE - 2];
+	ui_textarea_t *textarea = info_panel.textarea;
+	char *str;
+
+	if (get_current_state() == info_panel.state)
+		return EFI_SUCCESS;
+
+	str = fastboot_ui_info_line(info, INFO_LOCK_STATE_LINE);
+	if (!str)
+		return EFI_OUT_OF_RESOURCES;
+
+	if (strlen((CHAR8 *)str) > textarea->row_nb) {
+		FreePool(str);
+		fastboot_ui_info_free();
+		return fastboot_ui_info_create(info_panel.width, info_panel.height);
 	}
 
-	ui_textarea_display_text(lines, ui_font_get_default(),
-				 x, &y, width, height, NULL);
+	FreePool(textarea->text[INFO_LOCK_STATE_LINE].str);
+	ui_textarea_set_line(textarea, INFO_LOCK_STATE_LINE, str,
+			     info->get_color(), FALSE);
+	info_panel.state = get_current_state();
+	return EFI_SUCCESS;
+}
 
-exit:
-	if (lines) {
-		for (i = 2; i < line_nb && lines[i].str; i++)
-			FreePool(lines[i].str);
-		FreePool(lines);
+static UINTN fastboot_ui_info_draw(UINTN x, UINTN y, UINTN width, UINTN height)
+{
+	EFI_STATUS ret;
+
+	if (info_panel.textarea &&
+	    (info_panel.width != width || info_panel.height != height))
+		fastboot_ui_info_free();
+
+	if (info_panel.textarea)
+		ret = fastboot_ui_info_update();
+	else
+		ret = fastboot_ui_info_create(width, height);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to render the fastboot info panel");
+		return y;
 	}
-	return y;
+
+	/* The dynamic part has just been cleared.  */
+	ui_textarea_invalidate(info_panel.textarea);
+	ret = ui_textarea_draw(info_panel.textarea, x, y);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to draw the fastboot info panel");
+
+	return y + info_panel.textarea->height;
 }
 
 BOOLEAN fastboot_ui_confirm_for_state(enum device_state target)
@@ -250,8 +360,123 @@ void fastboot_ui_refresh(void)
 	fastboot_ui_clear_dynamic_part();
 	ui_boot_menu_draw(boot_menu, area_x, &y, swidth - area_x - margin);
 	y += 20;
-	fastboot_ui_info_draw(area_x, y, swidth - area_x - margin,
-			      sheight - y - margin);
+	y = fastboot_ui_info_draw(area_x, y, swidth - area_x - margin,
+				  sheight - y - margin);
+	progress.y = y + SPACE;
+	progress.filled = 0;
+	ui_flush();
+}
+
+/* DONE is the amount of data already received by a resumed
+   download.  */
+void fastboot_ui_progress_start(UINT64 total, UINT64 done)
+{
+	EFI_STATUS ret;
+
+	progress.total = total;
+	progress.done = progress.start = done;
+	progress.filled = 0;
+	progress.start_us = timer_us();
+	progress.active = TRUE;
+
+	if (!fastboot_ui_initialized || progress.timer)
+		return;
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0, NULL, NULL,
+				&progress.timer);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create the progress timer");
+		progress.timer = NULL;
+		return;
+	}
+
+	ret = uefi_call_wrapper(BS->SetTimer, 3, progress.timer, TimerPeriodic,
+				PROGRESS_PERIOD_MS * 10000);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to start the progress timer");
+		uefi_call_wrapper(BS->CloseEvent, 1, progress.timer);
+		progress.timer = NULL;
+	}
+}
+
+/* Called from the receive completion path: must not draw.  */
+void fastboot_ui_progress_update(UINT64 done)
+{
+	progress.done = done;
+}
+
+static void fastboot_ui_progress_draw(void)
+{
+	ui_font_t *font = ui_font_get_default();
+	UINTN width = swidth - area_x - margin;
+	UINTN filled, y = progress.y + PROGRESS_HEIGHT + SPACE / 2;
+	UINT64 elapsed, rate, eta;
+	char text[64];
+	ui_textline_t lines[] = {
+		{ &COLOR_WHITE, text, FALSE },
+		{ NULL, NULL, FALSE }
+	};
+
+	if (!font || y + font->cheight > sheight - margin)
+		return;
+
+	if (!progress.filled)
+		ui_fill_area(area_x, progress.y, width, PROGRESS_HEIGHT,
+			     &COLOR_LIGHTGRAY);
+
+	/* Only the newly filled part of the bar is drawn.  */
+	filled = progress.total ? progress.done * width / progress.total : 0;
+	if (filled > progress.filled) {
+		ui_fill_area(area_x + progress.filled, progress.y,
+			     filled - progress.filled, PROGRESS_HEIGHT, &COLOR_GREEN);
+		progress.filled = filled;
+	}
+
+	elapsed = timer_us() - progress.start_us;
+	rate = elapsed ? (progress.done - progress.start) * 1000000 / elapsed : 0;
+	eta = rate ? (progress.total - progress.done) / rate : 0;
+	if (snprintf((CHAR8 *)text, sizeof(text),
+		     (CHAR8 *)"%d MiB / %d MiB  %d.%d MiB/s  ETA %ds",
+		     (UINT32)(progress.done / MiB), (UINT32)(progress.total / MiB),
+		     (UINT32)(rate / MiB), (UINT32)(rate % MiB * 10 / MiB),
+		     (UINT32)eta) < 0)
+		return;
+
+	ui_fill_area(area_x, y, width, font->cheight, &COLOR_BLACK);
+	ui_textarea_display_text(lines, font, area_x, &y, width,
+				 font->cheight, NULL);
+	ui_flush();
+}
+
+/* For the long commands which block the main loop.  */
+void fastboot_ui_progress_refresh(void)
+{
+	if (progress.timer && progress.active &&
+	    uefi_call_wrapper(BS->CheckEvent, 1, progress.timer) == EFI_SUCCESS)
+		fastboot_ui_progress_draw();
+}
+
+/* May be called from the receive completion path: the bar is
+   removed by the main loop.  */
+void fastboot_ui_progress_stop(void)
+{
+	progress.active = FALSE;
+}
+
+static void fastboot_ui_progress_remove(void)
+{
+	ui_font_t *font = ui_font_get_default();
+
+	uefi_call_wrapper(BS->CloseEvent, 1, progress.timer);
+	progress.timer = NULL;
+
+	if (!fastboot_ui_initialized || !font ||
+	    progress.y + PROGRESS_HEIGHT + SPACE / 2 + font->cheight > sheight - margin)
+		return;
+
+	ui_clear_area(area_x, progress.y, swidth - area_x - margin,
+		      PROGRESS_HEIGHT + SPACE / 2 + font->cheight);
+	progress.filled = 0;
 }
 
 EFI_STATUS fastboot_ui_init(void)
@@ -266,6 +491,12 @@ EFI_STATUS fastboot_ui_init(void)
 		return ret;
 	}
 
+	/* The fastboot screen is drawn off-screen and flushed once
+	   complete.  */
+	ret = ui_back_buffer_enable();
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Back buffer not available, drawing on screen");
+
 	ui_clear_screen();
 
 	/* Use large enough margin to not overlap ui_print/ui_error
@@ -320,13 +551,29 @@ EFI_STATUS fastboot_ui_init(void)
 
 enum boot_target fastboot_ui_event_handler()
 {
-	return ui_boot_menu_event_handler(boot_menu, ui_read_input());
+	enum boot_target target;
+
+	target = ui_boot_menu_event_handler(boot_menu, ui_read_input());
+	if (progress.timer && !progress.active)
+		fastboot_ui_progress_remove();
+	else if (progress.timer &&
+		 uefi_call_wrapper(BS->CheckEvent, 1, progress.timer) == EFI_SUCCESS)
+		fastboot_ui_progress_draw();
+	ui_flush();
+	return target;
 }
 
 void fastboot_ui_destroy(void)
 {
+	if (progress.timer) {
+		uefi_call_wrapper(BS->CloseEvent, 1, progress.timer);
+		progress.timer = NULL;
+	}
+	progress.active = FALSE;
 	ui_boot_menu_free(boot_menu);
+	fastboot_ui_info_free();
 	ui_print_clear();
 	ui_display_vendor_splash();
+	ui_back_buffer_disable();
 	fastboot_ui_initialized = FALSE;
 }
@@ -42,5 +42,9 @@ void fastboot_ui_destroy(void);
 enum boot_target fastboot_ui_event_handler(void);
 BOOLEAN fastboot_ui_confirm_for_state(enum device_state target);
 void fastboot_ui_refresh(void);
+void fastboot_ui_progress_start(UINT64 total, UINT64 done);
+void fastboot_ui_progress_update(UINT64 done);
+void fastboot_ui_progress_refresh(void);
+void fastboot_ui_progress_stop(void);
 
 #endif  /* _FASTBOOT_UI_H_ */
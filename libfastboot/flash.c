@@ -39,15 +39,26 @@
 #include <android.h>
 
 #include "uefi_utils.h"
+#include "fastboot_ui.h"
 #include "gpt.h"
 #include "gpt_bin.h"
 #include "flash.h"
 #include "storage.h"
+#include "async_io.h"
 #include "sparse.h"
+#include "sparse_format.h"
+#include "delta.h"
+#include "lz4.h"
+#include "mkfs.h"
+#include "hashes.h"
+#include "crc32.h"
+#include "perf.h"
 #include "oemvars.h"
 #include "vars.h"
 #include "bootloader.h"
 #include "authenticated_action.h"
+#include "trace.h"
+#include "memstat.h"
 
 static struct gpt_partition_interface gparti;
 static UINT64 cur_offset;
@@ -58,20 +69,512 @@ static UINT64 cur_offset;
 #define is_inside_partition(off, sz) \
 		(off >= part_start && off + sz <= part_end)
 
-EFI_STATUS flash_skip(UINT64 size)
+/* The first write into a partition drops its erased record, see
+   erase_start().  The partition is remembered to not look the record
+   up again on each write.  */
+static struct {
+	UINT64 start;
+	UINT64 end;
+	BOOLEAN valid;
+} written;
+
+static void forget_erased_target(void)
+{
+	if (written.valid && written.start == gparti.part.starting_lba &&
+	    written.end == gparti.part.ending_lba)
+		return;
+
+	forget_erased_parts(gparti.part.starting_lba, gparti.part.ending_lba);
+	written.start = gparti.part.starting_lba;
+	written.end = gparti.part.ending_lba;
+	written.valid = TRUE;
+}
+
+void flash_forget_erased(const CHAR16 *label)
+{
+	struct gpt_partition_interface part;
+
+	written.valid = FALSE;
+	if (!label) {
+		forget_all_erased_parts();
+		return;
+	}
+
+	if (!EFI_ERROR(gpt_get_partition_by_label(label, &part, LOGICAL_UNIT_USER)))
+		forget_erased_parts(part.part.starting_lba, part.part.ending_lba);
+}
+
+/* The skipped area is part of the partition hash, read it back.  */
+#define HASH_READ_SIZE (1024 * 1024)
+static EFI_STATUS hash_skipped(UINT64 size)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	UINT64 offset;
+	UINTN len;
+	VOID *buf;
+
+	buf = AllocatePool(min(size, (UINT64)HASH_READ_SIZE));
+	if (!buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	for (offset = cur_offset; offset < cur_offset + size; offset += len) {
+		len = min(cur_offset + size - offset, (UINT64)HASH_READ_SIZE);
+		ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
+					gparti.bio->Media->MediaId, offset, len, buf);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to read back skipped bytes");
+			break;
+		}
+		hash_cache_update(buf, offset - part_start, len);
+	}
+
+	FreePool(buf);
+	return ret;
+}
+
+/* When the VerifyFlash option is set, a CRC32 of each written piece
+   of at most VERIFY_PIECE_SIZE bytes is recorded.  The pieces are read
+   back and checked once the image is flashed.  */
+#define VERIFY_PIECE_SIZE (1024 * 1024)
+struct verify_piece {
+	UINT64 offset;
+	UINT32 len;
+	UINT32 crc;
+};
+
+static struct {
+	BOOLEAN enabled;
+	struct verify_piece *pieces;
+	UINTN count;
+	UINTN max;
+	BOOLEAN failed;
+	UINT64 mismatch;
+} verify;
+
+static void verify_start(void)
+{
+	verify.enabled = get_verify_flash();
+	verify.count = 0;
+	verify.failed = FALSE;
+}
+
+static void verify_stop(void)
+{
+	if (verify.pieces)
+		FreePool(verify.pieces);
+	verify.pieces = NULL;
+	verify.count = verify.max = 0;
+	verify.enabled = FALSE;
+}
+
+static struct verify_piece *verify_new_piece(UINT64 offset)
+{
+	struct verify_piece *pieces;
+	UINTN max;
+
+	if (verify.count == verify.max) {
+		max = verify.max ? verify.max * 2 : 1024;
+		pieces = ReallocatePool(verify.pieces, verify.max * sizeof(*pieces),
+					max * sizeof(*pieces));
+		if (!pieces)
+			return NULL;
+		verify.pieces = pieces;
+		verify.max = max;
+	}
+
+	pieces = &verify.pieces[verify.count++];
+	pieces->offset = offset;
+	pieces->len = 0;
+	pieces->crc = 0;
+	return pieces;
+}
+
+static EFI_STATUS verify_record(UINT64 offset, CHAR8 *data, UINTN size)
+{
+	struct verify_piece *piece;
+	UINTN len;
+
+	if (!verify.enabled)
+		return EFI_SUCCESS;
+
+	for (; size; size -= len, offset += len, data += len) {
+		piece = verify.count ? &verify.pieces[verify.count - 1] : NULL;
+		if (!piece || piece->offset + piece->len != offset ||
+		    piece->len == VERIFY_PIECE_SIZE) {
+			piece = verify_new_piece(offset);
+			if (!piece) {
+				error(L"Failed to allocate verification data");
+				return EFI_OUT_OF_RESOURCES;
+			}
+		}
+
+		len = min(size, (UINTN)(VERIFY_PIECE_SIZE - piece->len));
+		piece->crc = crc32_update(piece->crc, data, len);
+		piece->len += len;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS verify_run(void)
+{
+	struct verify_piece *piece;
+	EFI_STATUS ret = EFI_SUCCESS;
+	VOID *buf;
+	UINTN i;
+
+	if (!verify.enabled || !verify.count)
+		return EFI_SUCCESS;
+
+	buf = AllocatePool(VERIFY_PIECE_SIZE);
+	if (!buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	log_debug(STORAGE, L"Verifying %d written pieces", verify.count);
+	for (i = 0; i < verify.count; i++) {
+		piece = &verify.pieces[i];
+		ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
+					gparti.bio->Media->MediaId, piece->offset,
+					piece->len, buf);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to read back written data");
+			break;
+		}
+		if (crc32_update(0, buf, piece->len) != piece->crc) {
+			verify.failed = TRUE;
+			verify.mismatch = piece->offset - part_start;
+			error(L"Verification failed at partition offset 0x%lx",
+			      verify.mismatch);
+			ret = EFI_CRC_ERROR;
+			break;
+		}
+	}
+
+	FreePool(buf);
+	return ret;
+}
+
+BOOLEAN flash_verify_failed(UINT64 *offset)
+{
+	if (verify.failed && offset)
+		*offset = verify.mismatch;
+	return verify.failed;
+}
+
+/* When the DiscardDontCare option is set, the skipped areas are
+   discarded.  Adjacent areas are merged and the resulting ranges are
+   queued so that the storage discards many of them at once.  */
+#define DISCARD_MAX_RANGES 256
+
+static struct {
+	BOOLEAN enabled;
+	UINT64 start;
+	UINT64 end;
+	struct lba_range ranges[DISCARD_MAX_RANGES];
+	UINTN nb;
+} discard;
+
+static void discard_start(void)
+{
+	discard.enabled = get_discard_dont_care();
+	discard.start = discard.end = 0;
+	discard.nb = 0;
+}
+
+/* Queue the current area, only the blocks entirely inside it */
+static void discard_queue(void)
+{
+	UINT32 block_size = gparti.bio->Media->BlockSize;
+	UINT64 first, last;
+
+	first = DIV_ROUND_UP(discard.start, block_size);
+	last = discard.end / block_size;
+	discard.start = discard.end = 0;
+	if (first >= last)
+		return;
+
+	discard.ranges[discard.nb].start = first;
+	discard.ranges[discard.nb].end = last - 1;
+	discard.nb++;
+}
+
+static EFI_STATUS discard_flush(void)
 {
+	EFI_STATUS ret;
+	UINTN nb;
+
+	discard_queue();
+	nb = discard.nb;
+	discard.nb = 0;
+	if (!nb)
+		return EFI_SUCCESS;
+
+	ret = async_write_sync();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* The area content does not matter, a failure is not fatal */
+	ret = storage_erase_ranges(gparti.handle, gparti.bio, discard.ranges, nb);
+	if (EFI_ERROR(ret))
+		debug(L"Failed to discard %d areas, %r", nb, ret);
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS discard_skipped(UINT64 size)
+{
+	EFI_STATUS ret;
+
+	/* The partition content becomes indeterminate */
+	hash_cache_end(FALSE);
+	forget_erased_target();
+
+	if (discard.end != cur_offset) {
+		discard_queue();
+		if (discard.nb == ARRAY_SIZE(discard.ranges)) {
+			ret = discard_flush();
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+		discard.start = cur_offset;
+	}
+	discard.end = cur_offset + size;
+
+	return EFI_SUCCESS;
+}
+
+/* DISCARDABLE is TRUE for the areas whose content does not matter, as
+   opposed to the areas to keep as they are.  */
+static EFI_STATUS skip(UINT64 size, BOOLEAN discardable)
+{
+	EFI_STATUS ret;
+
 	if (!is_inside_partition(cur_offset, size)) {
 		error(L"Attempt to skip outside of partition [%ld %ld] [%ld %ld]",
 				part_start, part_end, cur_offset, cur_offset + size);
 		return EFI_INVALID_PARAMETER;
 	}
+	if (discardable && discard.enabled && size) {
+		ret = discard_skipped(size);
+		if (EFI_ERROR(ret))
+			return ret;
+	} else if (hash_cache_active() && size) {
+		ret = hash_skipped(size);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
 	cur_offset += size;
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS flash_write(VOID *data, UINTN size)
+EFI_STATUS flash_skip(UINT64 size)
+{
+	return skip(size, TRUE);
+}
+
+EFI_STATUS flash_keep(UINT64 size)
+{
+	return skip(size, FALSE);
+}
+
+/* Offset of the next write, from the partition start */
+UINT64 flash_tell(void)
+{
+	return cur_offset - part_start;
+}
+
+/* Bytes left in the partition from the next write offset */
+UINT64 flash_space(void)
+{
+	return part_end - cur_offset;
+}
+
+EFI_STATUS flash_read(UINT64 offset, VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+
+	if (!gparti.bio)
+		return EFI_INVALID_PARAMETER;
+
+	if (!is_inside_partition(part_start + offset, size)) {
+		error(L"Attempt to read outside of partition [%ld %ld] [%ld %ld]",
+		      part_start, part_end, part_start + offset,
+		      part_start + offset + size);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
+				gparti.bio->Media->MediaId, part_start + offset,
+				size, data);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to read partition at 0x%lx", offset);
+
+	return ret;
+}
+
+/* Writes are issued with BlockIo when they are block aligned: the
+   DiskIo layer would otherwise bounce the data through its own
+   buffers.  Misaligned buffers are copied to an IoAlign aligned
+   bounce buffer kept across calls.  While an image is flashed,
+   BlockIo writes go through the asynchronous writer.  */
+#define BOUNCE_BUFFER_SIZE (1024 * 1024)
+static struct {
+	VOID *free_addr;
+	CHAR8 *buf;
+} bounce;
+
+static BOOLEAN is_io_aligned(VOID *data)
+{
+	UINTN align = gparti.bio->Media->IoAlign;
+
+	return align <= 1 || !((UINTN)data & (align - 1));
+}
+
+UINTN flash_io_align(void)
 {
+	return gparti.bio ? gparti.bio->Media->IoAlign : 0;
+}
+
+/* Preferred size and alignment of the writes, larger on the media
+   with large blocks, UFS for instance, so that the writes cover whole
+   erase blocks.  */
+#define WRITE_GRANULE_BLOCKS 2048
+#define WRITE_GRANULE_MIN (1024 * 1024)
+#define WRITE_GRANULE_MAX (4 * 1024 * 1024)
+
+UINTN flash_write_granule(void)
+{
+	UINTN granule;
+
+	if (!gparti.bio)
+		return WRITE_GRANULE_MIN;
+
+	granule = gparti.bio->Media->BlockSize * WRITE_GRANULE_BLOCKS;
+	return min(max(granule, (UINTN)WRITE_GRANULE_MIN), (UINTN)WRITE_GRANULE_MAX);
+}
+
+static EFI_STATUS write_bytes(UINT64 offset, VOID *data, UINTN size)
+{
+	return uefi_call_wrapper(gparti.dio->WriteDisk, 5, gparti.dio,
+				 gparti.bio->Media->MediaId, offset, size, data);
+}
+
+static EFI_STATUS do_write_blocks(UINT64 offset, CHAR8 *data, UINTN size)
+{
+	EFI_BLOCK_IO *bio = gparti.bio;
 	EFI_STATUS ret;
+	UINTN len;
+
+	trace(TRACE_DISK_WRITE, size, offset);
+
+	/* The asynchronous writer copies the data to its own aligned
+	   buffers */
+	if (is_io_aligned(data) || async_write_active(bio))
+		return async_write_blocks(bio, offset / bio->Media->BlockSize,
+					  size, data, TRUE);
+
+	if (bounce.buf && !is_io_aligned(bounce.buf)) {
+		FreePool(bounce.free_addr);
+		bounce.buf = NULL;
+	}
+	if (!bounce.buf) {
+		ret = alloc_aligned(&bounce.free_addr, (VOID **)&bounce.buf,
+				    BOUNCE_BUFFER_SIZE, bio->Media->IoAlign);
+		if (EFI_ERROR(ret))
+			return write_bytes(offset, data, size);
+	}
+
+	for (; size; size -= len, offset += len, data += len) {
+		len = min(size, (UINTN)BOUNCE_BUFFER_SIZE);
+		memcpy(bounce.buf, data, len);
+		ret = uefi_call_wrapper(bio->WriteBlocks, 5, bio, bio->Media->MediaId,
+					offset / bio->Media->BlockSize, len, bounce.buf);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* When the DeltaFlash option is set, the blocks are read first and
+   only the DELTA_PIECE_SIZE pieces that differ from the data are
+   written.  */
+#define DELTA_PIECE_SIZE (1024 * 1024)
+static struct {
+	BOOLEAN enabled;
+	VOID *free_addr;
+	CHAR8 *buf;
+	UINT64 skipped;
+} delta;
+
+static void delta_start(void)
+{
+	EFI_STATUS ret;
+
+	delta.enabled = get_delta_flash();
+	delta.skipped = 0;
+	if (!delta.enabled)
+		return;
+
+	ret = alloc_aligned(&delta.free_addr, (VOID **)&delta.buf,
+			    DELTA_PIECE_SIZE, gparti.bio->Media->IoAlign);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Delta flash disabled");
+		delta.enabled = FALSE;
+	}
+}
+
+static void delta_stop(void)
+{
+	if (delta.enabled)
+		log_debug(STORAGE, L"Delta flash: %ld MiB unchanged", delta.skipped / MiB);
+
+	if (delta.free_addr)
+		FreePool(delta.free_addr);
+	delta.free_addr = NULL;
+	delta.buf = NULL;
+	delta.enabled = FALSE;
+}
+
+static BOOLEAN blocks_match(UINT64 offset, CHAR8 *data, UINTN size)
+{
+	EFI_BLOCK_IO *bio = gparti.bio;
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(bio->ReadBlocks, 5, bio, bio->Media->MediaId,
+				offset / bio->Media->BlockSize, size, delta.buf);
+	return !EFI_ERROR(ret) && !CompareMem(delta.buf, data, size);
+}
+
+static EFI_STATUS write_blocks(UINT64 offset, CHAR8 *data, UINTN size)
+{
+	EFI_STATUS ret;
+	UINTN len;
+
+	if (!delta.enabled)
+		return do_write_blocks(offset, data, size);
+
+	for (; size; size -= len, offset += len, data += len) {
+		len = min(size, (UINTN)DELTA_PIECE_SIZE);
+		if (blocks_match(offset, data, len)) {
+			delta.skipped += len;
+			continue;
+		}
+		ret = do_write_blocks(offset, data, len);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_write(VOID *data, UINTN size)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	UINT32 block_size;
+	UINT64 offset;
+	UINTN head, body;
+	CHAR8 *s = data;
 
 	if (!gparti.bio)
 		return EFI_INVALID_PARAMETER;
@@ -81,30 +584,130 @@ EFI_STATUS flash_write(VOID *data, UINTN size)
 				part_start, part_end, cur_offset, cur_offset + size);
 		return EFI_INVALID_PARAMETER;
 	}
-	ret = uefi_call_wrapper(gparti.dio->WriteDisk, 5, gparti.dio, gparti.bio->Media->MediaId, cur_offset, size, data);
+	forget_erased_target();
+
+	/* Unaligned head and tail go through DiskIo, the block aligned
+	   body through BlockIo.  */
+	block_size = gparti.bio->Media->BlockSize;
+	offset = cur_offset;
+	head = min(size, (UINTN)((block_size - offset % block_size) % block_size));
+	body = (size - head) / block_size * block_size;
+
+	perf_io_start();
+	if (head)
+		ret = write_bytes(offset, s, head);
+	if (!EFI_ERROR(ret) && body)
+		ret = write_blocks(offset + head, s + head, body);
+	if (!EFI_ERROR(ret) && size - head - body)
+		ret = write_bytes(offset + head + body, s + head + body,
+				  size - head - body);
+	perf_io_end(size);
+
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to write bytes");
+	else {
+		hash_cache_update(data, cur_offset - part_start, size);
+		ret = verify_record(cur_offset, data, size);
+	}
 
 	cur_offset += size;
 	return ret;
 }
 
-EFI_STATUS flash_fill(UINT32 pattern, UINTN size)
-{
+/* FILL chunks can cover hundreds of MiB: they are written from a
+   small pattern buffer kept across calls.  */
+#define FILL_BUFFER_SIZE (1024 * 1024)
+static struct {
+	VOID *free_addr;
 	UINT32 *buf;
+	UINT32 pattern;
+} fill;
+
+static EFI_STATUS fill_buffer_get(UINT32 pattern)
+{
+	EFI_STATUS ret;
+	UINTN align = gparti.bio->Media->IoAlign;
 	UINTN i;
+
+	if (fill.buf && align && ((UINTN)fill.buf & (align - 1)))
+		flash_free();
+
+	if (!fill.buf) {
+		ret = alloc_aligned(&fill.free_addr, (VOID **)&fill.buf,
+				    FILL_BUFFER_SIZE, align);
+		if (EFI_ERROR(ret))
+			return ret;
+		/* alloc_aligned() returns a zeroed buffer.  */
+		fill.pattern = 0;
+	}
+
+	if (fill.pattern != pattern) {
+		for (i = 0; i < FILL_BUFFER_SIZE / sizeof(*fill.buf); i++)
+			fill.buf[i] = pattern;
+		fill.pattern = pattern;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_fill(UINT32 pattern, UINT64 size)
+{
 	EFI_STATUS ret;
+	UINTN len;
 
-	buf = AllocatePool(size);
-	if (!buf)
-		return EFI_OUT_OF_RESOURCES;
+	if (!gparti.bio)
+		return EFI_INVALID_PARAMETER;
 
-	for (i = 0; i < size / sizeof(*buf); i++)
-		buf[i] = pattern;
+	if (!is_inside_partition(cur_offset, size)) {
+		error(L"Attempt to fill outside of partition [%ld %ld] [%ld %ld]",
+				part_start, part_end, cur_offset, cur_offset + size);
+		return EFI_INVALID_PARAMETER;
+	}
 
-	ret = flash_write(buf, size);
-	FreePool(buf);
-	return ret;
+	ret = fill_buffer_get(pattern);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	for (; size; size -= len) {
+		len = min(size, (UINT64)FILL_BUFFER_SIZE);
+		ret = flash_write(fill.buf, len);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+void flash_free(void)
+{
+	uefi_fs_cache_flush();
+	if (fill.free_addr) {
+		FreePool(fill.free_addr);
+		fill.free_addr = NULL;
+		fill.buf = NULL;
+	}
+	if (bounce.free_addr) {
+		FreePool(bounce.free_addr);
+		bounce.free_addr = NULL;
+		bounce.buf = NULL;
+	}
+}
+
+/* Direct the flash_write() family to TARGET, a RAM disk for the
+   benchmarks for instance, NULL to stop.  */
+void flash_set_target(struct gpt_partition_interface *target)
+{
+	flash_free();
+	delta_stop();
+	discard.enabled = FALSE;
+
+	if (!target) {
+		ZeroMem(&gparti, sizeof(gparti));
+		return;
+	}
+
+	memcpy(&gparti, target, sizeof(gparti));
+	cur_offset = part_start;
 }
 
 static EFI_STATUS flash_into_esp(VOID *data, UINTN size, CHAR16 *label)
@@ -117,6 +720,7 @@ static EFI_STATUS flash_into_esp(VOID *data, UINTN size, CHAR16 *label)
 		efi_perror(ret, L"Failed to get partition ESP");
 		return ret;
 	}
+	esp_hash_invalidate(label);
 	return uefi_write_file_with_dir(io, label, data, size);
 }
 
@@ -145,10 +749,10 @@ static EFI_STATUS _flash_gpt(VOID *data, UINTN size, logical_unit_t log_unit)
 
 static EFI_STATUS flash_gpt(VOID *data, UINTN size)
 {
-	EFI_STATUS ret;
-
-	ret = _flash_gpt(data, size, LOGICAL_UNIT_USER);
-	return EFI_ERROR(ret) ? ret : EFI_SUCCESS | REFRESH_PARTITION_VAR;
+	/* Partitions may move */
+	hash_cache_invalidate(NULL);
+	flash_forget_erased(NULL);
+	return _flash_gpt(data, size, LOGICAL_UNIT_USER);
 }
 
 static EFI_STATUS flash_gpt_gpp1(VOID *data, UINTN size)
@@ -181,6 +785,8 @@ static EFI_STATUS flash_mbr(VOID *data, UINTN size)
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to flash MBR");
 
+	/* The first block is read again with the partition tables */
+	gpt_free_cache();
 	return ret;
 }
 #endif
@@ -195,11 +801,49 @@ static EFI_STATUS flash_ifwi(VOID *data, UINTN size)
 	return flash_into_esp(data, size, L"ifwi.bin");
 }
 
+static EFI_STATUS flash_oemvars_report(VOID *data, UINTN size)
+{
+	oemvars_stats_t stats;
+	EFI_STATUS ret;
+
+	ret = flash_oemvars(data, size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* The boot image oemvars must be applied again over these.  */
+	set_oemvars_digest(NULL);
+
+	oemvars_get_stats(&stats);
+	fastboot_info("oemvars: %d written, %d deleted, %d unchanged",
+		      stats.written, stats.deleted, stats.unchanged);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS read_boot_range(UINT64 offset, UINTN size, VOID *dest)
+{
+	EFI_STATUS ret;
+
+	if (!size)
+		return EFI_SUCCESS;
+
+	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
+				gparti.bio->Media->MediaId,
+				gparti.part.starting_lba * gparti.bio->Media->BlockSize
+				+ offset, size, dest);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to load the current bootimage");
+
+	return ret;
+}
+
+/* Only the header page and the kernel pages are written when the new
+   kernel fits in the same number of pages, the ramdisk and the second
+   stage are read and shifted otherwise.  */
 static EFI_STATUS flash_zimage(VOID *data, UINTN size)
 {
-	struct boot_img_hdr *bootimage, *new_bootimage;
-	VOID *new_cur, *cur;
-	UINTN new_size, partlen;
+	struct boot_img_hdr hdr, *new_bootimage;
+	VOID *new_cur;
+	UINTN new_size, write_size, partlen, tail;
 	EFI_STATUS ret;
 
 	ret = gpt_get_partition_by_label(L"boot", &gparti, LOGICAL_UNIT_USER);
@@ -210,86 +854,229 @@ static EFI_STATUS flash_zimage(VOID *data, UINTN size)
 
 	partlen = (gparti.part.ending_lba + 1 - gparti.part.starting_lba)
 		* gparti.bio->Media->BlockSize;
-	bootimage = AllocatePool(partlen);
-	if (!bootimage) {
-		error(L"Unable to allocate bootimage buffer");
-		return EFI_OUT_OF_RESOURCES;
-	}
 
-	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
-				gparti.bio->Media->MediaId,
-				gparti.part.starting_lba * gparti.bio->Media->BlockSize,
-				partlen, bootimage);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to load the current bootimage");
-		goto out;
-	}
+	ret = read_boot_range(0, sizeof(hdr), &hdr);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	if (strncmpa((CHAR8 *)BOOT_MAGIC, bootimage->magic, BOOT_MAGIC_SIZE)) {
+	if (strncmpa((CHAR8 *)BOOT_MAGIC, hdr.magic, BOOT_MAGIC_SIZE) ||
+	    hdr.page_size < sizeof(hdr) ||
+	    (hdr.page_size & (hdr.page_size - 1))) {
 		error(L"boot partition does not contain a valid bootimage");
-		ret = EFI_UNSUPPORTED;
-		goto out;
+		return EFI_UNSUPPORTED;
 	}
 
-	new_size = bootimage_size(bootimage) - bootimage->kernel_size
-		+ pagealign(bootimage, size);
+	new_size = bootimage_size(&hdr) - pagealign(&hdr, hdr.kernel_size)
+		+ pagealign(&hdr, size);
 	if (new_size > partlen) {
 		error(L"Kernel image is too large to fit in the boot partition");
-		ret = EFI_INVALID_PARAMETER;
-		goto out;
+		return EFI_INVALID_PARAMETER;
 	}
 
-	new_bootimage = AllocateZeroPool(new_size);
-	if (!new_bootimage) {
-		ret = EFI_OUT_OF_RESOURCES;
-		goto out;
-	}
+	tail = pagealign(&hdr, hdr.ramdisk_size) + pagealign(&hdr, hdr.second_size);
+	write_size = hdr.page_size + pagealign(&hdr, size);
+	if (pagealign(&hdr, size) != pagealign(&hdr, hdr.kernel_size))
+		write_size += tail;
+
+	new_bootimage = memstat_zero_pool(MEMSTAT_FLASH, write_size);
+	if (!new_bootimage)
+		return EFI_OUT_OF_RESOURCES;
 
 	/* Create the new bootimage. */
-	memcpy((VOID *)new_bootimage, bootimage, bootimage->page_size);
+	ret = read_boot_range(0, hdr.page_size, new_bootimage);
+	if (EFI_ERROR(ret))
+		goto out;
 
 	new_bootimage->kernel_size = size;
-	new_bootimage->kernel_addr = bootimage->kernel_addr;
-	new_cur = (VOID *)new_bootimage + bootimage->page_size;
+	new_cur = (VOID *)new_bootimage + hdr.page_size;
 	memcpy(new_cur, data, size);
 
-	new_cur += pagealign(new_bootimage, size);
-	cur = (VOID *)bootimage + bootimage->page_size
-		+ pagealign(bootimage, bootimage->kernel_size);
-	memcpy(new_cur, cur, bootimage->ramdisk_size);
-
-	new_cur += pagealign(new_bootimage, new_bootimage->ramdisk_size);
-	cur += pagealign(bootimage, bootimage->ramdisk_size);
-	memcpy(new_cur, cur, bootimage->second_size);
+	if (write_size != hdr.page_size + pagealign(&hdr, size)) {
+		debug(L"Shifting the ramdisk and the second stage");
+		new_cur += pagealign(&hdr, size);
+		ret = read_boot_range(hdr.page_size + pagealign(&hdr, hdr.kernel_size),
+				      hdr.ramdisk_size, new_cur);
+		if (EFI_ERROR(ret))
+			goto out;
+
+		new_cur += pagealign(&hdr, hdr.ramdisk_size);
+		ret = read_boot_range(hdr.page_size + pagealign(&hdr, hdr.kernel_size)
+				      + pagealign(&hdr, hdr.ramdisk_size),
+				      hdr.second_size, new_cur);
+		if (EFI_ERROR(ret))
+			goto out;
+	}
 
 	/* Flash new the bootimage. */
 	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
-	ret = flash_write(new_bootimage, new_size);
-
-	FreePool(new_bootimage);
+	ret = flash_write(new_bootimage, write_size);
 
- out:
-	FreePool(bootimage);
+out:
+	memstat_free_pool(MEMSTAT_FLASH, new_bootimage, write_size);
 	return ret;
 }
 
-EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label)
+/* Incremental image writer.  The image type is found out from its
+   first bytes: an LZ4 frame is decompressed first, then the
+   decompressed data is either a sparse or a raw image.  */
+static struct {
+	BOOLEAN started;
+	BOOLEAN lz4;
+	UINTN magic_len;
+	CHAR8 magic[sizeof(UINT32)];
+	BOOLEAN sparse;
+	UINTN head_len;
+	CHAR8 head[sizeof(struct sparse_header)];
+} fstream;
+
+static void stream_reset(void)
+{
+	ZeroMem(&fstream, sizeof(fstream));
+	fstream.started = TRUE;
+}
+
+/* The image type is unknown until the size of a sparse header has
+   been received.  */
+static EFI_STATUS image_head(CHAR8 **data, UINTN *size)
 {
 	EFI_STATUS ret;
+	UINTN len;
 
-	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get partition %s", label);
+	len = min(*size, sizeof(fstream.head) - fstream.head_len);
+	memcpy(fstream.head + fstream.head_len, *data, len);
+	fstream.head_len += len;
+	*data += len;
+	*size -= len;
+
+	if (fstream.head_len != sizeof(fstream.head))
+		return EFI_SUCCESS;
+
+	fstream.sparse = is_sparse_image(fstream.head, fstream.head_len);
+	if (!fstream.sparse)
+		return flash_write(fstream.head, fstream.head_len);
+
+	ret = sparse_stream_start();
+	if (EFI_ERROR(ret))
 		return ret;
+	return sparse_stream_write(fstream.head, fstream.head_len);
+}
+
+static EFI_STATUS image_write(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+	CHAR8 *s = data;
+
+	if (fstream.head_len < sizeof(fstream.head)) {
+		ret = image_head(&s, &size);
+		if (EFI_ERROR(ret) || !size)
+			return ret;
 	}
 
-	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	return fstream.sparse ? sparse_stream_write(s, size) : flash_write(s, size);
+}
 
-	if (is_sparse_image(data, size))
-		ret = flash_sparse(data, size);
-	else
-		ret = flash_write(data, size);
+static EFI_STATUS image_end(void)
+{
+	if (fstream.sparse)
+		return sparse_stream_end();
+	if (fstream.head_len && fstream.head_len < sizeof(fstream.head))
+		return flash_write(fstream.head, fstream.head_len);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS stream_write(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+	CHAR8 *s = data;
+	UINTN len;
+
+	if (fstream.magic_len < sizeof(fstream.magic)) {
+		len = min(size, sizeof(fstream.magic) - fstream.magic_len);
+		memcpy(fstream.magic + fstream.magic_len, s, len);
+		fstream.magic_len += len;
+		s += len;
+		size -= len;
+		if (fstream.magic_len < sizeof(fstream.magic))
+			return EFI_SUCCESS;
+
+		fstream.lz4 = is_lz4_image(fstream.magic, fstream.magic_len);
+		if (fstream.lz4) {
+			ret = lz4_stream_start(image_write);
+			if (EFI_ERROR(ret))
+				return ret;
+			ret = lz4_stream_write(fstream.magic, fstream.magic_len);
+		} else
+			ret = image_write(fstream.magic, fstream.magic_len);
+		if (EFI_ERROR(ret) || !size)
+			return ret;
+	}
+
+	return fstream.lz4 ? lz4_stream_write(s, size) : image_write(s, size);
+}
+
+static EFI_STATUS stream_end(void)
+{
+	EFI_STATUS ret = EFI_SUCCESS, ret_image;
+
+	fstream.started = FALSE;
+
+	if (fstream.lz4)
+		ret = lz4_stream_end();
+	else if (fstream.magic_len && fstream.magic_len < sizeof(fstream.magic))
+		ret = image_write(fstream.magic, fstream.magic_len);
+
+	ret_image = image_end();
+	return EFI_ERROR(ret) ? ret : ret_image;
+}
+
+/* While a batch image is flashed, the writes of a partition are left
+   to complete in the background when the next partition is on
+   another logical unit, so that independent units, each with its own
+   queue, are written concurrently.  Batch entries labels prefixed by
+   FACTORY_UNIT_PREFIX are on the factory logical unit.  */
+#define FACTORY_UNIT_PREFIX L"factory/"
+
+static struct {
+	BOOLEAN active;
+	logical_unit_t log_unit;
+} batch;
+
+/* Set up the per image services once the partition is selected */
+static void flash_begin(CHAR16 *label)
+{
+	hash_cache_start(label);
+	async_write_open(gparti.bio);
+	discard_start();
+	verify_start();
+	delta_start();
+}
+
+static EFI_STATUS flash_finish(EFI_STATUS ret)
+{
+	EFI_STATUS ret_close;
 
+	/* Waiting for the writes in flight is disk I/O time too */
+	perf_io_start();
+	if (!EFI_ERROR(ret))
+		ret = discard_flush();
+	discard.enabled = FALSE;
+
+	/* Verification reads the partition back */
+	if (batch.active && !verify.enabled)
+		ret_close = async_write_detach();
+	else
+		ret_close = async_write_close();
+	perf_io_end(0);
+	if (!EFI_ERROR(ret))
+		ret = ret_close;
+	delta_stop();
+
+	if (!EFI_ERROR(ret))
+		ret = verify_run();
+	verify_stop();
+
+	hash_cache_end(!EFI_ERROR(ret));
+	trace(TRACE_FLASH_END, ret, 0);
 	if (EFI_ERROR(ret))
 		return ret;
 
@@ -299,6 +1086,122 @@ EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label)
 	return EFI_SUCCESS;
 }
 
+EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label)
+{
+	EFI_STATUS ret, ret_end;
+
+	ret = gpt_get_partition_by_label(label, &gparti, batch.active ?
+					 batch.log_unit : LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	flash_begin(label);
+
+	if (is_lz4_image(data, size)) {
+		stream_reset();
+		ret = stream_write(data, size);
+		ret_end = stream_end();
+		if (!EFI_ERROR(ret))
+			ret = ret_end;
+	} else if (is_sparse_image(data, size))
+		ret = flash_sparse(data, size);
+	else if (is_delta_image(data, size))
+		ret = flash_delta(data, size);
+	else
+		ret = flash_write(data, size);
+
+	return flash_finish(ret);
+}
+
+/* A batch image packs several partition images behind a manifest so
+   that they are flashed with a single download.  All the fields are
+   little endian and the offsets are relative to the batch image
+   start.  */
+#define BATCH_MAGIC 0x48544142	/* "BATH" */
+#define BATCH_VERSION 1
+#define BATCH_LABEL_LENGTH 72
+
+struct batch_header {
+	UINT32 magic;
+	UINT32 version;
+	UINT32 count;
+	UINT32 reserved;
+} __attribute__((packed));
+
+struct batch_entry {
+	CHAR8 label[BATCH_LABEL_LENGTH];
+	UINT64 offset;
+	UINT64 size;
+} __attribute__((packed));
+
+static EFI_STATUS flash_batch(VOID *data, UINTN size)
+{
+	struct batch_header *hdr = data;
+	struct batch_entry *entry;
+	EFI_STATUS ret, ret_join;
+	CHAR16 *label, *name;
+	UINTN prefix_len = StrLen(FACTORY_UNIT_PREFIX);
+	UINT32 i;
+
+	if (size < sizeof(*hdr) || hdr->magic != BATCH_MAGIC ||
+	    hdr->version != BATCH_VERSION ||
+	    hdr->count > (size - sizeof(*hdr)) / sizeof(*entry)) {
+		error(L"Invalid batch image");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	entry = (struct batch_entry *)(hdr + 1);
+	batch.active = TRUE;
+	for (i = 0, ret = EFI_SUCCESS; i < hdr->count; i++, entry++) {
+		if (entry->offset > size || entry->size > size - entry->offset ||
+		    entry->label[BATCH_LABEL_LENGTH - 1] != '\0') {
+			error(L"Invalid batch entry %d", i);
+			ret = EFI_INVALID_PARAMETER;
+			break;
+		}
+
+		label = stra_to_str(entry->label);
+		if (!label) {
+			ret = EFI_OUT_OF_RESOURCES;
+			break;
+		}
+
+		name = label;
+		batch.log_unit = LOGICAL_UNIT_USER;
+		if (!StrnCmp(label, FACTORY_UNIT_PREFIX, prefix_len)) {
+			name = label + prefix_len;
+			batch.log_unit = LOGICAL_UNIT_FACTORY;
+		}
+
+		if (!StrCmp(name, L"batch")) {
+			error(L"Nested batch images are not supported");
+			FreePool(label);
+			ret = EFI_INVALID_PARAMETER;
+			break;
+		}
+
+		log_debug(FASTBOOT, L"Batch entry %d: %s", i, label);
+		ret = flash((CHAR8 *)data + entry->offset, entry->size, name);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to flash batch entry %s", label);
+			FreePool(label);
+			break;
+		}
+		FreePool(label);
+	}
+	batch.active = FALSE;
+
+	/* The hashes of the entries written in the background were
+	   recorded before the writes completed */
+	ret_join = async_write_join();
+	if (EFI_ERROR(ret_join))
+		hash_cache_invalidate(NULL);
+	return EFI_ERROR(ret) ? ret : ret_join;
+}
+
 static struct label_exception {
 	CHAR16 *name;
 	EFI_STATUS (*flash_func)(VOID *data, UINTN size);
@@ -311,8 +1214,9 @@ static struct label_exception {
 #endif
 	{ L"sfu", flash_sfu },
 	{ L"ifwi", flash_ifwi },
-	{ L"oemvars", flash_oemvars },
+	{ L"oemvars", flash_oemvars_report },
 	{ L"zimage", flash_zimage },
+	{ L"batch", flash_batch },
 	{ BOOTLOADER_PART, flash_bootloader },
 #ifdef BOOTLOADER_POLICY
 	{ CONVERT_TO_WIDE(ACTION_AUTHORIZATION), authenticated_action }
@@ -321,28 +1225,234 @@ static struct label_exception {
 
 EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label)
 {
+	EFI_STATUS ret;
 	UINTN i;
 
+	verify.failed = FALSE;
+
 #ifndef USER
 	/* special case for writing inside esp partition */
 	CHAR16 esp[] = L"/ESP/";
-	if (!StrnCmp(esp, label, StrLen(esp)))
+	if (!StrnCmp(esp, label, StrLen(esp))) {
+		if (batch.active && batch.log_unit != LOGICAL_UNIT_USER) {
+			error(L"%s is not supported on the factory logical unit",
+			      label);
+			return EFI_UNSUPPORTED;
+		}
+		if (batch.active) {
+			ret = async_write_join();
+			if (EFI_ERROR(ret))
+				return ret;
+		}
 		return flash_into_esp(data, size, &label[ARRAY_SIZE(esp) - 1]);
+	}
 #endif
+	/* The ESP file system may be modified under its open directories */
+	uefi_fs_cache_flush();
+
 	/* special cases */
 	for (i = 0; i < ARRAY_SIZE(LABEL_EXCEPTIONS); i++)
 		if (!StrCmp(LABEL_EXCEPTIONS[i].name, label))
-			return LABEL_EXCEPTIONS[i].flash_func(data, size);
+			break;
+
+	if (i == ARRAY_SIZE(LABEL_EXCEPTIONS))
+		return flash_partition(data, size, label);
+
+	if (!batch.active)
+		return LABEL_EXCEPTIONS[i].flash_func(data, size);
+
+	/* The special cases access the disk on their own, the batch
+	   writes in the background are waited for first.  */
+	if (batch.log_unit != LOGICAL_UNIT_USER) {
+		error(L"%s is not supported on the factory logical unit", label);
+		return EFI_UNSUPPORTED;
+	}
+	ret = async_write_join();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	batch.active = FALSE;
+	ret = LABEL_EXCEPTIONS[i].flash_func(data, size);
+	batch.active = TRUE;
+	return ret;
+}
+
+/* The special labels and the ESP files need the complete image.  */
+static BOOLEAN is_streamable(CHAR16 *label)
+{
+	UINTN i;
+
+#ifndef USER
+	if (!StrnCmp(L"/ESP/", label, 5))
+		return FALSE;
+#endif
+	for (i = 0; i < ARRAY_SIZE(LABEL_EXCEPTIONS); i++)
+		if (!StrCmp(LABEL_EXCEPTIONS[i].name, label))
+			return FALSE;
+
+	return TRUE;
+}
+
+/* Streaming flash: the partition is selected before the download
+   starts and the image is written to the disk as it is received.
+   Only regular partitions are supported as the special labels and
+   the ESP files need the complete image to be processed.  */
+EFI_STATUS flash_stream_start(CHAR16 *label)
+{
+	EFI_STATUS ret;
+
+	if (!label)
+		return EFI_INVALID_PARAMETER;
+
+	if (!is_streamable(label)) {
+		error(L"Streaming is not supported for %s", label);
+		return EFI_UNSUPPORTED;
+	}
+
+	uefi_fs_cache_flush();
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
 
-	return flash_partition(data, size, label);
+	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	flash_begin(label);
+	stream_reset();
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_stream_check(CHAR16 *label, VOID *data, UINTN size)
+{
+	struct gpt_partition_interface part;
+	struct sparse_header *sph = data;
+	UINT64 image_size = size, part_size;
+	EFI_STATUS ret;
+
+	if (!label || !data)
+		return EFI_INVALID_PARAMETER;
+
+	if (!is_streamable(label))
+		return EFI_UNSUPPORTED;
+
+	/* The stream has no delta support and the size of an lz4 image
+	   is only known once it is decompressed.  */
+	if (is_delta_image(data, size) || is_lz4_image(data, size))
+		return EFI_UNSUPPORTED;
+
+	ret = gpt_get_partition_by_label(label, &part, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	if (is_sparse_image(data, size))
+		image_size = (UINT64)sph->total_blks * sph->blk_sz;
+	part_size = (part.part.ending_lba + 1 - part.part.starting_lba) *
+		part.bio->Media->BlockSize;
+	if (image_size > part_size) {
+		error(L"Image of %ld bytes too large for partition %s (%ld bytes)",
+		      image_size, label, part_size);
+		return EFI_BAD_BUFFER_SIZE;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_stream_write(VOID *data, UINTN size)
+{
+	if (!fstream.started)
+		return EFI_NOT_STARTED;
+
+	return stream_write(data, size);
+}
+
+EFI_STATUS flash_stream_end(void)
+{
+	if (!fstream.started)
+		return EFI_NOT_STARTED;
+
+	return flash_finish(stream_end());
+}
+
+/* A file is streamed to a regular partition by pieces of
+   FILE_PIECE_SIZE bytes read in a buffer aligned for the partition
+   device, the special labels need the whole file.  So do the delta
+   and lz4 images, as flash_partition() handles them: *WHOLE is set
+   when the first piece shows one, nothing is written then.  */
+#define FILE_PIECE_SIZE (4 * 1024 * 1024)
+
+static EFI_STATUS flash_file_stream(EFI_FILE *file, CHAR16 *label,
+				    BOOLEAN *whole)
+{
+	struct gpt_partition_interface part;
+	EFI_STATUS ret, ret_end;
+	VOID *free_addr;
+	CHAR8 *buf;
+	UINTN len;
+
+	*whole = FALSE;
+
+	ret = gpt_get_partition_by_label(label, &part, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	ret = alloc_aligned(&free_addr, (VOID **)&buf, FILE_PIECE_SIZE,
+			    part.bio->Media->IoAlign);
+	if (EFI_ERROR(ret)) {
+		error(L"Failed to allocate the file buffer");
+		return ret;
+	}
+
+	len = FILE_PIECE_SIZE;
+	ret = uefi_call_wrapper(file->Read, 3, file, &len, buf);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to read file");
+		goto out;
+	}
+
+	if (is_delta_image(buf, len) || is_lz4_image(buf, len)) {
+		*whole = TRUE;
+		goto out;
+	}
+
+	ret = flash_stream_start(label);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	while (len) {
+		ret = flash_stream_write(buf, len);
+		if (EFI_ERROR(ret))
+			break;
+
+		len = FILE_PIECE_SIZE;
+		ret = uefi_call_wrapper(file->Read, 3, file, &len, buf);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to read file");
+			break;
+		}
+	}
+
+	ret_end = flash_stream_end();
+	if (!EFI_ERROR(ret))
+		ret = ret_end;
+out:
+	FreePool(free_addr);
+	return ret;
 }
 
 EFI_STATUS flash_file(EFI_HANDLE image, CHAR16 *filename, CHAR16 *label)
 {
 	EFI_STATUS ret;
 	EFI_FILE_IO_INTERFACE *io = NULL;
+	EFI_FILE *file;
 	VOID *buffer = NULL;
 	UINTN size = 0;
+	BOOLEAN whole;
 
 	ret = uefi_call_wrapper(BS->HandleProtocol, 3, image, &FileSystemProtocol, (void *)&io);
 	if (EFI_ERROR(ret)) {
@@ -350,6 +1460,20 @@ EFI_STATUS flash_file(EFI_HANDLE image, CHAR16 *filename, CHAR16 *label)
 		goto out;
 	}
 
+	if (is_streamable(label)) {
+		ret = uefi_open_file(io, filename, &file);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to open file %s", filename);
+			goto out;
+		}
+		ret = flash_file_stream(file, label, &whole);
+		uefi_call_wrapper(file->Close, 1, file);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to flash file %s on partition %s", filename, label);
+		if (EFI_ERROR(ret) || !whole)
+			goto out;
+	}
+
 	ret = uefi_read_file(io, filename, &buffer, &size);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to read file %s", filename);
@@ -370,65 +1494,227 @@ out:
 }
 
 #define FS_MGR_SIZE 4096
-static EFI_STATUS erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, UINT64 start, UINT64 end)
+/* An erase is done in several steps so that it can be interleaved
+   with other work.  The hardware erase of the whole partition is a
+   single step, filling it with zeros instead is done
+   ERASE_ZERO_PIECE_SIZE bytes at a time.  */
+#define ERASE_ZERO_PIECE_SIZE (256 * 1024 * 1024)
+static struct {
+	UINT64 next;
+	UINT64 end;
+	BOOLEAN zeroing;
+	BOOLEAN tracked;
+	BOOLEAN skip;
+} erasing;
+
+EFI_STATUS erase_start(CHAR16 *label)
+{
+	EFI_STATUS ret;
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	/* A partition erased and not written since is left as it is.
+	   The ESP is not tracked, it is also written through its
+	   filesystem.  */
+	erasing.tracked = CompareGuid(&gparti.part.type,
+				      &EfiPartTypeSystemPartitionGuid) != 0;
+	erasing.skip = erasing.tracked &&
+		is_erased_part(gparti.part.starting_lba, gparti.part.ending_lba);
+	if (erasing.skip) {
+		debug(L"Partition %s is already erased", label);
+		return EFI_SUCCESS;
+	}
+
+	hash_cache_invalidate(label);
+	uefi_fs_cache_flush();
+
+	erasing.next = gparti.part.starting_lba;
+	erasing.end = gparti.part.ending_lba;
+	erasing.zeroing = FALSE;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS erase_done(BOOLEAN *done)
 {
 	EFI_STATUS ret;
-	UINTN min_end;
 
-	ret = storage_erase_blocks(handle, bio, start, end);
-	if (ret == EFI_SUCCESS) {
-		/* If the Android fs_mgr fails mounting a partition,
-		   it tries to detect if the partition has been wiped
-		   out to determine if it has to format it.  fs_mgr
-		   considers that the partition has been wiped out if
-		   the first 4096 bytes are filled up with all 0 or
-		   all 1.  storage_erase_blocks() uses hardware
-		   support to erase the blocks which does not garantee
-		   that content will be all 0 or all 1.  It also can
-		   be indeterminate data. */
-		min_end = start + (FS_MGR_SIZE / bio->Media->BlockSize) + 1;
-		return fill_zero(bio, start, min(min_end, end));
+	*done = TRUE;
+	if (erasing.tracked) {
+		ret = set_erased_part(gparti.part.starting_lba,
+				      gparti.part.ending_lba);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to record the erased partition");
+		written.valid = FALSE;
 	}
 
-	debug(L"Fallbacking to filling with zeros");
-	return fill_zero(bio, start, end);
+	if (!CompareGuid(&gparti.part.type, &EfiPartTypeSystemPartitionGuid))
+		return gpt_refresh();
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS erase_step(BOOLEAN *done)
+{
+	EFI_BLOCK_IO *bio = gparti.bio;
+	EFI_STATUS ret;
+	UINT64 end;
+
+	*done = erasing.skip;
+	if (*done)
+		return EFI_SUCCESS;
+
+	if (!erasing.zeroing) {
+		ret = storage_erase_blocks(gparti.handle, bio, erasing.next,
+					   erasing.end);
+		if (ret == EFI_SUCCESS) {
+			/* If the Android fs_mgr fails mounting a
+			   partition, it tries to detect if the partition
+			   has been wiped out to determine if it has to
+			   format it.  fs_mgr considers that the partition
+			   has been wiped out if the first 4096 bytes are
+			   filled up with all 0 or all 1.
+			   storage_erase_blocks() uses hardware support to
+			   erase the blocks which does not garantee that
+			   content will be all 0 or all 1.  It also can be
+			   indeterminate data. */
+			end = erasing.next + (FS_MGR_SIZE / bio->Media->BlockSize) + 1;
+			ret = fill_zero(bio, erasing.next, min(end, erasing.end));
+			if (EFI_ERROR(ret))
+				return ret;
+			return erase_done(done);
+		}
+
+		debug(L"Fallbacking to filling with zeros");
+		erasing.zeroing = TRUE;
+	}
+
+	/* fill_zero() needs at least two blocks */
+	end = erasing.next + ERASE_ZERO_PIECE_SIZE / bio->Media->BlockSize - 1;
+	if (end + 1 >= erasing.end)
+		end = erasing.end;
+
+	ret = fill_zero(bio, erasing.next, end);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	erasing.next = end + 1;
+	if (erasing.next <= erasing.end)
+		return EFI_SUCCESS;
+
+	return erase_done(done);
 }
 
 EFI_STATUS erase_by_label(CHAR16 *label)
 {
+	BOOLEAN done = FALSE;
 	EFI_STATUS ret;
 
+	ret = erase_start(label);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	while (!done) {
+		ret = erase_step(&done);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to erase partition %s", label);
+			return ret;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Create an empty ext4 filesystem on the erased partition instead of
+   flashing an empty filesystem image: only the filesystem metadata is
+   written.  Partitions not reported as ext4 are not supported.  */
+EFI_STATUS format_by_label(CHAR16 *label)
+{
+	EFI_STATUS ret;
+	EFI_TIME now;
+	UINT32 ctime = 0;
+	UINT64 size;
+
 	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to get partition %s", label);
 		return ret;
 	}
-	ret = erase_blocks(gparti.handle, gparti.bio, gparti.part.starting_lba, gparti.part.ending_lba);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to erase partition %s", label);
+	if (CompareGuid(&gparti.part.type, &guid_linux_data))
+		return EFI_UNSUPPORTED;
+
+	ret = erase_by_label(label);
+	if (EFI_ERROR(ret))
 		return ret;
+
+	ret = uefi_call_wrapper(RT->GetTime, 2, &now, NULL);
+	if (!EFI_ERROR(ret))
+		ctime = efi_time_to_ctime(&now);
+
+	size = (gparti.part.ending_lba + 1 - gparti.part.starting_lba) *
+		gparti.bio->Media->BlockSize;
+	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	flash_begin(label);
+
+	return flash_finish(ext4_mkfs(size, ctime));
+}
+
+/* The disk is filled by slices so that the progress bar can be
+   refreshed.  */
+#define GARBAGE_SLICES	100
+
+static EFI_STATUS garbage_fill(struct gpt_partition_interface *disk,
+			       UINT64 start, UINT64 end,
+			       VOID *chunk, UINTN blocks)
+{
+	UINT64 lba, slice, last;
+	EFI_STATUS ret = EFI_SUCCESS;
+	UINTN block_size = disk->bio->Media->BlockSize;
+
+	slice = max(DIV_ROUND_UP(end + 1 - start, GARBAGE_SLICES), (UINT64)blocks);
+	slice = ALIGN(slice, blocks);
+
+	fastboot_ui_progress_start((end + 1 - start) * block_size, 0);
+	for (lba = start; lba <= end; lba = last + 1) {
+		last = min(lba + slice - 1, end);
+		ret = fill_with(disk->bio, lba, last, chunk, blocks);
+		if (EFI_ERROR(ret))
+			break;
+
+		fastboot_ui_progress_update((last + 1 - start) * block_size);
+		fastboot_ui_progress_refresh();
 	}
-	if (!CompareGuid(&gparti.part.type, &EfiPartTypeSystemPartitionGuid))
-		return gpt_refresh();
+	fastboot_ui_progress_stop();
 
-	return EFI_SUCCESS;
+	return ret;
 }
 
-EFI_STATUS garbage_disk(void)
+/* A media wide erase leaves no previous state behind at the storage
+   speed, only the partition tables areas then get random data.  FULL
+   writes random data over the entire disk.  */
+EFI_STATUS garbage_disk(BOOLEAN full)
 {
 	struct gpt_partition_interface gparti;
 	EFI_STATUS ret;
 	VOID *chunk;
 	VOID *aligned_chunk;
-	UINTN size;
+	UINTN size, blocks;
+	UINT64 start, end;
 
 	ret = gpt_get_root_disk(&gparti, LOGICAL_UNIT_USER);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to get disk information");
 		return ret;
 	}
+	start = gparti.part.starting_lba;
+	end = gparti.part.ending_lba;
 
-	size = gparti.bio->Media->BlockSize * N_BLOCK;
+	blocks = fill_chunk_blocks(gparti.bio, start, end);
+	size = gparti.bio->Media->BlockSize * blocks;
 	ret = alloc_aligned(&chunk, &aligned_chunk, size, gparti.bio->Media->IoAlign);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Unable to allocate the garbage chunk");
@@ -442,9 +1728,30 @@ EFI_STATUS garbage_disk(void)
 		return ret;
 	}
 
-	ret = fill_with(gparti.bio, gparti.part.starting_lba,
-			gparti.part.ending_lba, aligned_chunk, N_BLOCK);
+	if (!full && end + 1 - start > 2 * blocks) {
+		ret = storage_erase_blocks(gparti.handle, gparti.bio, start, end);
+		if (!EFI_ERROR(ret)) {
+			ret = fill_with(gparti.bio, start, start + blocks - 1,
+					aligned_chunk, blocks);
+			if (!EFI_ERROR(ret))
+				ret = fill_with(gparti.bio, end + 1 - blocks, end,
+						aligned_chunk, blocks);
+			goto out;
+		}
+		debug(L"Media wide erase failed, %r, filling the disk", ret);
+	}
+
+	ret = garbage_fill(&gparti, start, end, aligned_chunk, blocks);
 
+out:
 	FreePool(chunk);
-	return gpt_refresh();
+	flash_forget_erased(NULL);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to garbage the disk");
+		gpt_refresh();
+	} else
+		ret = gpt_refresh();
+	/* The partition tables are gone too */
+	gpt_free_cache();
+	return ret;
 }
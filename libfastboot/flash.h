@@ -36,19 +36,42 @@
 #define _FLASH_H_
 
 #include <efi.h>
+#include <gpt.h>
 
 EFI_STATUS flash_skip(UINT64 size);
+EFI_STATUS flash_keep(UINT64 size);
+UINT64 flash_tell(void);
+UINT64 flash_space(void);
+EFI_STATUS flash_read(UINT64 offset, VOID *data, UINTN size);
 EFI_STATUS flash_write(VOID *data, UINTN size);
-EFI_STATUS flash_fill(UINT32 pattern, UINTN size);
-
-/* return value for flash() function */
-
-#define REFRESH_PARTITION_VAR 0x1
+EFI_STATUS flash_fill(UINT32 pattern, UINT64 size);
 
 EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label);
+EFI_STATUS flash_stream_start(CHAR16 *label);
+/* Check that the complete image DATA of SIZE bytes can be streamed
+   to the partition LABEL.  EFI_UNSUPPORTED if LABEL is not a regular
+   partition.  */
+EFI_STATUS flash_stream_check(CHAR16 *label, VOID *data, UINTN size);
+EFI_STATUS flash_stream_write(VOID *data, UINTN size);
+EFI_STATUS flash_stream_end(void);
+void flash_free(void);
+void flash_set_target(struct gpt_partition_interface *target);
+UINTN flash_io_align(void);
+/* Power of two size the writes should be a multiple of and aligned
+   on, from the partition start, for the best throughput.  */
+UINTN flash_write_granule(void);
+BOOLEAN flash_verify_failed(UINT64 *offset);
 EFI_STATUS flash_file(EFI_HANDLE image, CHAR16 *filename, CHAR16 *label);
 EFI_STATUS erase_by_label(CHAR16 *label);
-EFI_STATUS garbage_disk(void);
+/* erase_by_label() in several calls: erase_step() erases a part of
+   the partition selected by erase_start() until *DONE.  */
+EFI_STATUS erase_start(CHAR16 *label);
+EFI_STATUS erase_step(BOOLEAN *done);
+/* Drop the record that LABEL is erased, of all the partitions if
+   LABEL is NULL, so that the next erase really erases.  */
+void flash_forget_erased(const CHAR16 *label);
+EFI_STATUS format_by_label(CHAR16 *label);
+EFI_STATUS garbage_disk(BOOLEAN full);
 EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label);
 EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end);
 
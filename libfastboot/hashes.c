@@ -36,201 +36,526 @@
 #include <efilib.h>
 #include <lib.h>
 #include <openssl/evp.h>
+#include <openssl/obj_mac.h>
 
 #include "fastboot.h"
+#include "hashes.h"
 #include "uefi_utils.h"
 #include "gpt.h"
 #include "android.h"
 #include "signature.h"
 #include "security.h"
+#include "arena.h"
+#include "sha_ni.h"
+#include "async_io.h"
+#include "parallel.h"
+#include "vars.h"
 
 static struct algorithm {
 	const CHAR8 *name;
 	const EVP_MD *(*get_md)(void);
 } const ALGORITHMS[] = {
 	{ (CHAR8*)"sha1", EVP_sha1 }, /* default algorithm */
-	{ (CHAR8*)"md5", EVP_md5 }
+	{ (CHAR8*)"md5", EVP_md5 },
+	{ (CHAR8*)"sha256", EVP_sha256 }
 };
 
-static const EVP_MD *selected_md;
-static unsigned int hash_len;
+#define MAX_DIGESTS ARRAY_SIZE(ALGORITHMS)
 
-EFI_STATUS set_hash_algorithm(const CHAR8 *algo)
+/* Several algorithms can be selected at once and the data is then
+   read only once for all of them.  */
+static struct {
+	const struct algorithm *algo[MAX_DIGESTS];
+	const EVP_MD *md[MAX_DIGESTS];
+	UINTN nb;
+} selected;
+
+struct hashes {
+	CHAR8 value[MAX_DIGESTS][EVP_MAX_MD_SIZE];
+};
+
+/* SHA-1 and SHA-256 are computed with sha1_update() and
+   sha256_update() to use the SHA extensions when the processor has
+   them, the other algorithms go through EVP.  */
+struct digest {
+	const EVP_MD *md;
+	EVP_MD_CTX mdctx;
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+};
+
+static void digest_init(struct digest *d, const EVP_MD *md)
 {
-	EFI_STATUS ret = EFI_SUCCESS;
-	unsigned int i;
+	d->md = md;
+	switch (EVP_MD_type(md)) {
+	case NID_sha1:
+		SHA1_Init(&d->sha1);
+		return;
+	case NID_sha256:
+		SHA256_Init(&d->sha256);
+		return;
+	}
 
-	/* Use default algorithm */
-	if (!algo) {
-		selected_md = ALGORITHMS[0].get_md();
-		goto out;
+	EVP_MD_CTX_init(&d->mdctx);
+	EVP_DigestInit_ex(&d->mdctx, md, NULL);
+}
+
+static void digest_update(struct digest *d, const VOID *data, UINTN len)
+{
+	switch (EVP_MD_type(d->md)) {
+	case NID_sha1:
+		sha1_update(&d->sha1, data, len);
+		break;
+	case NID_sha256:
+		sha256_update(&d->sha256, data, len);
+		break;
+	default:
+		EVP_DigestUpdate(&d->mdctx, data, len);
 	}
+}
 
-	selected_md = NULL;
-	for (i = 0; i < ARRAY_SIZE(ALGORITHMS); i++)
-		if (!strcmp(algo, ALGORITHMS[i].name))
-			selected_md = ALGORITHMS[i].get_md();
+/* HASH can be NULL to only release the context */
+static void digest_end(struct digest *d, CHAR8 *hash)
+{
+	CHAR8 discard[EVP_MAX_MD_SIZE];
 
-	if (!selected_md)
-		return EFI_UNSUPPORTED;
+	switch (EVP_MD_type(d->md)) {
+	case NID_sha1:
+		SHA1_Final(hash ? hash : discard, &d->sha1);
+		return;
+	case NID_sha256:
+		SHA256_Final(hash ? hash : discard, &d->sha256);
+		return;
+	}
 
-out:
-	hash_len = EVP_MD_size(selected_md);
-	return ret;
+	if (hash)
+		EVP_DigestFinal_ex(&d->mdctx, hash, NULL);
+	EVP_MD_CTX_cleanup(&d->mdctx);
 }
 
-static void hash_buffer(CHAR8 *buffer, UINT64 len, CHAR8 *hash)
+/* One digest per selected algorithm */
+struct digests {
+	struct digest d[MAX_DIGESTS];
+};
+
+static void digests_init(struct digests *ds)
 {
-	EVP_MD_CTX mdctx;
+	UINTN i;
 
-	if (!selected_md)
-		set_hash_algorithm(NULL);
+	if (!selected.nb)
+		set_hash_algorithms(0, NULL);
 
-	EVP_MD_CTX_init(&mdctx);
-	EVP_DigestInit_ex(&mdctx, selected_md, NULL);
-	EVP_DigestUpdate(&mdctx, buffer, len);
-	EVP_DigestFinal_ex(&mdctx, hash, NULL);
-	EVP_MD_CTX_cleanup(&mdctx);
+	for (i = 0; i < selected.nb; i++)
+		digest_init(&ds->d[i], selected.md[i]);
 }
 
-static EFI_STATUS report_hash(const CHAR16 *base, const CHAR16 *name, CHAR8 *hash)
+static void digests_update(struct digests *ds, const VOID *data, UINTN len)
 {
-	EFI_STATUS ret;
-	CHAR8 hashstr[hash_len * 2 + 1];
+	UINTN i;
 
-	ret = bytes_to_hex_stra(hash, hash_len, hashstr, sizeof(hashstr));
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to convert bytes to hexadecimal string");
-		return ret;
-	}
+	for (i = 0; i < selected.nb; i++)
+		digest_update(&ds->d[i], data, len);
+}
 
-	fastboot_info("target: %s%s", base, name);
-	fastboot_info("hash: %a", hashstr);
+/* HASH can be NULL to only release the contexts */
+static void digests_end(struct digests *ds, struct hashes *hash)
+{
+	UINTN i;
 
-	return EFI_SUCCESS;
+	for (i = 0; i < selected.nb; i++)
+		digest_end(&ds->d[i], hash ? hash->value[i] : NULL);
 }
 
-static UINTN get_bootimage_len(CHAR8 *buffer, UINTN buffer_len)
+EFI_STATUS set_hash_algorithms(UINTN nb, CHAR8 **algos)
 {
-	struct boot_img_hdr *hdr;
-	struct boot_signature *bs;
-	UINTN len;
+	UINTN i, j, k;
 
-	if (buffer_len < sizeof(*hdr)) {
-		error(L"boot image too small");
-		return 0;
+	/* Use default algorithm */
+	if (!nb) {
+		selected.algo[0] = &ALGORITHMS[0];
+		selected.md[0] = ALGORITHMS[0].get_md();
+		selected.nb = 1;
+		return EFI_SUCCESS;
 	}
-	hdr = (struct boot_img_hdr *) buffer;
 
-	if (strncmp((CHAR8 *) BOOT_MAGIC, hdr->magic, BOOT_MAGIC_SIZE)) {
-		error(L"bad boot magic");
-		return 0;
-	}
+	selected.nb = 0;
+	for (i = 0; i < nb; i++) {
+		for (j = 0; j < ARRAY_SIZE(ALGORITHMS); j++)
+			if (!strcmp(algos[i], ALGORITHMS[j].name))
+				break;
+		if (j == ARRAY_SIZE(ALGORITHMS)) {
+			selected.nb = 0;
+			return EFI_UNSUPPORTED;
+		}
 
-	len = bootimage_size(hdr);
-	debug(L"len %lld", len);
+		for (k = 0; k < selected.nb; k++)
+			if (selected.algo[k] == &ALGORITHMS[j])
+				break;
+		if (k != selected.nb)
+			continue;
 
-	if (len > buffer_len + BOOT_SIGNATURE_MAX_SIZE) {
-		error(L"boot image too big");
-		return 0;
+		selected.algo[selected.nb] = &ALGORITHMS[j];
+		selected.md[selected.nb] = ALGORITHMS[j].get_md();
+		selected.nb++;
 	}
 
-	bs = get_boot_signature(&buffer[len], BOOT_SIGNATURE_MAX_SIZE);
+	return EFI_SUCCESS;
+}
 
-	if (bs) {
-		len += bs->total_size;
-		free_boot_signature(bs);
-	} else {
-		debug(L"boot image doesn't seem to have a signature");
-	}
+/* The registered partitions are digested while they are flashed so
+   that their hash can be reported without reading them back.  An
+   entry is only valid for the algorithms and the length it has been
+   computed with.  */
+#define HASH_CACHE_SIZE 4
+static struct hash_cache {
+	CHAR16 label[36];
+	BOOLEAN valid;
+	const EVP_MD *md[MAX_DIGESTS];
+	UINTN nb;
+	UINT64 len;
+	struct hashes hash;
+} hash_cache[HASH_CACHE_SIZE];
 
-	debug(L"total boot image size %d", len);
-	return len;
-}
+static struct {
+	struct hash_cache *entry;
+	struct digests digests;
+	UINT64 len;
+} flash_hash;
 
-EFI_STATUS get_boot_image_hash(const CHAR16 *label)
+static struct hash_cache *hash_cache_lookup(const CHAR16 *label)
 {
-	struct gpt_partition_interface gparti;
-	CHAR8 *data;
-	UINT64 len;
-	UINT64 offset;
-	CHAR8 hash[EVP_MAX_MD_SIZE];
-	EFI_STATUS ret;
+	UINTN i;
 
-	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get partition %s", label);
-		return ret;
-	}
+	for (i = 0; i < ARRAY_SIZE(hash_cache); i++)
+		if (hash_cache[i].label[0] && !StrCmp(hash_cache[i].label, label))
+			return &hash_cache[i];
 
-	len = (gparti.part.ending_lba + 1 - gparti.part.starting_lba) * gparti.bio->Media->BlockSize;
-	offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	return NULL;
+}
 
-	if (len > 100 * MiB) {
-		error(L"partition too large to contain a boot image");
+EFI_STATUS hash_cache_register(const CHAR16 *label)
+{
+	UINTN i;
+
+	if (StrLen(label) >= ARRAY_SIZE(hash_cache[0].label))
 		return EFI_INVALID_PARAMETER;
+
+	if (hash_cache_lookup(label))
+		return EFI_SUCCESS;
+
+	for (i = 0; i < ARRAY_SIZE(hash_cache); i++)
+		if (!hash_cache[i].label[0]) {
+			StrCpy(hash_cache[i].label, (CHAR16 *)label);
+			hash_cache[i].valid = FALSE;
+			return EFI_SUCCESS;
+		}
+
+	return EFI_OUT_OF_RESOURCES;
+}
+
+void hash_cache_invalidate(const CHAR16 *label)
+{
+	struct hash_cache *entry;
+	UINTN i;
+
+	if (!label || !StrCmp(label, BOOTLOADER_PART))
+		esp_hash_invalidate(NULL);
+
+	if (label) {
+		entry = hash_cache_lookup(label);
+		if (entry)
+			entry->valid = FALSE;
+		return;
 	}
-	data = AllocatePool(len);
-	if (!data) {
-		return EFI_OUT_OF_RESOURCES;
+
+	for (i = 0; i < ARRAY_SIZE(hash_cache); i++)
+		hash_cache[i].valid = FALSE;
+}
+
+void hash_cache_end(BOOLEAN success)
+{
+	struct hash_cache *entry = flash_hash.entry;
+
+	if (!entry)
+		return;
+
+	if (success) {
+		digests_end(&flash_hash.digests, &entry->hash);
+		CopyMem(entry->md, selected.md, sizeof(entry->md));
+		entry->nb = selected.nb;
+		entry->len = flash_hash.len;
+		entry->valid = TRUE;
+	} else
+		digests_end(&flash_hash.digests, NULL);
+
+	flash_hash.entry = NULL;
+}
+
+BOOLEAN hash_cache_start(const CHAR16 *label)
+{
+	hash_cache_end(FALSE);
+
+	if (!StrCmp(label, BOOTLOADER_PART))
+		esp_hash_invalidate(NULL);
+
+	flash_hash.entry = hash_cache_lookup(label);
+	if (!flash_hash.entry)
+		return FALSE;
+
+	flash_hash.entry->valid = FALSE;
+	flash_hash.len = 0;
+	digests_init(&flash_hash.digests);
+
+	return TRUE;
+}
+
+BOOLEAN hash_cache_active(void)
+{
+	return flash_hash.entry != NULL;
+}
+
+void hash_cache_update(const VOID *data, UINT64 offset, UINTN len)
+{
+	if (!flash_hash.entry)
+		return;
+
+	/* Only a contiguous area from the partition start can be
+	   digested */
+	if (offset != flash_hash.len) {
+		debug(L"Non sequential write, %s hash not cached",
+		      flash_hash.entry->label);
+		hash_cache_end(FALSE);
+		return;
 	}
 
-	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio, gparti.bio->Media->MediaId, offset, len, data);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to read partition");
-		FreePool(data);
-		return ret;
+	digests_update(&flash_hash.digests, data, len);
+	flash_hash.len += len;
+}
+
+/* Get the cached hashes if they have been computed for LEN bytes
+   and with all the selected algorithms */
+static BOOLEAN hash_cache_get(struct hash_cache *entry, UINT64 len,
+			      struct hashes *hash)
+{
+	UINTN i, j;
+
+	if (!entry || !entry->valid || entry->len != len || !selected.nb)
+		return FALSE;
+
+	for (i = 0; i < selected.nb; i++) {
+		for (j = 0; j < entry->nb; j++)
+			if (entry->md[j] == selected.md[i])
+				break;
+		if (j == entry->nb)
+			return FALSE;
+		CopyMem(hash->value[i], entry->hash.value[j], EVP_MAX_MD_SIZE);
 	}
 
-	len = get_bootimage_len(data, len);
-	if (len) {
-		hash_buffer(data, len, hash);
-		ret = report_hash(L"/", label, hash);
+	return TRUE;
+}
+
+static void hash_buffer(CHAR8 *buffer, UINT64 len, struct hashes *hash)
+{
+	struct digests digests;
+
+	digests_init(&digests);
+	digests_update(&digests, buffer, len);
+	digests_end(&digests, hash);
+}
+
+/* With a single algorithm, the hash is reported as "hash: " for
+   compatibility, otherwise each one is prefixed with the algorithm
+   name.  */
+static EFI_STATUS report_hash(const CHAR16 *base, const CHAR16 *name, struct hashes *hash)
+{
+	EFI_STATUS ret;
+	CHAR8 hashstr[EVP_MAX_MD_SIZE * 2 + 1];
+	UINTN i;
+
+	fastboot_info("target: %s%s", base, name);
+
+	for (i = 0; i < selected.nb; i++) {
+		ret = bytes_to_hex_stra(hash->value[i], EVP_MD_size(selected.md[i]),
+					hashstr, sizeof(hashstr));
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to convert bytes to hexadecimal string");
+			return ret;
+		}
+
+		if (selected.nb == 1)
+			fastboot_info("hash: %a", hashstr);
+		else
+			fastboot_info("%a: %a", selected.algo[i]->name, hashstr);
 	}
-	FreePool(data);
-	return ret;
+
+	return EFI_SUCCESS;
 }
 
 #define MAX_DIR 10
 #define MAX_FILENAME_LEN (256 * sizeof(CHAR16))
 #define DIR_BUFFER_SIZE (MAX_DIR * MAX_FILENAME_LEN)
+#define ESP_ROOT L"/bootloader/"
 static CHAR16 *path;
 static CHAR16 *subname[MAX_DIR];
 static INTN subdir;
 
+/* The files are streamed through a single buffer, allocated once
+   for the whole ESP walk */
+#define FILE_CHUNK (1024 * 1024)
+static CHAR8 *file_buffer;
+
+/* The ESP file digests are kept for the session.  An entry, keyed by
+   the file path relative to the ESP root, is valid while the file
+   keeps its size and modification time and for the algorithms it has
+   been computed with.  */
+#define ESP_CACHE_SIZE 64
+static struct esp_cache {
+	CHAR16 *path;
+	UINT64 size;
+	EFI_TIME mtime;
+	const EVP_MD *md[MAX_DIGESTS];
+	UINTN nb;
+	struct hashes hash;
+} esp_cache[ESP_CACHE_SIZE];
+
+static CHAR16 esp_path_char(CHAR16 c)
+{
+	if (c == L'\\')
+		return L'/';
+	if (c >= L'a' && c <= L'z')
+		return c - L'a' + L'A';
+	return c;
+}
+
+/* The FAT paths are case insensitive and both separators are used */
+static BOOLEAN esp_path_equal(const CHAR16 *a, const CHAR16 *b)
+{
+	while (esp_path_char(*a) == L'/')
+		a++;
+	while (esp_path_char(*b) == L'/')
+		b++;
+
+	for (; *a && esp_path_char(*a) == esp_path_char(*b); a++, b++)
+		;
+	return esp_path_char(*a) == esp_path_char(*b);
+}
+
+static struct esp_cache *esp_cache_lookup(const CHAR16 *file)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(esp_cache); i++)
+		if (esp_cache[i].path && esp_path_equal(esp_cache[i].path, file))
+			return &esp_cache[i];
+
+	return NULL;
+}
+
+static BOOLEAN esp_cache_get(const CHAR16 *file, EFI_FILE_INFO *fi,
+			     struct hashes *hash)
+{
+	struct esp_cache *entry = esp_cache_lookup(file);
+
+	if (!entry || entry->size != fi->FileSize ||
+	    CompareMem(&entry->mtime, &fi->ModificationTime, sizeof(entry->mtime)) ||
+	    entry->nb != selected.nb ||
+	    CompareMem(entry->md, selected.md, selected.nb * sizeof(*entry->md)))
+		return FALSE;
+
+	CopyMem(hash, &entry->hash, sizeof(*hash));
+	return TRUE;
+}
+
+static void esp_cache_set(CHAR16 *file, EFI_FILE_INFO *fi, struct hashes *hash)
+{
+	struct esp_cache *entry = esp_cache_lookup(file);
+	UINTN i;
+
+	if (entry)
+		FreePool(file);
+	else {
+		for (i = 0; i < ARRAY_SIZE(esp_cache); i++)
+			if (!esp_cache[i].path)
+				break;
+		if (i == ARRAY_SIZE(esp_cache)) {
+			FreePool(file);
+			return;
+		}
+		entry = &esp_cache[i];
+		entry->path = file;
+	}
+
+	entry->size = fi->FileSize;
+	CopyMem(&entry->mtime, &fi->ModificationTime, sizeof(entry->mtime));
+	CopyMem(entry->md, selected.md, sizeof(entry->md));
+	entry->nb = selected.nb;
+	CopyMem(&entry->hash, hash, sizeof(*hash));
+}
+
+void esp_hash_invalidate(const CHAR16 *file)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(esp_cache); i++) {
+		if (!esp_cache[i].path ||
+		    (file && !esp_path_equal(esp_cache[i].path, file)))
+			continue;
+		FreePool(esp_cache[i].path);
+		ZeroMem(&esp_cache[i], sizeof(esp_cache[i]));
+	}
+}
+
 static EFI_STATUS hash_file(EFI_FILE *dir, EFI_FILE_INFO *fi)
 {
 	EFI_FILE *file;
-	void *data;
-	CHAR8 hash[EVP_MAX_MD_SIZE];
+	struct digests digests;
+	struct hashes hash;
 	EFI_STATUS ret;
+	CHAR16 *key = NULL;
 	UINTN size;
 
-	if (!fi->Size) {
-		hash_buffer(NULL, 0, hash);
-		return report_hash(path, fi->FileName, hash);
+	if (!fi->FileSize) {
+		hash_buffer(NULL, 0, &hash);
+		return report_hash(path, fi->FileName, &hash);
+	}
+
+	if (path) {
+		key = PoolPrint(L"%s%s", path + StrLen(ESP_ROOT), fi->FileName);
+		if (key && esp_cache_get(key, fi, &hash)) {
+			FreePool(key);
+			return report_hash(path, fi->FileName, &hash);
+		}
 	}
 
 	ret = uefi_call_wrapper(dir->Open, 5, dir, &file, fi->FileName, EFI_FILE_MODE_READ, 0);
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
+		if (key)
+			FreePool(key);
 		return ret;
+	}
 
-	size = fi->FileSize;
-
-	data = AllocatePool(size);
-	if (!data)
-		goto close;
-
-	ret = uefi_call_wrapper(file->Read, 3, file, &size, data);
-	if (EFI_ERROR(ret))
-		goto free;
+	digests_init(&digests);
+	do {
+		size = FILE_CHUNK;
+		ret = uefi_call_wrapper(file->Read, 3, file, &size, file_buffer);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to read %s", fi->FileName);
+			digests_end(&digests, NULL);
+			goto close;
+		}
+		digests_update(&digests, file_buffer, size);
+	} while (size);
+	digests_end(&digests, &hash);
 
-	hash_buffer(data, size, hash);
-	ret = report_hash(path, fi->FileName, hash);
+	if (key) {
+		esp_cache_set(key, fi, &hash);
+		key = NULL;
+	}
+	ret = report_hash(path, fi->FileName, &hash);
 
-free:
-	FreePool(data);
 close:
+	if (key)
+		FreePool(key);
 	uefi_call_wrapper(file->Close, 1, file);
 	return ret;
 }
@@ -244,7 +569,7 @@ close:
 	path = AllocateZeroPool(DIR_BUFFER_SIZE);
 	if (!path)
 		return;
-	StrCat(path, L"/bootloader/");
+	StrCat(path, ESP_ROOT);
  }
 
 static void freepath(void)
@@ -298,11 +623,15 @@ EFI_STATUS get_esp_hash(__attribute__((__unused__)) const CHAR16 *label)
 		return ret;
 	}
 
+	file_buffer = arena_pool_alloc(FILE_CHUNK);
+	if (!file_buffer)
+		return EFI_OUT_OF_RESOURCES;
+
 	subdir = 0;
 	ret = uefi_call_wrapper(io->OpenVolume, 2, io, &dirs[subdir]);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to open root directory");
-		return ret;
+		goto free;
 	}
 	initpath();
 	do {
@@ -343,12 +672,19 @@ EFI_STATUS get_esp_hash(__attribute__((__unused__)) const CHAR16 *label)
 		} else {
 			ret = hash_file(dirs[subdir], fi);
 			if (EFI_ERROR(ret)) {
+				for (; subdir >= 0; subdir--)
+					uefi_call_wrapper(dirs[subdir]->Close, 1, dirs[subdir]);
 				freepath();
-				return ret;
+				goto free;
 			}
 		}
 	} while (size || subdir >= 0);
-	return EFI_SUCCESS;
+	ret = EFI_SUCCESS;
+
+free:
+	arena_free(file_buffer);
+	file_buffer = NULL;
+	return ret;
 }
 
 /*
@@ -463,41 +799,271 @@ static EFI_STATUS read_partition(struct gpt_partition_interface *gparti, UINT64
 	return ret;
 }
 
-#define CHUNK 1024 * 1024
-#define MIN(a, b) ((a < b) ? (a) : (b))
-static EFI_STATUS hash_partition(struct gpt_partition_interface *gparti, UINT64 len, CHAR8 *hash)
+/* Read-ahead partition reader: the next chunk is read while the
+   current one is hashed.  The chunks are larger on the media with
+   large blocks, UFS for instance.  */
+#define READ_AHEAD_BUFFERS 2
+#define READ_CHUNK_BLOCKS 2048
+#define READ_CHUNK_MIN (1024 * 1024)
+#define READ_CHUNK_MAX (4 * 1024 * 1024)
+
+struct part_reader {
+	struct gpt_partition_interface *gparti;
+	async_reader_t *aio;
+	VOID *free_addr[READ_AHEAD_BUFFERS];
+	CHAR8 *bufs[READ_AHEAD_BUFFERS];
+	UINTN chunk;
+	UINT64 len;
+	UINT64 next;
+	UINTN idx;
+	UINTN pending_len;
+	BOOLEAN sync;
+	EFI_STATUS status;
+};
+
+static EFI_STATUS part_reader_submit(struct part_reader *r)
 {
-	EVP_MD_CTX mdctx;
-	CHAR8 *buffer;
-	UINT64 offset;
-	UINT64 chunklen;
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
+	struct gpt_partition_interface *gparti = r->gparti;
+	UINT32 block_size = gparti->bio->Media->BlockSize;
+	UINT64 nb_blocks = gparti->part.ending_lba + 1 - gparti->part.starting_lba;
+	UINT64 lba = gparti->part.starting_lba + r->next / block_size;
+	UINTN len, read_len;
+
+	r->pending_len = 0;
+	if (r->next >= r->len)
+		return EFI_SUCCESS;
+
+	len = min((UINT64)r->chunk, r->len - r->next);
+	read_len = ALIGN(len, block_size);
+	r->pending_len = len;
+	r->next += len;
+
+	/* The end of the data is not block aligned and the rounded up
+	   read does not fit in the partition */
+	r->sync = lba - gparti->part.starting_lba + read_len / block_size > nb_blocks;
+	if (r->sync) {
+		r->status = read_partition(gparti, r->next - len, len, r->bufs[r->idx]);
+		return EFI_SUCCESS;
+	}
 
-	buffer = AllocatePool(CHUNK);
-	if (!buffer)
-		return EFI_OUT_OF_RESOURCES;
+	return async_read_blocks(r->aio, lba, read_len, r->bufs[r->idx]);
+}
+
+static void part_reader_close(struct part_reader *r)
+{
+	UINTN i;
 
-	if (!selected_md)
-		set_hash_algorithm(NULL);
+	if (r->aio)
+		async_read_close(r->aio);
+	for (i = 0; i < READ_AHEAD_BUFFERS; i++)
+		if (r->free_addr[i])
+			FreePool(r->free_addr[i]);
+}
 
-	EVP_MD_CTX_init(&mdctx);
-	EVP_DigestInit_ex(&mdctx, selected_md, NULL);
+/* CHUNK must be a multiple of the media block size.  */
+static EFI_STATUS part_reader_open_chunk(struct part_reader *r,
+					 struct gpt_partition_interface *gparti,
+					 UINT64 len, UINTN chunk)
+{
+	UINT64 partlen;
+	EFI_STATUS ret;
+	UINTN i;
 
-	for (offset = 0; offset < len; offset += CHUNK) {
-		chunklen = MIN(len - offset, CHUNK);
-		ret = read_partition(gparti, offset, chunklen, buffer);
+	partlen = (gparti->part.ending_lba + 1 - gparti->part.starting_lba) * gparti->bio->Media->BlockSize;
+	if (len > partlen) {
+		error(L"attempt to read outside of partition %s, (len %lld partition len %lld)", gparti->part.name, len, partlen);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	ZeroMem(r, sizeof(*r));
+	r->gparti = gparti;
+	r->len = len;
+	r->chunk = chunk;
+
+	for (i = 0; i < READ_AHEAD_BUFFERS; i++) {
+		ret = alloc_aligned(&r->free_addr[i], (VOID **)&r->bufs[i],
+				    r->chunk, gparti->bio->Media->IoAlign);
 		if (EFI_ERROR(ret))
-			goto free;
-		EVP_DigestUpdate(&mdctx, buffer, chunklen);
+			goto err;
 	}
-	EVP_DigestFinal_ex(&mdctx, hash, NULL);
 
-free:
-	EVP_MD_CTX_cleanup(&mdctx);
-	FreePool(buffer);
+	ret = async_read_open(gparti->bio, &r->aio);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	ret = part_reader_submit(r);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	return EFI_SUCCESS;
+
+err:
+	part_reader_close(r);
 	return ret;
 }
 
+static EFI_STATUS part_reader_open(struct part_reader *r,
+				   struct gpt_partition_interface *gparti,
+				   UINT64 len)
+{
+	UINTN chunk;
+
+	chunk = gparti->bio->Media->BlockSize * READ_CHUNK_BLOCKS;
+	chunk = min(max(chunk, (UINTN)READ_CHUNK_MIN), (UINTN)READ_CHUNK_MAX);
+	return part_reader_open_chunk(r, gparti, len, chunk);
+}
+
+/* *LEN is zero once all the data has been read.  *DATA remains valid
+   until the next call.  */
+static EFI_STATUS part_reader_next(struct part_reader *r, CHAR8 **data, UINTN *len)
+{
+	EFI_STATUS ret;
+
+	ret = r->sync ? r->status : async_read_wait(r->aio);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"read partition %s failed", r->gparti->part.name);
+		return ret;
+	}
+
+	*data = r->bufs[r->idx];
+	*len = r->pending_len;
+	if (!*len)
+		return EFI_SUCCESS;
+
+	r->idx = (r->idx + 1) % READ_AHEAD_BUFFERS;
+	return part_reader_submit(r);
+}
+
+static EFI_STATUS hash_partition(struct gpt_partition_interface *gparti, UINT64 len, struct hashes *hash)
+{
+	struct part_reader reader;
+	struct digests digests;
+	CHAR8 *data;
+	UINTN chunklen;
+	EFI_STATUS ret;
+
+	ret = part_reader_open(&reader, gparti, len);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	digests_init(&digests);
+
+	for (;;) {
+		ret = part_reader_next(&reader, &data, &chunklen);
+		if (EFI_ERROR(ret)) {
+			digests_end(&digests, NULL);
+			goto close;
+		}
+		if (!chunklen)
+			break;
+		digests_update(&digests, data, chunklen);
+	}
+	digests_end(&digests, hash);
+
+close:
+	part_reader_close(&reader);
+	return ret;
+}
+
+/* Only the header and the signature are read to get the image length,
+   the image itself is streamed through the partition reader.  An
+   invalid image is not an error, *LEN is set to 0 and the partition
+   is skipped.  */
+static EFI_STATUS get_bootimage_len(struct gpt_partition_interface *gparti,
+				    UINT64 *len)
+{
+	struct boot_img_hdr hdr;
+	struct boot_signature *bs;
+	UINT64 partlen, siglen;
+	CHAR8 *sig;
+	EFI_STATUS ret;
+
+	*len = 0;
+	partlen = (gparti->part.ending_lba + 1 - gparti->part.starting_lba) * gparti->bio->Media->BlockSize;
+	if (partlen < sizeof(hdr)) {
+		error(L"boot image too small");
+		return EFI_SUCCESS;
+	}
+
+	ret = read_partition(gparti, 0, sizeof(hdr), &hdr);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (strncmp((CHAR8 *) BOOT_MAGIC, hdr.magic, BOOT_MAGIC_SIZE)) {
+		error(L"bad boot magic");
+		return EFI_SUCCESS;
+	}
+
+	*len = bootimage_size(&hdr);
+	debug(L"len %lld", *len);
+
+	if (*len > partlen) {
+		error(L"boot image too big");
+		*len = 0;
+		return EFI_SUCCESS;
+	}
+
+	siglen = min(partlen - *len, (UINT64)BOOT_SIGNATURE_MAX_SIZE);
+	if (!siglen) {
+		debug(L"boot image doesn't seem to have a signature");
+		return EFI_SUCCESS;
+	}
+
+	sig = AllocatePool(BOOT_SIGNATURE_MAX_SIZE);
+	if (!sig)
+		return EFI_OUT_OF_RESOURCES;
+
+	/* get_boot_signature() may look up to BOOT_SIGNATURE_MAX_SIZE */
+	ZeroMem(sig, BOOT_SIGNATURE_MAX_SIZE);
+	ret = read_partition(gparti, *len, siglen, sig);
+	if (EFI_ERROR(ret)) {
+		FreePool(sig);
+		return ret;
+	}
+
+	bs = get_boot_signature(sig, BOOT_SIGNATURE_MAX_SIZE);
+	FreePool(sig);
+	if (bs) {
+		*len += bs->total_size;
+		free_boot_signature(bs);
+	} else {
+		debug(L"boot image doesn't seem to have a signature");
+	}
+
+	if (*len > partlen) {
+		error(L"boot image too big");
+		*len = 0;
+		return EFI_SUCCESS;
+	}
+
+	debug(L"total boot image size %lld", *len);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS get_boot_image_hash(const CHAR16 *label)
+{
+	struct gpt_partition_interface gparti;
+	struct hashes hash;
+	UINT64 len;
+	EFI_STATUS ret;
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	ret = get_bootimage_len(&gparti, &len);
+	if (EFI_ERROR(ret) || !len)
+		return ret;
+
+	ret = hash_partition(&gparti, len, &hash);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return report_hash(L"/", label, &hash);
+}
+
 static EFI_STATUS get_ext4_len(struct gpt_partition_interface *gparti, UINT64 *len)
 {
 	UINT64 block_size;
@@ -564,7 +1130,9 @@ static EFI_STATUS check_verity_header(struct gpt_partition_interface *gparti, UI
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS get_fs_hash(const CHAR16 *label)
+static EFI_STATUS get_fs_len(const CHAR16 *label,
+			     struct gpt_partition_interface *gparti,
+			     UINT64 *fs_len)
 {
 	static struct supported_fs {
 		const char *name;
@@ -573,20 +1141,17 @@ EFI_STATUS get_fs_hash(const CHAR16 *label)
 		{ "Ext4", get_ext4_len },
 		{ "SquashFS", get_squashfs_len }
 	};
-	struct gpt_partition_interface gparti;
-	CHAR8 hash[EVP_MAX_MD_SIZE];
 	EFI_STATUS ret;
-	UINT64 fs_len;
 	UINTN i;
 
-	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	ret = gpt_get_partition_by_label(label, gparti, LOGICAL_UNIT_USER);
 	if (EFI_ERROR(ret)) {
 		debug(L"partition %s not found", label);
 		return ret;
 	}
 
 	for (i = 0; i < ARRAY_SIZE(SUPPORTED_FS); i++) {
-		ret = SUPPORTED_FS[i].get_len(&gparti, &fs_len);
+		ret = SUPPORTED_FS[i].get_len(gparti, fs_len);
 		if (EFI_ERROR(ret))
 			continue;
 		debug(L"%a filesystem found", SUPPORTED_FS[i].name);
@@ -597,7 +1162,17 @@ EFI_STATUS get_fs_hash(const CHAR16 *label)
 		return ret;
 	}
 
-	ret = check_verity_header(&gparti, fs_len);
+	return check_verity_header(gparti, *fs_len);
+}
+
+EFI_STATUS get_fs_hash(const CHAR16 *label)
+{
+	struct gpt_partition_interface gparti;
+	struct hashes hash;
+	EFI_STATUS ret;
+	UINT64 fs_len;
+
+	ret = get_fs_len(label, &gparti, &fs_len);
 	if (EFI_ERROR(ret))
 		return ret;
 
@@ -605,8 +1180,382 @@ EFI_STATUS get_fs_hash(const CHAR16 *label)
 
 	debug(L"filesystem size %lld", fs_len);
 
-	ret = hash_partition(&gparti, fs_len, hash);
+	if (!selected.nb)
+		set_hash_algorithms(0, NULL);
+
+	if (hash_cache_get(hash_cache_lookup(label), fs_len, &hash)) {
+		debug(L"%s hash computed while flashing", label);
+		return report_hash(L"/", gparti.part.name, &hash);
+	}
+
+	ret = hash_partition(&gparti, fs_len, &hash);
+	if (EFI_ERROR(ret))
+		return ret;
+	return report_hash(L"/", gparti.part.name, &hash);
+}
+
+/* The verity metadata block follows the filesystem.  Its table is
+   the dm-verity one: "<version> <data_dev> <hash_dev>
+   <data_block_size> <hash_block_size> <num_data_blocks>
+   <hash_start_block> <algorithm> <root_digest> <salt>".  The hash
+   tree levels are stored from the root one down to the data
+   one.  */
+#define VERITY_TABLE_FIELDS 10
+#define VERITY_SALT_MAX_SIZE 128
+#define VERITY_MAX_LEVELS 16
+#define VERITY_WORK_BLOCKS 16
+
+struct verity_metadata {
+	UINT32 magic;
+	UINT32 protocol_version;
+	CHAR8 signature[256];
+	UINT32 table_length;
+	CHAR8 table[];
+} __attribute__((packed));
+
+struct verity_table {
+	UINT64 data_blocks;
+	UINT64 hash_start;
+	CHAR8 root[VERITY_HASH_SIZE];
+	CHAR8 salt[VERITY_SALT_MAX_SIZE];
+	UINTN salt_len;
+};
+
+static EFI_STATUS hex_to_bytes(const CHAR8 *str, CHAR8 *bytes, UINTN size, UINTN *len)
+{
+	UINTN i, n = strlen(str);
+	CHAR8 c, v;
+
+	if (n % 2 || n / 2 > size)
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 0; i < n; i++) {
+		c = str[i];
+		if (c >= '0' && c <= '9')
+			v = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			v = c - 'A' + 10;
+		else
+			return EFI_INVALID_PARAMETER;
+		bytes[i / 2] = i % 2 ? bytes[i / 2] | v : v << 4;
+	}
+
+	*len = n / 2;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS read_verity_table(struct gpt_partition_interface *gparti,
+				    UINT64 fs_len, struct verity_table *table)
+{
+	struct verity_metadata *meta;
+	CHAR8 *fields[VERITY_TABLE_FIELDS], *saveptr, *token;
+	UINTN nb = 0, len;
+	EFI_STATUS ret;
+
+	meta = AllocatePool(VERITY_METADATA_SIZE + 1);
+	if (!meta)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = read_partition(gparti, fs_len, VERITY_METADATA_SIZE, meta);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	ret = EFI_INVALID_PARAMETER;
+	if (meta->table_length > VERITY_METADATA_SIZE - sizeof(*meta)) {
+		error(L"Invalid verity table length %d", meta->table_length);
+		goto out;
+	}
+	meta->table[meta->table_length] = '\0';
+
+	for (token = (CHAR8 *)strtok_r((char *)meta->table, " \n", (char **)&saveptr);
+	     token && nb < ARRAY_SIZE(fields);
+	     token = (CHAR8 *)strtok_r(NULL, " \n", (char **)&saveptr))
+		fields[nb++] = token;
+
+	if (nb != VERITY_TABLE_FIELDS || strcmp(fields[0], (CHAR8 *)"1")
+	    || strtoul((char *)fields[3], NULL, 10) != VERITY_BLOCK_SIZE
+	    || strtoul((char *)fields[4], NULL, 10) != VERITY_BLOCK_SIZE
+	    || strcmp(fields[7], (CHAR8 *)"sha256")) {
+		error(L"Unsupported verity table");
+		goto out;
+	}
+
+	table->data_blocks = strtoul((char *)fields[5], NULL, 10);
+	table->hash_start = strtoul((char *)fields[6], NULL, 10);
+	ret = hex_to_bytes(fields[8], table->root, sizeof(table->root), &len);
+	if (EFI_ERROR(ret) || len != sizeof(table->root)) {
+		error(L"Invalid verity root digest");
+		ret = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+	ret = hex_to_bytes(fields[9], table->salt, sizeof(table->salt), &table->salt_len);
+	if (EFI_ERROR(ret))
+		error(L"Invalid verity salt");
+
+out:
+	FreePool(meta);
+	return ret;
+}
+
+/* The blocks are hashed by batches of VERITY_WORK_BLOCKS on all the
+   processors.  The salt is hashed only once in SALTED and the
+   context is copied for each block.  */
+struct verity_work {
+	SHA256_CTX salted;
+	const CHAR8 *data;
+	UINTN nb_blocks;
+	CHAR8 *hashes;
+};
+
+static VOID verity_hash_blocks(VOID *arg, UINTN index)
+{
+	struct verity_work *w = arg;
+	UINTN i, end = min((index + 1) * VERITY_WORK_BLOCKS, w->nb_blocks);
+	SHA256_CTX ctx;
+
+	for (i = index * VERITY_WORK_BLOCKS; i < end; i++) {
+		ctx = w->salted;
+		sha256_update(&ctx, w->data + i * VERITY_BLOCK_SIZE, VERITY_BLOCK_SIZE);
+		SHA256_Final(w->hashes + i * VERITY_HASH_SIZE, &ctx);
+	}
+}
+
+static EFI_STATUS verity_hash(struct verity_work *w, const CHAR8 *data,
+			      UINTN nb_blocks, CHAR8 *hashes)
+{
+	w->data = data;
+	w->nb_blocks = nb_blocks;
+	w->hashes = hashes;
+	return parallel_for(DIV_ROUND_UP(nb_blocks, VERITY_WORK_BLOCKS),
+			    verity_hash_blocks, NULL, w);
+}
+
+/* Compare the computed tree with the stored one */
+static EFI_STATUS verity_check_tree(struct gpt_partition_interface *gparti,
+				    UINT64 offset, CHAR8 *tree, UINT64 tree_size)
+{
+	CHAR8 *buf;
+	UINT64 done, len;
+	EFI_STATUS ret = EFI_SUCCESS;
+
+	buf = AllocatePool(READ_CHUNK_MIN);
+	if (!buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	for (done = 0; done < tree_size; done += len) {
+		len = min(tree_size - done, (UINT64)READ_CHUNK_MIN);
+		ret = read_partition(gparti, offset + done, len, buf);
+		if (EFI_ERROR(ret))
+			break;
+		if (CompareMem(buf, tree + done, len)) {
+			error(L"Stored hash tree differs near block %lld",
+			      (offset + done) / VERITY_BLOCK_SIZE);
+			ret = EFI_CRC_ERROR;
+			break;
+		}
+	}
+
+	FreePool(buf);
+	return ret;
+}
+
+EFI_STATUS verify_verity(const CHAR16 *label)
+{
+	struct gpt_partition_interface gparti;
+	struct verity_table table;
+	struct verity_work w;
+	struct part_reader reader;
+	UINT64 level_blocks[VERITY_MAX_LEVELS], level_offset[VERITY_MAX_LEVELS];
+	UINT64 fs_len, data_size, tree_size = 0, partlen, block = 0;
+	CHAR8 root[VERITY_HASH_SIZE], rootstr[VERITY_HASH_SIZE * 2 + 1];
+	CHAR8 *tree, *data;
+	UINTN levels = 0, chunklen, i;
+	EFI_STATUS ret;
+
+	ret = get_fs_len(label, &gparti, &fs_len);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = read_verity_table(&gparti, fs_len, &table);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	data_size = table.data_blocks * VERITY_BLOCK_SIZE;
+	do {
+		if (levels == VERITY_MAX_LEVELS)
+			return EFI_INVALID_PARAMETER;
+		level_blocks[levels] = verity_tree_blocks(data_size, levels);
+		tree_size += level_blocks[levels] * VERITY_BLOCK_SIZE;
+	} while (level_blocks[levels++] > 1);
+
+	partlen = (gparti.part.ending_lba + 1 - gparti.part.starting_lba) * gparti.bio->Media->BlockSize;
+	if (data_size > table.hash_start * VERITY_BLOCK_SIZE
+	    || table.hash_start * VERITY_BLOCK_SIZE + tree_size > partlen) {
+		error(L"Verity table does not fit in partition %s", label);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	/* The root level comes first */
+	level_offset[levels - 1] = 0;
+	for (i = levels - 1; i > 0; i--)
+		level_offset[i - 1] = level_offset[i] + level_blocks[i] * VERITY_BLOCK_SIZE;
+
+	tree = AllocateZeroPool(tree_size);
+	if (!tree)
+		return EFI_OUT_OF_RESOURCES;
+
+	SHA256_Init(&w.salted);
+	sha256_update(&w.salted, table.salt, table.salt_len);
+
+	ret = part_reader_open(&reader, &gparti, data_size);
+	if (EFI_ERROR(ret))
+		goto free;
+
+	for (;;) {
+		ret = part_reader_next(&reader, &data, &chunklen);
+		if (EFI_ERROR(ret) || !chunklen)
+			break;
+		ret = verity_hash(&w, data, chunklen / VERITY_BLOCK_SIZE,
+				  tree + level_offset[0] + block * VERITY_HASH_SIZE);
+		if (EFI_ERROR(ret))
+			break;
+		block += chunklen / VERITY_BLOCK_SIZE;
+	}
+	part_reader_close(&reader);
+	if (EFI_ERROR(ret))
+		goto free;
+
+	for (i = 1; i < levels; i++) {
+		ret = verity_hash(&w, tree + level_offset[i - 1],
+				  level_blocks[i - 1], tree + level_offset[i]);
+		if (EFI_ERROR(ret))
+			goto free;
+	}
+	verity_hash(&w, tree + level_offset[levels - 1], 1, root);
+
+	ret = bytes_to_hex_stra(root, sizeof(root), rootstr, sizeof(rootstr));
 	if (EFI_ERROR(ret))
+		goto free;
+	fastboot_info("target: /%s", gparti.part.name);
+	fastboot_info("root hash: %a", rootstr);
+
+	if (CompareMem(root, table.root, sizeof(root))) {
+		error(L"%s root hash does not match the verity table", label);
+		ret = EFI_CRC_ERROR;
+		goto free;
+	}
+
+	ret = verity_check_tree(&gparti, table.hash_start * VERITY_BLOCK_SIZE,
+				tree, tree_size);
+
+free:
+	FreePool(tree);
+	return ret;
+}
+
+/* The partition is read by batches of blocks, one block per
+   processor, and each block digest is computed on its own
+   processor.  */
+#define MANIFEST_BATCH_MAX 8
+#define MANIFEST_REPORT_MAX 16
+
+struct manifest_work {
+	const CHAR8 *data;
+	UINTN len;
+	CHAR8 digests[MANIFEST_BATCH_MAX][BLOCK_DIGEST_SIZE];
+};
+
+static VOID manifest_hash_block(VOID *arg, UINTN index)
+{
+	struct manifest_work *w = arg;
+	UINTN offset = index * BLOCK_DIGEST_BLOCK_SIZE;
+	SHA256_CTX ctx;
+
+	SHA256_Init(&ctx);
+	sha256_update(&ctx, w->data + offset,
+		      min(w->len - offset, (UINTN)BLOCK_DIGEST_BLOCK_SIZE));
+	SHA256_Final(w->digests[index], &ctx);
+}
+
+EFI_STATUS verify_block_digests(const CHAR16 *label, const VOID *manifest,
+				UINTN size)
+{
+	struct gpt_partition_interface gparti;
+	struct manifest_work *w;
+	struct part_reader reader;
+	const CHAR8 *expected = manifest;
+	UINT64 partlen, len, nb_blocks, block = 0, mismatches = 0;
+	UINTN batch, nb, i;
+	EFI_STATUS ret;
+
+	if (!size || size % BLOCK_DIGEST_SIZE) {
+		error(L"Invalid block digest manifest size %d", size);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
 		return ret;
-	return report_hash(L"/", gparti.part.name, hash);
+	}
+
+	/* The last block is shorter if it ends the partition.  */
+	nb_blocks = size / BLOCK_DIGEST_SIZE;
+	partlen = (gparti.part.ending_lba + 1 - gparti.part.starting_lba) * gparti.bio->Media->BlockSize;
+	len = min(nb_blocks * BLOCK_DIGEST_BLOCK_SIZE, partlen);
+	if (DIV_ROUND_UP(len, BLOCK_DIGEST_BLOCK_SIZE) != nb_blocks) {
+		error(L"The manifest has %lld blocks, partition %s only %lld",
+		      nb_blocks, label, DIV_ROUND_UP(partlen, BLOCK_DIGEST_BLOCK_SIZE));
+		return EFI_INVALID_PARAMETER;
+	}
+
+	w = AllocatePool(sizeof(*w));
+	if (!w)
+		return EFI_OUT_OF_RESOURCES;
+
+	/* The SHA extensions detection logs, it must run on the BSP
+	   before the blocks are hashed on the other processors.  */
+	sha_ni_supported();
+
+	batch = min(max(parallel_workers(), (UINTN)1), (UINTN)MANIFEST_BATCH_MAX);
+	ret = part_reader_open_chunk(&reader, &gparti, len,
+				     batch * BLOCK_DIGEST_BLOCK_SIZE);
+	if (EFI_ERROR(ret))
+		goto free;
+
+	for (;;) {
+		ret = part_reader_next(&reader, (CHAR8 **)&w->data, &w->len);
+		if (EFI_ERROR(ret) || !w->len)
+			break;
+
+		nb = DIV_ROUND_UP(w->len, BLOCK_DIGEST_BLOCK_SIZE);
+		ret = parallel_for(nb, manifest_hash_block, NULL, w);
+		if (EFI_ERROR(ret))
+			break;
+
+		for (i = 0; i < nb; i++, block++) {
+			if (!CompareMem(w->digests[i],
+					expected + block * BLOCK_DIGEST_SIZE,
+					BLOCK_DIGEST_SIZE))
+				continue;
+			if (mismatches++ < MANIFEST_REPORT_MAX)
+				fastboot_info("block %ld differs", block);
+		}
+	}
+	part_reader_close(&reader);
+	if (EFI_ERROR(ret))
+		goto free;
+
+	fastboot_info("%ld of %ld blocks differ", mismatches, nb_blocks);
+	if (mismatches) {
+		error(L"%lld blocks of %s do not match the manifest",
+		      mismatches, label);
+		ret = EFI_CRC_ERROR;
+	}
+
+free:
+	FreePool(w);
+	return ret;
 }
@@ -38,6 +38,33 @@
 EFI_STATUS get_boot_image_hash(const CHAR16 *label);
 EFI_STATUS get_esp_hash(__attribute__((__unused__)) const CHAR16 *label);
 EFI_STATUS get_fs_hash(const CHAR16 *label);
-EFI_STATUS set_hash_algorithm(const CHAR8 *algo);
+/* Select the NB ALGOS hash algorithms, the default one if NB is 0 */
+EFI_STATUS set_hash_algorithms(UINTN nb, CHAR8 **algos);
+
+/* Recompute the dm-verity hash tree of the LABEL partition and
+   compare it with the stored tree and root hash */
+EFI_STATUS verify_verity(const CHAR16 *label);
+
+/* Compare the SHA-256 digest of each BLOCK_DIGEST_BLOCK_SIZE block of
+   the LABEL partition with the MANIFEST one.  The MANIFEST is the
+   concatenation of the digests of the consecutive blocks from the
+   beginning of the partition, the last one may be cut short by the
+   end of the partition.  The mismatching blocks are reported.  */
+#define BLOCK_DIGEST_BLOCK_SIZE (4 * 1024 * 1024)
+#define BLOCK_DIGEST_SIZE 32
+EFI_STATUS verify_block_digests(const CHAR16 *label, const VOID *manifest,
+				UINTN size);
+
+/* Digest of the registered partitions computed as they are flashed */
+EFI_STATUS hash_cache_register(const CHAR16 *label);
+void hash_cache_invalidate(const CHAR16 *label);
+BOOLEAN hash_cache_start(const CHAR16 *label);
+BOOLEAN hash_cache_active(void);
+void hash_cache_update(const VOID *data, UINT64 offset, UINTN len);
+void hash_cache_end(BOOLEAN success);
+
+/* Drop the cached digest of the ESP FILE, of all the ESP files if
+   FILE is NULL.  */
+void esp_hash_invalidate(const CHAR16 *file);
 
 #endif	/* _HASHES_H_ */
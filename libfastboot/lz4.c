@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "lz4.h"
+
+/* LZ4 frame format, see
+   https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md */
+#define LZ4_MAGIC		0x184D2204
+#define LZ4_FLG_VERSION_MASK	0xC0
+#define LZ4_FLG_VERSION		0x40
+#define LZ4_FLG_BLOCK_INDEP	(1 << 5)
+#define LZ4_FLG_BLOCK_CHECKSUM	(1 << 4)
+#define LZ4_FLG_CONTENT_SIZE	(1 << 3)
+#define LZ4_FLG_CONTENT_CHECKSUM (1 << 2)
+#define LZ4_FLG_DICT_ID		(1 << 0)
+#define LZ4_BLOCK_UNCOMPRESSED	(1U << 31)
+#define LZ4_HISTORY_SIZE	(64 * 1024)
+#define LZ4_MIN_MATCH		4
+/* Magic, FLG, BD, content size and HC */
+#define LZ4_MAX_HEADER_SIZE	(4 + 1 + 1 + 8 + 1)
+
+/* xxHash32, used by the frame header, block and content checksums */
+#define XXH_PRIME1 2654435761U
+#define XXH_PRIME2 2246822519U
+#define XXH_PRIME3 3266489917U
+#define XXH_PRIME4 668265263U
+#define XXH_PRIME5 374761393U
+
+struct xxh32 {
+	UINT32 v[4];
+	UINT32 total_len;	/* Modulo 2^32, as the digest uses it */
+	BOOLEAN large_len;	/* The total length reached 16 bytes */
+	UINT8 mem[16];
+	UINTN mem_len;
+};
+
+static UINT32 rotl32(UINT32 x, UINTN r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static UINT32 read32(const UINT8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static UINT32 xxh32_round(UINT32 acc, UINT32 input)
+{
+	return rotl32(acc + input * XXH_PRIME2, 13) * XXH_PRIME1;
+}
+
+static void xxh32_init(struct xxh32 *s)
+{
+	s->v[0] = XXH_PRIME1 + XXH_PRIME2;
+	s->v[1] = XXH_PRIME2;
+	s->v[2] = 0;
+	s->v[3] = -XXH_PRIME1;
+	s->total_len = 0;
+	s->large_len = FALSE;
+	s->mem_len = 0;
+}
+
+static void xxh32_stripe(struct xxh32 *s, const UINT8 *p)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(s->v); i++)
+		s->v[i] = xxh32_round(s->v[i], read32(p + i * 4));
+}
+
+static void xxh32_update(struct xxh32 *s, const UINT8 *p, UINTN len)
+{
+	UINTN n;
+
+	s->total_len += len;
+	s->large_len |= len >= sizeof(s->mem) || s->total_len >= sizeof(s->mem);
+
+	if (s->mem_len) {
+		n = min(len, sizeof(s->mem) - s->mem_len);
+		memcpy(s->mem + s->mem_len, p, n);
+		s->mem_len += n;
+		p += n;
+		len -= n;
+		if (s->mem_len < sizeof(s->mem))
+			return;
+		xxh32_stripe(s, s->mem);
+		s->mem_len = 0;
+	}
+
+	for (; len >= sizeof(s->mem); p += sizeof(s->mem), len -= sizeof(s->mem))
+		xxh32_stripe(s, p);
+
+	memcpy(s->mem, p, len);
+	s->mem_len = len;
+}
+
+static UINT32 xxh32_digest(struct xxh32 *s)
+{
+	const UINT8 *p = s->mem;
+	UINTN len = s->mem_len;
+	UINT32 h;
+
+	if (s->large_len)
+		h = rotl32(s->v[0], 1) + rotl32(s->v[1], 7) +
+			rotl32(s->v[2], 12) + rotl32(s->v[3], 18);
+	else
+		h = XXH_PRIME5;
+	h += s->total_len;
+
+	for (; len >= 4; p += 4, len -= 4)
+		h = rotl32(h + read32(p) * XXH_PRIME3, 17) * XXH_PRIME4;
+	for (; len; p++, len--)
+		h = rotl32(h + *p * XXH_PRIME5, 11) * XXH_PRIME1;
+
+	h ^= h >> 15;
+	h *= XXH_PRIME2;
+	h ^= h >> 13;
+	h *= XXH_PRIME3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static UINT32 xxh32(const UINT8 *p, UINTN len)
+{
+	struct xxh32 s;
+
+	xxh32_init(&s);
+	xxh32_update(&s, p, len);
+	return xxh32_digest(&s);
+}
+
+BOOLEAN is_lz4_image(void *data, UINTN size)
+{
+	return size >= sizeof(UINT32) && read32(data) == LZ4_MAGIC;
+}
+
+/* Decoder state.  Each block is collected in IN, unless it is
+   available in one piece in the caller buffer, and decompressed
+   after the LZ4_HISTORY_SIZE bytes of history at the beginning of
+   OUT, which linked blocks may refer to.  */
+static struct lz4_stream {
+	enum {
+		LZ4_FRAME_HEADER,
+		LZ4_BLOCK_SIZE,
+		LZ4_BLOCK_DATA,
+		LZ4_BLOCK_CHECKSUM,
+		LZ4_CONTENT_CHECKSUM,
+		LZ4_DONE,
+		LZ4_ERROR
+	} state;
+	lz4_output_t output;
+	UINT8 flg;
+	UINTN block_max;
+	UINT8 hdr[LZ4_MAX_HEADER_SIZE];
+	UINTN hdr_len;
+	UINT32 block_size;
+	UINT8 *in;
+	UINTN in_len;
+	UINT8 *out;
+	UINTN history;
+	struct xxh32 content;
+	struct xxh32 block;
+} lz;
+
+static UINTN header_size(UINT8 flg)
+{
+	return 4 + 2 + (flg & LZ4_FLG_CONTENT_SIZE ? 8 : 0) + 1;
+}
+
+static EFI_STATUS parse_frame_header(void)
+{
+	static const UINTN BLOCK_MAX[] = { 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+	UINT8 bd = lz.hdr[5];
+	UINTN size = header_size(lz.flg);
+	UINTN bsize;
+
+	if ((lz.flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION) {
+		error(L"Unsupported lz4 frame version");
+		return EFI_UNSUPPORTED;
+	}
+	if (lz.flg & LZ4_FLG_DICT_ID) {
+		error(L"lz4 frames with dictionary are not supported");
+		return EFI_UNSUPPORTED;
+	}
+	bsize = (bd >> 4) & 7;
+	if (bsize < 4) {
+		error(L"Invalid lz4 block maximum size %d", bsize);
+		return EFI_INVALID_PARAMETER;
+	}
+	if (((xxh32(lz.hdr + 4, size - 5) >> 8) & 0xff) != lz.hdr[size - 1]) {
+		error(L"lz4 frame header checksum mismatch");
+		return EFI_CRC_ERROR;
+	}
+
+	if (lz.block_max < BLOCK_MAX[bsize - 4]) {
+		if (lz.in)
+			FreePool(lz.in);
+		if (lz.out)
+			FreePool(lz.out);
+		lz.block_max = BLOCK_MAX[bsize - 4];
+		lz.in = AllocatePool(lz.block_max);
+		lz.out = AllocatePool(LZ4_HISTORY_SIZE + lz.block_max);
+		if (!lz.in || !lz.out) {
+			error(L"Failed to allocate lz4 buffers");
+			return EFI_OUT_OF_RESOURCES;
+		}
+	}
+
+	lz.history = 0;
+	xxh32_init(&lz.content);
+	return EFI_SUCCESS;
+}
+
+/* Decompress the LZ4 block SRC of LEN bytes at OUT + history.
+   Return the number of decompressed bytes in DECODED.  */
+static EFI_STATUS decode_block(const UINT8 *src, UINTN len, UINTN *decoded)
+{
+	const UINT8 *end = src + len;
+	UINT8 *start = lz.out + lz.history;
+	UINT8 *dst = start, *dst_end = start + lz.block_max;
+	UINT8 *match;
+	UINTN lit, mlen, offset;
+	UINT8 token, b;
+
+	while (src < end) {
+		token = *src++;
+
+		lit = token >> 4;
+		if (lit == 15)
+			do {
+				if (src == end)
+					goto malformed;
+				b = *src++;
+				lit += b;
+			} while (b == 255);
+		if (lit > (UINTN)(end - src) || lit > (UINTN)(dst_end - dst))
+			goto malformed;
+		memcpy(dst, src, lit);
+		dst += lit;
+		src += lit;
+
+		/* The last sequence has no match */
+		if (src == end)
+			break;
+
+		if (end - src < 2)
+			goto malformed;
+		offset = src[0] | (src[1] << 8);
+		src += 2;
+		if (!offset || offset > (UINTN)(dst - lz.out))
+			goto malformed;
+
+		mlen = token & 15;
+		if (mlen == 15)
+			do {
+				if (src == end)
+					goto malformed;
+				b = *src++;
+				mlen += b;
+			} while (b == 255);
+		mlen += LZ4_MIN_MATCH;
+		if (mlen > (UINTN)(dst_end - dst))
+			goto malformed;
+
+		/* Matches may overlap the bytes being written */
+		match = dst - offset;
+		if (offset >= mlen) {
+			memcpy(dst, match, mlen);
+			dst += mlen;
+		} else
+			while (mlen--)
+				*dst++ = *match++;
+	}
+
+	*decoded = dst - start;
+	return EFI_SUCCESS;
+
+malformed:
+	error(L"Malformed lz4 block");
+	return EFI_INVALID_PARAMETER;
+}
+
+static EFI_STATUS process_block(const UINT8 *src, UINTN len)
+{
+	EFI_STATUS ret;
+	UINTN decoded, keep;
+	UINT8 *start;
+
+	if (lz.flg & LZ4_FLG_BLOCK_CHECKSUM) {
+		xxh32_init(&lz.block);
+		xxh32_update(&lz.block, src, len);
+	}
+
+	if (lz.block_size & LZ4_BLOCK_UNCOMPRESSED) {
+		memcpy(lz.out + lz.history, src, len);
+		decoded = len;
+	} else {
+		ret = decode_block(src, len, &decoded);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	start = lz.out + lz.history;
+	if (lz.flg & LZ4_FLG_CONTENT_CHECKSUM)
+		xxh32_update(&lz.content, start, decoded);
+
+	ret = lz.output(start, decoded);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* Keep the last LZ4_HISTORY_SIZE bytes for the next linked
+	   block */
+	if (lz.flg & LZ4_FLG_BLOCK_INDEP)
+		return EFI_SUCCESS;
+	keep = min(lz.history + decoded, (UINTN)LZ4_HISTORY_SIZE);
+	CopyMem(lz.out, start + decoded - keep, keep);
+	lz.history = keep;
+
+	return EFI_SUCCESS;
+}
+
+/* Collect up to SIZE bytes of DATA in DEST until LEN reaches TOTAL.
+   Return the number of bytes consumed.  */
+static UINTN collect(UINT8 *dest, UINTN *len, UINTN total, UINT8 *data, UINTN size)
+{
+	UINTN n = min(size, total - *len);
+
+	memcpy(dest + *len, data, n);
+	*len += n;
+	return n;
+}
+
+static EFI_STATUS lz4_stream_parse(UINT8 *s, UINTN size)
+{
+	EFI_STATUS ret;
+	UINTN len;
+	UINT32 value;
+
+	while (size) {
+		switch (lz.state) {
+		case LZ4_FRAME_HEADER:
+			len = collect(lz.hdr, &lz.hdr_len, lz.hdr_len < 5 ? 5 :
+				      header_size(lz.flg), s, size);
+			if (lz.hdr_len == 5) {
+				if (read32(lz.hdr) != LZ4_MAGIC) {
+					error(L"Invalid lz4 frame magic");
+					return EFI_INVALID_PARAMETER;
+				}
+				lz.flg = lz.hdr[4];
+			}
+			if (lz.hdr_len <= 5 || lz.hdr_len != header_size(lz.flg))
+				break;
+			ret = parse_frame_header();
+			if (EFI_ERROR(ret))
+				return ret;
+			lz.hdr_len = 0;
+			lz.state = LZ4_BLOCK_SIZE;
+			break;
+
+		case LZ4_BLOCK_SIZE:
+			len = collect(lz.hdr, &lz.hdr_len, sizeof(value), s, size);
+			if (lz.hdr_len != sizeof(value))
+				break;
+			lz.hdr_len = 0;
+			lz.block_size = read32(lz.hdr);
+			if (!lz.block_size) {
+				lz.state = lz.flg & LZ4_FLG_CONTENT_CHECKSUM ?
+					LZ4_CONTENT_CHECKSUM : LZ4_DONE;
+				break;
+			}
+			if ((lz.block_size & ~LZ4_BLOCK_UNCOMPRESSED) > lz.block_max) {
+				error(L"lz4 block too large");
+				return EFI_INVALID_PARAMETER;
+			}
+			lz.in_len = 0;
+			lz.state = LZ4_BLOCK_DATA;
+			break;
+
+		case LZ4_BLOCK_DATA:
+			value = lz.block_size & ~LZ4_BLOCK_UNCOMPRESSED;
+			/* Avoid the copy when the block is available in
+			   one piece */
+			if (!lz.in_len && size >= value) {
+				len = value;
+				ret = process_block(s, len);
+			} else {
+				len = collect(lz.in, &lz.in_len, value, s, size);
+				if (lz.in_len != value)
+					break;
+				ret = process_block(lz.in, lz.in_len);
+			}
+			if (EFI_ERROR(ret))
+				return ret;
+			lz.state = lz.flg & LZ4_FLG_BLOCK_CHECKSUM ?
+				LZ4_BLOCK_CHECKSUM : LZ4_BLOCK_SIZE;
+			break;
+
+		case LZ4_BLOCK_CHECKSUM:
+		case LZ4_CONTENT_CHECKSUM:
+			len = collect(lz.hdr, &lz.hdr_len, sizeof(value), s, size);
+			if (lz.hdr_len != sizeof(value))
+				break;
+			lz.hdr_len = 0;
+			value = xxh32_digest(lz.state == LZ4_BLOCK_CHECKSUM ?
+					     &lz.block : &lz.content);
+			if (read32(lz.hdr) != value) {
+				error(L"lz4 %a checksum mismatch",
+				      lz.state == LZ4_BLOCK_CHECKSUM ? "block" : "content");
+				return EFI_CRC_ERROR;
+			}
+			lz.state = lz.state == LZ4_BLOCK_CHECKSUM ?
+				LZ4_BLOCK_SIZE : LZ4_DONE;
+			break;
+
+		case LZ4_DONE:
+			/* Concatenated frames */
+			lz.state = LZ4_FRAME_HEADER;
+			continue;
+
+		default:
+			return EFI_ABORTED;
+		}
+
+		s += len;
+		size -= len;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS lz4_stream_start(lz4_output_t output)
+{
+	if (!output)
+		return EFI_INVALID_PARAMETER;
+
+	lz.state = LZ4_FRAME_HEADER;
+	lz.output = output;
+	lz.hdr_len = 0;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS lz4_stream_write(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+
+	if (lz.state == LZ4_ERROR)
+		return EFI_ABORTED;
+
+	ret = lz4_stream_parse(data, size);
+	if (EFI_ERROR(ret))
+		lz.state = LZ4_ERROR;
+
+	return ret;
+}
+
+EFI_STATUS lz4_stream_end(void)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+
+	if (lz.state == LZ4_ERROR)
+		ret = EFI_ABORTED;
+	else if (lz.state != LZ4_DONE) {
+		error(L"lz4 image truncated");
+		ret = EFI_INVALID_PARAMETER;
+	}
+
+	if (lz.in)
+		FreePool(lz.in);
+	if (lz.out)
+		FreePool(lz.out);
+	ZeroMem(&lz, sizeof(lz));
+
+	return ret;
+}
@@ -0,0 +1,687 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <endian.h>
+#include "uefi_utils.h"
+
+#include "flash.h"
+#include "mkfs.h"
+
+/* The filesystem is laid out the way mke2fs does without the flex_bg
+   feature: each group holds its block bitmap, inode bitmap and inode
+   table, behind a superblock and group descriptors backup for the
+   groups selected by the sparse_super feature.  With the uninit_bg
+   feature, the kernel and e2fsck compute the bitmaps of the groups
+   flagged uninitialized and ignore the unused inode table entries:
+   only the first group, the last group and the backups are written,
+   the kernel zeroes the inode tables in the background.  */
+
+#define EXT4_BLOCK_SIZE			4096
+#define EXT4_LOG_BLOCK_SIZE		2	/* log2(EXT4_BLOCK_SIZE) - 10 */
+#define EXT4_BLOCKS_PER_GROUP		(8 * EXT4_BLOCK_SIZE)
+#define EXT4_MAX_BLOCKS			0xFFFFFFFFULL
+#define EXT4_INODE_SIZE			256
+#define EXT4_INODE_RATIO		16384
+#define EXT4_INODES_PER_BLOCK		(EXT4_BLOCK_SIZE / EXT4_INODE_SIZE)
+#define EXT4_DESC_SIZE			32
+#define EXT4_EXTRA_ISIZE		32
+#define EXT4_SB_OFFSET			1024
+#define EXT4_SUPER_MAGIC		0xEF53
+#define EXT4_VALID_FS			1
+#define EXT4_ERRORS_CONTINUE		1
+#define EXT4_DYNAMIC_REV		1
+/* Like mke2fs, a last group smaller than that is dropped */
+#define EXT4_MIN_GROUP_DATA		50
+
+#define EXT4_ROOT_INO			2
+#define EXT4_JOURNAL_INO		8
+#define EXT4_FIRST_INO			11
+#define EXT4_LOST_FOUND_INO		EXT4_FIRST_INO
+
+#define EXT4_FEATURE_COMPAT_HAS_JOURNAL		0x0004
+#define EXT4_FEATURE_COMPAT_EXT_ATTR		0x0008
+#define EXT4_FEATURE_INCOMPAT_FILETYPE		0x0002
+#define EXT4_FEATURE_INCOMPAT_EXTENTS		0x0040
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
+#define EXT4_FEATURE_RO_COMPAT_LARGE_FILE	0x0002
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM		0x0010
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK	0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE	0x0040
+
+#define EXT4_BG_INODE_UNINIT		0x0001
+#define EXT4_BG_BLOCK_UNINIT		0x0002
+
+#define EXT4_EXTENTS_FL			0x00080000
+#define EXT4_EXT_MAGIC			0xF30A
+#define EXT4_S_IFDIR			0040000
+#define EXT4_S_IFREG			0100000
+#define EXT4_FT_DIR			2
+#define EXT3_JNL_BACKUP_BLOCKS		1
+
+#define JBD2_MAGIC_NUMBER		0xC03B3998
+#define JBD2_SUPERBLOCK_V2		4
+
+struct ext4_super_block {
+	UINT32 s_inodes_count;
+	UINT32 s_blocks_count_lo;
+	UINT32 s_r_blocks_count_lo;
+	UINT32 s_free_blocks_count_lo;
+	UINT32 s_free_inodes_count;
+	UINT32 s_first_data_block;
+	UINT32 s_log_block_size;
+	UINT32 s_log_cluster_size;
+	UINT32 s_blocks_per_group;
+	UINT32 s_clusters_per_group;
+	UINT32 s_inodes_per_group;
+	UINT32 s_mtime;
+	UINT32 s_wtime;
+	UINT16 s_mnt_count;
+	UINT16 s_max_mnt_count;
+	UINT16 s_magic;
+	UINT16 s_state;
+	UINT16 s_errors;
+	UINT16 s_minor_rev_level;
+	UINT32 s_lastcheck;
+	UINT32 s_checkinterval;
+	UINT32 s_creator_os;
+	UINT32 s_rev_level;
+	UINT16 s_def_resuid;
+	UINT16 s_def_resgid;
+	UINT32 s_first_ino;
+	UINT16 s_inode_size;
+	UINT16 s_block_group_nr;
+	UINT32 s_feature_compat;
+	UINT32 s_feature_incompat;
+	UINT32 s_feature_ro_compat;
+	UINT8 s_uuid[16];
+	CHAR8 s_volume_name[16];
+	CHAR8 s_last_mounted[64];
+	UINT32 s_algorithm_usage_bitmap;
+	UINT8 s_prealloc_blocks;
+	UINT8 s_prealloc_dir_blocks;
+	UINT16 s_reserved_gdt_blocks;
+	UINT8 s_journal_uuid[16];
+	UINT32 s_journal_inum;
+	UINT32 s_journal_dev;
+	UINT32 s_last_orphan;
+	UINT32 s_hash_seed[4];
+	UINT8 s_def_hash_version;
+	UINT8 s_jnl_backup_type;
+	UINT16 s_desc_size;
+	UINT32 s_default_mount_opts;
+	UINT32 s_first_meta_bg;
+	UINT32 s_mkfs_time;
+	UINT32 s_jnl_blocks[17];
+	UINT32 s_blocks_count_hi;
+	UINT32 s_r_blocks_count_hi;
+	UINT32 s_free_blocks_count_hi;
+	UINT16 s_min_extra_isize;
+	UINT16 s_want_extra_isize;
+	UINT32 s_flags;
+	UINT8 s_reserved[668];
+} __attribute__((packed));
+
+struct ext4_group_desc {
+	UINT32 bg_block_bitmap_lo;
+	UINT32 bg_inode_bitmap_lo;
+	UINT32 bg_inode_table_lo;
+	UINT16 bg_free_blocks_count_lo;
+	UINT16 bg_free_inodes_count_lo;
+	UINT16 bg_used_dirs_count_lo;
+	UINT16 bg_flags;
+	UINT32 bg_exclude_bitmap_lo;
+	UINT16 bg_block_bitmap_csum_lo;
+	UINT16 bg_inode_bitmap_csum_lo;
+	UINT16 bg_itable_unused_lo;
+	UINT16 bg_checksum;
+} __attribute__((packed));
+
+struct ext4_extent_header {
+	UINT16 eh_magic;
+	UINT16 eh_entries;
+	UINT16 eh_max;
+	UINT16 eh_depth;
+	UINT32 eh_generation;
+} __attribute__((packed));
+
+struct ext4_extent {
+	UINT32 ee_block;
+	UINT16 ee_len;
+	UINT16 ee_start_hi;
+	UINT32 ee_start_lo;
+} __attribute__((packed));
+
+struct ext4_inode {
+	UINT16 i_mode;
+	UINT16 i_uid;
+	UINT32 i_size_lo;
+	UINT32 i_atime;
+	UINT32 i_ctime;
+	UINT32 i_mtime;
+	UINT32 i_dtime;
+	UINT16 i_gid;
+	UINT16 i_links_count;
+	UINT32 i_blocks_lo;
+	UINT32 i_flags;
+	UINT32 i_osd1;
+	union {
+		UINT32 i_block[15];
+		struct {
+			struct ext4_extent_header header;
+			struct ext4_extent extents[4];
+		} tree;
+	};
+	UINT32 i_generation;
+	UINT32 i_file_acl_lo;
+	UINT32 i_size_high;
+	UINT32 i_obso_faddr;
+	UINT8 i_osd2[12];
+	UINT16 i_extra_isize;
+	UINT16 i_checksum_hi;
+	UINT32 i_ctime_extra;
+	UINT32 i_mtime_extra;
+	UINT32 i_atime_extra;
+	UINT32 i_crtime;
+	UINT32 i_crtime_extra;
+	UINT32 i_version_hi;
+	UINT32 i_projid;
+	UINT8 i_reserved[EXT4_INODE_SIZE - 160];
+} __attribute__((packed));
+
+struct ext4_dir_entry {
+	UINT32 inode;
+	UINT16 rec_len;
+	UINT8 name_len;
+	UINT8 file_type;
+	CHAR8 name[];
+} __attribute__((packed));
+
+/* All fields are big endian */
+struct jbd2_superblock {
+	UINT32 h_magic;
+	UINT32 h_blocktype;
+	UINT32 h_sequence;
+	UINT32 s_blocksize;
+	UINT32 s_maxlen;
+	UINT32 s_first;
+	UINT32 s_sequence;
+	UINT32 s_start;
+	UINT32 s_errno;
+	UINT32 s_feature_compat;
+	UINT32 s_feature_incompat;
+	UINT32 s_feature_ro_compat;
+	UINT8 s_uuid[16];
+	UINT32 s_nr_users;
+} __attribute__((packed));
+
+static struct ext4_layout {
+	UINT32 blocks;
+	UINT32 groups;
+	UINT32 inodes_per_group;
+	UINT32 itable_blocks;
+	UINT32 gdt_blocks;
+	UINT32 journal_blocks;
+	UINT32 now;
+	UINT8 uuid[16];
+	UINT64 pos;
+	UINT8 *block;
+} fs;
+
+static BOOLEAN is_power_of(UINT32 n, UINT32 base)
+{
+	UINT64 p;
+
+	for (p = base; p < n; p *= base)
+		;
+	return p == n;
+}
+
+static BOOLEAN group_has_super(UINT32 group)
+{
+	if (group <= 1)
+		return TRUE;
+	if (!(group & 1))
+		return FALSE;
+	return is_power_of(group, 3) || is_power_of(group, 5) ||
+		is_power_of(group, 7);
+}
+
+static UINT32 group_first(UINT32 group)
+{
+	return group * EXT4_BLOCKS_PER_GROUP;
+}
+
+static UINT32 group_blocks(UINT32 group)
+{
+	if (group == fs.groups - 1)
+		return fs.blocks - group_first(group);
+	return EXT4_BLOCKS_PER_GROUP;
+}
+
+/* First block of the block bitmap, inode bitmap, inode table run */
+static UINT32 group_meta(UINT32 group)
+{
+	return group_first(group) +
+		(group_has_super(group) ? 1 + fs.gdt_blocks : 0);
+}
+
+static UINT32 group_used(UINT32 group)
+{
+	UINT32 used = group_meta(group) - group_first(group) + 2 + fs.itable_blocks;
+
+	/* Root and lost+found directories blocks and the journal */
+	if (group == 0)
+		used += 2 + fs.journal_blocks;
+	return used;
+}
+
+static UINT32 root_block(void)
+{
+	return group_meta(0) + 2 + fs.itable_blocks;
+}
+
+static UINT32 lost_found_block(void)
+{
+	return root_block() + 1;
+}
+
+static UINT32 journal_block(void)
+{
+	return root_block() + 2;
+}
+
+static UINT32 inodes_used(UINT32 group)
+{
+	return group == 0 ? EXT4_FIRST_INO : 0;
+}
+
+/* Same journal size as mke2fs, capped to fit in the first group */
+static UINT32 journal_size(UINT32 blocks)
+{
+	if (blocks < 2048)
+		return 0;
+	if (blocks < 32768)
+		return 1024;
+	if (blocks < 256 * 1024)
+		return 4096;
+	if (blocks < 512 * 1024)
+		return 8192;
+	return 16384;
+}
+
+static EFI_STATUS layout(UINT64 size)
+{
+	UINT64 blocks = size / EXT4_BLOCK_SIZE;
+	UINT32 inodes, last;
+
+	if (blocks > EXT4_MAX_BLOCKS)
+		return EFI_UNSUPPORTED;
+
+	for (;;) {
+		fs.blocks = blocks;
+		fs.groups = (blocks + EXT4_BLOCKS_PER_GROUP - 1) / EXT4_BLOCKS_PER_GROUP;
+		if (!fs.groups)
+			return EFI_UNSUPPORTED;
+
+		inodes = blocks * EXT4_BLOCK_SIZE / EXT4_INODE_RATIO / fs.groups;
+		inodes = ALIGN(max(inodes, (UINT32)EXT4_INODES_PER_BLOCK),
+			       EXT4_INODES_PER_BLOCK);
+		fs.inodes_per_group = min(inodes, (UINT32)EXT4_BLOCKS_PER_GROUP);
+		fs.itable_blocks = fs.inodes_per_group / EXT4_INODES_PER_BLOCK;
+		fs.gdt_blocks = ALIGN(fs.groups * EXT4_DESC_SIZE, EXT4_BLOCK_SIZE)
+			/ EXT4_BLOCK_SIZE;
+		fs.journal_blocks = 0;
+
+		last = fs.groups - 1;
+		if (group_blocks(last) >= group_used(last) + EXT4_MIN_GROUP_DATA)
+			break;
+		if (!last)
+			return EFI_UNSUPPORTED;
+		blocks = (UINT64)last * EXT4_BLOCKS_PER_GROUP;
+	}
+
+	fs.journal_blocks = journal_size(fs.blocks);
+	if (group_used(0) + EXT4_MIN_GROUP_DATA > group_blocks(0))
+		fs.journal_blocks = 0;
+
+	return EFI_SUCCESS;
+}
+
+/* Skip to BLOCK and write COUNT blocks of DATA there */
+static EFI_STATUS write_blocks(UINT32 block, VOID *data, UINTN count)
+{
+	UINT64 offset = (UINT64)block * EXT4_BLOCK_SIZE;
+	EFI_STATUS ret;
+
+	if (offset < fs.pos)
+		return EFI_INVALID_PARAMETER;
+
+	ret = flash_keep(offset - fs.pos);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = flash_write(data, count * EXT4_BLOCK_SIZE);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	fs.pos = offset + count * EXT4_BLOCK_SIZE;
+	return EFI_SUCCESS;
+}
+
+static UINT16 crc16(UINT16 crc, const VOID *data, UINTN size)
+{
+	const UINT8 *p = data;
+	UINTN i;
+
+	while (size--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+
+	return crc;
+}
+
+static void group_desc_init(struct ext4_group_desc *desc, UINT32 group)
+{
+	UINT32 meta = group_meta(group);
+
+	ZeroMem(desc, sizeof(*desc));
+	desc->bg_block_bitmap_lo = meta;
+	desc->bg_inode_bitmap_lo = meta + 1;
+	desc->bg_inode_table_lo = meta + 2;
+	desc->bg_free_blocks_count_lo = group_blocks(group) - group_used(group);
+	desc->bg_free_inodes_count_lo = fs.inodes_per_group - inodes_used(group);
+	desc->bg_itable_unused_lo = fs.inodes_per_group - inodes_used(group);
+	if (group == 0)
+		desc->bg_used_dirs_count_lo = 2;
+	else
+		desc->bg_flags = EXT4_BG_INODE_UNINIT;
+	/* e2fsck requires the last group block bitmap */
+	if (group != 0 && group != fs.groups - 1)
+		desc->bg_flags |= EXT4_BG_BLOCK_UNINIT;
+
+	desc->bg_checksum = crc16(~0, fs.uuid, sizeof(fs.uuid));
+	desc->bg_checksum = crc16(desc->bg_checksum, &group, sizeof(group));
+	desc->bg_checksum = crc16(desc->bg_checksum, desc,
+				  offsetof(struct ext4_group_desc, bg_checksum));
+}
+
+static void inode_init(struct ext4_inode *inode, UINT16 mode, UINT16 links,
+		       UINT32 block, UINT32 count)
+{
+	inode->i_mode = mode;
+	inode->i_links_count = links;
+	inode->i_size_lo = count * EXT4_BLOCK_SIZE;
+	inode->i_blocks_lo = count * (EXT4_BLOCK_SIZE / 512);
+	inode->i_atime = inode->i_ctime = inode->i_mtime = fs.now;
+	inode->i_crtime = fs.now;
+	inode->i_flags = EXT4_EXTENTS_FL;
+	inode->i_extra_isize = EXT4_EXTRA_ISIZE;
+	inode->tree.header.eh_magic = EXT4_EXT_MAGIC;
+	inode->tree.header.eh_entries = 1;
+	inode->tree.header.eh_max = ARRAY_SIZE(inode->tree.extents);
+	inode->tree.extents[0].ee_len = count;
+	inode->tree.extents[0].ee_start_lo = block;
+}
+
+static struct ext4_inode *journal_inode(struct ext4_inode *inode)
+{
+	ZeroMem(inode, sizeof(*inode));
+	inode_init(inode, EXT4_S_IFREG | 0600, 1, journal_block(),
+		   fs.journal_blocks);
+	return inode;
+}
+
+static void super_init(struct ext4_super_block *sb, UINT32 group)
+{
+	struct ext4_inode journal;
+	UINT32 i, free_blocks = 0;
+
+	for (i = 0; i < fs.groups; i++)
+		free_blocks += group_blocks(i) - group_used(i);
+
+	ZeroMem(sb, sizeof(*sb));
+	sb->s_inodes_count = fs.inodes_per_group * fs.groups;
+	sb->s_blocks_count_lo = fs.blocks;
+	sb->s_free_blocks_count_lo = free_blocks;
+	sb->s_free_inodes_count = sb->s_inodes_count - EXT4_FIRST_INO;
+	sb->s_log_block_size = EXT4_LOG_BLOCK_SIZE;
+	sb->s_log_cluster_size = EXT4_LOG_BLOCK_SIZE;
+	sb->s_blocks_per_group = EXT4_BLOCKS_PER_GROUP;
+	sb->s_clusters_per_group = EXT4_BLOCKS_PER_GROUP;
+	sb->s_inodes_per_group = fs.inodes_per_group;
+	sb->s_wtime = sb->s_lastcheck = sb->s_mkfs_time = fs.now;
+	sb->s_max_mnt_count = 0xFFFF;
+	sb->s_magic = EXT4_SUPER_MAGIC;
+	sb->s_state = EXT4_VALID_FS;
+	sb->s_errors = EXT4_ERRORS_CONTINUE;
+	sb->s_rev_level = EXT4_DYNAMIC_REV;
+	sb->s_first_ino = EXT4_FIRST_INO;
+	sb->s_inode_size = EXT4_INODE_SIZE;
+	sb->s_block_group_nr = group;
+	sb->s_feature_compat = EXT4_FEATURE_COMPAT_EXT_ATTR;
+	sb->s_feature_incompat = EXT4_FEATURE_INCOMPAT_FILETYPE |
+		EXT4_FEATURE_INCOMPAT_EXTENTS;
+	sb->s_feature_ro_compat = EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER |
+		EXT4_FEATURE_RO_COMPAT_LARGE_FILE |
+		EXT4_FEATURE_RO_COMPAT_GDT_CSUM |
+		EXT4_FEATURE_RO_COMPAT_DIR_NLINK |
+		EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE;
+	CopyMem(sb->s_uuid, fs.uuid, sizeof(sb->s_uuid));
+	sb->s_min_extra_isize = EXT4_EXTRA_ISIZE;
+	sb->s_want_extra_isize = EXT4_EXTRA_ISIZE;
+
+	if (!fs.journal_blocks)
+		return;
+
+	sb->s_feature_compat |= EXT4_FEATURE_COMPAT_HAS_JOURNAL;
+	sb->s_journal_inum = EXT4_JOURNAL_INO;
+	/* Backup of the journal inode extents and size */
+	sb->s_jnl_backup_type = EXT3_JNL_BACKUP_BLOCKS;
+	journal_inode(&journal);
+	CopyMem(sb->s_jnl_blocks, journal.i_block, sizeof(journal.i_block));
+	sb->s_jnl_blocks[15] = journal.i_size_high;
+	sb->s_jnl_blocks[16] = journal.i_size_lo;
+}
+
+static void set_bits(UINT8 *map, UINT32 first, UINT32 end)
+{
+	for (; first < end; first++)
+		map[first / 8] |= 1 << (first % 8);
+}
+
+static UINTN add_dir_entry(UINT8 *block, UINTN offset, UINT32 inode,
+			   UINT16 rec_len, const char *name)
+{
+	struct ext4_dir_entry *entry = (struct ext4_dir_entry *)(block + offset);
+
+	entry->inode = inode;
+	entry->rec_len = rec_len;
+	entry->name_len = strlen((CHAR8 *)name);
+	entry->file_type = EXT4_FT_DIR;
+	CopyMem(entry->name, name, entry->name_len);
+	return offset + rec_len;
+}
+
+static EFI_STATUS write_super(UINT32 group, struct ext4_group_desc *gdt)
+{
+	UINT32 first = group_first(group);
+	EFI_STATUS ret;
+
+	/* The primary superblock is 1024 bytes after the filesystem
+	   start, the backups start their group.  */
+	ZeroMem(fs.block, EXT4_BLOCK_SIZE);
+	super_init((struct ext4_super_block *)
+		   (fs.block + (group ? 0 : EXT4_SB_OFFSET)), group);
+	ret = write_blocks(first, fs.block, 1);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return write_blocks(first + 1, gdt, fs.gdt_blocks);
+}
+
+static EFI_STATUS write_first_group(void)
+{
+	struct ext4_inode *inodes = (struct ext4_inode *)fs.block;
+	struct jbd2_superblock *jsb = (struct jbd2_superblock *)fs.block;
+	UINT32 meta = group_meta(0);
+	EFI_STATUS ret;
+	UINTN offset;
+
+	/* Block bitmap */
+	ZeroMem(fs.block, EXT4_BLOCK_SIZE);
+	set_bits(fs.block, 0, group_used(0));
+	set_bits(fs.block, group_blocks(0), EXT4_BLOCKS_PER_GROUP);
+	ret = write_blocks(meta, fs.block, 1);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* Inode bitmap */
+	ZeroMem(fs.block, EXT4_BLOCK_SIZE);
+	set_bits(fs.block, 0, EXT4_FIRST_INO);
+	set_bits(fs.block, fs.inodes_per_group, 8 * EXT4_BLOCK_SIZE);
+	ret = write_blocks(meta + 1, fs.block, 1);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* First inode table block, holding the reserved inodes */
+	ZeroMem(fs.block, EXT4_BLOCK_SIZE);
+	inode_init(&inodes[EXT4_ROOT_INO - 1], EXT4_S_IFDIR | 0755, 3,
+		   root_block(), 1);
+	inode_init(&inodes[EXT4_LOST_FOUND_INO - 1], EXT4_S_IFDIR | 0700, 2,
+		   lost_found_block(), 1);
+	if (fs.journal_blocks)
+		journal_inode(&inodes[EXT4_JOURNAL_INO - 1]);
+	ret = write_blocks(meta + 2, fs.block, 1);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ZeroMem(fs.block, EXT4_BLOCK_SIZE);
+	offset = add_dir_entry(fs.block, 0, EXT4_ROOT_INO, 12, ".");
+	offset = add_dir_entry(fs.block, offset, EXT4_ROOT_INO, 12, "..");
+	add_dir_entry(fs.block, offset, EXT4_LOST_FOUND_INO,
+		      EXT4_BLOCK_SIZE - offset, "lost+found");
+	ret = write_blocks(root_block(), fs.block, 1);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ZeroMem(fs.block, EXT4_BLOCK_SIZE);
+	offset = add_dir_entry(fs.block, 0, EXT4_LOST_FOUND_INO, 12, ".");
+	add_dir_entry(fs.block, offset, EXT4_ROOT_INO,
+		      EXT4_BLOCK_SIZE - offset, "..");
+	ret = write_blocks(lost_found_block(), fs.block, 1);
+	if (EFI_ERROR(ret) || !fs.journal_blocks)
+		return ret;
+
+	/* An empty journal only needs its superblock */
+	ZeroMem(fs.block, EXT4_BLOCK_SIZE);
+	jsb->h_magic = htobe32(JBD2_MAGIC_NUMBER);
+	jsb->h_blocktype = htobe32(JBD2_SUPERBLOCK_V2);
+	jsb->s_blocksize = htobe32(EXT4_BLOCK_SIZE);
+	jsb->s_maxlen = htobe32(fs.journal_blocks);
+	jsb->s_first = htobe32(1);
+	jsb->s_sequence = htobe32(1);
+	jsb->s_nr_users = htobe32(1);
+	CopyMem(jsb->s_uuid, fs.uuid, sizeof(jsb->s_uuid));
+	return write_blocks(journal_block(), fs.block, 1);
+}
+
+static EFI_STATUS write_last_group(void)
+{
+	UINT32 last = fs.groups - 1;
+
+	ZeroMem(fs.block, EXT4_BLOCK_SIZE);
+	set_bits(fs.block, 0, group_used(last));
+	set_bits(fs.block, group_blocks(last), EXT4_BLOCKS_PER_GROUP);
+	return write_blocks(group_meta(last), fs.block, 1);
+}
+
+EFI_STATUS ext4_mkfs(UINT64 size, UINT32 now)
+{
+	struct ext4_group_desc *gdt = NULL;
+	EFI_STATUS ret;
+	UINT32 group;
+
+	ret = layout(size);
+	if (EFI_ERROR(ret)) {
+		error(L"Cannot lay out an ext4 filesystem of %ld bytes", size);
+		return ret;
+	}
+
+	ret = generate_random_numbers(fs.uuid, sizeof(fs.uuid));
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to generate the filesystem UUID");
+		return ret;
+	}
+	/* Version 4 random UUID */
+	fs.uuid[6] = (fs.uuid[6] & 0x0F) | 0x40;
+	fs.uuid[8] = (fs.uuid[8] & 0x3F) | 0x80;
+	fs.now = now;
+	fs.pos = 0;
+
+	fs.block = AllocatePool(EXT4_BLOCK_SIZE);
+	gdt = AllocateZeroPool(fs.gdt_blocks * EXT4_BLOCK_SIZE);
+	if (!fs.block || !gdt) {
+		ret = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	for (group = 0; group < fs.groups; group++)
+		group_desc_init(&gdt[group], group);
+
+	debug(L"ext4: %d blocks, %d groups, %d inodes per group, %d journal blocks",
+	      fs.blocks, fs.groups, fs.inodes_per_group, fs.journal_blocks);
+
+	ret = write_super(0, gdt);
+	if (!EFI_ERROR(ret))
+		ret = write_first_group();
+
+	for (group = 1; !EFI_ERROR(ret) && group < fs.groups; group++) {
+		if (group_has_super(group))
+			ret = write_super(group, gdt);
+		if (!EFI_ERROR(ret) && group == fs.groups - 1)
+			ret = write_last_group();
+	}
+
+out:
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to write the ext4 filesystem");
+	if (gdt)
+		FreePool(gdt);
+	if (fs.block) {
+		FreePool(fs.block);
+		fs.block = NULL;
+	}
+	return ret;
+}
@@ -0,0 +1,563 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <fastboot.h>
+#include <transport.h>
+
+#include "timer.h"
+#include "uefi_utils.h"
+#include "async_io.h"
+#include "gpt.h"
+#include "storage.h"
+#include "perf.h"
+
+#define PERF_LABEL_LENGTH 12
+
+struct perf_record {
+	CHAR8 label[PERF_LABEL_LENGTH];
+	UINT64 rx_size;
+	UINT64 rx_ticks;
+	UINT64 io_size;
+	UINT64 io_ticks;
+	UINT64 flash_ticks;
+	UINT64 stalls;
+};
+
+static struct perf_record cur;
+static struct perf_record history[PERF_HISTORY];
+static UINTN history_count;
+static UINT64 rx_start, flash_start, io_start, stalls_start;
+
+void perf_download_start(UINTN size)
+{
+	cur.rx_size = size;
+	cur.rx_ticks = 0;
+	rx_start = timer_ticks();
+}
+
+void perf_download_end(void)
+{
+	if (!rx_start)
+		return;
+
+	cur.rx_ticks = timer_ticks() - rx_start;
+	rx_start = 0;
+}
+
+void perf_flash_start(CHAR16 *label)
+{
+	if (EFI_ERROR(str_to_stra(cur.label, label, sizeof(cur.label))))
+		cur.label[0] = '\0';
+	cur.io_size = cur.io_ticks = 0;
+	stalls_start = async_write_stalls();
+	flash_start = timer_ticks();
+}
+
+void perf_flash_end(void)
+{
+	if (!flash_start)
+		return;
+
+	cur.flash_ticks = timer_ticks() - flash_start;
+	cur.stalls = async_write_stalls() - stalls_start;
+	flash_start = 0;
+
+	history[history_count % PERF_HISTORY] = cur;
+	history_count++;
+	ZeroMem(&cur, sizeof(cur));
+}
+
+void perf_io_start(void)
+{
+	io_start = timer_ticks();
+}
+
+void perf_io_end(UINTN size)
+{
+	cur.io_ticks += timer_ticks() - io_start;
+	cur.io_size += size;
+}
+
+static UINT64 rate(UINT64 size, UINT64 ticks)
+{
+	UINT64 us = timer_ticks_to_us(ticks);
+
+	/* Bytes per microsecond are MB/s */
+	return us ? size / us : 0;
+}
+
+static char *record_value(UINTN n)
+{
+	static char value[MAGIC_LENGTH];
+	struct perf_record *r;
+	UINT64 flash_ms, io_ms;
+
+	if (n >= min(history_count, (UINTN)PERF_HISTORY))
+		return NULL;
+
+	r = &history[(history_count - 1 - n) % PERF_HISTORY];
+	flash_ms = timer_ticks_to_us(r->flash_ticks) / 1000;
+	io_ms = timer_ticks_to_us(r->io_ticks) / 1000;
+
+	snprintf((CHAR8 *)value, sizeof(value),
+		 (CHAR8 *)"%a rx=%ld wr=%ld MB/s cpu=%ld io=%ld ms st=%ld",
+		 r->label, rate(r->rx_size, r->rx_ticks),
+		 rate(r->io_size, r->io_ticks),
+		 flash_ms > io_ms ? flash_ms - io_ms : 0, io_ms, r->stalls);
+	return value;
+}
+
+static char *get_last_flash(void)
+{
+	return record_value(0);
+}
+
+static char *get_flash_record(const char *suffix)
+{
+	return record_value(strtoul(suffix, NULL, 10));
+}
+
+static char *get_transport_stats(void)
+{
+	static char value[MAGIC_LENGTH];
+	transport_stats_t stats;
+
+	if (EFI_ERROR(transport_get_stats(TRANSPORT_CURRENT, NULL, &stats)))
+		return "";
+
+	snprintf((CHAR8 *)value, sizeof(value),
+		 (CHAR8 *)"rx=%ld/%ld tx=%ld/%ld err=%ld rt=%ld ra=%ld",
+		 stats.rx_bytes, stats.rx_transfers, stats.tx_bytes,
+		 stats.tx_transfers, stats.errors, stats.retries, stats.rearms);
+	return value;
+}
+
+static char *get_transport_latency(const char *suffix)
+{
+	static char value[MAGIC_LENGTH];
+	transport_stats_t stats;
+	UINT32 *h;
+	UINTN class;
+
+	class = strtoul(suffix, NULL, 10);
+	if (class >= TRANSPORT_SIZE_CLASSES)
+		return NULL;
+
+	if (EFI_ERROR(transport_get_stats(TRANSPORT_CURRENT, NULL, &stats)))
+		return "";
+
+	h = stats.latency[class];
+	snprintf((CHAR8 *)value, sizeof(value), (CHAR8 *)"%d %d %d %d %d %d",
+		 h[0], h[1], h[2], h[3], h[4], h[5]);
+	return value;
+}
+
+/* Command latency, from the reception of the command to its final
+   response, by command: the partition is part of the flash and erase
+   keys, the sub-command of the oem ones.  The commands beyond
+   CMD_KEYS - 1 different keys are accounted as "other".  */
+#define CMD_KEYS 24
+#define CMD_KEY_LENGTH 24
+#define CMD_LINE_LENGTH 48
+#define CMD_WORST 8
+
+struct cmd_stats {
+	CHAR8 key[CMD_KEY_LENGTH];
+	UINT32 count;
+	UINT64 ticks;
+	UINT64 max_ticks;
+	UINT32 buckets[PERF_CMD_BUCKETS];
+};
+
+struct cmd_sample {
+	CHAR8 line[CMD_LINE_LENGTH];
+	UINT64 ticks;
+};
+
+static struct {
+	struct cmd_stats stats[CMD_KEYS];
+	UINTN nb;
+	struct cmd_sample worst[CMD_WORST];
+	UINTN nb_worst;
+	struct cmd_sample cur;
+	CHAR8 key[CMD_KEY_LENGTH];
+	UINT64 start;
+} cmds;
+
+/* The key is the command name, up to the first space for the flash
+   and erase commands and up to the second one for the oem commands.  */
+static void cmd_key(CHAR8 *key, const CHAR8 *line)
+{
+	UINTN i, spaces = 1;
+
+	if (!strncmp(line, (CHAR8 *)"oem ", 4))
+		spaces = 2;
+
+	for (i = 0; i < CMD_KEY_LENGTH - 1 && line[i]; i++) {
+		if (line[i] == ' ' && !--spaces)
+			break;
+		if (line[i] == ':' && strncmp(line, (CHAR8 *)"flash:", 6) &&
+		    strncmp(line, (CHAR8 *)"erase:", 6))
+			break;
+		key[i] = line[i];
+	}
+	key[i] = '\0';
+}
+
+void perf_cmd_start(const CHAR8 *line)
+{
+	strncpy(cmds.cur.line, line, sizeof(cmds.cur.line) - 1);
+	cmds.cur.line[sizeof(cmds.cur.line) - 1] = '\0';
+	cmd_key(cmds.key, line);
+	cmds.start = timer_ticks();
+}
+
+static struct cmd_stats *cmd_stats_get(const CHAR8 *key)
+{
+	struct cmd_stats *s;
+	UINTN i;
+
+	for (i = 0; i < cmds.nb; i++)
+		if (!strcmp(cmds.stats[i].key, key))
+			return &cmds.stats[i];
+
+	if (cmds.nb >= CMD_KEYS - 1) {
+		key = (CHAR8 *)"other";
+		for (i = 0; i < cmds.nb; i++)
+			if (!strcmp(cmds.stats[i].key, key))
+				return &cmds.stats[i];
+		if (cmds.nb == CMD_KEYS)
+			return &cmds.stats[CMD_KEYS - 1];
+	}
+
+	s = &cmds.stats[cmds.nb++];
+	strncpy(s->key, key, sizeof(s->key));
+	return s;
+}
+
+void perf_cmd_end(void)
+{
+	struct cmd_stats *s;
+	UINT64 ticks, us, limit;
+	UINTN b, i;
+
+	if (!cmds.start)
+		return;
+
+	ticks = timer_ticks() - cmds.start;
+	cmds.start = 0;
+
+	s = cmd_stats_get(cmds.key);
+	s->count++;
+	s->ticks += ticks;
+	s->max_ticks = max(s->max_ticks, ticks);
+	us = timer_ticks_to_us(ticks);
+	for (b = 0, limit = 100; b < PERF_CMD_BUCKETS - 1 && us >= limit; b++)
+		limit *= 10;
+	s->buckets[b]++;
+
+	/* The worst samples are kept from the slowest down */
+	for (i = cmds.nb_worst; i > 0 && cmds.worst[i - 1].ticks < ticks; i--)
+		if (i < CMD_WORST)
+			cmds.worst[i] = cmds.worst[i - 1];
+	if (i == CMD_WORST)
+		return;
+
+	cmds.worst[i] = cmds.cur;
+	cmds.worst[i].ticks = ticks;
+	cmds.nb_worst = min(cmds.nb_worst + 1, (UINTN)CMD_WORST);
+}
+
+void perf_cmd_report(void)
+{
+	struct cmd_stats *s;
+	UINT32 *h;
+	UINTN i;
+
+	fastboot_info("<100us <1ms <10ms <100ms <1s <10s more");
+	for (i = 0; i < cmds.nb; i++) {
+		s = &cmds.stats[i];
+		h = s->buckets;
+		fastboot_info("%a n=%d avg=%ld max=%ld ms", s->key, s->count,
+			      timer_ticks_to_us(s->ticks / s->count) / 1000,
+			      timer_ticks_to_us(s->max_ticks) / 1000);
+		fastboot_info("  %d %d %d %d %d %d %d",
+			      h[0], h[1], h[2], h[3], h[4], h[5], h[6]);
+	}
+
+	for (i = 0; i < cmds.nb_worst; i++)
+		fastboot_info("%ld ms %a",
+			      timer_ticks_to_us(cmds.worst[i].ticks) / 1000,
+			      cmds.worst[i].line);
+}
+
+/* Storage benchmark.  The latency of the synchronous operations is
+   sampled, one operation out of STRIDE, to compute the percentiles.  */
+#define BENCH_MAX_SAMPLES 4096
+
+static struct bench {
+	struct gpt_partition_interface gparti;
+	UINT64 size;
+	UINTN block_size;
+	VOID *buf;
+	UINT64 samples[BENCH_MAX_SAMPLES];
+	UINTN nb_samples;
+	UINTN stride;
+} bench;
+
+typedef EFI_STATUS (*bench_op_t)(EFI_LBA lba, UINTN size);
+
+static EFI_STATUS diskio_write(EFI_LBA lba, UINTN size)
+{
+	EFI_DISK_IO *dio = bench.gparti.dio;
+	EFI_BLOCK_IO *bio = bench.gparti.bio;
+
+	return uefi_call_wrapper(dio->WriteDisk, 5, dio, bio->Media->MediaId,
+				 lba * bio->Media->BlockSize, size, bench.buf);
+}
+
+static EFI_STATUS diskio_read(EFI_LBA lba, UINTN size)
+{
+	EFI_DISK_IO *dio = bench.gparti.dio;
+	EFI_BLOCK_IO *bio = bench.gparti.bio;
+
+	return uefi_call_wrapper(dio->ReadDisk, 5, dio, bio->Media->MediaId,
+				 lba * bio->Media->BlockSize, size, bench.buf);
+}
+
+static EFI_STATUS blockio_write(EFI_LBA lba, UINTN size)
+{
+	EFI_BLOCK_IO *bio = bench.gparti.bio;
+
+	return uefi_call_wrapper(bio->WriteBlocks, 5, bio, bio->Media->MediaId,
+				 lba, size, bench.buf);
+}
+
+static EFI_STATUS blockio_read(EFI_LBA lba, UINTN size)
+{
+	EFI_BLOCK_IO *bio = bench.gparti.bio;
+
+	return uefi_call_wrapper(bio->ReadBlocks, 5, bio, bio->Media->MediaId,
+				 lba, size, bench.buf);
+}
+
+static EFI_STATUS blockio2_write(EFI_LBA lba, UINTN size)
+{
+	return async_write_blocks(bench.gparti.bio, lba, size, bench.buf, FALSE);
+}
+
+static void sort_samples(UINT64 *samples, UINTN nb)
+{
+	UINTN gap, i, j;
+	UINT64 tmp;
+
+	for (gap = nb / 2; gap; gap /= 2)
+		for (i = gap; i < nb; i++) {
+			tmp = samples[i];
+			for (j = i; j >= gap && samples[j - gap] > tmp; j -= gap)
+				samples[j] = samples[j - gap];
+			samples[j] = tmp;
+		}
+}
+
+static void bench_report(const char *name, UINT64 ticks)
+{
+	UINT64 *s = bench.samples;
+	UINTN n = bench.nb_samples;
+
+	if (!n) {
+		fastboot_info("%a: %ld MB/s", name, rate(bench.size, ticks));
+		return;
+	}
+
+	sort_samples(s, n);
+	fastboot_info("%a: %ld MB/s p50=%ld p90=%ld p99=%ld max=%ld us", name,
+		      rate(bench.size, ticks), s[n / 2], s[n * 9 / 10],
+		      s[n * 99 / 100], s[n - 1]);
+}
+
+static EFI_STATUS bench_run(bench_op_t op, BOOLEAN sampled, UINT64 *ticks)
+{
+	UINT32 block_size = bench.gparti.bio->Media->BlockSize;
+	UINT64 offset, start, total = 0, t;
+	UINTN len, i;
+	EFI_STATUS ret;
+
+	bench.nb_samples = 0;
+	for (offset = 0, i = 0; offset < bench.size; offset += len, i++) {
+		len = min((UINT64)bench.block_size, bench.size - offset);
+
+		start = timer_ticks();
+		ret = op(bench.gparti.part.starting_lba + offset / block_size, len);
+		t = timer_ticks() - start;
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Benchmark operation failed at %ld", offset);
+			return ret;
+		}
+
+		total += t;
+		if (sampled && i % bench.stride == 0 && bench.nb_samples < BENCH_MAX_SAMPLES)
+			bench.samples[bench.nb_samples++] = timer_ticks_to_us(t);
+	}
+
+	*ticks = total;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS bench_blockio2(UINTN depth)
+{
+	UINT64 start, stalls, ticks;
+	EFI_STATUS ret, ret_close;
+
+	ret = async_write_open_depth(bench.gparti.bio, depth);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!async_write_active(bench.gparti.bio)) {
+		async_write_close();
+		fastboot_info("blockio2 write: not supported");
+		return EFI_SUCCESS;
+	}
+
+	stalls = async_write_stalls();
+	start = timer_ticks();
+	ret = bench_run(blockio2_write, FALSE, &ticks);
+	ret_close = async_write_close();
+	if (EFI_ERROR(ret) || EFI_ERROR(ret_close))
+		return EFI_ERROR(ret) ? ret : ret_close;
+
+	/* The Block IO2 writes complete on close */
+	bench_report("blockio2 write", timer_ticks() - start);
+	fastboot_info("blockio2 write: qd=%d stalls=%ld", depth,
+		      async_write_stalls() - stalls);
+	return EFI_SUCCESS;
+}
+
+static void bench_erase(void)
+{
+	UINT32 block_size = bench.gparti.bio->Media->BlockSize;
+	UINT64 start, t;
+	EFI_STATUS ret;
+
+	start = timer_ticks();
+	ret = storage_erase_blocks(bench.gparti.handle, bench.gparti.bio,
+				   bench.gparti.part.starting_lba,
+				   bench.gparti.part.starting_lba + bench.size / block_size - 1);
+	t = timer_ticks() - start;
+	if (EFI_ERROR(ret)) {
+		fastboot_info("erase: not supported, %r", ret);
+		return;
+	}
+
+	bench.nb_samples = 1;
+	bench.samples[0] = timer_ticks_to_us(t);
+	bench_report("erase", t);
+}
+
+EFI_STATUS perf_storage_bench(CHAR16 *label, UINT64 size, UINTN block_size,
+			      UINTN depth)
+{
+	static const struct {
+		const char *name;
+		bench_op_t op;
+	} SYNC_OPS[] = {
+		{ "diskio write", diskio_write },
+		{ "diskio read", diskio_read },
+		{ "blockio write", blockio_write },
+		{ "blockio read", blockio_read }
+	};
+	UINT32 media_block_size;
+	UINT64 part_size, ticks;
+	VOID *free_addr;
+	EFI_STATUS ret;
+	UINTN i;
+
+	ret = gpt_get_partition_by_label(label, &bench.gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	media_block_size = bench.gparti.bio->Media->BlockSize;
+	part_size = (bench.gparti.part.ending_lba + 1 - bench.gparti.part.starting_lba)
+		* media_block_size;
+	if (!size || !block_size || block_size % media_block_size
+	    || size % media_block_size || size > part_size)
+		return EFI_INVALID_PARAMETER;
+
+	bench.size = size;
+	bench.block_size = block_size;
+	bench.stride = DIV_ROUND_UP(DIV_ROUND_UP(size, block_size), BENCH_MAX_SAMPLES);
+
+	ret = alloc_aligned(&free_addr, &bench.buf, block_size,
+			    bench.gparti.bio->Media->IoAlign);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	fastboot_info("%s: %ld bytes by %d bytes", label, size, block_size);
+	for (i = 0; i < ARRAY_SIZE(SYNC_OPS); i++) {
+		ret = bench_run(SYNC_OPS[i].op, TRUE, &ticks);
+		if (EFI_ERROR(ret))
+			goto out;
+		bench_report(SYNC_OPS[i].name, ticks);
+	}
+
+	ret = bench_blockio2(depth);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	bench_erase();
+
+out:
+	FreePool(free_addr);
+	return ret;
+}
+
+EFI_STATUS perf_publish(void)
+{
+	EFI_STATUS ret;
+
+	ret = fastboot_publish_dynamic("perf-last-flash", get_last_flash);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = fastboot_publish_dynamic("transport-stats", get_transport_stats);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = fastboot_publish_prefix("transport-latency:", get_transport_latency);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return fastboot_publish_prefix("perf-flash:", get_flash_record);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _PERF_H_
+#define _PERF_H_
+
+#include <efi.h>
+
+/* Download and flash throughput statistics.  A record covers a
+   download and the flash command that follows, the last PERF_HISTORY
+   records are published as the "perf-last-flash" and
+   "perf-flash:<n>" variables.  The statistics of the transport in use
+   are published as "transport-stats" and "transport-latency:<n>".  */
+#define PERF_HISTORY 8
+
+void perf_download_start(UINTN size);
+void perf_download_end(void);
+void perf_flash_start(CHAR16 *label);
+void perf_flash_end(void);
+void perf_io_start(void);
+void perf_io_end(UINTN size);
+EFI_STATUS perf_publish(void);
+
+/* Latency of each command, from LINE reception to its final OKAY or
+   FAIL response, in histograms of PERF_CMD_BUCKETS decades from
+   100us, along with the slowest command lines.  perf_cmd_report()
+   sends them as fastboot INFO lines.  */
+#define PERF_CMD_BUCKETS 7
+
+void perf_cmd_start(const CHAR8 *line);
+void perf_cmd_end(void);
+void perf_cmd_report(void);
+
+/* Measure the sequential write and read throughput and latency of the
+   first SIZE bytes of the LABEL partition through the Disk IO, Block
+   IO and Block IO2 (up to DEPTH writes in flight) protocols, and the
+   storage erase.  The results are reported as fastboot INFO lines.
+   The partition content is destroyed.  */
+EFI_STATUS perf_storage_bench(CHAR16 *label, UINT64 size, UINTN block_size,
+			      UINTN depth);
+
+#endif	/* _PERF_H_ */
@@ -36,17 +36,24 @@
 #include <efilib.h>
 #include <lib.h>
 #include "uefi_utils.h"
+#include "crc32.h"
 
 #include "flash.h"
+#include "arena.h"
+#include "memstat.h"
 #include "sparse_format.h"
+#include "sparse.h"
 
 /* Hunks buffer size.  */
 static const unsigned int BUFFER_SIZE = 10 * 1024 * 1024;
-/* Hunks that are larger than this threshold won't be buffered.  This
-   threshold MUST be smaller than the buffer size.  */
-static const unsigned int HUNK_SIZE_THRESHOLD = 1024 * 1024;
-static void *buffer;
+static void *buffer, *buffer_free_addr;
 static unsigned int cur_size;
+/* Adapted to the target write granule by init_buffer().  The RAW and
+   FILL hunks up to HUNK_THRESHOLD bytes are coalesced in the buffer.
+   Once BUFFER_LIMIT, a multiple of the granule at least twice as
+   large, is reached the buffer is written up to the last granule
+   boundary.  */
+static UINTN granule, hunk_threshold, buffer_limit;
 
 BOOLEAN is_sparse_image(void *data, UINT64 size)
 {
@@ -57,10 +64,10 @@ BOOLEAN is_sparse_image(void *data, UINT64 size)
 
 	sph = data;
 
-	debug(L"sparse header : magic %08x, major %d, minor %d, fdhrsz %d, chdrsz %d, bz %d",
+	log_verbose(FASTBOOT, L"sparse header : magic %08x, major %d, minor %d, fdhrsz %d, chdrsz %d, bz %d",
 	      sph->magic, sph->major_version, sph->minor_version,
 	      sph->file_hdr_sz, sph->chunk_hdr_sz, sph->blk_sz);
-	debug(L"tot blk %d, tot chk %d", sph->total_blks, sph->total_chunks);
+	log_verbose(FASTBOOT, L"tot blk %d, tot chk %d", sph->total_blks, sph->total_chunks);
 
 	if (sph->magic != SPARSE_HEADER_MAGIC)
 		return FALSE;
@@ -71,16 +78,33 @@ BOOLEAN is_sparse_image(void *data, UINT64 size)
 	if (sph->chunk_hdr_sz < sizeof(struct chunk_header))
 		return FALSE;
 
-	debug(L"Found a valid sparse image");
+	log_debug(FASTBOOT, L"Found a valid sparse image");
 	return TRUE;
 }
 
 static EFI_STATUS init_buffer()
 {
-	buffer = AllocatePool(BUFFER_SIZE);
-	if (!buffer) {
+	EFI_STATUS ret;
+
+	granule = flash_write_granule();
+	hunk_threshold = granule;
+	buffer_limit = BUFFER_SIZE / granule * granule;
+
+	/* Aligned for flash_write() to use the BlockIo fast path */
+	buffer_free_addr = NULL;
+	buffer = arena_alloc(BUFFER_SIZE, flash_io_align());
+	if (buffer) {
+		cur_size = 0;
+		return EFI_SUCCESS;
+	}
+
+	ret = alloc_aligned(&buffer_free_addr, &buffer, BUFFER_SIZE,
+			    flash_io_align());
+	memstat_alloc(MEMSTAT_SPARSE, BUFFER_SIZE, !EFI_ERROR(ret));
+	if (EFI_ERROR(ret)) {
 		error(L"Allocation failed, sparse file buffer is disabled");
-		return EFI_OUT_OF_RESOURCES;
+		buffer = NULL;
+		return ret;
 	}
 
 	cur_size = 0;
@@ -92,19 +116,56 @@ static void free_buffer()
 	if (!buffer)
 		return;
 
-	FreePool(buffer);
+	if (buffer_free_addr) {
+		FreePool(buffer_free_addr);
+		memstat_free(MEMSTAT_SPARSE, BUFFER_SIZE);
+	} else
+		arena_free(buffer);
 	buffer = NULL;
 }
 
+/* Write the buffered hunks.  Unless ALL is set, the write ends on
+   the last granule boundary and the bytes beyond are kept at the
+   beginning of the buffer.  */
+static EFI_STATUS write_buffer(BOOLEAN all)
+{
+	UINT64 start = flash_tell(), end;
+	UINTN len = cur_size;
+	EFI_STATUS ret;
+
+	if (!buffer || !cur_size) {
+		cur_size = 0;
+		return EFI_SUCCESS;
+	}
+
+	end = (start + cur_size) & ~((UINT64)granule - 1);
+	if (!all && end > start)
+		len = end - start;
+
+	ret = flash_write(buffer, len);
+	if (EFI_ERROR(ret)) {
+		cur_size = 0;
+		return ret;
+	}
+
+	cur_size -= len;
+	if (cur_size)
+		CopyMem(buffer, buffer + len, cur_size);
+	return EFI_SUCCESS;
+}
+
 static EFI_STATUS flush_buffer()
 {
-	EFI_STATUS ret = EFI_SUCCESS;
+	return write_buffer(TRUE);
+}
 
-	if (buffer && cur_size != 0)
-		ret = flash_write(buffer, cur_size);
+/* Make room for SIZE bytes in the buffer.  */
+static EFI_STATUS reserve_buffer(UINTN size)
+{
+	if (size + cur_size <= buffer_limit)
+		return EFI_SUCCESS;
 
-	cur_size = 0;
-	return ret;
+	return write_buffer(FALSE);
 }
 
 static EFI_STATUS flash_raw_data(void *data, unsigned size)
@@ -114,94 +175,703 @@ static EFI_STATUS flash_raw_data(void *data, unsigned size)
 	if (!buffer)
 		return flash_write(data, size);
 
-	if (size > HUNK_SIZE_THRESHOLD) {
+	if (size > hunk_threshold) {
 		ret = flush_buffer();
 		if (EFI_ERROR(ret))
 			return ret;
 		return flash_write(data, size);
 	}
 
-	if (size + cur_size > BUFFER_SIZE) {
+	ret = reserve_buffer(size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	memcpy(buffer + cur_size, data, size);
+	cur_size += size;
+
+	return EFI_SUCCESS;
+}
+
+/* A short FILL hunk is written in the buffer so that the RAW hunks
+   around it are merged into the same write.  */
+static EFI_STATUS flash_fill_data(UINT32 pattern, UINT64 size)
+{
+	CHAR8 *cur;
+	UINTN done;
+	EFI_STATUS ret;
+
+	if (!buffer || size > hunk_threshold) {
 		ret = flush_buffer();
 		if (EFI_ERROR(ret))
 			return ret;
+		return flash_fill(pattern, size);
 	}
 
-	memcpy(buffer + cur_size, data, size);
+	ret = reserve_buffer(size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	cur = (CHAR8 *)buffer + cur_size;
+	if (!pattern)
+		SetMem(cur, size, 0);
+	else {
+		memcpy(cur, &pattern, sizeof(pattern));
+		for (done = sizeof(pattern); done < size; done *= 2)
+			memcpy(cur + done, cur, min(done, (UINTN)size - done));
+	}
 	cur_size += size;
 
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS flash_chunk(struct sparse_header *sph, struct chunk_header *ckh, CHAR8 *data, unsigned int size)
+/* Sparse image parser state.  The parser accepts the image in
+   arbitrary sized pieces so that it can be fed either with a
+   complete image or with the data as it is received.  */
+static struct sparse_stream {
+	enum {
+		SPARSE_FILE_HEADER,
+		SPARSE_CHUNK_HEADER,
+		SPARSE_CHUNK_DATA,
+		SPARSE_DONE,
+		SPARSE_ERROR
+	} state;
+	struct sparse_header sph;
+	struct chunk_header ckh;
+	/* Number of bytes of the current header already received */
+	UINTN hdr_len;
+	/* Number of data bytes remaining in the current chunk */
+	UINT64 data_len;
+	UINT32 chunk;
+	/* 32 bits value of FILL and CRC32 chunks */
+	UINT32 word;
+	UINTN word_len;
+	/* CRC32 of the image produced so far */
+	UINT32 crc;
+	/* Blocks covered by the chunks started so far */
+	UINT64 blocks;
+} stream;
+
+/* Check the image described by the file header fits in MAX_SIZE
+   bytes.  */
+static EFI_STATUS check_file_header(struct sparse_header *sph, UINT64 max_size)
 {
-	EFI_STATUS ret;
+	UINT64 size;
+
+	if (!sph->blk_sz || sph->blk_sz % sizeof(UINT32)) {
+		error(L"invalid sparse block size %d", sph->blk_sz);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	size = (UINT64)sph->total_blks * sph->blk_sz;
+	if (size > max_size) {
+		error(L"sparse image too large, %ld bytes for %ld available",
+		      size, max_size);
+		return EFI_BAD_BUFFER_SIZE;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Check the chunk header CKH against the file header, BLOCKS is the
+   number of blocks covered by the previous chunks.  */
+static EFI_STATUS check_chunk(struct sparse_header *sph, struct chunk_header *ckh,
+			      UINT64 blocks)
+{
+	UINT64 size;
+
+	if (ckh->total_sz < sph->chunk_hdr_sz) {
+		error(L"sparse chunk malformated, %d, %d", ckh->total_sz, sph->chunk_hdr_sz);
+		return EFI_INVALID_PARAMETER;
+	}
+	size = ckh->total_sz - sph->chunk_hdr_sz;
+
+	if (blocks + ckh->chunk_sz > sph->total_blks) {
+		error(L"sparse chunks exceed the image size of %d blocks",
+		      sph->total_blks);
+		return EFI_INVALID_PARAMETER;
+	}
 
 	switch (ckh->chunk_type) {
 	case CHUNK_TYPE_RAW:
-		if (size % sph->blk_sz || size != ckh->chunk_sz * sph->blk_sz) {
+		if (size % sph->blk_sz || size != (UINT64)ckh->chunk_sz * sph->blk_sz) {
 			error(L"inconsistent raw chunk");
 			return EFI_INVALID_PARAMETER;
 		}
-		return flash_raw_data(data, size);
+		return EFI_SUCCESS;
 	case CHUNK_TYPE_DONT_CARE:
-		ret = flush_buffer();
-		if (EFI_ERROR(ret))
-			return ret;
-		return flash_skip(ckh->chunk_sz * sph->blk_sz);
+		return EFI_SUCCESS;
 	case CHUNK_TYPE_FILL:
+		if (size < sizeof(UINT32)) {
+			error(L"fill chunk truncated");
+			return EFI_INVALID_PARAMETER;
+		}
+		return EFI_SUCCESS;
+	case CHUNK_TYPE_CRC32:
+		if (size != sizeof(UINT32)) {
+			error(L"inconsistent crc32 chunk");
+			return EFI_INVALID_PARAMETER;
+		}
+		return EFI_SUCCESS;
+	default:
+		error(L"Unknow chunk type %04x", ckh->chunk_type);
+		return EFI_INVALID_PARAMETER;
+	}
+}
+
+static EFI_STATUS start_chunk(struct sparse_header *sph, struct chunk_header *ckh)
+{
+	EFI_STATUS ret;
+	UINT64 size;
+
+	ret = check_chunk(sph, ckh, stream.blocks);
+	if (EFI_ERROR(ret))
+		return ret;
+	stream.blocks += ckh->chunk_sz;
+
+	switch (ckh->chunk_type) {
+	case CHUNK_TYPE_DONT_CARE:
 		ret = flush_buffer();
 		if (EFI_ERROR(ret))
 			return ret;
-		return flash_fill(*((UINT32 *) data), ckh->chunk_sz * sph->blk_sz);
+		/* Skipped blocks count as zeroes in the image CRC32 */
+		size = (UINT64)ckh->chunk_sz * sph->blk_sz;
+		stream.crc = crc32_fill(stream.crc, 0, size);
+		return flash_skip(size);
+	default:
+		return EFI_SUCCESS;
+	}
+}
+
+/* Collect the 32 bits value starting the chunk data.  Return TRUE
+   once it is complete, only once per chunk.  */
+static BOOLEAN collect_word(CHAR8 *data, UINTN size)
+{
+	UINTN len;
+
+	if (stream.word_len == sizeof(stream.word))
+		return FALSE;
+
+	len = min(size, sizeof(stream.word) - stream.word_len);
+	memcpy((CHAR8 *)&stream.word + stream.word_len, data, len);
+	stream.word_len += len;
+
+	return stream.word_len == sizeof(stream.word);
+}
+
+static EFI_STATUS flash_chunk_data(struct sparse_header *sph, struct chunk_header *ckh,
+				   CHAR8 *data, UINTN size)
+{
+	UINT64 len;
+
+	switch (ckh->chunk_type) {
+	case CHUNK_TYPE_RAW:
+		stream.crc = crc32_update(stream.crc, data, size);
+		return flash_raw_data(data, size);
+	case CHUNK_TYPE_FILL:
+		if (!collect_word(data, size))
+			return EFI_SUCCESS;
+		len = (UINT64)ckh->chunk_sz * sph->blk_sz;
+		stream.crc = crc32_fill(stream.crc, stream.word, len);
+		return flash_fill_data(stream.word, len);
 	case CHUNK_TYPE_CRC32:
-		debug(L"crc chunk not implemented yet %d", size);
-		break;
+		if (!collect_word(data, size))
+			return EFI_SUCCESS;
+		if (stream.word != stream.crc) {
+			error(L"sparse image CRC32 mismatch, expected 0x%08x, got 0x%08x",
+			      stream.word, stream.crc);
+			return EFI_CRC_ERROR;
+		}
+		return EFI_SUCCESS;
 	default:
-		error(L"Unknow chunk type %04x", ckh->chunk_type);
-		return EFI_INVALID_PARAMETER;
+		/* DONT_CARE chunk data is ignored */
+		return EFI_SUCCESS;
+	}
+}
+
+/* Copy up to SIZE bytes of DATA into the HDR structure of HDR_SIZE
+   bytes.  The header is TOTAL_SIZE bytes long in the image, the bytes
+   beyond HDR_SIZE are skipped.  Return the number of bytes
+   consumed.  */
+static UINTN collect_header(void *hdr, UINTN hdr_size, UINTN total_size,
+			    CHAR8 *data, UINTN size)
+{
+	UINTN len = min(size, total_size - stream.hdr_len);
+
+	if (stream.hdr_len < hdr_size)
+		memcpy((CHAR8 *)hdr + stream.hdr_len, data,
+		       min(len, hdr_size - stream.hdr_len));
+	stream.hdr_len += len;
+
+	return len;
+}
+
+static void next_chunk(void)
+{
+	stream.hdr_len = 0;
+	if (++stream.chunk == stream.sph.total_chunks)
+		stream.state = SPARSE_DONE;
+	else
+		stream.state = SPARSE_CHUNK_HEADER;
+}
+
+static EFI_STATUS sparse_stream_parse(CHAR8 *s, UINTN size)
+{
+	struct sparse_header *sph = &stream.sph;
+	struct chunk_header *ckh = &stream.ckh;
+	UINTN len, total;
+	EFI_STATUS ret;
+
+	while (size && stream.state != SPARSE_DONE) {
+		switch (stream.state) {
+		case SPARSE_FILE_HEADER:
+			total = sizeof(*sph);
+			if (stream.hdr_len >= sizeof(*sph))
+				total = sph->file_hdr_sz;
+			len = collect_header(sph, sizeof(*sph), total, s, size);
+			if (stream.hdr_len < sizeof(*sph))
+				break;
+			if (total == sizeof(*sph)) {
+				if (!is_sparse_image(sph, sizeof(*sph)))
+					return EFI_INVALID_PARAMETER;
+				/* Refuse an image larger than the partition
+				   before any of it is written.  */
+				ret = check_file_header(sph, flash_space());
+				if (EFI_ERROR(ret))
+					return ret;
+			}
+			if (stream.hdr_len == sph->file_hdr_sz) {
+				stream.hdr_len = 0;
+				stream.state = sph->total_chunks ?
+					SPARSE_CHUNK_HEADER : SPARSE_DONE;
+			}
+			break;
+
+		case SPARSE_CHUNK_HEADER:
+			len = collect_header(ckh, sizeof(*ckh), sph->chunk_hdr_sz, s, size);
+			if (stream.hdr_len != sph->chunk_hdr_sz)
+				break;
+
+			ret = start_chunk(sph, ckh);
+			if (EFI_ERROR(ret))
+				return ret;
+
+			stream.word_len = 0;
+			stream.data_len = ckh->total_sz - sph->chunk_hdr_sz;
+			if (stream.data_len)
+				stream.state = SPARSE_CHUNK_DATA;
+			else
+				next_chunk();
+			break;
+
+		case SPARSE_CHUNK_DATA:
+			len = min((UINT64)size, stream.data_len);
+			ret = flash_chunk_data(sph, ckh, s, len);
+			if (EFI_ERROR(ret))
+				return ret;
+
+			stream.data_len -= len;
+			if (!stream.data_len)
+				next_chunk();
+			break;
+
+		default:
+			return EFI_ABORTED;
+		}
+
+		s += len;
+		size -= len;
 	}
+
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS flash_sparse(void *data, UINT64 size)
+EFI_STATUS sparse_stream_start(void)
+{
+	ZeroMem(&stream, sizeof(stream));
+	stream.state = SPARSE_FILE_HEADER;
+	init_buffer();
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS sparse_stream_write(void *data, UINTN size)
+{
+	EFI_STATUS ret;
+
+	if (stream.state == SPARSE_ERROR)
+		return EFI_ABORTED;
+
+	ret = sparse_stream_parse(data, size);
+	if (EFI_ERROR(ret))
+		stream.state = SPARSE_ERROR;
+
+	return ret;
+}
+
+EFI_STATUS sparse_stream_end(void)
 {
-	struct sparse_header *sph;
-	CHAR8 *s;
-	UINT64 rlen;
-	unsigned int i;
 	EFI_STATUS ret_flush_buffer, ret = EFI_SUCCESS;
 
-	rlen = size;
-	s = data;
-	sph = data;
-	s += sph->file_hdr_sz;
+	if (stream.state == SPARSE_ERROR)
+		ret = EFI_ABORTED;
+	else if (stream.state != SPARSE_DONE) {
+		error(L"sparse image truncated, %d/%d chunks",
+		      stream.chunk, stream.sph.total_chunks);
+		ret = EFI_INVALID_PARAMETER;
+	}
 
-	init_buffer();
+	ret_flush_buffer = flush_buffer();
+	free_buffer();
+	return EFI_ERROR(ret) ? ret : ret_flush_buffer;
+}
 
-	for (i = 0; i < sph->total_chunks; i++) {
-		struct chunk_header *ckh;
-		ckh = (struct chunk_header *) s;
+EFI_STATUS flash_sparse(void *data, UINT64 size)
+{
+	EFI_STATUS ret, ret_end;
 
-		if (rlen < sph->chunk_hdr_sz || rlen < ckh->total_sz) {
-			error(L"sparse chunk truncated, %ld, %ld", rlen, size);
-			ret = EFI_INVALID_PARAMETER;
-			break;
+	sparse_stream_start();
+	ret = sparse_stream_write(data, size);
+	ret_end = sparse_stream_end();
+
+	return EFI_ERROR(ret) ? ret : ret_end;
+}
+
+/* Header checker state.  */
+static struct {
+	UINT64 size;		/* image size */
+	UINT64 offset;		/* offset of the next header */
+	UINT64 blocks;
+	UINT32 chunk;
+	BOOLEAN done;
+	struct sparse_header sph;
+} check;
+
+void sparse_check_start(UINT64 size)
+{
+	ZeroMem(&check, sizeof(check));
+	check.size = size;
+}
+
+EFI_STATUS sparse_check_update(void *data, UINT64 len)
+{
+	struct sparse_header *sph = &check.sph;
+	struct chunk_header ckh;
+	EFI_STATUS ret;
+
+	if (check.done)
+		return EFI_SUCCESS;
+
+	if (!check.offset) {
+		if (len < sizeof(*sph))
+			return EFI_SUCCESS;
+		memcpy(sph, data, sizeof(*sph));
+		if (!is_sparse_image(sph, sizeof(*sph))) {
+			/* Not a sparse image, nothing to check.  */
+			check.done = TRUE;
+			return EFI_SUCCESS;
+		}
+		ret = check_file_header(sph, (UINT64)-1);
+		if (EFI_ERROR(ret))
+			return ret;
+		check.offset = sph->file_hdr_sz;
+	}
+
+	while (check.chunk < sph->total_chunks &&
+	       check.offset + sph->chunk_hdr_sz <= len) {
+		memcpy(&ckh, (CHAR8 *)data + check.offset, sizeof(ckh));
+		ret = check_chunk(sph, &ckh, check.blocks);
+		if (EFI_ERROR(ret))
+			return ret;
+
+		check.offset += ckh.total_sz;
+		if (check.offset > check.size) {
+			error(L"sparse chunk %d ends beyond the image, at %ld/%ld",
+			      check.chunk, check.offset, check.size);
+			return EFI_INVALID_PARAMETER;
 		}
-		if (ckh->total_sz < sph->chunk_hdr_sz) {
-			error(L"sparse chunk malformated, %d, %d", ckh->total_sz, sph->chunk_hdr_sz);
-			ret = EFI_INVALID_PARAMETER;
+		check.blocks += ckh.chunk_sz;
+		check.chunk++;
+	}
+
+	if (check.chunk == sph->total_chunks)
+		check.done = TRUE;
+
+	return EFI_SUCCESS;
+}
+
+static void fill_words(CHAR8 *out, UINT32 word, UINT64 size)
+{
+	UINT32 *p = (UINT32 *)out;
+	UINT64 i;
+
+	if (!word) {
+		memset(out, 0, size);
+		return;
+	}
+
+	for (i = 0; i < size / sizeof(word); i++)
+		p[i] = word;
+}
+
+/* The CRC32 of the expanded image is only computed if it is
+   checked.  */
+static BOOLEAN has_crc32_chunk(CHAR8 *data, UINT64 size)
+{
+	struct sparse_header *sph = (struct sparse_header *)data;
+	struct chunk_header ckh;
+	UINT64 offset = sph->file_hdr_sz;
+	UINT32 chunk;
+
+	for (chunk = 0; chunk < sph->total_chunks; chunk++) {
+		if (offset + sizeof(ckh) > size)
 			break;
+		memcpy(&ckh, data + offset, sizeof(ckh));
+		if (ckh.chunk_type == CHUNK_TYPE_CRC32)
+			return TRUE;
+		offset += ckh.total_sz;
+	}
+
+	return FALSE;
+}
+
+/* Walk the chunks of the complete sparse image DATA.  If OUT is NULL,
+   only compute in END the size of the image without its trailing
+   DONT_CARE blocks.  Otherwise, expand the first END bytes of the
+   image in OUT.  */
+static EFI_STATUS expand(CHAR8 *data, UINT64 size, CHAR8 *out, UINT64 *end,
+			 sparse_expand_cb_t cb, void *ctx)
+{
+	struct sparse_header *sph = (struct sparse_header *)data;
+	struct chunk_header ckh;
+	UINT64 offset, pos = 0, blocks = 0, len;
+	UINT32 chunk, word, crc = 0;
+	BOOLEAN check_crc;
+	CHAR8 *payload;
+	EFI_STATUS ret;
+
+	ret = check_file_header(sph, (UINT64)-1);
+	if (EFI_ERROR(ret))
+		return ret;
+	check_crc = out && has_crc32_chunk(data, size);
+
+	offset = sph->file_hdr_sz;
+	for (chunk = 0; chunk < sph->total_chunks; chunk++) {
+		if (offset + sph->chunk_hdr_sz > size) {
+			error(L"sparse image truncated, %d/%d chunks",
+			      chunk, sph->total_chunks);
+			return EFI_INVALID_PARAMETER;
 		}
-		ret = flash_chunk(sph, ckh, s + sph->chunk_hdr_sz, ckh->total_sz - sph->chunk_hdr_sz);
+		memcpy(&ckh, data + offset, sizeof(ckh));
+		ret = check_chunk(sph, &ckh, blocks);
 		if (EFI_ERROR(ret))
+			return ret;
+		if (offset + ckh.total_sz > size) {
+			error(L"sparse chunk %d ends beyond the image", chunk);
+			return EFI_INVALID_PARAMETER;
+		}
+
+		payload = data + offset + sph->chunk_hdr_sz;
+		offset += ckh.total_sz;
+		blocks += ckh.chunk_sz;
+		len = (UINT64)ckh.chunk_sz * sph->blk_sz;
+
+		if (ckh.chunk_type == CHUNK_TYPE_CRC32) {
+			memcpy(&word, payload, sizeof(word));
+			if (out && word != crc) {
+				error(L"sparse image CRC32 mismatch, expected 0x%08x, got 0x%08x",
+				      word, crc);
+				return EFI_CRC_ERROR;
+			}
+			continue;
+		}
+
+		if (!out) {
+			if (ckh.chunk_type != CHUNK_TYPE_DONT_CARE)
+				*end = pos + len;
+			pos += len;
+			continue;
+		}
+
+		/* Only the skipped blocks before the end are written */
+		len = min(len, *end - min(pos, *end));
+		switch (ckh.chunk_type) {
+		case CHUNK_TYPE_RAW:
+			memcpy(out + pos, payload, len);
+			if (check_crc)
+				crc = crc32_update(crc, out + pos, len);
+			break;
+		case CHUNK_TYPE_FILL:
+			memcpy(&word, payload, sizeof(word));
+			fill_words(out + pos, word, len);
+			if (check_crc)
+				crc = crc32_fill(crc, word, len);
 			break;
+		default:
+			memset(out + pos, 0, len);
+			if (check_crc)
+				crc = crc32_fill(crc, 0, (UINT64)ckh.chunk_sz * sph->blk_sz);
+			break;
+		}
+		if (cb && len)
+			cb(out + pos, len, ctx);
+		pos += (UINT64)ckh.chunk_sz * sph->blk_sz;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS sparse_expanded_size(void *data, UINT64 size, UINT64 *out_size)
+{
+	if (!is_sparse_image(data, size))
+		return EFI_INVALID_PARAMETER;
 
-		s += ckh->total_sz;
-		rlen -= ckh->total_sz;
+	*out_size = 0;
+	return expand(data, size, NULL, out_size, NULL, NULL);
+}
+
+EFI_STATUS sparse_expand(void *data, UINT64 size, void *out, UINT64 out_size,
+			 sparse_expand_cb_t cb, void *ctx)
+{
+	if (!is_sparse_image(data, size) || !out)
+		return EFI_INVALID_PARAMETER;
+
+	return expand(data, size, out, &out_size, cb, ctx);
+}
+
+EFI_STATUS sparse_encode_start(struct sparse_encoder *enc, void *buf,
+			       UINTN size, UINT32 blk_sz)
+{
+	struct sparse_header *sph = buf;
+
+	if (size < sizeof(*sph) || !blk_sz || blk_sz % sizeof(UINT32))
+		return EFI_INVALID_PARAMETER;
+
+	memset(sph, 0, sizeof(*sph));
+	sph->magic = SPARSE_HEADER_MAGIC;
+	sph->major_version = 0x1;
+	sph->file_hdr_sz = sizeof(*sph);
+	sph->chunk_hdr_sz = sizeof(struct chunk_header);
+	sph->blk_sz = blk_sz;
+
+	enc->buf = buf;
+	enc->size = size;
+	enc->used = sizeof(*sph);
+	enc->last = NULL;
+
+	return EFI_SUCCESS;
+}
+
+/* Extend the last chunk if it has the same TYPE and FILL value,
+   otherwise append a new chunk.  */
+static EFI_STATUS sparse_encode_chunk(struct sparse_encoder *enc, UINT16 type,
+				      UINT32 fill, const void *data,
+				      UINT32 blocks)
+{
+	struct sparse_header *sph = (struct sparse_header *)enc->buf;
+	struct chunk_header *ckh = enc->last;
+	UINTN data_size = type == CHUNK_TYPE_RAW ? blocks * sph->blk_sz : 0;
+	UINTN need = data_size;
+
+	if (!ckh || ckh->chunk_type != type ||
+	    (type == CHUNK_TYPE_FILL && enc->last_fill != fill)) {
+		need += sizeof(*ckh);
+		if (type == CHUNK_TYPE_FILL)
+			need += sizeof(fill);
+		ckh = NULL;
 	}
 
-	ret_flush_buffer = flush_buffer();
-	free_buffer();
-	return EFI_ERROR(ret) ? ret : ret_flush_buffer;
+	if (enc->size - enc->used < need)
+		return EFI_BUFFER_TOO_SMALL;
+
+	if (!ckh) {
+		ckh = enc->last = (struct chunk_header *)(enc->buf + enc->used);
+		ckh->chunk_type = type;
+		ckh->reserved1 = 0;
+		ckh->chunk_sz = 0;
+		ckh->total_sz = sizeof(*ckh);
+		enc->used += sizeof(*ckh);
+		if (type == CHUNK_TYPE_FILL) {
+			memcpy(enc->buf + enc->used, &fill, sizeof(fill));
+			ckh->total_sz += sizeof(fill);
+			enc->used += sizeof(fill);
+			enc->last_fill = fill;
+		}
+		sph->total_chunks++;
+	}
+
+	if (data_size) {
+		memcpy(enc->buf + enc->used, data, data_size);
+		ckh->total_sz += data_size;
+		enc->used += data_size;
+	}
+	ckh->chunk_sz += blocks;
+	sph->total_blks += blocks;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS sparse_encode_skip(struct sparse_encoder *enc, UINT32 blocks)
+{
+	if (!blocks)
+		return EFI_SUCCESS;
+
+	return sparse_encode_chunk(enc, CHUNK_TYPE_DONT_CARE, 0, NULL, blocks);
+}
+
+/* Return TRUE and the pattern in *FILL if the block is made of a
+   single repeated 32 bits word.  */
+static BOOLEAN block_is_fill(const UINT32 *block, UINT32 blk_sz, UINT32 *fill)
+{
+	UINTN i;
+
+	for (i = 1; i < blk_sz / sizeof(*block); i++)
+		if (block[i] != block[0])
+			return FALSE;
+
+	*fill = block[0];
+	return TRUE;
+}
+
+EFI_STATUS sparse_encode_data(struct sparse_encoder *enc, const void *data,
+			      UINTN size)
+{
+	struct sparse_header *sph = (struct sparse_header *)enc->buf;
+	const CHAR8 *block = data, *raw = NULL;
+	UINT32 fill, raw_blocks = 0;
+	EFI_STATUS ret;
+	UINTN i;
+
+	if (size % sph->blk_sz)
+		return EFI_INVALID_PARAMETER;
+
+	/* Runs of RAW blocks are copied at once.  */
+	for (i = 0; i < size; i += sph->blk_sz, block += sph->blk_sz) {
+		if (!block_is_fill((const UINT32 *)block, sph->blk_sz, &fill)) {
+			if (!raw_blocks++)
+				raw = block;
+			continue;
+		}
+
+		if (raw_blocks) {
+			ret = sparse_encode_chunk(enc, CHUNK_TYPE_RAW, 0, raw,
+						  raw_blocks);
+			if (EFI_ERROR(ret))
+				return ret;
+			raw_blocks = 0;
+		}
+
+		ret = sparse_encode_chunk(enc, CHUNK_TYPE_FILL, fill, NULL, 1);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	if (!raw_blocks)
+		return EFI_SUCCESS;
+
+	return sparse_encode_chunk(enc, CHUNK_TYPE_RAW, 0, raw, raw_blocks);
+}
+
+UINTN sparse_encode_end(struct sparse_encoder *enc)
+{
+	return enc->used;
 }
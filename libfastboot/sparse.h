@@ -37,7 +37,55 @@
 
 #include <efi.h>
 
-int is_sparse_image(void *data, UINT64 size);
+BOOLEAN is_sparse_image(void *data, UINT64 size);
 EFI_STATUS flash_sparse(void *data, UINT64 size);
 
+/* Incremental interface: the image can be supplied in pieces of any
+   size, for instance as the download progresses.  */
+EFI_STATUS sparse_stream_start(void);
+EFI_STATUS sparse_stream_write(void *data, UINTN size);
+EFI_STATUS sparse_stream_end(void);
+
+/* Header checker: follows the chunk headers of a SIZE bytes image
+   without reading the chunk data so that a malformed sparse image
+   can be refused while it is still being received.  DATA is the
+   image start and LEN the number of bytes available, which must not
+   decrease between calls.  Succeeds for an image which is not
+   sparse.  */
+void sparse_check_start(UINT64 size);
+EFI_STATUS sparse_check_update(void *data, UINT64 len);
+
+/* Expansion of a complete sparse image in memory.
+   sparse_expanded_size() returns the size of the image without its
+   trailing DONT_CARE blocks, which sparse_expand() writes to OUT, the
+   other DONT_CARE blocks reading as zeroes.  CB, if not NULL, is
+   called with each expanded area in image order.  */
+typedef void (*sparse_expand_cb_t)(void *data, UINTN size, void *ctx);
+EFI_STATUS sparse_expanded_size(void *data, UINT64 size, UINT64 *out_size);
+EFI_STATUS sparse_expand(void *data, UINT64 size, void *out, UINT64 out_size,
+			 sparse_expand_cb_t cb, void *ctx);
+
+/* Encoder: builds a sparse image of BLK_SZ bytes blocks in a caller
+   supplied buffer.  Blocks made of a repeated 32 bits word, zero
+   included, are encoded as FILL chunks and adjacent chunks of the
+   same kind are merged.  EFI_BUFFER_TOO_SMALL is returned when the
+   buffer is full.  */
+struct sparse_encoder {
+	CHAR8 *buf;
+	UINTN size;
+	UINTN used;
+	struct chunk_header *last;
+	UINT32 last_fill;
+};
+
+EFI_STATUS sparse_encode_start(struct sparse_encoder *enc, void *buf,
+			       UINTN size, UINT32 blk_sz);
+/* Add BLOCKS blocks of DONT_CARE chunk.  */
+EFI_STATUS sparse_encode_skip(struct sparse_encoder *enc, UINT32 blocks);
+/* SIZE must be a multiple of the block size.  */
+EFI_STATUS sparse_encode_data(struct sparse_encoder *enc, const void *data,
+			      UINTN size);
+/* Return the size of the sparse image.  */
+UINTN sparse_encode_end(struct sparse_encoder *enc);
+
 #endif	/* _SPARSE_H_ */
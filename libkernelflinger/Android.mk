@@ -63,11 +63,24 @@ ifeq ($(KERNELFLINGER_IGNORE_NOT_APPLICABLE_RESET),true)
     LOCAL_CFLAGS += -DIGNORE_NOT_APPLICABLE_RESET
 endif
 
+# Storage backends, see KERNELFLINGER_STORAGE
+STORAGE_SRC_FILES_emmc := mmc.c sdio.c
+STORAGE_SRC_FILES_ufs := ufs.c
+STORAGE_SRC_FILES_sdcard := sdcard.c mmc.c sdio.c
+STORAGE_SRC_FILES_sata := sata.c
+STORAGE_SRC_FILES_nvme := nvme.c
+ifneq ($(strip $(KERNELFLINGER_STORAGE)),)
+    STORAGE_SRC_FILES := $(STORAGE_SRC_FILES_$(strip $(KERNELFLINGER_STORAGE)))
+else
+    STORAGE_SRC_FILES := mmc.c ufs.c sdcard.c sdio.c sata.c nvme.c
+endif
+
 LOCAL_SRC_FILES := \
 	android.c \
 	efilinux.c \
 	acpi.c \
 	lib.c \
+	bump.c \
 	options.c \
 	security.c \
 	asn1.c \
@@ -82,18 +95,23 @@ LOCAL_SRC_FILES := \
 	log.c \
 	em.c \
 	gpt.c \
+	crc32.c \
+	parallel.c \
+	sha_ni.c \
 	storage.c \
+	async_io.c \
 	pci.c \
-	mmc.c \
-	ufs.c \
-	sdcard.c \
-	sdio.c \
-	sata.c \
+	$(STORAGE_SRC_FILES) \
+	ramdisk.c \
 	uefi_utils.c \
 	targets.c \
 	smbios.c \
 	oemvars.c \
 	text_parser.c \
+	timer.c \
+	timestamp.c \
+	trace.c \
+	memstat.c \
 	watchdog.c
 
 ifeq ($(HAL_AUTODETECT),true)
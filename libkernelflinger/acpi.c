@@ -149,7 +149,7 @@ static UINTN acpi_verify_checksum(struct ACPI_DESC_HEADER *table)
 	return sum == 0 ? EFI_SUCCESS : EFI_CRC_ERROR;
 }
 
-EFI_STATUS get_rsdt_table(struct RSDT_TABLE **rsdt)
+static EFI_STATUS get_rsdt_table(struct RSDT_TABLE **rsdt)
 {
 	EFI_GUID acpi2_guid = ACPI_20_TABLE_GUID;
 	struct RSDP_TABLE *rsdp;
@@ -171,7 +171,7 @@ EFI_STATUS get_rsdt_table(struct RSDT_TABLE **rsdt)
 		goto out;
 	}
 
-	ret = acpi_verify_checksum((struct ACPI_DESC_HEADER *)rsdt);
+	ret = acpi_verify_checksum((struct ACPI_DESC_HEADER *)*rsdt);
 	if (EFI_ERROR(ret)) {
 		error(L"Invalid checksum for RSDT table");
 		goto out;
@@ -181,28 +181,106 @@ out:
 	return ret;
 }
 
-EFI_STATUS get_acpi_table(const CHAR8 *signature, VOID **table)
+/* The RSDT is walked once.  The tables checksum is only verified the
+   first time they are looked up, EFI_NOT_READY standing for "not
+   verified yet".  The DSDT, only referenced by the FACP, takes the
+   last slot.  */
+static struct {
+	BOOLEAN ready;
+	EFI_STATUS status;
+	struct RSDT_TABLE *rsdt;
+	UINTN nb;
+	struct acpi_index_entry {
+		struct ACPI_DESC_HEADER *table;
+		EFI_STATUS checksum;
+	} *entries;
+} acpi_index;
+
+static EFI_STATUS acpi_index_build(void)
 {
 	struct RSDT_TABLE *rsdt;
 	EFI_STATUS ret;
-	UINTN i, nb_acpi_tables, sign_count = 1;
-	char *end;
-	UINTN max_sign_len = sizeof(((struct ACPI_DESC_HEADER *)0)->signature);
+	UINTN i, nb;
 
-	if (!strcmp((CHAR8 *)"DSDT", signature)) {
-		UINT64 dsdt = get_acpi_field(FACP, DSDT);
-		if (dsdt == (UINT64)-1)
-			return EFI_NOT_FOUND;
-		*table = (VOID *)(UINTN)dsdt;
+	if (acpi_index.ready)
+		return acpi_index.status;
+
+	acpi_index.ready = TRUE;
+	ret = get_rsdt_table(&rsdt);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	nb = (rsdt->header.length - sizeof(rsdt->header)) / sizeof(rsdt->entry[1]);
+	acpi_index.entries = AllocatePool((nb + 1) * sizeof(*acpi_index.entries));
+	if (!acpi_index.entries) {
+		ret = EFI_OUT_OF_RESOURCES;
 		goto out;
 	}
 
-	ret = get_rsdt_table(&rsdt);
+	for (i = 0; i < nb; i++) {
+		acpi_index.entries[i].table = (VOID *)(UINTN)rsdt->entry[i];
+		acpi_index.entries[i].checksum = EFI_NOT_READY;
+	}
+	acpi_index.entries[nb].table = NULL;
+	acpi_index.entries[nb].checksum = EFI_NOT_READY;
+
+	acpi_index.rsdt = rsdt;
+	acpi_index.nb = nb;
+out:
+	acpi_index.status = ret;
+	return ret;
+}
+
+static EFI_STATUS acpi_index_verify(struct acpi_index_entry *entry)
+{
+	CHAR8 *sig = entry->table->signature;
+
+	if (entry->checksum == EFI_NOT_READY) {
+		entry->checksum = acpi_verify_checksum(entry->table);
+		if (EFI_ERROR(entry->checksum))
+			error(L"Invalid checksum for %c%c%c%c table", sig[0],
+			      sig[1], sig[2], sig[3]);
+	}
+
+	return entry->checksum;
+}
+
+static struct acpi_index_entry *acpi_index_get_dsdt(void)
+{
+	struct acpi_index_entry *entry = &acpi_index.entries[acpi_index.nb];
+	UINT64 dsdt;
+
+	if (!entry->table) {
+		dsdt = get_acpi_field(FACP, DSDT);
+		if (dsdt == (UINT64)-1)
+			return NULL;
+		entry->table = (VOID *)(UINTN)dsdt;
+	}
+
+	return entry;
+}
+
+EFI_STATUS get_acpi_table(const CHAR8 *signature, VOID **table)
+{
+	struct acpi_index_entry *entry = NULL;
+	EFI_STATUS ret;
+	UINTN i, sign_count = 1;
+	char *end;
+	UINTN max_sign_len = sizeof(((struct ACPI_DESC_HEADER *)0)->signature);
+
+	ret = acpi_index_build();
 	if (EFI_ERROR(ret))
 		return ret;
 
 	if (!strcmp((CHAR8 *)"RSDT", signature)) {
-		*table = rsdt;
+		*table = acpi_index.rsdt;
+		return EFI_SUCCESS;
+	}
+
+	if (!strcmp((CHAR8 *)"DSDT", signature)) {
+		entry = acpi_index_get_dsdt();
+		if (!entry)
+			return EFI_NOT_FOUND;
 		goto out;
 	}
 
@@ -212,16 +290,13 @@ EFI_STATUS get_acpi_table(const CHAR8 *signature, VOID **table)
 			return EFI_INVALID_PARAMETER;
 	}
 
-	nb_acpi_tables = (rsdt->header.length - sizeof(rsdt->header)) / sizeof(rsdt->entry[1]);
-	ret = EFI_NOT_FOUND;
-	for (i = 0; i < nb_acpi_tables; i++) {
-		struct ACPI_DESC_HEADER *header = (VOID *)(UINTN)rsdt->entry[i];
-		if (!strncmpa(header->signature, signature, max_sign_len)) {
+	for (i = 0; i < acpi_index.nb; i++) {
+		if (!strncmpa(acpi_index.entries[i].table->signature, signature, max_sign_len)) {
 			if (sign_count > 1) {
 				sign_count--;
 				continue;
 			}
-			*table = header;
+			entry = &acpi_index.entries[i];
 			goto out;
 		}
 	}
@@ -229,14 +304,12 @@ EFI_STATUS get_acpi_table(const CHAR8 *signature, VOID **table)
 	return EFI_NOT_FOUND;
 
 out:
-	debug(L"Found %c%c%c%c table", signature[0], signature[1],
-	      signature[2], signature[3]);
-	ret = acpi_verify_checksum(*table);
+	ret = acpi_index_verify(entry);
 	if (EFI_ERROR(ret))
-		error(L"Invalid checksum for %c%c%c%c table", signature[0],
-		      signature[1], signature[2], signature[3]);
+		return ret;
 
-	return ret;
+	*table = entry->table;
+	return EFI_SUCCESS;
 }
 
 #ifdef USE_RSCI
@@ -46,6 +46,11 @@
 #include "storage.h"
 #include "text_parser.h"
 #include "watchdog.h"
+#include "timestamp.h"
+#include "uefi_utils.h"
+#include "async_io.h"
+#include "parallel.h"
+#include "bump.h"
 #ifdef HAL_AUTODETECT
 #include "blobstore.h"
 #endif
@@ -100,6 +105,10 @@ struct setup_header {
         UINT32 handover_offset;
 } __attribute__((packed));
 
+/* xloadflags */
+#define XLF_KERNEL_64                  (1 << 0)
+#define XLF_CAN_BE_LOADED_ABOVE_4G     (1 << 1)
+
 struct efi_info {
         UINT32 efi_loader_signature;
         UINT32 efi_systab;
@@ -174,7 +183,10 @@ struct boot_params {
         UINT8 hd1_info[16];
         UINT8 sys_desc_table[0x10];
         UINT8 olpc_ofw_header[0x10];
-        UINT8 _pad4[128];
+        UINT32 ext_ramdisk_image;
+        UINT32 ext_ramdisk_size;
+        UINT32 ext_cmd_line_ptr;
+        UINT8 _pad4[116];
         UINT8 edid_info[0x80];
         struct efi_info efi_info;
         UINT32 alt_mem_k;
@@ -290,6 +302,10 @@ static void setup_e820_map(struct boot_params *boot_params,
         struct e820_entry *e820_map = boot_params->e820_map;
         UINTN i, n_page = 0;
 
+        /* Sorted, adjacent regions of the same type are merged in a
+         * single pass.  */
+        sort_memory_map(mem_entries, nr_entries, entry_sz);
+
         for (i = 0; i < nr_entries; i++) {
                 EFI_MEMORY_DESCRIPTOR *d;
                 unsigned int cur_type = 0;
@@ -336,6 +352,9 @@ static void setup_e820_map(struct boot_params *boot_params,
                         continue;
                 }
 
+                if (n_page == ARRAY_SIZE(boot_params->e820_map))
+                        break;
+
                 e820_map[n_page].addr = d->PhysicalStart;
                 e820_map[n_page].size = d->NumberOfPages << EFI_PAGE_SHIFT;
                 e820_map[n_page].type = cur_type;
@@ -345,44 +364,71 @@ static void setup_e820_map(struct boot_params *boot_params,
         boot_params->e820_entries = n_page;
 }
 
+/* The memory map buffer is allocated once, with room for the
+ * descriptors its own allocation and a partial shutdown of the boot
+ * services may add, and reused by the ExitBootServices() retries.  */
+#define MEMMAP_SLACK_ENTRIES    16
+
+static struct {
+        EFI_MEMORY_DESCRIPTOR *entries;
+        UINTN size;
+} memmap;
+
+static EFI_STATUS memmap_alloc(void)
+{
+        EFI_STATUS ret;
+        UINTN size = 0, key, entry_sz;
+        UINT32 entry_ver;
+
+        if (memmap.entries)
+                FreePool(memmap.entries);
+        memmap.entries = NULL;
+        memmap.size = 0;
+
+        ret = uefi_call_wrapper(BS->GetMemoryMap, 5, &size, NULL, &key,
+                                &entry_sz, &entry_ver);
+        if (ret != EFI_BUFFER_TOO_SMALL)
+                return EFI_ERROR(ret) ? ret : EFI_DEVICE_ERROR;
+
+        size += MEMMAP_SLACK_ENTRIES * entry_sz;
+        memmap.entries = AllocatePool(size);
+        if (!memmap.entries)
+                return EFI_OUT_OF_RESOURCES;
+
+        memmap.size = size;
+        return EFI_SUCCESS;
+}
+
 /* WARNING: Do not make any call that might change the memory mapping
  * (allocation, print, ...) in this function.  */
 static EFI_STATUS setup_memory_map(struct boot_params *boot_params, UINTN *key)
 {
-        UINTN nr_entries, entry_sz;
-        EFI_MEMORY_DESCRIPTOR *mem_entries;
+        EFI_STATUS ret;
+        UINTN size, nr_entries, entry_sz;
         UINT32 entry_ver;
         struct efi_info *efi = &boot_params->efi_info;
 
-        /* This function can be called several times. The previous
-         * memory map buffer must be freed. */
-        if (efi->efi_memmap) {
-                EFI_PHYSICAL_ADDRESS prev_memmap = efi->efi_memmap;
-#ifdef  __LP64__
-                prev_memmap = prev_memmap |
-                        (EFI_PHYSICAL_ADDRESS)efi->efi_memmap_hi << 32;
-#endif
-                FreePool((VOID *)prev_memmap);
-        }
-
-        mem_entries = LibMemoryMap(&nr_entries, key, &entry_sz, &entry_ver);
-        if (!mem_entries)
-                return EFI_OUT_OF_RESOURCES;
+        size = memmap.size;
+        ret = uefi_call_wrapper(BS->GetMemoryMap, 5, &size, memmap.entries,
+                                key, &entry_sz, &entry_ver);
+        if (EFI_ERROR(ret))
+                return ret;
+        nr_entries = size / entry_sz;
 
         efi->efi_systab = (UINT32)(UINTN)ST;
         efi->efi_memdesc_size = entry_sz;
         efi->efi_memdesc_version = entry_ver;
-        efi->efi_memmap = (UINT32)(UINTN)mem_entries;
+        efi->efi_memmap = (UINT32)(UINTN)memmap.entries;
         efi->efi_memmap_size = entry_sz * nr_entries;
 #ifdef  __LP64__
         efi->efi_systab_hi = (EFI_PHYSICAL_ADDRESS)ST >> 32;
-        efi->efi_memmap_hi = (EFI_PHYSICAL_ADDRESS)mem_entries >> 32;
+        efi->efi_memmap_hi = (EFI_PHYSICAL_ADDRESS)memmap.entries >> 32;
 #endif
 
         memcpy(&efi->efi_loader_signature,
                EFI_LOADER_SIGNATURE, sizeof(efi->efi_loader_signature));
 
-        setup_e820_map(boot_params, mem_entries, nr_entries, entry_sz);
+        setup_e820_map(boot_params, memmap.entries, nr_entries, entry_sz);
 
         return EFI_SUCCESS;
 }
@@ -408,8 +454,19 @@ static inline EFI_STATUS handover_jump(EFI_HANDLE image,
          * Hence, we give two chances to ExitBootServices() to
          * succeed.
          */
+        ret = memmap_alloc();
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to allocate the memory map");
+                return ret;
+        }
+
         for (i = 0; i < 2; i++) {
                 ret = setup_memory_map(boot_params, &map_key);
+                if (ret == EFI_BUFFER_TOO_SMALL) {
+                        ret = memmap_alloc();
+                        if (!EFI_ERROR(ret))
+                                ret = setup_memory_map(boot_params, &map_key);
+                }
                 if (EFI_ERROR(ret)) {
                         efi_perror(ret, L"Failed to setup memory map");
                         return ret;
@@ -483,6 +540,122 @@ struct boot_img_hdr *get_bootimage_header(VOID *bootimage_blob)
 }
 
 
+/* Boot image whose kernel and ramdisk have been read by
+ * android_image_load_partition() directly at their final location.
+ * The corresponding areas of the boot image buffer are not read.  */
+static struct {
+        VOID *bootimage;
+        UINT32 koffset;
+        UINT32 ksize;
+        EFI_PHYSICAL_ADDRESS kernel_start;
+        UINT32 kernel_alloc_size;
+        UINT32 roffset;
+        UINT32 rsize;
+        EFI_PHYSICAL_ADDRESS ramdisk_start;
+} preloaded;
+
+static void release_preloaded(void)
+{
+        bootimage_hash_abort();
+        efree(preloaded.kernel_start, preloaded.kernel_alloc_size);
+        if (preloaded.rsize)
+                efree(preloaded.ramdisk_start, preloaded.rsize);
+        memset(&preloaded, 0, sizeof(preloaded));
+}
+
+UINTN bootimage_pieces(VOID *bootimage, UINTN size,
+                       struct bootimage_piece *pieces)
+{
+        struct {
+                UINTN offset;
+                UINTN size;
+                VOID *data;
+        } holes[2];
+        UINTN i, n = 0, cur = 0;
+
+        if (bootimage != preloaded.bootimage) {
+                pieces[0].data = bootimage;
+                pieces[0].size = size;
+                return 1;
+        }
+
+        holes[0].offset = preloaded.koffset;
+        holes[0].size = preloaded.ksize;
+        holes[0].data = (VOID *)(UINTN)preloaded.kernel_start;
+        holes[1].offset = preloaded.roffset;
+        holes[1].size = preloaded.rsize;
+        holes[1].data = (VOID *)(UINTN)preloaded.ramdisk_start;
+
+        for (i = 0; i < ARRAY_SIZE(holes) && holes[i].offset < size; i++) {
+                if (!holes[i].size)
+                        continue;
+
+                if (holes[i].offset > cur) {
+                        pieces[n].data = (UINT8 *)bootimage + cur;
+                        pieces[n++].size = holes[i].offset - cur;
+                }
+
+                pieces[n].data = holes[i].data;
+                pieces[n++].size = min(holes[i].size, size - holes[i].offset);
+                cur = holes[i].offset + pieces[n - 1].size;
+        }
+
+        if (cur < size) {
+                pieces[n].data = (UINT8 *)bootimage + cur;
+                pieces[n++].size = size - cur;
+        }
+
+        return n;
+}
+
+/* A 64-bit kernel announcing it can be loaded above 4 GiB accepts
+ * its ramdisk and boot parameters anywhere in memory.  */
+static BOOLEAN can_be_loaded_above_4g(struct boot_params *bp)
+{
+#if __LP64__
+        return bp->hdr.version >= 0x20c &&
+                (bp->hdr.xloadflags & XLF_KERNEL_64) &&
+                (bp->hdr.xloadflags & XLF_CAN_BE_LOADED_ABOVE_4G);
+#else
+        (void)bp;
+        return FALSE;
+#endif
+}
+
+/* The pages are taken from the top of the allowed range, which
+ * leaves the fragmented low memory alone.  */
+static EFI_STATUS allocate_ramdisk(struct boot_params *bp, UINT32 rsize,
+                                   EFI_PHYSICAL_ADDRESS *ramdisk_addr)
+{
+        EFI_ALLOCATE_TYPE type = AllocateMaxAddress;
+        EFI_STATUS ret;
+
+        *ramdisk_addr = bp->hdr.ramdisk_max;
+        if (can_be_loaded_above_4g(bp))
+                type = AllocateAnyPages;
+
+        ret = allocate_pages(type, EfiLoaderData, EFI_SIZE_TO_PAGES(rsize),
+                             ramdisk_addr);
+        if (EFI_ERROR(ret))
+                efi_perror(ret, L"Failed to allocate the ramdisk");
+
+        return ret;
+}
+
+static void set_ramdisk(struct boot_params *bp, EFI_PHYSICAL_ADDRESS addr,
+                        UINT32 size)
+{
+        bp->hdr.ramdisk_start = (UINT32)addr;
+        bp->hdr.ramdisk_len = size;
+        bp->ext_ramdisk_image = (UINT32)((UINT64)addr >> 32);
+        bp->ext_ramdisk_size = 0;
+}
+
+static EFI_PHYSICAL_ADDRESS get_ramdisk(struct boot_params *bp)
+{
+        return ((UINT64)bp->ext_ramdisk_image << 32) | bp->hdr.ramdisk_start;
+}
+
 static EFI_STATUS setup_ramdisk(UINT8 *bootimage)
 {
         struct boot_img_hdr *aosp_header;
@@ -499,22 +672,22 @@ static EFI_STATUS setup_ramdisk(UINT8 *bootimage)
         rsize = aosp_header->ramdisk_size;
         if (!rsize) {
                 debug(L"boot image has no ramdisk");
+                set_ramdisk(bp, 0, 0);
                 return EFI_SUCCESS; // no ramdisk, so nothing to do
         }
 
-        bp->hdr.ramdisk_len = rsize;
         debug(L"ramdisk size %d", rsize);
-        ret = emalloc(rsize, 0x1000, &ramdisk_addr);
+        if (bootimage == preloaded.bootimage) {
+                set_ramdisk(bp, preloaded.ramdisk_start, rsize);
+                return EFI_SUCCESS;
+        }
+
+        ret = allocate_ramdisk(bp, rsize, &ramdisk_addr);
         if (EFI_ERROR(ret))
                 return ret;
 
-        if ((UINTN)ramdisk_addr > bp->hdr.ramdisk_max) {
-                error(L"Ramdisk address is too high!");
-                efree(ramdisk_addr, rsize);
-                return EFI_OUT_OF_RESOURCES;
-        }
         memcpy((VOID *)(UINTN)ramdisk_addr, bootimage + roffset, rsize);
-        bp->hdr.ramdisk_start = (UINT32)(UINTN)ramdisk_addr;
+        set_ramdisk(bp, ramdisk_addr, rsize);
         return EFI_SUCCESS;
 }
 
@@ -584,22 +757,22 @@ static CHAR16 *get_wake_reason(void)
         wake_source = rsci_get_wake_source();
         switch(wake_source) {
         case WAKE_BATTERY_INSERTED:
-                reason = StrDuplicate(L"battery_inserted");
+                reason = bump_strdup(L"battery_inserted");
                 break;
         case WAKE_USB_CHARGER_INSERTED:
-                reason = StrDuplicate(L"usb_charger_inserted");
+                reason = bump_strdup(L"usb_charger_inserted");
                 break;
         case WAKE_ACDC_CHARGER_INSERTED:
-                reason = StrDuplicate(L"acdc_charger_inserted");
+                reason = bump_strdup(L"acdc_charger_inserted");
                 break;
         case WAKE_POWER_BUTTON_PRESSED:
-                reason = StrDuplicate(L"power_button_pressed");
+                reason = bump_strdup(L"power_button_pressed");
                 break;
         case WAKE_RTC_TIMER:
-                reason = StrDuplicate(L"rtc_timer");
+                reason = bump_strdup(L"rtc_timer");
                 break;
         case WAKE_BATTERY_REACHED_IA_THRESHOLD:
-                reason = StrDuplicate(L"battery_reached_ia_threshold");
+                reason = bump_strdup(L"battery_reached_ia_threshold");
                 break;
         default:
                 debug(L"wake_source = 0x%02x", wake_source);
@@ -619,41 +792,41 @@ static CHAR16 *get_reset_reason(void)
         switch (reset_source) {
 #ifndef IGNORE_NOT_APPLICABLE_RESET
         case RESET_NOT_APPLICABLE:
-                reason = StrDuplicate(L"not_applicable");
+                reason = bump_strdup(L"not_applicable");
                 break;
 #endif
         case RESET_OS_INITIATED:
-                reason = StrDuplicate(OS_INITIATED);
+                reason = bump_strdup(OS_INITIATED);
                 break;
         case RESET_FORCED:
-                reason = StrDuplicate(L"forced");
+                reason = bump_strdup(L"forced");
                 break;
         case RESET_FW_UPDATE:
-                reason = StrDuplicate(L"firmware_update");
+                reason = bump_strdup(L"firmware_update");
                 break;
         case RESET_KERNEL_WATCHDOG:
-                reason = StrDuplicate(L"watchdog");
+                reason = bump_strdup(L"watchdog");
                 break;
         case RESET_SECURITY_WATCHDOG:
-                reason = StrDuplicate(L"security_watchdog");
+                reason = bump_strdup(L"security_watchdog");
                 break;
         case RESET_SECURITY_INITIATED:
-                reason = StrDuplicate(L"security_initiated");
+                reason = bump_strdup(L"security_initiated");
                 break;
         case RESET_EC_WATCHDOG:
-                reason = StrDuplicate(L"ec_watchdog");
+                reason = bump_strdup(L"ec_watchdog");
                 break;
         case RESET_PMIC_WATCHDOG:
-                reason = StrDuplicate(L"pmic_watchdog");
+                reason = bump_strdup(L"pmic_watchdog");
                 break;
         case RESET_SHORT_POWER_LOSS:
-                reason = StrDuplicate(L"short_power_loss");
+                reason = bump_strdup(L"short_power_loss");
                 break;
         case RESET_PLATFORM_SPECIFIC:
-                reason = StrDuplicate(L"platform_specific");
+                reason = bump_strdup(L"platform_specific");
                 break;
         case RESET_UNKNOWN:
-                reason = StrDuplicate(L"unknown");
+                reason = bump_strdup(L"unknown");
                 break;
         default:
                 debug(L"reset_source = 0x%02x", reset_source);
@@ -677,10 +850,11 @@ static CHAR16 *get_boot_reason(void)
                 goto done;
 
         /* in case of an OS initiated reboot => get reason from efi var */
+        bump_free(bootreason);
         bootreason = get_reboot_reason();
         if (!bootreason) {
                 debug(L"Error while trying to read the reboot reason");
-                bootreason = StrDuplicate(L"unknown");
+                bootreason = bump_strdup(L"unknown");
                 goto done;
         }
 
@@ -691,8 +865,8 @@ static CHAR16 *get_boot_reason(void)
                             (*pos >= L'a' && *pos <= L'z') ||
                             *pos == L'_')) {
                         debug(L"Error, reboot reason contains non-alphanumeric characters");
-                        FreePool(bootreason);
-                        bootreason = StrDuplicate(L"unknown");
+                        bump_free(bootreason);
+                        bootreason = bump_strdup(L"unknown");
                         break;
                 }
                 pos++;
@@ -703,30 +877,174 @@ done:
 }
 
 
-static EFI_STATUS prepend_command_line(CHAR16 **cmdline, CHAR16 *fmt, ...)
+/* The boot parameters are formatted back to back, NUL terminated, in
+ * a buffer which grows as needed.  They are assembled in the reverse
+ * order of their addition in front of the boot image command line, the
+ * last added one first, and converted to ASCII in one pass.  */
+#define CMDLINE_BUILDER_SIZE    4096    /* Initial sizes */
+#define CMDLINE_PARAMS          64
+
+static struct cmdline_builder {
+        CHAR16 *buf;
+        UINTN size;
+        UINTN used;
+        struct cmdline_param {
+                UINTN offset;
+                UINTN length;
+        } *params;
+        UINTN max;
+        UINTN nb;
+} builder;
+
+static void cmdline_reset(void)
 {
-        CHAR16 *old;
-        va_list args;
-        CHAR16 *string;
-        CHAR16 *new;
+        builder.used = 0;
+        builder.nb = 0;
+}
 
-        old = *cmdline;
-        va_start(args, fmt);
-        string = VPoolPrint(fmt, args);
-        va_end(args);
+/* Make room for one more parameter of LEN characters */
+static EFI_STATUS cmdline_grow(UINTN len)
+{
+        UINTN size, max;
+        VOID *p;
+
+        if (builder.nb == builder.max) {
+                max = builder.max ? builder.max * 2 : CMDLINE_PARAMS;
+                p = ReallocatePool(builder.params,
+                                   builder.max * sizeof(*builder.params),
+                                   max * sizeof(*builder.params));
+                if (!p)
+                        return EFI_OUT_OF_RESOURCES;
+                builder.params = p;
+                builder.max = max;
+        }
 
-        if (!string)
-                return EFI_OUT_OF_RESOURCES;
+        if (builder.used + len + 1 <= builder.size)
+                return EFI_SUCCESS;
 
-        new = PoolPrint(L"%s %s", string, old);
-        FreePool(string);
-        if (!new)
+        size = builder.size ? builder.size : CMDLINE_BUILDER_SIZE;
+        while (size < builder.used + len + 1)
+                size *= 2;
+        p = ReallocatePool(builder.buf, builder.size * sizeof(CHAR16),
+                           size * sizeof(CHAR16));
+        if (!p)
                 return EFI_OUT_OF_RESOURCES;
+        builder.buf = p;
+        builder.size = size;
+        return EFI_SUCCESS;
+}
+
+static void cmdline_push(UINTN len)
+{
+        builder.params[builder.nb].offset = builder.used;
+        builder.params[builder.nb].length = len;
+        builder.nb++;
+        builder.used += len + 1;
+}
+
+static EFI_STATUS cmdline_add(CHAR16 *fmt, ...)
+{
+        UINTN avail, len = 1;
+        va_list args;
+        EFI_STATUS ret;
+
+        for (;;) {
+                ret = cmdline_grow(len);
+                if (EFI_ERROR(ret)) {
+                        efi_perror(ret, L"Failed to grow the command line");
+                        return ret;
+                }
 
-        FreePool(old);
-        *cmdline = new;
+                avail = builder.size - builder.used;
+                va_start(args, fmt);
+                len = VSPrint(builder.buf + builder.used,
+                              avail * sizeof(CHAR16), fmt, args);
+                va_end(args);
+
+                /* VSPrint() silently truncates */
+                if (len + 1 < avail)
+                        break;
+                len = avail;
+        }
+
+        cmdline_push(len);
+        return EFI_SUCCESS;
+}
+
+#ifdef HAL_AUTODETECT
+/* Add the LEN characters at STR as they are, without formatting */
+static EFI_STATUS cmdline_add_slice(const char *str, UINTN len)
+{
+        EFI_STATUS ret;
+        UINTN i;
+
+        ret = cmdline_grow(len);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to grow the command line");
+                return ret;
+        }
+
+        for (i = 0; i < len; i++)
+                builder.buf[builder.used + i] = str[i];
+        builder.buf[builder.used + len] = 0;
+
+        cmdline_push(len);
         return EFI_SUCCESS;
 }
+#endif
+
+/* Length of the command line cmdline_build() would assemble */
+static UINTN cmdline_length(CHAR16 *base)
+{
+        UINTN i, len = StrLen(base);
+
+        for (i = 0; i < builder.nb; i++)
+                len += builder.params[i].length + 1;
+
+        return len;
+}
+
+/* Assemble the parameters and BASE in pages allocated below
+ * MAX_ADDR.  */
+static EFI_STATUS cmdline_build(CHAR16 *base, EFI_PHYSICAL_ADDRESS max_addr,
+                                CHAR8 **cmdline_p)
+{
+        EFI_PHYSICAL_ADDRESS addr = max_addr;
+        UINTN i, len, base_len, pos = 0;
+        CHAR8 *cmdline;
+        EFI_STATUS ret;
+
+        base_len = StrLen(base);
+        len = cmdline_length(base);
+
+        ret = allocate_pages(AllocateMaxAddress, EfiLoaderData,
+                             EFI_SIZE_TO_PAGES(len + 1), &addr);
+        if (EFI_ERROR(ret))
+                return ret;
+        cmdline = (CHAR8 *)(UINTN)addr;
+
+        for (i = builder.nb; i > 0; i--) {
+                ret = str_to_stra(cmdline + pos,
+                                  builder.buf + builder.params[i - 1].offset,
+                                  builder.params[i - 1].length + 1);
+                if (EFI_ERROR(ret))
+                        goto err;
+                pos += builder.params[i - 1].length;
+                cmdline[pos++] = ' ';
+        }
+
+        ret = str_to_stra(cmdline + pos, base, base_len + 1);
+        if (EFI_ERROR(ret))
+                goto err;
+
+        *cmdline_p = cmdline;
+        return EFI_SUCCESS;
+
+err:
+        error(L"Non-ascii characters in command line");
+        free_pages(addr, EFI_SIZE_TO_PAGES(len + 1));
+        return ret;
+}
 
 
 static CHAR16 *get_command_line(IN struct boot_img_hdr *aosp_header,
@@ -757,7 +1075,7 @@ static CHAR16 *get_command_line(IN struct boot_img_hdr *aosp_header,
                                BOOT_EXTRA_ARGS_SIZE);
                 }
 
-                cmdline16 = stra_to_str(full_cmdline);
+                cmdline16 = bump_stra_to_str(full_cmdline);
 
                 if (!cmdline16)
                         return NULL;
@@ -770,30 +1088,34 @@ static CHAR16 *get_command_line(IN struct boot_img_hdr *aosp_header,
 
 #ifndef USER
         if (cmdline_prepend) {
-                EFI_STATUS ret;
+                CHAR16 *new;
 
                 error(L"Prepending '%s' to command line", cmdline_prepend);
                 needs_pause = TRUE;
 
-                ret = prepend_command_line(&cmdline16, L"%s", cmdline_prepend);
-                FreePool(cmdline_prepend);
-                if (EFI_ERROR(ret))
+                new = PoolPrint(L"%s %s", cmdline_prepend, cmdline16);
+                bump_free(cmdline_prepend);
+                if (!new)
                         error(L"couldn't prepend to command line");
+                else {
+                        bump_free(cmdline16);
+                        cmdline16 = new;
+                }
         }
 
         if (cmdline_append) {
-                EFI_STATUS ret;
+                CHAR16 *new;
 
                 error(L"Appending '%s' to command line", cmdline_append);
                 needs_pause = TRUE;
 
-                ret = prepend_command_line(&cmdline_append, L"%s", cmdline16);
-                if (EFI_ERROR(ret)) {
-                        error(L"couldn't prepend to command line");
-                        FreePool(cmdline_append);
-                } else {
-                        FreePool(cmdline16);
-                        cmdline16 = cmdline_append;
+                new = PoolPrint(L"%s %s", cmdline16, cmdline_append);
+                bump_free(cmdline_append);
+                if (!new)
+                        error(L"couldn't append to command line");
+                else {
+                        bump_free(cmdline16);
+                        cmdline16 = new;
                 }
         }
 
@@ -855,21 +1177,13 @@ EFI_STATUS get_bootimage_blob(VOID *bootimage, enum blobtype btype, VOID **blob,
  * #<comment> or <key>=<value>. We don't do sanity checking as the
  * blobstore is covered by the verified boot signature and is hence
  * trusted */
-static EFI_STATUS parse_bootvars_line(char *line, VOID *ctx)
-{
-        CHAR16 **cmdline16 = (CHAR16 **)ctx;
-
-        if (strlen((CHAR8 *)line) == 0 || line[0] == '#')
-                return EFI_SUCCESS;
-
-        return prepend_command_line(cmdline16, L"%a", line);
-}
-
-static EFI_STATUS add_bootvars(VOID *bootimage, CHAR16 **cmdline16)
+static EFI_STATUS add_bootvars(VOID *bootimage)
 {
         VOID *bootvars;
         UINT32 bvsize;
         EFI_STATUS ret;
+        text_iter_t it;
+        text_slice_t line;
 
         ret = get_bootimage_blob(bootimage, BLOB_TYPE_BOOTVARS, &bootvars,
                                  &bvsize);
@@ -882,8 +1196,19 @@ static EFI_STATUS add_bootvars(VOID *bootimage, CHAR16 **cmdline16)
                 return ret;
         }
 
-        return parse_text_buffer(bootvars, bvsize, parse_bootvars_line,
-                                 cmdline16);
+        text_iter_init(&it, bootvars, bvsize);
+        while (text_next_line(&it, &line)) {
+                if (line.ptr[0] == '#')
+                        continue;
+
+                ret = cmdline_add_slice(line.ptr, line.len);
+                if (EFI_ERROR(ret)) {
+                        efi_perror(ret, L"Failed at line %d", it.lineno);
+                        return ret;
+                }
+        }
+
+        return EFI_SUCCESS;
 }
 #endif
 
@@ -897,10 +1222,11 @@ static EFI_STATUS setup_command_line(
         char   *serialno = NULL;
         CHAR16 *serialport = NULL;
         CHAR16 *bootreason = NULL;
+        CHAR16 *timeline = NULL;
+        UINTN mark = bump_mark();
+        UINTN len;
 
-        EFI_PHYSICAL_ADDRESS cmdline_addr;
         CHAR8 *cmdline;
-        UINTN cmdlen;
         EFI_STATUS ret;
         struct boot_params *buf;
         struct boot_img_hdr *aosp_header;
@@ -913,20 +1239,19 @@ static EFI_STATUS setup_command_line(
                 ret = EFI_OUT_OF_RESOURCES;
                 goto out;
         }
+        cmdline_reset();
 
         /* Append serial number from DMI */
         serialno = get_serial_number();
         if (serialno) {
-                ret = prepend_command_line(&cmdline16,
-                                L"androidboot.serialno=%a g_ffs.iSerialNumber=%a",
-                                serialno, serialno);
+                ret = cmdline_add(L"androidboot.serialno=%a g_ffs.iSerialNumber=%a",
+                                  serialno, serialno);
                 if (EFI_ERROR(ret))
                         goto out;
         }
 
         if (boot_target == CHARGER) {
-                ret = prepend_command_line(&cmdline16,
-                                L"androidboot.mode=charger");
+                ret = cmdline_add(L"androidboot.mode=charger");
                 if (EFI_ERROR(ret))
                         goto out;
         }
@@ -937,32 +1262,31 @@ static EFI_STATUS setup_command_line(
                 goto out;
         }
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.bootreason=%s", bootreason);
+        ret = cmdline_add(L"androidboot.bootreason=%s", bootreason);
         if (EFI_ERROR(ret))
                 goto out;
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.verifiedbootstate=%s",
-                                   boot_state_to_string(boot_state));
+        ret = cmdline_add(L"androidboot.verifiedbootstate=%s",
+                          boot_state_to_string(boot_state));
         if (EFI_ERROR(ret))
                 goto out;
 
         if (swap_guid) {
-                ret = prepend_command_line(&cmdline16, L"resume=PARTUUID=%g",
-                        swap_guid);
+                ret = cmdline_add(L"resume=PARTUUID=%g", swap_guid);
                 if (EFI_ERROR(ret))
                         goto out;
         }
 
         serialport = get_serial_port();
         if (serialport) {
-                ret = prepend_command_line(&cmdline16, L"console=%s", serialport);
+                ret = cmdline_add(L"console=%s", serialport);
                 if (EFI_ERROR(ret))
                         goto out;
         }
 
 #ifndef USER
         if (get_disable_watchdog()) {
-                ret = prepend_command_line(&cmdline16, CONVERT_TO_WIDE(TCO_OPT_DISABLED));
+                ret = cmdline_add(CONVERT_TO_WIDE(TCO_OPT_DISABLED));
                 if (EFI_ERROR(ret))
                         goto out;
         }
@@ -970,59 +1294,65 @@ static EFI_STATUS setup_command_line(
 
         PCI_DEVICE_PATH *boot_device = get_boot_device();
         if (boot_device) {
-                ret = prepend_command_line(&cmdline16,
-                                           L"androidboot.diskbus=%02x.%x",
-                                           boot_device->Device,
-                                           boot_device->Function);
+                ret = cmdline_add(L"androidboot.diskbus=%02x.%x",
+                                  boot_device->Device,
+                                  boot_device->Function);
                 if (EFI_ERROR(ret))
                         goto out;
         } else
                 error(L"Boot device not found, diskbus parameter not set in the commandline!");
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.bootloader=%a",
-                                   get_property_bootloader());
+        ret = cmdline_add(L"androidboot.bootloader=%a",
+                          get_property_bootloader());
         if (EFI_ERROR(ret))
                 goto out;
 
 #ifdef HAL_AUTODETECT
-        ret = prepend_command_line(&cmdline16, L"androidboot.brand=%a "
-                                   "androidboot.name=%a androidboot.device=%a "
-                                   "androidboot.model=%a", get_property_brand(),
-                                   get_property_name(), get_property_device(),
-                                   get_property_model());
+        ret = cmdline_add(L"androidboot.brand=%a "
+                          "androidboot.name=%a androidboot.device=%a "
+                          "androidboot.model=%a", get_property_brand(),
+                          get_property_name(), get_property_device(),
+                          get_property_model());
         if (EFI_ERROR(ret))
                 goto out;
 
-        ret = add_bootvars(bootimage, &cmdline16);
+        ret = add_bootvars(bootimage);
         if (EFI_ERROR(ret))
                 goto out;
 #endif
 
+        /* The timeline is only informative, it is added last and
+         * omitted if the kernel command line cannot take it.  */
+        timestamp_record("setup_command_line");
+        timeline = timestamp_timeline();
+        if (timeline) {
+                len = cmdline_length(cmdline16) + 1 +
+                        StrLen(L"androidboot.boot_timeline=") + StrLen(timeline);
+                if (len <= buf->hdr.cmdline_size) {
+                        ret = cmdline_add(L"androidboot.boot_timeline=%s",
+                                          timeline);
+                        if (EFI_ERROR(ret))
+                                goto out;
+                } else
+                        debug(L"Boot timeline omitted, the command line is too long");
+        }
+
         /* Documentation/x86/boot.txt: "The kernel command line can be located
          * anywhere between the end of the setup heap and 0xA0000" */
-        cmdline_addr = 0xA0000;
-        cmdlen = StrLen(cmdline16);
-        ret = allocate_pages(AllocateMaxAddress, EfiLoaderData,
-                             EFI_SIZE_TO_PAGES(cmdlen + 1),
-                             &cmdline_addr);
+        ret = cmdline_build(cmdline16, 0xA0000, &cmdline);
         if (EFI_ERROR(ret))
                 goto out;
 
-        cmdline = (CHAR8 *)(UINTN)cmdline_addr;
-        ret = str_to_stra(cmdline, cmdline16, cmdlen + 1);
-        if (EFI_ERROR(ret)) {
-                error(L"Non-ascii characters in command line");
-                free_pages(cmdline_addr, EFI_SIZE_TO_PAGES(cmdlen + 1));
-                goto out;
-        }
-
         buf->hdr.cmd_line_ptr = (UINT32)(UINTN)cmdline;
         ret = EFI_SUCCESS;
 out:
-        FreePool(cmdline16);
-        FreePool(bootreason);
+        bump_free(cmdline16);
+        bump_free(bootreason);
         if (serialport)
                 FreePool(serialport);
+        if (timeline)
+                FreePool(timeline);
+        bump_release(mark);
 
         return ret;
 }
@@ -1049,12 +1379,32 @@ static void setup_screen_info_from_gop(struct screen_info *pinfo)
         pinfo->lfb_linelength = gop->Mode->Info->PixelsPerScanLine * 4;
 }
 
+static EFI_STATUS allocate_kernel(struct boot_params *buf,
+                                  EFI_PHYSICAL_ADDRESS *kernel_start)
+{
+        EFI_STATUS ret;
+
+        *kernel_start = buf->hdr.pref_address;
+        ret = allocate_pages(AllocateAddress, EfiLoaderData,
+                             EFI_SIZE_TO_PAGES(buf->hdr.init_size),
+                             kernel_start);
+        if (EFI_ERROR(ret)) {
+                /*
+                 * We failed to allocate the preferred address, so
+                 * just allocate some memory and hope for the best.
+                 */
+                ret = emalloc(buf->hdr.init_size, buf->hdr.kernel_alignment,
+                              kernel_start);
+        }
+
+        return ret;
+}
+
 static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
 {
         EFI_PHYSICAL_ADDRESS kernel_start;
         EFI_PHYSICAL_ADDRESS boot_addr;
         struct boot_params *boot_params;
-        UINT64 init_size;
         EFI_STATUS ret;
         struct boot_img_hdr *aosp_header;
         struct boot_params *buf;
@@ -1071,30 +1421,27 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
         setup_sectors++; /* Add boot sector */
         setup_size = (UINT32)setup_sectors * 512;
         ksize = aosp_header->kernel_size - setup_size;
-        kernel_start = buf->hdr.pref_address;
-        init_size = buf->hdr.init_size;
         buf->hdr.loader_id = 0x1;
         memset(&buf->screen_info, 0x0, sizeof(buf->screen_info));
 
         setup_screen_info_from_gop(&buf->screen_info);
 
-        ret = allocate_pages(AllocateAddress, EfiLoaderData,
-                             EFI_SIZE_TO_PAGES(init_size), &kernel_start);
-        if (EFI_ERROR(ret)) {
-                /*
-                 * We failed to allocate the preferred address, so
-                 * just allocate some memory and hope for the best.
-                 */
-                ret = emalloc(init_size, buf->hdr.kernel_alignment, &kernel_start);
+        if (bootimage == preloaded.bootimage)
+                kernel_start = preloaded.kernel_start;
+        else {
+                ret = allocate_kernel(buf, &kernel_start);
                 if (EFI_ERROR(ret))
                         return ret;
-        }
 
-        memcpy((CHAR8 *)(UINTN)kernel_start, bootimage + koffset + setup_size, ksize);
+                memcpy((CHAR8 *)(UINTN)kernel_start,
+                       bootimage + koffset + setup_size, ksize);
+        }
 
         boot_addr = 0x3fffffff;
-        ret = allocate_pages(AllocateMaxAddress, EfiLoaderData,
-                             EFI_SIZE_TO_PAGES(16384), &boot_addr);
+        ret = allocate_pages(can_be_loaded_above_4g(buf) ?
+                             AllocateAnyPages : AllocateMaxAddress,
+                             EfiLoaderData, EFI_SIZE_TO_PAGES(16384),
+                             &boot_addr);
         if (EFI_ERROR(ret))
                 goto out;
 
@@ -1110,12 +1457,22 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
         ui_free();
 
         log_flush_to_var(FALSE);
+        timestamp_record("handover_kernel");
+        timestamp_bench_record();
+        timestamp_save();
 
         boot_params = (struct boot_params *)(UINTN)boot_addr;
         memset(boot_params, 0x0, 16384);
 
-        /* Copy first two sectors to boot_params */
-        memcpy(boot_params, (CHAR8 *)buf, 2 * 512);
+        /* Only the setup header, which ends at 0x202 plus the jump
+         * offset, is copied: the rest of the boot sector is code and
+         * would make the kernel discard the ext_* fields.  */
+        boot_params->screen_info = buf->screen_info;
+        boot_params->ext_ramdisk_image = buf->ext_ramdisk_image;
+        boot_params->ext_ramdisk_size = buf->ext_ramdisk_size;
+        memcpy(&boot_params->hdr, &buf->hdr,
+               min(0x202 + (buf->hdr.jump >> 8), 2 * 512) -
+               offsetof(struct boot_params, hdr));
         boot_params->hdr.code32_start = (UINT32)((UINT64)kernel_start);
 
         ret = handover_jump(parent_image, boot_params, kernel_start);
@@ -1124,21 +1481,378 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
 
         free_pages(boot_addr, EFI_SIZE_TO_PAGES(16384));
 out:
-        efree(kernel_start, ksize);
+        /* The preloaded kernel is released with the ramdisk */
+        if (bootimage != preloaded.bootimage)
+                efree(kernel_start, ksize);
+        return ret;
+}
+
+static EFI_STATUS read_bootimage_range(struct gpt_partition_interface *gpart,
+                                       UINT64 offset, UINTN size, VOID *dest)
+{
+        EFI_STATUS ret;
+        UINT64 partition_start;
+
+        if (!size)
+                return EFI_SUCCESS;
+
+        partition_start = gpart->part.starting_lba * gpart->bio->Media->BlockSize;
+        ret = uefi_call_wrapper(gpart->dio->ReadDisk, 5, gpart->dio,
+                                gpart->bio->Media->MediaId,
+                                partition_start + offset, size, dest);
+        if (EFI_ERROR(ret))
+                efi_perror(ret, L"ReadDisk");
+
+        return ret;
+}
+
+/* Read a boot image range and feed the streaming hash with it */
+static EFI_STATUS read_hashed_range(struct gpt_partition_interface *gpart,
+                                    UINT64 offset, UINTN size, VOID *dest)
+{
+        EFI_STATUS ret;
+
+        ret = read_bootimage_range(gpart, offset, size, dest);
+        if (!EFI_ERROR(ret))
+                bootimage_hash_update(dest, size);
+
+        return ret;
+}
+
+/* The kernel and the ramdisk are read in chunks: with Block IO2, the
+ * next chunk is read while the previous one is hashed.  */
+#define BOOTIMAGE_CHUNK_SIZE (4 * 1024 * 1024)
+
+static EFI_STATUS read_hashed_piece(struct gpt_partition_interface *gpart,
+                                    async_reader_t *aio, UINT64 offset,
+                                    UINTN size, UINT8 *dest)
+{
+        UINT32 block_size = gpart->bio->Media->BlockSize;
+        UINT32 io_align = gpart->bio->Media->IoAlign;
+        UINT64 start = ALIGN(offset, block_size);
+        UINT64 end = ALIGN_DOWN(offset + size, block_size);
+        UINT64 cur, len, prev_len = 0;
+        UINT8 *prev = NULL;
+        EFI_STATUS ret;
+
+        if (!aio || end <= start ||
+            (io_align > 1 && (UINTN)(dest + start - offset) % io_align))
+                return read_hashed_range(gpart, offset, size, dest);
+
+        /* Unaligned head */
+        ret = read_hashed_range(gpart, offset, start - offset, dest);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        for (cur = start; cur < end; cur += len) {
+                len = min(end - cur, (UINT64)BOOTIMAGE_CHUNK_SIZE);
+                ret = async_read_blocks(aio, gpart->part.starting_lba +
+                                        cur / block_size, len,
+                                        dest + cur - offset);
+                if (EFI_ERROR(ret))
+                        return ret;
+
+                if (prev)
+                        bootimage_hash_update(prev, prev_len);
+
+                ret = async_read_wait(aio);
+                if (EFI_ERROR(ret)) {
+                        efi_perror(ret, L"Failed to read boot image blocks");
+                        return ret;
+                }
+
+                prev = dest + cur - offset;
+                prev_len = len;
+        }
+        bootimage_hash_update(prev, prev_len);
+
+        /* Unaligned tail */
+        return read_hashed_range(gpart, end, offset + size - end,
+                                 dest + end - offset);
+}
+
+/* Size of the setup sectors of a kernel which can be loaded at its
+ * final location, 0 if it cannot.  */
+static UINT32 relocatable_setup_size(struct boot_img_hdr *hdr,
+                                     struct boot_params *buf)
+{
+        UINT32 setup_size;
+
+        if (buf->hdr.signature != 0xAA55 || buf->hdr.header != SETUP_HDR ||
+            buf->hdr.version < 0x20c || !buf->hdr.relocatable_kernel)
+                return 0;
+
+        setup_size = ((UINT32)buf->hdr.setup_secs + 1) * 512;
+        if (setup_size >= hdr->kernel_size)
+                return 0;
+
+        return setup_size;
+}
+
+/* Read the boot image in BOOTIMAGE except for the kernel and the
+ * ramdisk which are read directly at the location they are booted
+ * from.  It saves two copies of the largest part of the image.  This
+ * is only done for a bzImage kernel android_image_start_buffer()
+ * accepts, one boot image at a time.
+ *
+ * The signature block is read first so that the image is hashed in
+ * order while it is read, see bootimage_hash_start().  */
+static EFI_STATUS preload_bootimage(struct gpt_partition_interface *gpart,
+                                    UINT8 *bootimage, UINTN img_size)
+{
+        struct boot_img_hdr *hdr = (struct boot_img_hdr *)bootimage;
+        struct boot_params *buf;
+        EFI_PHYSICAL_ADDRESS kernel_start, ramdisk_start = 0;
+        UINT32 koffset, roffset, kend, rend, setup_size, ksize, rsize;
+        UINTN imgsize;
+        async_reader_t *aio = NULL;
+        EFI_STATUS ret;
+
+        if (preloaded.bootimage)
+                return EFI_UNSUPPORTED;
+
+        koffset = hdr->page_size;
+        if (hdr->kernel_size < 2 * 512)
+                return EFI_UNSUPPORTED;
+
+        /* Boot image header and boot sectors */
+        ret = read_bootimage_range(gpart, 0, koffset + 2 * 512, bootimage);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        buf = (struct boot_params *)(bootimage + koffset);
+        setup_size = relocatable_setup_size(hdr, buf);
+        if (!setup_size)
+                return EFI_UNSUPPORTED;
+
+        ret = read_bootimage_range(gpart, koffset + 2 * 512, setup_size - 2 * 512,
+                                   bootimage + koffset + 2 * 512);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        ksize = hdr->kernel_size - setup_size;
+        kend = koffset + hdr->kernel_size;
+        roffset = koffset + pagealign(hdr, hdr->kernel_size);
+        rsize = hdr->ramdisk_size;
+        rend = roffset + rsize;
+        imgsize = bootimage_size(hdr);
+
+        /* Signature block */
+        ret = read_bootimage_range(gpart, imgsize, img_size - imgsize,
+                                   bootimage + imgsize);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        ret = bootimage_hash_start(bootimage, bootimage + imgsize);
+        if (EFI_ERROR(ret))
+                debug(L"Boot image is not hashed while it is read");
+        bootimage_hash_update(bootimage, koffset + setup_size);
+
+        ret = async_read_open(gpart->bio, &aio);
+        if (EFI_ERROR(ret))
+                aio = NULL;
+
+        ret = allocate_kernel(buf, &kernel_start);
+        if (EFI_ERROR(ret))
+                goto out;
+
+        ret = read_hashed_piece(gpart, aio, koffset + setup_size, ksize,
+                                (UINT8 *)(UINTN)kernel_start);
+        if (EFI_ERROR(ret))
+                goto free_kernel;
+
+        ret = read_hashed_range(gpart, kend, roffset - kend, bootimage + kend);
+        if (EFI_ERROR(ret))
+                goto free_kernel;
+
+        if (rsize) {
+                ret = allocate_ramdisk(buf, rsize, &ramdisk_start);
+                if (EFI_ERROR(ret))
+                        goto free_kernel;
+
+                ret = read_hashed_piece(gpart, aio, roffset, rsize,
+                                        (UINT8 *)(UINTN)ramdisk_start);
+                if (EFI_ERROR(ret))
+                        goto free_ramdisk;
+        }
+
+        /* Ramdisk padding and second stage */
+        ret = read_hashed_range(gpart, rend, imgsize - rend, bootimage + rend);
+        if (EFI_ERROR(ret))
+                goto free_ramdisk;
+
+        bootimage_hash_end();
+        if (aio)
+                async_read_close(aio);
+
+        preloaded.bootimage = bootimage;
+        preloaded.koffset = koffset + setup_size;
+        preloaded.ksize = ksize;
+        preloaded.kernel_start = kernel_start;
+        preloaded.kernel_alloc_size = buf->hdr.init_size;
+        preloaded.roffset = roffset;
+        preloaded.rsize = rsize;
+        preloaded.ramdisk_start = ramdisk_start;
+
+        return EFI_SUCCESS;
+
+free_ramdisk:
+        if (rsize)
+                efree(ramdisk_start, rsize);
+free_kernel:
+        efree(kernel_start, buf->hdr.init_size);
+out:
+        if (aio)
+                async_read_close(aio);
+        bootimage_hash_abort();
         return ret;
 }
 
+EFI_STATUS android_image_place(VOID *bootimage, UINTN size, UINTN received,
+                               UINTN *need)
+{
+        struct boot_img_hdr *hdr = bootimage;
+        struct boot_params *buf;
+        EFI_PHYSICAL_ADDRESS kernel_start, ramdisk_start = 0;
+        UINT32 koffset, setup_size;
+        EFI_STATUS ret;
+
+        if (preloaded.bootimage)
+                return EFI_UNSUPPORTED;
+
+        if (received < sizeof(*hdr)) {
+                *need = sizeof(*hdr);
+                return EFI_NOT_READY;
+        }
+
+        if (!get_bootimage_header(bootimage) || hdr->page_size < 2048 ||
+            (hdr->page_size & (hdr->page_size - 1)) ||
+            hdr->kernel_size < 2 * 512 || bootimage_size(hdr) > size)
+                return EFI_UNSUPPORTED;
+
+        koffset = hdr->page_size;
+        if (received < koffset + 2 * 512) {
+                *need = koffset + 2 * 512;
+                return EFI_NOT_READY;
+        }
+
+        buf = (struct boot_params *)((UINT8 *)bootimage + koffset);
+        setup_size = relocatable_setup_size(hdr, buf);
+        if (!setup_size)
+                return EFI_UNSUPPORTED;
+
+        if (received < koffset + setup_size) {
+                *need = koffset + setup_size;
+                return EFI_NOT_READY;
+        }
+        if (received > koffset + setup_size)
+                return EFI_UNSUPPORTED;
+
+        ret = allocate_kernel(buf, &kernel_start);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        if (hdr->ramdisk_size) {
+                ret = allocate_ramdisk(buf, hdr->ramdisk_size, &ramdisk_start);
+                if (EFI_ERROR(ret)) {
+                        efree(kernel_start, buf->hdr.init_size);
+                        return ret;
+                }
+        }
+
+        preloaded.bootimage = bootimage;
+        preloaded.koffset = koffset + setup_size;
+        preloaded.ksize = hdr->kernel_size - setup_size;
+        preloaded.kernel_start = kernel_start;
+        preloaded.kernel_alloc_size = buf->hdr.init_size;
+        preloaded.roffset = koffset + pagealign(hdr, hdr->kernel_size);
+        preloaded.rsize = hdr->ramdisk_size;
+        preloaded.ramdisk_start = ramdisk_start;
+
+        return EFI_SUCCESS;
+}
+
+VOID *android_image_locate(VOID *bootimage, UINTN offset, UINTN *len)
+{
+        struct {
+                UINTN offset;
+                UINTN size;
+                UINT8 *data;
+        } holes[2];
+        UINTN i;
+
+        if (bootimage != preloaded.bootimage)
+                return (UINT8 *)bootimage + offset;
+
+        holes[0].offset = preloaded.koffset;
+        holes[0].size = preloaded.ksize;
+        holes[0].data = (UINT8 *)(UINTN)preloaded.kernel_start;
+        holes[1].offset = preloaded.roffset;
+        holes[1].size = preloaded.rsize;
+        holes[1].data = (UINT8 *)(UINTN)preloaded.ramdisk_start;
+
+        for (i = 0; i < ARRAY_SIZE(holes); i++) {
+                if (!holes[i].size)
+                        continue;
+                if (offset < holes[i].offset) {
+                        *len = min(*len, holes[i].offset - offset);
+                        break;
+                }
+                if (offset < holes[i].offset + holes[i].size) {
+                        *len = min(*len, holes[i].offset + holes[i].size - offset);
+                        return holes[i].data + offset - holes[i].offset;
+                }
+        }
+
+        return (UINT8 *)bootimage + offset;
+}
+
+void android_image_unplace(VOID *bootimage, BOOLEAN flatten)
+{
+        if (!bootimage || bootimage != preloaded.bootimage)
+                return;
+
+        if (flatten) {
+                memcpy((UINT8 *)bootimage + preloaded.koffset,
+                       (VOID *)(UINTN)preloaded.kernel_start, preloaded.ksize);
+                if (preloaded.rsize)
+                        memcpy((UINT8 *)bootimage + preloaded.roffset,
+                               (VOID *)(UINTN)preloaded.ramdisk_start,
+                               preloaded.rsize);
+        }
+
+        release_preloaded();
+}
+
+void android_image_move(VOID *from, VOID *to, UINTN size)
+{
+        struct bootimage_piece pieces[BOOTIMAGE_MAX_PIECES];
+        UINTN i, n, offset = 0;
+
+        if (from != preloaded.bootimage) {
+                memcpy(to, from, size);
+                return;
+        }
+
+        /* Only the pieces in the boot image buffer itself */
+        n = bootimage_pieces(from, size, pieces);
+        for (i = 0; i < n; offset += pieces[i++].size)
+                if (pieces[i].data == (UINT8 *)from + offset)
+                        memcpy((UINT8 *)to + offset, pieces[i].data,
+                               pieces[i].size);
+
+        preloaded.bootimage = to;
+}
+
 EFI_STATUS android_image_load_partition(
                 IN const CHAR16 *label,
                 OUT VOID **bootimage_p)
 {
-        UINT32 MediaId;
         UINT32 img_size;
         VOID *bootimage;
         EFI_STATUS ret;
         struct boot_img_hdr aosp_header;
         struct gpt_partition_interface gpart;
-        UINTN partition_start;
 
         *bootimage_p = NULL;
         ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
@@ -1146,17 +1860,11 @@ EFI_STATUS android_image_load_partition(
                 debug(L"Partition %s not found", label);
                 return ret;
         }
-        MediaId = gpart.bio->Media->MediaId;
-        partition_start = gpart.part.starting_lba * gpart.bio->Media->BlockSize;
 
         debug(L"Reading boot image header");
-        ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId,
-                                partition_start,
-                                sizeof(aosp_header), &aosp_header);
-        if (EFI_ERROR(ret)) {
-                efi_perror(ret, L"ReadDisk (header)");
+        ret = read_bootimage_range(&gpart, 0, sizeof(aosp_header), &aosp_header);
+        if (EFI_ERROR(ret))
                 return ret;
-        }
         if (strncmpa((CHAR8 *)BOOT_MAGIC, aosp_header.magic, BOOT_MAGIC_SIZE)) {
                 error(L"This partition does not appear to contain an Android boot image");
                 return EFI_INVALID_PARAMETER;
@@ -1167,19 +1875,33 @@ EFI_STATUS android_image_load_partition(
         if (!bootimage)
                 return EFI_OUT_OF_RESOURCES;
 
+        ret = preload_bootimage(&gpart, bootimage, img_size);
+        if (!EFI_ERROR(ret)) {
+                debug(L"Read boot image with in place kernel and ramdisk");
+                timestamp_record("image_read");
+                *bootimage_p = bootimage;
+                return EFI_SUCCESS;
+        }
+
         debug(L"Reading full boot image (%d bytes)", img_size);
-        ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId, partition_start,
-                                img_size, bootimage);
+        ret = read_bootimage_range(&gpart, 0, img_size, bootimage);
         if (EFI_ERROR(ret)) {
-                efi_perror(ret, L"ReadDisk");
                 FreePool(bootimage);
                 return ret;
         }
 
+        timestamp_record("image_read");
         *bootimage_p = bootimage;
         return EFI_SUCCESS;
 }
 
+void android_image_free(VOID *bootimage)
+{
+        if (bootimage && bootimage == preloaded.bootimage)
+                release_preloaded();
+        FreePool(bootimage);
+}
+
 
 EFI_STATUS android_image_load_file(
                 IN EFI_HANDLE device,
@@ -1376,9 +2098,11 @@ EFI_STATUS android_image_start_buffer(
         ret = handover_kernel(bootimage, parent_image);
         efi_perror(ret, L"handover_kernel");
 
-        efree(buf->hdr.ramdisk_start, buf->hdr.ramdisk_len);
-        buf->hdr.ramdisk_start = 0;
-        buf->hdr.ramdisk_len = 0;
+        if (bootimage == preloaded.bootimage)
+                release_preloaded();
+        else
+                efree(get_ramdisk(buf), buf->hdr.ramdisk_len);
+        set_ramdisk(buf, 0, 0);
 out_cmdline:
         free_pages(buf->hdr.cmd_line_ptr,
                         strlena((CHAR8 *)(UINTN)buf->hdr.cmd_line_ptr) + 1);
@@ -1404,6 +2128,17 @@ VOID dump_bcb(IN struct bootloader_message *bcb)
 #define dump_bcb(b) (void)0
 #endif
 
+/* The BCB read from the disk is kept until the next write_bcb() so
+ * that only the sectors which changed are written, if any.  The
+ * snapshot is the raw content, before read_bcb() terminates the
+ * strings.  */
+static struct {
+        BOOLEAN valid;
+        UINT64 offset;
+        UINT32 media_id;
+        struct bootloader_message data;
+} bcb_snapshot;
+
 EFI_STATUS read_bcb(
                 IN const CHAR16 *label,
                 OUT struct bootloader_message *bcb)
@@ -1412,6 +2147,8 @@ EFI_STATUS read_bcb(
         struct gpt_partition_interface gpart;
         UINTN partition_start;
 
+        bcb_snapshot.valid = FALSE;
+
         debug(L"Locating BCB");
         ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
         if (EFI_ERROR(ret))
@@ -1426,6 +2163,12 @@ EFI_STATUS read_bcb(
                 efi_perror(ret, L"ReadDisk (bcb)");
                 return ret;
         }
+
+        memcpy(&bcb_snapshot.data, bcb, sizeof(bcb_snapshot.data));
+        bcb_snapshot.offset = partition_start;
+        bcb_snapshot.media_id = gpart.bio->Media->MediaId;
+        bcb_snapshot.valid = TRUE;
+
         bcb->command[31] = '\0';
         bcb->status[31] = '\0';
         dump_bcb(bcb);
@@ -1433,7 +2176,31 @@ EFI_STATUS read_bcb(
         return EFI_SUCCESS;
 }
 
+static EFI_STATUS write_bcb_sectors(
+                IN struct gpt_partition_interface *gpart,
+                IN UINTN partition_start,
+                IN struct bootloader_message *bcb)
+{
+        EFI_STATUS ret;
+        UINTN sector = gpart->bio->Media->BlockSize;
+        UINTN offset, size;
+        CHAR8 *new = (CHAR8 *)bcb, *old = (CHAR8 *)&bcb_snapshot.data;
 
+        for (offset = 0; offset < sizeof(*bcb); offset += size) {
+                size = min(sector, sizeof(*bcb) - offset);
+                if (!memcmp(new + offset, old + offset, size))
+                        continue;
+
+                ret = uefi_call_wrapper(gpart->dio->WriteDisk, 5, gpart->dio,
+                                        gpart->bio->Media->MediaId,
+                                        partition_start + offset, size,
+                                        new + offset);
+                if (EFI_ERROR(ret))
+                        return ret;
+        }
+
+        return EFI_SUCCESS;
+}
 
 EFI_STATUS write_bcb(
                 IN const CHAR16 *label,
@@ -1442,6 +2209,10 @@ EFI_STATUS write_bcb(
         EFI_STATUS ret;
         struct gpt_partition_interface gpart;
         UINTN partition_start;
+        BOOLEAN incremental;
+
+        incremental = bcb_snapshot.valid;
+        bcb_snapshot.valid = FALSE;
 
         debug(L"Locating BCB");
         ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
@@ -1449,10 +2220,23 @@ EFI_STATUS write_bcb(
                 return EFI_INVALID_PARAMETER;
         partition_start = gpart.part.starting_lba * gpart.bio->Media->BlockSize;
 
+        if (incremental && (bcb_snapshot.offset != partition_start ||
+                            bcb_snapshot.media_id != gpart.bio->Media->MediaId))
+                incremental = FALSE;
+
+        if (incremental && !memcmp(bcb, &bcb_snapshot.data, sizeof(*bcb))) {
+                debug(L"BCB unchanged");
+                return EFI_SUCCESS;
+        }
+
         debug(L"Writing BCB");
-        ret = uefi_call_wrapper(gpart.dio->WriteDisk, 5, gpart.dio,
-                                gpart.bio->Media->MediaId,
-                                partition_start, sizeof(*bcb), bcb);
+        forget_erased_parts(gpart.part.starting_lba, gpart.part.ending_lba);
+        if (incremental)
+                ret = write_bcb_sectors(&gpart, partition_start, bcb);
+        else
+                ret = uefi_call_wrapper(gpart.dio->WriteDisk, 5, gpart.dio,
+                                        gpart.bio->Media->MediaId,
+                                        partition_start, sizeof(*bcb), bcb);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"WriteDisk (bcb)");
                 return ret;
@@ -1463,40 +2247,112 @@ EFI_STATUS write_bcb(
 }
 
 
+/* The conventional memory is cleared in chunks spread on the
+ * processors by parallel_for().  The chunks are indexes in the
+ * conventional pages of the memory map, taken after every allocation
+ * of this function so that nothing in use is cleared.  */
+#define CLEAR_CHUNK_PAGES       16384ULL        /* 64MiB */
+
+static struct clear_ctx {
+        CHAR8 *map;
+        UINTN nr_entries;
+        UINTN entry_sz;
+        UINT64 total_pages;
+        UINTN reported;
+} clear_ctx;
+
+/* Non-temporal stores do not pollute the caches nor read the lines
+ * they write.  */
+static void clear_pages_nt(EFI_PHYSICAL_ADDRESS start, UINT64 size)
+{
+        UINTN *p = (UINTN *)(UINTN)start;
+        UINTN *end = (UINTN *)(UINTN)(start + size);
+        UINTN zero = 0;
+
+        for (; p < end; p++)
+                asm volatile("movnti %1, %0" : "=m" (*p) : "r" (zero));
+}
+
+/* Work item: no boot service can be used */
+static VOID clear_chunk(VOID *arg, UINTN index)
+{
+        struct clear_ctx *ctx = arg;
+        EFI_MEMORY_DESCRIPTOR *entry;
+        UINT64 base = 0, start, end, first, count;
+        UINTN i;
+
+        first = index * CLEAR_CHUNK_PAGES;
+        count = ctx->total_pages - first;
+        if (count > CLEAR_CHUNK_PAGES)
+                count = CLEAR_CHUNK_PAGES;
+
+        for (i = 0; i < ctx->nr_entries && base < first + count; i++) {
+                entry = (EFI_MEMORY_DESCRIPTOR *)(ctx->map + i * ctx->entry_sz);
+                if (entry->Type != EfiConventionalMemory)
+                        continue;
+
+                start = first > base ? first : base;
+                end = first + count < base + entry->NumberOfPages ?
+                        first + count : base + entry->NumberOfPages;
+                if (start < end)
+                        clear_pages_nt(entry->PhysicalStart +
+                                       (start - base) * EFI_PAGE_SIZE,
+                                       (end - start) * EFI_PAGE_SIZE);
+                base += entry->NumberOfPages;
+        }
+
+        asm volatile("sfence" ::: "memory");
+}
+
+static VOID report_clear_progress(VOID *arg, UINTN done, UINTN count)
+{
+        struct clear_ctx *ctx = arg;
+        UINTN percent = done * 100 / count;
+
+        if (percent >= ctx->reported + 10 || percent == 100) {
+                if (percent != ctx->reported)
+                        debug(L"Memory cleared: %d%%", percent);
+                ctx->reported = percent;
+        }
+}
+
 EFI_STATUS android_clear_memory()
 {
         UINTN nr_entries, key, entry_sz;
         CHAR8 *mem_entries;
         UINT32 entry_ver;
         UINTN i;
-        UINTN counter;
-        CHAR8 *mem_map;
         EFI_TPL OldTpl;
 
+        /* Everything that allocates memory must come before the memory
+         * map */
+        parallel_init();
+
         OldTpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_NOTIFY);
         mem_entries = (CHAR8 *)LibMemoryMap(&nr_entries, &key, &entry_sz, &entry_ver);
         if (!mem_entries) {
                 uefi_call_wrapper(BS->RestoreTPL, 1, OldTpl);
                 return EFI_OUT_OF_RESOURCES;
         }
-        counter = 0;
-        mem_map = mem_entries;
-        for (i = 0; i < nr_entries; mem_entries += entry_sz, i++) {
-                EFI_MEMORY_DESCRIPTOR *entry;
-                UINT64 map_sz;
 
-                entry = (EFI_MEMORY_DESCRIPTOR *)mem_entries;
-                map_sz = entry->NumberOfPages * EFI_PAGE_SIZE;
+        ZeroMem(&clear_ctx, sizeof(clear_ctx));
+        clear_ctx.map = mem_entries;
+        clear_ctx.nr_entries = nr_entries;
+        clear_ctx.entry_sz = entry_sz;
+        for (i = 0; i < nr_entries; i++) {
+                EFI_MEMORY_DESCRIPTOR *entry;
 
-                if (entry->Type == EfiConventionalMemory) {
-                        uefi_call_wrapper(BS->SetMem, 3, (void *) (UINTN)entry->PhysicalStart, map_sz, 0);
-                        counter += entry->NumberOfPages;
-                }
+                entry = (EFI_MEMORY_DESCRIPTOR *)(mem_entries + i * entry_sz);
+                if (entry->Type == EfiConventionalMemory)
+                        clear_ctx.total_pages += entry->NumberOfPages;
         }
+
+        parallel_for(DIV_ROUND_UP(clear_ctx.total_pages, CLEAR_CHUNK_PAGES),
+                     clear_chunk, report_clear_progress, &clear_ctx);
         uefi_call_wrapper(BS->RestoreTPL, 1, OldTpl);
 
-        FreePool((void *)mem_map);
-        return EFI_SUCCESS;
+        FreePool((void *)mem_entries);
+        return parallel_exit();
 }
 
 /* vim: softtabstop=8:shiftwidth=8:expandtab
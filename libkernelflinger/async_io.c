@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "async_io.h"
+#include "protocol/BlockIo2.h"
+
+/* Size of the buffers used for the writes that need a copy */
+#define ASYNC_IO_BUFFER_SIZE (1024 * 1024)
+
+struct request {
+	EFI_BLOCK_IO2_TOKEN token;
+	BOOLEAN busy;
+	VOID *free_addr;
+	CHAR8 *buf;
+};
+
+struct writer {
+	EFI_BLOCK_IO *bio;
+	EFI_BLOCK_IO2_PROTOCOL *bio2;
+	UINTN depth;
+	UINTN next;
+	EFI_STATUS status;
+	struct request requests[ASYNC_IO_DEPTH];
+};
+
+/* The active writer and the detached ones which complete their
+   writes in the background.  A slot is free when its BIO is NULL.  */
+static struct writer writers[ASYNC_IO_WRITERS];
+static struct writer *writer = &writers[0];
+
+/* Submissions that had to wait for a request in flight */
+static UINT64 stalls;
+
+static EFI_BLOCK_IO2_PROTOCOL *get_block_io2(EFI_BLOCK_IO *bio)
+{
+	EFI_GUID BlockIo2ProtocolGuid = EFI_BLOCK_IO2_PROTOCOL_GUID;
+	EFI_BLOCK_IO2_PROTOCOL *bio2 = NULL;
+	EFI_HANDLE *handles;
+	EFI_BLOCK_IO *cur;
+	UINTN i, nb_handle;
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(BS->LocateHandleBuffer, 5, ByProtocol,
+				&BlockIoProtocol, NULL, &nb_handle, &handles);
+	if (EFI_ERROR(ret))
+		return NULL;
+
+	for (i = 0; i < nb_handle; i++) {
+		ret = uefi_call_wrapper(BS->HandleProtocol, 3, handles[i],
+					&BlockIoProtocol, (VOID **)&cur);
+		if (EFI_ERROR(ret) || cur != bio)
+			continue;
+		ret = uefi_call_wrapper(BS->HandleProtocol, 3, handles[i],
+					&BlockIo2ProtocolGuid, (VOID **)&bio2);
+		if (EFI_ERROR(ret))
+			bio2 = NULL;
+		break;
+	}
+
+	FreePool(handles);
+	return bio2;
+}
+
+static void complete(struct writer *w, struct request *req)
+{
+	UINTN index;
+
+	if (!req->busy)
+		return;
+
+	uefi_call_wrapper(BS->WaitForEvent, 3, 1, &req->token.Event, &index);
+	req->busy = FALSE;
+	if (EFI_ERROR(req->token.TransactionStatus) && !EFI_ERROR(w->status)) {
+		efi_perror(req->token.TransactionStatus, L"Asynchronous write failed");
+		w->status = req->token.TransactionStatus;
+	}
+}
+
+static EFI_STATUS writer_sync(struct writer *w)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(w->requests); i++)
+		complete(w, &w->requests[i]);
+
+	return w->status;
+}
+
+static EFI_STATUS writer_close(struct writer *w)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	ret = writer_sync(w);
+
+	for (i = 0; i < ARRAY_SIZE(w->requests); i++) {
+		if (w->requests[i].token.Event)
+			uefi_call_wrapper(BS->CloseEvent, 1, w->requests[i].token.Event);
+		if (w->requests[i].free_addr)
+			FreePool(w->requests[i].free_addr);
+	}
+	ZeroMem(w, sizeof(*w));
+
+	return ret;
+}
+
+EFI_STATUS async_write_open(EFI_BLOCK_IO *bio)
+{
+	return async_write_open_depth(bio, ASYNC_IO_DEPTH);
+}
+
+EFI_STATUS async_write_open_depth(EFI_BLOCK_IO *bio, UINTN depth)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	if (depth == 0 || depth > ASYNC_IO_DEPTH)
+		return EFI_INVALID_PARAMETER;
+
+	async_write_close();
+
+	/* The writes of a detached writer on the same device must
+	   complete first to keep them ordered.  */
+	for (i = 0; i < ARRAY_SIZE(writers); i++)
+		if (&writers[i] != writer && writers[i].bio == bio) {
+			ret = writer_close(&writers[i]);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+
+	writer->bio = bio;
+	writer->bio2 = get_block_io2(bio);
+	writer->depth = depth;
+	writer->status = EFI_SUCCESS;
+	writer->next = 0;
+	if (!writer->bio2) {
+		debug(L"Block IO2 not supported, using synchronous writes");
+		return EFI_SUCCESS;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(writer->requests); i++) {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+					&writer->requests[i].token.Event);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create block io event");
+			async_write_close();
+			writer->bio = bio;
+			return EFI_SUCCESS;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+BOOLEAN async_write_active(EFI_BLOCK_IO *bio)
+{
+	return bio == writer->bio && writer->bio2;
+}
+
+BOOLEAN async_write_opened(void)
+{
+	return writer->bio != NULL;
+}
+
+UINT64 async_write_stalls(void)
+{
+	return stalls;
+}
+
+static EFI_STATUS submit(EFI_LBA lba, UINTN size, VOID *data, BOOLEAN copy)
+{
+	struct request *req = &writer->requests[writer->next];
+	EFI_STATUS ret;
+
+	if (req->busy)
+		stalls++;
+	complete(writer, req);
+	if (EFI_ERROR(writer->status))
+		return writer->status;
+
+	if (copy) {
+		if (!req->buf) {
+			ret = alloc_aligned(&req->free_addr, (VOID **)&req->buf,
+					    ASYNC_IO_BUFFER_SIZE,
+					    writer->bio->Media->IoAlign);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+		memcpy(req->buf, data, size);
+		data = req->buf;
+	}
+
+	req->token.TransactionStatus = EFI_SUCCESS;
+	ret = uefi_call_wrapper(writer->bio2->WriteBlocksEx, 6, writer->bio2,
+				writer->bio->Media->MediaId, lba, &req->token,
+				size, data);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to submit write at lba %ld", lba);
+		return ret;
+	}
+
+	req->busy = TRUE;
+	writer->next = (writer->next + 1) % writer->depth;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS async_write_blocks(EFI_BLOCK_IO *bio, EFI_LBA lba, UINTN size,
+			      VOID *data, BOOLEAN copy)
+{
+	EFI_STATUS ret;
+	UINTN len;
+	CHAR8 *s = data;
+
+	if (!async_write_active(bio))
+		return uefi_call_wrapper(bio->WriteBlocks, 5, bio, bio->Media->MediaId,
+					 lba, size, data);
+
+	if (!copy)
+		return submit(lba, size, data, FALSE);
+
+	for (; size; size -= len, s += len, lba += len / bio->Media->BlockSize) {
+		len = min(size, (UINTN)ASYNC_IO_BUFFER_SIZE);
+		ret = submit(lba, len, s, TRUE);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS async_write_sync(void)
+{
+	return writer_sync(writer);
+}
+
+EFI_STATUS async_write_close(void)
+{
+	return writer_close(writer);
+}
+
+EFI_STATUS async_write_detach(void)
+{
+	UINTN i;
+
+	if (!writer->bio2)
+		return async_write_close();
+
+	if (EFI_ERROR(writer->status))
+		return async_write_close();
+
+	for (i = 0; i < ARRAY_SIZE(writers); i++)
+		if (!writers[i].bio) {
+			writer = &writers[i];
+			return EFI_SUCCESS;
+		}
+
+	return async_write_close();
+}
+
+EFI_STATUS async_write_join(void)
+{
+	EFI_STATUS ret = EFI_SUCCESS, ret_close;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(writers); i++) {
+		if (&writers[i] == writer || !writers[i].bio)
+			continue;
+		ret_close = writer_close(&writers[i]);
+		if (!EFI_ERROR(ret))
+			ret = ret_close;
+	}
+
+	return ret;
+}
+
+struct async_reader {
+	EFI_BLOCK_IO *bio;
+	EFI_BLOCK_IO2_PROTOCOL *bio2;
+	EFI_BLOCK_IO2_TOKEN token;
+	BOOLEAN busy;
+	EFI_STATUS status;
+};
+
+EFI_STATUS async_read_open(EFI_BLOCK_IO *bio, async_reader_t **reader_p)
+{
+	EFI_STATUS ret;
+	async_reader_t *reader;
+
+	if (!bio || !reader_p)
+		return EFI_INVALID_PARAMETER;
+
+	reader = AllocateZeroPool(sizeof(*reader));
+	if (!reader)
+		return EFI_OUT_OF_RESOURCES;
+
+	reader->bio = bio;
+	reader->bio2 = get_block_io2(bio);
+	if (!reader->bio2)
+		debug(L"Block IO2 not supported, using synchronous reads");
+	else {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+					&reader->token.Event);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create block io event");
+			reader->bio2 = NULL;
+		}
+	}
+
+	*reader_p = reader;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS async_read_blocks(async_reader_t *reader, EFI_LBA lba,
+			     UINTN size, VOID *data)
+{
+	EFI_STATUS ret;
+
+	if (!reader || reader->busy)
+		return EFI_NOT_READY;
+
+	if (!reader->bio2) {
+		reader->status = uefi_call_wrapper(reader->bio->ReadBlocks, 5,
+						   reader->bio,
+						   reader->bio->Media->MediaId,
+						   lba, size, data);
+		return EFI_SUCCESS;
+	}
+
+	reader->token.TransactionStatus = EFI_SUCCESS;
+	ret = uefi_call_wrapper(reader->bio2->ReadBlocksEx, 6, reader->bio2,
+				reader->bio->Media->MediaId, lba, &reader->token,
+				size, data);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to submit read at lba %ld", lba);
+		return ret;
+	}
+
+	reader->busy = TRUE;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS async_read_wait(async_reader_t *reader)
+{
+	UINTN index;
+
+	if (!reader)
+		return EFI_INVALID_PARAMETER;
+
+	if (reader->busy) {
+		uefi_call_wrapper(BS->WaitForEvent, 3, 1, &reader->token.Event, &index);
+		reader->busy = FALSE;
+		reader->status = reader->token.TransactionStatus;
+	}
+
+	return reader->status;
+}
+
+void async_read_close(async_reader_t *reader)
+{
+	if (!reader)
+		return;
+
+	async_read_wait(reader);
+	if (reader->token.Event)
+		uefi_call_wrapper(BS->CloseEvent, 1, reader->token.Event);
+	FreePool(reader);
+}
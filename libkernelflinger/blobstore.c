@@ -54,23 +54,79 @@ struct metablock {
 	unsigned int data_size;
 } __attribute__((packed));
 
+struct index_entry {
+	unsigned int hash;	/* hash_key() of blob_key and blob_type */
+	unsigned int blob_type;
+	unsigned int data_offset;
+	unsigned int data_size;
+	char blob_key[BLOB_KEY_LENGTH];
+} __attribute__((packed));
+
 struct blobstore {
 	char magic[8];
 	unsigned int version;
 	unsigned int total_size;
-	unsigned int hashmap_sz;
-	unsigned int hashmap[0]; /* of hashmap_sz */
+	union {
+		/* Version 1 */
+		struct {
+			unsigned int hashmap_sz;
+			unsigned int hashmap[0]; /* of hashmap_sz */
+		} __attribute__((packed));
+		/* Version 2: index entries sorted by increasing hash,
+		 * laid out right after the header so that the header
+		 * and the index can be read without the blobs. */
+		struct {
+			unsigned int index_nb;
+			struct index_entry index[0]; /* of index_nb */
+		} __attribute__((packed));
+	};
 } __attribute__((packed));
 
-unsigned int hash_blob_key(char *key, enum blobtype type, unsigned int hsize)
+static unsigned int hash_key(char *key, enum blobtype type)
 {
 	unsigned int hash_val;
 
 	/* based on libcutils hashmapHash() algorithm */
 	for (hash_val = 0; *key != '\0'; key++)
 		hash_val = hash_val * 31 + *key;
-	hash_val = hash_val * 31 + (unsigned int)type;
-	return hash_val % hsize;
+	return hash_val * 31 + (unsigned int)type;
+}
+
+unsigned int hash_blob_key(char *key, enum blobtype type, unsigned int hsize)
+{
+	return hash_key(key, type) % hsize;
+}
+
+static BOOLEAN index_valid(struct blobstore *bs)
+{
+	return bs->index_nb <= (bs->total_size - sizeof(*bs)) /
+		sizeof(struct index_entry);
+}
+
+/* Binary search of the first entry of HASH and linear scan of the
+ * colliding ones.  */
+static struct index_entry *index_lookup(struct blobstore *bs, char *key,
+					enum blobtype type)
+{
+	unsigned int hash, lo = 0, hi = bs->index_nb, mid;
+	struct index_entry *e;
+
+	hash = hash_key(key, type);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (bs->index[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (e = &bs->index[lo]; e < &bs->index[bs->index_nb] &&
+		     e->hash == hash; e++)
+		if (type == e->blob_type &&
+		    !strncmp((CHAR8 *)key, (CHAR8 *)e->blob_key, BLOB_KEY_LENGTH))
+			return e;
+
+	return NULL;
 }
 
 
@@ -94,14 +150,41 @@ struct blobstore *blobstore_get(void *mem, unsigned int size)
 		return NULL;
 	}
 
-	if (bs->version != 1) {
+	if (bs->version != 1 && bs->version != 2) {
 		error(L"unsupported blobstore version");
 		return NULL;
 	}
 
+	if (bs->version == 2 && !index_valid(bs)) {
+		error(L"bad blobstore index size");
+		return NULL;
+	}
+
 	return bs;
 }
 
+static int get_item_v2(struct blobstore *bs, char *key, enum blobtype type,
+		       void **data, unsigned int *size)
+{
+	struct index_entry *e;
+
+	e = index_lookup(bs, key, type);
+	if (!e) {
+		debug(L"not found in blobstore index");
+		return -2;
+	}
+
+	if (e->data_offset > bs->total_size ||
+	    e->data_size > bs->total_size - e->data_offset) {
+		error(L"bad offset in blobstore index");
+		return -1;
+	}
+
+	*data = (unsigned char *)bs + e->data_offset;
+	*size = e->data_size;
+	return 0;
+}
+
 
 int blobstore_get_item(struct blobstore *bs, char *key, enum blobtype type,
 		       void **data, unsigned int *size)
@@ -111,6 +194,9 @@ int blobstore_get_item(struct blobstore *bs, char *key, enum blobtype type,
 	unsigned int offset;
 	struct metablock *mb;
 
+	if (bs->version == 2)
+		return get_item_v2(bs, key, type, data, size);
+
 	hash = hash_blob_key(key, type, bs->hashmap_sz);
 	offset = bs->hashmap[hash];
 	start = (unsigned char *)bs;
@@ -147,4 +233,3 @@ int blobstore_get_item(struct blobstore *bs, char *key, enum blobtype type,
 	return -2;
 }
 
-
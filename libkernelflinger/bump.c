@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "bump.h"
+
+#define BUMP_SIZE	(64 * 1024)
+#define BUMP_ALIGN	sizeof(UINT64)
+
+static struct {
+	UINT8 area[BUMP_SIZE] __attribute__((aligned(16)));
+	UINTN top;
+	UINTN last;	/* offset of the last allocation */
+} bump;
+
+static BOOLEAN bump_contains(VOID *ptr)
+{
+	return (UINT8 *)ptr >= bump.area && (UINT8 *)ptr < bump.area + BUMP_SIZE;
+}
+
+VOID *bump_alloc(UINTN size)
+{
+	UINTN start = (bump.top + BUMP_ALIGN - 1) & ~(BUMP_ALIGN - 1);
+
+	if (!size || size > BUMP_SIZE - start)
+		return AllocatePool(size ? size : 1);
+
+	bump.last = start;
+	bump.top = start + size;
+	return bump.area + start;
+}
+
+CHAR16 *bump_strdup(const CHAR16 *str)
+{
+	UINTN size = (StrLen(str) + 1) * sizeof(*str);
+	CHAR16 *dup;
+
+	dup = bump_alloc(size);
+	if (dup)
+		memcpy(dup, str, size);
+	return dup;
+}
+
+CHAR16 *bump_stra_to_str(const CHAR8 *stra)
+{
+	UINTN len = strlen(stra), i;
+	CHAR16 *str;
+
+	str = bump_alloc((len + 1) * sizeof(*str));
+	if (!str)
+		return NULL;
+
+	for (i = 0; i <= len; i++)
+		str[i] = stra[i];
+	return str;
+}
+
+void bump_free(VOID *ptr)
+{
+	if (!ptr)
+		return;
+
+	if (!bump_contains(ptr)) {
+		FreePool(ptr);
+		return;
+	}
+
+	/* The last allocation is reclaimed right away, the others when
+	   the area is rewound.  */
+	if ((UINT8 *)ptr == bump.area + bump.last)
+		bump.top = bump.last;
+}
+
+UINTN bump_mark(void)
+{
+	return bump.top;
+}
+
+void bump_release(UINTN mark)
+{
+	if (mark < bump.top)
+		bump.top = bump.last = mark;
+}
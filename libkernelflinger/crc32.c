@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "crc32.h"
+
+/* Slicing-by-8: eight 256 entries tables let the main loop process
+   eight bytes per iteration with independent lookups.  The firmware
+   environment is built without SSE so carry-less multiplication
+   folding is not an option.  */
+#define CRC32_POLY 0xEDB88320
+static UINT32 table[8][256];
+static BOOLEAN table_ready;
+
+static void init_table(void)
+{
+	UINT32 c;
+	UINTN i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? CRC32_POLY ^ (c >> 1) : c >> 1;
+		table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			table[j][i] = (table[j - 1][i] >> 8) ^
+				table[0][table[j - 1][i] & 0xff];
+
+	table_ready = TRUE;
+}
+
+UINT32 crc32_update(UINT32 crc, const VOID *data, UINTN size)
+{
+	const UINT8 *p = data;
+	UINT32 lo, hi;
+
+	if (!table_ready)
+		init_table();
+
+	crc = ~crc;
+
+	for (; size && ((UINTN)p & 7); size--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	for (; size >= 8; size -= 8, p += 8) {
+		lo = *(const UINT32 *)p ^ crc;
+		hi = *(const UINT32 *)(p + 4);
+		crc = table[7][lo & 0xff] ^
+			table[6][(lo >> 8) & 0xff] ^
+			table[5][(lo >> 16) & 0xff] ^
+			table[4][lo >> 24] ^
+			table[3][hi & 0xff] ^
+			table[2][(hi >> 8) & 0xff] ^
+			table[1][(hi >> 16) & 0xff] ^
+			table[0][hi >> 24];
+	}
+
+	for (; size; size--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/* CRC combination works on the GF(2) 32x32 matrix representing the
+   CRC register update for a run of zero bits.  */
+static UINT32 gf2_matrix_times(const UINT32 *mat, UINT32 vec)
+{
+	UINT32 sum = 0;
+
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+
+	return sum;
+}
+
+static void gf2_matrix_square(UINT32 *square, const UINT32 *mat)
+{
+	UINTN n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+UINT32 crc32_combine(UINT32 crc_a, UINT32 crc_b, UINT64 len_b)
+{
+	UINT32 even[32], odd[32];
+	UINT32 row;
+	UINTN n;
+
+	if (!len_b)
+		return crc_a;
+
+	/* Operator for one zero bit */
+	odd[0] = CRC32_POLY;
+	for (n = 1, row = 1; n < 32; n++, row <<= 1)
+		odd[n] = row;
+
+	gf2_matrix_square(even, odd);	/* two zero bits */
+	gf2_matrix_square(odd, even);	/* four zero bits */
+
+	/* Apply LEN_B zero bytes to CRC_A, the first square gives the
+	   operator for one zero byte.  */
+	for (;;) {
+		gf2_matrix_square(even, odd);
+		if (len_b & 1)
+			crc_a = gf2_matrix_times(even, crc_a);
+		len_b >>= 1;
+		if (!len_b)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len_b & 1)
+			crc_a = gf2_matrix_times(odd, crc_a);
+		len_b >>= 1;
+		if (!len_b)
+			break;
+	}
+
+	return crc_a ^ crc_b;
+}
+
+UINT32 crc32_fill(UINT32 crc, UINT32 pattern, UINT64 size)
+{
+	UINT32 unit;
+	UINT64 unit_len = sizeof(pattern);
+
+	/* A run of 2^k patterns is built by doubling, the runs
+	   matching the bits of the pattern count are appended to
+	   CRC.  All the runs start on a pattern boundary so the
+	   order they are appended in does not matter.  */
+	unit = crc32_update(0, &pattern, sizeof(pattern));
+	for (size /= sizeof(pattern); size; size >>= 1) {
+		if (size & 1)
+			crc = crc32_combine(crc, unit, unit_len);
+		if (size > 1) {
+			unit = crc32_combine(unit, unit, unit_len);
+			unit_len <<= 1;
+		}
+	}
+
+	return crc;
+}
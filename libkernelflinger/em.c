@@ -32,6 +32,7 @@
 
 #include "acpi.h"
 #include "lib.h"
+#include "timer.h"
 #include "protocol/ChargingAppletProtocol.h"
 
 #include "em.h"
@@ -48,27 +49,74 @@ struct battery_status {
         BATTERY_CAPACITY BatteryCapacityLevel;
 };
 
+/* The boot target checks and the fastboot variables query the
+ * battery several times in a row: the protocol answers are kept for
+ * STATUS_TTL_MS so that a boot costs a single query while a longer
+ * running loop still gets fresh values.  */
+#define STATUS_TTL_MS   1000
+
+static struct {
+        CHARGING_APPLET_PROTOCOL *protocol;
+        BOOLEAN status_valid;
+        UINT64 status_ticks;
+        struct battery_status status;
+        BOOLEAN charger_valid;
+        UINT64 charger_ticks;
+        CHARGER_TYPE charger;
+} cache;
+
+static BOOLEAN cache_fresh(BOOLEAN valid, UINT64 ticks)
+{
+        return valid && timer_ticks() - ticks < STATUS_TTL_MS * timer_ticks_per_ms();
+}
+
+static EFI_STATUS get_charging_protocol(CHARGING_APPLET_PROTOCOL **protocol)
+{
+        EFI_STATUS ret;
+
+        if (!cache.protocol) {
+                ret = LibLocateProtocol(&gChargingAppletProtocolGuid,
+                                        (VOID **)&cache.protocol);
+                if (EFI_ERROR(ret)) {
+                        cache.protocol = NULL;
+                        return ret;
+                }
+        }
+
+        *protocol = cache.protocol;
+        return EFI_SUCCESS;
+}
+
 static EFI_STATUS get_battery_status(struct battery_status *status)
 {
         CHARGING_APPLET_PROTOCOL *charging_protocol;
+        struct battery_status *cur = &cache.status;
         EFI_STATUS ret;
 
-        ret = LibLocateProtocol(&gChargingAppletProtocolGuid,
-                                (VOID **)&charging_protocol);
+        if (cache_fresh(cache.status_valid, cache.status_ticks)) {
+                memcpy(status, cur, sizeof(*status));
+                return EFI_SUCCESS;
+        }
+
+        cache.status_valid = FALSE;
+        ret = get_charging_protocol(&charging_protocol);
         if (EFI_ERROR(ret))
                 goto error;
 
         ret = uefi_call_wrapper(charging_protocol->GetBatteryInfo, 7,
                                 charging_protocol,
-                                &status->BatteryInfo,
-                                &status->BatteryPresent,
-                                &status->BatteryValid,
-                                &status->CapacityReadable,
-                                &status->BatteryVoltageLevel,
-                                &status->BatteryCapacityLevel);
+                                &cur->BatteryInfo,
+                                &cur->BatteryPresent,
+                                &cur->BatteryValid,
+                                &cur->CapacityReadable,
+                                &cur->BatteryVoltageLevel,
+                                &cur->BatteryCapacityLevel);
         if (EFI_ERROR(ret))
                 goto error;
 
+        cache.status_valid = TRUE;
+        cache.status_ticks = timer_ticks();
+        memcpy(status, cur, sizeof(*status));
         return ret;
 
 error:
@@ -79,20 +127,24 @@ error:
 BOOLEAN is_charger_plugged_in(void)
 {
         CHARGING_APPLET_PROTOCOL *charging_protocol;
-        CHARGER_TYPE type;
         EFI_STATUS ret;
 
-        ret = LibLocateProtocol(&gChargingAppletProtocolGuid,
-                                (VOID **)&charging_protocol);
+        if (cache_fresh(cache.charger_valid, cache.charger_ticks))
+                return cache.charger != ChargerUndefined;
+
+        cache.charger_valid = FALSE;
+        ret = get_charging_protocol(&charging_protocol);
         if (EFI_ERROR(ret))
                 goto error;
 
         ret = uefi_call_wrapper(charging_protocol->GetChargerType, 2,
-                                charging_protocol, &type);
+                                charging_protocol, &cache.charger);
         if (EFI_ERROR(ret))
                 goto error;
 
-        return type != ChargerUndefined;
+        cache.charger_valid = TRUE;
+        cache.charger_ticks = timer_ticks();
+        return cache.charger != ChargerUndefined;
 
 error:
         efi_perror(ret, L"Failed to get charger status");
@@ -39,6 +39,9 @@
 #include "gpt.h"
 #include "gpt_bin.h"
 #include "storage.h"
+#include "crc32.h"
+#include "timestamp.h"
+#include "async_io.h"
 
 #define PROTECTIVE_MBR 0xEE
 #define GPT_SIGNATURE "EFI PART"
@@ -82,24 +85,44 @@ struct gpt_disk {
 	EFI_BLOCK_IO *bio;
 	EFI_DISK_IO *dio;
 	EFI_HANDLE handle;
-	BOOLEAN label_prefix_removed;
+	/* Length of the prefix of the on-disk names which is not part
+	   of the labels, see gpt_label_prefix() */
+	UINTN label_offset;
 	logical_unit_t log_unit;
 	struct gpt_header gpt_hd;
 	struct gpt_partition *partitions;
+	/* Hash table of the partition labels: a slot holds the index
+	   of a partition plus one, zero is a free slot */
+	UINT16 *index;
+	UINTN index_size;
 };
 
-/* Allow to scan and flash only one disk at a time
- * this disk could be emmc user area or emmc gpp */
-static struct gpt_disk sdisk;
+/* One cached disk per logical unit, for instance the emmc user area
+ * and the emmc gpp.  SDISK is the disk of the last logical unit
+ * used */
+static struct gpt_disk disks[LOGICAL_UNIT_FACTORY + 1];
+static struct gpt_disk *sdisk = &disks[LOGICAL_UNIT_USER];
+
+/* gpt_prefetch() starts a single asynchronous read of the GPT header
+   and of the entries which usually follow it.  The disk is only read
+   again by gpt_cache_partition() if the entries are elsewhere.  */
+#define GPT_PREFETCH_ENTRIES_SIZE (128 * 128)
+
+static struct {
+	logical_unit_t log_unit;
+	EFI_BLOCK_IO *bio;
+	async_reader_t *aio;
+	VOID *free_addr;
+	CHAR8 *buf;
+	UINTN size;
+	BOOLEAN pending;
+	BOOLEAN valid;
+} prefetch;
 
 static EFI_STATUS calculate_crc32(void *data, UINTN size, UINT32 *crc)
 {
-	EFI_STATUS ret;
-
-	ret = uefi_call_wrapper(BS->CalculateCrc32, 3, data, size, crc);
-	if (EFI_ERROR(ret))
-		efi_perror(ret, L"CalculateCrc32 failed");
-	return ret;
+	*crc = crc32_update(0, data, size);
+	return EFI_SUCCESS;
 }
 
 static EFI_STATUS set_header_crc32(struct gpt_header *gh)
@@ -113,10 +136,50 @@ static EFI_STATUS set_header_crc32(struct gpt_header *gh)
 	return ret;
 }
 
+/* Closing the reader waits for a pending read */
+static void prefetch_release(void)
+{
+	async_read_close(prefetch.aio);
+	if (prefetch.free_addr)
+		FreePool(prefetch.free_addr);
+	ZeroMem(&prefetch, sizeof(prefetch));
+}
+
+/* Copy the [OFFSET, OFFSET + SIZE[ disk range if it was prefetched */
+static BOOLEAN prefetch_read(struct gpt_disk *disk, UINT64 offset,
+			     UINTN size, VOID *dest)
+{
+	EFI_STATUS ret;
+	UINT64 start;
+
+	if (!prefetch.bio || prefetch.bio != disk->bio)
+		return FALSE;
+
+	if (prefetch.pending) {
+		prefetch.pending = FALSE;
+		ret = async_read_wait(prefetch.aio);
+		prefetch.valid = !EFI_ERROR(ret);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"GPT prefetch failed");
+	}
+
+	start = disk->bio->Media->BlockSize;
+	if (!prefetch.valid || offset < start ||
+	    offset + size > start + prefetch.size)
+		return FALSE;
+
+	memcpy(dest, prefetch.buf + offset - start, size);
+	return TRUE;
+}
+
 static EFI_STATUS read_gpt_header(struct gpt_disk *disk)
 {
 	EFI_STATUS ret;
 
+	if (prefetch_read(disk, disk->bio->Media->BlockSize,
+			  sizeof(disk->gpt_hd), &disk->gpt_hd))
+		return EFI_SUCCESS;
+
 	ret = uefi_call_wrapper(disk->dio->ReadDisk, 5, disk->dio, disk->bio->Media->MediaId, disk->bio->Media->BlockSize, sizeof(disk->gpt_hd), (VOID *)&disk->gpt_hd);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to read disk for GPT header");
@@ -144,6 +207,9 @@ static EFI_STATUS read_gpt_partitions(struct gpt_disk *disk)
 		return EFI_OUT_OF_RESOURCES;
 	}
 
+	if (prefetch_read(disk, offset, size, disk->partitions))
+		return EFI_SUCCESS;
+
 	ret = uefi_call_wrapper(disk->dio->ReadDisk, 5, disk->dio, disk->bio->Media->MediaId, offset, size, disk->partitions);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to read GPT partitions");
@@ -194,71 +260,110 @@ static EFI_STATUS gpt_prepare_disk(EFI_HANDLE handle, struct gpt_disk *disk)
 
 /* Gmin adds the "android_" prefix to the partition label.  Most of
    the fastboot command relies on the partition name/label.  The
-   following functions get rid of this prefix and put it if previously
-   removed.  */
+   prefix is detected once per cached table and the labels are the
+   names past it, the on-disk names are left untouched.  */
 const CHAR16 *ANDROID_PREFIX = L"android_";
 
-static EFI_STATUS gpt_remove_prefix(void)
+static EFI_STATUS gpt_label_prefix(struct gpt_disk *disk)
 {
 	UINTN prefix_len = StrLen(ANDROID_PREFIX);
-	BOOLEAN removed = FALSE;
-	BOOLEAN not_removed = FALSE;
+	BOOLEAN prefixed = FALSE;
+	BOOLEAN not_prefixed = FALSE;
 	UINTN p;
 
-	if (sdisk.label_prefix_removed)
-		return EFI_SUCCESS;
-
-	for (p = 0; p < sdisk.gpt_hd.number_of_entries; p++) {
+	disk->label_offset = 0;
+	for (p = 0; p < disk->gpt_hd.number_of_entries; p++) {
 		struct gpt_partition *part;
 
-		part = &sdisk.partitions[p];
+		part = &disk->partitions[p];
 		if (!CompareGuid(&part->type, &NullGuid))
 			continue;
 
-		if (!StrnCmp(part->name, ANDROID_PREFIX, prefix_len)) {
-			if (not_removed)
-				goto error;
-			CopyMem(part->name, &part->name[prefix_len],
-				sizeof(part->name) - (prefix_len * sizeof(CHAR16)));
-			removed = TRUE;
-			continue;
-		}
-		if (removed == TRUE)
-			goto error;
+		if (!StrnCmp(part->name, ANDROID_PREFIX, prefix_len))
+			prefixed = TRUE;
+		else
+			not_prefixed = TRUE;
+	}
 
-		not_removed = TRUE;
+	if (prefixed && not_prefixed) {
+		error(L"Not all the partition have the '%s' prefix", ANDROID_PREFIX);
+		return EFI_INVALID_PARAMETER;
 	}
 
-	sdisk.label_prefix_removed = removed;
+	if (prefixed)
+		disk->label_offset = prefix_len;
 	return EFI_SUCCESS;
-error:
-	error(L"Not all the partition have the '%s' prefix", ANDROID_PREFIX);
-	return EFI_INVALID_PARAMETER;
 }
 
-static void gpt_put_prefix_back(void)
+static inline const CHAR16 *part_label(struct gpt_disk *disk,
+				       struct gpt_partition *part)
 {
-	UINTN prefix_len = StrLen(ANDROID_PREFIX);
-	struct gpt_partition save;
-	UINTN p;
+	return part->name + disk->label_offset;
+}
+
+/* Copy PART for the callers, with its label as name */
+static void gpt_copy_partition(struct gpt_disk *disk, struct gpt_partition *dst,
+			       struct gpt_partition *part)
+{
+	UINTN len = ARRAY_SIZE(part->name) - disk->label_offset;
 
-	if (!sdisk.label_prefix_removed)
+	CopyMem(dst, part, sizeof(*part));
+	if (!disk->label_offset)
 		return;
+	CopyMem(dst->name, part_label(disk, part), len * sizeof(CHAR16));
+	ZeroMem(&dst->name[len], disk->label_offset * sizeof(CHAR16));
+}
 
-	for (p = 0; p < sdisk.gpt_hd.number_of_entries; p++) {
-		struct gpt_partition *part;
+static UINTN label_hash(const CHAR16 *label, UINTN max)
+{
+	UINTN hash = 2166136261U;
+	UINTN i;
 
-		part = &sdisk.partitions[p];
-		if (!CompareGuid(&part->type, &NullGuid))
+	for (i = 0; i < max && label[i]; i++)
+		hash = (hash ^ label[i]) * 16777619U;
+
+	return hash;
+}
+
+static void gpt_index_free(struct gpt_disk *disk)
+{
+	if (disk->index)
+		FreePool(disk->index);
+	disk->index = NULL;
+	disk->index_size = 0;
+}
+
+/* The index is a hint, gpt_find_partition() falls back on a scan if
+   it could not be built */
+static void gpt_index_build(struct gpt_disk *disk)
+{
+	UINTN p, slot, size;
+
+	gpt_index_free(disk);
+	if (disk->gpt_hd.number_of_entries >= 0xFFFF)
+		return;
+
+	for (size = 16; size < disk->gpt_hd.number_of_entries * 2; size *= 2)
+		;
+
+	disk->index = AllocateZeroPool(size * sizeof(*disk->index));
+	if (!disk->index)
+		return;
+	disk->index_size = size;
+
+	for (p = 0; p < disk->gpt_hd.number_of_entries; p++) {
+		struct gpt_partition *part = &disk->partitions[p];
+
+		if (!CompareGuid(&part->type, &NullGuid) || !part_label(disk, part)[0])
 			continue;
 
-		CopyMem(save.name, part->name, sizeof(part->name));
-		CopyMem(&part->name[prefix_len], save.name,
-			sizeof(part->name) - (prefix_len * sizeof(CHAR16)));
-		CopyMem(part->name, ANDROID_PREFIX, prefix_len * sizeof(CHAR16));
+		slot = label_hash(part_label(disk, part),
+				  ARRAY_SIZE(part->name) - disk->label_offset);
+		for (slot &= size - 1; disk->index[slot];
+		     slot = (slot + 1) & (size - 1))
+			;
+		disk->index[slot] = p + 1;
 	}
-
-	sdisk.label_prefix_removed = FALSE;
 }
 
 static EFI_STATUS gpt_list_partition_on_disk(struct gpt_disk *disk)
@@ -272,17 +377,19 @@ static EFI_STATUS gpt_list_partition_on_disk(struct gpt_disk *disk)
 		efi_perror(ret, L"Failed to read GPT partitions");
 		return ret;
 	}
-	ret = gpt_remove_prefix();
+	ret = gpt_label_prefix(disk);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to remove prefix of partition label");
 		return ret;
 	}
+	gpt_index_build(disk);
 
 	return EFI_SUCCESS;
 }
 
-/* Given the logical unit, find the disk and caches
- * information into the global sdisk variable */
+/* Given the logical unit, find the disk and caches information into
+ * its disks slot which becomes SDISK.  A cached unit is only reloaded
+ * once its partition tables are written.  */
 static EFI_STATUS gpt_cache_partition(logical_unit_t log_unit)
 {
 	EFI_STATUS ret;
@@ -292,8 +399,14 @@ static EFI_STATUS gpt_cache_partition(logical_unit_t log_unit)
 	BOOLEAN found = FALSE;
 	EFI_DEVICE_PATH *device_path;
 
+	if ((UINTN)log_unit >= ARRAY_SIZE(disks)) {
+		error(L"Unknown logical unit %d", log_unit);
+		return EFI_INVALID_PARAMETER;
+	}
+
 	/* if  already cached, return */
-	if (sdisk.dio && sdisk.log_unit == log_unit)
+	sdisk = &disks[log_unit];
+	if (sdisk->dio)
 		return EFI_SUCCESS;
 
 	ret = uefi_call_wrapper(BS->LocateHandleBuffer, 5, ByProtocol, &BlockIoProtocol, NULL, &nb_handle, &handles);
@@ -310,14 +423,14 @@ static EFI_STATUS gpt_cache_partition(logical_unit_t log_unit)
 		if (EFI_ERROR(ret))
 			continue;
 
-		ZeroMem(&sdisk, sizeof(sdisk));
-		ret = gpt_prepare_disk(handles[i], &sdisk);
+		ZeroMem(sdisk, sizeof(*sdisk));
+		ret = gpt_prepare_disk(handles[i], sdisk);
 		if (EFI_ERROR(ret))
 			continue;
 		debug(L"Found disk as block io %d for logical unit %d", i, log_unit);
 
-		sdisk.handle = handles[i];
-		sdisk.log_unit = log_unit;
+		sdisk->handle = handles[i];
+		sdisk->log_unit = log_unit;
 		found = TRUE;
 	}
 	if (!found) {
@@ -326,33 +439,107 @@ static EFI_STATUS gpt_cache_partition(logical_unit_t log_unit)
 		goto free_handles;
 	}
 
-	ret = gpt_list_partition_on_disk(&sdisk);
+	ret = gpt_list_partition_on_disk(sdisk);
 	/* ignore if there are no gpt partition on the system disk */
 	if (EFI_ERROR(ret)) {
-		ZeroMem(&sdisk.gpt_hd, sizeof(struct gpt_header));
+		ZeroMem(&sdisk->gpt_hd, sizeof(struct gpt_header));
 	}
+	timestamp_record("gpt_load");
 	ret = EFI_SUCCESS;
 
 free_handles:
+	if (prefetch.bio && prefetch.log_unit == log_unit)
+		prefetch_release();
+	FreePool(handles);
+	return ret;
+}
+
+EFI_STATUS gpt_prefetch(logical_unit_t log_unit)
+{
+	EFI_STATUS ret;
+	EFI_HANDLE *handles;
+	EFI_BLOCK_IO *bio = NULL;
+	UINTN nb_handle = 0, i;
+
+	if ((UINTN)log_unit >= ARRAY_SIZE(disks))
+		return EFI_INVALID_PARAMETER;
+
+	if (disks[log_unit].dio || prefetch.bio)
+		return EFI_ALREADY_STARTED;
+
+	ret = uefi_call_wrapper(BS->LocateHandleBuffer, 5, ByProtocol, &BlockIoProtocol, NULL, &nb_handle, &handles);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	for (i = 0; i < nb_handle; i++) {
+		ret = storage_check_logical_unit(DevicePathFromHandle(handles[i]), log_unit);
+		if (EFI_ERROR(ret))
+			continue;
+
+		uefi_call_wrapper(BS->ConnectController, 4, handles[i], NULL, NULL, TRUE);
+		ret = uefi_call_wrapper(BS->HandleProtocol, 3, handles[i], &BlockIoProtocol, (VOID *)&bio);
+		if (EFI_ERROR(ret) || bio->Media->LogicalPartition ||
+		    bio->Media->RemovableMedia) {
+			bio = NULL;
+			continue;
+		}
+		break;
+	}
 	FreePool(handles);
+	if (!bio)
+		return EFI_NOT_FOUND;
+
+	prefetch.size = (DIV_ROUND_UP(GPT_PREFETCH_ENTRIES_SIZE, bio->Media->BlockSize) + 1) *
+		bio->Media->BlockSize;
+	ret = alloc_aligned(&prefetch.free_addr, (VOID **)&prefetch.buf,
+			    prefetch.size, bio->Media->IoAlign);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	ret = async_read_open(bio, &prefetch.aio);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	ret = async_read_blocks(prefetch.aio, 1, prefetch.size, prefetch.buf);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	prefetch.bio = bio;
+	prefetch.log_unit = log_unit;
+	prefetch.pending = TRUE;
+	return EFI_SUCCESS;
+
+err:
+	prefetch_release();
 	return ret;
 }
 
+static void gpt_free_disk(struct gpt_disk *disk)
+{
+	gpt_index_free(disk);
+	if (disk->partitions)
+		FreePool(disk->partitions);
+	ZeroMem(disk, sizeof(*disk));
+}
+
 void gpt_free_cache(void)
 {
-	if (sdisk.partitions)
-		FreePool(sdisk.partitions);
-	ZeroMem(&sdisk, sizeof(sdisk));
+	UINTN i;
+
+	prefetch_release();
+
+	for (i = 0; i < ARRAY_SIZE(disks); i++)
+		gpt_free_disk(&disks[i]);
 }
 
 EFI_STATUS gpt_sync(void)
 {
 	EFI_STATUS ret;
 
-	if (!sdisk.bio)
+	if (!sdisk->bio)
 		return EFI_SUCCESS;
 
-	ret = uefi_call_wrapper(sdisk.bio->FlushBlocks, 1, sdisk.bio);
+	ret = uefi_call_wrapper(sdisk->bio->FlushBlocks, 1, sdisk->bio);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to flush block io interface");
 
@@ -368,16 +555,27 @@ EFI_STATUS gpt_refresh(void)
 		return ret;
 
 	/* Nothing cached, just return */
-	if (!sdisk.bio)
+	if (!sdisk->bio)
 		return EFI_SUCCESS;
 
-	ret = uefi_call_wrapper(BS->ReinstallProtocolInterface, 4, sdisk.handle, &BlockIoProtocol, sdisk.bio, sdisk.bio);
+	/* The file systems of the partitions are about to go away */
+	uefi_fs_cache_flush();
+
+	ret = uefi_call_wrapper(BS->ReinstallProtocolInterface, 4, sdisk->handle, &BlockIoProtocol, sdisk->bio, sdisk->bio);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to Reinstall block io interface on System disk");
+		/* The cached protocols may be gone */
+		gpt_free_disk(sdisk);
 		return ret;
 	}
-	/* invalid gpt cache to force to get new handle next time */
-	gpt_free_cache();
+
+	/* The disk io protocol is reinstalled as well, the partition
+	   table is kept */
+	ret = uefi_call_wrapper(BS->HandleProtocol, 3, sdisk->handle, &DiskIoProtocol, (VOID *)&sdisk->dio);
+	if (EFI_ERROR(ret)) {
+		debug(L"Failed to get the disk io protocol back, %r", ret);
+		gpt_free_disk(sdisk);
+	}
 
 	return EFI_SUCCESS;
 }
@@ -391,25 +589,36 @@ EFI_STATUS gpt_get_root_disk(struct gpt_partition_interface *gpart, logical_unit
 		return ret;
 
 	gpart->part.starting_lba = 0;
-	gpart->part.ending_lba = sdisk.bio->Media->LastBlock;
-	gpart->bio = sdisk.bio;
-	gpart->dio = sdisk.dio;
+	gpart->part.ending_lba = sdisk->bio->Media->LastBlock;
+	gpart->bio = sdisk->bio;
+	gpart->dio = sdisk->dio;
 
 	return EFI_SUCCESS;
 }
 
 static struct gpt_partition *gpt_find_partition(const CHAR16 *label)
 {
-	UINTN p;
-
-	for (p = 0; p < sdisk.gpt_hd.number_of_entries; p++) {
-		struct gpt_partition *part;
+	struct gpt_partition *part;
+	UINTN p, slot;
+
+	if (sdisk->index) {
+		for (slot = label_hash(label, ARRAY_SIZE(part->name)) & (sdisk->index_size - 1);
+		     sdisk->index[slot];
+		     slot = (slot + 1) & (sdisk->index_size - 1)) {
+			part = &sdisk->partitions[sdisk->index[slot] - 1];
+			if (!StrCmp(part_label(sdisk, part), label))
+				return part;
+		}
+		return NULL;
+	}
 
-		part = &sdisk.partitions[p];
-		if (!CompareGuid(&part->type, &NullGuid) || StrCmp(part->name, label))
+	for (p = 0; p < sdisk->gpt_hd.number_of_entries; p++) {
+		part = &sdisk->partitions[p];
+		if (!CompareGuid(&part->type, &NullGuid) ||
+		    StrCmp(part_label(sdisk, part), label))
 			continue;
 
-		debug(L"Found label %s in partition %d", label, p);
+		log_verbose(STORAGE, L"Found label %s in partition %d", label, p);
 		return part;
 	}
 
@@ -429,10 +638,10 @@ EFI_STATUS gpt_get_partition_by_label(const CHAR16 *label,
 
 	part = gpt_find_partition(label);
 	if (part) {
-		CopyMem(&gpart->part, part, sizeof(*part));
-		gpart->bio = sdisk.bio;
-		gpart->dio = sdisk.dio;
-		gpart->handle = sdisk.handle;
+		gpt_copy_partition(sdisk, &gpart->part, part);
+		gpart->bio = sdisk->bio;
+		gpart->dio = sdisk->dio;
+		gpart->handle = sdisk->handle;
 		return EFI_SUCCESS;
 	}
 
@@ -452,25 +661,25 @@ EFI_STATUS gpt_list_partition(struct gpt_partition_interface **gpartlist, UINTN
 		return ret;
 
 	*part_count = 0;
-	if (!sdisk.gpt_hd.number_of_entries)
+	if (!sdisk->gpt_hd.number_of_entries)
 		return EFI_SUCCESS;
 
-	*gpartlist = AllocatePool(sdisk.gpt_hd.number_of_entries * sizeof(struct gpt_partition_interface));
+	*gpartlist = AllocatePool(sdisk->gpt_hd.number_of_entries * sizeof(struct gpt_partition_interface));
 	if (!*gpartlist)
 		return EFI_OUT_OF_RESOURCES;
 
-	for (p = 0; p < sdisk.gpt_hd.number_of_entries; p++) {
+	for (p = 0; p < sdisk->gpt_hd.number_of_entries; p++) {
 		struct gpt_partition *part;
 		struct gpt_partition_interface *parti;
 
-		part = &sdisk.partitions[p];
-		if (!CompareGuid(&part->type, &NullGuid) || !part->name[0])
+		part = &sdisk->partitions[p];
+		if (!CompareGuid(&part->type, &NullGuid) || !part_label(sdisk, part)[0])
 			continue;
 
 		parti = &(*gpartlist)[(*part_count)];
-		parti->bio = sdisk.bio;
-		parti->dio = sdisk.dio;
-		CopyMem(&parti->part, part, sizeof(*part));
+		parti->bio = sdisk->bio;
+		parti->dio = sdisk->dio;
+		gpt_copy_partition(sdisk, &parti->part, part);
 		(*part_count)++;
 	}
 
@@ -506,7 +715,7 @@ static void gpt_new(struct gpt_header *gh, UINTN start_lba, UINTN blocksize, UIN
 		gh->first_usable_lba = MiB / blocksize;
 	gh->last_usable_lba = ALIGN_DOWN(lastblock - (gpt_size), (MiB / blocksize)) - 1;
 
-	debug(L"first usable lba %ld, last usable lba %ld",
+	log_debug(STORAGE, L"first usable lba %ld, last usable lba %ld",
 	      gh->first_usable_lba, gh->last_usable_lba);
 	/* TODO generate unique UUID for disk */
 }
@@ -538,7 +747,7 @@ static EFI_STATUS gpt_check_partition_list(UINTN part_count, struct gpt_bin_part
 		}
 		totsize += gbp[i].length;
 	}
-	disksize = ((sdisk.gpt_hd.last_usable_lba + 1 - sdisk.gpt_hd.first_usable_lba) * sdisk.bio->Media->BlockSize) / MiB;
+	disksize = ((sdisk->gpt_hd.last_usable_lba + 1 - sdisk->gpt_hd.first_usable_lba) * sdisk->bio->Media->BlockSize) / MiB;
 
 	if (totsize > disksize) {
 		error(L"partitions are bigger than the disk, partitions %ld MiB disk %ld MiB", totsize, disksize);
@@ -554,28 +763,28 @@ static struct gpt_partition *gpt_fill_entries(UINTN part_count, struct gpt_bin_p
 	UINT64 start_lba;
 	UINTN i;
 
-	gp = AllocateZeroPool(sdisk.gpt_hd.number_of_entries * sdisk.gpt_hd.size_of_entry);
+	gp = AllocateZeroPool(sdisk->gpt_hd.number_of_entries * sdisk->gpt_hd.size_of_entry);
 	if (!gp)
 		return NULL;
 
 	/* align on MiB boundaries ??? */
-	start_lba = sdisk.gpt_hd.first_usable_lba;
+	start_lba = sdisk->gpt_hd.first_usable_lba;
 
 	for (i = 0; i < part_count; i++) {
 		CopyMem(&gp[i].name, &gbp[i].label, sizeof(gp[i].name));
 		CopyMem(&gp[i].type, &gbp[i].type, sizeof(EFI_GUID));
 		CopyMem(&gp[i].unique, &gbp[i].uuid, sizeof(EFI_GUID));
 		gp[i].starting_lba = start_lba;
-		gp[i].ending_lba = start_lba - 1 + gbp[i].length * (MiB / sdisk.bio->Media->BlockSize);
+		gp[i].ending_lba = start_lba - 1 + gbp[i].length * (MiB / sdisk->bio->Media->BlockSize);
 		start_lba = gp[i].ending_lba + 1;
-		debug(L"partition %s, start %ld, end %ld", gp[i].name, gp[i].starting_lba, gp[i].ending_lba);
+		log_verbose(STORAGE, L"partition %s, start %ld, end %ld", gp[i].name, gp[i].starting_lba, gp[i].ending_lba);
 	}
 	return gp;
 }
 
 static EFI_STATUS gpt_write_mbr(void)
 {
-	struct mbr mbr;
+	struct mbr mbr, cur;
 	EFI_STATUS ret;
 
 	/* Write protective MBR */
@@ -583,12 +792,19 @@ static EFI_STATUS gpt_write_mbr(void)
 	mbr.sig = 0xAA55;
 	mbr.entries[0].type = PROTECTIVE_MBR;
 	mbr.entries[0].first_lba = 1;
-	if (sdisk.bio->Media->LastBlock > 0xFFFFFFFFULL)
+	if (sdisk->bio->Media->LastBlock > 0xFFFFFFFFULL)
 		mbr.entries[0].lba_count = 0xFFFFFFFFULL;
 	else
-		mbr.entries[0].lba_count = sdisk.bio->Media->LastBlock;
+		mbr.entries[0].lba_count = sdisk->bio->Media->LastBlock;
+
+	ret = uefi_call_wrapper(sdisk->dio->ReadDisk, 5, sdisk->dio, sdisk->bio->Media->MediaId,
+				440, sizeof(struct mbr), &cur);
+	if (!EFI_ERROR(ret) && !memcmp(&cur, &mbr, sizeof(mbr))) {
+		log_debug(STORAGE, L"Protective MBR unchanged");
+		return EFI_SUCCESS;
+	}
 
-	ret = uefi_call_wrapper(sdisk.dio->WriteDisk, 5, sdisk.dio, sdisk.bio->Media->MediaId,
+	ret = uefi_call_wrapper(sdisk->dio->WriteDisk, 5, sdisk->dio, sdisk->bio->Media->MediaId,
 				440, sizeof(struct mbr), &mbr);
 	if (EFI_ERROR(ret))
 		error(L"Couldn't write MBR");
@@ -596,49 +812,101 @@ static EFI_STATUS gpt_write_mbr(void)
 	return ret;
 }
 
-static EFI_STATUS gpt_write_table_to_disk(struct gpt_header *gh)
+/* Write the GH header and the entries array.  If the OLD entries
+ * array is not NULL, only the blocks of the entries which differ from
+ * it are written.  The header is written if it differs from OLD_GH
+ * once, NULL forces it.  */
+static EFI_STATUS gpt_write_table_to_disk(struct gpt_header *gh,
+					  struct gpt_header *old_gh,
+					  struct gpt_partition *old)
 {
 	UINT64 entries_offset, header_offset, entries_size;
+	UINTN bsize = sdisk->bio->Media->BlockSize;
+	UINT8 *cur = (UINT8 *)sdisk->partitions, *prev = (UINT8 *)old;
+	UINT64 start, end;
 	EFI_STATUS ret;
 
 	entries_size = gh->number_of_entries * gh->size_of_entry;
-	header_offset = gh->my_lba * sdisk.bio->Media->BlockSize;
-	entries_offset = gh->entries_lba * sdisk.bio->Media->BlockSize;
+	header_offset = gh->my_lba * bsize;
+	entries_offset = gh->entries_lba * bsize;
 
-	ret = uefi_call_wrapper(sdisk.dio->WriteDisk, 5, sdisk.dio, sdisk.bio->Media->MediaId,
-				header_offset, sizeof(struct gpt_header), gh);
-	if (EFI_ERROR(ret)) {
-		error(L"Couldn't write GPT header");
-		return ret;
+	/* Runs of modified blocks */
+	for (start = 0; start < entries_size; start = end) {
+		end = min(start + bsize, entries_size);
+		if (prev && !memcmp(cur + start, prev + start, end - start))
+			continue;
+		while (end < entries_size && prev &&
+		       memcmp(cur + end, prev + end, min(bsize, entries_size - end)))
+			end = min(end + bsize, entries_size);
+		if (!prev)
+			end = entries_size;
+
+		log_verbose(STORAGE, L"Write GPT entries 0x%lx-0x%lx", start, end);
+		ret = uefi_call_wrapper(sdisk->dio->WriteDisk, 5, sdisk->dio, sdisk->bio->Media->MediaId,
+					entries_offset + start, end - start, cur + start);
+		if (EFI_ERROR(ret)) {
+			error(L"Couldn't write GPT entries array");
+			return ret;
+		}
 	}
 
-	ret = uefi_call_wrapper(sdisk.dio->WriteDisk, 5, sdisk.dio, sdisk.bio->Media->MediaId,
-				entries_offset, entries_size,
-				sdisk.partitions);
+	if (old_gh && !memcmp(old_gh, gh, sizeof(*gh)))
+		return EFI_SUCCESS;
+
+	ret = uefi_call_wrapper(sdisk->dio->WriteDisk, 5, sdisk->dio, sdisk->bio->Media->MediaId,
+				header_offset, sizeof(struct gpt_header), gh);
 	if (EFI_ERROR(ret))
-		error(L"Couldn't write GPT entries array");
+		error(L"Couldn't write GPT header");
 
 	return ret;
 }
 
-static EFI_STATUS gpt_write_partition_tables(void)
+/* Read the header at LBA, returns FALSE if it cannot be read, is
+ * corrupted, is not a header with the same layout as GH or does not
+ * describe entries of ENTRIES_CRC CRC32 */
+static BOOLEAN gpt_read_header_at(UINT64 lba, struct gpt_header *gh,
+				  UINT32 entries_crc, struct gpt_header *cur)
+{
+	struct gpt_header check;
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(sdisk->dio->ReadDisk, 5, sdisk->dio, sdisk->bio->Media->MediaId,
+				lba * sdisk->bio->Media->BlockSize, sizeof(*cur), cur);
+	if (EFI_ERROR(ret) || !is_gpt_device(cur))
+		return FALSE;
+
+	CopyMem(&check, cur, sizeof(check));
+	if (EFI_ERROR(set_header_crc32(&check)) ||
+	    check.header_crc32 != cur->header_crc32)
+		return FALSE;
+
+	return cur->my_lba == gh->my_lba && cur->entries_lba == gh->entries_lba &&
+		cur->number_of_entries == gh->number_of_entries &&
+		cur->size_of_entry == gh->size_of_entry &&
+		cur->entries_crc32 == entries_crc;
+}
+
+/* OLD is the entries array on the disk, or NULL if it is unknown.
+ * The tables are only written where they changed and the cache is
+ * kept instead of being read again.  */
+static EFI_STATUS gpt_write_partition_tables(struct gpt_partition *old)
 {
 	EFI_STATUS ret;
 	UINT64 entries_size;
 	struct gpt_header *gh;
 	struct gpt_header *gh_backup;
-	UINT32 crc;
-
-	gpt_put_prefix_back();
+	struct gpt_header cur;
+	BOOLEAN valid, entries_changed;
+	UINT32 crc, old_crc = 0;
 
-	gh = &sdisk.gpt_hd;
+	gh = &sdisk->gpt_hd;
 
 	entries_size = gh->number_of_entries * gh->size_of_entry;
 	gh->my_lba = 1;
-	gh->alternate_lba = sdisk.bio->Media->LastBlock;
+	gh->alternate_lba = sdisk->bio->Media->LastBlock;
 	gh->entries_lba = 2;
 
-	ret = calculate_crc32(sdisk.partitions, entries_size, &crc);
+	ret = calculate_crc32(sdisk->partitions, entries_size, &crc);
 	if (EFI_ERROR(ret))
 		return ret;
 
@@ -648,8 +916,20 @@ static EFI_STATUS gpt_write_partition_tables(void)
 	if (EFI_ERROR(ret))
 		return ret;
 
-	debug(L"Write first GPT Header at %d", gh->my_lba);
-	ret = gpt_write_table_to_disk(gh);
+	entries_changed = !old || memcmp(old, sdisk->partitions, entries_size);
+
+	/* The tables on the disk are only diffed against OLD if their
+	   CRCs show they hold it, the full arrays are written
+	   otherwise */
+	if (old) {
+		ret = calculate_crc32(old, entries_size, &old_crc);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	valid = old && gpt_read_header_at(gh->my_lba, gh, old_crc, &cur);
+	log_debug(STORAGE, L"Write first GPT Header at %d", gh->my_lba);
+	ret = gpt_write_table_to_disk(gh, valid ? &cur : NULL, valid ? old : NULL);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to write primary GPT header");
 		return ret;
@@ -665,49 +945,90 @@ static EFI_STATUS gpt_write_partition_tables(void)
 
 	gh_backup->my_lba = gh->alternate_lba;
 	gh_backup->alternate_lba = gh->my_lba;
-	gh_backup->entries_lba = gh_backup->my_lba - entries_size / sdisk.bio->Media->BlockSize;
+	gh_backup->entries_lba = gh_backup->my_lba - entries_size / sdisk->bio->Media->BlockSize;
 
 	ret = set_header_crc32(gh_backup);
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
+		FreePool(gh_backup);
 		return ret;
+	}
 
-	debug(L"Write alternate GPT Header at %d", gh_backup->my_lba);
-	ret = gpt_write_table_to_disk(gh_backup);
+	/* The backup entries are only trusted to match the primary ones
+	   when the backup header is the expected one */
+	valid = old && gpt_read_header_at(gh_backup->my_lba, gh_backup, old_crc, &cur);
+	log_debug(STORAGE, L"Write alternate GPT Header at %d", gh_backup->my_lba);
+	ret = gpt_write_table_to_disk(gh_backup, valid ? &cur : NULL, valid ? old : NULL);
 	FreePool(gh_backup);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to write alternate GPT header");
 		return ret;
 	}
-	debug(L"Write protective MBR");
+	log_debug(STORAGE, L"Write protective MBR");
 	ret = gpt_write_mbr();
 	if (EFI_ERROR(ret))
 		return ret;
 
-	return gpt_refresh();
+	/* The partition drivers only have to enumerate the partitions
+	   again if they changed */
+	if (entries_changed) {
+		ret = gpt_refresh();
+		if (EFI_ERROR(ret) || !sdisk->dio) {
+			/* The tables are read again next time */
+			gpt_free_disk(sdisk);
+			return ret;
+		}
+	} else
+		log_debug(STORAGE, L"GPT partitions unchanged");
+
+	ret = gpt_label_prefix(sdisk);
+	if (EFI_ERROR(ret)) {
+		gpt_free_disk(sdisk);
+		return EFI_SUCCESS;
+	}
+	gpt_index_build(sdisk);
+
+	return EFI_SUCCESS;
 }
 
 EFI_STATUS gpt_create(UINTN start_lba, UINTN part_count, struct gpt_bin_part *gbp, logical_unit_t log_unit)
 {
 	EFI_STATUS ret;
+	struct gpt_partition *old = NULL;
 
 	ret = gpt_cache_partition(log_unit);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	if (sdisk.partitions) {
-		FreePool(sdisk.partitions);
-		sdisk.partitions = NULL;
+	/* The cached entries are the ones on the disk */
+	gpt_index_free(sdisk);
+	if (sdisk->partitions) {
+		if (is_gpt_device(&sdisk->gpt_hd) &&
+		    sdisk->gpt_hd.number_of_entries == GPT_ENTRIES &&
+		    sdisk->gpt_hd.size_of_entry == GPT_ENTRY_SIZE)
+			old = sdisk->partitions;
+		else
+			FreePool(sdisk->partitions);
+		sdisk->partitions = NULL;
 	}
-	gpt_new(&sdisk.gpt_hd, start_lba, sdisk.bio->Media->BlockSize, sdisk.bio->Media->LastBlock);
+	gpt_new(&sdisk->gpt_hd, start_lba, sdisk->bio->Media->BlockSize, sdisk->bio->Media->LastBlock);
 
 	ret = gpt_check_partition_list(part_count, gbp);
 	if (EFI_ERROR(ret))
-		return ret;
+		goto out;
+
+	sdisk->partitions = gpt_fill_entries(part_count, gbp);
+	if (!sdisk->partitions) {
+		ret = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+	sdisk->label_offset = 0;
 
-	sdisk.partitions = gpt_fill_entries(part_count, gbp);
-	sdisk.label_prefix_removed = FALSE;
+	ret = gpt_write_partition_tables(old);
 
-	return gpt_write_partition_tables();
+out:
+	if (old)
+		FreePool(old);
+	return ret;
 }
 
 EFI_STATUS gpt_get_partition_guid(CHAR16 *label, EFI_GUID *guid, logical_unit_t log_unit)
@@ -760,7 +1081,7 @@ EFI_STATUS gpt_swap_partition(CHAR16 *label1, CHAR16 *label2, logical_unit_t log
 	part2->starting_lba = save1.starting_lba;
 	part2->ending_lba = save1.ending_lba;
 
-	return gpt_write_partition_tables();
+	return gpt_write_partition_tables(NULL);
 }
 
 static HARDDRIVE_DEVICE_PATH *get_hd_device_path(EFI_DEVICE_PATH *p)
@@ -836,7 +1157,7 @@ EFI_STATUS gpt_get_header(struct gpt_header **header, UINTN *size, logical_unit_
 	if (!*header)
 		return EFI_OUT_OF_RESOURCES;
 
-	memcpy(*header, &sdisk.gpt_hd, *size);
+	memcpy(*header, &sdisk->gpt_hd, *size);
 
 	return EFI_SUCCESS;
 }
@@ -852,12 +1173,12 @@ EFI_STATUS gpt_get_partitions(struct gpt_partition **partitions, UINTN *size, lo
 	if (EFI_ERROR(ret))
 		return ret;
 
-	*size = sdisk.gpt_hd.number_of_entries * sizeof(*sdisk.partitions);
+	*size = sdisk->gpt_hd.number_of_entries * sizeof(*sdisk->partitions);
 	*partitions = AllocatePool(*size);
 	if (!*partitions)
 		return EFI_OUT_OF_RESOURCES;
 
-	memcpy(*partitions, sdisk.partitions, *size);
+	memcpy(*partitions, sdisk->partitions, *size);
 
 	return EFI_SUCCESS;
 }
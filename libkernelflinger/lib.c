@@ -68,6 +68,8 @@
 
 #include "lib.h"
 #include "vars.h"
+#include "timestamp.h"
+#include "bump.h"
 
 
 EFI_HANDLE g_parent_image;
@@ -268,34 +270,209 @@ EFI_STATUS stra_to_guid(char *str, EFI_GUID *g)
         return EFI_SUCCESS;
 }
 
-int vsnprintf(CHAR8 *dst, UINTN size, const CHAR8 *format, va_list ap)
+/* Native CHAR8 formatter, it follows the VSPrint() conversions (%a
+   for CHAR8 strings, %s for CHAR16 strings, %r for EFI_STATUS, %g for
+   GUID, upper case hexadecimal digits) without converting the format
+   and the result from and to CHAR16.  The output is truncated to SIZE
+   - 1 characters and the number of characters written is returned.  */
+struct format_out {
+        CHAR8 *dst;
+        UINTN size;
+        UINTN len;
+};
+
+static void format_put(struct format_out *out, CHAR8 c)
 {
-        EFI_STATUS ret;
-        int len = -1;
-        CHAR16 *format16;
+        if (out->len + 1 < out->size)
+                out->dst[out->len++] = c;
+}
+
+static void format_pad(struct format_out *out, CHAR8 pad, UINTN n)
+{
+        while (n--)
+                format_put(out, pad);
+}
 
-        format16 = stra_to_str((CHAR8 *)format);
-        if (!format16)
+static void format_str8(struct format_out *out, const CHAR8 *str, UINTN max,
+                        UINTN width, BOOLEAN left)
+{
+        UINTN len = 0;
+
+        if (!str)
+                str = (CHAR8 *)"(null)";
+        while (len < max && str[len])
+                len++;
+
+        if (!left && width > len)
+                format_pad(out, ' ', width - len);
+        for (UINTN i = 0; i < len; i++)
+                format_put(out, str[i]);
+        if (left && width > len)
+                format_pad(out, ' ', width - len);
+}
+
+static void format_str16(struct format_out *out, const CHAR16 *str, UINTN max,
+                         UINTN width, BOOLEAN left)
+{
+        UINTN len = 0;
+
+        if (!str) {
+                format_str8(out, (CHAR8 *)"(null)", max, width, left);
+                return;
+        }
+        while (len < max && str[len])
+                len++;
+
+        if (!left && width > len)
+                format_pad(out, ' ', width - len);
+        for (UINTN i = 0; i < len; i++)
+                format_put(out, str[i] < 0x80 ? (CHAR8)str[i] : '?');
+        if (left && width > len)
+                format_pad(out, ' ', width - len);
+}
+
+static void format_number(struct format_out *out, UINT64 value, BOOLEAN negative,
+                          UINTN base, CHAR8 pad, UINTN width, BOOLEAN left)
+{
+        static const CHAR8 DIGITS[] = "0123456789ABCDEF";
+        CHAR8 digits[24];
+        UINTN len = 0, total;
+
+        do {
+                digits[len++] = DIGITS[value % base];
+                value /= base;
+        } while (value);
+
+        total = len + (negative ? 1 : 0);
+        if (negative && pad == '0')
+                format_put(out, '-');
+        if (!left && width > total)
+                format_pad(out, pad, width - total);
+        if (negative && pad != '0')
+                format_put(out, '-');
+        while (len)
+                format_put(out, digits[--len]);
+        if (left && width > total)
+                format_pad(out, ' ', width - total);
+}
+
+static int format_va(CHAR8 *dst, UINTN size, const VOID *fmt, BOOLEAN wide,
+                     va_list ap)
+{
+        struct format_out out = { .dst = dst, .size = size, .len = 0 };
+        CHAR16 tmp[64];
+        UINTN i = 0, width, max, base;
+        BOOLEAN left, is_long;
+        CHAR8 pad;
+        INT64 value;
+        CHAR16 c;
+
+        if (!dst || !size || !fmt)
                 return -1;
 
-        CHAR16 *dst16 = AllocatePool(size * sizeof(CHAR16));
-        if (!dst16)
-                goto free_format16;
+#define FMT_CHAR(i) (wide ? ((const CHAR16 *)fmt)[i] : ((const CHAR8 *)fmt)[i])
+        for (; (c = FMT_CHAR(i)); i++) {
+                if (c != '%') {
+                        format_put(&out, c < 0x80 ? (CHAR8)c : '?');
+                        continue;
+                }
 
-        len = VSPrint(dst16, size * sizeof(CHAR16), format16, ap);
+                left = FALSE;
+                pad = ' ';
+                width = 0;
+                max = (UINTN)-1;
+                is_long = FALSE;
+
+                for (c = FMT_CHAR(++i); c == '-' || c == '0'; c = FMT_CHAR(++i))
+                        if (c == '-')
+                                left = TRUE;
+                        else
+                                pad = '0';
+
+                if (c == '*') {
+                        width = va_arg(ap, UINTN);
+                        c = FMT_CHAR(++i);
+                } else
+                        for (; c >= '0' && c <= '9'; c = FMT_CHAR(++i))
+                                width = width * 10 + c - '0';
+
+                if (c == '.') {
+                        max = 0;
+                        for (c = FMT_CHAR(++i); c >= '0' && c <= '9'; c = FMT_CHAR(++i))
+                                max = max * 10 + c - '0';
+                }
 
-        ret = str_to_stra((CHAR8 *)dst, dst16, len + 1);
-        if (EFI_ERROR(ret))
-                len = -1;
-        else
-                dst[len] = '\0';
+                for (; c == 'l' || c == 'h'; c = FMT_CHAR(++i))
+                        if (c == 'l')
+                                is_long = TRUE;
 
-        FreePool(dst16);
+                base = 16;
+                switch (c) {
+                case '\0':
+                        i--;
+                        break;
+                case 'a':
+                        format_str8(&out, va_arg(ap, CHAR8 *), max, width, left);
+                        break;
+                case 's':
+                        format_str16(&out, va_arg(ap, CHAR16 *), max, width, left);
+                        break;
+                case 'c':
+                        format_put(&out, (CHAR8)va_arg(ap, UINTN));
+                        break;
+                case 'd':
+                case 'i':
+                        value = is_long ? va_arg(ap, INT64) : va_arg(ap, INT32);
+                        format_number(&out, value < 0 ? -(UINT64)value : (UINT64)value,
+                                      value < 0, 10, pad, width, left);
+                        break;
+                case 'u':
+                        base = 10;
+                        /* Fall through */
+                case 'x':
+                        format_number(&out, is_long ? va_arg(ap, UINT64) : va_arg(ap, UINT32),
+                                      FALSE, base, pad, width, left);
+                        break;
+                case 'X':
+                        /* VSPrint() pads %X to the size of the value */
+                        if (!width) {
+                                width = is_long ? 16 : 8;
+                                pad = '0';
+                        }
+                        format_number(&out, is_long ? va_arg(ap, UINT64) : va_arg(ap, UINT32),
+                                      FALSE, 16, pad, width, left);
+                        break;
+                case 'p':
+                        format_number(&out, (UINTN)va_arg(ap, VOID *), FALSE, 16,
+                                      '0', sizeof(VOID *) * 2, FALSE);
+                        break;
+                case 'r':
+                        StatusToString(tmp, va_arg(ap, EFI_STATUS));
+                        format_str16(&out, tmp, max, width, left);
+                        break;
+                case 'g':
+                        GuidToString(tmp, va_arg(ap, EFI_GUID *));
+                        format_str16(&out, tmp, max, width, left);
+                        break;
+                default:
+                        format_put(&out, c < 0x80 ? (CHAR8)c : '?');
+                        break;
+                }
+        }
+#undef FMT_CHAR
 
-free_format16:
-        FreePool(format16);
+        dst[out.len] = '\0';
+        return out.len;
+}
+
+int vsnprintf(CHAR8 *dst, UINTN size, const CHAR8 *format, va_list ap)
+{
+        return format_va(dst, size, format, FALSE, ap);
+}
 
-        return len;
+int vsnprintf_w(CHAR8 *dst, UINTN size, const CHAR16 *format, va_list ap)
+{
+        return format_va(dst, size, format, TRUE, ap);
 }
 
 
@@ -311,24 +488,157 @@ int snprintf(CHAR8 *str, UINTN size, const CHAR8 *format, ...)
 }
 
 
-EFI_STATUS get_efi_variable(const EFI_GUID *guid, CHAR16 *key,
-                UINTN *size_p, VOID **data_p, UINT32 *flags_p)
+/* GetVariable() goes through SMM on some platforms and the boot flow
+ * reads the same variables many times.  The Kernelflinger owned
+ * variables, which are only written through set_efi_variable() and
+ * del_efi_variable(), are cached with their absence.  The firmware
+ * owned ones can change behind our back and are never cached.  */
+#define VAR_CACHE_SIZE          32
+#define VAR_CACHE_MAX_DATA      1024
+
+static struct var_cache {
+        EFI_GUID guid;
+        CHAR16 *name;
+        BOOLEAN present;
+        UINT32 flags;
+        UINTN size;
+        VOID *data;
+} var_cache[VAR_CACHE_SIZE];
+static UINTN var_cache_next;
+static UINTN var_generation;
+
+UINTN efi_variable_generation(void)
+{
+        return var_generation;
+}
+
+static BOOLEAN var_cacheable(const EFI_GUID *guid)
+{
+        return !CompareGuid((EFI_GUID *)guid, (EFI_GUID *)&loader_guid) ||
+                !CompareGuid((EFI_GUID *)guid, (EFI_GUID *)&fastboot_guid);
+}
+
+static struct var_cache *var_cache_lookup(const EFI_GUID *guid, CHAR16 *key)
 {
+        UINTN i;
+
+        for (i = 0; i < ARRAY_SIZE(var_cache); i++)
+                if (var_cache[i].name && !StrCmp(var_cache[i].name, key) &&
+                    !CompareGuid(&var_cache[i].guid, (EFI_GUID *)guid))
+                        return &var_cache[i];
+
+        return NULL;
+}
+
+static void var_cache_release(struct var_cache *entry)
+{
+        if (entry->name)
+                FreePool(entry->name);
+        if (entry->data)
+                FreePool(entry->data);
+        ZeroMem(entry, sizeof(*entry));
+}
+
+/* DATA is NULL for a variable known not to exist */
+static void var_cache_store(const EFI_GUID *guid, CHAR16 *key, UINT32 flags,
+                            UINTN size, VOID *data)
+{
+        struct var_cache *entry;
+
+        if (!var_cacheable(guid))
+                return;
+
+        entry = var_cache_lookup(guid, key);
+        if (entry)
+                var_cache_release(entry);
+
+        if (size > VAR_CACHE_MAX_DATA)
+                return;
+
+        if (!entry) {
+                entry = &var_cache[var_cache_next];
+                var_cache_next = (var_cache_next + 1) % ARRAY_SIZE(var_cache);
+                var_cache_release(entry);
+        }
+
+        entry->name = StrDuplicate(key);
+        if (!entry->name)
+                return;
+
+        if (data) {
+                entry->data = AllocatePool(size ? size : 1);
+                if (!entry->data) {
+                        var_cache_release(entry);
+                        return;
+                }
+                memcpy(entry->data, data, size);
+                entry->present = TRUE;
+        }
+
+        memcpy(&entry->guid, guid, sizeof(entry->guid));
+        entry->flags = flags;
+        entry->size = size;
+}
+
+void efi_variable_cache_invalidate(const EFI_GUID *guid, CHAR16 *key)
+{
+        struct var_cache *entry;
+        UINTN i;
+
+        var_generation++;
+        if (guid && key) {
+                entry = var_cache_lookup(guid, key);
+                if (entry)
+                        var_cache_release(entry);
+                return;
+        }
+
+        for (i = 0; i < ARRAY_SIZE(var_cache); i++)
+                var_cache_release(&var_cache[i]);
+}
+
+/* The SCRATCH buffers come from the bump allocator, they are meant
+   for the variables which are parsed and released right away.  */
+static EFI_STATUS read_efi_variable(const EFI_GUID *guid, CHAR16 *key,
+                                    UINTN *size_p, VOID **data_p,
+                                    UINT32 *flags_p, BOOLEAN scratch)
+{
+#define var_alloc(size) (scratch ? bump_alloc(size) : AllocatePool(size))
+#define var_free(ptr) (scratch ? bump_free(ptr) : FreePool(ptr))
+        struct var_cache *entry;
         VOID *data;
         UINTN size;
         UINT32 flags;
         EFI_STATUS ret;
 
+        entry = var_cache_lookup(guid, key);
+        if (entry) {
+                if (!entry->present)
+                        return EFI_NOT_FOUND;
+
+                data = var_alloc(entry->size ? entry->size : 1);
+                if (!data)
+                        return EFI_OUT_OF_RESOURCES;
+                memcpy(data, entry->data, entry->size);
+
+                if (size_p)
+                        *size_p = entry->size;
+                if (flags_p)
+                        *flags_p = entry->flags;
+                *data_p = data;
+                return EFI_SUCCESS;
+        }
+
         size = 1024; /* Arbitrary starting value */
-        data = AllocatePool(size);
+        data = var_alloc(size);
         if (!data)
                 return EFI_OUT_OF_RESOURCES;
 
         ret = uefi_call_wrapper(RT->GetVariable, 5, key, (EFI_GUID *)guid,
                                 &flags, &size, data);
         if (ret == EFI_BUFFER_TOO_SMALL) {
-                FreePool(data);
-                data = AllocatePool(size);
+                var_free(data);
+                data = var_alloc(size);
                 if (!data)
                         return EFI_OUT_OF_RESOURCES;
                 ret = uefi_call_wrapper(RT->GetVariable, 5, key, (EFI_GUID *)guid,
@@ -336,10 +646,14 @@ EFI_STATUS get_efi_variable(const EFI_GUID *guid, CHAR16 *key,
         }
 
         if (EFI_ERROR(ret)) {
-                FreePool(data);
+                var_free(data);
+                if (ret == EFI_NOT_FOUND)
+                        var_cache_store(guid, key, 0, 0, NULL);
                 return ret;
         }
 
+        var_cache_store(guid, key, flags, size, data);
+
         if (size_p)
                 *size_p = size;
         if (flags_p)
@@ -347,6 +661,14 @@ EFI_STATUS get_efi_variable(const EFI_GUID *guid, CHAR16 *key,
         *data_p = data;
 
         return EFI_SUCCESS;
+#undef var_alloc
+#undef var_free
+}
+
+EFI_STATUS get_efi_variable(const EFI_GUID *guid, CHAR16 *key,
+                UINTN *size_p, VOID **data_p, UINT32 *flags_p)
+{
+        return read_efi_variable(guid, key, size_p, data_p, flags_p, FALSE);
 }
 
 
@@ -376,17 +698,17 @@ CHAR16 *get_efi_variable_str8(const EFI_GUID *guid, CHAR16 *key)
         EFI_STATUS ret;
         UINTN size;
 
-        ret = get_efi_variable(guid, key, &size, (VOID **)&data, NULL);
+        ret = read_efi_variable(guid, key, &size, (VOID **)&data, NULL, TRUE);
         if (EFI_ERROR(ret) || !data || !size)
                 return NULL;
 
         if (data[size - 1] != '\0') {
-                FreePool(data);
+                bump_free(data);
                 return NULL;
         }
 
         value = stra_to_str(data);
-        FreePool(data);
+        bump_free(data);
         return value;
 }
 
@@ -397,17 +719,17 @@ EFI_STATUS get_efi_variable_byte(const EFI_GUID *guid, CHAR16 *key, UINT8 *byte)
         EFI_STATUS ret;
         UINTN size;
 
-        ret = get_efi_variable(guid, key, &size, (VOID **)&data, NULL);
+        ret = read_efi_variable(guid, key, &size, (VOID **)&data, NULL, TRUE);
         if (EFI_ERROR(ret))
                 return ret;
 
         if (!size) {
-                FreePool(data);
+                bump_free(data);
                 return EFI_NOT_FOUND;
         }
 
         *byte = data[0];
-        FreePool(data);
+        bump_free(data);
         return EFI_SUCCESS;
 }
 
@@ -418,7 +740,7 @@ EFI_STATUS get_efi_variable_long_from_str8(const EFI_GUID *guid, CHAR16 *key,
         EFI_STATUS ret;
         UINTN size;
 
-        ret = get_efi_variable(guid, key, &size, (VOID **)&data, NULL);
+        ret = read_efi_variable(guid, key, &size, (VOID **)&data, NULL, TRUE);
         if (EFI_ERROR(ret))
                 return ret;
 
@@ -438,7 +760,7 @@ EFI_STATUS get_efi_variable_long_from_str8(const EFI_GUID *guid, CHAR16 *key,
         else
                 ret = EFI_SUCCESS;
 out:
-        FreePool(data);
+        bump_free(data);
         return ret;
 }
 
@@ -448,7 +770,14 @@ EFI_STATUS del_efi_variable(const EFI_GUID *guid, CHAR16 *key)
 
         ret = uefi_call_wrapper(RT->SetVariable, 5, key, (EFI_GUID *)guid, 0, 0, NULL);
         if (ret == EFI_NOT_FOUND)
-                return EFI_SUCCESS;
+                ret = EFI_SUCCESS;
+
+        var_generation++;
+
+        if (EFI_ERROR(ret))
+                efi_variable_cache_invalidate(guid, key);
+        else
+                var_cache_store(guid, key, 0, 0, NULL);
 
         return ret;
 }
@@ -473,11 +802,12 @@ EFI_STATUS set_efi_variable(const EFI_GUID *guid, CHAR16 *key,
          * implementations. The correct method of changing the attributes of a
          * variable is to delete the variable and recreate it with different
          * attributes. */
-        ret = get_efi_variable((EFI_GUID *)guid, key, &cursize, &curdata, &curflags);
+        ret = read_efi_variable((EFI_GUID *)guid, key, &cursize, &curdata,
+                                &curflags, TRUE);
         if (EFI_ERROR(ret) && ret != EFI_NOT_FOUND)
                 return ret;
         if (ret == EFI_SUCCESS)
-                FreePool(curdata);
+                bump_free(curdata);
         if (ret == EFI_SUCCESS && curflags != flags) {
                 ret = del_efi_variable((EFI_GUID *)guid, key);
                 if (EFI_ERROR(ret)) {
@@ -486,8 +816,15 @@ EFI_STATUS set_efi_variable(const EFI_GUID *guid, CHAR16 *key,
                 }
         }
 
-        return uefi_call_wrapper(RT->SetVariable, 5, key, (EFI_GUID *)guid, flags,
-                                 size, data);
+        ret = uefi_call_wrapper(RT->SetVariable, 5, key, (EFI_GUID *)guid, flags,
+                                size, data);
+        var_generation++;
+        if (EFI_ERROR(ret))
+                efi_variable_cache_invalidate(guid, key);
+        else
+                var_cache_store(guid, key, flags, size, size ? data : NULL);
+
+        return ret;
 }
 
 
@@ -827,14 +1164,42 @@ CHAR16 *StrStr(const CHAR16 *s, const CHAR16 *find)
         return (CHAR16 *)s;
 }
 
+/* Unlike Stall(), waiting for a timer event lets the firmware idle
+   the CPU.  Stall() is the fallback when the event cannot be used,
+   at a raised TPL for instance.  */
+VOID sleep_us(UINT64 usecs)
+{
+        EFI_EVENT timer;
+        EFI_STATUS ret;
+        UINTN index;
+
+        ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0, NULL,
+                                NULL, &timer);
+        if (EFI_ERROR(ret))
+                goto stall;
+
+        ret = uefi_call_wrapper(BS->SetTimer, 3, timer, TimerRelative,
+                                usecs * 10);
+        if (!EFI_ERROR(ret))
+                ret = uefi_call_wrapper(BS->WaitForEvent, 3, 1, &timer, &index);
+        uefi_call_wrapper(BS->CloseEvent, 1, timer);
+        if (!EFI_ERROR(ret))
+                return;
+
+stall:
+        uefi_call_wrapper(BS->Stall, 1, usecs);
+}
+
 VOID pause(UINTN seconds)
 {
-        uefi_call_wrapper(BS->Stall, 1, seconds * 1000000);
+        sleep_us((UINT64)seconds * 1000000);
 }
 
 
 VOID halt_system(VOID)
 {
+        log_persist();
+        log_flush_serial();
         uefi_call_wrapper(RT->ResetSystem, 4, EfiResetShutdown, EFI_SUCCESS,
                           0, NULL);
         error(L"Failed to halt the device ... looping forever");
@@ -846,6 +1211,10 @@ VOID reboot(CHAR16 *target)
 {
         EFI_STATUS ret;
 
+        timestamp_save();
+        log_persist();
+        log_flush_serial();
+
         if (target) {
                 ret = set_efi_variable_str(&loader_guid, LOADER_ENTRY_ONESHOT,
                                            TRUE, TRUE, target);
@@ -887,23 +1256,243 @@ EFI_STATUS alloc_aligned(VOID **free_addr, VOID **aligned_addr,
         return EFI_SUCCESS;
 }
 
-int memcmp(const void *s1, const void *s2, size_t n)
+/* Memory kernels.  The small sizes are handled by a couple of
+   possibly overlapping moves, the medium ones by SSE2 unaligned moves
+   and the large ones by "rep movsb/stosb" when the CPU has the
+   Enhanced REP MOVSB/STOSB feature (ERMS), which makes it the fastest
+   way to move large areas.  The features are detected on first use.
+
+   The empty asm statements hide the moved values from the compiler
+   which would otherwise turn the loops back into memcpy() and
+   memset() calls.  */
+#define MEM_SSE2_MIN            16
+#define MEM_ERMS_MIN            2048
+
+#define CPUID_SSE2              (1 << 26)       /* Leaf 1, EDX */
+#define CPUID_ERMS              (1 << 9)        /* Leaf 7, EBX */
+
+#define MEM_SSE2_TARGET __attribute__((target("sse2")))
+
+typedef char v16qi_u __attribute__((vector_size(16), aligned(1), may_alias));
+
+static struct {
+        BOOLEAN detected;
+        BOOLEAN sse2;
+        BOOLEAN erms;
+} mem_cpu;
+
+static void mem_detect(void)
 {
-        return CompareMem(s1, s2, n);
+        UINT32 reg[4];
+
+        cpuid(0, reg);
+        if (reg[0] >= 7) {
+                cpuid_count(7, 0, reg);
+                mem_cpu.erms = !!(reg[1] & CPUID_ERMS);
+        }
+
+        cpuid(1, reg);
+        mem_cpu.sse2 = !!(reg[3] & CPUID_SSE2);
+        mem_cpu.detected = TRUE;
 }
 
-void *memset(void *s, int c, size_t n)
+static inline UINT64 load64(const UINT8 *p)
 {
-        SetMem(s, n, (UINT8)c);
-        return s;
+        UINT64 v;
+
+        __builtin_memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static inline UINT32 load32(const UINT8 *p)
+{
+        UINT32 v;
+
+        __builtin_memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static inline void store64(UINT8 *p, UINT64 v)
+{
+        __builtin_memcpy(p, &v, sizeof(v));
+}
+
+static inline void store32(UINT8 *p, UINT32 v)
+{
+        __builtin_memcpy(p, &v, sizeof(v));
+}
+
+/* Up to 16 bytes, all the loads happen before the stores so that
+   overlapping areas are supported.  */
+static inline void copy_small(UINT8 *d, const UINT8 *s, size_t n)
+{
+        UINT64 a, b;
+        UINT32 x, y;
+        UINT8 c0, c1, c2;
+
+        if (n >= 8) {
+                a = load64(s);
+                b = load64(s + n - 8);
+                store64(d, a);
+                store64(d + n - 8, b);
+        } else if (n >= 4) {
+                x = load32(s);
+                y = load32(s + n - 4);
+                store32(d, x);
+                store32(d + n - 4, y);
+        } else if (n) {
+                c0 = s[0];
+                c1 = s[n / 2];
+                c2 = s[n - 1];
+                d[0] = c0;
+                d[n / 2] = c1;
+                d[n - 1] = c2;
+        }
+}
+
+static MEM_SSE2_TARGET void copy_sse2(UINT8 *d, const UINT8 *s, size_t n)
+{
+        v16qi_u tail = *(const v16qi_u *)(s + n - 16), v;
+        size_t i;
+
+        for (i = 0; i + 16 < n; i += 16) {
+                v = *(const v16qi_u *)(s + i);
+                asm("" : "+x" (v));
+                *(v16qi_u *)(d + i) = v;
+        }
+        *(v16qi_u *)(d + n - 16) = tail;
+}
+
+static MEM_SSE2_TARGET void set_sse2(UINT8 *d, UINT8 c, size_t n)
+{
+        v16qi_u v = { c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c };
+        size_t i;
+
+        for (i = 0; i + 16 < n; i += 16) {
+                asm("" : "+x" (v));
+                *(v16qi_u *)(d + i) = v;
+        }
+        *(v16qi_u *)(d + n - 16) = v;
+}
+
+static inline void rep_movsb(UINT8 *d, const UINT8 *s, size_t n)
+{
+        asm volatile("rep movsb"
+                     : "+D" (d), "+S" (s), "+c" (n)
+                     : : "memory");
+}
+
+static inline void rep_stosb(UINT8 *d, UINT8 c, size_t n)
+{
+        asm volatile("rep stosb"
+                     : "+D" (d), "+c" (n)
+                     : "a" (c)
+                     : "memory");
 }
 
 void *memcpy(void *dest, const void *source, size_t count)
 {
-        CopyMem(dest, source, (UINTN)count);
+        UINT8 *d = dest;
+        const UINT8 *s = source;
+
+        if (count <= MEM_SSE2_MIN) {
+                copy_small(d, s, count);
+                return dest;
+        }
+
+        /* CopyMem() supports overlapping areas, some callers may
+           rely on it.  */
+        if ((d > s ? (size_t)(d - s) : (size_t)(s - d)) < count) {
+                CopyMem(dest, (VOID *)source, (UINTN)count);
+                return dest;
+        }
+
+        if (!mem_cpu.detected)
+                mem_detect();
+
+        if (mem_cpu.sse2 && (count < MEM_ERMS_MIN || !mem_cpu.erms))
+                copy_sse2(d, s, count);
+        else
+                rep_movsb(d, s, count);
+
         return dest;
 }
 
+void *memset(void *s, int c, size_t n)
+{
+        UINT8 *d = s;
+        UINT64 v;
+
+        if (n <= MEM_SSE2_MIN) {
+                v = (UINT8)c * 0x0101010101010101ULL;
+                if (n >= 8) {
+                        store64(d, v);
+                        store64(d + n - 8, v);
+                } else if (n >= 4) {
+                        store32(d, v);
+                        store32(d + n - 4, v);
+                } else if (n) {
+                        d[0] = c;
+                        d[n / 2] = c;
+                        d[n - 1] = c;
+                }
+                return s;
+        }
+
+        if (!mem_cpu.detected)
+                mem_detect();
+
+        if (mem_cpu.sse2 && (n < MEM_ERMS_MIN || !mem_cpu.erms))
+                set_sse2(d, c, n);
+        else
+                rep_stosb(d, c, n);
+
+        return s;
+}
+
+/* Words are compared until the first difference which is then
+   located byte per byte.  */
+int memcmp(const void *s1, const void *s2, size_t n)
+{
+        const UINT8 *p1 = s1, *p2 = s2;
+
+        for (; n >= 8; n -= 8, p1 += 8, p2 += 8)
+                if (load64(p1) != load64(p2))
+                        break;
+
+        for (; n; n--, p1++, p2++)
+                if (*p1 != *p2)
+                        return *p1 - *p2;
+
+        return 0;
+}
+
+BOOLEAN is_zero(const void *buf, size_t size)
+{
+        const UINT8 *p = buf;
+        UINT64 acc;
+
+        /* Eight words at a time, returning on the first non-zero
+           block.  */
+        for (; size >= 64; size -= 64, p += 64) {
+                acc = load64(p) | load64(p + 8) | load64(p + 16) |
+                        load64(p + 24) | load64(p + 32) | load64(p + 40) |
+                        load64(p + 48) | load64(p + 56);
+                if (acc)
+                        return FALSE;
+        }
+
+        for (; size >= 8; size -= 8, p += 8)
+                if (load64(p))
+                        return FALSE;
+
+        for (; size; size--, p++)
+                if (*p)
+                        return FALSE;
+
+        return TRUE;
+}
+
 
 static BOOLEAN is_a_leap_year(INTN year)
 {
@@ -934,44 +1523,123 @@ UINT64 efi_time_to_ctime(EFI_TIME *time)
                 + (time->Minute * 60) + time->Second;
 }
 
-VOID cpuid(UINT32 op, UINT32 reg[4])
+VOID cpuid_count(UINT32 op, UINT32 count, UINT32 reg[4])
 {
 #if __LP64__
         asm volatile("xchg{q}\t{%%}rbx, %q1\n\t"
                      "cpuid\n\t"
                      "xchg{q}\t{%%}rbx, %q1\n\t"
                      : "=a" (reg[0]), "=&r" (reg[1]), "=c" (reg[2]), "=d" (reg[3])
-                     : "a" (op));
+                     : "a" (op), "c" (count));
 #else
         asm volatile("pushl %%ebx      \n\t" /* save %ebx */
                      "cpuid            \n\t"
                      "movl %%ebx, %1   \n\t" /* save what cpuid just put in %ebx */
                      "popl %%ebx       \n\t" /* restore the old %ebx */
                      : "=a"(reg[0]), "=r"(reg[1]), "=c"(reg[2]), "=d"(reg[3])
-                     : "a"(op)
+                     : "a"(op), "c"(count)
                      : "cc");
 #endif
 }
 
-EFI_STATUS generate_random_numbers(CHAR8 *data, UINTN size)
+VOID cpuid(UINT32 op, UINT32 reg[4])
 {
+        cpuid_count(op, 0, reg);
+}
+
+/* RDRAND is the output of the CPU DRBG, itself reseeded by the CPU
+   entropy source, it may only transiently fail.  Small requests are
+   served from a per-boot pool refilled RANDOM_POOL_WORDS 64-bit values
+   at a time, consumed bytes are wiped from the pool.  */
 #define RDRAND_SUPPORT (1 << 30)
+#define RDRAND_RETRIES 10
+#define RANDOM_POOL_WORDS 8
+
+static struct {
+        UINT64 words[RANDOM_POOL_WORDS];
+        UINTN avail;
+        INTN supported;
+} random_pool = { .supported = -1 };
+
+static BOOLEAN rdrand64(UINT64 *value)
+{
+        UINTN i;
+#if __LP64__
+        unsigned long long random;
+
+        for (i = 0; i < RDRAND_RETRIES; i++)
+                if (__builtin_ia32_rdrand64_step(&random) == 1) {
+                        *value = random;
+                        return TRUE;
+                }
+#else
+        unsigned int random[2];
+        UINTN j;
+
+        for (j = 0; j < ARRAY_SIZE(random); j++) {
+                for (i = 0; i < RDRAND_RETRIES; i++)
+                        if (__builtin_ia32_rdrand32_step(&random[j]) == 1)
+                                break;
+                if (i == RDRAND_RETRIES)
+                        return FALSE;
+        }
+        *value = ((UINT64)random[1] << 32) | random[0];
+        return TRUE;
+#endif
+        return FALSE;
+}
+
+static EFI_STATUS random_pool_refill(void)
+{
+        UINTN i;
+
+        for (i = 0; i < ARRAY_SIZE(random_pool.words); i++)
+                if (!rdrand64(&random_pool.words[i]))
+                        return EFI_UNSUPPORTED;
+
+        random_pool.avail = sizeof(random_pool.words);
+        return EFI_SUCCESS;
+}
+
+EFI_STATUS generate_random_numbers(CHAR8 *data, UINTN size)
+{
         uint32_t reg[4];
-        int ret;
-        UINTN i, j;
-        unsigned int random;
+        EFI_STATUS ret;
+        UINT64 random;
+        UINTN len;
+        CHAR8 *src;
 
-        cpuid(1, reg);
-        if (!(reg[2] & RDRAND_SUPPORT))
+        if (random_pool.supported == -1) {
+                cpuid(1, reg);
+                random_pool.supported = !!(reg[2] & RDRAND_SUPPORT);
+        }
+        if (!random_pool.supported)
                 return EFI_UNSUPPORTED;
 
-        for (i = 0; i < size; ) {
-                ret = __builtin_ia32_rdrand32_step(&random);
-                if (ret != 1)
-                        return EFI_UNSUPPORTED;
+        while (size) {
+                /* Large requests bypass the pool.  */
+                if (!random_pool.avail && size >= sizeof(random_pool.words)) {
+                        if (!rdrand64(&random))
+                                return EFI_UNSUPPORTED;
+                        memcpy(data, &random, sizeof(random));
+                        data += sizeof(random);
+                        size -= sizeof(random);
+                        continue;
+                }
+
+                if (!random_pool.avail) {
+                        ret = random_pool_refill();
+                        if (EFI_ERROR(ret))
+                                return ret;
+                }
 
-                for (j = 0; j < sizeof(random) && i < size; j++, i++)
-                        data[i] = ((unsigned char *)&random)[j];
+                len = min(size, random_pool.avail);
+                random_pool.avail -= len;
+                src = (CHAR8 *)random_pool.words + random_pool.avail;
+                memcpy(data, src, len);
+                memset(src, 0, len);
+                data += len;
+                size -= len;
         }
 
         return EFI_SUCCESS;
@@ -36,6 +36,7 @@
 #include "log.h"
 #include "lib.h"
 #include "vars.h"
+#include "timer.h"
 
 static SERIAL_IO_INTERFACE *serial;
 
@@ -47,48 +48,145 @@ static SERIAL_IO_INTERFACE *serial;
 #define SERIAL_STOP_BITS	1
 
 #define BUFFER_SIZE 128
-static CHAR16 buf16[BUFFER_SIZE];
 static CHAR8 buf8[BUFFER_SIZE];
 
+/* In asynchronous mode, the messages are queued and a periodic timer
+   writes them to the serial port so that log() callers do not wait
+   for the serial line.  Each tick writes about what the line can
+   transmit during the period.  When the queue is full the messages
+   still reach the log buffer but are not sent to the serial port.
+   The queue is only accessed at TPL_HIGH_LEVEL.  */
+#define SERIAL_QUEUE_SIZE	(16 * 1024)
+#define SERIAL_PERIOD_MS	10
+#define SERIAL_TICK_BYTES	(SERIAL_BAUD_RATE / 10 * SERIAL_PERIOD_MS / 1000)
+
+static struct serial_queue {
+	CHAR8 data[SERIAL_QUEUE_SIZE];
+	UINTN head;
+	UINTN tail;
+	UINTN dropped;
+	UINTN draining;		/* Drains in progress */
+	EFI_EVENT timer;
+} queue;
+
 #define LOG_BUF_SIZE 4096
 static CHAR8 log_buf[LOG_BUF_SIZE];
 static UINTN pos, last_pos;
 
+/* error() saves the log in a non-volatile variable for post-mortem
+   analysis.  As a burst of errors would cause as many flash writes,
+   the log is written at most once per LOG_PERSIST_INTERVAL_US and the
+   pending content is written at the points calling log_persist().  */
+#define LOG_PERSIST_INTERVAL_US	(5 * 1000 * 1000)
+
+static BOOLEAN log_dirty;
+static BOOLEAN log_persisting;
+static UINT64 last_persist_us;
+
+/* Return the content of the log buffer in chronological order.  *BUF
+   is either the log buffer itself or a pool allocated copy if
+   *ALLOCATED is set.  */
+static EFI_STATUS log_linearize(CHAR8 **buf, UINTN *size, BOOLEAN *allocated)
+{
+	CHAR8 *cur;
+
+	if (!last_pos) {
+		*buf = log_buf;
+		*size = pos;
+		*allocated = FALSE;
+		return EFI_SUCCESS;
+	}
+
+	/* Manage roll-over */
+	*size = last_pos < pos ? pos : last_pos;
+	cur = *buf = AllocatePool(*size);
+	if (!*buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	if (pos < last_pos) {
+		memcpy(cur, log_buf + pos, last_pos - pos);
+		cur += last_pos - pos;
+	}
+	memcpy(cur, log_buf, pos);
+	*allocated = TRUE;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS log_dump(void **buf, UINTN *size)
+{
+	EFI_STATUS ret;
+	CHAR8 *data;
+	BOOLEAN allocated;
+
+	ret = log_linearize(&data, size, &allocated);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (allocated) {
+		*buf = data;
+		return EFI_SUCCESS;
+	}
+
+	*buf = AllocatePool(*size ? *size : 1);
+	if (!*buf)
+		return EFI_OUT_OF_RESOURCES;
+	memcpy(*buf, data, *size);
+	return EFI_SUCCESS;
+}
+
 EFI_STATUS log_flush_to_var(BOOLEAN nonvol)
 {
 	EFI_STATUS ret;
-	CHAR8 *buf, *cur;
+	CHAR8 *buf;
 	UINTN size;
+	BOOLEAN allocated;
 
 #ifdef USER
 	if (!device_is_provisioning())
 		return EFI_SUCCESS;
 #endif
 
-	if (last_pos) {		/* Manage roll-over */
-		size = last_pos < pos ? pos : last_pos;
-
-		cur = buf = AllocatePool(size);
-		if (!buf)
-			return EFI_OUT_OF_RESOURCES;
-
-		if (pos < last_pos) {
-			memcpy(buf, log_buf + pos, last_pos - pos);
-			cur += last_pos - pos;
-		}
-		memcpy(cur, log_buf, pos);
-	} else {
-		size = pos;
-		buf = log_buf;
-	}
+	ret = log_linearize(&buf, &size, &allocated);
+	if (EFI_ERROR(ret))
+		return ret;
 
+	log_persisting = TRUE;
 	ret = set_efi_variable(&loader_guid, LOG_VAR,
 			       size, buf, nonvol, TRUE);
-	if (last_pos)
+	log_persisting = FALSE;
+	if (allocated)
 		FreePool(buf);
+
+	if (nonvol && !EFI_ERROR(ret)) {
+		log_dirty = FALSE;
+		last_persist_us = timer_us();
+	}
 	return ret;
 }
 
+void log_error_persist(void)
+{
+	/* The variable write may itself report an error.  */
+	if (log_persisting)
+		return;
+
+	if (last_persist_us &&
+	    timer_us() - last_persist_us < LOG_PERSIST_INTERVAL_US) {
+		log_dirty = TRUE;
+		return;
+	}
+
+	log_flush_to_var(TRUE);
+}
+
+EFI_STATUS log_persist(void)
+{
+	if (!log_dirty || log_persisting)
+		return EFI_SUCCESS;
+
+	return log_flush_to_var(TRUE);
+}
+
 static void log_append_to_buffer(CHAR8 *msg, UINTN length)
 {
 	if (length > LOG_BUF_SIZE)
@@ -126,6 +224,120 @@ static EFI_STATUS serial_init()
 	return EFI_SUCCESS;
 }
 
+static void queue_push(CHAR8 *msg, UINTN length)
+{
+	UINTN room, n;
+	EFI_TPL tpl;
+
+	tpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_HIGH_LEVEL);
+
+	room = SERIAL_QUEUE_SIZE - (queue.head - queue.tail);
+	if (length > room) {
+		queue.dropped += length;
+		goto out;
+	}
+
+	n = min(length, SERIAL_QUEUE_SIZE - queue.head % SERIAL_QUEUE_SIZE);
+	memcpy(queue.data + queue.head % SERIAL_QUEUE_SIZE, msg, n);
+	memcpy(queue.data, msg + n, length - n);
+	queue.head += length;
+
+out:
+	uefi_call_wrapper(BS->RestoreTPL, 1, tpl);
+}
+
+/* Write at most MAX queued bytes to the serial port.  Return FALSE if
+   there was nothing to write or, unless FLUSH, if another drain is in
+   progress.  A flush does not wait for the drain it interrupted,
+   which could not complete before the flush returns.  */
+static BOOLEAN queue_drain(UINTN max, BOOLEAN flush)
+{
+	CHAR8 chunk[256];
+	UINTN length, n, dropped;
+	EFI_TPL tpl;
+
+	tpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_HIGH_LEVEL);
+	if ((queue.draining && !flush) || queue.head == queue.tail) {
+		uefi_call_wrapper(BS->RestoreTPL, 1, tpl);
+		return FALSE;
+	}
+
+	length = min(min(max, sizeof(chunk)), queue.head - queue.tail);
+	n = min(length, SERIAL_QUEUE_SIZE - queue.tail % SERIAL_QUEUE_SIZE);
+	memcpy(chunk, queue.data + queue.tail % SERIAL_QUEUE_SIZE, n);
+	memcpy(chunk + n, queue.data, length - n);
+	queue.tail += length;
+	dropped = queue.dropped;
+	queue.dropped = 0;
+	queue.draining++;
+	uefi_call_wrapper(BS->RestoreTPL, 1, tpl);
+
+	uefi_call_wrapper(serial->Write, 3, serial, &length, chunk);
+	if (dropped) {
+		n = snprintf(chunk, sizeof(chunk),
+			     (CHAR8 *)"[%d log bytes dropped]\n", dropped);
+		if ((INTN)n > 0) {
+			length = n;
+			uefi_call_wrapper(serial->Write, 3, serial, &length, chunk);
+		}
+	}
+
+	queue.draining--;
+	return TRUE;
+}
+
+static void EFIAPI queue_drain_notify(__attribute__((__unused__)) EFI_EVENT event,
+				       __attribute__((__unused__)) void *context)
+{
+	queue_drain(SERIAL_TICK_BYTES, FALSE);
+}
+
+/* Write all the queued messages, synchronously, until the queue is
+   empty.  */
+void log_flush_serial(void)
+{
+	while (queue_drain(SERIAL_QUEUE_SIZE, TRUE))
+		;
+}
+
+EFI_STATUS log_async_start(void)
+{
+	EFI_STATUS ret;
+
+	if (queue.timer)
+		return EFI_SUCCESS;
+
+	if (!serial && EFI_ERROR(serial_init()))
+		return EFI_NOT_READY;
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER | EVT_NOTIFY_SIGNAL,
+				TPL_CALLBACK, queue_drain_notify, NULL,
+				&queue.timer);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = uefi_call_wrapper(BS->SetTimer, 3, queue.timer, TimerPeriodic,
+				SERIAL_PERIOD_MS * 10000);
+	if (EFI_ERROR(ret)) {
+		uefi_call_wrapper(BS->CloseEvent, 1, queue.timer);
+		queue.timer = NULL;
+	}
+
+	return ret;
+}
+
+/* Must be called before the image exits: the timer notification
+   function belongs to the image.  */
+void log_async_stop(void)
+{
+	if (!queue.timer)
+		return;
+
+	uefi_call_wrapper(BS->CloseEvent, 1, queue.timer);
+	queue.timer = NULL;
+	log_flush_serial();
+}
+
 void log(const CHAR16 *fmt, ...)
 {
 	va_list args;
@@ -136,12 +348,11 @@ void log(const CHAR16 *fmt, ...)
 
 	va_start(args, fmt);
 
-	length = VSPrint(buf16, sizeof(buf16), (CHAR16 *)fmt, args) + 1;
-
-	if (EFI_ERROR(str_to_stra(buf8, buf16, length)))
-		goto exit;
+	length = vsnprintf_w(buf8, sizeof(buf8), fmt, args) + 1;
 
-	if (EFI_ERROR(uefi_call_wrapper(serial->Write, 3, serial, &length, buf8)))
+	if (queue.timer)
+		queue_push(buf8, length);
+	else if (EFI_ERROR(uefi_call_wrapper(serial->Write, 3, serial, &length, buf8)))
 		goto exit;
 
 	log_append_to_buffer(buf8, length);
@@ -149,3 +360,64 @@ void log(const CHAR16 *fmt, ...)
 exit:
 	va_end(args);
 }
+
+#define INITIAL_LEVEL(sub) \
+	(LOG_LEVEL_##sub < LOG_LEVEL_DEBUG ? LOG_LEVEL_##sub : LOG_LEVEL_DEBUG)
+
+#define INITIAL_LEVELS {					\
+	[LOG_STORAGE] = INITIAL_LEVEL(STORAGE),			\
+	[LOG_TRANSPORT] = INITIAL_LEVEL(TRANSPORT),		\
+	[LOG_FASTBOOT] = INITIAL_LEVEL(FASTBOOT),		\
+	[LOG_UI] = INITIAL_LEVEL(UI),				\
+	[LOG_SECURITY] = INITIAL_LEVEL(SECURITY)		\
+}
+
+static const UINT8 initial_levels[LOG_SUBSYSTEM_NB] = INITIAL_LEVELS;
+UINT8 log_levels[LOG_SUBSYSTEM_NB] = INITIAL_LEVELS;
+
+static const char *SUBSYSTEM_NAMES[] = {
+	[LOG_STORAGE] = "storage",
+	[LOG_TRANSPORT] = "transport",
+	[LOG_FASTBOOT] = "fastboot",
+	[LOG_UI] = "ui",
+	[LOG_SECURITY] = "security"
+};
+
+/* Parse the "name=level[,name=level...]" LOG_LEVELS_VAR variable,
+   unknown names and malformed entries are ignored.  The subsystems
+   it does not name, all of them if it does not exist, are back to
+   their initial level.  */
+void log_levels_load(void)
+{
+	EFI_STATUS ret;
+	CHAR8 *data, *entry, *value;
+	char *saveptr;
+	UINT32 flags;
+	UINTN size, i;
+
+	memcpy(log_levels, initial_levels, sizeof(log_levels));
+
+	ret = get_efi_variable(&loader_guid, LOG_LEVELS_VAR, &size,
+			       (VOID **)&data, &flags);
+	if (EFI_ERROR(ret))
+		return;
+
+	if (!size || data[size - 1] != '\0')
+		goto exit;
+
+	for (entry = (CHAR8 *)strtok_r((char *)data, ",", &saveptr);
+	     entry;
+	     entry = (CHAR8 *)strtok_r(NULL, ",", &saveptr)) {
+		value = strchr(entry, '=');
+		if (!value || value[1] < '0' || value[1] > '9' || value[2])
+			continue;
+		*value++ = '\0';
+
+		for (i = 0; i < ARRAY_SIZE(SUBSYSTEM_NAMES); i++)
+			if (!strcmp(entry, (CHAR8 *)SUBSYSTEM_NAMES[i]))
+				log_levels[i] = *value - '0';
+	}
+
+exit:
+	FreePool(data);
+}
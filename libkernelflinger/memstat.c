@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "memstat.h"
+#include "trace.h"
+
+/* A peak is recorded in the trace each time it grows by this many
+   bytes, so that the trace shows the growth without being flooded.  */
+#define PEAK_TRACE_STEP	(1024 * 1024)
+
+static const char *TAG_NAMES[] = {
+	[MEMSTAT_DOWNLOAD] = "download",
+	[MEMSTAT_SPARSE] = "sparse",
+	[MEMSTAT_FLASH] = "flash",
+	[MEMSTAT_OPENSSL] = "openssl"
+};
+
+static memstat_t stats[MEMSTAT_TAG_NB];
+static UINT64 traced_peak[MEMSTAT_TAG_NB];
+
+void memstat_alloc(enum memstat_tag tag, UINTN size, BOOLEAN ok)
+{
+	memstat_t *s;
+
+	if (tag >= MEMSTAT_TAG_NB)
+		return;
+
+	s = &stats[tag];
+	if (!ok) {
+		s->failures++;
+		trace(TRACE_ALLOC_FAIL, tag, size);
+		return;
+	}
+
+	s->allocs++;
+	s->current += size;
+	s->largest = max(s->largest, (UINT64)size);
+	if (s->current <= s->peak)
+		return;
+
+	s->peak = s->current;
+	if (s->peak >= traced_peak[tag] + PEAK_TRACE_STEP) {
+		traced_peak[tag] = s->peak;
+		trace(TRACE_ALLOC_PEAK, tag, s->peak);
+	}
+}
+
+void memstat_free(enum memstat_tag tag, UINTN size)
+{
+	if (tag >= MEMSTAT_TAG_NB)
+		return;
+
+	stats[tag].current -= min(stats[tag].current, (UINT64)size);
+}
+
+VOID *memstat_pool(enum memstat_tag tag, UINTN size)
+{
+	VOID *buf = AllocatePool(size);
+
+	memstat_alloc(tag, size, buf != NULL);
+	return buf;
+}
+
+VOID *memstat_zero_pool(enum memstat_tag tag, UINTN size)
+{
+	VOID *buf = AllocateZeroPool(size);
+
+	memstat_alloc(tag, size, buf != NULL);
+	return buf;
+}
+
+void memstat_free_pool(enum memstat_tag tag, VOID *buf, UINTN size)
+{
+	if (!buf)
+		return;
+
+	FreePool(buf);
+	memstat_free(tag, size);
+}
+
+const memstat_t *memstat_get(enum memstat_tag tag)
+{
+	return tag < MEMSTAT_TAG_NB ? &stats[tag] : NULL;
+}
+
+const char *memstat_name(enum memstat_tag tag)
+{
+	return tag < MEMSTAT_TAG_NB ? TAG_NAMES[tag] : "unknown";
+}
@@ -39,8 +39,12 @@
    initialization.  */
 #define CARD_ADDRESS		1
 
+/* EXT_CSD SEC_FEATURE_SUPPORT bits */
+#define SECURE_ER_EN		0x01
+#define SEC_GB_CL_EN		0x10
+
 static EFI_STATUS get_mmc_info(EFI_SD_HOST_IO_PROTOCOL *sdio,
-			       UINTN *erase_grp_size, UINTN *timeout)
+			       struct sdio_erase_info *info)
 {
 	EXT_CSD *ext_csd;
 	void *rawbuffer;
@@ -62,12 +66,33 @@ static EFI_STATUS get_mmc_info(EFI_SD_HOST_IO_PROTOCOL *sdio,
 
 	/* Erase group size is 512Kbyte × HC_ERASE_GRP_SIZE so it's
 	 * 1024 x HC_ERASE_GRP_SIZE in sector count timeout is 300ms x
-	 * ERASE_TIMEOUT_MULT per erase group*/
-	*erase_grp_size = 1024 * ext_csd->HC_ERASE_GRP_SIZE;
-	*timeout = 300 * ext_csd->ERASE_TIMEOUT_MULT;
+	 * ERASE_TIMEOUT_MULT per erase group.  The secure variants
+	 * are only used when supported, their timeout multipliers
+	 * apply on top of it.  TRIM timeout is 300ms x TRIM_MULT.  */
+	ZeroMem(info, sizeof(*info));
+	info->card_address = CARD_ADDRESS;
+	info->emmc = TRUE;
+	info->erase_grp_size = 1024 * ext_csd->HC_ERASE_GRP_SIZE;
+	info->erase_timeout = 300 * ext_csd->ERASE_TIMEOUT_MULT;
+	info->secure = !!(ext_csd->SEC_FEATURE_SUPPORT & SECURE_ER_EN);
+	info->trim = (ext_csd->SEC_FEATURE_SUPPORT & SEC_GB_CL_EN) &&
+		ext_csd->TRIM_MULT;
+	info->trim_timeout = 300 * ext_csd->TRIM_MULT;
+	if (info->secure) {
+		info->erase_timeout *= max(ext_csd->SEC_ERASE_MULT, 1);
+		info->trim_timeout = 300 * ext_csd->ERASE_TIMEOUT_MULT *
+			max(ext_csd->SEC_TRIM_MULT, 1);
+	}
 
-	debug(L"eMMC parameter: erase grp size %d sectors, timeout %d ms",
-	      *erase_grp_size, *timeout);
+	if (!info->erase_grp_size) {
+		error(L"Invalid eMMC erase group size");
+		ret = EFI_DEVICE_ERROR;
+		goto out;
+	}
+
+	debug(L"eMMC parameter: erase grp size %d sectors, timeout %d ms, trim %a, secure %a",
+	      info->erase_grp_size, info->erase_timeout,
+	      info->trim ? "yes" : "no", info->secure ? "yes" : "no");
 
 out:
 	FreePool(rawbuffer);
@@ -124,13 +149,13 @@ BOOLEAN is_emmc(EFI_DEVICE_PATH *p)
 	return FALSE;
 }
 
-static EFI_STATUS mmc_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
-				   UINT64 start, UINT64 end)
+static EFI_STATUS mmc_erase_ranges(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				   struct lba_range *ranges, UINTN nb)
 {
 	EFI_STATUS ret;
 	EFI_SD_HOST_IO_PROTOCOL *sdio;
 	EFI_DEVICE_PATH *dev_path;
-	UINTN erase_grp_size, timeout;
+	struct sdio_erase_info info;
 
 	dev_path = DevicePathFromHandle(handle);
 	if (!dev_path) {
@@ -144,18 +169,26 @@ static EFI_STATUS mmc_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
 		return ret;
 	}
 
-	ret = get_mmc_info(sdio, &erase_grp_size, &timeout);
+	ret = get_mmc_info(sdio, &info);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to get erase group size");
 		return ret;
 	}
 
-	return sdio_erase(sdio, bio, start, end,
-			  CARD_ADDRESS, erase_grp_size, timeout, TRUE);
+	return sdio_erase_ranges(sdio, bio, &info, ranges, nb);
+}
+
+static EFI_STATUS mmc_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				   UINT64 start, UINT64 end)
+{
+	struct lba_range range = { start, end };
+
+	return mmc_erase_ranges(handle, bio, &range, 1);
 }
 
 struct storage STORAGE(STORAGE_EMMC) = {
 	.erase_blocks = mmc_erase_blocks,
+	.erase_ranges = mmc_erase_ranges,
 	.check_logical_unit = mmc_check_logical_unit,
 	.probe = is_emmc,
 	.name = L"eMMC"
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+#include "storage.h"
+#include "pci.h"
+#include "protocol/NvmExpressPassthru.h"
+
+#define NVME_TIMEOUT			300000000	/* 100ns units => 30s */
+#define NVME_ADMIN_IDENTIFY		0x06
+#define NVME_IDENTIFY_CONTROLLER	0x01
+#define NVME_IDENTIFY_SIZE		4096
+#define NVME_ONCS_OFFSET		520
+#define NVME_ONCS_DSM			0x04
+#define NVME_ONCS_WRITE_ZEROES		0x08
+#define NVME_CMD_WRITE_ZEROES		0x08
+#define NVME_CMD_DSM			0x09
+#define NVME_DSM_DEALLOCATE		0x04
+#define NVME_DSM_MAX_RANGES		256
+#define NVME_DSM_MAX_BLOCKS		0xFFFFFFFF
+#define NVME_WRITE_ZEROES_MAX_BLOCKS	0x10000
+
+struct dsm_range {
+	UINT32 attributes;
+	UINT32 nlb;
+	UINT64 slba;
+} __attribute__((packed));
+
+static NVME_NAMESPACE_DEVICE_PATH *get_nvme_device_path(EFI_DEVICE_PATH *p)
+{
+	for (; !IsDevicePathEndType(p); p = NextDevicePathNode(p))
+		if (DevicePathType(p) == MESSAGING_DEVICE_PATH
+		    && DevicePathSubType(p) == MSG_NVME_NAMESPACE_DP)
+			return (NVME_NAMESPACE_DEVICE_PATH *)p;
+
+	return NULL;
+}
+
+static EFI_STATUS nvme_get_namespace(EFI_HANDLE handle,
+				     EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL **nvme,
+				     UINT32 *nsid)
+{
+	EFI_STATUS ret;
+	EFI_GUID NvmePassThruProtocolGuid = EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL_GUID;
+	EFI_DEVICE_PATH *dp;
+	NVME_NAMESPACE_DEVICE_PATH *ns;
+
+	dp = DevicePathFromHandle(handle);
+	if (!dp) {
+		error(L"Failed to get device path from handle");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	ret = get_pci_protocol(dp, &NvmePassThruProtocolGuid, (VOID **)nvme);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get the NVMe root device protocol");
+		return ret;
+	}
+
+	ns = get_nvme_device_path(dp);
+	if (!ns) {
+		error(L"Failed to get NVMe namespace device path");
+		return EFI_NOT_FOUND;
+	}
+
+	*nsid = ns->NamespaceId;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS nvme_command(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *nvme,
+			       UINT32 nsid, UINT8 queue,
+			       EFI_NVM_EXPRESS_COMMAND *cmd,
+			       VOID *buffer, UINT32 length)
+{
+	EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET packet;
+	EFI_NVM_EXPRESS_COMPLETION completion;
+
+	ZeroMem(&packet, sizeof(packet));
+	ZeroMem(&completion, sizeof(completion));
+
+	cmd->Nsid = nsid;
+	packet.CommandTimeout = NVME_TIMEOUT;
+	packet.TransferBuffer = buffer;
+	packet.TransferLength = length;
+	packet.QueueType = queue;
+	packet.NvmeCmd = cmd;
+	packet.NvmeCompletion = &completion;
+
+	return uefi_call_wrapper(nvme->PassThru, 4, nvme, nsid, &packet, NULL);
+}
+
+/* Optional NVM Command Support field of the Identify Controller data */
+static EFI_STATUS nvme_get_oncs(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *nvme,
+				UINT16 *oncs)
+{
+	EFI_NVM_EXPRESS_COMMAND cmd;
+	VOID *buf, *data;
+	EFI_STATUS ret;
+
+	ret = alloc_aligned(&buf, &data, NVME_IDENTIFY_SIZE, nvme->Mode->IoAlign);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ZeroMem(&cmd, sizeof(cmd));
+	cmd.Cdw0.Opcode = NVME_ADMIN_IDENTIFY;
+	cmd.Cdw10 = NVME_IDENTIFY_CONTROLLER;
+	cmd.Flags = CDW10_VALID;
+
+	ret = nvme_command(nvme, 0, NVME_ADMIN_QUEUE, &cmd, data, NVME_IDENTIFY_SIZE);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to identify the NVMe controller");
+	else
+		*oncs = *(UINT16 *)((UINT8 *)data + NVME_ONCS_OFFSET);
+
+	FreePool(buf);
+	return ret;
+}
+
+static EFI_STATUS nvme_dsm_send(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *nvme,
+				UINT32 nsid, struct dsm_range *ranges, UINTN nb)
+{
+	EFI_NVM_EXPRESS_COMMAND cmd;
+	EFI_STATUS ret;
+
+	ZeroMem(&cmd, sizeof(cmd));
+	cmd.Cdw0.Opcode = NVME_CMD_DSM;
+	cmd.Cdw10 = nb - 1;
+	cmd.Cdw11 = NVME_DSM_DEALLOCATE;
+	cmd.Flags = CDW10_VALID | CDW11_VALID;
+
+	ret = nvme_command(nvme, nsid, NVME_IO_QUEUE, &cmd, ranges,
+			   nb * sizeof(*ranges));
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Dataset Management command failed");
+
+	return ret;
+}
+
+/* Deallocate the ranges with Dataset Management commands of up to
+   NVME_DSM_MAX_RANGES ranges each */
+static EFI_STATUS nvme_deallocate(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *nvme,
+				  UINT32 nsid, struct lba_range *ranges, UINTN nb)
+{
+	struct dsm_range *dsm;
+	UINT64 start, count;
+	UINTN i, n = 0;
+	VOID *buf;
+	EFI_STATUS ret;
+
+	ret = alloc_aligned(&buf, (VOID **)&dsm, NVME_DSM_MAX_RANGES * sizeof(*dsm),
+			    nvme->Mode->IoAlign);
+	if (EFI_ERROR(ret)) {
+		error(L"Failed to allocate the Dataset Management ranges");
+		return ret;
+	}
+
+	for (i = 0; i < nb; i++) {
+		for (start = ranges[i].start; start <= ranges[i].end; start += count) {
+			if (n == NVME_DSM_MAX_RANGES) {
+				ret = nvme_dsm_send(nvme, nsid, dsm, n);
+				if (EFI_ERROR(ret))
+					goto out;
+				n = 0;
+			}
+
+			count = min(ranges[i].end - start + 1, (UINT64)NVME_DSM_MAX_BLOCKS);
+			dsm[n].attributes = 0;
+			dsm[n].nlb = count;
+			dsm[n].slba = start;
+			n++;
+		}
+	}
+
+	ret = n ? nvme_dsm_send(nvme, nsid, dsm, n) : EFI_SUCCESS;
+
+out:
+	FreePool(buf);
+	return ret;
+}
+
+static EFI_STATUS nvme_write_zeroes(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *nvme,
+				    UINT32 nsid, UINT64 start, UINT64 end)
+{
+	EFI_NVM_EXPRESS_COMMAND cmd;
+	UINT64 count;
+	EFI_STATUS ret;
+
+	for (; start <= end; start += count) {
+		count = min(end - start + 1, (UINT64)NVME_WRITE_ZEROES_MAX_BLOCKS);
+
+		ZeroMem(&cmd, sizeof(cmd));
+		cmd.Cdw0.Opcode = NVME_CMD_WRITE_ZEROES;
+		cmd.Cdw10 = (UINT32)start;
+		cmd.Cdw11 = (UINT32)(start >> 32);
+		cmd.Cdw12 = count - 1;
+		cmd.Flags = CDW10_VALID | CDW11_VALID | CDW12_VALID;
+
+		ret = nvme_command(nvme, nsid, NVME_IO_QUEUE, &cmd, NULL, 0);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Write Zeroes command failed");
+			return ret;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Deallocate the blocks when the controller supports it, write zeroes
+   otherwise */
+static EFI_STATUS nvme_erase_ranges(EFI_HANDLE handle,
+				    __attribute__((unused)) EFI_BLOCK_IO *bio,
+				    struct lba_range *ranges, UINTN nb)
+{
+	EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *nvme;
+	EFI_STATUS ret;
+	UINT32 nsid;
+	UINT16 oncs;
+	UINTN i;
+
+	ret = nvme_get_namespace(handle, &nvme, &nsid);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = nvme_get_oncs(nvme, &oncs);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (oncs & NVME_ONCS_DSM)
+		return nvme_deallocate(nvme, nsid, ranges, nb);
+
+	if (!(oncs & NVME_ONCS_WRITE_ZEROES)) {
+		debug(L"This NVMe device supports neither Dataset Management nor Write Zeroes");
+		return EFI_UNSUPPORTED;
+	}
+
+	for (i = 0; i < nb; i++) {
+		ret = nvme_write_zeroes(nvme, nsid, ranges[i].start, ranges[i].end);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS nvme_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				    UINT64 start, UINT64 end)
+{
+	struct lba_range range = { start, end };
+
+	return nvme_erase_ranges(handle, bio, &range, 1);
+}
+
+/* This mapping of namespaces is hardcoded for now, like the UFS LUNs
+ * one.
+ */
+#define NSID_USER 1
+#define NSID_FACTORY 2
+#define NSID_UNKNOWN 0
+static UINT32 log_unit_to_nvme_nsid(logical_unit_t log_unit)
+{
+	switch(log_unit) {
+	case LOGICAL_UNIT_USER:
+		return NSID_USER;
+	case LOGICAL_UNIT_FACTORY:
+		return NSID_FACTORY;
+	default:
+		error(L"Unknown logical partition %d", log_unit);
+		return NSID_UNKNOWN;
+	}
+}
+
+static EFI_STATUS nvme_check_logical_unit(EFI_DEVICE_PATH *p, logical_unit_t log_unit)
+{
+	NVME_NAMESPACE_DEVICE_PATH *ns;
+	UINT32 nsid;
+
+	nsid = log_unit_to_nvme_nsid(log_unit);
+	if (nsid == NSID_UNKNOWN)
+		return EFI_NOT_FOUND;
+
+	ns = get_nvme_device_path(p);
+	if (!ns)
+		return EFI_NOT_FOUND;
+
+	return ns->NamespaceId == nsid ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+static BOOLEAN is_nvme(EFI_DEVICE_PATH *p)
+{
+	return get_nvme_device_path(p) != NULL;
+}
+
+struct storage STORAGE(STORAGE_NVME) = {
+	.erase_blocks = nvme_erase_blocks,
+	.erase_ranges = nvme_erase_ranges,
+	.check_logical_unit = nvme_check_logical_unit,
+	.probe = is_nvme,
+	.name = L"NVMe"
+};
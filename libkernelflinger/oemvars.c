@@ -33,6 +33,7 @@
 #include "oemvars.h"
 #include "vars.h"
 #include "text_parser.h"
+#include "bump.h"
 
 enum vartype {
 	VAR_TYPE_UNKNOWN,
@@ -40,47 +41,71 @@ enum vartype {
 	VAR_TYPE_BLOB
 };
 
+/* The variable writes are queued while the file is parsed and issued
+   once it is complete: each SetVariable() call is a flash erase and
+   program cycle on most platforms.  */
+typedef struct oemvar_write {
+	CHAR16 *name;
+	EFI_GUID guid;
+	uint32_t attributes;
+	UINTN size;
+	char *data;
+	INTN growth;		/* size change in the variable store */
+	UINTN lineno;
+} oemvar_write_t;
+
 typedef struct oemvars_ctx {
 	EFI_GUID guid;
 	const EFI_GUID *restricted_guid;
 	BOOLEAN silent_write_error;
+	UINTN lineno;
+	oemvar_write_t *writes;
+	UINTN write_nb;
+	oemvars_stats_t stats;
 } oemvars_ctx_t;
 
-static BOOLEAN parse_oemvar_guid_line(char *line, EFI_GUID *g)
-{
-	EFI_STATUS ret;
-	const CHAR8 *prefix = (CHAR8 *) "GUID";
+static oemvars_stats_t last_stats;
 
-	skip_whitespace(&line);
+static BOOLEAN parse_oemvar_guid_line(text_slice_t line, EFI_GUID *g)
+{
+	static const char PREFIX[] = "GUID";
+	char guid[37];
 
-	if (strncmp(prefix, (CHAR8 *)line, strlen(prefix)) != 0)
+	if (line.len < sizeof(PREFIX) - 1 ||
+	    memcmp(line.ptr, PREFIX, sizeof(PREFIX) - 1))
 		return FALSE;
 
-	line += strlen(prefix);
-	skip_whitespace(&line);
-	if (*line++ != '=')
+	line.ptr += sizeof(PREFIX) - 1;
+	line.len -= sizeof(PREFIX) - 1;
+	text_slice_trim(&line);
+	if (!line.len || *line.ptr != '=')
 		return FALSE;
-	skip_whitespace(&line);
 
-	ret = stra_to_guid(line, g);
-	if (EFI_ERROR(ret))
+	line.ptr++;
+	line.len--;
+	text_slice_trim(&line);
+	if (line.len < sizeof(guid) - 1)
 		return FALSE;
 
-	return TRUE;
+	memcpy(guid, line.ptr, sizeof(guid) - 1);
+	guid[sizeof(guid) - 1] = '\0';
+	return !EFI_ERROR(stra_to_guid(guid, g));
 }
 
-/* Implements modify-in-place "URL-like" escaping: "%[0-9a-fA-F]{2}"
- * converts to the specified byte; no other modifications are
- * performed (including "+" for space!).  Returns the number of output
- * bytes */
-static UINTN unescape_oemvar_val(char *val)
+/* Implements "URL-like" escaping: "%[0-9a-fA-F]{2}" converts to the
+ * specified byte; no other modifications are performed (including
+ * "+" for space!).  The result is written to OUT, which must hold at
+ * least VAL->len + 1 bytes, NUL terminated.  Returns the number of
+ * output bytes, including the NUL */
+static UINTN unescape_oemvar_val(char *out, text_slice_t *val)
 {
-	char *p = val, *out = val;
-	unsigned int byte;
 	char value[3] = { '\0', '\0', '\0' };
+	char *p = val->ptr, *end = val->ptr + val->len, *start = out;
+	unsigned int byte;
 	char *tmp;
-	while (*p) {
-		if (p[0] != '%') {
+
+	while (p < end) {
+		if (p[0] != '%' || end - p < 3) {
 			*out++ = *p++;
 			continue;
 		}
@@ -96,12 +121,11 @@ static UINTN unescape_oemvar_val(char *val)
 		}
 	}
 	*out++ = '\0';
-	return out - val;
+	return out - start;
 }
 
-static int parse_oemvar_attributes(char **linep, uint32_t *attributesp, enum vartype *typep)
+static int parse_oemvar_attributes(text_slice_t *line, uint32_t *attributesp, enum vartype *typep)
 {
-	char *line = *linep;
 	char *pos, *end;
 	/* No point in writing volatile values. Default to both boot and runtime
 	 * access, can remove runtime access with 'b' flag */
@@ -111,25 +135,19 @@ static int parse_oemvar_attributes(char **linep, uint32_t *attributesp, enum var
 	enum vartype type = VAR_TYPE_UNKNOWN;
 
 	/* skip leading whitespace */
-	skip_whitespace(&line);
+	text_slice_trim(line);
 
 	/* Defaults if no attrs set */
-	if (*line != '[')
+	if (!line->len || *line->ptr != '[')
 		goto out;
 
-	line++;
-	pos = line;
-	end = (char *)strchr((CHAR8 *)line, ']');
+	end = text_slice_chr(line, ']');
 	if (!end) {
 		error(L"Unclosed attributes specification");
 		return -1;
 	}
-	*end = '\0';
-	line = end + 1;
 
-	debug(L"found attributes [%a]", pos);
-
-	while (*pos) {
+	for (pos = line->ptr + 1; pos < end; pos++) {
 		switch (*pos) {
 		case 'd':
 			debug(L"raw data type selected");
@@ -151,33 +169,213 @@ static int parse_oemvar_attributes(char **linep, uint32_t *attributesp, enum var
 			error(L"Unknown attribute code '%c'", *pos);
 			return -1;
 		}
-		pos++;
 	}
 
+	line->len -= end + 1 - line->ptr;
+	line->ptr = end + 1;
+
  out:
 	if (type == VAR_TYPE_UNKNOWN)
 		type = VAR_TYPE_STRING;
 
 	*typep = type;
-	*linep = line;
 	*attributesp = attributes;
 
 	return 0;
 }
 
-static EFI_STATUS parse_line(char *line, VOID *context)
+/* Compare the SIZE bytes of DATA with the current content of the
+   variable.  Authenticated variables are always written as their value
+   includes the authentication descriptor.  */
+static BOOLEAN oemvar_unchanged(CHAR16 *name, EFI_GUID *guid,
+				uint32_t attributes, char *data, UINTN size,
+				INTN *growth)
+{
+	EFI_STATUS ret;
+	UINT32 cur_attributes;
+	UINTN cur_size = size + 1;
+	char *cur;
+	BOOLEAN unchanged = FALSE;
+
+	*growth = size;
+	if (attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS)
+		return FALSE;
+
+	cur = bump_alloc(cur_size);
+	if (!cur)
+		return FALSE;
+
+	ret = uefi_call_wrapper(RT->GetVariable, 5, name, guid,
+				&cur_attributes, &cur_size, cur);
+	if (ret == EFI_NOT_FOUND) {
+		unchanged = size == 0;
+		goto out;
+	}
+	if (ret == EFI_BUFFER_TOO_SMALL) {
+		*growth = size - cur_size;
+		goto out;
+	}
+	if (EFI_ERROR(ret))
+		goto out;
+
+	*growth = size - cur_size;
+	if (size == 0)
+		goto out;
+	unchanged = cur_size == size && cur_attributes == attributes &&
+		!memcmp(cur, data, size);
+
+out:
+	bump_free(cur);
+	return unchanged;
+}
+
+static void drop_write(oemvar_write_t *write)
+{
+	bump_free(write->data);
+	bump_free(write->name);
+	write->name = NULL;
+}
+
+/* A later definition of a variable replaces the queued one so that
+   the writes can be reordered.  */
+static void queue_write(oemvars_ctx_t *ctx, CHAR16 *name, uint32_t attributes,
+			char *data, UINTN size)
+{
+	oemvar_write_t *write;
+	INTN growth;
+	UINTN i;
+
+	for (i = 0; i < ctx->write_nb; i++) {
+		write = &ctx->writes[i];
+		if (write->name && !StrCmp(write->name, name) &&
+		    !memcmp(&write->guid, &ctx->guid, sizeof(ctx->guid))) {
+			drop_write(write);
+			break;
+		}
+	}
+
+	if (oemvar_unchanged(name, &ctx->guid, attributes, data, size, &growth)) {
+		ctx->stats.unchanged++;
+		bump_free(data);
+		bump_free(name);
+		return;
+	}
+
+	write = &ctx->writes[ctx->write_nb++];
+	write->name = name;
+	write->guid = ctx->guid;
+	write->attributes = attributes;
+	write->size = size;
+	write->data = data;
+	write->growth = growth;
+	write->lineno = ctx->lineno;
+}
+
+/* Deletions first, then by increasing size change so that the space
+   released by the shrinking variables is available to the growing
+   ones and the variable store is reclaimed as little as possible.  */
+static BOOLEAN write_before(oemvar_write_t *a, oemvar_write_t *b)
+{
+	if (!a->size != !b->size)
+		return !a->size;
+	if (a->growth != b->growth)
+		return a->growth < b->growth;
+	return a->lineno < b->lineno;
+}
+
+static BOOLEAN is_authenticated(oemvar_write_t *write)
+{
+	return !!(write->attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS);
+}
+
+/* Index of the last plain write before END, END if there is none.  */
+static UINTN prev_plain(oemvar_write_t *writes, UINTN end)
+{
+	UINTN i = end;
+
+	while (i > 0)
+		if (!is_authenticated(&writes[--i]))
+			return i;
+
+	return end;
+}
+
+/* The authenticated writes keep their place: the secure boot
+   variables must be written in the order of the file, db and KEK
+   before PK for instance.  Only the plain writes are sorted, among
+   the slots they occupy.  */
+static void sort_writes(oemvar_write_t *writes, UINTN nb)
+{
+	oemvar_write_t tmp;
+	UINTN i, j, p;
+
+	for (i = 1; i < nb; i++) {
+		if (is_authenticated(&writes[i]))
+			continue;
+		tmp = writes[i];
+		for (j = i; (p = prev_plain(writes, j)) != j &&
+			     write_before(&tmp, &writes[p]); j = p)
+			writes[j] = writes[p];
+		writes[j] = tmp;
+	}
+}
+
+static EFI_STATUS issue_writes(oemvars_ctx_t *ctx)
+{
+	oemvar_write_t *write;
+	EFI_STATUS ret;
+	UINTN i;
+
+	sort_writes(ctx->writes, ctx->write_nb);
+
+	for (i = 0; i < ctx->write_nb; i++) {
+		write = &ctx->writes[i];
+		if (!write->name)
+			continue;
+
+		debug(L"Setting oemvar: %s", write->name);
+		ret = uefi_call_wrapper(RT->SetVariable, 5, write->name,
+					&write->guid, write->attributes,
+					write->size, write->data);
+		efi_variable_cache_invalidate(&write->guid, write->name);
+		/* Delete a non-existent variable is permitted.  */
+		if (EFI_ERROR(ret) && !(ret == EFI_NOT_FOUND && write->size == 0)) {
+			if (!ctx->silent_write_error) {
+				efi_perror(ret, L"EFI variable setting failed at line %d",
+					   write->lineno);
+				return ret;
+			}
+			debug(L"EFI variable setting failed: %r", ret);
+			debug(L"silent error is on, continue anyway");
+			continue;
+		}
+
+		if (write->size)
+			ctx->stats.written++;
+		else
+			ctx->stats.deleted++;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* The variable name and value are the only copies made, in the bump
+   allocator, and kept until the writes are issued.  */
+static EFI_STATUS parse_line(text_slice_t line, oemvars_ctx_t *ctx)
 {
 	EFI_STATUS ret;
 	uint32_t attributes;
 	enum vartype type;
 	CHAR16 *varname;
-	UINTN vallen;
-	char  *var, *val, *p;
-	oemvars_ctx_t *ctx = (oemvars_ctx_t *)context;
+	UINTN vallen, i;
+	text_slice_t var;
+	char *val = NULL, *p;
 
 	/* Snip comments */
-	if ((p = (char *)strchr((CHAR8 *)line, '#')))
-		*p = 0;
+	if ((p = text_slice_chr(&line, '#'))) {
+		line.len = p - line.ptr;
+		text_slice_trim(&line);
+	}
 
 	/* GUID line syntax */
 	if (parse_oemvar_guid_line(line, &ctx->guid)) {
@@ -195,77 +393,70 @@ static EFI_STATUS parse_line(char *line, VOID *context)
 	}
 
 	/* Variable definition? */
-	skip_whitespace(&line);
-	var = line;
-	val = NULL;
-	while (*line && !isspace(*line)) line++;
-	if (*line) {
-		*line++ = 0;
-		skip_whitespace(&line);
-		val = line;
-	}
-
-	if (!*var)
+	if (!text_next_token(&line, &var))
 		return EFI_SUCCESS;
+	text_slice_trim(&line);
+
+	varname = bump_alloc((var.len + 1) * sizeof(*varname));
+	if (!varname) {
+		error(L"Failed to convert varname string.");
+		return EFI_OUT_OF_RESOURCES;
+	}
+	for (i = 0; i < var.len; i++)
+		varname[i] = var.ptr[i];
+	varname[i] = 0;
+
+	vallen = 0;
+	if (line.len) {
+		val = bump_alloc(line.len + 1);
+		if (!val) {
+			ret = EFI_OUT_OF_RESOURCES;
+			goto exit;
+		}
 
-	if (val) {
 		switch (type) {
 		case VAR_TYPE_BLOB:
-			vallen = unescape_oemvar_val(val) - 1;
+			vallen = unescape_oemvar_val(val, &line) - 1;
 			break;
 		case VAR_TYPE_STRING:
-			vallen = unescape_oemvar_val(val);
+			vallen = unescape_oemvar_val(val, &line);
 			break;
 		default:
-			return EFI_INVALID_PARAMETER;
+			ret = EFI_INVALID_PARAMETER;
+			goto exit;
 		}
-	} else {
-		vallen = 0;
-	}
-
-	varname = stra_to_str((CHAR8 *)var);
-	if (!varname) {
-		error(L"Failed to convert varname string.");
-		return EFI_INVALID_PARAMETER;
 	}
 
 	if (!memcmp(&ctx->guid, &fastboot_guid, sizeof(ctx->guid))) {
 #ifdef BOOTLOADER_POLICY_EFI_VAR
-		UINTN i;
-
 		for (i = 0; i < FASTBOOT_SECURED_VARS_SIZE; i++)
 			if (!StrCmp((CHAR16 *)FASTBOOT_SECURED_VARS[i], varname))
 				break;
 
 		if (i == FASTBOOT_SECURED_VARS_SIZE) {
 			error(L"fastboot GUID is reserved for Kernelflinger use");
-			return EFI_ACCESS_DENIED;
+			ret = EFI_ACCESS_DENIED;
+			goto exit;
 		}
 
-		if (!(attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS))
-			return EFI_ACCESS_DENIED;
+		if (!(attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS)) {
+			ret = EFI_ACCESS_DENIED;
+			goto exit;
+		}
 #else
 		error(L"fastboot GUID is reserved for Kernelflinger use");
-		return EFI_ACCESS_DENIED;
+		ret = EFI_ACCESS_DENIED;
+		goto exit;
 #endif
 	}
 
-	debug(L"Setting oemvar: %a", var);
-	ret = uefi_call_wrapper(RT->SetVariable, 5, varname,
-				&ctx->guid, attributes,
-				vallen, val);
-	FreePool(varname);
-	/* Delete a non-existent variable is permitted.  */
-	if (EFI_ERROR(ret) && !(ret == EFI_NOT_FOUND && vallen == 0)) {
-		if (!ctx->silent_write_error) {
-			efi_perror(ret, L"EFI variable setting failed");
-			return ret;
-		}
-		debug(L"EFI variable setting failed: %r", ret);
-		debug(L"silent error is on, continue anyway");
-	}
-
+	queue_write(ctx, varname, attributes, val, vallen);
 	return EFI_SUCCESS;
+
+exit:
+	bump_free(val);
+	bump_free(varname);
+	return ret;
 }
 
 /*
@@ -313,9 +504,42 @@ static EFI_STATUS _flash_oemvars(VOID *data, UINTN size,
 		.restricted_guid = restricted_guid,
 		.silent_write_error = silent_error
 	};
+	text_iter_t it;
+	text_slice_t line;
+	EFI_STATUS ret = EFI_SUCCESS;
+	UINTN nb = 0, i, mark = bump_mark();
 
 	debug(L"Parsing and setting values from oemvars file");
-	return parse_text_buffer(data, size, parse_line, &ctx);
+	text_iter_init(&it, data, size);
+	while (text_next_line(&it, &line))
+		nb++;
+
+	ctx.writes = AllocatePool(max(nb, (UINTN)1) * sizeof(*ctx.writes));
+	if (!ctx.writes)
+		return EFI_OUT_OF_RESOURCES;
+
+	text_iter_init(&it, data, size);
+	while (text_next_line(&it, &line)) {
+		ctx.lineno = it.lineno;
+		ret = parse_line(line, &ctx);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed at line %d", it.lineno);
+			goto exit;
+		}
+	}
+
+	ret = issue_writes(&ctx);
+	debug(L"oemvars: %d written, %d deleted, %d unchanged",
+	      ctx.stats.written, ctx.stats.deleted, ctx.stats.unchanged);
+	last_stats = ctx.stats;
+
+exit:
+	for (i = ctx.write_nb; i > 0; i--)
+		if (ctx.writes[i - 1].name)
+			drop_write(&ctx.writes[i - 1]);
+	FreePool(ctx.writes);
+	bump_release(mark);
+	return ret;
 }
 
 EFI_STATUS flash_oemvars_silent_write_error(VOID *data, UINTN size,
@@ -328,3 +552,8 @@ EFI_STATUS flash_oemvars(VOID *data, UINTN size)
 {
 	return _flash_oemvars(data, size, NULL, FALSE);
 }
+
+void oemvars_get_stats(oemvars_stats_t *stats)
+{
+	*stats = last_stats;
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <uefi_utils.h>
+
+#include "parallel.h"
+#include "protocol/MpService.h"
+
+#define MAX_WORKERS 64
+
+/* Items [next, end) of a worker queue.  NEXT is incremented by the
+   owner and by the thieves alike so an item is only taken once.  */
+static struct queue {
+	volatile UINTN next;
+	UINTN end;
+} __attribute__((aligned(64))) queues[MAX_WORKERS];
+
+static struct {
+	BOOLEAN initialized;
+	EFI_MP_SERVICES_PROTOCOL *mp;
+	EFI_EVENT event;
+	UINTN workers;
+	BOOLEAN busy;
+	BOOLEAN pending;	/* APs run not waited for yet */
+	parallel_work_t work;
+	VOID *arg;
+	volatile UINTN next_worker;
+	volatile UINTN done;
+} pool;
+
+EFI_STATUS parallel_init(void)
+{
+	EFI_GUID mp_guid = EFI_MP_SERVICES_PROTOCOL_GUID;
+	UINTN nb, enabled;
+	EFI_STATUS ret;
+
+	if (pool.initialized)
+		return pool.mp ? EFI_SUCCESS : EFI_UNSUPPORTED;
+
+	pool.initialized = TRUE;
+	pool.workers = 1;
+
+	ret = LibLocateProtocol(&mp_guid, (VOID **)&pool.mp);
+	if (EFI_ERROR(ret))
+		goto serial;
+
+	ret = uefi_call_wrapper(pool.mp->GetNumberOfProcessors, 3, pool.mp,
+				&nb, &enabled);
+	if (EFI_ERROR(ret) || enabled < 2) {
+		ret = EFI_ERROR(ret) ? ret : EFI_UNSUPPORTED;
+		goto serial;
+	}
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+				&pool.event);
+	if (EFI_ERROR(ret))
+		goto serial;
+
+	pool.workers = min(enabled, (UINTN)MAX_WORKERS);
+	debug(L"%d processors available for parallel work", pool.workers);
+	return EFI_SUCCESS;
+
+serial:
+	debug(L"Parallel work runs on the BSP only: %r", ret);
+	pool.mp = NULL;
+	return ret;
+}
+
+UINTN parallel_workers(void)
+{
+	parallel_init();
+	return pool.workers;
+}
+
+static BOOLEAN take(struct queue *q, UINTN *index)
+{
+	if (q->next >= q->end)
+		return FALSE;
+
+	*index = __sync_fetch_and_add(&q->next, 1);
+	return *index < q->end;
+}
+
+static void run(UINTN self)
+{
+	UINTN i, index;
+
+	while (take(&queues[self], &index)) {
+		pool.work(pool.arg, index);
+		__sync_fetch_and_add(&pool.done, 1);
+	}
+
+	for (i = 1; i < pool.workers; i++)
+		while (take(&queues[(self + i) % pool.workers], &index)) {
+			pool.work(pool.arg, index);
+			__sync_fetch_and_add(&pool.done, 1);
+		}
+}
+
+static VOID EFIAPI ap_procedure(__attribute__((__unused__)) VOID *arg)
+{
+	UINTN self = __sync_add_and_fetch(&pool.next_worker, 1);
+
+	/* More processors than expected */
+	if (self >= pool.workers)
+		return;
+
+	run(self);
+}
+
+static EFI_TPL current_tpl(void)
+{
+	EFI_TPL tpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_HIGH_LEVEL);
+
+	uefi_call_wrapper(BS->RestoreTPL, 1, tpl);
+	return tpl;
+}
+
+/* The MP services only notice that the APs are done from a timer
+   event and the event can only be waited for at TPL_APPLICATION.  */
+static BOOLEAN wait_aps(void)
+{
+	UINTN index;
+
+	if (!pool.pending)
+		return TRUE;
+
+	if (current_tpl() != TPL_APPLICATION)
+		return FALSE;
+
+	uefi_call_wrapper(BS->WaitForEvent, 3, 1, &pool.event, &index);
+	pool.pending = FALSE;
+	return TRUE;
+}
+
+EFI_STATUS parallel_for(UINTN count, parallel_work_t work,
+			parallel_progress_t progress, VOID *arg)
+{
+	BOOLEAN started = FALSE;
+	UINTN i, share, reported = 0, idx;
+	EFI_STATUS ret;
+
+	if (!work)
+		return EFI_INVALID_PARAMETER;
+
+	/* A work item cannot start nested parallel work */
+	if (pool.busy) {
+		for (i = 0; i < count; i++)
+			work(arg, i);
+		return EFI_SUCCESS;
+	}
+
+	parallel_init();
+	wait_aps();
+	pool.busy = TRUE;
+	pool.work = work;
+	pool.arg = arg;
+	pool.done = 0;
+	pool.next_worker = 0;
+
+	share = DIV_ROUND_UP(count, pool.workers);
+	for (i = 0; i < pool.workers; i++) {
+		queues[i].next = min(i * share, count);
+		queues[i].end = min((i + 1) * share, count);
+	}
+
+	if (pool.mp && count > 1) {
+		ret = uefi_call_wrapper(pool.mp->StartupAllAPs, 7, pool.mp,
+					ap_procedure, FALSE, pool.event, 0,
+					NULL, NULL);
+		started = !EFI_ERROR(ret);
+		if (!started)
+			debug(L"Failed to start the APs, serial execution: %r", ret);
+	}
+
+	/* The BSP works through its queue then steals from the other
+	   ones, which covers the APs which did not start.  */
+	while (take(&queues[0], &idx)) {
+		work(arg, idx);
+		__sync_fetch_and_add(&pool.done, 1);
+		if (progress)
+			progress(arg, pool.done, count);
+	}
+	for (i = 1; i < pool.workers; i++)
+		while (take(&queues[i], &idx)) {
+			work(arg, idx);
+			__sync_fetch_and_add(&pool.done, 1);
+			if (progress)
+				progress(arg, pool.done, count);
+		}
+
+	/* Join: wait for the items the APs are on */
+	while (pool.done != count) {
+		asm volatile("pause" ::: "memory");
+		if (progress && pool.done != reported) {
+			reported = pool.done;
+			progress(arg, reported, count);
+		}
+	}
+	if (progress && reported != count)
+		progress(arg, count, count);
+
+	/* Otherwise, the next StartupAllAPs() call may fail and the
+	   work then runs serially.  */
+	pool.pending = started;
+	wait_aps();
+
+	pool.busy = FALSE;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS parallel_exit(void)
+{
+	if (!pool.initialized)
+		return EFI_SUCCESS;
+
+	if (!wait_aps()) {
+		error(L"Parallel work exit must run at TPL_APPLICATION");
+		return EFI_NOT_READY;
+	}
+
+	if (pool.event)
+		uefi_call_wrapper(BS->CloseEvent, 1, pool.event);
+
+	ZeroMem(&pool, sizeof(pool));
+	return EFI_SUCCESS;
+}
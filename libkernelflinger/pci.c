@@ -44,29 +44,115 @@ PCI_DEVICE_PATH* get_pci_device_path(EFI_DEVICE_PATH *p)
 	return NULL;
 }
 
-EFI_STATUS get_pci_device(IN EFI_DEVICE_PATH *p, OUT EFI_PCI_IO **p_pciio)
+/* Protocols of the PCI controllers, keyed by the device path up to
+   the last PCI node: the boot device is looked up many times.  */
+#define PCI_CACHE_ENTRIES	8
+#define PCI_CACHE_PATH_MAX	64
+
+static struct pci_cache_entry {
+	EFI_GUID guid;
+	UINTN path_len;
+	UINT8 path[PCI_CACHE_PATH_MAX];
+	VOID *interface;
+} pci_cache[PCI_CACHE_ENTRIES];
+static UINTN pci_cache_next;
+
+static struct {
+	EFI_PCI_IO *pciio;
+	pci_device_ids_t ids;
+} pci_ids_cache[PCI_CACHE_ENTRIES];
+static UINTN pci_ids_cache_next;
+
+/* Length of the device path P up to the end of its last PCI node, 0
+   if it has none.  */
+static UINTN pci_path_len(EFI_DEVICE_PATH *p)
 {
+	EFI_DEVICE_PATH *start = p;
+	UINTN len = 0;
+
+	while (!IsDevicePathEndType(p)) {
+		p = NextDevicePathNode(p);
+		if (DevicePathType(start) == HARDWARE_DEVICE_PATH &&
+		    DevicePathSubType(start) == HW_PCI_DP)
+			len = (UINT8 *)p - (UINT8 *)start;
+		start = p;
+	}
+
+	return len;
+}
+
+EFI_STATUS get_pci_protocol(IN EFI_DEVICE_PATH *p, IN EFI_GUID *guid,
+			    OUT VOID **interface)
+{
+	struct pci_cache_entry *entry;
+	EFI_DEVICE_PATH *remaining = p;
+	EFI_HANDLE handle;
 	EFI_STATUS ret;
-	EFI_HANDLE pci_handle;
-	EFI_DEVICE_PATH *tmp_path = p;
+	UINTN len, i;
 
-	ret = locate_device_path(&PciIoProtocol, &tmp_path, &pci_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to locate handle for EFI_PCI_IO_PROTOCOL");
-		return ret;
+	len = pci_path_len(p);
+	for (i = 0; len && i < PCI_CACHE_ENTRIES; i++) {
+		entry = &pci_cache[i];
+		if (entry->interface && entry->path_len == len &&
+		    !CompareGuid(&entry->guid, guid) &&
+		    !CompareMem(entry->path, p, len)) {
+			*interface = entry->interface;
+			return EFI_SUCCESS;
+		}
 	}
 
-	ret = handle_protocol(pci_handle, &PciIoProtocol, (void**)p_pciio);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to open PciIoProtocol");
+	ret = locate_device_path(guid, &remaining, &handle);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = handle_protocol(handle, guid, interface);
+	if (EFI_ERROR(ret))
 		return ret;
+
+	/* Only the protocols of the PCI controller itself are cached,
+	   the lookup of a protocol of a child device depends on the
+	   rest of the path.  */
+	if (len && len <= PCI_CACHE_PATH_MAX &&
+	    (UINT8 *)remaining - (UINT8 *)p == (INTN)len) {
+		entry = &pci_cache[pci_cache_next++ % PCI_CACHE_ENTRIES];
+		CopyMem(&entry->guid, guid, sizeof(entry->guid));
+		CopyMem(entry->path, p, len);
+		entry->path_len = len;
+		entry->interface = *interface;
 	}
 
 	return EFI_SUCCESS;
 }
 
+EFI_STATUS get_pci_device(IN EFI_DEVICE_PATH *p, OUT EFI_PCI_IO **p_pciio)
+{
+	EFI_STATUS ret;
+
+	ret = get_pci_protocol(p, &PciIoProtocol, (VOID **)p_pciio);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to get the PciIoProtocol");
+
+	return ret;
+}
+
 EFI_STATUS get_pci_ids(IN EFI_PCI_IO *pciio, OUT pci_device_ids_t *ids)
 {
-	return uefi_call_wrapper(pciio->Pci.Read, 5, pciio, EfiPciIoWidthUint16,
-				 0, 2, ids);
+	EFI_STATUS ret;
+	UINTN i;
+
+	for (i = 0; i < PCI_CACHE_ENTRIES; i++)
+		if (pci_ids_cache[i].pciio == pciio) {
+			*ids = pci_ids_cache[i].ids;
+			return EFI_SUCCESS;
+		}
+
+	ret = uefi_call_wrapper(pciio->Pci.Read, 5, pciio, EfiPciIoWidthUint16,
+				0, 2, ids);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	i = pci_ids_cache_next++ % PCI_CACHE_ENTRIES;
+	pci_ids_cache[i].pciio = pciio;
+	pci_ids_cache[i].ids = *ids;
+	return EFI_SUCCESS;
 }
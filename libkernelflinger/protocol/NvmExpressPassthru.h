@@ -0,0 +1,137 @@
+/** @file
+    NVM Express Pass Thru protocol as defined in the UEFI 2.5
+    specification.
+
+    The NVM Express Pass Thru protocol lets a driver send NVM Express
+    admin and I/O commands to the namespaces of a controller.
+
+    Copyright (c) 2013 - 2015, Intel Corporation. All rights reserved.<BR>
+    This program and the accompanying materials
+    are licensed and made available under the terms and conditions of the BSD License
+    which accompanies this distribution.  The full text of the license may be found at
+    http://opensource.org/licenses/bsd-license.php
+
+    THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+    WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#ifndef __NVM_EXPRESS_PASS_THRU_H__
+#define __NVM_EXPRESS_PASS_THRU_H__
+
+#include <efi.h>
+
+#define EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL_GUID				\
+	{								\
+		0x52c78312, 0x8edc, 0x4233, {0x98, 0xf2, 0x1a, 0x1a, 0xa5, 0xe3, 0x88, 0xa5} \
+	}
+
+#ifndef MSG_NVME_NAMESPACE_DP
+#define MSG_NVME_NAMESPACE_DP		0x17
+
+typedef struct {
+	EFI_DEVICE_PATH Header;
+	UINT32 NamespaceId;
+	UINT64 NamespaceUuid;
+} NVME_NAMESPACE_DEVICE_PATH;
+#endif
+
+typedef struct _EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL;
+
+typedef struct {
+	UINT32 Attributes;
+	UINT32 IoAlign;
+	UINT32 NvmeVersion;
+} EFI_NVM_EXPRESS_PASS_THRU_MODE;
+
+#define NVME_ADMIN_QUEUE		0x00
+#define NVME_IO_QUEUE			0x01
+
+typedef struct {
+	UINT32 Opcode:8;
+	UINT32 FusedOperation:2;
+	UINT32 Reserved:22;
+} NVME_CDW0;
+
+#define CDW2_VALID			0x01
+#define CDW3_VALID			0x02
+#define CDW10_VALID			0x04
+#define CDW11_VALID			0x08
+#define CDW12_VALID			0x10
+#define CDW13_VALID			0x20
+#define CDW14_VALID			0x40
+#define CDW15_VALID			0x80
+
+typedef struct {
+	NVME_CDW0 Cdw0;
+	UINT8 Flags;
+	UINT32 Nsid;
+	UINT32 Cdw2;
+	UINT32 Cdw3;
+	UINT32 Cdw10;
+	UINT32 Cdw11;
+	UINT32 Cdw12;
+	UINT32 Cdw13;
+	UINT32 Cdw14;
+	UINT32 Cdw15;
+} EFI_NVM_EXPRESS_COMMAND;
+
+typedef struct {
+	UINT32 DW0;
+	UINT32 DW1;
+	UINT32 DW2;
+	UINT32 DW3;
+} EFI_NVM_EXPRESS_COMPLETION;
+
+typedef struct {
+	UINT64 CommandTimeout;
+	VOID *TransferBuffer;
+	UINT32 TransferLength;
+	VOID *MetadataBuffer;
+	UINT32 MetadataLength;
+	UINT8 QueueType;
+	EFI_NVM_EXPRESS_COMMAND *NvmeCmd;
+	EFI_NVM_EXPRESS_COMPLETION *NvmeCompletion;
+} EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET;
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_NVM_EXPRESS_PASS_THRU_PASSTHRU) (
+	IN EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *This,
+	IN UINT32 NamespaceId,
+	IN OUT EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET *Packet,
+	IN EFI_EVENT Event OPTIONAL
+	);
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_NVM_EXPRESS_PASS_THRU_GET_NEXT_NAMESPACE) (
+	IN EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *This,
+	IN OUT UINT32 *NamespaceId
+	);
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_NVM_EXPRESS_PASS_THRU_BUILD_DEVICE_PATH) (
+	IN EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *This,
+	IN UINT32 NamespaceId,
+	OUT EFI_DEVICE_PATH **DevicePath
+	);
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_NVM_EXPRESS_PASS_THRU_GET_NAMESPACE) (
+	IN EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *This,
+	IN EFI_DEVICE_PATH *DevicePath,
+	OUT UINT32 *NamespaceId
+	);
+
+struct _EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL {
+	EFI_NVM_EXPRESS_PASS_THRU_MODE *Mode;
+	EFI_NVM_EXPRESS_PASS_THRU_PASSTHRU PassThru;
+	EFI_NVM_EXPRESS_PASS_THRU_GET_NEXT_NAMESPACE GetNextNamespace;
+	EFI_NVM_EXPRESS_PASS_THRU_BUILD_DEVICE_PATH BuildDevicePath;
+	EFI_NVM_EXPRESS_PASS_THRU_GET_NAMESPACE GetNamespace;
+};
+
+#endif	/* __NVM_EXPRESS_PASS_THRU_H__ */
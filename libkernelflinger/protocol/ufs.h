@@ -38,6 +38,9 @@
 #define CDB_LENGTH			10
 #define BLOCK_TIMEOUT			10000	/* 100ns units => 1ms by block */
 #define UFS_UNMAP			0x42
+#define UFS_INQUIRY			0x12
+#define INQUIRY_EVPD			0x01
+#define VPD_BLOCK_LIMITS		0xB0
 
 struct command_descriptor_block {
 	__be8 op_code;		/* Operation Code (must be 0x42 for unmap) */
@@ -57,9 +60,27 @@ struct unmap_block_descriptor {
 
 struct unmap_parameter {
 	__be16 data_length; /* length in bytes of the following data */
-	__be16 block_desc_length; /* length in bytes of the unmap block descriptor */
+	__be16 block_desc_length; /* length in bytes of the unmap block descriptors */
 	__be32 reserved;
-	struct unmap_block_descriptor block_desc;
+	struct unmap_block_descriptor block_desc[];
+} __attribute__((packed));
+
+struct inquiry_cdb {
+	__be8 op_code;		/* Operation Code (must be 0x12 for inquiry) */
+	__be8 flags;		/* EVPD is bit 0 */
+	__be8 page_code;	/* vital product data page */
+	__be16 alloc_length;	/* allocation length */
+	__be8 control;		/* must be 0 */
+} __attribute__((packed));
+
+struct vpd_block_limits {
+	__be8 device_type;
+	__be8 page_code;	/* must be 0xB0 */
+	__be16 page_length;
+	__be8 reserved[16];
+	__be32 max_unmap_lba_count;	/* LBAs per UNMAP command */
+	__be32 max_unmap_desc_count;	/* block descriptors per UNMAP command */
+	__be8 reserved2[36];
 } __attribute__((packed));
 
 #endif	/* _UFS_PROTOCOL_H_ */
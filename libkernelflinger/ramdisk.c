@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+#include "storage.h"
+#include "gpt.h"
+#include "ramdisk.h"
+
+/* The PCI node makes the RAM disk a boot device candidate, the
+   vendor node identifies it.  No actual PCI device uses these
+   device and function numbers.  */
+#define RAMDISK_PCI_DEVICE	0xFF
+#define RAMDISK_PCI_FUNCTION	0xFF
+#define RAMDISK_MIN_SIZE	(64 * MiB)
+
+static EFI_GUID ramdisk_guid = { 0x3c8c7e1a, 0x5d4b, 0x4e0f,
+				 { 0x9a, 0x26, 0x71, 0x0b, 0x7e, 0x41, 0xd2, 0x5c } };
+
+static EFI_GUID linux_data_guid = { 0x0fc63daf, 0x8483, 0x4772,
+				    { 0x8e, 0x79, 0x3d, 0x69, 0xd8, 0x47, 0x7d, 0xe4 } };
+
+struct ramdisk_device_path {
+	PCI_DEVICE_PATH pci;
+	VENDOR_DEVICE_PATH vendor;
+	EFI_DEVICE_PATH end;
+} __attribute__((packed));
+
+static struct ramdisk {
+	EFI_HANDLE handle;
+	UINT8 *data;
+	UINT32 latency_us;
+	EFI_BLOCK_IO_MEDIA media;
+	EFI_BLOCK_IO bio;
+	EFI_DISK_IO dio;
+	struct ramdisk_device_path dp;
+} ramdisk;
+
+static EFI_STATUS check_transfer(UINT32 media_id, UINT64 offset,
+				 UINTN size, VOID *buffer)
+{
+	UINT64 disk_size;
+
+	if (media_id != ramdisk.media.MediaId)
+		return EFI_MEDIA_CHANGED;
+
+	if (!buffer)
+		return EFI_INVALID_PARAMETER;
+
+	disk_size = (ramdisk.media.LastBlock + 1) * ramdisk.media.BlockSize;
+	if (offset > disk_size || size > disk_size - offset)
+		return EFI_INVALID_PARAMETER;
+
+	if (ramdisk.latency_us)
+		uefi_call_wrapper(BS->Stall, 1, ramdisk.latency_us);
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS check_blocks(UINT32 media_id, EFI_LBA lba,
+			       UINTN size, VOID *buffer)
+{
+	if (size % ramdisk.media.BlockSize)
+		return EFI_BAD_BUFFER_SIZE;
+
+	if (ramdisk.media.IoAlign > 1 &&
+	    (UINTN)buffer & (ramdisk.media.IoAlign - 1))
+		return EFI_INVALID_PARAMETER;
+
+	if (lba > ramdisk.media.LastBlock)
+		return EFI_INVALID_PARAMETER;
+
+	return check_transfer(media_id, lba * ramdisk.media.BlockSize,
+			      size, buffer);
+}
+
+static EFI_STATUS EFIAPI ramdisk_reset(__attribute__((__unused__)) EFI_BLOCK_IO *bio,
+				       __attribute__((__unused__)) BOOLEAN verify)
+{
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI ramdisk_read_blocks(__attribute__((__unused__)) EFI_BLOCK_IO *bio,
+					     UINT32 media_id, EFI_LBA lba,
+					     UINTN size, VOID *buffer)
+{
+	EFI_STATUS ret;
+
+	ret = check_blocks(media_id, lba, size, buffer);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	memcpy(buffer, ramdisk.data + lba * ramdisk.media.BlockSize, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI ramdisk_write_blocks(__attribute__((__unused__)) EFI_BLOCK_IO *bio,
+					      UINT32 media_id, EFI_LBA lba,
+					      UINTN size, VOID *buffer)
+{
+	EFI_STATUS ret;
+
+	ret = check_blocks(media_id, lba, size, buffer);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	memcpy(ramdisk.data + lba * ramdisk.media.BlockSize, buffer, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI ramdisk_flush_blocks(__attribute__((__unused__)) EFI_BLOCK_IO *bio)
+{
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI ramdisk_read_disk(__attribute__((__unused__)) EFI_DISK_IO *dio,
+					   UINT32 media_id, UINT64 offset,
+					   UINTN size, VOID *buffer)
+{
+	EFI_STATUS ret;
+
+	ret = check_transfer(media_id, offset, size, buffer);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	memcpy(buffer, ramdisk.data + offset, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI ramdisk_write_disk(__attribute__((__unused__)) EFI_DISK_IO *dio,
+					    UINT32 media_id, UINT64 offset,
+					    UINTN size, VOID *buffer)
+{
+	EFI_STATUS ret;
+
+	ret = check_transfer(media_id, offset, size, buffer);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	memcpy(ramdisk.data + offset, buffer, size);
+	return EFI_SUCCESS;
+}
+
+static void set_device_path_node(EFI_DEVICE_PATH *node, UINT8 type,
+				 UINT8 subtype, UINT16 length)
+{
+	node->Type = type;
+	node->SubType = subtype;
+	node->Length[0] = length & 0xFF;
+	node->Length[1] = length >> 8;
+}
+
+BOOLEAN ramdisk_exists(void)
+{
+	return ramdisk.handle != NULL;
+}
+
+EFI_STATUS ramdisk_create(UINT64 size, UINT32 block_size, UINT32 io_align,
+			  UINT32 latency_us)
+{
+	EFI_STATUS ret;
+
+	if (ramdisk_exists())
+		return EFI_ALREADY_STARTED;
+
+	if (block_size < 512 || (block_size & (block_size - 1)) ||
+	    (io_align & (io_align - 1)) || size < RAMDISK_MIN_SIZE ||
+	    size % block_size || size != (UINTN)size)
+		return EFI_INVALID_PARAMETER;
+
+	ramdisk.data = AllocateZeroPool(size);
+	if (!ramdisk.data) {
+		error(L"Failed to allocate the %ld bytes RAM disk", size);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	ramdisk.latency_us = latency_us;
+	ramdisk.media.MediaId = 1;
+	ramdisk.media.MediaPresent = TRUE;
+	ramdisk.media.BlockSize = block_size;
+	ramdisk.media.IoAlign = io_align;
+	ramdisk.media.LastBlock = size / block_size - 1;
+
+	ramdisk.bio.Revision = EFI_BLOCK_IO_INTERFACE_REVISION;
+	ramdisk.bio.Media = &ramdisk.media;
+	ramdisk.bio.Reset = ramdisk_reset;
+	ramdisk.bio.ReadBlocks = ramdisk_read_blocks;
+	ramdisk.bio.WriteBlocks = ramdisk_write_blocks;
+	ramdisk.bio.FlushBlocks = ramdisk_flush_blocks;
+
+	ramdisk.dio.Revision = EFI_DISK_IO_INTERFACE_REVISION;
+	ramdisk.dio.ReadDisk = ramdisk_read_disk;
+	ramdisk.dio.WriteDisk = ramdisk_write_disk;
+
+	set_device_path_node(&ramdisk.dp.pci.Header, HARDWARE_DEVICE_PATH,
+			     HW_PCI_DP, sizeof(ramdisk.dp.pci));
+	ramdisk.dp.pci.Device = RAMDISK_PCI_DEVICE;
+	ramdisk.dp.pci.Function = RAMDISK_PCI_FUNCTION;
+	set_device_path_node(&ramdisk.dp.vendor.Header, HARDWARE_DEVICE_PATH,
+			     HW_VENDOR_DP, sizeof(ramdisk.dp.vendor));
+	memcpy(&ramdisk.dp.vendor.Guid, &ramdisk_guid, sizeof(ramdisk_guid));
+	set_device_path_node(&ramdisk.dp.end, END_DEVICE_PATH_TYPE,
+			     END_ENTIRE_DEVICE_PATH_SUBTYPE, sizeof(ramdisk.dp.end));
+
+	ret = uefi_call_wrapper(BS->InstallProtocolInterface, 4, &ramdisk.handle,
+				&DevicePathProtocol, EFI_NATIVE_INTERFACE,
+				&ramdisk.dp);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	ret = uefi_call_wrapper(BS->InstallProtocolInterface, 4, &ramdisk.handle,
+				&DiskIoProtocol, EFI_NATIVE_INTERFACE,
+				&ramdisk.dio);
+	if (EFI_ERROR(ret))
+		goto uninstall_dp;
+
+	ret = uefi_call_wrapper(BS->InstallProtocolInterface, 4, &ramdisk.handle,
+				&BlockIoProtocol, EFI_NATIVE_INTERFACE,
+				&ramdisk.bio);
+	if (EFI_ERROR(ret))
+		goto uninstall_dio;
+
+	debug(L"%ld bytes RAM disk installed, block size %d, IO align %d, latency %dus",
+	      size, block_size, io_align, latency_us);
+	return EFI_SUCCESS;
+
+uninstall_dio:
+	uefi_call_wrapper(BS->UninstallProtocolInterface, 3, ramdisk.handle,
+			  &DiskIoProtocol, &ramdisk.dio);
+uninstall_dp:
+	uefi_call_wrapper(BS->UninstallProtocolInterface, 3, ramdisk.handle,
+			  &DevicePathProtocol, &ramdisk.dp);
+err:
+	efi_perror(ret, L"Failed to install the RAM disk protocols");
+	FreePool(ramdisk.data);
+	ZeroMem(&ramdisk, sizeof(ramdisk));
+	return ret;
+}
+
+/* Typical partitions of the flash, erase and hash paths, the last one
+   takes the remaining space.  */
+static const struct {
+	CHAR16 *label;
+	INT32 length;
+} RAMDISK_PARTITIONS[] = {
+	{ L"bootloader", 8 },
+	{ L"misc", 1 },
+	{ L"boot", 32 },
+	{ L"userdata", -1 }
+};
+
+EFI_STATUS ramdisk_create_gpt(void)
+{
+	struct gpt_bin_part parts[ARRAY_SIZE(RAMDISK_PARTITIONS)];
+	UINTN i;
+
+	if (!ramdisk_exists())
+		return EFI_NOT_STARTED;
+
+	ZeroMem(parts, sizeof(parts));
+	for (i = 0; i < ARRAY_SIZE(parts); i++) {
+		StrNCpy(parts[i].label, RAMDISK_PARTITIONS[i].label,
+			ARRAY_SIZE(parts[i].label) - 1);
+		parts[i].length = RAMDISK_PARTITIONS[i].length;
+		memcpy(&parts[i].type, &linux_data_guid, sizeof(parts[i].type));
+		memcpy(&parts[i].uuid, &ramdisk_guid, sizeof(parts[i].uuid));
+		parts[i].uuid.Data4[7] += i + 1;
+	}
+
+	return gpt_create(0, ARRAY_SIZE(parts), parts, LOGICAL_UNIT_USER);
+}
+
+static EFI_STATUS ramdisk_erase_blocks(__attribute__((__unused__)) EFI_HANDLE handle,
+				       EFI_BLOCK_IO *bio, UINT64 start, UINT64 end)
+{
+	if (bio != &ramdisk.bio || start > end || end > ramdisk.media.LastBlock)
+		return EFI_INVALID_PARAMETER;
+
+	if (ramdisk.latency_us)
+		uefi_call_wrapper(BS->Stall, 1, ramdisk.latency_us);
+
+	memset(ramdisk.data + start * ramdisk.media.BlockSize, 0,
+	       (end - start + 1) * ramdisk.media.BlockSize);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS ramdisk_check_logical_unit(__attribute__((unused)) EFI_DEVICE_PATH *p,
+					     logical_unit_t log_unit)
+{
+	return log_unit == LOGICAL_UNIT_USER ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+static BOOLEAN is_ramdisk(EFI_DEVICE_PATH *p)
+{
+	for (; !IsDevicePathEndType(p); p = NextDevicePathNode(p))
+		if (DevicePathType(p) == HARDWARE_DEVICE_PATH &&
+		    DevicePathSubType(p) == HW_VENDOR_DP &&
+		    !CompareGuid(&((VENDOR_DEVICE_PATH *)p)->Guid, &ramdisk_guid))
+			return TRUE;
+
+	return FALSE;
+}
+
+struct storage STORAGE(STORAGE_RAMDISK) = {
+	.erase_blocks = ramdisk_erase_blocks,
+	.check_logical_unit = ramdisk_check_logical_unit,
+	.probe = is_ramdisk,
+	.name = L"RAM disk"
+};
@@ -34,6 +34,8 @@
 #include "protocol/AtaPassThru.h"
 #include "protocol/Atapi.h"
 #include "storage.h"
+#include "pci.h"
+#include "uefi_utils.h"
 
 #define TRIM_SUPPORTED_BIT		0x01
 #define BIT5				0x20
@@ -44,6 +46,8 @@
 #define MAX_SECTOR_PER_RANGE		0xFFFF
 #define ATA_CMD_DSM_TRIM_FEATURE	0x1
 #define PORT_MULTIPLIER_POS		0x4
+/* Keeps the range buffer small and the sector count on 8 bits */
+#define MAX_DSM_BLOCKS			64
 
 typedef struct lba_range_entry {
 	UINT16 lba[3];
@@ -112,21 +116,53 @@ static BOOLEAN is_dsm_trim_supported(EFI_ATA_PASS_THRU_PROTOCOL *ata,
 	return TRUE;
 }
 
-/* http://www.t13.org/documents/uploadeddocuments/docs2009/d2015r2-ataatapi_command_set_-_2_acs-2.pdf
+/* The LBA Range Entries accumulate up to the DSM limit reported by
+ * IDENTIFY before a command is sent.
+ *
+ * http://www.t13.org/documents/uploadeddocuments/docs2009/d2015r2-ataatapi_command_set_-_2_acs-2.pdf
  * See. 7.10 DATA SET MANAG EMENT - 06h, DMA
  * See. 4.18.3.2 LBA Range Entry
  */
-static EFI_STATUS ata_dsm_trim(EFI_ATA_PASS_THRU_PROTOCOL *ata,
-			       SATA_DEVICE_PATH *sata_dp, UINT64 start, UINT64 end,
-			       UINT16 max_dsm_block_nb)
+struct dsm_trim {
+	EFI_ATA_PASS_THRU_PROTOCOL *ata;
+	SATA_DEVICE_PATH *sata_dp;
+	VOID *buf;
+	lba_range_entry_t *range;
+	UINTN nb;
+	UINTN max;
+};
+
+static EFI_STATUS dsm_trim_init(struct dsm_trim *trim,
+				EFI_ATA_PASS_THRU_PROTOCOL *ata,
+				SATA_DEVICE_PATH *sata_dp,
+				UINT16 max_dsm_block_nb)
+{
+	UINTN nr_blocks = min(max_dsm_block_nb, MAX_DSM_BLOCKS);
+	EFI_STATUS ret;
+
+	ret = alloc_aligned(&trim->buf, (VOID **)&trim->range,
+			    nr_blocks * BLOCK_SIZE, ata->Mode->IoAlign);
+	if (EFI_ERROR(ret)) {
+		error(L"Failed to allocate DSM LBA Range buffer");
+		return ret;
+	}
+
+	trim->ata = ata;
+	trim->sata_dp = sata_dp;
+	trim->nb = 0;
+	trim->max = nr_blocks * BLOCK_SIZE / sizeof(*trim->range);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS dsm_trim_flush(struct dsm_trim *trim)
 {
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
+	EFI_STATUS ret;
 	EFI_ATA_STATUS_BLOCK asb;
 	EFI_ATA_COMMAND_BLOCK acb = {
 		.AtaCommand = ATA_CMD_DSM,
 		.AtaFeatures = ATA_CMD_DSM_TRIM_FEATURE,
 		.AtaDeviceHead = (UINT8) (BIT7 | BIT6 | BIT5 |
-					  (sata_dp->PortMultiplierPortNumber << PORT_MULTIPLIER_POS))
+					  (trim->sata_dp->PortMultiplierPortNumber << PORT_MULTIPLIER_POS))
 	};
 	EFI_ATA_PASS_THRU_COMMAND_PACKET ata_packet = {
 		.Asb = &asb,
@@ -135,62 +171,85 @@ static EFI_STATUS ata_dsm_trim(EFI_ATA_PASS_THRU_PROTOCOL *ata,
 		.Protocol = EFI_ATA_PASS_THRU_PROTOCOL_PIO_DATA_OUT,
 		.Length = EFI_ATA_PASS_THRU_LENGTH_BYTES | EFI_ATA_PASS_THRU_LENGTH_SECTOR_COUNT
 	};
-	lba_range_entry_t *range, *buf;
-	UINT64 left;
-	UINTN nr_sectors, nr_ranges, nr_blocks, i, count;
+	UINTN size, count;
 
-	nr_sectors = end - start + 1;
-	nr_ranges = nr_sectors / MAX_SECTOR_PER_RANGE;
-	if (nr_sectors % MAX_SECTOR_PER_RANGE)
-		nr_ranges++;
-	nr_blocks = (nr_ranges * sizeof(*range)) / BLOCK_SIZE;
-	if ((nr_ranges * sizeof(UINT64)) % BLOCK_SIZE)
-		nr_blocks++;
+	if (!trim->nb)
+		return EFI_SUCCESS;
 
-	ret = alloc_aligned((VOID **)&buf, (VOID **)&range,
-			    nr_blocks * BLOCK_SIZE, ata->Mode->IoAlign);
-	if (EFI_ERROR(ret)) {
-		error(L"Failed to allocate DSM LBA Range buffer");
-		return ret;
-	}
+	/* Entries with a zero length are ignored by the drive */
+	size = trim->nb * sizeof(*trim->range);
+	count = DIV_ROUND_UP(size, BLOCK_SIZE);
+	memset((UINT8 *)trim->range + size, 0, count * BLOCK_SIZE - size);
+
+	ata_packet.OutDataBuffer = trim->range;
+	ata_packet.OutTransferLength = count * BLOCK_SIZE;
+	acb.AtaSectorCount = count;
+
+	memset(&asb, 0, sizeof(asb));
+	ret = uefi_call_wrapper(trim->ata->PassThru, 5, trim->ata,
+				trim->sata_dp->HBAPortNumber,
+				trim->sata_dp->PortMultiplierPortNumber,
+				&ata_packet, NULL);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"DATA SET MANAGEMENT command failed");
 
-	for (i = 0; start <= end; start += MAX_SECTOR_PER_RANGE, i++) {
-		*((UINT64 *)&range[i]) = start;
+	trim->nb = 0;
+	return ret;
+}
+
+static EFI_STATUS dsm_trim_add(struct dsm_trim *trim, UINT64 start, UINT64 end)
+{
+	EFI_STATUS ret;
+	UINT64 left;
+
+	for (; start <= end; start += trim->range[trim->nb++].len) {
+		if (trim->nb == trim->max) {
+			ret = dsm_trim_flush(trim);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+
+		*((UINT64 *)&trim->range[trim->nb]) = start;
 		left = end - start + 1;
-		range[i].len = left < MAX_SECTOR_PER_RANGE ? left : MAX_SECTOR_PER_RANGE;
+		trim->range[trim->nb].len = left < MAX_SECTOR_PER_RANGE ? left : MAX_SECTOR_PER_RANGE;
 	}
 
-	for (i = 0; i < nr_blocks; i += max_dsm_block_nb) {
-		ata_packet.OutDataBuffer = ((UINT8 *)range) + i * BLOCK_SIZE;
+	return EFI_SUCCESS;
+}
 
-		count = min(nr_blocks - i, max_dsm_block_nb);
-		ata_packet.OutTransferLength = count * BLOCK_SIZE;
-		acb.AtaSectorCount = count;
+static EFI_STATUS ata_dsm_trim(EFI_ATA_PASS_THRU_PROTOCOL *ata,
+			       SATA_DEVICE_PATH *sata_dp,
+			       struct lba_range *ranges, UINTN nb,
+			       UINT16 max_dsm_block_nb)
+{
+	struct dsm_trim trim;
+	EFI_STATUS ret;
+	UINTN i;
 
-		memset(&asb, 0, sizeof(asb));
-		ret = uefi_call_wrapper(ata->PassThru, 5, ata,
-					sata_dp->HBAPortNumber,
-					sata_dp->PortMultiplierPortNumber,
-					&ata_packet, NULL);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"DATA SET MANAGEMENT command failed");
+	ret = dsm_trim_init(&trim, ata, sata_dp, max_dsm_block_nb);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	for (i = 0; i < nb; i++) {
+		ret = dsm_trim_add(&trim, ranges[i].start, ranges[i].end);
+		if (EFI_ERROR(ret))
 			goto out;
-		}
 	}
 
+	ret = dsm_trim_flush(&trim);
+
 out:
-	FreePool(buf);
+	FreePool(trim.buf);
 	return ret;
 }
 
-static EFI_STATUS sata_erase_blocks(EFI_HANDLE handle,
+static EFI_STATUS sata_erase_ranges(EFI_HANDLE handle,
 				    __attribute__((unused)) EFI_BLOCK_IO *bio,
-				    UINT64 start, UINT64 end)
+				    struct lba_range *ranges, UINTN nb)
 {
 	EFI_STATUS ret;
 	EFI_GUID AtaPassThruProtocolGuid = EFI_ATA_PASS_THRU_PROTOCOL_GUID;
 	EFI_DEVICE_PATH *dp;
-	EFI_HANDLE ata_handle;
 	SATA_DEVICE_PATH *sata_dp;
 	EFI_ATA_PASS_THRU_PROTOCOL *ata;
 	UINT16 max_dsm_block_nb;
@@ -201,11 +260,9 @@ static EFI_STATUS sata_erase_blocks(EFI_HANDLE handle,
 		return EFI_INVALID_PARAMETER;
 	}
 
-	sata_dp = (SATA_DEVICE_PATH *)dp;
-	ret = uefi_call_wrapper(BS->LocateDevicePath, 3, &AtaPassThruProtocolGuid,
-				(EFI_DEVICE_PATH **)&sata_dp, &ata_handle);
+	ret = get_pci_protocol(dp, &AtaPassThruProtocolGuid, (VOID **)&ata);
 	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to locate ATA root device");
+		efi_perror(ret, L"Failed to get the ATA root device protocol");
 		return ret;
 	}
 
@@ -215,19 +272,20 @@ static EFI_STATUS sata_erase_blocks(EFI_HANDLE handle,
 		return EFI_NOT_FOUND;
 	}
 
-	ret = uefi_call_wrapper(BS->HandleProtocol, 3, ata_handle,
-				&AtaPassThruProtocolGuid, (void *)&ata);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"failed to get ATA protocol");
-		return ret;
-	}
-
 	if (is_dsm_trim_supported(ata, sata_dp, &max_dsm_block_nb))
-		return ata_dsm_trim(ata, sata_dp, start, end, max_dsm_block_nb);
+		return ata_dsm_trim(ata, sata_dp, ranges, nb, max_dsm_block_nb);
 
 	return EFI_UNSUPPORTED;
 }
 
+static EFI_STATUS sata_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				    UINT64 start, UINT64 end)
+{
+	struct lba_range range = { start, end };
+
+	return sata_erase_ranges(handle, bio, &range, 1);
+}
+
 static EFI_STATUS sata_check_logical_unit(__attribute__((unused)) EFI_DEVICE_PATH *p,
 					  logical_unit_t log_unit)
 {
@@ -241,6 +299,7 @@ static BOOLEAN is_sata(EFI_DEVICE_PATH *p)
 
 struct storage STORAGE(STORAGE_SATA) = {
 	.erase_blocks = sata_erase_blocks,
+	.erase_ranges = sata_erase_ranges,
 	.check_logical_unit = sata_check_logical_unit,
 	.probe = is_sata,
 	.name = L"SATA"
@@ -70,6 +70,7 @@ static EFI_STATUS sdcard_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
 	EFI_SD_HOST_IO_PROTOCOL *sdio;
 	EFI_DEVICE_PATH *dev_path;
 	CARD_DATA *card_data;
+	struct sdio_erase_info info;
 
 	dev_path = DevicePathFromHandle(handle);
 	if (!dev_path) {
@@ -89,8 +90,13 @@ static EFI_STATUS sdcard_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
 		return ret;
 	}
 
-	return sdio_erase(sdio, bio, start, end,
-			  card_data->Address, 1, SDIO_DFLT_TIMEOUT, FALSE);
+	/* SDCards erase at the block granularity */
+	ZeroMem(&info, sizeof(info));
+	info.card_address = card_data->Address;
+	info.erase_grp_size = 1;
+	info.erase_timeout = SDIO_DFLT_TIMEOUT;
+
+	return sdio_erase(sdio, bio, &info, start, end);
 }
 
 /* SDCards do not support hardware level partitions */
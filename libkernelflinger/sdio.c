@@ -35,37 +35,77 @@
 #include <lib.h>
 
 #include "storage.h"
+#include "pci.h"
 #include "protocol/Mmc.h"
 #include "protocol/SdHostIo.h"
 #include "sdio.h"
+#include "uefi_utils.h"
 
 #define SDCARD_ERASE_GROUP_START	32
 #define SDCARD_ERASE_GROUP_END		33
 #define STATUS_ERROR_MASK		0xFCFFA080
+#define ERASE_POLL_US			1000
+
+/* ERASE command arguments */
+#define MMC_ERASE_ARG			0x00000000
+#define MMC_TRIM_ARG			0x00000001
+#define MMC_SECURE_ERASE_ARG		0x80000000
+#define MMC_SECURE_TRIM1_ARG		0x80000001
+#define MMC_SECURE_TRIM2_ARG		0x80008000
 
 EFI_STATUS sdio_get(EFI_DEVICE_PATH *p, EFI_SD_HOST_IO_PROTOCOL **sdio)
 {
-	EFI_STATUS ret;
-	EFI_HANDLE sdio_handle;
 	EFI_GUID guid = EFI_SD_HOST_IO_PROTOCOL_GUID;
 
-	ret = uefi_call_wrapper(BS->LocateDevicePath, 3, &guid, &p, &sdio_handle);
-	if (EFI_ERROR(ret))
+	return get_pci_protocol(p, &guid, (VOID **)sdio);
+}
+
+/* Send the ERASE command with ARG, the erase range being already set,
+   and wait for the card to be ready again.  */
+static EFI_STATUS sdio_erase_cmd(EFI_SD_HOST_IO_PROTOCOL *sdio,
+				 struct sdio_erase_info *info,
+				 UINT32 arg, UINTN timeout)
+{
+	EFI_STATUS ret;
+	UINT32 status;
+	CARD_STATUS card_status;
+
+	ret = uefi_call_wrapper(sdio->SendCommand, 9, sdio, ERASE, arg,
+				NoData, NULL, 0, ResponseR1, timeout, &status);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Erase command Failed");
 		return ret;
+	}
+	if (status & STATUS_ERROR_MASK) {
+		error(L"Erase Failed, status=0x%08x", status);
+		return EFI_DEVICE_ERROR;
+	}
+
+	do {
+		sleep_us(ERASE_POLL_US);
+		ret = uefi_call_wrapper(sdio->SendCommand, 9, sdio, SEND_STATUS,
+					info->card_address << 16, NoData, NULL, 0,
+					ResponseR1, SDIO_DFLT_TIMEOUT,
+					(UINT32 *)&card_status);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed get status");
+			return ret;
+		}
+	} while (!card_status.READY_FOR_DATA);
 
-	return uefi_call_wrapper(BS->HandleProtocol, 3, sdio_handle, &guid, (void **)sdio);
+	return ret;
 }
 
-static EFI_STATUS sdio_erase_group(EFI_SD_HOST_IO_PROTOCOL *sdio, UINT64 start,
-				   UINT64 end, UINTN timeout, UINT16 card_address,
-				   BOOLEAN emmc)
+static EFI_STATUS sdio_erase_group(EFI_SD_HOST_IO_PROTOCOL *sdio,
+				   struct sdio_erase_info *info,
+				   UINT64 start, UINT64 end,
+				   UINT32 arg, UINTN timeout)
 {
 	EFI_STATUS ret;
 	UINT32 status;
-	CARD_STATUS card_status;
 
 	ret = uefi_call_wrapper(sdio->SendCommand, 9, sdio,
-				emmc ? ERASE_GROUP_START : SDCARD_ERASE_GROUP_START,
+				info->emmc ? ERASE_GROUP_START : SDCARD_ERASE_GROUP_START,
 				start, NoData, NULL, 0, ResponseR1, SDIO_DFLT_TIMEOUT, &status);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed set start erase");
@@ -73,11 +113,11 @@ static EFI_STATUS sdio_erase_group(EFI_SD_HOST_IO_PROTOCOL *sdio, UINT64 start,
 	}
 	if (status & STATUS_ERROR_MASK) {
 		error(L"Failed set erase group start, status=0x%08x", status);
-		return ret;
+		return EFI_DEVICE_ERROR;
 	}
 
 	ret = uefi_call_wrapper(sdio->SendCommand, 9, sdio,
-				emmc ? ERASE_GROUP_END : SDCARD_ERASE_GROUP_END,
+				info->emmc ? ERASE_GROUP_END : SDCARD_ERASE_GROUP_END,
 				end, NoData, NULL, 0, ResponseR1, SDIO_DFLT_TIMEOUT, &status);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed set end erase");
@@ -85,67 +125,98 @@ static EFI_STATUS sdio_erase_group(EFI_SD_HOST_IO_PROTOCOL *sdio, UINT64 start,
 	}
 	if (status & STATUS_ERROR_MASK) {
 		error(L"Failed set erase group end, status=0x%08x", status);
-		return ret;
+		return EFI_DEVICE_ERROR;
 	}
 
-	ret = uefi_call_wrapper(sdio->SendCommand, 9, sdio, ERASE, 0x80000000,
-				NoData, NULL, 0, ResponseR1, timeout, &status);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Erase command Failed");
-		return ret;
-	}
-	if (status & STATUS_ERROR_MASK) {
-		error(L"Erase Failed, status=0x%08x", status);
+	return sdio_erase_cmd(sdio, info, arg, timeout);
+}
+
+/* The range edges which do not cover a whole erase group are trimmed
+   when the card supports it, written with zeros otherwise.  A secure
+   trim is a two steps operation.  */
+static EFI_STATUS sdio_erase_edge(EFI_SD_HOST_IO_PROTOCOL *sdio,
+				  EFI_BLOCK_IO *bio,
+				  struct sdio_erase_info *info,
+				  UINT64 start, UINT64 end)
+{
+	EFI_STATUS ret;
+
+	if (!info->trim) {
+		ret = fill_zero(bio, start, end);
+		if (EFI_ERROR(ret))
+			error(L"Failed to fill with zeros");
 		return ret;
 	}
 
-	do {
-		pause(1);
-		ret = uefi_call_wrapper(sdio->SendCommand, 9, sdio, SEND_STATUS,
-					card_address << 16, NoData, NULL, 0,
-					ResponseR1, SDIO_DFLT_TIMEOUT,
-					(UINT32 *)&card_status);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed get status");
-			return ret;
-		}
-	} while (!card_status.READY_FOR_DATA);
+	if (!info->secure)
+		return sdio_erase_group(sdio, info, start, end, MMC_TRIM_ARG,
+					info->trim_timeout);
 
-	return ret;
+	ret = sdio_erase_group(sdio, info, start, end, MMC_SECURE_TRIM1_ARG,
+			       info->trim_timeout);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return sdio_erase_cmd(sdio, info, MMC_SECURE_TRIM2_ARG,
+			      info->trim_timeout);
 }
 
 EFI_STATUS sdio_erase(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_BLOCK_IO *bio,
-		      UINT64 start, UINT64 end,
-		      UINT16 card_address, UINTN erase_grp_size, UINTN erase_timeout,
-		      BOOLEAN emmc)
+		      struct sdio_erase_info *info, UINT64 start, UINT64 end)
 {
 	EFI_STATUS ret;
-	UINT64 left;
+	UINT64 first, last;
 	UINTN timeout;
 
-	if (!sdio || !bio)
+	if (!sdio || !bio || !info || !info->erase_grp_size || start > end)
 		return EFI_INVALID_PARAMETER;
 
-	left = start % erase_grp_size;
-	if (left) {
-		ret = fill_zero(bio, start, start + erase_grp_size - left - 1);
-		if (EFI_ERROR(ret)) {
-			error(L"Failed to fill with zeros");
+	/* [FIRST, LAST] is the part of the range made of whole erase
+	   groups */
+	first = ALIGN(start, info->erase_grp_size);
+	last = ALIGN_DOWN(end + 1, info->erase_grp_size);
+	if (first >= last)
+		return sdio_erase_edge(sdio, bio, info, start, end);
+	last--;
+
+	if (start < first) {
+		ret = sdio_erase_edge(sdio, bio, info, start, first - 1);
+		if (EFI_ERROR(ret))
 			return ret;
-		}
-		start += erase_grp_size - left;
 	}
 
-	left = (end + 1) % erase_grp_size;
-	if (left) {
-		ret = fill_zero(bio, end + 1 - left, end);
-		if (EFI_ERROR(ret)) {
-			error(L"Failed to fill with zeros");
+	if (end > last) {
+		ret = sdio_erase_edge(sdio, bio, info, last + 1, end);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	timeout = info->erase_timeout * ((last + 1 - first) / info->erase_grp_size);
+	return sdio_erase_group(sdio, info, first, last,
+				info->secure ? MMC_SECURE_ERASE_ARG : MMC_ERASE_ARG,
+				timeout);
+}
+
+/* The card parameters are only read once for all the ranges, the
+   contiguous ranges are erased together.  */
+EFI_STATUS sdio_erase_ranges(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_BLOCK_IO *bio,
+			     struct sdio_erase_info *info,
+			     struct lba_range *ranges, UINTN nb)
+{
+	EFI_STATUS ret;
+	UINT64 start, end;
+	UINTN i;
+
+	for (i = 0; i < nb; i++) {
+		start = ranges[i].start;
+		end = ranges[i].end;
+		while (i + 1 < nb && ranges[i + 1].start == end + 1)
+			end = ranges[++i].end;
+
+		ret = sdio_erase(sdio, bio, info, start, end);
+		if (EFI_ERROR(ret))
 			return ret;
-		}
-		end -= left;
 	}
 
-	timeout = erase_timeout * ((end + 1 - start) / erase_grp_size);
-	return sdio_erase_group(sdio, start, end, timeout, card_address, emmc);
+	return EFI_SUCCESS;
 }
@@ -37,13 +37,27 @@
 
 #include <lib.h>
 #include "protocol/SdHostIo.h"
+#include "storage.h"
 
 #define SDIO_DFLT_TIMEOUT	3000
 
 EFI_STATUS sdio_get(EFI_DEVICE_PATH *p, EFI_SD_HOST_IO_PROTOCOL **sdio);
+/* Erase capabilities of a card, sizes in sectors and timeouts in
+   milliseconds */
+struct sdio_erase_info {
+	UINT16 card_address;
+	BOOLEAN emmc;
+	UINTN erase_grp_size;
+	UINTN erase_timeout;	/* Per erase group */
+	BOOLEAN secure;		/* Secure erase and trim */
+	BOOLEAN trim;		/* Write block granularity erase */
+	UINTN trim_timeout;	/* Per trim command */
+};
+
 EFI_STATUS sdio_erase(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_BLOCK_IO *bio,
-		      UINT64 start, UINT64 end, UINT16 card_address,
-		      UINTN erase_grp_size, UINTN erase_timeout,
-		      BOOLEAN emmc);
+		      struct sdio_erase_info *info, UINT64 start, UINT64 end);
+EFI_STATUS sdio_erase_ranges(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_BLOCK_IO *bio,
+			     struct sdio_erase_info *info,
+			     struct lba_range *ranges, UINTN nb);
 
 #endif	/* _SDIO_H_ */
@@ -37,14 +37,17 @@
 #include <openssl/objects.h>
 #include <openssl/obj_mac.h>
 #include <openssl/rsa.h>
+#include <openssl/bn.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
+#include <openssl_mem.h>
 
 #include "security.h"
 #include "android.h"
 #include "signature.h"
 #include "lib.h"
 #include "vars.h"
+#include "sha_ni.h"
 
 #define SETUP_MODE_VAR	        L"SetupMode"
 #define SECURE_BOOT_VAR         L"SecureBoot"
@@ -104,6 +107,76 @@ static X509 *der_to_x509(CONST UINT8 *der, UINTN size)
 }
 
 
+/* The OEM certificate is parsed once for the lifetime of the
+ * application: boot, fastboot boot and recovery can verify several
+ * images against it.  The RSA key Montgomery context is computed at
+ * load time and kept with it.  */
+static struct oem_key {
+        UINT8 *der;
+        UINTN der_size;
+        X509 *cert;
+        EVP_PKEY *pkey;
+        RSA *rsa;
+} oem_key;
+
+static void oem_key_free(void)
+{
+        if (oem_key.rsa)
+                RSA_free(oem_key.rsa);
+        if (oem_key.pkey)
+                EVP_PKEY_free(oem_key.pkey);
+        if (oem_key.cert)
+                X509_free(oem_key.cert);
+        if (oem_key.der)
+                FreePool(oem_key.der);
+        memset(&oem_key, 0, sizeof(oem_key));
+}
+
+static struct oem_key *get_oem_key(CONST UINT8 *der, UINTN size)
+{
+        BN_CTX *ctx;
+
+        if (oem_key.cert && oem_key.der_size == size &&
+            !memcmp(oem_key.der, der, size))
+                return &oem_key;
+
+        oem_key_free();
+
+        oem_key.cert = der_to_x509(der, size);
+        if (!oem_key.cert)
+                goto err;
+
+        oem_key.pkey = get_rsa_pubkey(oem_key.cert);
+        if (!oem_key.pkey)
+                goto err;
+
+        oem_key.rsa = EVP_PKEY_get1_RSA(oem_key.pkey);
+        if (!oem_key.rsa)
+                goto err;
+
+        ctx = BN_CTX_new();
+        if (ctx) {
+                if (!BN_MONT_CTX_set_locked(&oem_key.rsa->_method_mod_n,
+                                            CRYPTO_LOCK_RSA, oem_key.rsa->n,
+                                            ctx))
+                        pr_error_openssl();
+                BN_CTX_free(ctx);
+        }
+
+        oem_key.der = AllocatePool(size);
+        if (!oem_key.der)
+                goto err;
+        memcpy(oem_key.der, der, size);
+        oem_key.der_size = size;
+
+        return &oem_key;
+
+err:
+        oem_key_free();
+        return NULL;
+}
+
+
 static EFI_STATUS get_hash_buffer(UINTN nid, VOID **hash, UINTN *hashsz)
 {
         switch (nid) {
@@ -127,17 +200,167 @@ static EFI_STATUS get_hash_buffer(UINTN nid, VOID **hash, UINTN *hashsz)
 }
 
 
+/* Boot image hash computed while the image is read.  Only the
+ * AuthenticatedAttributes data remains to be hashed at verification
+ * time.  */
+static struct {
+        VOID *bootimage;
+        int nid;
+        UINTN len;
+        BOOLEAN complete;
+        union {
+                SHA_CTX sha1;
+                SHA256_CTX sha256;
+                SHA512_CTX sha512;
+        } ctx;
+} streamed;
+
+static EFI_STATUS hash_start(VOID *bootimage, int nid)
+{
+        int ret;
+
+        switch (nid) {
+        case NID_sha1WithRSAEncryption:
+                ret = SHA1_Init(&streamed.ctx.sha1);
+                break;
+        case NID_sha256WithRSAEncryption:
+                ret = SHA256_Init(&streamed.ctx.sha256);
+                break;
+        case NID_sha512WithRSAEncryption:
+                ret = SHA512_Init(&streamed.ctx.sha512);
+                break;
+        default:
+                return EFI_UNSUPPORTED;
+        }
+        if (ret != 1)
+                return EFI_DEVICE_ERROR;
+
+        streamed.bootimage = bootimage;
+        streamed.nid = nid;
+        return EFI_SUCCESS;
+}
+
+EFI_STATUS bootimage_hash_start(VOID *bootimage, VOID *signature_data)
+{
+        struct boot_signature *sig;
+        int nid;
+
+        bootimage_hash_abort();
+
+        sig = get_boot_signature(signature_data, BOOT_SIGNATURE_MAX_SIZE);
+        if (!sig)
+                return EFI_NOT_FOUND;
+        nid = sig->id.nid;
+        free_boot_signature(sig);
+
+        return hash_start(bootimage, nid);
+}
+
+EFI_STATUS bootimage_hash_start_sha256(VOID *bootimage)
+{
+        bootimage_hash_abort();
+        return hash_start(bootimage, NID_sha256WithRSAEncryption);
+}
+
+void bootimage_hash_move(VOID *from, VOID *to)
+{
+        if (streamed.bootimage == from)
+                streamed.bootimage = to;
+}
+
+void bootimage_hash_update(const VOID *data, UINTN size)
+{
+        if (!streamed.bootimage || streamed.complete)
+                return;
+
+        switch (streamed.nid) {
+        case NID_sha1WithRSAEncryption:
+                sha1_update(&streamed.ctx.sha1, data, size);
+                break;
+        case NID_sha256WithRSAEncryption:
+                sha256_update(&streamed.ctx.sha256, data, size);
+                break;
+        case NID_sha512WithRSAEncryption:
+                SHA512_Update(&streamed.ctx.sha512, data, size);
+                break;
+        }
+        streamed.len += size;
+}
+
+void bootimage_hash_end(void)
+{
+        if (streamed.bootimage)
+                streamed.complete = TRUE;
+}
+
+void bootimage_hash_abort(void)
+{
+        OPENSSL_cleanse(&streamed, sizeof(streamed));
+        memset(&streamed, 0, sizeof(streamed));
+}
+
+/* Finish the streamed hash of BOOTIMAGE if it covers the IMGSIZE
+ * bytes with the algorithm of the BS signature.  */
+static BOOLEAN hash_streamed_bootimage(struct boot_signature *bs,
+                VOID *bootimage, UINTN imgsize, void *hash)
+{
+        if (streamed.bootimage != bootimage || !streamed.complete ||
+            streamed.nid != bs->id.nid || streamed.len != imgsize)
+                return FALSE;
+
+        switch (streamed.nid) {
+        case NID_sha1WithRSAEncryption:
+        {
+                SHA_CTX sha_ctx = streamed.ctx.sha1;
+
+                SHA1_Update(&sha_ctx, bs->attributes.data,
+                                bs->attributes.data_sz);
+                SHA1_Final(hash, &sha_ctx);
+                OPENSSL_cleanse(&sha_ctx, sizeof(sha_ctx));
+                return TRUE;
+        }
+        case NID_sha256WithRSAEncryption:
+        {
+                SHA256_CTX sha_ctx = streamed.ctx.sha256;
+
+                SHA256_Update(&sha_ctx, bs->attributes.data,
+                                bs->attributes.data_sz);
+                SHA256_Final(hash, &sha_ctx);
+                OPENSSL_cleanse(&sha_ctx, sizeof(sha_ctx));
+                return TRUE;
+        }
+        case NID_sha512WithRSAEncryption:
+        {
+                SHA512_CTX sha_ctx = streamed.ctx.sha512;
+
+                SHA512_Update(&sha_ctx, bs->attributes.data,
+                                bs->attributes.data_sz);
+                SHA512_Final(hash, &sha_ctx);
+                OPENSSL_cleanse(&sha_ctx, sizeof(sha_ctx));
+                return TRUE;
+        }
+        }
+
+        return FALSE;
+}
 
 static EFI_STATUS hash_bootimage(struct boot_signature *bs,
                 VOID *bootimage, UINTN imgsize, void **hash, UINTN *hashsz)
 {
         int nid = bs->id.nid;
         EFI_STATUS eret;
+        struct bootimage_piece pieces[BOOTIMAGE_MAX_PIECES];
+        UINTN i, count;
 
         eret = get_hash_buffer(nid, hash, hashsz);
         if (EFI_ERROR(eret))
                 return eret;
 
+        if (hash_streamed_bootimage(bs, bootimage, imgsize, *hash))
+                return EFI_SUCCESS;
+
+        count = bootimage_pieces(bootimage, imgsize, pieces);
+
         /* Hash the bootimage + the AuthenticatedAttributes data */
         switch (nid) {
         case NID_sha1WithRSAEncryption:
@@ -147,7 +370,8 @@ static EFI_STATUS hash_bootimage(struct boot_signature *bs,
                 if (1 != SHA1_Init(&sha_ctx))
                         break;
 
-                SHA1_Update(&sha_ctx, bootimage, imgsize);
+                for (i = 0; i < count; i++)
+                        sha1_update(&sha_ctx, pieces[i].data, pieces[i].size);
                 SHA1_Update(&sha_ctx, bs->attributes.data,
                                 bs->attributes.data_sz);
                 SHA1_Final(*hash, &sha_ctx);
@@ -162,7 +386,8 @@ static EFI_STATUS hash_bootimage(struct boot_signature *bs,
                 if (1 != SHA256_Init(&sha_ctx))
                         break;
 
-                SHA256_Update(&sha_ctx, bootimage, imgsize);
+                for (i = 0; i < count; i++)
+                        sha256_update(&sha_ctx, pieces[i].data, pieces[i].size);
                 SHA256_Update(&sha_ctx, bs->attributes.data,
                                 bs->attributes.data_sz);
                 SHA256_Final(*hash, &sha_ctx);
@@ -177,7 +402,8 @@ static EFI_STATUS hash_bootimage(struct boot_signature *bs,
                 if (1 != SHA512_Init(&sha_ctx))
                         break;
 
-                SHA512_Update(&sha_ctx, bootimage, imgsize);
+                for (i = 0; i < count; i++)
+                        SHA512_Update(&sha_ctx, pieces[i].data, pieces[i].size);
                 SHA512_Update(&sha_ctx, bs->attributes.data,
                                 bs->attributes.data_sz);
                 SHA512_Final(*hash, &sha_ctx);
@@ -210,28 +436,18 @@ static int get_rsa_verify_nid(int nid)
 
 
 static EFI_STATUS check_bootimage(CHAR8 *bootimage, UINTN imgsize,
-                                  struct boot_signature *sig, X509 *cert)
+                                  struct boot_signature *sig, RSA *rsa)
 {
         VOID *hash;
         UINTN hash_sz;
         EFI_STATUS ret;
         int rsa_ret;
-        EVP_PKEY *pkey = NULL;
-        RSA *rsa;
 
         ret = hash_bootimage(sig, bootimage, imgsize, &hash, &hash_sz);
         if (EFI_ERROR(ret))
                 return EFI_ACCESS_DENIED;
 
         ret = EFI_ACCESS_DENIED;
-        pkey = get_rsa_pubkey(cert);
-        if (!pkey)
-                goto free_hash;
-
-        rsa = EVP_PKEY_get1_RSA(pkey);
-        if (!rsa)
-                goto free_pkey;
-
         rsa_ret = RSA_verify(get_rsa_verify_nid(sig->id.nid),
                              hash, hash_sz, sig->signature,
                              sig->signature_len, rsa);
@@ -240,14 +456,33 @@ static EFI_STATUS check_bootimage(CHAR8 *bootimage, UINTN imgsize,
         else
                 pr_error_openssl();
 
-free_pkey:
-        EVP_PKEY_free(pkey);
-free_hash:
         FreePool(hash);
         return ret;
 }
 
 
+static EFI_STATUS check_bootimage_cert(CHAR8 *bootimage, UINTN imgsize,
+                                       struct boot_signature *sig, X509 *cert)
+{
+        EFI_STATUS ret;
+        EVP_PKEY *pkey;
+        RSA *rsa;
+
+        pkey = get_rsa_pubkey(cert);
+        if (!pkey)
+                return EFI_ACCESS_DENIED;
+
+        rsa = EVP_PKEY_get1_RSA(pkey);
+        EVP_PKEY_free(pkey);
+        if (!rsa)
+                return EFI_ACCESS_DENIED;
+
+        ret = check_bootimage(bootimage, imgsize, sig, rsa);
+        RSA_free(rsa);
+        return ret;
+}
+
+
 static EFI_STATUS add_digest(X509_ALGOR *algo)
 {
         int nid = OBJ_obj2nid(algo->algorithm);
@@ -274,20 +509,58 @@ static EFI_STATUS add_digest(X509_ALGOR *algo)
 }
 
 
+/* The hash of the last key is kept along with its public key bit
+ * string: the same verifier certificate is usually hashed for each
+ * boot image.  */
+static UINT8 *hashed_key;
+static UINTN hashed_key_size;
+
+static BOOLEAN pub_key_hashed(ASN1_BIT_STRING *key)
+{
+        return key && hashed_key && hashed_key_size == (UINTN)key->length &&
+                !memcmp(hashed_key, key->data, key->length);
+}
+
+static void pub_key_hashed_set(ASN1_BIT_STRING *key)
+{
+        if (hashed_key)
+                FreePool(hashed_key);
+        hashed_key = NULL;
+        hashed_key_size = 0;
+        if (!key)
+                return;
+
+        hashed_key = AllocatePool(max(key->length, 1));
+        if (!hashed_key)
+                return;
+        memcpy(hashed_key, key->data, key->length);
+        hashed_key_size = key->length;
+}
+
 EFI_STATUS compute_pub_key_hash(X509 *cert, UINT8 **hash_p, UINTN *hash_size)
 {
         static UINT8 hash[SHA256_DIGEST_LENGTH];
         EFI_STATUS fun_ret = EFI_INVALID_PARAMETER;
+        ASN1_BIT_STRING *key;
         BIO *rot_bio = NULL;
         EVP_PKEY *pkey = NULL;
         RSA *rsa;
         int ret;
         int size;
         char *rot_bitstream;
+        SHA256_CTX sha_ctx;
 
         if (!hash_p || !hash_size || !cert)
                 return EFI_INVALID_PARAMETER;
 
+        key = X509_get0_pubkey_bitstr(cert);
+        if (pub_key_hashed(key)) {
+                *hash_p = hash;
+                *hash_size = sizeof(hash);
+                return EFI_SUCCESS;
+        }
+        pub_key_hashed_set(NULL);
+
         rot_bio = BIO_new(BIO_s_mem());
         if (!rot_bio) {
                 error(L"Failed to allocate the RoT bitstream BIO");
@@ -308,6 +581,7 @@ EFI_STATUS compute_pub_key_hash(X509 *cert, UINT8 **hash_p, UINTN *hash_size)
         }
 
         ret = i2d_RSAPublicKey_bio(rot_bio, rsa);
+        RSA_free(rsa);
         if (ret <= 0) {
                 error(L"Failed to write the RSA key to RoT bitstream BIO");
                 goto out;
@@ -319,11 +593,13 @@ EFI_STATUS compute_pub_key_hash(X509 *cert, UINT8 **hash_p, UINTN *hash_size)
                 goto out;
         }
 
-        ret = EVP_Digest(rot_bitstream, size, hash, NULL, EVP_sha256(), NULL);
-        if (ret == 0) {
+        if (1 != SHA256_Init(&sha_ctx)) {
                 error(L"Failed to hash the RoT bitstream");
                 goto out;
         }
+        sha256_update(&sha_ctx, rot_bitstream, size);
+        SHA256_Final(hash, &sha_ctx);
+        pub_key_hashed_set(key);
 
         *hash_p = hash;
         *hash_size = sizeof(hash);
@@ -348,7 +624,7 @@ UINT8 verify_android_boot_image(IN VOID *bootimage, IN VOID *der_cert,
         UINTN imgsize;
         UINT8 verify_state = BOOT_STATE_RED;
         CHAR16 *target_tmp;
-        EVP_PKEY *oemkey = NULL;
+        struct oem_key *oemkey;
         EFI_STATUS ret;
 
         if (!bootimage || !der_cert || !target)
@@ -357,14 +633,14 @@ UINT8 verify_android_boot_image(IN VOID *bootimage, IN VOID *der_cert,
         if (verifier_cert)
                 *verifier_cert = NULL;
 
-        debug(L"get boot image header");
+        log_debug(SECURITY, L"get boot image header");
         hdr = get_bootimage_header(bootimage);
         if (!hdr) {
                 debug(L"bad boot image data");
                 goto out;
         }
 
-        debug(L"decoding boot image signature");
+        log_debug(SECURITY, L"decoding boot image signature");
         imgsize = bootimage_size(hdr);
         signature_data = (UINT8*)bootimage + imgsize;
         sig = get_boot_signature(signature_data, BOOT_SIGNATURE_MAX_SIZE);
@@ -373,18 +649,18 @@ UINT8 verify_android_boot_image(IN VOID *bootimage, IN VOID *der_cert,
                 goto out;
         }
 
-        X509 *cert = der_to_x509(der_cert, cert_size);
-        if (!cert) {
+        oemkey = get_oem_key(der_cert, cert_size);
+        if (!oemkey) {
                 debug(L"Failed to get OEM certificate");
                 goto free_sig;
         }
 
-        debug(L"verifying boot image");
-        ret = check_bootimage(bootimage, imgsize, sig, cert);
+        log_debug(SECURITY, L"verifying boot image");
+        ret = check_bootimage(bootimage, imgsize, sig, oemkey->rsa);
         if (!EFI_ERROR(ret)) {
                 verify_state = BOOT_STATE_GREEN;
                 if (verifier_cert)
-                        *verifier_cert = X509_dup(cert);
+                        *verifier_cert = X509_dup(oemkey->cert);
                 goto done;
         }
 
@@ -394,27 +670,22 @@ UINT8 verify_android_boot_image(IN VOID *bootimage, IN VOID *der_cert,
         }
 
         debug(L"Bootimage does not verify against the OEM key, trying included certificate");
-        ret = check_bootimage(bootimage, imgsize, sig, sig->certificate);
+        ret = check_bootimage_cert(bootimage, imgsize, sig, sig->certificate);
         if (EFI_ERROR(ret))
                 goto done;
 
         if (verifier_cert)
                 *verifier_cert = X509_dup(sig->certificate);
-        oemkey = get_rsa_pubkey(cert);
-        if (!oemkey ||
-            EFI_ERROR(add_digest(sig->certificate->sig_alg)) ||
-            X509_verify(sig->certificate, oemkey) != 1) {
+        if (EFI_ERROR(add_digest(sig->certificate->sig_alg)) ||
+            X509_verify(sig->certificate, oemkey->pkey) != 1) {
                 verify_state = BOOT_STATE_YELLOW;
                 goto done;
         }
 
-        debug(L"Embedded certificate verified by OEM key");
+        log_debug(SECURITY, L"Embedded certificate verified by OEM key");
         verify_state = BOOT_STATE_GREEN;
 
 done:
-        if (oemkey)
-                EVP_PKEY_free(oemkey);
-        X509_free(cert);
         target_tmp = stra_to_str((CHAR8*)sig->attributes.target);
         if (!target_tmp) {
                 verify_state = BOOT_STATE_RED;
@@ -426,6 +697,7 @@ done:
 free_sig:
         free_boot_signature(sig);
 out:
+        openssl_mem_trim();
 
         return verify_state;
 }
@@ -552,7 +824,7 @@ static UINT64 get_signing_time(PKCS7 *p7)
         t.Minute  = (str[8] - '0') * 10 + (str[9] - '0');
         t.Second  = (str[10] - '0') * 10 + (str[11] - '0');
 
-        debug(L"year=%d, month=%d, day=%d, hour=%d, minute=%d, second=%d",
+        log_debug(SECURITY, L"year=%d, month=%d, day=%d, hour=%d, minute=%d, second=%d",
               t.Year, t.Month, t.Day, t.Hour, t.Minute, t.Second);
 
         /* Note: no timezone management */
@@ -649,6 +921,7 @@ done:
                 X509_STORE_free(store);
         if (data_bio)
                 BIO_free(data_bio);
+        openssl_mem_trim();
 
         return payload ? EFI_SUCCESS : EFI_INVALID_PARAMETER;
 }
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "sha_ni.h"
+
+/* The SHA extensions compress a SHA-1 or SHA-256 block several times
+   faster than the OpenSSL C implementation.  They are only used on
+   x86_64 where the UEFI specification guarantees that SSE is enabled;
+   each function below enables the instruction set it needs through a
+   target attribute since the firmware is built without SSE.  */
+#ifdef __x86_64__
+
+#define CPUID_SSSE3		(1 << 9)
+#define CPUID_SSE4_1		(1 << 19)
+#define CPUID_7_0_SHA		(1 << 29)
+
+#define SHA_NI_TARGET __attribute__((target("sha,ssse3,sse4.1")))
+
+typedef int v4si __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+typedef char v16qi __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+typedef int v4si_u __attribute__((vector_size(16), aligned(1)));
+typedef char v16qi_u __attribute__((vector_size(16), aligned(1)));
+
+static BOOLEAN detect_sha_ni(void)
+{
+	UINT32 reg[4];
+
+	cpuid(0, reg);
+	if (reg[0] < 7)
+		return FALSE;
+
+	cpuid(1, reg);
+	if (!(reg[2] & CPUID_SSSE3) || !(reg[2] & CPUID_SSE4_1))
+		return FALSE;
+
+	cpuid_count(7, 0, reg);
+	return !!(reg[1] & CPUID_7_0_SHA);
+}
+
+BOOLEAN sha_ni_supported(void)
+{
+	static enum { UNKNOWN, SUPPORTED, UNSUPPORTED } state = UNKNOWN;
+
+	if (state == UNKNOWN) {
+		state = detect_sha_ni() ? SUPPORTED : UNSUPPORTED;
+		debug(L"SHA extensions %a", state == SUPPORTED ?
+		      "available" : "not available");
+	}
+
+	return state == SUPPORTED;
+}
+
+static const UINT32 K256[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* STATE is kept as the ABEF and CDGH vectors the sha256rnds2
+   instruction works on.  The message schedule is a ring of four
+   vectors of four words.  */
+SHA_NI_TARGET
+static void sha256_ni_blocks(UINT32 h[8], const UINT8 *data, UINTN nb)
+{
+	const v16qi bswap = { 3, 2, 1, 0, 7, 6, 5, 4,
+			      11, 10, 9, 8, 15, 14, 13, 12 };
+	v4si abef, cdgh, abef_save, cdgh_save, tmp, msg[4];
+	UINTN i;
+
+	tmp = __builtin_ia32_pshufd(*(v4si_u *)&h[0], 0xB1);
+	cdgh = __builtin_ia32_pshufd(*(v4si_u *)&h[4], 0x1B);
+	abef = (v4si)__builtin_ia32_palignr128((v2di)tmp, (v2di)cdgh, 64);
+	cdgh = (v4si)__builtin_ia32_pblendw128((v8hi)cdgh, (v8hi)tmp, 0xF0);
+
+	for (; nb; nb--, data += 64) {
+		abef_save = abef;
+		cdgh_save = cdgh;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				msg[i] = (v4si)__builtin_ia32_pshufb128(
+					*(v16qi_u *)(data + i * 16), bswap);
+			else
+				msg[i & 3] = __builtin_ia32_sha256msg2(
+					__builtin_ia32_sha256msg1(msg[i & 3], msg[(i + 1) & 3]) +
+					(v4si)__builtin_ia32_palignr128((v2di)msg[(i + 3) & 3],
+									(v2di)msg[(i + 2) & 3], 32),
+					msg[(i + 3) & 3]);
+
+			tmp = msg[i & 3] + *(v4si *)&K256[i * 4];
+			cdgh = __builtin_ia32_sha256rnds2(cdgh, abef, tmp);
+			tmp = __builtin_ia32_pshufd(tmp, 0x0E);
+			abef = __builtin_ia32_sha256rnds2(abef, cdgh, tmp);
+		}
+
+		abef += abef_save;
+		cdgh += cdgh_save;
+	}
+
+	tmp = __builtin_ia32_pshufd(abef, 0x1B);
+	cdgh = __builtin_ia32_pshufd(cdgh, 0xB1);
+	*(v4si_u *)&h[0] = (v4si)__builtin_ia32_pblendw128((v8hi)tmp, (v8hi)cdgh, 0xF0);
+	*(v4si_u *)&h[4] = (v4si)__builtin_ia32_palignr128((v2di)cdgh, (v2di)tmp, 64);
+}
+
+/* Return the next four words of the SHA-1 message schedule for the
+   group of four rounds I, MSG being the ring of the last four.  */
+SHA_NI_TARGET
+static inline v4si sha1_ni_msg(v4si msg[4], const UINT8 *data, UINTN i)
+{
+	const v16qi bswap = { 15, 14, 13, 12, 11, 10, 9, 8,
+			      7, 6, 5, 4, 3, 2, 1, 0 };
+
+	if (i < 4)
+		msg[i] = (v4si)__builtin_ia32_pshufb128(
+			*(v16qi_u *)(data + i * 16), bswap);
+	else
+		msg[i & 3] = __builtin_ia32_sha1msg2(
+			__builtin_ia32_sha1msg1(msg[i & 3], msg[(i + 1) & 3]) ^
+			msg[(i + 2) & 3], msg[(i + 3) & 3]);
+
+	return msg[i & 3];
+}
+
+/* The sha1rnds4 round function selector must be an immediate, hence
+   one loop per group of twenty rounds.  */
+#define SHA1_NI_ROUNDS(func)						\
+	for (; i < ((func) + 1) * 5; i++) {				\
+		e = i ? __builtin_ia32_sha1nexte(prev, sha1_ni_msg(msg, data, i)) \
+			: e_save + sha1_ni_msg(msg, data, i);		\
+		prev = abcd;						\
+		abcd = __builtin_ia32_sha1rnds4(abcd, e, func);		\
+	}
+
+SHA_NI_TARGET
+static void sha1_ni_blocks(UINT32 h[5], const UINT8 *data, UINTN nb)
+{
+	v4si abcd, abcd_save, e, e_save, prev, msg[4];
+	UINTN i;
+
+	abcd = __builtin_ia32_pshufd(*(v4si_u *)&h[0], 0x1B);
+	e = (v4si){ 0, 0, 0, (int)h[4] };
+
+	for (; nb; nb--, data += 64) {
+		abcd_save = abcd;
+		e_save = e;
+		prev = abcd;
+		i = 0;
+
+		SHA1_NI_ROUNDS(0);
+		SHA1_NI_ROUNDS(1);
+		SHA1_NI_ROUNDS(2);
+		SHA1_NI_ROUNDS(3);
+
+		e = __builtin_ia32_sha1nexte(prev, e_save);
+		abcd += abcd_save;
+	}
+
+	*(v4si_u *)&h[0] = __builtin_ia32_pshufd(abcd, 0x1B);
+	h[4] = e[3];
+}
+
+/* OpenSSL keeps the message length in bits in the NL and NH
+   words.  */
+static void add_length(SHA_LONG *nl, SHA_LONG *nh, UINTN len)
+{
+	SHA_LONG l = *nl + (SHA_LONG)(len << 3);
+
+	if (l < *nl)
+		(*nh)++;
+	*nh += (SHA_LONG)((UINT64)len >> 29);
+	*nl = l;
+}
+
+void sha1_update(SHA_CTX *ctx, const VOID *data, UINTN len)
+{
+	const UINT8 *p = data;
+	UINT32 h[5];
+	UINTN fill, nb;
+
+	if (!sha_ni_supported()) {
+		SHA1_Update(ctx, data, len);
+		return;
+	}
+
+	/* Let OpenSSL complete the pending partial block if any */
+	if (ctx->num) {
+		fill = min(len, (UINTN)(SHA_CBLOCK - ctx->num));
+		SHA1_Update(ctx, p, fill);
+		p += fill;
+		len -= fill;
+	}
+
+	nb = len / SHA_CBLOCK;
+	if (nb) {
+		h[0] = ctx->h0;
+		h[1] = ctx->h1;
+		h[2] = ctx->h2;
+		h[3] = ctx->h3;
+		h[4] = ctx->h4;
+		sha1_ni_blocks(h, p, nb);
+		ctx->h0 = h[0];
+		ctx->h1 = h[1];
+		ctx->h2 = h[2];
+		ctx->h3 = h[3];
+		ctx->h4 = h[4];
+		add_length(&ctx->Nl, &ctx->Nh, nb * SHA_CBLOCK);
+		p += nb * SHA_CBLOCK;
+		len -= nb * SHA_CBLOCK;
+	}
+
+	if (len)
+		SHA1_Update(ctx, p, len);
+}
+
+void sha256_update(SHA256_CTX *ctx, const VOID *data, UINTN len)
+{
+	const UINT8 *p = data;
+	UINTN fill, nb;
+
+	if (!sha_ni_supported()) {
+		SHA256_Update(ctx, data, len);
+		return;
+	}
+
+	if (ctx->num) {
+		fill = min(len, (UINTN)(SHA256_CBLOCK - ctx->num));
+		SHA256_Update(ctx, p, fill);
+		p += fill;
+		len -= fill;
+	}
+
+	nb = len / SHA256_CBLOCK;
+	if (nb) {
+		sha256_ni_blocks((UINT32 *)ctx->h, p, nb);
+		add_length(&ctx->Nl, &ctx->Nh, nb * SHA256_CBLOCK);
+		p += nb * SHA256_CBLOCK;
+		len -= nb * SHA256_CBLOCK;
+	}
+
+	if (len)
+		SHA256_Update(ctx, p, len);
+}
+
+#else
+
+BOOLEAN sha_ni_supported(void)
+{
+	return FALSE;
+}
+
+void sha1_update(SHA_CTX *ctx, const VOID *data, UINTN len)
+{
+	SHA1_Update(ctx, data, len);
+}
+
+void sha256_update(SHA256_CTX *ctx, const VOID *data, UINTN len)
+{
+	SHA256_Update(ctx, data, len);
+}
+
+#endif
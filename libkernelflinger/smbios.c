@@ -41,29 +41,70 @@ char *SMBIOS_UNDEFINED = "N/A";
 /* Allow cast to pointer from integer of different size.  */
 #pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
 
-char *smbios_get_string(UINT8 type, UINT8 offset)
+/* The table is walked once to index the first structure of each type
+   and the strings are cached as they are looked up.  */
+#define SMBIOS_TYPE_END_OF_TABLE	127
+#define STRING_CACHE_SIZE		16
+
+static BOOLEAN indexed;
+static SMBIOS_HEADER *structures[256];
+static struct {
+	UINT8 type;
+	UINT8 offset;
+	char *str;
+} string_cache[STRING_CACHE_SIZE];
+static UINTN string_cache_nb;
+
+static void smbios_index(void)
 {
 	SMBIOS_STRUCTURE_TABLE *table;
 	EFI_STATUS ret;
 	SMBIOS_STRUCTURE_POINTER sm_struct;
-	UINT8 i;
-	CHAR8 *str;
+	UINT8 *end;
+
+	indexed = TRUE;
 
 	ret = LibGetSystemConfigurationTable(&SMBIOSTableGuid, (VOID**)&table);
 	if (EFI_ERROR(ret))
-		return SMBIOS_UNDEFINED;
+		return;
 
 	sm_struct.Hdr = (SMBIOS_HEADER *)table->TableAddress;
-	for (i = 0; i < table->TableLength; i++) {
-		if (sm_struct.Hdr->Type == type)
+	end = sm_struct.Raw + table->TableLength;
+	while (sm_struct.Raw < end) {
+		if (!structures[sm_struct.Hdr->Type])
+			structures[sm_struct.Hdr->Type] = sm_struct.Hdr;
+		if (sm_struct.Hdr->Type == SMBIOS_TYPE_END_OF_TABLE)
 			break;
 		LibGetSmbiosString(&sm_struct, -1);
 	}
+}
+
+char *smbios_get_string(UINT8 type, UINT8 offset)
+{
+	SMBIOS_STRUCTURE_POINTER sm_struct;
+	CHAR8 *str;
+	UINTN i;
 
-	if (i == table->TableLength)
+	if (!indexed)
+		smbios_index();
+
+	for (i = 0; i < string_cache_nb; i++)
+		if (string_cache[i].type == type &&
+		    string_cache[i].offset == offset)
+			return string_cache[i].str;
+
+	sm_struct.Hdr = structures[type];
+	if (!sm_struct.Hdr)
 		return SMBIOS_UNDEFINED;
 
 	str = LibGetSmbiosString(&sm_struct, sm_struct.Raw[offset]);
 
+	if (string_cache_nb < STRING_CACHE_SIZE) {
+		string_cache[string_cache_nb].type = type;
+		string_cache[string_cache_nb].offset = offset;
+		string_cache[string_cache_nb].str = str ? (char *)str : SMBIOS_UNDEFINED;
+		string_cache_nb++;
+	}
+
 	return str ? (char *)str : SMBIOS_UNDEFINED;
 }
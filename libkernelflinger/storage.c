@@ -33,7 +33,10 @@
 #include <log.h>
 #include <lib.h>
 #include "storage.h"
+#include "uefi_utils.h"
+#include "async_io.h"
 #include "pci.h"
+#include "vars.h"
 
 static struct storage *storage;
 static PCI_DEVICE_PATH boot_device;
@@ -52,24 +55,61 @@ static BOOLEAN is_boot_device(EFI_DEVICE_PATH *p)
 		&& pci->Device == boot_device.Device;
 }
 
+extern struct storage STORAGE(STORAGE_RAMDISK);
+
+#ifdef STORAGE_ONLY
+/* Single boot medium build: only its backend is compiled in and
+   probed, the RAM disk is still available on request.  STORAGE()
+   pastes its argument unexpanded, hence the indirection.  */
+#define ONLY_STORAGE_(X)	STORAGE(X)
+#define ONLY_STORAGE		ONLY_STORAGE_(STORAGE_ONLY)
+
+extern struct storage ONLY_STORAGE;
+
+static struct storage *supported_storage[STORAGE_ALL] =  {
+	[STORAGE_ONLY] = &ONLY_STORAGE,
+	[STORAGE_RAMDISK] = &STORAGE(STORAGE_RAMDISK)
+};
+
+#define FIRST_STORAGE	STORAGE_ONLY
+#else
 extern struct storage STORAGE(STORAGE_EMMC);
 extern struct storage STORAGE(STORAGE_UFS);
 extern struct storage STORAGE(STORAGE_SDCARD);
 extern struct storage STORAGE(STORAGE_SATA);
+extern struct storage STORAGE(STORAGE_NVME);
+
+static struct storage *supported_storage[STORAGE_ALL] =  {
+	&STORAGE(STORAGE_EMMC),
+	&STORAGE(STORAGE_UFS),
+	&STORAGE(STORAGE_SDCARD),
+	&STORAGE(STORAGE_SATA),
+	&STORAGE(STORAGE_NVME),
+	&STORAGE(STORAGE_RAMDISK)
+};
+
+#define FIRST_STORAGE	STORAGE_EMMC
+#endif
 
 static EFI_STATUS identify_storage(EFI_DEVICE_PATH *device_path,
 				   enum storage_type filter)
 {
 	enum storage_type st;
-	static struct storage *supported_storage[STORAGE_ALL] =  {
-		&STORAGE(STORAGE_EMMC),
-		&STORAGE(STORAGE_UFS),
-		&STORAGE(STORAGE_SDCARD),
-		&STORAGE(STORAGE_SATA)
-	};
-
-	for (st = STORAGE_EMMC; st < STORAGE_ALL; st++) {
-		if ((filter == st || filter == STORAGE_ALL) &&
+
+#ifdef STORAGE_ONLY
+	/* Skip the table walk for the usual full identification */
+	if (filter == STORAGE_ALL) {
+		if (!ONLY_STORAGE.probe(device_path))
+			return EFI_UNSUPPORTED;
+		storage = &ONLY_STORAGE;
+		debug(L"%s storage identified", storage->name);
+		return EFI_SUCCESS;
+	}
+#endif
+
+	for (st = FIRST_STORAGE; st < STORAGE_ALL; st++) {
+		if ((filter == st ||
+		     (filter == STORAGE_ALL && st != STORAGE_RAMDISK)) &&
 		    supported_storage[st] && supported_storage[st]->probe(device_path)) {
 			debug(L"%s storage identified", supported_storage[st]->name);
 			storage = supported_storage[st];
@@ -80,6 +120,96 @@ static EFI_STATUS identify_storage(EFI_DEVICE_PATH *device_path,
 	return EFI_UNSUPPORTED;
 }
 
+/* The boot device found by a full enumeration is saved so that the
+   next boots only probe that device.  */
+#define BOOT_STORAGE_VAR	L"BootStorage"
+
+struct boot_storage {
+	UINT32 type;
+	UINT8 device;
+	UINT8 function;
+} __attribute__((packed));
+
+static EFI_STATUS get_cached_boot_storage(struct boot_storage *cache)
+{
+	struct boot_storage *data;
+	UINTN size;
+	EFI_STATUS ret;
+
+	ret = get_efi_variable(&loader_guid, BOOT_STORAGE_VAR, &size,
+			       (VOID **)&data, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (size != sizeof(*cache) || data->type >= STORAGE_ALL) {
+		FreePool(data);
+		return EFI_COMPROMISED_DATA;
+	}
+
+	memcpy(cache, data, sizeof(*cache));
+	FreePool(data);
+	return EFI_SUCCESS;
+}
+
+static void set_cached_boot_storage(void)
+{
+	struct boot_storage cache, prev;
+	EFI_STATUS ret;
+
+	ZeroMem(&cache, sizeof(cache));
+	for (cache.type = STORAGE_EMMC; cache.type < STORAGE_ALL; cache.type++)
+		if (storage == supported_storage[cache.type])
+			break;
+	/* The RAM disk does not survive a reset */
+	if (cache.type == STORAGE_RAMDISK)
+		return;
+	cache.device = boot_device.Device;
+	cache.function = boot_device.Function;
+
+	ret = get_cached_boot_storage(&prev);
+	if (!EFI_ERROR(ret) && !memcmp(&prev, &cache, sizeof(cache)))
+		return;
+
+	ret = set_efi_variable(&loader_guid, BOOT_STORAGE_VAR, sizeof(cache),
+			       &cache, TRUE, FALSE);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to save the boot storage");
+}
+
+static EFI_STATUS identify_cached_boot_device(enum storage_type type,
+					      EFI_HANDLE *handles, UINTN nb_handle)
+{
+	struct boot_storage cache;
+	EFI_DEVICE_PATH *device_path;
+	PCI_DEVICE_PATH *pci;
+	EFI_STATUS ret;
+	UINTN i;
+
+	ret = get_cached_boot_storage(&cache);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (type != STORAGE_ALL && type != cache.type)
+		return EFI_NOT_FOUND;
+
+	for (i = 0; i < nb_handle; i++) {
+		device_path = DevicePathFromHandle(handles[i]);
+		pci = get_pci_device_path(device_path);
+		if (!pci || pci->Device != cache.device
+		    || pci->Function != cache.function)
+			continue;
+
+		if (EFI_ERROR(identify_storage(device_path, cache.type)))
+			continue;
+
+		memcpy(&boot_device, pci, sizeof(boot_device));
+		return EFI_SUCCESS;
+	}
+
+	debug(L"Cached boot storage not found");
+	return EFI_NOT_FOUND;
+}
+
 EFI_STATUS identify_boot_device(enum storage_type type)
 {
 	EFI_STATUS ret;
@@ -97,6 +227,12 @@ EFI_STATUS identify_boot_device(enum storage_type type)
 	}
 
 	boot_device.Header.Type = 0;
+	ret = identify_cached_boot_device(type, handles, nb_handle);
+	if (!EFI_ERROR(ret)) {
+		FreePool(handles);
+		return EFI_SUCCESS;
+	}
+
 	for (i = 0; i < nb_handle; i++) {
 		device_path = DevicePathFromHandle(handles[i]);
 		pci = get_pci_device_path(device_path);
@@ -119,10 +255,12 @@ EFI_STATUS identify_boot_device(enum storage_type type)
 
 	FreePool(handles);
 
-	if (!pci) {
+	if (!boot_device.Header.Type || !storage) {
 		error(L"No PCI storage found");
 		return EFI_UNSUPPORTED;
 	}
+
+	set_cached_boot_storage();
 	return EFI_SUCCESS;
 }
 
@@ -150,43 +288,112 @@ EFI_STATUS storage_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, UINT64 sta
 	if (!valid_storage())
 		return EFI_UNSUPPORTED;
 
-	debug(L"Erase lba %ld -> %ld", start, end);
+	log_debug(STORAGE, L"Erase lba %ld -> %ld", start, end);
 	return storage->erase_blocks(handle, bio, start, end);
 }
 
+EFI_STATUS storage_erase_ranges(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				struct lba_range *ranges, UINTN nb)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	if (!valid_storage())
+		return EFI_UNSUPPORTED;
+
+	if (storage->erase_ranges) {
+		log_debug(STORAGE, L"Erase %d ranges", nb);
+		return storage->erase_ranges(handle, bio, ranges, nb);
+	}
+
+	for (i = 0; i < nb; i++) {
+		log_verbose(STORAGE, L"Erase lba %ld -> %ld", ranges[i].start, ranges[i].end);
+		ret = storage->erase_blocks(handle, bio, ranges[i].start,
+					    ranges[i].end);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
 #define percent5(x, max) (x) * 20 / (max) * 5
 
+/* Large writes keep the media busy but the queue of asynchronous
+   writes must also be kept filled: a range is written in at least
+   FILL_MIN_WRITES chunks up to FILL_MAX_SIZE each.  */
+#define FILL_MAX_SIZE	(16 * 1024 * 1024)
+#define FILL_MIN_WRITES	(ASYNC_IO_DEPTH * 4)
+
+UINTN fill_chunk_blocks(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end)
+{
+	UINT64 range = end - start + 1;
+	UINTN unit, chunk;
+
+	/* The chunk size is a multiple of IoAlign so that any offset
+	   of the pattern keeps the buffer aligned */
+	unit = max(bio->Media->BlockSize, bio->Media->IoAlign);
+	unit = ALIGN(unit, bio->Media->BlockSize) / bio->Media->BlockSize;
+
+	chunk = range / FILL_MIN_WRITES;
+	chunk = max(chunk, (UINTN)N_BLOCK);
+	chunk = min(chunk, (UINTN)(FILL_MAX_SIZE / bio->Media->BlockSize));
+	chunk = max(chunk - chunk % unit, unit);
+
+	if (range < chunk)
+		chunk = ALIGN(range, unit);
+
+	return chunk;
+}
+
 EFI_STATUS fill_with(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end,
 			    VOID *pattern, UINTN pattern_blocks)
 {
 	UINT64 lba;
 	UINT64 size;
 	UINT64 prev = 0, progress = 0;
+	BOOLEAN nested;
 	EFI_STATUS ret;
 
-	debug(L"Fill lba %d -> %d", start, end);
+	log_debug(STORAGE, L"Fill lba %d -> %d", start, end);
 	if (end <= start)
 		return EFI_INVALID_PARAMETER;
 
-	for (lba = start; lba <= end; lba += pattern_blocks, prev = progress,
+	/* PATTERN is never modified, the writes do not need a copy.  The
+	   writer of a caller is left opened: its device is written
+	   through it, another device synchronously.  */
+	nested = async_write_opened();
+	if (!nested)
+		async_write_open(bio);
+
+	/* The first write stops at a multiple of PATTERN_BLOCKS so that
+	   the following ones are aligned on the chunk size */
+	for (lba = start; lba <= end; lba += size, prev = progress,
 				      progress = percent5(lba - start, end - start)) {
-		if (lba + pattern_blocks > end + 1)
+		size = pattern_blocks - lba % pattern_blocks;
+		if (lba + size > end + 1)
 			size = end - lba + 1;
-		else
-			size = pattern_blocks;
 
 		if (progress != prev)
-			debug(L"%d%% completed", progress);
+			log_verbose(STORAGE, L"%d%% completed", progress);
 
-		ret = uefi_call_wrapper(bio->WriteBlocks, 5, bio, bio->Media->MediaId, lba,
-					bio->Media->BlockSize * size, pattern);
+		ret = async_write_blocks(bio, lba, bio->Media->BlockSize * size,
+					 pattern, FALSE);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Failed to erase block %ld", lba);
+			if (nested)
+				async_write_sync();
+			else
+				async_write_close();
 			return ret;
 		}
 	}
 
-	return EFI_SUCCESS;
+	/* PATTERN may be released once we return */
+	ret = nested ? async_write_sync() : async_write_close();
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to erase blocks");
+	return ret;
 }
 
 EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end)
@@ -194,14 +401,20 @@ EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end)
 	EFI_STATUS ret;
 	VOID *emptyblock;
 	VOID *aligned_emptyblock;
-
-	ret = alloc_aligned(&emptyblock, &aligned_emptyblock,
-			    bio->Media->BlockSize * N_BLOCK,
-			    bio->Media->IoAlign);
+	UINTN blocks;
+
+	/* Fallback on smaller chunks if memory is short */
+	for (blocks = fill_chunk_blocks(bio, start, end); ; blocks /= 2) {
+		ret = alloc_aligned(&emptyblock, &aligned_emptyblock,
+				    bio->Media->BlockSize * blocks,
+				    bio->Media->IoAlign);
+		if (ret != EFI_OUT_OF_RESOURCES || blocks <= N_BLOCK)
+			break;
+	}
 	if (EFI_ERROR(ret))
 		return ret;
 
-	ret = fill_with(bio, start, end, aligned_emptyblock, N_BLOCK);
+	ret = fill_with(bio, start, end, aligned_emptyblock, blocks);
 
 	FreePool(emptyblock);
 
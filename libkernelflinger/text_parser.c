@@ -42,49 +42,112 @@ void skip_whitespace(char **line)
 	*line = cur;
 }
 
-EFI_STATUS parse_text_buffer(VOID *data, UINTN size,
-			     EFI_STATUS (*parse_line)(char *line, VOID *ctx),
-			     VOID *context)
+void text_iter_init(text_iter_t *it, VOID *data, UINTN size)
 {
-	EFI_STATUS ret = EFI_SUCCESS;
-	char *buf, *line, *eol, *p;
-	int lineno = 0;
-
-	/* Extra byte so we can always terminate the last line. */
-	buf = AllocatePool(size + 1);
-	if (!buf) {
-		error(L"Failed to allocate text copy buffer");
-		return EFI_OUT_OF_RESOURCES;
+	it->cur = data;
+	it->end = (char *)data + size;
+	it->lineno = 0;
+}
+
+void text_slice_trim(text_slice_t *s)
+{
+	while (s->len && isspace(*s->ptr)) {
+		s->ptr++;
+		s->len--;
+	}
+	while (s->len && isspace(s->ptr[s->len - 1]))
+		s->len--;
+}
+
+BOOLEAN text_next_line(text_iter_t *it, text_slice_t *line)
+{
+	char *eol;
+
+	while (it->cur < it->end) {
+		it->lineno++;
+		line->ptr = it->cur;
+		for (eol = it->cur; eol < it->end && *eol != '\n' && *eol; eol++)
+			;
+		line->len = eol - it->cur;
+		it->cur = eol + 1;
+
+		text_slice_trim(line);
+		if (line->len)
+			return TRUE;
 	}
-	memcpy(buf, data, size);
-	buf[size] = 0;
 
-	for (line = buf; line - buf < (ssize_t)size; line = eol + 1) {
-		lineno++;
+	return FALSE;
+}
+
+BOOLEAN text_next_token(text_slice_t *s, text_slice_t *token)
+{
+	UINTN i;
+
+	text_slice_trim(s);
+	if (!s->len)
+		return FALSE;
+
+	for (i = 0; i < s->len && !isspace(s->ptr[i]); i++)
+		;
+	token->ptr = s->ptr;
+	token->len = i;
+	s->ptr += i;
+	s->len -= i;
+	return TRUE;
+}
+
+char *text_slice_chr(text_slice_t *s, char c)
+{
+	UINTN i;
+
+	for (i = 0; i < s->len; i++)
+		if (s->ptr[i] == c)
+			return &s->ptr[i];
+	return NULL;
+}
+
+BOOLEAN text_slice_eq(text_slice_t *s, const char *str)
+{
+	UINTN len = strlen((CHAR8 *)str);
 
-		/* Detect line and terminate. */
-		eol = (char *)strchr((CHAR8 *)line, '\n');
-		if (!eol)
-			eol = line + strlen((CHAR8 *)line);
-		*eol = 0;
+	return s->len == len && !memcmp(s->ptr, str, len);
+}
 
-		/* Snip space character for sanity. */
-		p = line + strlen((CHAR8 *)line);
-		while (p > line && isspace(*(p-1)))
-			*(--p) = 0;
+/* The lines are copied one at a time in a buffer which only grows to
+   the longest line length.  */
+EFI_STATUS parse_text_buffer(VOID *data, UINTN size,
+			     EFI_STATUS (*parse_line)(char *line, VOID *ctx),
+			     VOID *context)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	text_iter_t it;
+	text_slice_t line;
+	char *buf = NULL;
+	UINTN buf_size = 0;
 
-		skip_whitespace(&line);
-		if (*line == '\0')
-			continue;
+	text_iter_init(&it, data, size);
+	while (text_next_line(&it, &line)) {
+		if (line.len + 1 > buf_size) {
+			if (buf)
+				FreePool(buf);
+			buf_size = max(line.len + 1, (UINTN)256);
+			buf = AllocatePool(buf_size);
+			if (!buf) {
+				error(L"Failed to allocate text line buffer");
+				return EFI_OUT_OF_RESOURCES;
+			}
+		}
+		memcpy(buf, line.ptr, line.len);
+		buf[line.len] = '\0';
 
-		ret = parse_line(line, context);
+		ret = parse_line(buf, context);
 		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed at line %d", lineno);
-			goto exit;
+			efi_perror(ret, L"Failed at line %d", it.lineno);
+			break;
 		}
 	}
 
-exit:
-	FreePool(buf);
+	if (buf)
+		FreePool(buf);
 	return ret;
 }
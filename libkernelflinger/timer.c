@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "timer.h"
+
+#define CPUID_TSC_LEAF 0x15
+#define CALIBRATION_US 1000
+
+/* Time stamp counter ticks per millisecond */
+static UINT64 ticks_per_ms;
+
+UINT64 timer_ticks(void)
+{
+	UINT32 lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((UINT64)hi << 32) | lo;
+}
+
+static void calibrate(void)
+{
+	UINT32 reg[4];
+	UINT64 start;
+
+	/* EAX:EBX is the TSC / crystal ratio and ECX the crystal
+	   frequency in Hz, if enumerated.  */
+	cpuid(0, reg);
+	if (reg[0] >= CPUID_TSC_LEAF) {
+		cpuid(CPUID_TSC_LEAF, reg);
+		if (reg[0] && reg[1] && reg[2]) {
+			ticks_per_ms = (UINT64)reg[2] * reg[1] / reg[0] / 1000;
+			return;
+		}
+	}
+
+	start = timer_ticks();
+	uefi_call_wrapper(BS->Stall, 1, CALIBRATION_US);
+	ticks_per_ms = (timer_ticks() - start) * 1000 / CALIBRATION_US;
+	if (!ticks_per_ms)
+		ticks_per_ms = 1;
+}
+
+UINT64 timer_ticks_to_us(UINT64 ticks)
+{
+	if (!ticks_per_ms)
+		calibrate();
+
+	return ticks * 1000 / ticks_per_ms;
+}
+
+UINT64 timer_ticks_per_ms(void)
+{
+	if (!ticks_per_ms)
+		calibrate();
+
+	return ticks_per_ms;
+}
+
+UINT64 timer_us(void)
+{
+	return timer_ticks_to_us(timer_ticks());
+}
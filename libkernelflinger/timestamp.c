@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "vars.h"
+#include "timer.h"
+#include "targets.h"
+#include "timestamp.h"
+
+static struct {
+	const char *name;
+	UINT64 ticks;
+} records[MAX_TIMESTAMPS];
+static UINTN nb_records;
+static struct timestamp *last_boot;
+static UINTN last_boot_count;
+/* A boot bench sample was recorded, the time stamps are kept across
+   the reboot.  */
+static BOOLEAN persist;
+
+void timestamp_record(const char *name)
+{
+	if (nb_records == MAX_TIMESTAMPS)
+		return;
+
+	records[nb_records].name = name;
+	records[nb_records].ticks = timer_ticks();
+	nb_records++;
+}
+
+UINTN timestamp_get(struct timestamp *stamps, UINTN max)
+{
+	UINTN i;
+
+	for (i = 0; i < nb_records && i < max; i++) {
+		ZeroMem(stamps[i].name, sizeof(stamps[i].name));
+		strncpy((CHAR8 *)stamps[i].name, (CHAR8 *)records[i].name,
+			sizeof(stamps[i].name) - 1);
+		stamps[i].us = timer_ticks_to_us(records[i].ticks);
+	}
+
+	return i;
+}
+
+CHAR16 *timestamp_timeline(void)
+{
+	CHAR16 *timeline = NULL, *tmp;
+	UINTN i;
+
+	for (i = 0; i < nb_records; i++) {
+		tmp = PoolPrint(L"%s%s%a:%ld", timeline ? timeline : L"",
+				timeline ? L"," : L"", records[i].name,
+				timer_ticks_to_us(records[i].ticks));
+		if (timeline)
+			FreePool(timeline);
+		if (!tmp)
+			return NULL;
+		timeline = tmp;
+	}
+
+	return timeline;
+}
+
+/* The previous boot time stamps are read before they are replaced */
+static EFI_STATUS load_last_boot(void)
+{
+	EFI_STATUS ret;
+	UINT32 flags;
+	UINTN size;
+	VOID *data;
+
+	if (last_boot)
+		return EFI_SUCCESS;
+
+	ret = get_efi_variable(&loader_guid, TIMESTAMPS_VAR, &size, &data,
+			       &flags);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!size || size % sizeof(*last_boot)) {
+		FreePool(data);
+		return EFI_COMPROMISED_DATA;
+	}
+
+	last_boot = data;
+	last_boot_count = size / sizeof(*last_boot);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS timestamp_get_last_boot(struct timestamp **stamps, UINTN *count)
+{
+	EFI_STATUS ret;
+
+	if (!stamps || !count)
+		return EFI_INVALID_PARAMETER;
+
+	ret = load_last_boot();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	*stamps = AllocatePool(last_boot_count * sizeof(**stamps));
+	if (!*stamps)
+		return EFI_OUT_OF_RESOURCES;
+
+	memcpy(*stamps, last_boot, last_boot_count * sizeof(**stamps));
+	*count = last_boot_count;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS timestamp_save(void)
+{
+	struct timestamp stamps[MAX_TIMESTAMPS];
+	UINTN count;
+
+	if (!nb_records)
+		return EFI_SUCCESS;
+
+	/* Not to write the non-volatile storage on every boot, the time
+	   stamps only survive a reset during a boot bench run.  */
+	load_last_boot();
+	count = timestamp_get(stamps, ARRAY_SIZE(stamps));
+	return set_efi_variable(&loader_guid, TIMESTAMPS_VAR,
+				count * sizeof(*stamps), stamps, persist, TRUE);
+}
+
+struct boot_bench {
+	UINT32 remaining;
+	UINT32 count;
+	UINT32 next;
+	UINT32 us[BOOT_BENCH_SAMPLES];
+} __attribute__((packed));
+
+static EFI_STATUS boot_bench_load(struct boot_bench *bench)
+{
+	EFI_STATUS ret;
+	UINT32 flags;
+	UINTN size;
+	VOID *data;
+
+	ret = get_efi_variable(&loader_guid, BOOT_BENCH_VAR, &size, &data,
+			       &flags);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (size != sizeof(*bench)) {
+		FreePool(data);
+		return EFI_COMPROMISED_DATA;
+	}
+
+	memcpy(bench, data, sizeof(*bench));
+	FreePool(data);
+
+	if (bench->count > BOOT_BENCH_SAMPLES ||
+	    bench->next >= BOOT_BENCH_SAMPLES)
+		return EFI_COMPROMISED_DATA;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS boot_bench_store(struct boot_bench *bench)
+{
+	return set_efi_variable(&loader_guid, BOOT_BENCH_VAR, sizeof(*bench),
+				bench, TRUE, FALSE);
+}
+
+EFI_STATUS timestamp_bench_start(UINT32 boots)
+{
+	struct boot_bench bench;
+
+	ZeroMem(&bench, sizeof(bench));
+	bench.remaining = boots;
+	return boot_bench_store(&bench);
+}
+
+void timestamp_bench_record(void)
+{
+	struct boot_bench bench;
+	EFI_STATUS ret;
+	UINT64 us;
+
+	ret = boot_bench_load(&bench);
+	if (EFI_ERROR(ret) || !bench.remaining)
+		return;
+
+	us = timer_ticks_to_us(timer_ticks());
+	bench.us[bench.next] = min(us, (UINT32)-1);
+	bench.next = (bench.next + 1) % BOOT_BENCH_SAMPLES;
+	if (bench.count < BOOT_BENCH_SAMPLES)
+		bench.count++;
+	bench.remaining--;
+	persist = TRUE;
+
+	ret = boot_bench_store(&bench);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to save the boot bench sample");
+		return;
+	}
+
+	if (!bench.remaining)
+		return;
+
+	debug(L"Boot bench: %ld us, %d boot(s) remaining", us, bench.remaining);
+	reboot_to_target(NORMAL_BOOT);
+}
+
+EFI_STATUS timestamp_bench_get(struct boot_bench_stats *stats)
+{
+	struct boot_bench bench;
+	EFI_STATUS ret;
+	UINT32 *us, tmp;
+	UINTN i, j;
+
+	if (!stats)
+		return EFI_INVALID_PARAMETER;
+
+	ret = boot_bench_load(&bench);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ZeroMem(stats, sizeof(*stats));
+	stats->remaining = bench.remaining;
+	stats->count = bench.count;
+	if (!bench.count)
+		return EFI_SUCCESS;
+
+	/* At most BOOT_BENCH_SAMPLES samples, an insertion sort does */
+	us = bench.us;
+	for (i = 1; i < bench.count; i++) {
+		tmp = us[i];
+		for (j = i; j > 0 && us[j - 1] > tmp; j--)
+			us[j] = us[j - 1];
+		us[j] = tmp;
+	}
+
+	stats->min_us = us[0];
+	stats->p50_us = us[(bench.count - 1) / 2];
+	stats->p99_us = us[(bench.count - 1) * 99 / 100];
+	stats->max_us = us[bench.count - 1];
+	return EFI_SUCCESS;
+}
@@ -10,3 +10,12 @@ LOCAL_CFLAGS += -O2 -g -Wall -Werror -pedantic
 LOCAL_MODULE := png2c
 
 include $(BUILD_HOST_EXECUTABLE)
+
+################################
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := tracedump.c
+LOCAL_CFLAGS += -O2 -g -Wall -Werror
+LOCAL_MODULE := tracedump
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -49,7 +49,7 @@ static char *program_name;
 
 static void usage(int status)
 {
-	printf("Usage: %s -i FILE -o FILE -f FORMAT -p NAME\n",
+	printf("Usage: %s -i FILE -o FILE -f FORMAT -p NAME [-c]\n",
 	       basename((char *)program_name));
 	printf("\
 Transform PNG file to C source data structure.\n\
@@ -57,6 +57,7 @@ Transform PNG file to C source data structure.\n\
   -i, --input-file=FILE         write data into FILE instead of printing it\n\
   -f, --output-format=FORMAT    allowed values are: RGBA, BGRA, GRAY\n\
   -p, --prefix=NAME             prefix name for C content\n\
+  -c, --compress                run-length encode the pixels\n\
   -h, --help                    display this help\n\
 ");
 	exit(status);
@@ -100,6 +101,49 @@ static void write_to_c_source(const char *name, png_bytep buffer,
 		fclose(f);
 }
 
+/* Run-length encoding of PIXEL bytes wide pixels.  Each packet starts
+   with a header byte: if its high bit is set, the next pixel is
+   repeated (header & 0x7f) + 1 times, otherwise header + 1 literal
+   pixels follow.  DST must be able to hold SIZE + SIZE / PIXEL
+   bytes.  */
+#define RLE_RUN		0x80
+#define RLE_MAX		128
+
+static unsigned int rle_compress(png_bytep src, unsigned int size,
+				 unsigned int pixel, png_bytep dst)
+{
+	unsigned int nb = size / pixel, i = 0, len = 0, n;
+
+#define PIXEL(i) (src + (i) * pixel)
+	while (i < nb) {
+		for (n = 1; i + n < nb && n < RLE_MAX; n++)
+			if (memcmp(PIXEL(i + n), PIXEL(i), pixel))
+				break;
+
+		if (n > 1) {
+			dst[len++] = RLE_RUN | (n - 1);
+			memcpy(dst + len, PIXEL(i), pixel);
+			len += pixel;
+			i += n;
+			continue;
+		}
+
+		/* Literals up to the beginning of the next run */
+		for (n = 1; i + n < nb && n < RLE_MAX; n++)
+			if (i + n + 1 < nb &&
+			    !memcmp(PIXEL(i + n), PIXEL(i + n + 1), pixel))
+				break;
+
+		dst[len++] = n - 1;
+		memcpy(dst + len, PIXEL(i), n * pixel);
+		len += n * pixel;
+		i += n;
+	}
+#undef PIXEL
+
+	return len;
+}
+
 static png_uint_32 get_format_from_string(const char *str)
 {
 	static struct str_to_format {
@@ -125,6 +169,7 @@ static struct option const long_options[] = {
 	{"output-file", required_argument, NULL, 'o'},
 	{"output-format", required_argument, NULL, 'f'},
 	{"prefix", required_argument, NULL, 'p'},
+	{"compress", no_argument, NULL, 'c'},
 	{"help", no_argument, NULL, 'h'},
 	{NULL, 0, NULL, 0}
 };
@@ -132,9 +177,10 @@ static struct option const long_options[] = {
 int main(int argc, char **argv)
 {
 	png_image image;
-	png_bytep buffer;
+	png_bytep buffer, compressed;
 	unsigned int size;
 	bool format_initialized = false;
+	bool compress = false;
 	png_uint_32 format = 0;
 	const char *ipath = NULL;
 	const char *opath = NULL;
@@ -143,7 +189,7 @@ int main(int argc, char **argv)
 
 	program_name = argv[0];
 
-	while ((c = getopt_long(argc, argv, "i:o:f:p:h", long_options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "i:o:f:p:ch", long_options, NULL)) != -1) {
 		switch (c) {
 		case 'i':
 			ipath = optarg;
@@ -158,6 +204,9 @@ int main(int argc, char **argv)
 			format = get_format_from_string(optarg);
 			format_initialized = true;
 			break;
+		case 'c':
+			compress = true;
+			break;
 		case 'h':
 			usage(EXIT_SUCCESS);
 			break;
@@ -186,6 +235,17 @@ int main(int argc, char **argv)
 	if (!png_image_finish_read(&image, NULL, buffer, 0, NULL))
 		error("Failed to read  PNG file.");
 
+	if (compress) {
+		compressed = malloc(size + size / PNG_IMAGE_PIXEL_SIZE(format));
+		if (!compressed)
+			error("Failed to allocate buffer.");
+
+		size = rle_compress(buffer, size, PNG_IMAGE_PIXEL_SIZE(format),
+				    compressed);
+		free(buffer);
+		buffer = compressed;
+	}
+
 	write_to_c_source(prefix, buffer, size, opath);
 
 	png_image_free(&image);
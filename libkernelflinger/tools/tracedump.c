@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <libgen.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+/* Host copies of the trace.h structures */
+#define TRACE_MAGIC	0x5254464b
+#define TRACE_VERSION	1
+
+struct trace_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint64_t ticks_per_ms;
+	uint64_t count;
+	uint64_t lost;
+} __attribute__((packed));
+
+struct trace_record {
+	uint64_t ticks;
+	uint32_t event;
+	uint32_t a;
+	uint64_t b;
+} __attribute__((packed));
+
+static const char *EVENT_NAMES[] = {
+#define TRACE_EVENT(id, name) name,
+#include "../../include/libkernelflinger/trace_events.h"
+#undef TRACE_EVENT
+};
+
+static char *program_name;
+
+static void usage(int status)
+{
+	printf("Usage: %s [-i FILE]\n", basename((char *)program_name));
+	printf("\
+Decode a kernelflinger trace dump retrieved with \"adb pull trace\".\n\
+  -i, --input-file=FILE         read the dump from FILE instead of stdin\n\
+  -h, --help                    display this help\n\
+");
+	exit(status);
+}
+
+static void error(const char *s)
+{
+	fprintf(stderr, "%s\n", s);
+	exit(EXIT_FAILURE);
+}
+
+static struct option const long_options[] = {
+	{"input-file", required_argument, NULL, 'i'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+	struct trace_header header;
+	struct trace_record record;
+	const char *name;
+	uint64_t i, start = 0, prev = 0, us;
+	FILE *fp = stdin;
+	int c;
+
+	program_name = argv[0];
+
+	while ((c = getopt_long(argc, argv, "i:h", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'i':
+			fp = fopen(optarg, "rb");
+			if (!fp) {
+				perror(optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (fread(&header, sizeof(header), 1, fp) != 1)
+		error("Failed to read the trace header.");
+
+	if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+	    header.record_size != sizeof(record) || !header.ticks_per_ms)
+		error("Invalid trace header.");
+
+	printf("%" PRIu64 " records, %" PRIu64 " lost\n",
+	       header.count, header.lost);
+
+	for (i = 0; i < header.count; i++) {
+		if (fread(&record, sizeof(record), 1, fp) != 1)
+			error("Truncated trace.");
+
+		if (!i)
+			start = prev = record.ticks;
+		us = (record.ticks - start) * 1000 / header.ticks_per_ms;
+		name = record.event < ARRAY_SIZE(EVENT_NAMES) ?
+			EVENT_NAMES[record.event] : "unknown";
+		printf("%12" PRIu64 " us (+%6" PRIu64 ") %-16s %08x %016" PRIx64 "\n",
+		       us, (record.ticks - prev) * 1000 / header.ticks_per_ms,
+		       name, record.a, record.b);
+		prev = record.ticks;
+	}
+
+	if (fp != stdin)
+		fclose(fp);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2016, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "timer.h"
+#include "trace.h"
+
+/* Size of the ring in bytes, several MiB by default, can be set with
+   KERNELFLINGER_CFLAGS.  */
+#ifndef TRACE_SIZE
+#define TRACE_SIZE	(4 * 1024 * 1024)
+#endif
+
+static const char *EVENT_NAMES[] = {
+#define TRACE_EVENT(id, name) name,
+#include "trace_events.h"
+#undef TRACE_EVENT
+};
+
+static struct {
+	trace_record_t *records;
+	UINTN capacity;
+	UINT64 count;
+} ring;
+
+/* The ring stays allocated for the lifetime of the image so that a
+   later session, crashmode for instance, can retrieve it.  */
+EFI_STATUS trace_init(void)
+{
+	if (ring.records)
+		return EFI_SUCCESS;
+
+	ring.capacity = TRACE_SIZE / sizeof(*ring.records);
+	ring.records = AllocatePool(ring.capacity * sizeof(*ring.records));
+	if (!ring.records)
+		return EFI_OUT_OF_RESOURCES;
+
+	ring.count = 0;
+	return EFI_SUCCESS;
+}
+
+/* Record producers may run in event notification functions.  */
+void trace(enum trace_event event, UINT32 a, UINT64 b)
+{
+	trace_record_t *r;
+
+	if (!ring.records)
+		return;
+
+	r = &ring.records[__sync_fetch_and_add(&ring.count, 1) % ring.capacity];
+	r->ticks = timer_ticks();
+	r->event = event;
+	r->a = a;
+	r->b = b;
+}
+
+EFI_STATUS trace_dump(void **buf, UINTN *size)
+{
+	trace_header_t *header;
+	UINT64 count = ring.count;
+	UINTN nb, first, n;
+
+	if (!ring.records)
+		return EFI_NOT_FOUND;
+
+	nb = min(count, (UINT64)ring.capacity);
+	header = AllocatePool(sizeof(*header) + nb * sizeof(*ring.records));
+	if (!header)
+		return EFI_OUT_OF_RESOURCES;
+
+	header->magic = TRACE_MAGIC;
+	header->version = TRACE_VERSION;
+	header->record_size = sizeof(*ring.records);
+	header->ticks_per_ms = timer_ticks_per_ms();
+	header->count = nb;
+	header->lost = count - nb;
+
+	first = (count - nb) % ring.capacity;
+	n = min(nb, ring.capacity - first);
+	memcpy(header + 1, ring.records + first, n * sizeof(*ring.records));
+	memcpy((trace_record_t *)(header + 1) + n, ring.records,
+	       (nb - n) * sizeof(*ring.records));
+
+	*buf = header;
+	*size = sizeof(*header) + nb * sizeof(*ring.records);
+	return EFI_SUCCESS;
+}
+
+const char *trace_event_name(UINT32 event)
+{
+	return event < ARRAY_SIZE(EVENT_NAMES) ? EVENT_NAMES[event] : "unknown";
+}
@@ -43,6 +43,64 @@
 const EFI_GUID esp_ptn_guid = { 0x2568845d, 0x2332, 0x4675,
 		{0xbc, 0x39, 0x8f, 0xa5, 0xa4, 0x74, 0x8d, 0x15}};
 
+/* The ESP file system interface and the root directory of the last
+   volumes used are kept until uefi_fs_cache_flush(), which is called
+   whenever the partitions may have been enumerated again.  */
+#define ROOT_CACHE_SIZE 4
+
+static EFI_FILE_IO_INTERFACE *esp_fs_cache;
+static struct {
+	EFI_FILE_IO_INTERFACE *io;
+	EFI_FILE *root;
+} root_cache[ROOT_CACHE_SIZE];
+static UINTN root_cache_next;
+
+static void dir_cache_flush(void);
+
+void uefi_fs_cache_flush(void)
+{
+	UINTN i;
+
+	dir_cache_flush();
+	for (i = 0; i < ARRAY_SIZE(root_cache); i++)
+		if (root_cache[i].root)
+			uefi_call_wrapper(root_cache[i].root->Close, 1,
+					  root_cache[i].root);
+	ZeroMem(root_cache, sizeof(root_cache));
+	root_cache_next = 0;
+	esp_fs_cache = NULL;
+}
+
+/* The returned root directory must not be closed */
+static EFI_STATUS open_root(EFI_FILE_IO_INTERFACE *io, EFI_FILE **root)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(root_cache); i++)
+		if (root_cache[i].io == io) {
+			*root = root_cache[i].root;
+			return EFI_SUCCESS;
+		}
+
+	ret = uefi_call_wrapper(io->OpenVolume, 2, io, root);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	i = root_cache_next;
+	root_cache_next = (root_cache_next + 1) % ARRAY_SIZE(root_cache);
+	if (root_cache[i].root) {
+		/* The directories may have been opened from this volume */
+		dir_cache_flush();
+		uefi_call_wrapper(root_cache[i].root->Close, 1,
+				  root_cache[i].root);
+	}
+	root_cache[i].io = io;
+	root_cache[i].root = *root;
+
+	return EFI_SUCCESS;
+}
+
 EFI_STATUS get_esp_fs(EFI_FILE_IO_INTERFACE **esp_fs)
 {
 	EFI_STATUS ret = EFI_SUCCESS;
@@ -50,6 +108,11 @@ EFI_STATUS get_esp_fs(EFI_FILE_IO_INTERFACE **esp_fs)
 	EFI_HANDLE esp_handle = NULL;
 	EFI_FILE_IO_INTERFACE *esp;
 
+	if (esp_fs_cache) {
+		*esp_fs = esp_fs_cache;
+		return EFI_SUCCESS;
+	}
+
 	ret = gpt_get_partition_handle(BOOTLOADER_PART, LOGICAL_UNIT_USER,
 				       &esp_handle);
 	if (EFI_ERROR(ret)) {
@@ -63,7 +126,7 @@ EFI_STATUS get_esp_fs(EFI_FILE_IO_INTERFACE **esp_fs)
 		efi_perror(ret, L"HandleProtocol for ESP partition failed");
 		return ret;
 	}
-	*esp_fs = esp;
+	*esp_fs = esp_fs_cache = esp;
 
 	return ret;
 }
@@ -71,12 +134,13 @@ EFI_STATUS get_esp_fs(EFI_FILE_IO_INTERFACE **esp_fs)
 EFI_STATUS uefi_open_file(EFI_FILE_IO_INTERFACE *io, CHAR16 *filename, EFI_FILE **file)
 {
 	EFI_STATUS ret;
+	EFI_FILE *root;
 
-	ret = uefi_call_wrapper(io->OpenVolume, 2, io, file);
+	ret = open_root(io, &root);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	ret = uefi_call_wrapper((*file)->Open, 5, *file, file, filename, EFI_FILE_MODE_READ, 0);
+	ret = uefi_call_wrapper(root->Open, 5, root, file, filename, EFI_FILE_MODE_READ, 0);
 	if (EFI_ERROR(ret))
 		return ret;
 
@@ -172,7 +236,7 @@ EFI_STATUS uefi_write_file(EFI_FILE_IO_INTERFACE *io, CHAR16 *filename, void *da
 	EFI_STATUS ret;
 	EFI_FILE *file, *root;
 
-	ret = uefi_call_wrapper(io->OpenVolume, 2, io, &root);
+	ret = open_root(io, &root);
 	if (EFI_ERROR(ret))
 		goto out;
 
@@ -196,21 +260,102 @@ EFI_STATUS uefi_create_dir(EFI_FILE *parent, EFI_FILE **dir, CHAR16 *dirname)
 				 EFI_FILE_DIRECTORY);
 }
 
+/* Directories opened by uefi_write_file_with_dir() are kept open
+   until uefi_fs_cache_flush() so that a bundle of files written in
+   the same directories only opens each of them once.  */
+#define DIR_CACHE_SIZE 16
+#define DIR_PATH_MAX 128
+
+static struct {
+	EFI_FILE_IO_INTERFACE *io;
+	UINTN nb;
+	struct {
+		CHAR16 path[DIR_PATH_MAX];
+		EFI_FILE *dir;
+	} entries[DIR_CACHE_SIZE];
+} dir_cache;
+
+static void dir_cache_flush(void)
+{
+	UINTN i;
+
+	for (i = 0; i < dir_cache.nb; i++)
+		uefi_call_wrapper(dir_cache.entries[i].dir->Close, 1,
+				  dir_cache.entries[i].dir);
+	ZeroMem(&dir_cache, sizeof(dir_cache));
+}
+
+static EFI_STATUS dir_cache_root(EFI_FILE_IO_INTERFACE *io, EFI_FILE **root)
+{
+	if (dir_cache.io != io) {
+		dir_cache_flush();
+		dir_cache.io = io;
+	}
+
+	return open_root(io, root);
+}
+
+static EFI_FILE *dir_cache_lookup(CHAR16 *path)
+{
+	UINTN i;
+
+	for (i = 0; i < dir_cache.nb; i++)
+		if (!StrCmp(dir_cache.entries[i].path, path))
+			return dir_cache.entries[i].dir;
+
+	return NULL;
+}
+
+static BOOLEAN dir_cache_add(CHAR16 *path, EFI_FILE *dir)
+{
+	if (dir_cache.nb == DIR_CACHE_SIZE || StrLen(path) >= DIR_PATH_MAX)
+		return FALSE;
+
+	StrCpy(dir_cache.entries[dir_cache.nb].path, path);
+	dir_cache.entries[dir_cache.nb++].dir = dir;
+	return TRUE;
+}
+
+/* Large files are written in chunks that are a multiple of any FAT
+   cluster size.  */
+#define WRITE_CHUNK_SIZE (1024 * 1024)
+
+static EFI_STATUS write_chunks(EFI_FILE *file, void *data, UINTN size)
+{
+	EFI_STATUS ret;
+	UINTN offset, len;
+
+	for (offset = 0; offset < size; offset += len) {
+		len = min(size - offset, (UINTN)WRITE_CHUNK_SIZE);
+		ret = uefi_call_wrapper(file->Write, 3, file, &len,
+					(UINT8 *)data + offset);
+		if (EFI_ERROR(ret))
+			return ret;
+		if (!len)
+			return EFI_DEVICE_ERROR;
+	}
+
+	return EFI_SUCCESS;
+}
+
 #define MAX_SUBDIR 10
 EFI_STATUS uefi_write_file_with_dir(EFI_FILE_IO_INTERFACE *io, CHAR16 *filename, void *data, UINTN size)
 {
 	EFI_STATUS ret;
 	EFI_FILE *dirs[MAX_SUBDIR];
+	BOOLEAN cached[MAX_SUBDIR];
 	EFI_FILE *file;
 	CHAR16 *start;
 	CHAR16 *end;
 	INTN subdir = 0;
 
-	ret = uefi_call_wrapper(io->OpenVolume, 2, io, &dirs[0]);
+	ret = dir_cache_root(io, &dirs[0]);
 	if (EFI_ERROR(ret)) {
+		dir_cache.io = NULL;
 		efi_perror(ret, L"Failed to open root directory");
 		return ret;
 	}
+	cached[0] = TRUE;
 	start = filename;
 	for (end = filename; *end; end++) {
 		if (*end != '/')
@@ -221,8 +366,15 @@ EFI_STATUS uefi_write_file_with_dir(EFI_FILE_IO_INTERFACE *io, CHAR16 *filename,
 		}
 
 		*end = 0;
-		debug(L"create directory %s", start);
-		ret = uefi_create_dir(dirs[subdir], &dirs[subdir + 1], start);
+		dirs[subdir + 1] = dir_cache_lookup(filename);
+		if (dirs[subdir + 1]) {
+			cached[subdir + 1] = TRUE;
+		} else {
+			debug(L"create directory %s", start);
+			ret = uefi_create_dir(dirs[subdir], &dirs[subdir + 1], start);
+			if (!EFI_ERROR(ret))
+				cached[subdir + 1] = dir_cache_add(filename, dirs[subdir + 1]);
+		}
 		*end = '/';
 		if (EFI_ERROR(ret))
 			goto out;
@@ -239,12 +391,13 @@ EFI_STATUS uefi_write_file_with_dir(EFI_FILE_IO_INTERFACE *io, CHAR16 *filename,
 	if (EFI_ERROR(ret))
 		goto out;
 
-	ret = uefi_call_wrapper(file->Write, 3, file, &size, data);
+	ret = write_chunks(file, data, size);
 	uefi_call_wrapper(file->Close, 1, file);
 
 out:
 	for (; subdir >= 0; subdir--)
-		uefi_call_wrapper(dirs[subdir]->Close, 1, dirs[subdir]);
+		if (!cached[subdir])
+			uefi_call_wrapper(dirs[subdir]->Close, 1, dirs[subdir]);
 
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to write file %s", filename);
@@ -256,7 +409,7 @@ EFI_STATUS uefi_delete_file(EFI_FILE_IO_INTERFACE *io, CHAR16 *filename)
 	EFI_STATUS ret;
 	EFI_FILE *file, *root;
 
-	ret = uefi_call_wrapper(io->OpenVolume, 2, io, &root);
+	ret = open_root(io, &root);
 	if (EFI_ERROR(ret))
 		goto out;
 
@@ -294,7 +447,7 @@ BOOLEAN uefi_exist_file_root(EFI_FILE_IO_INTERFACE *io, CHAR16 *filename)
 	EFI_STATUS ret;
 	EFI_FILE *root;
 
-	ret = uefi_call_wrapper(io->OpenVolume, 2, io, &root);
+	ret = open_root(io, &root);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to open volume %s", filename);
 		return FALSE;
@@ -324,7 +477,7 @@ EFI_STATUS uefi_create_directory_root(EFI_FILE_IO_INTERFACE *io, CHAR16 *dirname
 	EFI_STATUS ret;
 	EFI_FILE *root;
 
-	ret = uefi_call_wrapper(io->OpenVolume, 2, io, &root);
+	ret = open_root(io, &root);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to open volume %s", dirname);
 		return ret;
@@ -332,3 +485,70 @@ EFI_STATUS uefi_create_directory_root(EFI_FILE_IO_INTERFACE *io, CHAR16 *dirname
 
 	return uefi_create_directory(root, dirname);
 }
+
+static void swap_entries(UINT8 *a, UINT8 *b, UINTN size)
+{
+	UINT64 word;
+	UINT8 byte;
+	UINTN i = 0;
+
+	if (!(((UINTN)a | (UINTN)b | size) % sizeof(word)))
+		for (; i < size; i += sizeof(word)) {
+			word = *(UINT64 *)(a + i);
+			*(UINT64 *)(a + i) = *(UINT64 *)(b + i);
+			*(UINT64 *)(b + i) = word;
+		}
+
+	for (; i < size; i++) {
+		byte = a[i];
+		a[i] = b[i];
+		b[i] = byte;
+	}
+}
+
+static inline EFI_MEMORY_DESCRIPTOR *memory_map_entry(UINT8 *entries,
+						      UINTN i, UINTN entry_sz)
+{
+	return (EFI_MEMORY_DESCRIPTOR *)(entries + i * entry_sz);
+}
+
+static void sift_down(UINT8 *entries, UINTN root, UINTN nr_entries,
+		      UINTN entry_sz)
+{
+	UINTN child;
+
+	while ((child = 2 * root + 1) < nr_entries) {
+		if (child + 1 < nr_entries &&
+		    memory_map_entry(entries, child, entry_sz)->PhysicalStart <
+		    memory_map_entry(entries, child + 1, entry_sz)->PhysicalStart)
+			child++;
+
+		if (memory_map_entry(entries, root, entry_sz)->PhysicalStart >=
+		    memory_map_entry(entries, child, entry_sz)->PhysicalStart)
+			return;
+
+		swap_entries(entries + root * entry_sz,
+			     entries + child * entry_sz, entry_sz);
+		root = child;
+	}
+}
+
+/* In-place heap sort of a memory map by physical address.  It does
+   not allocate memory so it can be used right before
+   ExitBootServices().  */
+void sort_memory_map(void *entries, UINTN nr_entries, UINTN entry_sz)
+{
+	UINT8 *map = entries;
+	UINTN i;
+
+	if (nr_entries < 2)
+		return;
+
+	for (i = nr_entries / 2; i > 0; i--)
+		sift_down(map, i - 1, nr_entries, entry_sz);
+
+	for (i = nr_entries - 1; i > 0; i--) {
+		swap_entries(map, map + i * entry_sz, entry_sz);
+		sift_down(map, 0, i, entry_sz);
+	}
+}
@@ -32,6 +32,7 @@
 
 #include <lib.h>
 #include "storage.h"
+#include "pci.h"
 #include "protocol/ufs.h"
 #include "protocol/ScsiPassThruExt.h"
 
@@ -44,36 +45,38 @@ static EFI_DEVICE_PATH *get_scsi_device_path(EFI_DEVICE_PATH *p)
 	return NULL;
 }
 
-static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, __attribute__((unused)) EFI_BLOCK_IO *bio, UINT64 start, UINT64 end)
+/* Block descriptors of an UNMAP command, up to the limits the device
+ * reports in the Block Limits VPD page.  */
+#define MAX_UNMAP_DESC			256
+#define MAX_UNMAP_LBA_COUNT		0xFFFFFFFF
+
+struct unmap_batch {
+	EFI_EXT_SCSI_PASS_THRU_PROTOCOL *scsi;
+	UINT8 target_bytes[TARGET_MAX_BYTES];
+	UINT64 lun;
+	UINT32 max_desc;
+	UINT32 max_lba;
+	UINTN nb;
+	UINT64 nb_lba;
+	VOID *buf;
+	struct unmap_parameter *unmap;
+};
+
+static EFI_STATUS ufs_get_device(EFI_HANDLE handle, struct unmap_batch *batch)
 {
 	EFI_STATUS ret;
 	EFI_GUID ScsiPassThruProtocolGuid = EFI_EXT_SCSI_PASS_THRU_PROTOCOL_GUID;
-	EFI_EXT_SCSI_PASS_THRU_PROTOCOL *scsi;
-	EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET scsi_req;
-	struct unmap_parameter unmap;
-	struct command_descriptor_block cdb;
-	EFI_HANDLE scsi_handle;
 	EFI_DEVICE_PATH *dp = DevicePathFromHandle(handle);
-	EFI_DEVICE_PATH *scsi_dp = dp;
-	UINT8 target_bytes[TARGET_MAX_BYTES];
-	UINT8 *target = target_bytes;
-	UINT64 lun;
+	EFI_DEVICE_PATH *scsi_dp;
+	UINT8 *target = batch->target_bytes;
 
 	if (!dp) {
 		error(L"Failed to get device path from handle");
 		return EFI_INVALID_PARAMETER;
 	}
-	ret = uefi_call_wrapper(BS->LocateDevicePath, 3, &ScsiPassThruProtocolGuid,
-				&scsi_dp, &scsi_handle);
-	if (EFI_ERROR(ret)) {
-		error(L"Failed to locate SCSI root device");
-		return ret;
-	}
-
-	ret = uefi_call_wrapper(BS->HandleProtocol, 3, scsi_handle,
-				&ScsiPassThruProtocolGuid, (void *)&scsi);
+	ret = get_pci_protocol(dp, &ScsiPassThruProtocolGuid, (VOID **)&batch->scsi);
 	if (EFI_ERROR(ret)) {
-		error(L"failed to get scsi protocol");
+		error(L"Failed to get the SCSI root device protocol");
 		return ret;
 	}
 
@@ -83,35 +86,172 @@ static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, __attribute__((unused)) EF
 		return EFI_NOT_FOUND;
 	}
 
-	ret = uefi_call_wrapper(scsi->GetTargetLun, 4, scsi, scsi_dp, (UINT8 **)&target, &lun);
-	if (EFI_ERROR(ret)) {
+	ret = uefi_call_wrapper(batch->scsi->GetTargetLun, 4, batch->scsi, scsi_dp,
+				(UINT8 **)&target, &batch->lun);
+	if (EFI_ERROR(ret))
 		error(L"Failed to get LUN of current device");
-		return ret;
+
+	return ret;
+}
+
+/* A device without the Block Limits VPD page is sent one descriptor
+ * per command as the unmap limits are unknown.  */
+static void ufs_get_unmap_limits(struct unmap_batch *batch)
+{
+	EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET scsi_req;
+	struct inquiry_cdb cdb;
+	struct vpd_block_limits *limits;
+	VOID *buf;
+	EFI_STATUS ret;
+
+	batch->max_desc = 1;
+	batch->max_lba = MAX_UNMAP_LBA_COUNT;
+
+	ret = alloc_aligned(&buf, (VOID **)&limits, sizeof(*limits),
+			    batch->scsi->Mode->IoAlign);
+	if (EFI_ERROR(ret))
+		return;
+
+	ZeroMem(&scsi_req, sizeof(scsi_req));
+	ZeroMem(&cdb, sizeof(cdb));
+
+	cdb.op_code = UFS_INQUIRY;
+	cdb.flags = INQUIRY_EVPD;
+	cdb.page_code = VPD_BLOCK_LIMITS;
+	cdb.alloc_length = htobe16(sizeof(*limits));
+
+	scsi_req.Timeout = BLOCK_TIMEOUT;
+	scsi_req.InDataBuffer = limits;
+	scsi_req.Cdb = &cdb;
+	scsi_req.InTransferLength = sizeof(*limits);
+	scsi_req.CdbLength = sizeof(cdb);
+	scsi_req.DataDirection = EFI_EXT_SCSI_DATA_DIRECTION_READ;
+
+	ret = uefi_call_wrapper(batch->scsi->PassThru, 5, batch->scsi,
+				batch->target_bytes, batch->lun, &scsi_req, NULL);
+	if (EFI_ERROR(ret) || limits->page_code != VPD_BLOCK_LIMITS) {
+		debug(L"Block Limits VPD page not available");
+		goto out;
 	}
 
+	if (be32toh(limits->max_unmap_desc_count))
+		batch->max_desc = min(be32toh(limits->max_unmap_desc_count),
+				      (UINT32)MAX_UNMAP_DESC);
+	if (be32toh(limits->max_unmap_lba_count))
+		batch->max_lba = be32toh(limits->max_unmap_lba_count);
+	debug(L"UNMAP limits: %d descriptors, %d blocks",
+	      batch->max_desc, batch->max_lba);
+
+out:
+	FreePool(buf);
+}
+
+static EFI_STATUS unmap_flush(struct unmap_batch *batch)
+{
+	EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET scsi_req;
+	struct command_descriptor_block cdb;
+	UINTN size;
+	EFI_STATUS ret;
+
+	if (!batch->nb)
+		return EFI_SUCCESS;
+
+	size = sizeof(*batch->unmap) + batch->nb * sizeof(*batch->unmap->block_desc);
+
 	ZeroMem(&scsi_req, sizeof(scsi_req));
-	ZeroMem(&unmap, sizeof(unmap));
 	ZeroMem(&cdb, sizeof(cdb));
 
 	cdb.op_code = UFS_UNMAP;
-	cdb.param_length = htobe16(sizeof(unmap));
+	cdb.param_length = htobe16(size);
 
-	unmap.data_length = htobe16(sizeof(unmap) - sizeof(unmap.data_length));
-	unmap.block_desc_length = htobe16(sizeof(unmap.block_desc));
-	unmap.block_desc.lba = htobe64(start);
-	unmap.block_desc.count = htobe32(end - start + 1);
+	batch->unmap->data_length = htobe16(size - sizeof(batch->unmap->data_length));
+	batch->unmap->block_desc_length = htobe16(size - sizeof(*batch->unmap));
 
-	scsi_req.Timeout = BLOCK_TIMEOUT * (end - start + 1);
-	scsi_req.OutDataBuffer = &unmap;
+	scsi_req.Timeout = BLOCK_TIMEOUT * batch->nb_lba;
+	scsi_req.OutDataBuffer = batch->unmap;
 	scsi_req.Cdb = &cdb;
-	scsi_req.OutTransferLength = sizeof(unmap);
+	scsi_req.OutTransferLength = size;
 	scsi_req.CdbLength = sizeof(cdb);
 	scsi_req.DataDirection = EFI_EXT_SCSI_DATA_DIRECTION_WRITE;
 
-	ret = uefi_call_wrapper(scsi->PassThru, 5, scsi, target, lun, &scsi_req, NULL);
+	ret = uefi_call_wrapper(batch->scsi->PassThru, 5, batch->scsi,
+				batch->target_bytes, batch->lun, &scsi_req, NULL);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"UNMAP command failed");
+
+	batch->nb = 0;
+	batch->nb_lba = 0;
+	return ret;
+}
+
+static EFI_STATUS unmap_add(struct unmap_batch *batch, UINT64 start, UINT64 end)
+{
+	struct unmap_block_descriptor *desc;
+	EFI_STATUS ret;
+	UINT64 count;
+
+	while (start <= end) {
+		if (batch->nb == batch->max_desc || batch->nb_lba == batch->max_lba) {
+			ret = unmap_flush(batch);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+
+		count = min(end - start + 1, (UINT64)(batch->max_lba - batch->nb_lba));
+		desc = &batch->unmap->block_desc[batch->nb++];
+		desc->lba = htobe64(start);
+		desc->count = htobe32(count);
+		desc->reserved = 0;
+
+		batch->nb_lba += count;
+		start += count;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS ufs_erase_ranges(EFI_HANDLE handle, __attribute__((unused)) EFI_BLOCK_IO *bio,
+				   struct lba_range *ranges, UINTN nb)
+{
+	struct unmap_batch batch;
+	EFI_STATUS ret;
+	UINTN i;
+
+	ZeroMem(&batch, sizeof(batch));
+	ret = ufs_get_device(handle, &batch);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ufs_get_unmap_limits(&batch);
+
+	ret = alloc_aligned(&batch.buf, (VOID **)&batch.unmap,
+			    sizeof(*batch.unmap) + batch.max_desc * sizeof(*batch.unmap->block_desc),
+			    batch.scsi->Mode->IoAlign);
+	if (EFI_ERROR(ret)) {
+		error(L"Failed to allocate the UNMAP parameter list");
+		return ret;
+	}
+
+	for (i = 0; i < nb; i++) {
+		ret = unmap_add(&batch, ranges[i].start, ranges[i].end);
+		if (EFI_ERROR(ret))
+			goto out;
+	}
+
+	ret = unmap_flush(&batch);
+
+out:
+	FreePool(batch.buf);
 	return ret;
 }
 
+static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, UINT64 start, UINT64 end)
+{
+	struct lba_range range = { start, end };
+
+	return ufs_erase_ranges(handle, bio, &range, 1);
+}
+
 /* This mapping of LUNs is hardcoded for now.  If a new board comes
  * with a different mapping, we will have to find a clean way to
  * identify it
@@ -178,6 +318,7 @@ static BOOLEAN is_ufs(EFI_DEVICE_PATH *p)
 
 struct storage STORAGE(STORAGE_UFS) = {
 	.erase_blocks = ufs_erase_blocks,
+	.erase_ranges = ufs_erase_ranges,
 	.check_logical_unit = ufs_check_logical_unit,
 	.probe = is_ufs,
 	.name = L"UFS"
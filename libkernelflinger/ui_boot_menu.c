@@ -61,35 +61,83 @@ ui_boot_menu_t *ui_boot_menu_create(ui_boot_action_t *actions)
 
 static const UINTN MARGIN = 20;
 
-static EFI_STATUS ui_boot_menu_redraw(ui_boot_menu_t *menu, UINTN *y)
+/* The help text is rendered once, a navigation only draws the image
+   of the new selection.  */
+static EFI_STATUS ui_boot_menu_render_help(ui_boot_menu_t *menu)
 {
-	EFI_STATUS ret;
-	ui_textline_t lines[] = {
+	static const char *HELP[] = {
 #ifdef USE_POWER_BUTTON
-		{ &COLOR_LIGHTGRAY, "Volume UP/DOWN buttons to move the selection", TRUE },
-		{ &COLOR_LIGHTGRAY, "Power button to select the option", TRUE },
+		"Volume UP/DOWN buttons to move the selection",
+		"Power button to select the option",
 #else
-		{ &COLOR_LIGHTGRAY, "Volume DOWN button to move the selection", TRUE },
-		{ &COLOR_LIGHTGRAY, "Volume UP button to select boot option", TRUE },
+		"Volume DOWN button to move the selection",
+		"Volume UP button to select boot option",
 #endif
-		{ NULL, NULL, TRUE }
 	};
+	ui_textline_t lines[ARRAY_SIZE(HELP) + 1];
+	UINTN i;
+
+	if (menu->help && menu->help_width == menu->max_width)
+		return EFI_SUCCESS;
+
+	if (menu->help) {
+		ui_textarea_free(menu->help);
+		menu->help = NULL;
+	}
+
+	memset(lines, 0, sizeof(lines));
+	for (i = 0; i < ARRAY_SIZE(HELP); i++) {
+		lines[i].color = &COLOR_LIGHTGRAY;
+		lines[i].bold = TRUE;
+		lines[i].str = strdup(HELP[i]);
+		if (!lines[i].str)
+			goto err;
+	}
+
+	menu->help = ui_textarea_create_text(lines, ui_font_get_default(),
+					     menu->max_width, 0, NULL);
+	if (!menu->help)
+		goto err;
 
-	*y = menu->y;
+	menu->help_width = menu->max_width;
+	return EFI_SUCCESS;
+
+err:
+	for (i = 0; i < ARRAY_SIZE(HELP) && lines[i].str; i++)
+		FreePool(lines[i].str);
+	return EFI_OUT_OF_RESOURCES;
+}
 
+static EFI_STATUS ui_boot_menu_draw_image(ui_boot_menu_t *menu, UINTN *height)
+{
 	ui_image_t *image = menu->actions[menu->cur].image;
 	if (!image)
 		return EFI_UNSUPPORTED;
 
-	ret = ui_image_draw_scale(image, menu->x, *y,
-				  min(image->width, menu->max_width), 0);
+	*height = image->height;
+	return ui_image_draw_scale(image, menu->x, menu->y,
+				   min(image->width, menu->max_width), 0);
+}
+
+static EFI_STATUS ui_boot_menu_redraw(ui_boot_menu_t *menu, UINTN *y)
+{
+	EFI_STATUS ret;
+	UINTN height;
+
+	ret = ui_boot_menu_draw_image(menu, &height);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	*y += image->height + MARGIN;
+	*y = menu->y + height + MARGIN;
+	menu->image_height = height;
+
+	ret = ui_boot_menu_render_help(menu);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	return ui_textarea_display_text(lines, ui_font_get_default(),
-					menu->x, y, menu->max_width, 0, NULL);
+	ret = ui_textarea_draw(menu->help, menu->x, *y);
+	*y += menu->help->height;
+	return ret;
 }
 
 EFI_STATUS ui_boot_menu_draw(ui_boot_menu_t *menu, UINTN x, UINTN *y, UINTN max_width)
@@ -97,18 +145,31 @@ EFI_STATUS ui_boot_menu_draw(ui_boot_menu_t *menu, UINTN x, UINTN *y, UINTN max_
 	menu->x = x;
 	menu->y = *y;
 	menu->max_width = max_width;
+	/* The caller may have drawn over the help text.  */
+	if (menu->help)
+		ui_textarea_invalidate(menu->help);
 	return ui_boot_menu_redraw(menu, y);
 }
 
-enum boot_target ui_boot_menu_event_handler(ui_boot_menu_t *menu, ui_events_t event)
+/* The help text only has to move if the new image height differs.  */
+static EFI_STATUS ui_boot_menu_select(ui_boot_menu_t *menu, UINTN cur)
 {
-	UINTN y;
+	ui_image_t *image = menu->actions[cur].image;
+	UINTN height, y;
+
+	menu->cur = cur;
+	if (!menu->help || !image || image->height != menu->image_height)
+		return ui_boot_menu_redraw(menu, &y);
+
+	return ui_boot_menu_draw_image(menu, &height);
+}
 
+enum boot_target ui_boot_menu_event_handler(ui_boot_menu_t *menu, ui_events_t event)
+{
 	switch (event) {
 	case EV_UP:
 #ifdef USE_POWER_BUTTON
-		menu->cur = (menu->cur + menu->action_nb - 1) % menu->action_nb;
-		ui_boot_menu_redraw(menu, &y);
+		ui_boot_menu_select(menu, (menu->cur + menu->action_nb - 1) % menu->action_nb);
 		break;
 	case EV_POWER:
 		return menu->actions[menu->cur].target;
@@ -116,8 +177,7 @@ enum boot_target ui_boot_menu_event_handler(ui_boot_menu_t *menu, ui_events_t ev
 		return menu->actions[menu->cur].target;
 #endif
 	case EV_DOWN:
-		menu->cur = (menu->cur + 1) % menu->action_nb;
-		ui_boot_menu_redraw(menu, &y);
+		ui_boot_menu_select(menu, (menu->cur + 1) % menu->action_nb);
 		break;
 	default:
 		break;
@@ -128,5 +188,7 @@ enum boot_target ui_boot_menu_event_handler(ui_boot_menu_t *menu, ui_events_t ev
 
 void ui_boot_menu_free(ui_boot_menu_t *menu)
 {
+	if (menu->help)
+		ui_textarea_free(menu->help);
 	FreePool(menu);
 }
@@ -45,20 +45,68 @@ static const ui_textline_t yes_no_menu[][2] = {
 
 static UINTN current = 1; /* dafault answer is No */
 
-static EFI_STATUS ui_confirm_draw_menu(ui_font_t *font, UINTN x, UINTN y,
-				       UINTN width, UINTN height)
+/* Each menu entry is rendered once in its normal and highlighted
+   state, a selection change only blits the entries.  */
+static ui_textarea_t *frames[ARRAY_SIZE(yes_no_menu)][2];
+
+static void ui_confirm_free_frames(void)
+{
+	UINTN i, j;
+
+	for (i = 0; i < ARRAY_SIZE(frames); i++)
+		for (j = 0; j < ARRAY_SIZE(frames[i]); j++)
+			if (frames[i][j]) {
+				ui_textarea_free(frames[i][j]);
+				frames[i][j] = NULL;
+			}
+}
+
+static EFI_STATUS ui_confirm_render_frames(ui_font_t *font, UINTN width, UINTN height)
+{
+	static EFI_GRAPHICS_OUTPUT_BLT_PIXEL *COLORS[] = {
+		&COLOR_BLACK, &COLOR_HIGHLIGHT
+	};
+	ui_textline_t lines[2];
+	UINTN i, j;
+
+	for (i = 0; i < ARRAY_SIZE(frames); i++)
+		for (j = 0; j < ARRAY_SIZE(frames[i]); j++) {
+			memcpy(lines, yes_no_menu[i], sizeof(lines));
+			lines[0].str = strdup(yes_no_menu[i][0].str);
+			if (!lines[0].str)
+				goto err;
+
+			frames[i][j] = ui_textarea_create_text(lines, font, width,
+							       height, COLORS[j]);
+			if (!frames[i][j]) {
+				FreePool(lines[0].str);
+				goto err;
+			}
+		}
+
+	return EFI_SUCCESS;
+
+err:
+	ui_confirm_free_frames();
+	return EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS ui_confirm_draw_menu(UINTN x, UINTN y, UINTN width)
 {
 	EFI_STATUS ret;
-	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color;
+	ui_textarea_t *frame;
 	UINTN i, y1 = y;
 
-	for (i = 0; i < ARRAY_SIZE(yes_no_menu); i++) {
-		color = current == i ? &COLOR_HIGHLIGHT : &COLOR_BLACK;
-		ui_fill_area(x, y1, width, height, color);
-		ret = ui_textarea_display_text(yes_no_menu[i], font, x, &y1,
-					       width, height, color);
+	for (i = 0; i < ARRAY_SIZE(frames); i++) {
+		frame = frames[i][current == i];
+		if (frame->width < width)
+			ui_fill_area(x + frame->width, y1, width - frame->width,
+				     frame->height, frame->bg_color);
+		ui_textarea_invalidate(frame);
+		ret = ui_textarea_draw(frame, x, y1);
 		if (EFI_ERROR(ret))
 			return ret;
+		y1 += frame->height;
 	}
 
 	return EFI_SUCCESS;
@@ -111,25 +159,25 @@ BOOLEAN ui_confirm(const ui_textline_t *text, UINTN width, UINTN height,
 				width, text_height, &scaled_text_width, &scaled_text_height);
 	line_height = scaled_text_height / line_nb;
 
-	ret = ui_confirm_draw_menu(font, x, y, scaled_text_width, line_height);
-	if (EFI_ERROR(ret))
+	ret = ui_confirm_render_frames(font, scaled_text_width, line_height);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to render the confirmation menu");
 		return FALSE;
-	for (;;) {
+	}
+
+	ret = ui_confirm_draw_menu(x, y, scaled_text_width);
+	while (!EFI_ERROR(ret)) {
 		event = ui_wait_for_input(TIMEOUT_SECS);
-		switch (event) {
-		case EV_UP:
-		case EV_DOWN:
-			current = (current + 1) % ARRAY_SIZE(yes_no_menu);
-			ret = ui_confirm_draw_menu(font, x, y, scaled_text_width, line_height);
-			if (EFI_ERROR(ret))
-				return FALSE;
-			break;
-		case EV_POWER:
-			return !current;
-		default:
+		if (event == EV_POWER)
 			break;
+		if (event == EV_UP || event == EV_DOWN) {
+			current = (current + 1) % ARRAY_SIZE(yes_no_menu);
+			ret = ui_confirm_draw_menu(x, y, scaled_text_width);
 		}
 	}
+
+	ui_confirm_free_frames();
+	return !EFI_ERROR(ret) && !current;
 #else
 	const ui_textline_t *texts[] = {text, yes_no_text};
 	ui_display_texts(texts, x, y, width, height);
@@ -39,6 +39,15 @@
 
 #define DEFAULT_FONT_NAME "18x32"
 
+/* Rendering text is a copy of pre-colored and pre-scaled glyph rows.
+   The atlases are built on first use, the oldest one is evicted when
+   the cache is full.  */
+#define GLYPH_NB		(UI_GLYPH_LAST - UI_GLYPH_FIRST + 1)
+#define GLYPHS_CACHE_SIZE	8
+
+static ui_glyphs_t glyphs_cache[GLYPHS_CACHE_SIZE];
+static UINTN glyphs_cache_next;
+
 ui_font_t *ui_font_get_default(void)
 {
 	static ui_font_t *default_font = NULL;
@@ -62,3 +71,129 @@ ui_font_t *ui_font_get(char *name)
 
 	return NULL;
 }
+
+static void blend(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *dst,
+		  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg,
+		  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color, unsigned char a)
+{
+	dst->Blue = (bg->Blue * (255 - a) + color->Blue * a) / 255;
+	dst->Green = (bg->Green * (255 - a) + color->Green * a) / 255;
+	dst->Red = (bg->Red * (255 - a) + color->Red * a) / 255;
+	dst->Reserved = bg->Reserved;
+}
+
+static EFI_STATUS render_glyphs(ui_glyphs_t *glyphs)
+{
+	EFI_STATUS ret = EFI_OUT_OF_RESOURCES;
+	ui_font_t *font = glyphs->font;
+	UINTN cell = glyphs->cwidth * glyphs->cheight;
+	BOOLEAN scale = glyphs->cwidth != font->cwidth ||
+		glyphs->cheight != font->cheight;
+	unsigned char *alpha, *scaled = NULL, *src, *a;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *dst;
+	UINTN c, i, j;
+
+	alpha = AllocatePool(font->cwidth * font->cheight);
+	if (!alpha)
+		return EFI_OUT_OF_RESOURCES;
+
+	if (scale) {
+		scaled = AllocatePool(cell);
+		if (!scaled)
+			goto out;
+	}
+
+	glyphs->blt = AllocatePool(GLYPH_NB * cell * sizeof(*glyphs->blt));
+	if (!glyphs->blt)
+		goto out;
+
+	for (c = 0; c < GLYPH_NB; c++) {
+		src = font->texture + (c + UI_GLYPH_FIRST - 0x20) * font->cwidth
+			+ (glyphs->bold ? font->cheight * font->width : 0);
+		for (j = 0; j < font->cheight; j++)
+			memcpy(alpha + j * font->cwidth, src + j * font->width,
+			       font->cwidth);
+
+		a = alpha;
+		if (scale) {
+			ret = ui_bilinear_scale(alpha, scaled,
+						font->cwidth, font->cheight,
+						glyphs->cwidth, glyphs->cheight, 1);
+			if (EFI_ERROR(ret))
+				goto out;
+			a = scaled;
+		}
+
+		dst = glyphs->blt + c * cell;
+		for (i = 0; i < cell; i++)
+			blend(&dst[i], &glyphs->bg_color, &glyphs->color, a[i]);
+	}
+	ret = EFI_SUCCESS;
+
+out:
+	if (EFI_ERROR(ret) && glyphs->blt) {
+		FreePool(glyphs->blt);
+		glyphs->blt = NULL;
+	}
+	if (scaled)
+		FreePool(scaled);
+	FreePool(alpha);
+	return ret;
+}
+
+/* A NULL background color is black.  */
+ui_glyphs_t *ui_font_get_glyphs(ui_font_t *font,
+				EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color,
+				EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color,
+				BOOLEAN bold, UINTN cwidth, UINTN cheight)
+{
+	static EFI_GRAPHICS_OUTPUT_BLT_PIXEL black;
+	ui_glyphs_t *glyphs;
+	EFI_STATUS ret;
+	UINTN i;
+
+	if (!bg_color)
+		bg_color = &black;
+
+	for (i = 0; i < ARRAY_SIZE(glyphs_cache); i++) {
+		glyphs = &glyphs_cache[i];
+		if (glyphs->blt && glyphs->font == font && glyphs->bold == bold &&
+		    glyphs->cwidth == cwidth && glyphs->cheight == cheight &&
+		    !memcmp(&glyphs->color, color, sizeof(*color)) &&
+		    !memcmp(&glyphs->bg_color, bg_color, sizeof(*bg_color)))
+			return glyphs;
+	}
+
+	glyphs = &glyphs_cache[glyphs_cache_next];
+	glyphs_cache_next = (glyphs_cache_next + 1) % ARRAY_SIZE(glyphs_cache);
+	if (glyphs->blt)
+		FreePool(glyphs->blt);
+
+	glyphs->font = font;
+	glyphs->color = *color;
+	glyphs->bg_color = *bg_color;
+	glyphs->bold = bold;
+	glyphs->cwidth = cwidth;
+	glyphs->cheight = cheight;
+	glyphs->blt = NULL;
+
+	ret = render_glyphs(glyphs);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to render the %a font glyphs", font->name);
+		return NULL;
+	}
+
+	return glyphs;
+}
+
+void ui_font_free_glyphs(void)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(glyphs_cache); i++)
+		if (glyphs_cache[i].blt)
+			FreePool(glyphs_cache[i].blt);
+
+	memset(glyphs_cache, 0, sizeof(glyphs_cache));
+	glyphs_cache_next = 0;
+}
@@ -39,6 +39,82 @@
 
 #include "res/img_res.h"
 
+/* The battery animation and the menus redraw the same images at the
+   same size: the scaled images are kept so that a redraw is a plain
+   blit.  The oldest entry is evicted when the cache is full.  */
+#define SCALED_CACHE_SIZE 8
+
+static struct scaled_image {
+	ui_image_t *image;
+	ui_image_t scaled;
+} scaled_cache[SCALED_CACHE_SIZE];
+static UINTN scaled_cache_next;
+
+/* Run-length encoded packets as written by png2c: a header byte,
+   followed by one pixel repeated (header & 0x7f) + 1 times if
+   RLE_RUN is set or header + 1 literal pixels otherwise.  */
+#define RLE_RUN	0x80
+
+static EFI_STATUS rle_decode(ui_image_t *image)
+{
+	const unsigned char *data = image->data;
+	const unsigned char *end = data + image->data_len;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt, pixel;
+	UINTN i = 0, n, nb = image->width * image->height;
+	unsigned char header;
+
+	blt = AllocatePool(ui_get_blt_size(image->width, image->height));
+	if (!blt)
+		return EFI_OUT_OF_RESOURCES;
+
+	while (data < end && i < nb) {
+		header = *data++;
+		n = (header & ~RLE_RUN) + 1;
+		if (n > nb - i)
+			break;
+
+		if (header & RLE_RUN) {
+			if ((UINTN)(end - data) < sizeof(pixel))
+				break;
+			memcpy(&pixel, data, sizeof(pixel));
+			data += sizeof(pixel);
+			for (; n; n--)
+				blt[i++] = pixel;
+		} else {
+			if ((UINTN)(end - data) < n * sizeof(pixel))
+				break;
+			memcpy(blt + i, data, n * sizeof(pixel));
+			data += n * sizeof(pixel);
+			i += n;
+		}
+	}
+
+	if (i != nb || data != end) {
+		FreePool(blt);
+		return EFI_COMPROMISED_DATA;
+	}
+
+	image->blt = blt;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS image_load(ui_image_t *image)
+{
+	EFI_STATUS ret;
+
+	if (image->blt)
+		return EFI_SUCCESS;
+
+	if (!image->data)
+		return EFI_NOT_FOUND;
+
+	ret = rle_decode(image);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to decode image %a", image->name);
+
+	return ret;
+}
+
 ui_image_t *ui_image_get(const char *name)
 {
 	unsigned int i;
@@ -54,6 +130,10 @@ EFI_STATUS ui_image_draw(ui_image_t *image, UINTN x, UINTN y)
 {
 	EFI_STATUS ret;
 
+	ret = image_load(image);
+	if (EFI_ERROR(ret))
+		return ret;
+
 	ret = ui_draw_blt(image->blt, x, y, image->width, image->height);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to display image %a", image->name);
@@ -61,37 +141,87 @@ EFI_STATUS ui_image_draw(ui_image_t *image, UINTN x, UINTN y)
 	return ret;
 }
 
+static ui_image_t *get_scaled(ui_image_t *image, UINTN width, UINTN height)
+{
+	EFI_STATUS ret;
+	struct scaled_image *entry;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(scaled_cache); i++) {
+		entry = &scaled_cache[i];
+		if (entry->image == image && entry->scaled.width == width &&
+		    entry->scaled.height == height)
+			return &entry->scaled;
+	}
+
+	if (EFI_ERROR(image_load(image)))
+		return NULL;
+
+	blt = AllocatePool(ui_get_blt_size(width, height));
+	if (!blt) {
+		efi_perror(EFI_OUT_OF_RESOURCES, L"Failed to allocate buffer");
+		return NULL;
+	}
+
+	ret = ui_bilinear_scale((unsigned char *)image->blt,
+				(unsigned char *)blt,
+				image->width, image->height,
+				width, height,
+				sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to scale image %a", image->name);
+		FreePool(blt);
+		return NULL;
+	}
+
+	entry = &scaled_cache[scaled_cache_next];
+	scaled_cache_next = (scaled_cache_next + 1) % ARRAY_SIZE(scaled_cache);
+	if (entry->scaled.blt)
+		FreePool(entry->scaled.blt);
+
+	entry->image = image;
+	entry->scaled = *image;
+	entry->scaled.blt = blt;
+	entry->scaled.width = width;
+	entry->scaled.height = height;
+
+	return &entry->scaled;
+}
+
 EFI_STATUS ui_image_draw_scale(ui_image_t *image, UINTN x, UINTN y, UINTN width, UINTN height)
 {
-	EFI_STATUS ret = EFI_SUCCESS;
-	ui_image_t to_draw;
+	ui_image_t *scaled;
 	UINTN new_width, new_height;
 
-	memcpy(&to_draw, image, sizeof(to_draw));
-
-	ui_get_scaled_dimension(to_draw.width, to_draw.height,
+	ui_get_scaled_dimension(image->width, image->height,
 				width, height, &new_width, &new_height);
 
-	to_draw.blt = AllocatePool(ui_get_blt_size(new_width, new_height));
-	if (!to_draw.blt) {
-		ret = EFI_OUT_OF_RESOURCES;
-		efi_perror(ret, L"Failed to allocate buffer");
-		goto out;
-	}
+	if (new_width == image->width && new_height == image->height)
+		return ui_image_draw(image, x, y);
 
-	to_draw.width = new_width;
-	to_draw.height = new_height;
+	scaled = get_scaled(image, new_width, new_height);
+	if (!scaled)
+		return EFI_OUT_OF_RESOURCES;
 
-	ui_bilinear_scale((unsigned char *)image->blt,
-			  (unsigned char *)to_draw.blt,
-			  image->width, image->height,
-			  to_draw.width, to_draw.height,
-			  sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+	return ui_image_draw(scaled, x, y);
+}
 
-	ret = ui_image_draw(&to_draw, x, y);
+void ui_image_free_cache(void)
+{
+	UINTN i;
 
-out:
-	if (to_draw.blt)
-		FreePool(to_draw.blt);
-	return ret;
+	for (i = 0; i < ARRAY_SIZE(scaled_cache); i++)
+		if (scaled_cache[i].scaled.blt)
+			FreePool(scaled_cache[i].scaled.blt);
+
+	memset(scaled_cache, 0, sizeof(scaled_cache));
+	scaled_cache_next = 0;
+
+	/* Decoded images */
+	for (i = 0; i < ARRAY_SIZE(ui_images); i++)
+		if (ui_images[i].data && ui_images[i].blt) {
+			FreePool(ui_images[i].blt);
+			ui_images[i].blt = NULL;
+		}
 }
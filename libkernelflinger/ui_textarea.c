@@ -42,8 +42,8 @@ static EFI_STATUS ui_textarea_allocate_blt(ui_textarea_t *textarea)
 {
 	UINTN blt_size;
 
-	textarea->width = textarea->font->cwidth * textarea->row_nb;
-	textarea->height = textarea->font->cheight * textarea->line_nb;
+	textarea->width = textarea->cwidth * textarea->row_nb;
+	textarea->height = textarea->cheight * textarea->line_nb;
 
 	blt_size = sizeof(*textarea->blt) * textarea->width * textarea->height;
 	textarea->blt = AllocateZeroPool(blt_size);
@@ -69,6 +69,8 @@ ui_textarea_t *ui_textarea_create(UINTN line_nb, UINTN row_nb, ui_font_t *font,
 	textarea->line_nb = line_nb;
 	textarea->row_nb = row_nb;
 	textarea->font = font;
+	textarea->cwidth = font->cwidth;
+	textarea->cheight = font->cheight;
 
 	if (EFI_ERROR(ui_textarea_allocate_blt(textarea))) {
 		FreePool(textarea);
@@ -83,91 +85,175 @@ ui_textarea_t *ui_textarea_create(UINTN line_nb, UINTN row_nb, ui_font_t *font,
 		return NULL;
 	}
 
+	textarea->dirty = AllocateZeroPool(sizeof(*textarea->dirty) * line_nb);
+	if (!textarea->dirty) {
+		FreePool(textarea->text);
+		FreePool(textarea->blt);
+		FreePool(textarea);
+		return NULL;
+	}
+
 	textarea->current = -1;
 	textarea->color = color;
 	textarea->bg_color = bg_color;
+	textarea->rendered = FALSE;
+	textarea->changed_first = 1;
+	textarea->changed_last = 0;
+	textarea->drawn = FALSE;
 
 	return textarea;
 }
 
-static void ui_textarea_copy_char(unsigned char *src_p, UINTN src_row_bytes,
-				  unsigned char *dst_p, UINTN dst_row_bytes,
-				  int width, int height,
-				  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color)
+static void ui_textarea_changed(ui_textarea_t *textarea, UINTN first, UINTN last)
 {
-	int i, j;
-
-	for (j = 0; j < height; ++j) {
-		unsigned char* sx = src_p;
-		unsigned char* px = dst_p;
-		for (i = 0; i < width; ++i) {
-			unsigned char a = *sx++;
-			if (a == 255) {
-				*px++ = color->Blue;
-				*px++ = color->Green;
-				*px++ = color->Red;
-				px++;
-			} else if (a > 0) {
-				*px = (*px * (255-a) + color->Blue * a) / 255;
-				++px;
-				*px = (*px * (255-a) + color->Green * a) / 255;
-				++px;
-				*px = (*px * (255-a) + color->Red * a) / 255;
-				++px;
-				++px;
-			} else {
-				px += 4;
-			}
-		}
-		src_p += src_row_bytes;
-		dst_p += dst_row_bytes;
+	if (textarea->changed_first > textarea->changed_last) {
+		textarea->changed_first = first;
+		textarea->changed_last = last;
+		return;
 	}
+
+	textarea->changed_first = min(textarea->changed_first, first);
+	textarea->changed_last = max(textarea->changed_last, last);
 }
 
-static void ui_textarea_refresh_blt(ui_textarea_t *textarea)
+static void ui_textarea_render_line(ui_textarea_t *textarea, UINTN line, UINTN cur)
 {
-	UINTN cur, i, j, x, y = 0;
-	ui_font_t *font = textarea->font;
 	UINTN pixel_size = sizeof(*textarea->blt);
-	UINTN row_size = textarea->width * pixel_size;
-	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color;
-	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color = textarea->bg_color;
+	UINTN cwidth = textarea->cwidth, cheight = textarea->cheight;
+	UINTN i, j, x;
+	UINTN line_pixels = textarea->width * cheight;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt = textarea->blt + line * line_pixels;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color, *glyph;
+	ui_glyphs_t *glyphs;
+	unsigned char *s;
+
+	if (textarea->bg_color)
+		for (i = 0; i < line_pixels; i++)
+			blt[i] = *textarea->bg_color;
+	else
+		ZeroMem(blt, line_pixels * pixel_size);
+
+	s = (unsigned char *)textarea->text[cur].str;
+	if (!s || !*s)
+		return;
+
+	color = textarea->color;
+	if (textarea->text[cur].color)
+		color = textarea->text[cur].color;
+
+	glyphs = ui_font_get_glyphs(textarea->font, color, textarea->bg_color,
+				    textarea->text[cur].bold, cwidth, cheight);
+	if (!glyphs)
+		return;
+
+	for (x = 0, j = 0; *s && j < textarea->row_nb; s++, x += cwidth, j++) {
+		if (*s < UI_GLYPH_FIRST || *s > UI_GLYPH_LAST)
+			continue;
+
+		glyph = glyphs->blt + (*s - UI_GLYPH_FIRST) * cwidth * cheight;
+		for (i = 0; i < cheight; i++)
+			memcpy(blt + i * textarea->width + x, glyph + i * cwidth,
+			       cwidth * pixel_size);
+	}
+}
 
-	ZeroMem(textarea->blt,
-		textarea->width * textarea->height * sizeof(*textarea->blt));
+/* Only the modified lines are rendered.  A new line scrolls the blt
+   content up instead of rendering all the lines again.  */
+static void ui_textarea_refresh_blt(ui_textarea_t *textarea)
+{
+	UINTN cur, i, shift;
+	UINTN line_pixels = textarea->width * textarea->cheight;
+	BOOLEAN all = !textarea->rendered || !textarea->dirty;
+
+	if (!all) {
+		shift = (textarea->current - textarea->rendered_current
+			 + textarea->line_nb) % textarea->line_nb;
+		if (shift) {
+			CopyMem(textarea->blt, textarea->blt + shift * line_pixels,
+				(textarea->line_nb - shift) * line_pixels * sizeof(*textarea->blt));
+			ui_textarea_changed(textarea, 0, textarea->line_nb - 1);
+		}
+	}
 
-	for (i = 1; i <= textarea->line_nb; i++) {
-		cur = (textarea->current + i) % textarea->line_nb;
+	for (i = 0; i < textarea->line_nb; i++) {
+		cur = (textarea->current + 1 + i) % textarea->line_nb;
+		if (!all && !textarea->dirty[cur])
+			continue;
 
-		color = textarea->color;
-		if (textarea->text[cur].color)
-			color = textarea->text[cur].color;
+		ui_textarea_render_line(textarea, i, cur);
+		if (textarea->dirty)
+			textarea->dirty[cur] = FALSE;
+		ui_textarea_changed(textarea, i, i);
+	}
 
-		if (bg_color) {
-			UINTN x1;
-			for (x1 = 0; x1 < textarea->height * textarea->width; x1++)
-				CopyMem(textarea->blt + x1, bg_color,
-					sizeof(bg_color));
-		}
+	textarea->rendered = TRUE;
+	textarea->rendered_current = textarea->current;
+}
+
+/* Compute the cell size for TEXT to fit in WIDTH x HEIGHT.  */
+static EFI_STATUS ui_textarea_fit(const ui_textline_t *text, ui_font_t *font,
+				  UINTN width, UINTN height,
+				  UINTN *line_nb, UINTN *row_nb,
+				  UINTN *cwidth, UINTN *cheight)
+{
+	UINTN len, new_width, new_height;
+
+	*row_nb = 0;
+	for (*line_nb = 0; text[*line_nb].str; (*line_nb)++) {
+		len = strlen((CHAR8 *)text[*line_nb].str);
+		*row_nb = *row_nb < len ? len : *row_nb;
+	}
 
-		unsigned char *s = (unsigned char *)textarea->text[cur].str;
-		for (x = 0, j = 0; s && *s && j < textarea->row_nb; s++, x += font->cwidth, j++) {
-			if (*s <= 0x20 || *s > 0x7E)
-				continue;
-			if (*s == '\n')
-				break;
-
-			unsigned char* src_p = font->texture + ((*s - 0x20) * font->cwidth)
-				+ (textarea->text[cur].bold ? font->cheight * font->width : 0);
-			unsigned char* dst_p = ((unsigned char *)textarea->blt)
-				+ (y * row_size)
-				+ (x * pixel_size);
-
-			ui_textarea_copy_char(src_p, font->width, dst_p, row_size,
-					      font->cwidth, font->cheight, color);
+	if (!*line_nb || !*row_nb)
+		return EFI_INVALID_PARAMETER;
+
+	/* The text is rendered with glyphs scaled to the cell size
+	   rather than scaling the rendered text.  */
+	ui_get_scaled_dimension(*row_nb * font->cwidth, *line_nb * font->cheight,
+				width, height, &new_width, &new_height);
+
+	*cwidth = max(new_width / *row_nb, (UINTN)1);
+	*cheight = max(new_height / *line_nb, (UINTN)1);
+	return EFI_SUCCESS;
+}
+
+/* Create a textarea displaying TEXT scaled to fit in WIDTH x HEIGHT.
+   The textarea takes the ownership of the TEXT strings.  */
+ui_textarea_t *ui_textarea_create_text(const ui_textline_t *text, ui_font_t *font,
+				       UINTN width, UINTN height,
+				       EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color)
+{
+	ui_textarea_t *textarea;
+	UINTN i, line_nb, row_nb, cwidth, cheight;
+
+	if (!text || !font)
+		return NULL;
+
+	if (EFI_ERROR(ui_textarea_fit(text, font, width, height, &line_nb,
+				      &row_nb, &cwidth, &cheight)))
+		return NULL;
+
+	textarea = ui_textarea_create(line_nb, row_nb, font, NULL, bg_color);
+	if (!textarea)
+		return NULL;
+
+	if (cwidth != textarea->cwidth || cheight != textarea->cheight) {
+		FreePool(textarea->blt);
+		textarea->cwidth = cwidth;
+		textarea->cheight = cheight;
+		if (EFI_ERROR(ui_textarea_allocate_blt(textarea))) {
+			FreePool(textarea->dirty);
+			FreePool(textarea->text);
+			FreePool(textarea);
+			return NULL;
 		}
-		y += font->cheight;
 	}
+
+	for (i = 0; i < line_nb; i++)
+		ui_textarea_set_line(textarea, i, text[i].str,
+				     text[i].color, text[i].bold);
+
+	return textarea;
 }
 
 EFI_STATUS ui_textarea_display_text(const ui_textline_t *text, ui_font_t *font,
@@ -176,18 +262,15 @@ EFI_STATUS ui_textarea_display_text(const ui_textline_t *text, ui_font_t *font,
 {
 	ui_textarea_t textarea;
 	EFI_STATUS ret;
-	UINTN line_nb, len, row_nb = 0;
+	UINTN line_nb, row_nb;
 
 	if (!text || !font || !y)
 		return EFI_INVALID_PARAMETER;
 
-	for (line_nb = 0; text[line_nb].str; line_nb++) {
-		len = strlen((CHAR8 *)text[line_nb].str);
-		row_nb = row_nb < len ? len : row_nb;
-	}
-
-	if (!line_nb || !row_nb)
-		return EFI_INVALID_PARAMETER;
+	ret = ui_textarea_fit(text, font, width, height, &line_nb, &row_nb,
+			      &textarea.cwidth, &textarea.cheight);
+	if (EFI_ERROR(ret))
+		return ret;
 
 	textarea.line_nb = line_nb;
 	textarea.row_nb = row_nb;
@@ -196,13 +279,20 @@ EFI_STATUS ui_textarea_display_text(const ui_textline_t *text, ui_font_t *font,
 	textarea.bg_color = bg_color;
 	textarea.font = font;
 	textarea.current = -1;
+	textarea.dirty = NULL;
+	textarea.rendered = FALSE;
+	textarea.changed_first = 1;
+	textarea.changed_last = 0;
+	textarea.drawn = FALSE;
 
 	ret = ui_textarea_allocate_blt(&textarea);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	ret = ui_textarea_draw_scale(&textarea, x, y, width, height);
+	ui_textarea_refresh_blt(&textarea);
+	ret = ui_draw_blt(textarea.blt, x, *y, textarea.width, textarea.height);
 	FreePool(textarea.blt);
+	*y += textarea.height;
 	return ret;
 }
 
@@ -211,6 +301,7 @@ void ui_textarea_free(ui_textarea_t *textarea)
 	ui_textarea_clear(textarea);
 	FreePool(textarea->blt);
 	FreePool(textarea->text);
+	FreePool(textarea->dirty);
 	FreePool(textarea);
 }
 
@@ -225,6 +316,7 @@ void ui_textarea_clear(ui_textarea_t *textarea)
 		}
 
 	textarea->current = -1;
+	textarea->rendered = FALSE;
 }
 
 void ui_textarea_set_line(ui_textarea_t *textarea, UINTN line_nb, char *str,
@@ -233,6 +325,8 @@ void ui_textarea_set_line(ui_textarea_t *textarea, UINTN line_nb, char *str,
 	textarea->text[line_nb].str = str;
 	textarea->text[line_nb].color = color;
 	textarea->text[line_nb].bold = bold;
+	if (textarea->dirty)
+		textarea->dirty[line_nb] = TRUE;
 }
 
 void ui_textarea_newline(ui_textarea_t *textarea, char *str,
@@ -254,6 +348,10 @@ EFI_STATUS ui_textarea_draw_scale(ui_textarea_t *textarea, UINTN x, UINTN *y,
 	EFI_STATUS ret;
 
 	ui_textarea_refresh_blt(textarea);
+	textarea->changed_first = 1;
+	textarea->changed_last = 0;
+	/* The scaled lines do not match the next ui_textarea_draw() */
+	textarea->drawn = FALSE;
 
 	ui_get_scaled_dimension(textarea->width, textarea->height,
 				width, height, &new_width, &new_height);
@@ -261,20 +359,47 @@ EFI_STATUS ui_textarea_draw_scale(ui_textarea_t *textarea, UINTN x, UINTN *y,
 	if (!scaled_blt)
 		return EFI_OUT_OF_RESOURCES;
 
-	ui_bilinear_scale((unsigned char *)textarea->blt,
-			  (unsigned char *)scaled_blt,
-			  textarea->width, textarea->height,
-			  new_width, new_height,
-			  sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
-	ret = ui_draw_blt(scaled_blt, x, *y, new_width, new_height);
+	ret = ui_bilinear_scale((unsigned char *)textarea->blt,
+				(unsigned char *)scaled_blt,
+				textarea->width, textarea->height,
+				new_width, new_height,
+				sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+	if (!EFI_ERROR(ret))
+		ret = ui_draw_blt(scaled_blt, x, *y, new_width, new_height);
 	FreePool(scaled_blt);
 	*y += new_height;
 
 	return ret;
 }
 
+/* The screen content is unknown, the next draw is a complete one */
+void ui_textarea_invalidate(ui_textarea_t *textarea)
+{
+	textarea->drawn = FALSE;
+}
+
+/* Only the lines changed since the last draw at the same position
+   are drawn.  */
 EFI_STATUS ui_textarea_draw(ui_textarea_t *textarea, UINTN x, UINTN y)
 {
+	UINTN first, nb, cheight = textarea->cheight;
+	EFI_STATUS ret;
+
 	ui_textarea_refresh_blt(textarea);
-	return ui_draw_blt(textarea->blt, x, y, textarea->width, textarea->height);
+
+	if (!textarea->drawn || textarea->drawn_x != x || textarea->drawn_y != y) {
+		ret = ui_draw_blt(textarea->blt, x, y, textarea->width, textarea->height);
+	} else if (textarea->changed_first <= textarea->changed_last) {
+		first = textarea->changed_first * cheight;
+		nb = (textarea->changed_last + 1 - textarea->changed_first) * cheight;
+		ret = ui_draw_blt_lines(textarea->blt, x, y, textarea->width, first, nb);
+	} else
+		ret = EFI_SUCCESS;
+
+	textarea->changed_first = 1;
+	textarea->changed_last = 0;
+	textarea->drawn = !EFI_ERROR(ret);
+	textarea->drawn_x = x;
+	textarea->drawn_y = y;
+	return ret;
 }
@@ -43,11 +43,21 @@
 #define OFF_MODE_CHARGE_VAR	L"off-mode-charge"
 #define OEM_LOCK_VAR		L"OEMLock"
 #define CRASH_EVENT_MENU_VAR	L"CrashEventMenu"
+#define DISCARD_DONT_CARE_VAR	L"DiscardDontCare"
+#define VERIFY_FLASH_VAR	L"VerifyFlash"
+#define DELTA_FLASH_VAR		L"DeltaFlash"
+#define PIPELINE_FLASH_VAR	L"PipelineFlash"
+#define DEFERRED_ERASE_VAR	L"DeferredErase"
+#define IP_CONFIG_CACHE_VAR	L"IpConfigCache"
+#define CACHED_IP_CONFIG_VAR	L"CachedIpConfig"
+#define STATIC_IP_CONFIG_VAR	L"StaticIpConfig"
 #define WDT_COUNTER_VAR		L"WatchdogCounter"
 #define WDT_COUNTER_MAX_VAR	L"WatchdogCounterMax"
 #define WDT_TIME_REF_VAR	L"WatchdogTimeReference"
 #define DISABLE_WDT_VAR		L"DisableWatchdog"
 #define UPDATE_OEMVARS		L"UpdateOemVars"
+#define OEMVARS_DIGEST_VAR	L"OemVarsDigest"
+#define ERASED_PARTS_VAR	L"ErasedParts"
 #define UI_DISPLAY_SPLASH_VAR	L"UIDisplaySplash"
 #define REBOOT_REASON		L"LoaderEntryRebootReason"
 #ifdef BOOTLOADER_POLICY_EFI_VAR
@@ -104,11 +114,6 @@ static struct state_display {
 	{ "unlocked", &COLOR_RED }
 };
 
-static CHAR8 current_off_mode_charge[2];
-static CHAR8 current_crash_event_menu[2];
-static CHAR8 disable_wdt[2];
-static CHAR8 current_update_oemvars[2];
-static CHAR8 ui_display_splash[2];
 
 CHAR16 *boot_state_to_string(UINT8 boot_state)
 {
@@ -126,30 +131,28 @@ CHAR16 *boot_state_to_string(UINT8 boot_state)
 	}
 }
 
-BOOLEAN get_current_boolean_var(const EFI_GUID *guid, CHAR16 *varname, CHAR8 cache[2],const BOOLEAN default_value)
+/* The values are not cached here, get_efi_variable() does it */
+BOOLEAN get_current_boolean_var(const EFI_GUID *guid, CHAR16 *varname, const BOOLEAN default_value)
 {
 	UINTN size;
 	CHAR8 *data;
+	BOOLEAN value;
 
-	if (cache[0] == '\0') {
-		if (EFI_ERROR(get_efi_variable(guid, varname,
-					       &size, (VOID **)&data, NULL)))
-			return default_value;
+	if (EFI_ERROR(get_efi_variable(guid, varname,
+				       &size, (VOID **)&data, NULL)))
+		return default_value;
 
-		if (size != 2
-		    || (strcmp(data, (CHAR8 *)"0") && strcmp(data, (CHAR8 *)"1"))) {
-			FreePool(data);
-			return default_value;
-		}
-
-		memcpy(cache, data, 2);
-		FreePool(data);
-	}
+	if (size != 2
+	    || (strcmp(data, (CHAR8 *)"0") && strcmp(data, (CHAR8 *)"1")))
+		value = default_value;
+	else
+		value = !strcmp(data, (CHAR8 *)"1");
 
-	return !strcmp(cache, (CHAR8 *)"1");
+	FreePool(data);
+	return value;
 }
 
-EFI_STATUS set_boolean_var(const EFI_GUID *guid, CHAR16 *varname, CHAR8 cache[2], BOOLEAN enabled)
+EFI_STATUS set_boolean_var(const EFI_GUID *guid, CHAR16 *varname, BOOLEAN enabled)
 {
 	CHAR8 *val = (CHAR8 *)(enabled ? "1" : "0");
 	EFI_STATUS ret = set_efi_variable(guid, varname,
@@ -159,42 +162,338 @@ EFI_STATUS set_boolean_var(const EFI_GUID *guid, CHAR16 *varname, CHAR8 cache[2]
 		return ret;
 	}
 
-	memcpy(cache, val, 2);
 	return EFI_SUCCESS;
 }
 
 BOOLEAN get_current_off_mode_charge(void)
 {
-	return get_current_boolean_var(&fastboot_guid, OFF_MODE_CHARGE_VAR, current_off_mode_charge, TRUE);
+	return get_current_boolean_var(&fastboot_guid, OFF_MODE_CHARGE_VAR, TRUE);
 }
 
 EFI_STATUS set_off_mode_charge(BOOLEAN enabled)
 {
-	return set_boolean_var(&fastboot_guid, OFF_MODE_CHARGE_VAR, current_off_mode_charge, enabled);
+	return set_boolean_var(&fastboot_guid, OFF_MODE_CHARGE_VAR, enabled);
 }
 
 BOOLEAN get_current_crash_event_menu(void)
 {
-	return get_current_boolean_var(&fastboot_guid, CRASH_EVENT_MENU_VAR, current_crash_event_menu, TRUE);
+	return get_current_boolean_var(&fastboot_guid, CRASH_EVENT_MENU_VAR, TRUE);
 }
 
 EFI_STATUS set_crash_event_menu(BOOLEAN enabled)
 {
-	return set_boolean_var(&fastboot_guid, CRASH_EVENT_MENU_VAR, current_crash_event_menu, enabled);
+	return set_boolean_var(&fastboot_guid, CRASH_EVENT_MENU_VAR, enabled);
+}
+
+BOOLEAN get_discard_dont_care(void)
+{
+	return get_current_boolean_var(&fastboot_guid, DISCARD_DONT_CARE_VAR, FALSE);
+}
+
+EFI_STATUS set_discard_dont_care(BOOLEAN enabled)
+{
+	return set_boolean_var(&fastboot_guid, DISCARD_DONT_CARE_VAR, enabled);
+}
+
+BOOLEAN get_verify_flash(void)
+{
+	return get_current_boolean_var(&fastboot_guid, VERIFY_FLASH_VAR, FALSE);
+}
+
+EFI_STATUS set_verify_flash(BOOLEAN enabled)
+{
+	return set_boolean_var(&fastboot_guid, VERIFY_FLASH_VAR, enabled);
+}
+
+BOOLEAN get_delta_flash(void)
+{
+	return get_current_boolean_var(&fastboot_guid, DELTA_FLASH_VAR, FALSE);
+}
+
+EFI_STATUS set_delta_flash(BOOLEAN enabled)
+{
+	return set_boolean_var(&fastboot_guid, DELTA_FLASH_VAR, enabled);
+}
+
+BOOLEAN get_pipeline_flash(void)
+{
+	return get_current_boolean_var(&fastboot_guid, PIPELINE_FLASH_VAR, FALSE);
+}
+
+EFI_STATUS set_pipeline_flash(BOOLEAN enabled)
+{
+	return set_boolean_var(&fastboot_guid, PIPELINE_FLASH_VAR, enabled);
+}
+
+BOOLEAN get_deferred_erase(void)
+{
+	return get_current_boolean_var(&fastboot_guid, DEFERRED_ERASE_VAR, FALSE);
+}
+
+EFI_STATUS set_deferred_erase(BOOLEAN enabled)
+{
+	return set_boolean_var(&fastboot_guid, DEFERRED_ERASE_VAR, enabled);
+}
+
+BOOLEAN get_ip_config_cache(void)
+{
+	return get_current_boolean_var(&fastboot_guid, IP_CONFIG_CACHE_VAR, FALSE);
+}
+
+EFI_STATUS set_ip_config_cache(BOOLEAN enabled)
+{
+	if (!enabled)
+		del_efi_variable(&fastboot_guid, CACHED_IP_CONFIG_VAR);
+
+	return set_boolean_var(&fastboot_guid, IP_CONFIG_CACHE_VAR, enabled);
+}
+
+EFI_STATUS get_cached_ip_config(ip_config_t *config)
+{
+	EFI_STATUS ret;
+	ip_config_t *data;
+	UINTN size;
+
+	ret = get_efi_variable(&fastboot_guid, CACHED_IP_CONFIG_VAR, &size,
+			       (VOID **)&data, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (size != sizeof(*config)) {
+		FreePool(data);
+		return EFI_COMPROMISED_DATA;
+	}
+
+	memcpy(config, data, sizeof(*config));
+	FreePool(data);
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS set_cached_ip_config(ip_config_t *config)
+{
+	return set_efi_variable(&fastboot_guid, CACHED_IP_CONFIG_VAR,
+				sizeof(*config), config, TRUE, FALSE);
+}
+
+static EFI_STATUS parse_ipv4(char *str, EFI_IPv4_ADDRESS *address, char **end)
+{
+	unsigned long value;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(address->Addr); i++) {
+		if (i && *str++ != '.')
+			return EFI_INVALID_PARAMETER;
+
+		value = strtoul(str, end, 10);
+		if (*end == str || value > 255)
+			return EFI_INVALID_PARAMETER;
+
+		address->Addr[i] = value;
+		str = *end;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* STATIC_IP_CONFIG_VAR is a "A.B.C.D/PREFIX" string, usually set by
+   the oemvars.  */
+EFI_STATUS get_static_ip_config(ip_config_t *config)
+{
+	EFI_STATUS ret;
+	char *data, *end;
+	UINTN size, i;
+	unsigned long prefix;
+	UINT32 mask;
+
+	ret = get_efi_variable(&loader_guid, STATIC_IP_CONFIG_VAR, &size,
+			       (VOID **)&data, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!size || data[size - 1] != '\0') {
+		ret = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	ret = parse_ipv4(data, &config->address, &end);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	if (*end++ != '/') {
+		ret = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	prefix = strtoul(end, &end, 10);
+	if (*end != '\0' || prefix == 0 || prefix > 32) {
+		ret = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	mask = 0xFFFFFFFF << (32 - prefix);
+	for (i = 0; i < ARRAY_SIZE(config->subnet.Addr); i++)
+		config->subnet.Addr[i] = mask >> (24 - 8 * i);
+
+out:
+	if (EFI_ERROR(ret))
+		error(L"Invalid %s variable", STATIC_IP_CONFIG_VAR);
+	FreePool(data);
+	return ret;
 }
 
 BOOLEAN get_display_splash(void) {
-	return get_current_boolean_var(&loader_guid, UI_DISPLAY_SPLASH_VAR, ui_display_splash, TRUE);
+	return get_current_boolean_var(&loader_guid, UI_DISPLAY_SPLASH_VAR, TRUE);
 }
 
 BOOLEAN get_oemvars_update(void)
 {
-	return get_current_boolean_var(&fastboot_guid, UPDATE_OEMVARS, current_update_oemvars, TRUE);
+	return get_current_boolean_var(&fastboot_guid, UPDATE_OEMVARS, TRUE);
 }
 
 EFI_STATUS set_oemvars_update(BOOLEAN enabled)
 {
-	return set_boolean_var(&fastboot_guid, UPDATE_OEMVARS, current_update_oemvars, enabled);
+	return set_boolean_var(&fastboot_guid, UPDATE_OEMVARS, enabled);
+}
+
+BOOLEAN oemvars_digest_match(const UINT8 *digest)
+{
+	UINTN size;
+	UINT8 *data;
+	BOOLEAN match;
+
+	if (EFI_ERROR(get_efi_variable(&fastboot_guid, OEMVARS_DIGEST_VAR,
+				       &size, (VOID **)&data, NULL)))
+		return FALSE;
+
+	match = size == OEMVARS_DIGEST_SIZE
+		&& !memcmp(data, digest, OEMVARS_DIGEST_SIZE);
+	FreePool(data);
+	return match;
+}
+
+EFI_STATUS set_oemvars_digest(const UINT8 *digest)
+{
+	if (!digest)
+		return del_efi_variable(&fastboot_guid, OEMVARS_DIGEST_VAR);
+
+	return set_efi_variable(&fastboot_guid, OEMVARS_DIGEST_VAR,
+				OEMVARS_DIGEST_SIZE, (VOID *)digest, TRUE, FALSE);
+}
+
+/* First and last blocks of a partition known to be erased.  The
+   records are volatile: writes done outside of kernelflinger, by
+   another boot option or the UEFI shell for instance, are not seen
+   and a record must not outlive the boot session which made it.  */
+struct erased_part {
+	UINT64 start;
+	UINT64 end;
+} __attribute__((packed));
+
+#define ERASED_PARTS_MAX	16
+
+static EFI_STATUS erased_parts_load(struct erased_part **parts, UINTN *nb)
+{
+	UINTN size;
+	UINT32 flags;
+	EFI_STATUS ret;
+
+	ret = get_efi_variable(&fastboot_guid, ERASED_PARTS_VAR, &size,
+			       (VOID **)parts, &flags);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* A non-volatile record was left by a previous boot */
+	if ((flags & EFI_VARIABLE_NON_VOLATILE) ||
+	    size % sizeof(**parts) || size > ERASED_PARTS_MAX * sizeof(**parts)) {
+		FreePool(*parts);
+		del_efi_variable(&fastboot_guid, ERASED_PARTS_VAR);
+		return EFI_COMPROMISED_DATA;
+	}
+
+	*nb = size / sizeof(**parts);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS erased_parts_save(struct erased_part *parts, UINTN nb)
+{
+	if (!nb)
+		return del_efi_variable(&fastboot_guid, ERASED_PARTS_VAR);
+
+	return set_efi_variable(&fastboot_guid, ERASED_PARTS_VAR,
+				nb * sizeof(*parts), parts, FALSE, FALSE);
+}
+
+BOOLEAN is_erased_part(UINT64 start, UINT64 end)
+{
+	struct erased_part *parts;
+	BOOLEAN found = FALSE;
+	UINTN nb, i;
+
+	if (EFI_ERROR(erased_parts_load(&parts, &nb)))
+		return FALSE;
+
+	for (i = 0; i < nb && !found; i++)
+		found = parts[i].start == start && parts[i].end == end;
+
+	FreePool(parts);
+	return found;
+}
+
+EFI_STATUS set_erased_part(UINT64 start, UINT64 end)
+{
+	struct erased_part parts[ERASED_PARTS_MAX], *stored;
+	EFI_STATUS ret;
+	UINTN nb = 0, i;
+
+	ret = erased_parts_load(&stored, &nb);
+	if (!EFI_ERROR(ret)) {
+		memcpy(parts, stored, nb * sizeof(*parts));
+		FreePool(stored);
+	} else
+		nb = 0;
+
+	/* The oldest range goes away first */
+	for (i = 0; i < nb; i++)
+		if (parts[i].start == start && parts[i].end == end)
+			break;
+	if (i == nb && nb == ARRAY_SIZE(parts))
+		i = 0;
+	if (i != nb) {
+		CopyMem(&parts[i], &parts[i + 1], (nb - i - 1) * sizeof(*parts));
+		nb--;
+	}
+
+	parts[nb].start = start;
+	parts[nb].end = end;
+	return erased_parts_save(parts, nb + 1);
+}
+
+void forget_erased_parts(UINT64 start, UINT64 end)
+{
+	struct erased_part *parts;
+	EFI_STATUS ret;
+	UINTN nb, i, j;
+
+	if (EFI_ERROR(erased_parts_load(&parts, &nb)))
+		return;
+
+	for (i = j = 0; i < nb; i++)
+		if (parts[i].end < start || parts[i].start > end)
+			parts[j++] = parts[i];
+
+	if (j != nb) {
+		ret = erased_parts_save(parts, j);
+		/* A stale range would skip a needed erase */
+		if (EFI_ERROR(ret))
+			del_efi_variable(&fastboot_guid, ERASED_PARTS_VAR);
+	}
+	FreePool(parts);
+}
+
+void forget_all_erased_parts(void)
+{
+	del_efi_variable(&fastboot_guid, ERASED_PARTS_VAR);
 }
 
 enum device_state get_current_state()
@@ -382,7 +681,7 @@ EFI_STATUS set_watchdog_counter_max(UINT8 max)
 
 BOOLEAN get_disable_watchdog()
 {
-	return get_current_boolean_var(&loader_guid, DISABLE_WDT_VAR, disable_wdt, FALSE);
+	return get_current_boolean_var(&loader_guid, DISABLE_WDT_VAR, FALSE);
 }
 
 static void CDD_clean_string(char *buf)
@@ -429,22 +728,39 @@ static void CDD_clean_string(char *buf)
 	} \
 } while(0)
 
+/* The properties are computed once, even when they end up empty, as
+ * they are used by the command line, the fastboot variables and the
+ * UI.  */
+enum property_id {
+	PROPERTY_BOOTLOADER,
+	PROPERTY_NAME,
+	PROPERTY_BRAND,
+	PROPERTY_DEVICE,
+	PROPERTY_DEVICE_ID,
+	PROPERTY_NB
+};
+
+static struct property {
+	BOOLEAN cached;
+	char value[ANDROID_PROP_VALUE_MAX];
+} properties[PROPERTY_NB];
+
 char *get_property_bootloader(void)
 {
-	static char loader[ANDROID_PROP_VALUE_MAX];
+	struct property *loader = &properties[PROPERTY_BOOTLOADER];
+	char buf[ANDROID_PROP_VALUE_MAX];
 
-	if (!loader[0]) {
-		char buf[ANDROID_PROP_VALUE_MAX];
+	if (loader->cached)
+		return loader->value;
 
-		buf[0] = 0;
-		SMBIOS_TO_BUFFER(buf, TYPE_BIOS, BiosVersion);
-		snprintf((CHAR8 *)loader, ANDROID_PROP_VALUE_MAX,
-			 (CHAR8 *)"%a_%a", buf,
-			 KERNELFLINGER_VERSION_8);
-		CDD_clean_string(loader);
-	}
+	buf[0] = 0;
+	SMBIOS_TO_BUFFER(buf, TYPE_BIOS, BiosVersion);
+	snprintf((CHAR8 *)loader->value, sizeof(loader->value),
+		 (CHAR8 *)"%a_%a", buf, KERNELFLINGER_VERSION_8);
+	CDD_clean_string(loader->value);
+	loader->cached = TRUE;
 
-	return loader;
+	return loader->value;
 }
 
 #ifdef HAL_AUTODETECT
@@ -484,16 +800,18 @@ static void chop_brand_tail(char *brand)
 
 char *get_property_name(void)
 {
-	static char name[ANDROID_PROP_VALUE_MAX];
+	struct property *name = &properties[PROPERTY_NAME];
 
-	if (!name[0]) {
-		SMBIOS_TO_BUFFER(name, TYPE_PRODUCT, ProductName);
-		SMBIOS_TO_BUFFER(name, TYPE_BOARD, ProductName);
-		CDD_clean_string(name);
-		debug(L"Detected product name '%a'", name);
-	}
+	if (name->cached)
+		return name->value;
 
-	return name;
+	SMBIOS_TO_BUFFER(name->value, TYPE_PRODUCT, ProductName);
+	SMBIOS_TO_BUFFER(name->value, TYPE_BOARD, ProductName);
+	CDD_clean_string(name->value);
+	debug(L"Detected product name '%a'", name->value);
+	name->cached = TRUE;
+
+	return name->value;
 }
 
 /* product_vendor observed to be blank on some devices
@@ -501,17 +819,19 @@ char *get_property_name(void)
  * board_vendor observed to be reasonable on sample of devices */
 char *get_property_brand(void)
 {
-	static char brand[ANDROID_PROP_VALUE_MAX];
+	struct property *brand = &properties[PROPERTY_BRAND];
 
-	if (!brand[0]) {
-		SMBIOS_TO_BUFFER(brand, TYPE_BOARD, Manufacturer);
-		SMBIOS_TO_BUFFER(brand, TYPE_PRODUCT, Manufacturer);
-		CDD_clean_string(brand);
-		chop_brand_tail(brand);
-		debug(L"Detected product brand '%a'", brand);
-	}
+	if (brand->cached)
+		return brand->value;
+
+	SMBIOS_TO_BUFFER(brand->value, TYPE_BOARD, Manufacturer);
+	SMBIOS_TO_BUFFER(brand->value, TYPE_PRODUCT, Manufacturer);
+	CDD_clean_string(brand->value);
+	chop_brand_tail(brand->value);
+	debug(L"Detected product brand '%a'", brand->value);
+	brand->cached = TRUE;
 
-	return brand;
+	return brand->value;
 }
 
 char *get_property_model(void)
@@ -524,40 +844,46 @@ char *get_property_model(void)
 
 char *get_property_device(void)
 {
-	static char device[ANDROID_PROP_VALUE_MAX];
-	if (!device[0]) {
-		char board_name[ANDROID_PROP_VALUE_MAX];
-		char board_version[ANDROID_PROP_VALUE_MAX];
+	struct property *device = &properties[PROPERTY_DEVICE];
+	char board_name[ANDROID_PROP_VALUE_MAX];
+	char board_version[ANDROID_PROP_VALUE_MAX];
 
-		board_name[0] = 0;
-		board_version[0] = 0;
+	if (device->cached)
+		return device->value;
 
-		SMBIOS_TO_BUFFER(board_name, TYPE_BOARD, ProductName);
-		SMBIOS_TO_BUFFER(board_version, TYPE_BOARD, Version);
+	board_name[0] = 0;
+	board_version[0] = 0;
 
-		if (board_version[0]) {
-			snprintf((CHAR8 *)device, ANDROID_PROP_VALUE_MAX,
-				 (CHAR8 *)"%a_%a", board_name, board_version);
-		} else {
-			snprintf((CHAR8 *)device, ANDROID_PROP_VALUE_MAX,
-				 (CHAR8*)"%a", board_name);
-		}
-		CDD_clean_string(device);
-		debug(L"Detected product device '%a'", device);
+	SMBIOS_TO_BUFFER(board_name, TYPE_BOARD, ProductName);
+	SMBIOS_TO_BUFFER(board_version, TYPE_BOARD, Version);
+
+	if (board_version[0]) {
+		snprintf((CHAR8 *)device->value, sizeof(device->value),
+			 (CHAR8 *)"%a_%a", board_name, board_version);
+	} else {
+		snprintf((CHAR8 *)device->value, sizeof(device->value),
+			 (CHAR8*)"%a", board_name);
 	}
+	CDD_clean_string(device->value);
+	debug(L"Detected product device '%a'", device->value);
+	device->cached = TRUE;
 
-	return device;
+	return device->value;
 }
 
 char *get_device_id(void)
 {
-	static char deviceid[ANDROID_PROP_VALUE_MAX];
-	if (!deviceid[0]) {
-		snprintf((CHAR8 *)deviceid, sizeof(deviceid),
-			 (CHAR8 *)"%a/%a/%a", get_property_brand(),
-			 get_property_name(), get_property_device());
-	}
-	return deviceid;
+	struct property *deviceid = &properties[PROPERTY_DEVICE_ID];
+
+	if (deviceid->cached)
+		return deviceid->value;
+
+	snprintf((CHAR8 *)deviceid->value, sizeof(deviceid->value),
+		 (CHAR8 *)"%a/%a/%a", get_property_brand(),
+		 get_property_name(), get_property_device());
+	deviceid->cached = TRUE;
+
+	return deviceid->value;
 }
 #else
 char *get_device_id(void)
@@ -575,6 +901,7 @@ char *get_serial_number(void)
 	unsigned int zeroes = 0;
 	UINTN len;
 
+	/* Always set, to the bad BIOS value at worst */
 	if (serialno[0] != '\0')
 		return serialno;
 
@@ -0,0 +1,11 @@
+#ifndef _OPENSSL_MEM_H_
+#define _OPENSSL_MEM_H_
+
+/* Kept apart from openssl_support.h, which replaces libc types, so
+   that it can be included after the OpenSSL headers.  */
+
+/* Give the memory of the small allocations slabs which are not used
+   anymore back to the firmware */
+void openssl_mem_trim(void);
+
+#endif 	/* _OPENSSL_MEM_H_ */
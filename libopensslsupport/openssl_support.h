@@ -8,4 +8,6 @@ typedef UINTN size_t;
 typedef long time_t;
 typedef VOID *FILE;
 
+#include "openssl_mem.h"
+
 #endif 	/* _OPENSSL_SUPPORT_H_ */
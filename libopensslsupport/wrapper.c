@@ -1,6 +1,7 @@
 #include <efi.h>
 #include <efilib.h>
 #include <lib.h>
+#include "memstat.h"
 #include "openssl_support.h"
 
 FILE  *__sF = NULL;
@@ -599,43 +600,170 @@ int tcgetattr(int fd, void *termios_p)
 	return 0;
 }
 
-/* UEFI ReallocatePool needs the old size information, which we don't have.
- * These wrappers of malloc, free and realloc keeps track of allocated
- * memory to be able to get the old size information.
- * The static table mem might be too small.
- * When this code has been written, we have counted a maximun of 450
- * allocated chunks during a secure boot use case */
+/* UEFI ReallocatePool needs the old size information.  The size is
+ * stored in a header in front of each allocation so that malloc, free
+ * and realloc do not have to look it up.  The 16 bytes header keeps
+ * the pool alignment and its magic catches the pointers which were
+ * not allocated here.  SLAB is the address of the slab holding a
+ * small allocation, zero for a pool allocation. */
+#define MEM_CHUNK_MAGIC 0x4b4e4843	/* "CHNK" */
+#define MEM_FREE_MAGIC 0x45455246	/* "FREE" */
+
 typedef struct mem_chunk {
-	void *addr;
-	size_t size;
+	UINT32 magic;
+	UINT32 size;
+	UINT64 slab;
 } mem_chunk_t;
-static mem_chunk_t mem[1024];
 
-static inline mem_chunk_t *search_mem(void *addr)
-{
-	unsigned int i;
+/* ASN.1, X509 and BIGNUM parsing make thousands of small
+ * allocations.  They are carved from SLAB_SIZE page allocations, one
+ * free list per size class, instead of being as many pool
+ * allocations.  The empty slabs are kept for the next verification
+ * and returned to the firmware by openssl_mem_trim(). */
+#define SLAB_PAGES 16
+#define SLAB_SIZE (SLAB_PAGES * EFI_PAGE_SIZE)
+
+static const UINT32 SLAB_CLASSES[] = { 16, 32, 64, 128, 256 };
+
+typedef struct slab {
+	struct slab *next;
+	UINT32 class;
+	UINT32 used;		/* live chunks */
+	UINT32 carved;		/* offset of the space not carved yet */
+} __attribute__((aligned(16))) slab_t;
 
-	for (i = 0; i < ARRAY_SIZE(mem) && mem[i].addr != addr; i++)
-		;
+typedef struct free_chunk {
+	struct free_chunk *next;
+} free_chunk_t;
+
+static struct slab_class {
+	slab_t *slabs;
+	slab_t *cur;		/* slab being carved */
+	free_chunk_t *free;
+} classes[ARRAY_SIZE(SLAB_CLASSES)];
+
+static inline mem_chunk_t *to_chunk(void *addr)
+{
+	mem_chunk_t *mc = (mem_chunk_t *)addr - 1;
 
-	if (i == ARRAY_SIZE(mem))
+	if (mc->magic != MEM_CHUNK_MAGIC)
 		return NULL;
-	return &mem[i];
+	return mc;
 }
 
-void *malloc(size_t size)
+static inline slab_t *chunk_slab(mem_chunk_t *mc)
+{
+	return (slab_t *)(UINTN)mc->slab;
+}
+
+static mem_chunk_t *slab_alloc(UINTN c)
 {
+	struct slab_class *sc = &classes[c];
+	UINTN stride = sizeof(mem_chunk_t) + SLAB_CLASSES[c];
+	EFI_PHYSICAL_ADDRESS addr;
 	mem_chunk_t *mc;
+	slab_t *slab;
+	EFI_STATUS ret;
+
+	if (sc->free) {
+		mc = (mem_chunk_t *)sc->free - 1;
+		sc->free = sc->free->next;
+		chunk_slab(mc)->used++;
+		return mc;
+	}
 
-	mc = search_mem(NULL);
-	if (!mc) {
-		error(L"malloc failed, wrapper allocator is full!");
+	slab = sc->cur;
+	if (!slab || slab->carved + stride > SLAB_SIZE) {
+		ret = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages,
+					EfiLoaderData, SLAB_PAGES, &addr);
+		memstat_alloc(MEMSTAT_OPENSSL, SLAB_SIZE, !EFI_ERROR(ret));
+		if (EFI_ERROR(ret))
+			return NULL;
+
+		slab = (slab_t *)(UINTN)addr;
+		slab->class = c;
+		slab->used = 0;
+		slab->carved = sizeof(*slab);
+		slab->next = sc->slabs;
+		sc->slabs = sc->cur = slab;
+	}
+
+	mc = (mem_chunk_t *)((CHAR8 *)slab + slab->carved);
+	mc->slab = (UINTN)slab;
+	slab->carved += stride;
+	slab->used++;
+	return mc;
+}
+
+static void slab_free(mem_chunk_t *mc)
+{
+	slab_t *slab = chunk_slab(mc);
+	struct slab_class *sc = &classes[slab->class];
+	free_chunk_t *fc = (free_chunk_t *)(mc + 1);
+
+	slab->used--;
+	fc->next = sc->free;
+	sc->free = fc;
+}
+
+void openssl_mem_trim(void)
+{
+	struct slab_class *sc;
+	free_chunk_t **fc;
+	slab_t **slab, *empty;
+	UINTN c;
+
+	for (c = 0; c < ARRAY_SIZE(classes); c++) {
+		sc = &classes[c];
+
+		for (fc = &sc->free; *fc; ) {
+			if (chunk_slab((mem_chunk_t *)*fc - 1)->used)
+				fc = &(*fc)->next;
+			else
+				*fc = (*fc)->next;
+		}
+
+		for (slab = &sc->slabs; *slab; ) {
+			if ((*slab)->used) {
+				slab = &(*slab)->next;
+				continue;
+			}
+			empty = *slab;
+			*slab = empty->next;
+			if (sc->cur == empty)
+				sc->cur = NULL;
+			uefi_call_wrapper(BS->FreePages, 2,
+					  (EFI_PHYSICAL_ADDRESS)(UINTN)empty,
+					  SLAB_PAGES);
+			memstat_free(MEMSTAT_OPENSSL, SLAB_SIZE);
+		}
+	}
+}
+
+void *malloc(size_t size)
+{
+	mem_chunk_t *mc = NULL;
+	UINTN c;
+
+	if (size > (UINT32)-1)
 		return NULL;
+
+	for (c = 0; c < ARRAY_SIZE(SLAB_CLASSES); c++)
+		if (size <= SLAB_CLASSES[c]) {
+			mc = slab_alloc(c);
+			break;
+		}
+
+	if (!mc) {
+		mc = memstat_pool(MEMSTAT_OPENSSL, sizeof(*mc) + size);
+		if (!mc)
+			return NULL;
+		mc->slab = 0;
 	}
 
-	mc->addr = AllocatePool(size);
+	mc->magic = MEM_CHUNK_MAGIC;
 	mc->size = size;
-	return mc->addr;
+	return mc + 1;
 }
 
 void free(void *addr)
@@ -645,27 +773,60 @@ void free(void *addr)
 	if (!addr)
 		return;
 
-	mc = search_mem(addr);
+	mc = to_chunk(addr);
 	if (!mc) {
 		error(L"Tried to free an unknown pointer");
 		return;
 	}
 
-	FreePool(addr);
-	mc->addr = NULL;
+	mc->magic = MEM_FREE_MAGIC;
+	if (mc->slab)
+		slab_free(mc);
+	else
+		memstat_free_pool(MEMSTAT_OPENSSL, mc, sizeof(*mc) + mc->size);
 }
 
 void *realloc(void *ptr, size_t size)
 {
 	mem_chunk_t *mc;
+	UINTN old_size;
+	void *new;
+
+	if (!ptr)
+		return malloc(size);
 
-	mc = search_mem(ptr);
+	mc = to_chunk(ptr);
 	if (!mc) {
 		error(L"Tried to realloc an unknown pointer");
 		return NULL;
 	}
 
-	mc->addr = ReallocatePool(ptr, (UINTN)mc->size, (UINTN) size);
+	if (size > (UINT32)-1)
+		return NULL;
+
+	if (mc->slab) {
+		if (size <= SLAB_CLASSES[chunk_slab(mc)->class]) {
+			mc->size = size;
+			return ptr;
+		}
+
+		new = malloc(size);
+		if (!new)
+			return NULL;
+		memcpy(new, ptr, mc->size);
+		free(ptr);
+		return new;
+	}
+
+	old_size = sizeof(*mc) + mc->size;
+	mc = ReallocatePool(mc, old_size, (UINTN)(sizeof(*mc) + size));
+	/* The old pool is released even if the new one cannot be
+	 * allocated. */
+	memstat_free(MEMSTAT_OPENSSL, old_size);
+	memstat_alloc(MEMSTAT_OPENSSL, sizeof(*mc) + size, mc != NULL);
+	if (!mc)
+		return NULL;
+
 	mc->size = size;
-	return mc->addr;
+	return mc + 1;
 }
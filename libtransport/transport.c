@@ -31,15 +31,44 @@
  */
 
 #include <lib.h>
+#include <timer.h>
+#include <trace.h>
 #include <transport.h>
 
+/* All the registered transports are started at once.  The first
+   one to receive data becomes the session, the others are then
+   stopped.  */
+#define MAX_TRANSPORTS 4
+
 static transport_t *transports;
 static UINTN nb_transport;
 static transport_t *current;
+static BOOLEAN started[MAX_TRANSPORTS];
+
+/* Writes may be queued in the backend, their issue time stamps are
+   kept in order of submission.  Writes beyond TX_TIMED_MAX in flight
+   are counted but not timed.  */
+#define TX_TIMED_MAX 32
+
+static transport_stats_t stats[MAX_TRANSPORTS];
+static struct timing {
+	UINT64 rx_start;
+	UINT64 tx_start[TX_TIMED_MAX];
+	UINTN tx_head;
+	UINTN tx_count;
+} timing[MAX_TRANSPORTS];
+
+static const UINT32 SIZE_CLASS_LIMITS[TRANSPORT_SIZE_CLASSES - 1] = {
+	512, 4 * 1024, 64 * 1024, 1024 * 1024
+};
+
+static start_callback_t start_callback;
+static data_callback_t rx_callback;
+static data_callback_t tx_callback;
 
 EFI_STATUS transport_register(transport_t *trans, UINTN nb)
 {
-	if (!trans || !nb)
+	if (!trans || !nb || nb > MAX_TRANSPORTS)
 		return EFI_INVALID_PARAMETER;
 
 	transports = trans;
@@ -54,44 +83,241 @@ void transport_unregister(void)
 	nb_transport = 0;
 }
 
+static void record_latency(UINTN index, UINT64 start, unsigned len)
+{
+	UINT64 us, limit = 10;
+	UINTN class = 0, bucket = 0;
+
+	if (!start)
+		return;
+
+	while (class < TRANSPORT_SIZE_CLASSES - 1 &&
+	       len >= SIZE_CLASS_LIMITS[class])
+		class++;
+
+	us = timer_ticks_to_us(timer_ticks() - start);
+	while (bucket < TRANSPORT_LATENCY_BUCKETS - 1 && us >= limit) {
+		bucket++;
+		limit *= 10;
+	}
+
+	stats[index].latency[class][bucket]++;
+}
+
+static void rx_completed(UINTN index, unsigned len)
+{
+	trace(TRACE_TRANSPORT_RX, index, len);
+	stats[index].rx_bytes += len;
+	stats[index].rx_transfers++;
+	record_latency(index, timing[index].rx_start, len);
+	timing[index].rx_start = 0;
+}
+
+static void tx_completed(UINTN index, unsigned len)
+{
+	struct timing *t = &timing[index];
+	UINT64 start = 0;
+
+	trace(TRACE_TRANSPORT_TX, index, len);
+	stats[index].tx_bytes += len;
+	stats[index].tx_transfers++;
+	if (t->tx_count) {
+		start = t->tx_start[t->tx_head];
+		t->tx_head = (t->tx_head + 1) % TX_TIMED_MAX;
+		t->tx_count--;
+	}
+	record_latency(index, start, len);
+}
+
+static void count_error(EFI_STATUS ret)
+{
+	UINTN index = current - transports;
+
+	if (ret == EFI_NOT_READY)
+		stats[index].retries++;
+	else if (ret != EFI_UNSUPPORTED)
+		stats[index].errors++;
+}
+
+static EFI_STATUS rx_issued(EFI_STATUS ret)
+{
+	if (EFI_ERROR(ret))
+		count_error(ret);
+	else
+		timing[current - transports].rx_start = timer_ticks();
+
+	return ret;
+}
+
+static EFI_STATUS tx_issued(EFI_STATUS ret)
+{
+	struct timing *t = &timing[current - transports];
+
+	if (EFI_ERROR(ret))
+		count_error(ret);
+	else if (t->tx_count < TX_TIMED_MAX) {
+		t->tx_start[(t->tx_head + t->tx_count) % TX_TIMED_MAX] = timer_ticks();
+		t->tx_count++;
+	}
+
+	return ret;
+}
+
+static void select_session(UINTN index)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	current = &transports[index];
+	log_debug(TRANSPORT, L"%a transport layer selected", current->name);
+
+	for (i = 0; i < nb_transport; i++) {
+		if (i == index || !started[i])
+			continue;
+
+		ret = transports[i].stop();
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to stop %a transport layer",
+				   transports[i].name);
+		started[i] = FALSE;
+	}
+}
+
+/* Until a session is selected, the upper layer requests issued
+   from a callback go to the transport which triggered it.  */
+static void transport_start_cb(UINTN index)
+{
+	transport_t *session = current;
+
+	if (session && session != &transports[index])
+		return;
+
+	current = &transports[index];
+	start_callback();
+	current = session;
+}
+
+static void transport_rx_cb(UINTN index, void *buf, unsigned len)
+{
+	rx_completed(index, len);
+
+	if (!current)
+		select_session(index);
+	else if (current != &transports[index])
+		return;
+
+	rx_callback(buf, len);
+}
+
+static void transport_tx_cb(UINTN index, void *buf, unsigned len)
+{
+	transport_t *session = current;
+
+	tx_completed(index, len);
+
+	if (session && session != &transports[index])
+		return;
+
+	current = &transports[index];
+	tx_callback(buf, len);
+	current = session;
+}
+
+#define TRANSPORT_CALLBACKS(i)						\
+	static void start_cb_##i(void)					\
+	{								\
+		transport_start_cb(i);					\
+	}								\
+	static void rx_cb_##i(void *buf, unsigned len)			\
+	{								\
+		transport_rx_cb(i, buf, len);				\
+	}								\
+	static void tx_cb_##i(void *buf, unsigned len)			\
+	{								\
+		transport_tx_cb(i, buf, len);				\
+	}
+
+TRANSPORT_CALLBACKS(0)
+TRANSPORT_CALLBACKS(1)
+TRANSPORT_CALLBACKS(2)
+TRANSPORT_CALLBACKS(3)
+
+static const struct {
+	start_callback_t start;
+	data_callback_t rx;
+	data_callback_t tx;
+} CALLBACKS[MAX_TRANSPORTS] = {
+	{ start_cb_0, rx_cb_0, tx_cb_0 },
+	{ start_cb_1, rx_cb_1, tx_cb_1 },
+	{ start_cb_2, rx_cb_2, tx_cb_2 },
+	{ start_cb_3, rx_cb_3, tx_cb_3 }
+};
+
 EFI_STATUS transport_start(start_callback_t start_cb,
 			   data_callback_t rx_cb,
 			   data_callback_t tx_cb)
 {
-	EFI_STATUS ret = EFI_NOT_READY;
+	EFI_STATUS ret = EFI_NOT_READY, first_error = EFI_SUCCESS;
+	BOOLEAN any = FALSE;
 	UINTN i;
 
 	if (!start_cb || !rx_cb || !tx_cb)
 		return EFI_INVALID_PARAMETER;
 
+	start_callback = start_cb;
+	rx_callback = rx_cb;
+	tx_callback = tx_cb;
+	current = NULL;
+	ZeroMem(stats, sizeof(stats));
+	ZeroMem(timing, sizeof(timing));
+
 	for (i = 0; i < nb_transport; i++) {
-		current = &transports[i];
-		ret = current->start(start_cb, rx_cb, tx_cb);
-		if (!EFI_ERROR(ret))
-			break;
-		current = NULL;
+		ret = transports[i].start(CALLBACKS[i].start, CALLBACKS[i].rx,
+					  CALLBACKS[i].tx);
+		started[i] = !EFI_ERROR(ret);
+		if (started[i]) {
+			log_debug(TRANSPORT, L"%a transport layer started", transports[i].name);
+			any = TRUE;
+			continue;
+		}
 
 		if (ret == EFI_UNSUPPORTED) {
-			debug(L"%a transport layer is not supported, skipping",
+			log_debug(TRANSPORT, L"%a transport layer is not supported, skipping",
 			      transports[i].name);
 			continue;
 		}
+		/* No network configuration, the other ones are served */
+		if (ret == EFI_TIMEOUT) {
+			log_debug(TRANSPORT, L"%a transport layer is not available, skipping",
+				  transports[i].name);
+			continue;
+		}
 		efi_perror(ret, L"Failed to initialize %a transport layer",
 			   transports[i].name);
-		break;
+		if (!EFI_ERROR(first_error))
+			first_error = ret;
 	}
 
-	if (current)
-		debug(L"%a transport layer selected", current->name);
+	if (any)
+		return EFI_SUCCESS;
 
-	return ret;
+	return EFI_ERROR(first_error) ? first_error : ret;
 }
 
 EFI_STATUS transport_stop(void)
 {
-	EFI_STATUS ret;
+	EFI_STATUS ret = EFI_NOT_STARTED, stop_ret;
+	UINTN i;
+
+	for (i = 0; i < nb_transport; i++) {
+		if (!started[i])
+			continue;
 
-	ret = current ? current->stop() : EFI_NOT_STARTED;
+		stop_ret = transports[i].stop();
+		if (ret == EFI_NOT_STARTED || EFI_ERROR(stop_ret))
+			ret = stop_ret;
+		started[i] = FALSE;
+	}
 	current = NULL;
 
 	return ret;
@@ -99,15 +325,136 @@ EFI_STATUS transport_stop(void)
 
 EFI_STATUS transport_run(void)
 {
-	return current ? current->run() : EFI_NOT_STARTED;
+	EFI_STATUS ret = EFI_NOT_STARTED, run_ret;
+	UINTN i;
+
+	if (current)
+		return current->run();
+
+	for (i = 0; i < nb_transport; i++) {
+		if (!started[i])
+			continue;
+
+		run_ret = transports[i].run();
+		if (ret == EFI_NOT_STARTED || (EFI_ERROR(run_ret) && run_ret != EFI_TIMEOUT))
+			ret = run_ret;
+
+		/* Data received, the session has been selected */
+		if (current)
+			break;
+	}
+
+	return ret;
+}
+
+static BOOLEAN add_event(transport_t *trans, EFI_EVENT *events,
+			 UINTN max, UINTN *count)
+{
+	EFI_EVENT event;
+
+	if (!trans->event || *count == max)
+		return FALSE;
+
+	event = trans->event();
+	if (!event)
+		return FALSE;
+
+	events[(*count)++] = event;
+	return TRUE;
+}
+
+UINTN transport_events(EFI_EVENT *events, UINTN max)
+{
+	UINTN i, count = 0;
+
+	if (!events)
+		return 0;
+
+	if (current)
+		return add_event(current, events, max, &count) ? count : 0;
+
+	for (i = 0; i < nb_transport; i++) {
+		if (started[i] && !add_event(&transports[i], events, max, &count))
+			return 0;
+	}
+
+	return count;
 }
 
 EFI_STATUS transport_read(void *buf, UINT32 size)
 {
-	return current ? current->read(buf, size) : EFI_NOT_STARTED;
+	return current ? rx_issued(current->read(buf, size)) : EFI_NOT_STARTED;
 }
 
 EFI_STATUS transport_write(void *buf, UINT32 size)
 {
-	return current ? current->write(buf, size) : EFI_NOT_STARTED;
+	return current ? tx_issued(current->write(buf, size)) : EFI_NOT_STARTED;
+}
+
+EFI_STATUS transport_writev(transport_fragment_t *frags, UINTN count)
+{
+	if (!current)
+		return EFI_NOT_STARTED;
+
+	if (!current->writev)
+		return EFI_UNSUPPORTED;
+
+	return tx_issued(current->writev(frags, count));
+}
+
+EFI_STATUS transport_readv_some(transport_fragment_t *frags, UINTN count)
+{
+	if (!current)
+		return EFI_NOT_STARTED;
+
+	if (!current->readv_some)
+		return EFI_UNSUPPORTED;
+
+	return rx_issued(current->readv_some(frags, count));
+}
+
+UINT32 transport_read_granularity(void)
+{
+	if (!current || !current->read_granularity)
+		return 1;
+
+	return current->read_granularity();
+}
+
+UINTN transport_write_depth(void)
+{
+	if (!current || !current->write_depth)
+		return 1;
+
+	return current->write_depth();
+}
+
+EFI_STATUS transport_get_stats(UINTN index, const char **name,
+			       transport_stats_t *result)
+{
+	const transport_counters_t *counters;
+
+	if (!result)
+		return EFI_INVALID_PARAMETER;
+
+	if (index == TRANSPORT_CURRENT) {
+		if (!current)
+			return EFI_NOT_STARTED;
+		index = current - transports;
+	}
+
+	if (index >= nb_transport)
+		return EFI_NOT_FOUND;
+
+	*result = stats[index];
+	if (transports[index].counters) {
+		counters = transports[index].counters();
+		result->errors += counters->errors;
+		result->rearms += counters->rearms;
+	}
+
+	if (name)
+		*name = transports[index].name;
+
+	return EFI_SUCCESS;
 }
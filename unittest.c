@@ -35,12 +35,26 @@
 #include <efiapi.h>
 #include <efilib.h>
 
+#include <openssl/sha.h>
+
 #include "ux.h"
 #include "ui.h"
 #include "lib.h"
 #include "unittest.h"
 #include "blobstore.h"
 #include "watchdog.h"
+#include "timer.h"
+#include "crc32.h"
+#include "gpt.h"
+#include "text_parser.h"
+#include "sparse_format.h"
+#ifndef USERFASTBOOT
+#include "flash.h"
+#include "sparse.h"
+#include "fastboot.h"
+#include "uefi_utils.h"
+#include "fastboot_loopback.h"
+#endif
 
 /*
  * This is the hardware second timeout value
@@ -104,13 +118,389 @@ static VOID test_ux(VOID)
         ux_display_low_battery(3);
 }
 
+/* Benchmarks of the hot kernels, reported in time stamp counter
+ * cycles per byte so that they can be compared across platforms.  */
+#define BENCH_SIZE		(16 * 1024 * 1024)
+#define BENCH_BLOCK_SIZE	512
+#define BENCH_LOOKUPS		1000
+
+static VOID bench_report(CHAR16 *name, UINT64 start, UINT64 bytes)
+{
+        UINT64 cycles = timer_ticks() - start;
+        UINT64 centi = cycles * 100 / bytes;
+
+        Print(L"%s: %ld.%02ld cycles/byte, %ld us\n", name, centi / 100,
+              centi % 100, timer_ticks_to_us(cycles));
+}
+
+static VOID bench_memory(unsigned char *src, unsigned char *dst)
+{
+        UINT64 start;
+
+        start = timer_ticks();
+        memset(dst, 0x5a, BENCH_SIZE);
+        bench_report(L"memset", start, BENCH_SIZE);
+
+        start = timer_ticks();
+        memcpy(dst, src, BENCH_SIZE);
+        bench_report(L"memcpy", start, BENCH_SIZE);
+}
+
+static VOID bench_digests(unsigned char *data)
+{
+        unsigned char md[SHA512_DIGEST_LENGTH];
+        volatile UINT32 crc;
+        UINT64 start;
+
+        start = timer_ticks();
+        crc = crc32_update(0, data, BENCH_SIZE);
+        bench_report(L"crc32", start, BENCH_SIZE);
+        (void)crc;
+
+        start = timer_ticks();
+        SHA1(data, BENCH_SIZE, md);
+        bench_report(L"sha1", start, BENCH_SIZE);
+
+        start = timer_ticks();
+        SHA256(data, BENCH_SIZE, md);
+        bench_report(L"sha256", start, BENCH_SIZE);
+
+        start = timer_ticks();
+        SHA512(data, BENCH_SIZE, md);
+        bench_report(L"sha512", start, BENCH_SIZE);
+}
+
+static EFI_STATUS bench_count_line(__attribute__((__unused__)) char *line,
+                                   VOID *ctx)
+{
+        (*(UINTN *)ctx)++;
+        return EFI_SUCCESS;
+}
+
+static VOID bench_text_parser(unsigned char *buf)
+{
+        static const char LINE[] = "ANDROID_KEY=some value to tokenize\n";
+        UINTN i, size, lines = 0;
+        EFI_STATUS ret;
+        UINT64 start;
+
+        size = BENCH_SIZE / (sizeof(LINE) - 1) * (sizeof(LINE) - 1);
+        for (i = 0; i < size; i += sizeof(LINE) - 1)
+                memcpy(buf + i, LINE, sizeof(LINE) - 1);
+
+        start = timer_ticks();
+        ret = parse_text_buffer(buf, size, bench_count_line, &lines);
+        bench_report(L"parse_text_buffer", start, size);
+        if (EFI_ERROR(ret))
+                Print(L"parse_text_buffer failed, %r\n", ret);
+}
+
+static VOID bench_scale(unsigned char *src, unsigned char *dst)
+{
+        const int depth = sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL);
+        UINT64 start;
+
+        start = timer_ticks();
+        ui_bilinear_scale(src, dst, 1024, 768, 1920, 1080, depth);
+        bench_report(L"ui_bilinear_scale", start, 1920 * 1080 * depth);
+}
+
+static VOID bench_textarea(VOID)
+{
+        ui_textarea_t *textarea;
+        UINTN i, width, height;
+        EFI_STATUS ret;
+        UINT64 start;
+
+        ret = ui_init(&width, &height);
+        if (EFI_ERROR(ret)) {
+                Print(L"No graphics, textarea benchmark skipped\n");
+                return;
+        }
+
+        textarea = ui_textarea_create(40, 80, ui_font_get_default(),
+                                      &COLOR_WHITE, &COLOR_BLACK);
+        if (!textarea) {
+                Print(L"Failed to create the textarea\n");
+                return;
+        }
+
+        for (i = 0; i < textarea->line_nb; i++)
+                ui_textarea_set_line(textarea, i, "The quick brown fox jumps over the lazy dog",
+                                     &COLOR_WHITE, i % 2);
+
+        start = timer_ticks();
+        ret = ui_textarea_draw(textarea, 0, 0);
+        bench_report(L"ui_textarea_draw", start,
+                     ui_get_blt_size(textarea->width, textarea->height));
+        if (EFI_ERROR(ret))
+                Print(L"ui_textarea_draw failed, %r\n", ret);
+
+        ui_textarea_free(textarea);
+}
+
+static VOID bench_gpt(VOID)
+{
+        struct gpt_partition_interface gparti;
+        EFI_STATUS ret = EFI_SUCCESS;
+        UINT64 start, cycles;
+        UINTN i;
+
+        start = timer_ticks();
+        for (i = 0; i < BENCH_LOOKUPS && !EFI_ERROR(ret); i++)
+                ret = gpt_get_partition_by_label(L"data", &gparti,
+                                                 LOGICAL_UNIT_USER);
+        cycles = timer_ticks() - start;
+        if (EFI_ERROR(ret)) {
+                Print(L"gpt_get_partition_by_label failed, %r\n", ret);
+                return;
+        }
+        Print(L"gpt_get_partition_by_label: %ld cycles/lookup\n",
+              cycles / BENCH_LOOKUPS);
+}
+
+#ifndef USERFASTBOOT
+/* RAM disk the flash functions write to */
+static unsigned char *ram_disk;
+
+static EFI_BLOCK_IO_MEDIA ram_disk_media = {
+        .MediaPresent = TRUE,
+        .BlockSize = BENCH_BLOCK_SIZE,
+        .LastBlock = BENCH_SIZE / BENCH_BLOCK_SIZE - 1
+};
+
+static EFI_STATUS EFIAPI ram_disk_read_blocks(__attribute__((__unused__)) EFI_BLOCK_IO *bio,
+                                              __attribute__((__unused__)) UINT32 media_id,
+                                              EFI_LBA lba, UINTN size, VOID *data)
+{
+        memcpy(data, ram_disk + lba * BENCH_BLOCK_SIZE, size);
+        return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI ram_disk_write_blocks(__attribute__((__unused__)) EFI_BLOCK_IO *bio,
+                                               __attribute__((__unused__)) UINT32 media_id,
+                                               EFI_LBA lba, UINTN size, VOID *data)
+{
+        memcpy(ram_disk + lba * BENCH_BLOCK_SIZE, data, size);
+        return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI ram_disk_read(__attribute__((__unused__)) EFI_DISK_IO *dio,
+                                       __attribute__((__unused__)) UINT32 media_id,
+                                       UINT64 offset, UINTN size, VOID *data)
+{
+        memcpy(data, ram_disk + offset, size);
+        return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI ram_disk_write(__attribute__((__unused__)) EFI_DISK_IO *dio,
+                                        __attribute__((__unused__)) UINT32 media_id,
+                                        UINT64 offset, UINTN size, VOID *data)
+{
+        memcpy(ram_disk + offset, data, size);
+        return EFI_SUCCESS;
+}
+
+static EFI_BLOCK_IO ram_disk_bio = {
+        .Media = &ram_disk_media,
+        .ReadBlocks = ram_disk_read_blocks,
+        .WriteBlocks = ram_disk_write_blocks
+};
+
+static EFI_DISK_IO ram_disk_dio = {
+        .ReadDisk = ram_disk_read,
+        .WriteDisk = ram_disk_write
+};
+
+static VOID ram_disk_target(VOID)
+{
+        struct gpt_partition_interface target;
+
+        ZeroMem(&target, sizeof(target));
+        target.part.starting_lba = 0;
+        target.part.ending_lba = ram_disk_media.LastBlock;
+        target.bio = &ram_disk_bio;
+        target.dio = &ram_disk_dio;
+        flash_set_target(&target);
+}
+
+/* Sparse image covering the RAM disk with 1 MiB RAW, FILL and
+   DONT_CARE chunks, in a row.  */
+static UINTN build_sparse_image(unsigned char *buf, unsigned char *data)
+{
+        const UINT32 blk_sz = 4096, chunk_blks = 1024 * 1024 / 4096;
+        sparse_header_t *sph = (sparse_header_t *)buf;
+        chunk_header_t *ckh;
+        unsigned char *cur = buf + sizeof(*sph);
+        UINTN i, chunks = BENCH_SIZE / (chunk_blks * blk_sz);
+
+        sph->magic = SPARSE_HEADER_MAGIC;
+        sph->major_version = 1;
+        sph->minor_version = 0;
+        sph->file_hdr_sz = sizeof(*sph);
+        sph->chunk_hdr_sz = sizeof(*ckh);
+        sph->blk_sz = blk_sz;
+        sph->total_blks = chunks * chunk_blks;
+        sph->total_chunks = chunks;
+        sph->image_checksum = 0;
+
+        for (i = 0; i < chunks; i++) {
+                ckh = (chunk_header_t *)cur;
+                ckh->reserved1 = 0;
+                ckh->chunk_sz = chunk_blks;
+                cur += sizeof(*ckh);
+                switch (i % 3) {
+                case 0:
+                        ckh->chunk_type = CHUNK_TYPE_RAW;
+                        memcpy(cur, data + i * chunk_blks * blk_sz,
+                               chunk_blks * blk_sz);
+                        cur += chunk_blks * blk_sz;
+                        break;
+                case 1:
+                        ckh->chunk_type = CHUNK_TYPE_FILL;
+                        *(UINT32 *)cur = 0xdeadbeef;
+                        cur += sizeof(UINT32);
+                        break;
+                default:
+                        ckh->chunk_type = CHUNK_TYPE_DONT_CARE;
+                }
+                ckh->total_sz = cur - (unsigned char *)ckh;
+        }
+
+        return cur - buf;
+}
+
+static VOID bench_flash(unsigned char *data)
+{
+        unsigned char *image;
+        EFI_STATUS ret;
+        UINT64 start;
+        UINTN size;
+
+        ram_disk = AllocatePool(BENCH_SIZE);
+        image = AllocatePool(BENCH_SIZE + BENCH_SIZE / 8);
+        if (!ram_disk || !image) {
+                Print(L"Failed to allocate the RAM disk\n");
+                goto out;
+        }
+
+        ram_disk_target();
+        start = timer_ticks();
+        ret = flash_fill(0xdeadbeef, BENCH_SIZE);
+        bench_report(L"flash_fill", start, BENCH_SIZE);
+        if (EFI_ERROR(ret))
+                Print(L"flash_fill failed, %r\n", ret);
+
+        size = build_sparse_image(image, data);
+        ram_disk_target();
+        start = timer_ticks();
+        ret = flash_sparse(image, size);
+        bench_report(L"flash_sparse", start, BENCH_SIZE);
+        if (EFI_ERROR(ret))
+                Print(L"flash_sparse failed, %r\n", ret);
+
+out:
+        flash_set_target(NULL);
+        if (image)
+                FreePool(image);
+        if (ram_disk)
+                FreePool(ram_disk);
+        ram_disk = NULL;
+}
+#endif
+
+static VOID test_bench(VOID)
+{
+        unsigned char *src, *dst;
+        UINTN i;
+
+        src = AllocatePool(BENCH_SIZE);
+        dst = AllocatePool(BENCH_SIZE);
+        if (!src || !dst) {
+                Print(L"Failed to allocate the benchmark buffers\n");
+                goto out;
+        }
+
+        for (i = 0; i < BENCH_SIZE; i++)
+                src[i] = i * 7 + (i >> 12);
+
+        bench_memory(src, dst);
+        bench_digests(src);
+        bench_text_parser(dst);
+        bench_scale(src, dst);
+        bench_textarea();
+        bench_gpt();
+#ifndef USERFASTBOOT
+        bench_flash(src);
+#endif
+
+out:
+        if (src)
+                FreePool(src);
+        if (dst)
+                FreePool(dst);
+}
+
+#ifndef USERFASTBOOT
+#define LOOPBACK_SESSION L"\\loopback.session"
+
+/* Replay a recorded fastboot session at full speed, see the
+   "Loopback sessions" section of doc/fastboot.md.  */
+static VOID test_loopback(VOID)
+{
+        EFI_STATUS ret;
+        EFI_FILE_IO_INTERFACE *io;
+        void *session, *bootimage, *efiimage;
+        UINTN size, imagesize;
+        enum boot_target target;
+        loopback_result_t res;
+        UINT64 mbps;
+
+        ret = get_esp_fs(&io);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to get the ESP file system");
+                return;
+        }
+
+        ret = uefi_read_file(io, LOOPBACK_SESSION, &session, &size);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to read %s", LOOPBACK_SESSION);
+                return;
+        }
+
+        ret = fastboot_loopback_set_session(session, size);
+        if (EFI_ERROR(ret))
+                goto out;
+
+        ret = fastboot_start(&bootimage, &efiimage, &imagesize, &target);
+        fastboot_loopback_get_result(&res);
+        fastboot_loopback_clear_session();
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Fastboot session failed");
+                goto out;
+        }
+
+        mbps = res.us ? res.rx_bytes / res.us : 0;
+        Print(L"loopback: %ld bytes in %ld us (%ld MB/s), %d mismatch(es)%s\n",
+              res.rx_bytes, res.us, mbps, res.mismatches,
+              res.complete ? L"" : L", session incomplete");
+
+out:
+        FreePool(session);
+}
+#endif
+
 static struct test_suite {
         CHAR16 *name;
         VOID (*fun)(VOID);
 } TEST_SUITES[] = {
         { L"ux", test_ux },
         { L"keys", test_keys },
-        { L"watchdog", test_watchdog }
+        { L"watchdog", test_watchdog },
+        { L"bench", test_bench },
+#ifndef USERFASTBOOT
+        { L"loopback", test_loopback }
+#endif
 };
 
 VOID unittest_main(CHAR16 *testname)
@@ -502,6 +502,34 @@ error:
 }
 
 
+/* The CPU idles on a timer event rather than spinning in Stall()
+   while the battery image is displayed.  */
+static VOID idle_pause(UINTN seconds)
+{
+	EFI_EVENT timer;
+	EFI_STATUS ret;
+	UINTN index;
+
+	if (!seconds)
+		return;
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0, NULL, NULL,
+				&timer);
+	if (EFI_ERROR(ret))
+		goto fallback;
+
+	ret = uefi_call_wrapper(BS->SetTimer, 3, timer, TimerRelative,
+				(UINT64)seconds * 10000000);
+	if (!EFI_ERROR(ret))
+		ret = uefi_call_wrapper(BS->WaitForEvent, 3, 1, &timer, &index);
+	uefi_call_wrapper(BS->CloseEvent, 1, timer);
+	if (!EFI_ERROR(ret))
+		return;
+
+fallback:
+	pause(seconds);
+}
+
 VOID ux_display_img_battery(const char *battery_img_name, UINTN delay) {
 	ui_image_t *battery;
 	EFI_STATUS ret;
@@ -524,7 +552,8 @@ VOID ux_display_img_battery(const char *battery_img_name, UINTN delay) {
 	if (EFI_ERROR(ret))
 		return;
 
-	pause(delay);
+	ui_flush();
+	idle_pause(delay);
 }
 
 VOID ux_display_low_battery(UINTN delay) {